@@ -5,3 +5,5 @@ set -x
 cd `pwd`/libs/examples
 bjam
 
+cd ../test
+bjam
@@ -0,0 +1,589 @@
+/*
+ * bench.cpp
+ *
+ *  Created on: Sep 6, 2013
+ *      Author: vincent
+ */
+
+/*    Copyright 2011 ~ 2013 Vincent Zhang, ivincent.zhang@gmail.com
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+/*
+ * The micro benchmarks of the RPC path, from the encoding of a call to a round trip over the loopback,
+ * try : bench --benchmark_format=json --benchmark_out=rpc.json
+ *
+ * The BM_rf_wrapper cases compare the archives, fast, boost binary and text, and the one of the transaction log,
+ * on the argument shapes of the sample service, the label tells the bytes on the wire and the allocations of a call,
+ * try : bench --benchmark_filter=BM_rf_wrapper_encode/
+ *
+ * The BM_allocations cases count the allocations per call of the decode, dispatch and respond path,
+ * and fail once a call allocates more than the bound, the bench exits with 1 if any case fails,
+ * so it's a check of the zero copy and the pooling, try : bench --benchmark_filter=BM_allocations
+ * */
+
+#include "config.h"
+
+// the global operator new counts the allocations of every thread, see benchmark.h
+#define PIONEER_BENCH_COUNT_ALLOCATIONS
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <numeric>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <boost/archive/binary_iarchive.hpp>
+#include <boost/archive/binary_oarchive.hpp>
+#include <boost/archive/text_iarchive.hpp>
+#include <boost/archive/text_oarchive.hpp>
+#include <boost/program_options.hpp>
+
+#include <muduo/base/CountDownLatch.h>
+#include <muduo/net/EventLoop.h>
+
+#include <atlas/transaction/archive.hpp>
+
+#include <pioneer/net/net.h>
+#include <pioneer/net/net_pools.h>
+#include <pioneer/net/net_handlers.h>
+#include <pioneer/net/request.h>
+#include <pioneer/net/rpc_clients.h>
+
+#include "benchmark.h"
+#include "inward_client.h"
+#include "service/rfc_func.h"
+#include "service/rfc_func.server.ipp"
+
+namespace po = boost::program_options;
+
+using muduo::net::EventLoop;
+using muduo::net::InetAddress;
+using pioneer::net::connection_handler;
+using pioneer::net::message_handler;
+using pioneer::net::inward_tag;
+
+using namespace pioneer;
+using namespace pioneer::rpc;
+
+namespace {
+
+  std::vector<int> make_numbers(size_t n) {
+    std::vector<int> numbers(n);
+    std::iota(numbers.begin(), numbers.end(), 0);
+
+    return numbers;
+  }
+
+  std::string encode_accumulate(const std::vector<int>& numbers) {
+    atlas::rpc::message_builder builder(rpc::inward_client);
+    return builder.build(rpc_func::accumulate, fn_ids::accumulate, numbers, nilctx);
+  }
+
+  void bm_message_builder(bench::state& state, size_t n) {
+    std::vector<int> numbers = make_numbers(n);
+    atlas::rpc::message_builder builder(rpc::inward_client);
+    uint64_t bytes = 0;
+
+    while (state.keep_running()) {
+      std::string message = builder.build(rpc_func::accumulate, fn_ids::accumulate, numbers, nilctx);
+      bytes += message.size();
+      bench::do_not_optimize(message);
+    }
+
+    state.set_bytes_processed(bytes);
+  }
+
+  /*
+   * The argument shapes of the sample service, see rfc_func.h, scaled by n : the numbers of accumulate,
+   * the string of announce_inner_node, and the ints of run_bench, which are never scaled. They are encoded
+   * as a call is, see fn_encoder, and decoded into a rf_wrapper
+   * */
+  struct numbers_shape {
+    typedef atlas::rpc::rf_wrapper<rpc_result(const std::vector<int>&, rpc_context)> wrapper;
+
+    numbers_shape(size_t n) : numbers(make_numbers(n)) {}
+
+    template<typename OArchive>
+    void encode(OArchive& oa) const { atlas::rpc::fn_encoder<decltype(rpc_func::accumulate)>::encode(oa, numbers, nilctx); }
+
+    template<typename IArchive>
+    void decode(IArchive& ia) const {
+      wrapper w(rpc_func::accumulate, ia, nilctx);
+      bench::do_not_optimize(w);
+    }
+
+    std::vector<int> numbers;
+  };
+
+  struct string_shape {
+    typedef atlas::rpc::rf_wrapper<rpc_result(const string&, rpc_context)> wrapper;
+
+    string_shape(size_t n) : ip(n, '1') {}
+
+    template<typename OArchive>
+    void encode(OArchive& oa) const { atlas::rpc::fn_encoder<decltype(rpc_func::announce_inner_node)>::encode(oa, ip, nilctx); }
+
+    template<typename IArchive>
+    void decode(IArchive& ia) const {
+      wrapper w(rpc_func::announce_inner_node, ia, nilctx);
+      bench::do_not_optimize(w);
+    }
+
+    std::string ip;
+  };
+
+  // run_bench is served by the cluster bench, which is not linked here, the wrapper takes the signature only
+  rpc_result run_plan(int run, int duration_ms, int concurrency, int size, rpc_context c) noexcept {
+    return nullptr;
+  }
+
+  struct ints_shape {
+    typedef atlas::rpc::rf_wrapper<rpc_result(int, int, int, int, rpc_context)> wrapper;
+
+    ints_shape(size_t) {}
+
+    template<typename OArchive>
+    void encode(OArchive& oa) const { atlas::rpc::fn_encoder<decltype(run_plan)>::encode(oa, 1, 10000, 8, 64, nilctx); }
+
+    template<typename IArchive>
+    void decode(IArchive& ia) const {
+      wrapper w(run_plan, ia, nilctx);
+      bench::do_not_optimize(w);
+    }
+  };
+
+  // the text archive is the one of ATLAS_DEBUG_RPC, without the header, the header is never sent
+  template<typename OArchive, typename IArchive, unsigned int Flags = 0>
+  struct stream_archives {
+    template<typename Shape>
+    static void encode(const Shape& shape, std::string& buffer) {
+      // the memory streams are stream buffers as well, which the boost archives take too
+      atlas::io::oappendstream os(buffer);
+      OArchive oa(static_cast<std::ostream&>(os), Flags);
+      shape.encode(oa);
+    }
+
+    template<typename Shape>
+    static void decode(const Shape& shape, const std::string& buffer) {
+      atlas::io::imemstream is(buffer.data(), buffer.size());
+      IArchive ia(static_cast<std::istream&>(is), Flags);
+      shape.decode(ia);
+    }
+  };
+
+  typedef stream_archives<atlas::serialization::fast_oarchive, atlas::serialization::fast_iarchive> fast_archives;
+  typedef stream_archives<boost::archive::binary_oarchive, boost::archive::binary_iarchive,
+      boost::archive::no_header> binary_archives;
+  typedef stream_archives<boost::archive::text_oarchive, boost::archive::text_iarchive,
+      boost::archive::no_header> text_archives;
+
+  // the archives of the transaction log, the classes are saved by boost.serialization through serialization_oarchive
+  struct transact_archives {
+    template<typename Shape>
+    static void encode(const Shape& shape, std::string& buffer) {
+      boost::transact::char_oarchive<std::back_insert_iterator<std::string>> oa(std::back_inserter(buffer));
+      shape.encode(oa);
+    }
+
+    template<typename Shape>
+    static void decode(const Shape& shape, const std::string& buffer) {
+      boost::transact::char_iarchive<const char*> ia(buffer.data(), buffer.data() + buffer.size());
+      shape.decode(ia);
+    }
+  };
+
+  // the bytes on the wire of a call and the allocations per call
+  void label_call(bench::state& state, size_t bytes, uint64_t allocations) {
+    char label[64];
+    std::snprintf(label, sizeof(label), "%zu bytes, %.2f allocations", bytes,
+        state.iterations() ? static_cast<double>(allocations) / state.iterations() : 0);
+    state.set_label(label);
+  }
+
+  template<typename Archives, typename Shape>
+  void bm_encode(bench::state& state, size_t n) {
+    Shape shape(n);
+    std::string buffer;
+    uint64_t bytes = 0;
+
+    // the buffer keeps it's capacity, as the connection's does
+    Archives::encode(shape, buffer);
+    uint64_t allocations = bench::thread_allocations();
+
+    while (state.keep_running()) {
+      buffer.clear();
+      Archives::encode(shape, buffer);
+
+      bytes += buffer.size();
+      bench::do_not_optimize(buffer);
+    }
+
+    label_call(state, buffer.size(), bench::thread_allocations() - allocations);
+    state.set_bytes_processed(bytes);
+  }
+
+  template<typename Archives, typename Shape>
+  void bm_decode(bench::state& state, size_t n) {
+    Shape shape(n);
+    std::string buffer;
+    Archives::encode(shape, buffer);
+
+    uint64_t allocations = bench::thread_allocations();
+
+    while (state.keep_running()) {
+      Archives::decode(shape, buffer);
+    }
+
+    label_call(state, buffer.size(), bench::thread_allocations() - allocations);
+    state.set_bytes_processed(buffer.size() * state.iterations());
+  }
+
+  // every archive of every shape, the ints are not scaled
+  template<typename Archives>
+  void add_archive(bench::runner& runner, const std::string& archive, const std::vector<size_t>& sizes) {
+    for (size_t n : sizes) {
+      std::string arg = "/" + std::to_string(n);
+
+      runner.add("BM_rf_wrapper_encode/" + archive + "/numbers" + arg, [n](bench::state& s) {
+        bm_encode<Archives, numbers_shape>(s, n);
+      });
+      runner.add("BM_rf_wrapper_decode/" + archive + "/numbers" + arg, [n](bench::state& s) {
+        bm_decode<Archives, numbers_shape>(s, n);
+      });
+      runner.add("BM_rf_wrapper_encode/" + archive + "/string" + arg, [n](bench::state& s) {
+        bm_encode<Archives, string_shape>(s, n);
+      });
+      runner.add("BM_rf_wrapper_decode/" + archive + "/string" + arg, [n](bench::state& s) {
+        bm_decode<Archives, string_shape>(s, n);
+      });
+    }
+
+    runner.add("BM_rf_wrapper_encode/" + archive + "/ints", [](bench::state& s) { bm_encode<Archives, ints_shape>(s, 0); });
+    runner.add("BM_rf_wrapper_decode/" + archive + "/ints", [](bench::state& s) { bm_decode<Archives, ints_shape>(s, 0); });
+  }
+
+  // the function is looked up, the arguments are decoded and the function runs, the response is not sent
+  void bm_dispatch(bench::state& state, size_t n) {
+    std::string frame = encode_accumulate(make_numbers(n));
+    atlas::rpc::message msg(frame);
+
+    while (state.keep_running()) {
+      rpc_result result = atlas::rpc::dispatcher_manager::ref().dispatch(msg, nilctx);
+      bench::do_not_optimize(result);
+    }
+
+    state.set_bytes_processed(frame.size() * state.iterations());
+  }
+
+  // the session ids are unique without the random generator, which is measured by the message builder
+  void bm_suspend_resume(bench::state& state) {
+    auto& manager = atlas::rpc::async_task_manager::ref();
+    uint64_t calls = 0;
+    uint64_t seq = 0;
+
+    auto cb = [&calls](const std::string&, int, atlas::rpc::async_task&) { ++calls; };
+
+    while (state.keep_running()) {
+      atlas::rpc::uuid id;
+      ++seq;
+      std::memset(id.data, 0, sizeof(id.data));
+      std::memcpy(id.data, &seq, sizeof(seq));
+
+      manager.suspend(id, cb, 1, std::chrono::milliseconds(1000));
+      manager.resume(id, "45", 0);
+    }
+
+    // drop the deadlines of the completed sessions
+    manager.sweep();
+
+    if (calls != state.iterations()) state.skip_with_error("callbacks lost");
+  }
+
+  /*
+   * The bounds of the allocations per call, they are the counts of the path as it is, lower one once an allocation
+   * is removed, and raise one only with the reason of the new allocation
+   * */
+  const uint64_t build_request_allocations = 1;
+  const uint64_t execute_allocations = 6;
+  const uint64_t respond_allocations = 6;
+
+  // the calls made before the loop, so the pools and the tables are filled before counting
+  const int allocation_warm_up_calls = 64;
+
+  void check_allocations(bench::state& state, uint64_t allocations, uint64_t bound) {
+    double per_call = state.iterations() ? static_cast<double>(allocations) / state.iterations() : 0;
+
+    char label[64];
+    std::snprintf(label, sizeof(label), "%.2f allocations per call", per_call);
+    state.set_label(label);
+
+    if (per_call > bound) state.skip_with_error(std::string(label) + ", the bound is " + std::to_string(bound));
+  }
+
+  // a request frame of an existing session, as the inward server reads it
+  struct request_frame {
+    request_frame(size_t n) : frame(std::make_shared<const std::string>(encode_accumulate(make_numbers(n)))),
+      holder(frame) {}
+
+    std::shared_ptr<const std::string> frame;
+    atlas::rpc::message::holder_type holder;
+  };
+
+  const atlas::rpc::endpoint_id allocation_source = atlas::rpc::parse_endpoint("127.0.0.1:9000");
+
+  // the session is removed as the worker does once the request is executed
+  void bm_allocations_build_request(bench::state& state, size_t n) {
+    request_frame f(n);
+    const std::string* frame = f.frame.get();
+    auto& manager = net::session_manager::ref();
+    const atlas::rpc::uuid& session_id = atlas::rpc::message::get_session_id(frame->data());
+
+    for (int i = 0; i < allocation_warm_up_calls; ++i) {
+      manager.build_request(allocation_source, f.holder, frame->data(), frame->size());
+      manager.remove(session_id);
+    }
+
+    uint64_t allocations = bench::thread_allocations();
+
+    while (state.keep_running()) {
+      net::request_ptr request = manager.build_request(allocation_source, f.holder, frame->data(), frame->size());
+      bench::do_not_optimize(request);
+      manager.remove(session_id);
+    }
+
+    check_allocations(state, bench::thread_allocations() - allocations, build_request_allocations);
+  }
+
+  // the call expects no response, so the respond path is left to bm_allocations_respond
+  void bm_allocations_execute(bench::state& state, size_t n) {
+    request_frame f(n);
+    const std::string* frame = f.frame.get();
+    auto& manager = net::session_manager::ref();
+
+    for (int i = 0; i < allocation_warm_up_calls; ++i) {
+      manager.build_request(allocation_source, f.holder, frame->data(), frame->size())->execute();
+    }
+
+    uint64_t allocations = bench::thread_allocations();
+
+    while (state.keep_running()) {
+      manager.build_request(allocation_source, f.holder, frame->data(), frame->size())->execute();
+    }
+
+    check_allocations(state, bench::thread_allocations() - allocations, execute_allocations);
+  }
+
+  // the response frame is built and dropped, it's the socket's to send it
+  class null_caller : public atlas::rpc::remote_caller {
+  public:
+
+    null_caller() : atlas::rpc::remote_caller(rpc::inward_client) {}
+
+  protected:
+
+    virtual void send(const char* message, size_t size) { bench::do_not_optimize(message); }
+  };
+
+  void bm_allocations_respond(bench::state& state) {
+    null_caller caller;
+    rpc_context context(rpc::inward_client, atlas::rpc::rpc_async_callback, atlas::rpc::uuid(), allocation_source);
+    rpc_result result("45");
+
+    for (int i = 0; i < allocation_warm_up_calls; ++i) atlas::rpc::dispatcher_manager::ref().respond(caller, context, result);
+
+    uint64_t allocations = bench::thread_allocations();
+
+    while (state.keep_running()) {
+      atlas::rpc::dispatcher_manager::ref().respond(caller, context, result);
+    }
+
+    check_allocations(state, bench::thread_allocations() - allocations, respond_allocations);
+  }
+
+  /*
+   * A round trip over the loopback, through the inward server and the inward client pool in this process,
+   * as a node calls another, the calling thread waits for every response
+   * */
+  class loopback {
+  public:
+
+    loopback(int port, int io_threads) : _port(port), _io_threads(io_threads), _server_ready(1) {}
+
+  public:
+
+    void start() {
+      system::init_worker_pool(2);
+      net::init_peer_stats();
+
+      _server.reset(new std::thread([this]() { serve(); }));
+      _server_ready.wait();
+
+      _client.start(_port, _io_threads, 1);
+      _client.connect("127.0.0.1");
+    }
+
+    void stop() {
+      _client.stop();
+
+      if (_server_loop) _server_loop->quit();
+      if (_server) _server->join();
+      _server.reset();
+      _server_loop.reset();
+
+      system::worker_pool::ref().wait();
+    }
+
+    std::string target() const { return "127.0.0.1:" + std::to_string(_port); }
+
+  private:
+
+    void serve() {
+      system::set_thread_name("inward server");
+
+      _server_loop.reset(new EventLoop);
+      net::inward_server server(_server_loop.get(), InetAddress(_port), "inward server");
+      server.setThreadNum(_io_threads);
+      server.setConnectionCallback(boost::bind(connection_handler::on_inward_server_connection, _1));
+      server.setMessageCallback(boost::bind(message_handler::on_inward_server_message, _1, _2, _3));
+      server.setWriteCompleteCallback(boost::bind(connection_handler::on_write_complete<inward_tag>, _1));
+      server.start();
+
+      _server_loop->queueInLoop(boost::bind(&muduo::CountDownLatch::countDown, &_server_ready));
+      _server_loop->loop();
+    }
+
+  private:
+
+    int _port;
+    int _io_threads;
+    muduo::CountDownLatch _server_ready;
+
+    std::shared_ptr<EventLoop> _server_loop;
+    std::unique_ptr<std::thread> _server;
+    inward_client_service _client;
+  };
+
+  void bm_round_trip(bench::state& state, const std::string& target, size_t n) {
+    std::vector<int> numbers = make_numbers(n);
+    std::string expected = std::to_string(std::accumulate(numbers.begin(), numbers.end(), 0));
+
+    rpc::p2p_client client(rpc::inward_client, target);
+
+    while (state.keep_running()) {
+      rpc_result result = client.sync_call(rpc_func::accumulate, fn_ids::accumulate, numbers, nilctx);
+
+      if (result.err() || result.data() != expected) {
+        state.skip_with_error("bad response, error " + std::to_string(result.err()));
+        return;
+      }
+    }
+  }
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+  po::options_description desc("Allowed options");
+  desc.add_options()
+      ("help", "produce help message")
+      ("benchmark_filter", po::value<std::string>()->default_value("all"), "run the benchmarks whose name contains it")
+      ("benchmark_min_time", po::value<double>()->default_value(0.5), "the minimal seconds a benchmark runs")
+      ("benchmark_format", po::value<std::string>()->default_value("console"), "console, json or csv")
+      ("benchmark_out", po::value<std::string>(), "write the report to the file instead of the standard output")
+      ("loopback_port", po::value<int>()->default_value(PIONEER_INWARD_SERVER_PORT + 100),
+          "the port of the loopback round trips, 0 disables them")
+      ("loopback_io_threads", po::value<int>()->default_value(1), "the I/O threads of the loopback server and client");
+
+  po::variables_map vm;
+  po::store(po::parse_command_line(argc, argv, desc), vm);
+  po::notify(vm);
+
+  if (vm.count("help")) {
+    std::cout << desc << std::endl;
+    return 0;
+  }
+
+  google::InitGoogleLogging(argv[0]);
+
+  const size_t sizes[] = { 8, 64, 1024 };
+
+  bench::runner runner;
+  runner.set_min_time(vm["benchmark_min_time"].as<double>());
+  runner.set_filter(vm["benchmark_filter"].as<std::string>());
+
+  for (size_t n : sizes) {
+    std::string arg = "/" + std::to_string(n);
+
+    runner.add("BM_message_builder_build" + arg, [n](bench::state& s) { bm_message_builder(s, n); });
+    runner.add("BM_dispatcher_dispatch" + arg, [n](bench::state& s) { bm_dispatch(s, n); });
+  }
+
+  std::vector<size_t> archive_sizes(std::begin(sizes), std::end(sizes));
+  archive_sizes.push_back(16384);
+
+  add_archive<fast_archives>(runner, "fast", archive_sizes);
+  add_archive<binary_archives>(runner, "binary", archive_sizes);
+  add_archive<text_archives>(runner, "text", archive_sizes);
+  add_archive<transact_archives>(runner, "transact", archive_sizes);
+
+  runner.add("BM_async_task_suspend_resume", [](bench::state& s) { bm_suspend_resume(s); });
+
+  for (size_t n : sizes) {
+    std::string arg = "/" + std::to_string(n);
+
+    runner.add("BM_allocations/session_manager_build_request" + arg, [n](bench::state& s) {
+      bm_allocations_build_request(s, n);
+    });
+    runner.add("BM_allocations/request_execute" + arg, [n](bench::state& s) { bm_allocations_execute(s, n); });
+  }
+  runner.add("BM_allocations/dispatcher_manager_respond", [](bench::state& s) { bm_allocations_respond(s); });
+
+  // the loopback is started only if a round trip is to run
+  std::unique_ptr<loopback> lo;
+  int port = vm["loopback_port"].as<int>();
+  if (port > 0 && runner.matches("BM_p2p_client_round_trip/")) {
+    lo.reset(new loopback(port, vm["loopback_io_threads"].as<int>()));
+    lo->start();
+
+    std::string target = lo->target();
+    for (size_t n : sizes) {
+      runner.add("BM_p2p_client_round_trip/" + std::to_string(n), [target, n](bench::state& s) {
+        bm_round_trip(s, target, n);
+      });
+    }
+  }
+
+  std::vector<bench::result> results = runner.run();
+
+  if (lo) lo->stop();
+
+  if (vm.count("benchmark_out")) {
+    std::ofstream out(vm["benchmark_out"].as<std::string>());
+    bench::runner::report(results, vm["benchmark_format"].as<std::string>(), out);
+  }
+  else {
+    bench::runner::report(results, vm["benchmark_format"].as<std::string>(), std::cout);
+  }
+
+  // a failed case, for example, an allocation bound exceeded
+  for (const bench::result& r : results) {
+    if (!r.error.empty()) return 1;
+  }
+
+  return 0;
+}
@@ -0,0 +1,479 @@
+/*
+ * benchmark.h
+ *
+ *  Created on: Sep 6, 2013
+ *      Author: vincent
+ */
+
+/*    Copyright 2011 ~ 2013 Vincent Zhang, ivincent.zhang@gmail.com
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#ifndef PIONEER_EXAMPLES_BENCHMARK_H_
+#define PIONEER_EXAMPLES_BENCHMARK_H_
+
+#include <time.h>
+#include <unistd.h>
+
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <iostream>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace pioneer {
+  namespace bench {
+
+    // keep the compiler from optimizing the value away
+    template<typename T>
+    inline void do_not_optimize(const T& value) {
+      asm volatile("" : : "g"(&value) : "memory");
+    }
+
+    inline uint64_t thread_cpu_ns() {
+      struct timespec ts;
+      ::clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+
+      return static_cast<uint64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+    }
+
+    /*
+     * The allocations made by the calling thread through the global operator new, the pools and the arenas
+     * allocate through it as well. They are counted only in the program defining PIONEER_BENCH_COUNT_ALLOCATIONS
+     * before including this header, which replaces the operator, see the end of the file
+     * */
+    inline uint64_t& thread_allocations() {
+      // gcc 4.7 does not support thread_local
+      static __thread uint64_t allocations = 0;
+      return allocations;
+    }
+
+    // the resident memory of the process, in bytes, 0 if it's unknown
+    inline uint64_t resident_bytes() {
+      unsigned long long pages = 0, resident = 0;
+
+      FILE* f = std::fopen("/proc/self/statm", "r");
+      if (!f) return 0;
+      if (std::fscanf(f, "%llu %llu", &pages, &resident) != 2) resident = 0;
+      std::fclose(f);
+
+      return static_cast<uint64_t>(resident) * ::sysconf(_SC_PAGESIZE);
+    }
+
+    /*
+     * The integers in [0, n) drawn by a Zipfian distribution of the skew theta in (0, 1), by the method of Gray et al.,
+     * "Quickly Generating Billion-Record Synthetic Databases", as YCSB does. The ranks are scrambled by a hash,
+     * so the hot items are spread over the key space rather than packed at it's head.
+     * The constructor takes O(n), next() is O(1), the generator is not thread safe, give every thread one
+     * */
+    class zipf_generator {
+    public:
+
+      zipf_generator(uint64_t n, double theta = 0.99, uint64_t seed = 0x9E3779B97F4A7C15ULL) :
+        _n(std::max<uint64_t>(n, 1)), _theta(theta), _state(seed | 1) {
+        _zeta_n = zeta(_n, theta);
+        double zeta2 = zeta(2, theta);
+
+        _alpha = 1 / (1 - theta);
+        _eta = (1 - std::pow(2.0 / _n, 1 - theta)) / (1 - zeta2 / _zeta_n);
+        _half_pow_theta = 1 + std::pow(0.5, theta);
+      }
+
+    public:
+
+      uint64_t next() { return scramble(next_rank()); }
+
+      // the rank, 0 is the hottest one
+      uint64_t next_rank() {
+        double u = uniform();
+        double uz = u * _zeta_n;
+
+        if (uz < 1) return 0;
+        if (uz < _half_pow_theta) return 1 % _n;
+
+        uint64_t rank = static_cast<uint64_t>(_n * std::pow(_eta * u - _eta + 1, _alpha));
+        return std::min(rank, _n - 1);
+      }
+
+    private:
+
+      static double zeta(uint64_t n, double theta) {
+        double sum = 0;
+        for (uint64_t i = 1; i <= n; ++i) sum += 1 / std::pow(static_cast<double>(i), theta);
+
+        return sum;
+      }
+
+      // xorshift64*, in [0, 1)
+      double uniform() {
+        _state ^= _state >> 12;
+        _state ^= _state << 25;
+        _state ^= _state >> 27;
+
+        return ((_state * 2685821657736338717ULL) >> 11) * (1.0 / 9007199254740992.0);
+      }
+
+      // the finalizer of MurmurHash3, a bijection of 64 bits, folded into [0, n)
+      uint64_t scramble(uint64_t rank) const {
+        uint64_t h = rank;
+        h ^= h >> 33;
+        h *= 0xFF51AFD7ED558CCDULL;
+        h ^= h >> 33;
+        h *= 0xC4CEB9FE1A85EC53ULL;
+        h ^= h >> 33;
+
+        return h % _n;
+      }
+
+    private:
+
+      uint64_t _n;
+      double _theta;
+      double _zeta_n;
+      double _alpha;
+      double _eta;
+      double _half_pow_theta;
+      uint64_t _state;
+    };
+
+    /*
+     * A run of a case, the case loops while keep_running(), the real time and the CPU time of the calling thread
+     * between the first and the last call are measured, like the State of Google Benchmark
+     * */
+    class state {
+    public:
+
+      explicit state(uint64_t iterations) : _iterations(iterations), _remaining(iterations), _started(false),
+        _real_ns(0), _cpu_ns(0), _bytes(0) {}
+
+    public:
+
+      bool keep_running() {
+        if (!_started) {
+          _started = true;
+          start_timing();
+        }
+
+        if (_remaining > 0) {
+          --_remaining;
+          return true;
+        }
+
+        stop_timing();
+        return false;
+      }
+
+      // exclude the setup inside the loop from the time
+      void pause_timing() { stop_timing(); }
+
+      void resume_timing() { start_timing(); }
+
+      uint64_t iterations() const { return _iterations; }
+
+      // the bytes processed by all the iterations, reported as bytes per second
+      void set_bytes_processed(uint64_t bytes) { _bytes = bytes; }
+
+      void set_label(const std::string& label) { _label = label; }
+
+      void skip_with_error(const std::string& error) {
+        _error = error;
+        _remaining = 0;
+      }
+
+      uint64_t real_ns() const { return _real_ns; }
+
+      uint64_t cpu_ns() const { return _cpu_ns; }
+
+      uint64_t bytes() const { return _bytes; }
+
+      const std::string& label() const { return _label; }
+
+      const std::string& error() const { return _error; }
+
+    private:
+
+      void start_timing() {
+        _real_start = std::chrono::steady_clock::now();
+        _cpu_start = thread_cpu_ns();
+      }
+
+      void stop_timing() {
+        _real_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - _real_start).count();
+        _cpu_ns += thread_cpu_ns() - _cpu_start;
+      }
+
+    private:
+
+      uint64_t _iterations;
+      uint64_t _remaining;
+      bool _started;
+
+      std::chrono::steady_clock::time_point _real_start;
+      uint64_t _cpu_start;
+
+      uint64_t _real_ns;
+      uint64_t _cpu_ns;
+      uint64_t _bytes;
+      std::string _label;
+      std::string _error;
+    };
+
+    struct result {
+      std::string name;
+      uint64_t iterations;
+      double real_time;   // per iteration, in nanoseconds
+      double cpu_time;    // per iteration, in nanoseconds
+      double bytes_per_second;
+      std::string label;
+      std::string error;
+    };
+
+    /*
+     * The registered cases, run one by one in the registration order, every case runs more iterations until it
+     * takes the minimal time, and reported in the console, json or csv format of Google Benchmark,
+     * so the existing tools compare the runs
+     * */
+    class runner {
+    public:
+
+      typedef std::function<void(state&)> function;
+
+      static const uint64_t max_iterations = 1000000000;
+
+    public:
+
+      runner() : _min_time(0.5) {}
+
+    public:
+
+      void add(const std::string& name, function f) { _cases.push_back(bench_case{name, f}); }
+
+      void set_min_time(double seconds) { _min_time = seconds > 0 ? seconds : 0.5; }
+
+      // the cases whose name contains the filter, std::regex is not usable in our compiler
+      void set_filter(const std::string& filter) { _filter = filter; }
+
+      bool matches(const std::string& name) const {
+        return _filter.empty() || _filter == "all" || name.find(_filter) != std::string::npos;
+      }
+
+      std::vector<result> run() {
+        std::vector<result> results;
+
+        for (const bench_case& c : _cases) {
+          if (!matches(c.name)) continue;
+
+          results.push_back(run(c));
+        }
+
+        return results;
+      }
+
+      // format : console, json or csv
+      static void report(const std::vector<result>& results, const std::string& format, std::ostream& os) {
+        if (format == "json") report_json(results, os);
+        else if (format == "csv") report_csv(results, os);
+        else report_console(results, os);
+      }
+
+    private:
+
+      struct bench_case {
+        std::string name;
+        function f;
+      };
+
+      result run(const bench_case& c) {
+        uint64_t iterations = 1;
+
+        while (true) {
+          state s(iterations);
+          c.f(s);
+
+          double seconds = s.real_ns() / 1e9;
+          if (!s.error().empty() || seconds >= _min_time || iterations >= max_iterations) return make_result(c, s);
+
+          // grow by the time taken, by 10 times at most, and a bit more to reach the minimal time at once
+          double multiplier = seconds > 0 ? _min_time * 1.4 / seconds : 10;
+          multiplier = std::min(std::max(multiplier, 2.0), 10.0);
+          iterations = std::min<uint64_t>(iterations * multiplier, max_iterations);
+        }
+      }
+
+      static result make_result(const bench_case& c, const state& s) {
+        result r;
+        r.name = c.name;
+        r.iterations = s.iterations();
+        r.real_time = s.iterations() ? static_cast<double>(s.real_ns()) / s.iterations() : 0;
+        r.cpu_time = s.iterations() ? static_cast<double>(s.cpu_ns()) / s.iterations() : 0;
+        r.bytes_per_second = s.real_ns() ? s.bytes() * 1e9 / s.real_ns() : 0;
+        r.label = s.label();
+        r.error = s.error();
+
+        return r;
+      }
+
+      static void report_console(const std::vector<result>& results, std::ostream& os) {
+        char line[256];
+        std::snprintf(line, sizeof(line), "%-48s %15s %15s %12s\n", "Benchmark", "Time", "CPU", "Iterations");
+        os << line << std::string(93, '-') << "\n";
+
+        for (const result& r : results) {
+          if (!r.error.empty()) {
+            os << r.name << " ERROR : " << r.error << "\n";
+            continue;
+          }
+
+          std::snprintf(line, sizeof(line), "%-48s %12.0f ns %12.0f ns %12llu", r.name.c_str(), r.real_time,
+              r.cpu_time, static_cast<unsigned long long>(r.iterations));
+          os << line;
+
+          if (r.bytes_per_second > 0) {
+            std::snprintf(line, sizeof(line), " %10.3fMB/s", r.bytes_per_second / (1024 * 1024));
+            os << line;
+          }
+          if (!r.label.empty()) os << " " << r.label;
+
+          os << "\n";
+        }
+      }
+
+      static void report_json(const std::vector<result>& results, std::ostream& os) {
+        char host[256] = { 0 };
+        ::gethostname(host, sizeof(host) - 1);
+
+        char date[64] = { 0 };
+        std::time_t now = std::time(nullptr);
+        std::strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", std::localtime(&now));
+
+        os << "{\n  \"context\": {\n"
+           << "    \"date\": \"" << date << "\",\n"
+           << "    \"host_name\": \"" << escape(host) << "\",\n"
+           << "    \"num_cpus\": " << std::thread::hardware_concurrency() << ",\n"
+#ifdef NDEBUG
+           << "    \"library_build_type\": \"release\"\n"
+#else
+           << "    \"library_build_type\": \"debug\"\n"
+#endif
+           << "  },\n  \"benchmarks\": [";
+
+        for (size_t i = 0; i < results.size(); ++i) {
+          const result& r = results[i];
+
+          os << (i ? "," : "") << "\n    {\n"
+             << "      \"name\": \"" << escape(r.name) << "\",\n"
+             << "      \"run_name\": \"" << escape(r.name) << "\",\n"
+             << "      \"run_type\": \"iteration\",\n";
+          if (!r.error.empty()) {
+            os << "      \"error_occurred\": true,\n"
+               << "      \"error_message\": \"" << escape(r.error) << "\",\n";
+          }
+          os << "      \"iterations\": " << r.iterations << ",\n"
+             << "      \"real_time\": " << r.real_time << ",\n"
+             << "      \"cpu_time\": " << r.cpu_time << ",\n"
+             << "      \"time_unit\": \"ns\"";
+          if (r.bytes_per_second > 0) os << ",\n      \"bytes_per_second\": " << r.bytes_per_second;
+          if (!r.label.empty()) os << ",\n      \"label\": \"" << escape(r.label) << "\"";
+          os << "\n    }";
+        }
+
+        os << "\n  ]\n}\n";
+      }
+
+      static void report_csv(const std::vector<result>& results, std::ostream& os) {
+        os << "name,iterations,real_time,cpu_time,time_unit,bytes_per_second,items_per_second,label,"
+           << "error_occurred,error_message\n";
+
+        for (const result& r : results) {
+          os << "\"" << r.name << "\"," << r.iterations << "," << r.real_time << "," << r.cpu_time << ",ns,";
+          if (r.bytes_per_second > 0) os << r.bytes_per_second;
+          os << ",,\"" << r.label << "\"," << (r.error.empty() ? "" : "true") << ",\"" << r.error << "\"\n";
+        }
+      }
+
+      static std::string escape(const std::string& s) {
+        std::string out;
+        for (char c : s) {
+          if (c == '"' || c == '\\') out += '\\';
+          out += c;
+        }
+
+        return out;
+      }
+
+    private:
+
+      std::vector<bench_case> _cases;
+      double _min_time;
+      std::string _filter;
+    };
+
+  } // bench
+} // pioneer
+
+#ifdef PIONEER_BENCH_COUNT_ALLOCATIONS
+
+// a program has one global operator new, so define it in one translation unit only
+
+void* operator new(std::size_t size) {
+  ++pioneer::bench::thread_allocations();
+
+  void* p = std::malloc(size ? size : 1);
+  if (!p) throw std::bad_alloc();
+
+  return p;
+}
+
+void* operator new[](std::size_t size) {
+  return ::operator new(size);
+}
+
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept {
+  ++pioneer::bench::thread_allocations();
+
+  return std::malloc(size ? size : 1);
+}
+
+void* operator new[](std::size_t size, const std::nothrow_t& t) noexcept {
+  return ::operator new(size, t);
+}
+
+void operator delete(void* p) noexcept {
+  std::free(p);
+}
+
+void operator delete[](void* p) noexcept {
+  std::free(p);
+}
+
+void operator delete(void* p, const std::nothrow_t&) noexcept {
+  std::free(p);
+}
+
+void operator delete[](void* p, const std::nothrow_t&) noexcept {
+  std::free(p);
+}
+
+#endif // PIONEER_BENCH_COUNT_ALLOCATIONS
+
+#endif /* PIONEER_EXAMPLES_BENCHMARK_H_ */
@@ -22,92 +22,184 @@
 
 #include "config.h"
 
+#include <cstring>
+#include <chrono>
+#include <condition_variable>
+#include <fstream>
+#include <iostream>
 #include <functional>
+#include <mutex>
+#include <thread>
 
-#include <boost/bind.hpp>
+#include <boost/program_options.hpp>
 #include <glog/logging.h>
 #include <atlas/console.h>
 #include <atlas/rpc.h>
-#include <muduo/net/TcpClient.h>
-#include <muduo/net/TcpConnection.h>
-#include <muduo/net/EventLoopThread.h>
+
+#include <pioneer/net/cluster_client.h>
+#include <pioneer/net/tls.h>
 
 #include "commander.h"
 
 using namespace pioneer;
-using namespace muduo;
-using namespace muduo::net;
 
-class pioneer_client {
+/*
+ * The calls of the batch mode in flight, a command waits for a free slot before it's sent, and a response frees
+ * it, so the connection is kept busy with up to the concurrency of calls and none is waited for in between
+ * */
+class batch_window {
 public:
 
-  pioneer_client(EventLoop* loop, const InetAddress& listenAddr) :
-      _loop(loop), _client(loop, listenAddr, "pioneer_client")
-  {
-    _client.setConnectionCallback(boost::bind(&pioneer_client::on_connection, this, _1));
-    _client.setMessageCallback(boost::bind(&pioneer_client::on_message, this, _1, _2, _3));
-    _client.enableRetry();
+  explicit batch_window(int size) : _size(std::max(size, 1)), _free(_size), _done(0), _failed(0) {}
+
+  void acquire() {
+    std::unique_lock<std::mutex> lock(_mutex);
+    _cond.wait(lock, [this]() { return _free > 0; });
+    --_free;
   }
 
-  void connect() { _client.connect(); }
+  // the I/O thread, when a response comes or the call times out
+  void release(int err_code) {
+    std::lock_guard<std::mutex> guard(_mutex);
+    ++_free;
+    ++_done;
+    if (err_code) ++_failed;
+    _cond.notify_all();
+  }
 
-  void disconnect() { _client.disconnect(); }
+  void wait_all() {
+    std::unique_lock<std::mutex> lock(_mutex);
+    _cond.wait(lock, [this]() { return _free == _size; });
+  }
 
-  void send(const std::string& message) { _connection->send(message.data(), message.size()); }
+  long done() const { std::lock_guard<std::mutex> guard(_mutex); return _done; }
 
-  void send(const char* message, size_t size) { _connection->send(message, size); }
+  long failed() const { std::lock_guard<std::mutex> guard(_mutex); return _failed; }
 
 private:
 
-  void on_connection(const TcpConnectionPtr& connection) {
-    MutexLockGuard lock(_mutex);
-    _connection = connection;
+  const int _size;
+  int _free;
+  long _done;
+  long _failed;
+
+  mutable std::mutex _mutex;
+  std::condition_variable _cond;
+};
+
+// run the commands of the stream, one per line, the empty lines and the ones starting with # are skipped,
+// return the exit code, 1 if any call failed
+int run_batch(rpc::commander<net::cluster_client>& commander, std::istream& in, int repeat, int concurrency, bool quiet) {
+  std::vector<std::string> commands;
+  for (std::string line; std::getline(in, line);) {
+    boost::algorithm::trim(line);
+    if (line.empty() || line[0] == '#') continue;
+    if (line == "quit") break;
+
+    commands.push_back(line);
   }
 
-  /*
-   * |------------|----------------------|------------|------|-----|---------|----------------
-   *   total size         cson-header         type      ecat  ecode  [count]      body
-   * */
-  void on_message(const TcpConnectionPtr& conn, Buffer* buf, muduo::Timestamp) {
-    size_t bytes_received = buf->readableBytes();
-    auto header = reinterpret_cast<const atlas::rpc::request_header*>(buf->peek());
-
-    if (bytes_received < sizeof(header->length) || (int32_t)bytes_received < header->length) {
-      LOG(INFO) << "I will read more data. Read " << bytes_received
-          << " bytes while " << header->length << " bytes expected.";
-      return;
-    }
+  batch_window window(concurrency);
+  commander.set_batch([&window](int err_code) { window.release(err_code); }, quiet);
 
-    buf->retrieve(sizeof(atlas::rpc::request_header));
-    std::string rpc_str(buf->peek(), buf->readableBytes());
+  long one_way = 0;
+  auto start = std::chrono::steady_clock::now();
 
-    atlas::rpc::message message(buf->peek());
+  for (int i = 0; i < repeat; ++i) {
+    for (const std::string& command : commands) {
+      window.acquire();
 
-    if (!rpc_str.empty()) {
-      // invoke built-in dispatchers
-      atlas::rpc::dispatcher_manager::ref().dispatch(header->fn_id, rpc_str, nullptr);
-    }
-    else {
-      LOG(ERROR) << "bad rpc message!";
+      // a one way call is done once sent, and a bad command is not sent
+      if (!commander.order(command)) {
+        window.release(0);
+        ++one_way;
+      }
     }
-
-    buf->retrieveAll();
   }
 
-  EventLoop* _loop;
-  TcpClient _client;
-  MutexLock _mutex;
-  TcpConnectionPtr _connection;
-};
+  window.wait_all();
+
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  long calls = window.done() - one_way;
+
+  std::cout << calls << " calls with responses, " << window.failed() << " failed, " << one_way << " one way or not sent, "
+      << seconds << "s, " << (seconds > 0 ? calls / seconds : 0) << " calls/s" << std::endl;
+
+  return window.failed() ? 1 : 0;
+}
 
 int main(int argc, char* argv[]) {
-  if (argc > 2) {
-    EventLoopThread loopThread;
-    InetAddress server_addr(argv[1], static_cast<uint16_t>(atoi(argv[2])));
+  namespace po = boost::program_options;
+
+  po::options_description desc("usage : client ip port [ca file for TLS] [options]\ntry : client 127.0.0.1 9100");
+  desc.add_options()
+      ("help", "this help")
+      ("ip", po::value<std::string>(), "the server ip")
+      ("port", po::value<int>(), "the outward port of the server")
+      ("ca", po::value<std::string>(), "the CA to verify the server against, the connection is TLS if it's given")
+      ("servers", po::value<std::string>()->default_value(""), "more servers, ip:port separated by commas, the calls"
+          " go to all of them in turn, and skip the ones down")
+      ("threads", po::value<int>()->default_value(CLIENT_THREADS), "the I/O threads of the connections")
+      ("connections", po::value<int>()->default_value(CLIENT_CONNECTIONS_PER_SERVER), "the connections to every server")
+      ("batch", po::value<std::string>(), "run the commands of the file, one per line, - for the standard input,"
+          " instead of the console, the calls are sent without waiting for the responses")
+      ("repeat", po::value<int>()->default_value(CLIENT_BATCH_REPEAT), "run the commands of the batch so many times")
+      ("concurrency", po::value<int>()->default_value(CLIENT_BATCH_CONCURRENCY), "the calls of the batch in flight")
+      ("quiet", "print the summary of the batch only, not the results")
+      ;
+
+  po::positional_options_description positional;
+  positional.add("ip", 1).add("port", 1).add("ca", 1);
+
+  po::variables_map vm;
+  try {
+    po::store(po::command_line_parser(argc, argv).options(desc).positional(positional).run(), vm);
+    po::notify(vm);
+  }
+  catch (const std::exception& e) {
+    std::cerr << "error: " << e.what() << "\n" << desc << "\n";
+    return 1;
+  }
+
+  if (!vm.count("help") && vm.count("ip") && vm.count("port")) {
+    std::vector<std::string> servers;
+    std::string more = vm["servers"].as<std::string>();
+    boost::algorithm::split(servers, more, boost::is_any_of(", "), boost::token_compress_on);
+    servers.erase(std::remove(servers.begin(), servers.end(), std::string()), servers.end());
+    servers.insert(servers.begin(), vm["ip"].as<std::string>() + ":" + std::to_string(vm["port"].as<int>()));
+
+    // the server is verified against the CA, and the records are encrypted by the kernel
+    std::shared_ptr<pioneer::net::tls_context> tls;
+    if (vm.count("ca")) {
+      tls = pioneer::net::tls_context::client(vm["ca"].as<std::string>());
+      if (!tls) return 1;
+      if (!pioneer::net::tls_context::offload_supported()) {
+        std::cerr << "kernel TLS is not supported, load the tls module\n";
+        return 1;
+      }
+    }
 
-    pioneer_client client(loopThread.startLoop(), server_addr);
+    net::cluster_client client(servers, vm["threads"].as<int>(), vm["connections"].as<int>(), tls);
     client.connect();
-    rpc::commander<pioneer_client> commander(client);
+    rpc::commander<net::cluster_client> commander(client);
+
+    if (vm.count("batch")) {
+      if (!client.wait_connected(std::chrono::seconds(10))) {
+        std::cerr << "can not connect to the server\n";
+        return 1;
+      }
+
+      const std::string& file = vm["batch"].as<std::string>();
+      if (file == "-") return run_batch(commander, std::cin, vm["repeat"].as<int>(), vm["concurrency"].as<int>(), vm.count("quiet"));
+
+      std::ifstream in(file);
+      if (!in) {
+        std::cerr << "can not read " << file << "\n";
+        return 1;
+      }
+
+      return run_batch(commander, in, vm["repeat"].as<int>(), vm["concurrency"].as<int>(), vm.count("quiet"));
+    }
 
     const char* line;
     atlas::console console("pioneer >", "/tmp/pioneer_console_history");
@@ -126,7 +218,6 @@ int main(int argc, char* argv[]) {
     }
   }
   else {
-    std::cerr << "usage : client ip port";
-    std::cerr << "try : client 127.0.0.1 9100";
+    std::cerr << desc << "\n";
   }
 }
@@ -42,6 +42,8 @@
 
 #include "service/rfc_func.h"
 #include "service/rfc_func.client.ipp"
+#include "service/kv.h"
+#include "service/kv.client.ipp"
 
 namespace po = boost::program_options;
 
@@ -54,15 +56,47 @@ namespace pioneer {
       std::cout << result << std::endl;
     }
 
+    // the sum is a typed result of an int, see rpc_func::accumulate
+    void print_sum(const std::string& result, int err_code, atlas::rpc::async_task& task) {
+      int sum = 0;
+      if (err_code || !atlas::rpc::result_cast(result, sum)) std::cout << "error " << err_code << std::endl;
+      else std::cout << sum << std::endl;
+    }
+
+    void print_kv_result(const std::string& result, int err_code, atlas::rpc::async_task& task) {
+      if (err_code == kv::not_found) std::cout << "not found" << std::endl;
+      else if (err_code) std::cout << "error " << err_code << " " << result << std::endl;
+      else std::cout << result << std::endl;
+    }
+
+    void print_kv_values(const std::string& result, int err_code, atlas::rpc::async_task& task) {
+      kv::value_list values;
+      if (err_code || !kv::decode_values(result, values)) {
+        std::cout << "error " << err_code << std::endl;
+        return;
+      }
+
+      for (const boost::optional<std::string>& v : values) std::cout << (v ? *v : std::string("not found")) << std::endl;
+    }
+
+    typedef void (*result_printer)(const std::string&, int, atlas::rpc::async_task&);
+
+    // the end of a call of the batch mode, with the error code, see commander::set_batch
+    typedef std::function<void(int)> done_callback;
+
     template<typename MessageSender>
     class commander : public atlas::rpc::remote_caller {
     public:
 
-      commander(MessageSender& sender) : atlas::rpc::remote_caller(rpc::outward_client), _sender(sender) {
+      commander(MessageSender& sender) : atlas::rpc::remote_caller(rpc::outward_client), _sender(sender), _quiet(false) {
         _descs["help"].add_options()
             ("cannounce_inner_node", "all servers connect to the announced data node")
-            ("cstart_udp_test", "all servers start udp test")
+            ("cset_config", "all servers change the settings changeable while running")
             ("accumulate", "ask the server to accumulate a list of numbers separated by commas")
+            ("cstart_bench", "all servers call each other for a while, and the report of the cluster is shown")
+            ("kv_get", "the value of a key of the kv service")
+            ("kv_put", "put a key and it's value to the kv service")
+            ("kv_multi_get", "the values of the keys of the kv service")
             ("quit", "quit client")
             ;
 
@@ -72,12 +106,10 @@ namespace pioneer {
                 " the ip list should be separated by a comma")
             ;
 
-        _descs["cstart_udp_test"].add_options()
-            ("help", "usage : start_udp_test [--rounds] [--test_count] [--interval] [--rest_time]")
-            ("rounds", po::value<int>()->default_value(1), "test rounds")
-            ("test_count", po::value<int>()->default_value(1), "test times")
-            ("interval", po::value<int>()->default_value(10), "time interval between two test in millisecond")
-            ("rest_time", po::value<int>()->default_value(1), "rest time in seconds")
+        _descs["cset_config"].add_options()
+            ("help", "usage : cset_config --settings name=value, name2=value2 ...")
+            ("settings", po::value<std::string>(), "the settings to change, see /pioneer/config of the report server,"
+                " the settings should be separated by a comma")
             ;
 
         _descs["accumulate"].add_options()
@@ -85,33 +117,68 @@ namespace pioneer {
             ("numbers", po::value<std::string>(), "the numbers to be accumulated together,"
                 " the numbers should be separated by a comma")
             ;
+
+        _descs["cstart_bench"].add_options()
+            ("help", "usage : cstart_bench [--duration] [--concurrency] [--size]")
+            ("duration", po::value<int>()->default_value(10000), "the run time in milliseconds")
+            ("concurrency", po::value<int>()->default_value(8), "the calls in flight per peer of every server")
+            ("size", po::value<int>()->default_value(64), "the payload size of a call in bytes")
+            ;
+
+        _descs["kv_get"].add_options()
+            ("help", "usage : kv_get --key key")
+            ("key", po::value<std::string>(), "the key")
+            ;
+
+        _descs["kv_put"].add_options()
+            ("help", "usage : kv_put --key key --value value")
+            ("key", po::value<std::string>(), "the key")
+            ("value", po::value<std::string>(), "the value")
+            ;
+
+        _descs["kv_multi_get"].add_options()
+            ("help", "usage : kv_multi_get --keys key, key2, key3 ...")
+            ("keys", po::value<std::string>(), "the keys separated by a comma")
+            ;
       }
 
       virtual ~commander() {}
 
     public:
 
-      void order(const std::string& command) {
+      /*
+       * The batch mode, the calls are not waited for, the end of every call with a response is told to the hook,
+       * so the caller keeps several of them in flight over the connection, and the results are printed as they
+       * come unless quiet
+       * */
+      void set_batch(const done_callback& on_done, bool quiet) {
+        _on_done = on_done;
+        _quiet = quiet;
+      }
+
+      // return true if a response is waited for, it's told to the batch hook
+      bool order(const std::string& command) {
         auto args = tokenize<std::string>(command, " ");
+        if (args.empty()) return false;
 
         std::string cmd = args.front();
         args.erase(args.begin());
-        parse(cmd, args);
+        return parse(cmd, args);
       }
 
     protected:
 
-      void parse(const std::string& command, const std::vector<std::string>& args) {
+      bool parse(const std::string& command, const std::vector<std::string>& args) {
         try {
           if (command == "help") {
             std::cout << _descs["help"];
-            return;
+            return false;
           }
 
           auto it = _descs.find(command);
           if (it == _descs.end()) {
             std::cout << "invalid command, type help for more information";
-            return;
+            return false;
           }
 
           const po::options_description& desc = *it->second;
@@ -124,10 +191,10 @@ namespace pioneer {
 
           if (vm.count("help")) {
             std::cout << desc << "\n";
-            return;
+            return false;
           }
 
-          dispatch(command, desc, vm);
+          return dispatch(command, desc, vm);
         }
         catch (const std::exception& e) {
           std::cerr << "error: " << e.what() << "\n";
@@ -135,6 +202,8 @@ namespace pioneer {
         catch (...) {
           std::cerr << "Exception of unknown type!\n";
         }
+
+        return false;
       }
 
       bool check_require(const po::variables_map& vm, const std::string& option, const po::options_description& desc) {
@@ -147,27 +216,74 @@ namespace pioneer {
         return true;
       }
 
-      void dispatch(const std::string& command, const po::options_description& desc, const po::variables_map& vm) {
-        if (command == "cstart_udp_test") {
-          call(rpc_func::cstart_udp_test, fn_ids::cstart_udp_test,
-              vm["rounds"].as<int>(),
-              vm["test_count"].as<int>(),
-              vm["interval"].as<int>(),
-              vm["rest_time"].as<int>(),
-              nilctx);
-        }
-        else if (command == "cannounce_inner_node") {
-          if (!check_require(vm, "ips", desc)) return;
+      // the printer of the result, and the batch hook in the batch mode
+      atlas::rpc::rpc_callback_type callback(result_printer print) const {
+        if (!_on_done) return atlas::rpc::rpc_callback_type(print);
+
+        done_callback on_done = _on_done;
+        bool quiet = _quiet;
+        return [print, on_done, quiet](const std::string& result, int err_code, atlas::rpc::async_task& task) {
+          if (!quiet) print(result, err_code, task);
+          on_done(err_code);
+        };
+      }
+
+      // return true if a response is waited for, the one way calls are done once sent
+      bool dispatch(const std::string& command, const po::options_description& desc, const po::variables_map& vm) {
+        if (command == "cannounce_inner_node") {
+          if (!check_require(vm, "ips", desc)) return false;
 
           call(rpc_func::cannounce_inner_node, fn_ids::cannounce_inner_node, vm["ips"].as<std::string>(), nilctx);
         }
+        else if (command == "cset_config") {
+          if (!check_require(vm, "settings", desc)) return false;
+
+          call(rpc_func::cset_config, fn_ids::cset_config, vm["settings"].as<std::string>(), nilctx);
+        }
         else if (command == "accumulate") {
-          if (!check_require(vm, "numbers", desc)) return;
+          if (!check_require(vm, "numbers", desc)) return false;
 
-          // once return, call print_result to show the result
-          atlas::rpc::rpc_callback_type cb(print_result);
+          // once return, call print_sum to show the result
+          atlas::rpc::rpc_callback_type cb(callback(print_sum));
           call(rpc_func::accumulate, fn_ids::accumulate, cb, tokenize<int>(vm["numbers"].as<std::string>()), nilctx);
+          return true;
         }
+        else if (command == "cstart_bench") {
+          int duration = vm["duration"].as<int>();
+
+          // the report comes once every server is over
+          set_timeout(std::chrono::milliseconds(duration) + std::chrono::seconds(10));
+
+          atlas::rpc::rpc_callback_type cb(callback(print_result));
+          call(rpc_func::cstart_bench, fn_ids::cstart_bench, cb, duration, vm["concurrency"].as<int>(),
+              vm["size"].as<int>(), nilctx);
+
+          set_timeout(atlas::rpc::default_rpc_timeout);
+          return true;
+        }
+        else if (command == "kv_get") {
+          if (!check_require(vm, "key", desc)) return false;
+
+          atlas::rpc::rpc_callback_type cb(callback(print_kv_result));
+          call(kv_func::get, fn_ids::kv_get, cb, vm["key"].as<std::string>(), nilctx);
+          return true;
+        }
+        else if (command == "kv_put") {
+          if (!check_require(vm, "key", desc) || !check_require(vm, "value", desc)) return false;
+
+          atlas::rpc::rpc_callback_type cb(callback(print_kv_result));
+          call(kv_func::put, fn_ids::kv_put, cb, vm["key"].as<std::string>(), vm["value"].as<std::string>(), nilctx);
+          return true;
+        }
+        else if (command == "kv_multi_get") {
+          if (!check_require(vm, "keys", desc)) return false;
+
+          atlas::rpc::rpc_callback_type cb(callback(print_kv_values));
+          call(kv_func::multi_get, fn_ids::kv_multi_get, cb, tokenize<std::string>(vm["keys"].as<std::string>()), nilctx);
+          return true;
+        }
+
+        return false;
       }
 
       template<typename T, typename Container = std::vector<T> >
@@ -180,8 +296,9 @@ namespace pioneer {
         return separated_args;
       }
 
+      // the sender returns false if there is no connection to send on
       virtual void send(const char* message, size_t size) {
-        _sender.send(message, size);
+        if (!_sender.send(message, size)) reject(message, size, atlas::rpc::rpc_unreachable);
       }
 
     private:
@@ -189,6 +306,9 @@ namespace pioneer {
       boost::ptr_map<std::string, po::options_description> _descs;
 
       MessageSender& _sender;
+
+      done_callback _on_done;
+      bool _quiet;
     };
 
   } // client
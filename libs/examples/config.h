@@ -8,9 +8,17 @@
 #ifndef PIONEER_CONFIG_H_
 #define PIONEER_CONFIG_H_
 
-#define ATLAS_DEBUG_RPC 1
+// use text archives for RPC messages, for debugging only
+// #define ATLAS_DEBUG_RPC 1
 
+// an IPv4 or IPv6 group, for example, "ff15::1:18"
 const char* PIONEER_MULTIGROUP = "234.1.1.18";
+// the subnet broadcast address of the data plane, empty to disable broadcasting
+const char* PIONEER_BCAST_ADDRESS = "";
+// the interface to multicast on, a name like "eth1" or one of it's IPv4 addresses, empty to follow the routes
+const char* PIONEER_MCAST_INTERFACE = "";
+// the channel groups joined beside the cluster group, separated by commas, for example, "234.1.2.1,234.1.2.2"
+const char* PIONEER_MCAST_CHANNELS = "";
 
 const int PIONEER_OUTWARD_SERVER_PORT = 9100;
 const int PIONEER_INWARD_SERVER_PORT = 9102;
@@ -20,4 +28,194 @@ const int OUTWARD_SERVER_THREADS = 2;
 const int INWARD_SERVER_THREADS = 2;
 const int INWARD_CLIENT_POOL_THREADS = 2;
 
+// the threads running the requests, 0 means one per CPU, see pioneer/system/thread_pool.h
+const int WORKER_POOL_THREADS = 0;
+// pin the workers one per CPU of the list, for example, "2-7", empty to let them float
+const char* WORKER_POOL_CPUS = "";
+// keep the workers on the CPUs of a NUMA node if no CPU list is given, -1 means any node
+const int WORKER_POOL_NUMA_NODE = -1;
+// grow the worker pool up to so many threads while the queue delay stays above the wait, in seconds,
+// the extra ones retire after the idle timeout, 0 keeps the pool fixed
+const int WORKER_POOL_MAX_THREADS = 0;
+const double WORKER_POOL_MAX_QUEUE_WAIT = 0.01;
+const double WORKER_POOL_IDLE_TIMEOUT = 5.0;
+// run the requests on the I/O loops instead of the workers, for cheap handlers only
+const bool WORKER_POOL_INLINE = false;
+// run the requests of a connection one at a time in order, so the handlers need no lock for it
+const bool WORKER_POOL_ORDERED = false;
+// one loop per core accepts, reads, runs and answers the outward and inward requests, on the CPUs of
+// WORKER_POOL_CPUS, or of the NUMA node, or all of them, instead of the server threads and the worker pool
+const bool THREAD_PER_CORE = false;
+// every I/O loop of the outward and inward servers listens on the port with SO_REUSEPORT, linux 3.9, so a burst of
+// connects is accepted by all of them rather than by the base loop alone, see net::reuseport_group
+const bool REUSEPORT = false;
+// the socket options of the outward and the inward connections, default, latency, busy_poll or throughput,
+// see net::socket_profile
+const char* OUTWARD_SOCKET_PROFILE = "latency";
+const char* INWARD_SOCKET_PROFILE = "latency";
+// the outward listeners take the first request of a client in it's SYN, the connections with data in flight before
+// their handshakes are done, 0 for off, the kernel needs the bit 2 of net.ipv4.tcp_fastopen, see net::fast_open
+const int OUTWARD_FAST_OPEN = 256;
+// the kernel stamps the received datagrams, off, software or hardware, so the latency of a request is split into
+// it's receive, it's queue wait and it's execution, see net::rx_timestamps
+const char* RX_TIMESTAMPS = "off";
+// the client connections idle for the seconds are closed, and the most bloated ones once their buffers take more
+// than the MB, 0 for never, see net::connection_reaper
+const int OUTWARD_IDLE_TIMEOUT = 300;
+const int OUTWARD_MEMORY_CAP = 1024;
+// the outward server speaks TLS with these in PEM, the records are encrypted by the kernel, see net::tls_session
+const char* TLS_CERT = "";
+const char* TLS_KEY = "";
+// the frames larger than the threshold are sent with LZ4 to the peers which accept it, see net::frame_compression
+const bool COMPRESSION = false;
+const int COMPRESSION_THRESHOLD = 4096;
+// the large frames are sent to the peers in chunks, so the control frames pass them, see net::frame_chunks
+const bool FRAME_CHUNKS = true;
+// the frames built end with their CRC-32C, checked by the receiver, every node must know the flag, see atlas::rpc::message::seal
+const bool CHECKSUMS = false;
+// the MB the results of the pure functions may take, 0 turns the cache off, see atlas::rpc::result_cache
+const int RESULT_CACHE_SIZE = 0;
+// the loops poll with io_uring instead of epoll, linux 5.1, see net::uring_poller
+const bool IO_URING = false;
+// the blocks of the request arenas and the multicast receive rings are taken from 2MB pages, off, transparent or
+// reserved, the reserved ones need vm.nr_hugepages and fall back to the transparent ones, see atlas::memory::huge_page_resource
+const char* HUGE_PAGES = "off";
+// the I/O loops and the workers are placed on the NUMA nodes, off, spread over all, or nic, on the node of the
+// NUMA_INTERFACE only, a request is read and run on one node, see system::numa_placement
+const char* NUMA_PLACEMENT = "off";
+const char* NUMA_INTERFACE = "";
+// the inside nodes are known by gossip instead of the announcing, see net::gossip
+const bool GOSSIP = false;
+// the members to join by, for example, 10.0.0.1,10.0.0.2
+const char* GOSSIP_SEEDS = "";
+// the datagrams of the cluster group are taken off the NIC by AF_XDP before the network stack, an IPv4 group and
+// a named interface only, linux 5.9 and root, the socket receives all if it's not supported, see net::xdp_receiver
+const bool MCAST_XDP = false;
+// the multicast datagrams seen in the window are dropped, by the session id of their first frame, see net::mcast_dedupe
+const bool MCAST_DEDUPE = true;
+const int MCAST_DEDUPE_WINDOW = 500;
+// the copies of this node's own multicasts are dropped by the dedupe too, the node runs it's own copy in process
+// if the local shortcut is on, or never
+const bool MCAST_SUPPRESS_SELF = false;
+// the request frames are captured into the file from the start, to replay them with pioneer_loadgen --mode replay,
+// none if empty, /pioneer/capture starts and stops it while running, see net::traffic_capture
+const char* CAPTURE_FILE = "";
+const int CAPTURE_MAX_MB = 1024;
+// the calls of a node to itself are run in process, instead of through the loopback, see net::local_delivery
+const bool LOCAL_SHORTCUT = true;
+// the responses to the calls of a node complete them on the I/O loop which reads them, instead of a worker,
+// the callbacks must be cheap then, see system::worker_settings::inline_completions
+const bool INLINE_COMPLETIONS = true;
+// the inward connections, full_mesh, random or rack, the others than the full mesh need the gossip, see net::overlay
+const char* TOPOLOGY = "full_mesh";
+// the links of a node to the random members, and the ip prefix length of a rack
+const int OVERLAY_DEGREE = 3;
+const int RACK_PREFIX = 24;
+// the cluster wide actions are coordinated by the leader only, see net::leader_election
+const bool LEADER_ELECTION = false;
+// the election timeout of the leader, in seconds
+const double LEADER_ELECTION_TIMEOUT = 1.0;
+// the labels of this node, the requests to any inside node go to the nearest ones, see net::locality
+const char* ZONE = "";
+const char* RACK = "";
+// at a signal, the node drains for the seconds at most before it quits, 0 to quit at once, see net::drain
+const double DRAIN_TIMEOUT = 30.0;
+// the log of the kv service, the puts are replayed from it at start, in memory only if empty, see service/kv.h
+const char* KV_LOG = "";
+// the kv log rolls at so many MB, and a checkpoint drops the logs before it
+const int KV_LOG_SIZE = 64;
+// a node joining the cluster pulls the keys it owns from the inside nodes, see rpc::kv::pull
+const bool KV_BOOTSTRAP = false;
+// the queued tasks per worker above which the requests opted in are passed on to the less loaded inside nodes,
+// 0 never passes any on, see net::offload
+const double OFFLOAD_THRESHOLD = 0;
+// the requests per second of an outward client, and it's burst, the ones beyond are answered busy, 0 for no quota,
+// see net::fair_queue
+const double CLIENT_QUOTA = 0;
+const double CLIENT_QUOTA_BURST = 0;
+// the outward data plane requests in the worker pool at once, the others wait their clients' turns, 0 for no fair
+// queueing, and the bytes of a turn and the requests a client may have waiting, 0 for no bound
+const int FAIR_QUEUE_IN_FLIGHT = 0;
+const int FAIR_QUEUE_QUANTUM = 16 * 1024;
+const int FAIR_QUEUE_MAX_QUEUED = 1000;
+// a client is it's ip and the client id of it's headers, not it's ip only
+const bool FAIR_QUEUE_BY_CLIENT_ID = false;
+// on jemalloc, the threads of a role allocate from an arena of their own, see atlas::memory::role_arenas, build
+// with PIONEER_JEMALLOC=1 or preload libjemalloc
+const bool JEMALLOC_ARENAS = true;
+// the functions are called by HTTP/JSON on the outward port as well, POST /rpc/<name>, see net::http_gateway, and
+// the largest body taken, in bytes
+const bool HTTP_GATEWAY = false;
+const int HTTP_GATEWAY_MAX_BODY = 1024 * 1024;
+// the queued requests of a function with a batch handler run together, so many at most, 0 runs them one by one,
+// see net::call_batches
+const int CALL_BATCH_SIZE = 64;
+// the threads running the control plane requests, see PIONEER_RPC_PRIORITY
+const int CONTROL_POOL_THREADS = 1;
+
+// the data plane requests beyond are rejected with rpc_busy, 0 means unbounded, see pioneer/system/admission.h
+const int WORKER_POOL_MAX_PENDING = 100000;
+// shed the requests once the queue delay stays above the target for the interval, in seconds, 0 disables it
+const double WORKER_POOL_CODEL_TARGET = 0.005;
+const double WORKER_POOL_CODEL_INTERVAL = 0.1;
+
+// how often the log lines are written to the log files, in seconds, see pioneer/system/async_logging.h
+const double ASYNC_LOG_FLUSH_INTERVAL = 1.0;
+
+// the requests whose handler takes longer are kept for /pioneer/slow_requests, in seconds, and the head of the
+// arguments of a part of them, see atlas/rpc/slow_log.h
+const double SLOW_REQUEST_THRESHOLD = 0.1;
+const int SLOW_REQUEST_CAPTURE_BYTES = 64;
+const double SLOW_REQUEST_CAPTURE_RATE = 0.1;
+
+// the profiler samples so many times per second of CPU time, 0 disables it, see pioneer/system/profiler.h
+const int PROFILER_HZ = 49;
+
+// the part of the new traces sampled and recorded, see atlas/rpc/trace.h
+const double RPC_TRACE_SAMPLE_RATE = 0.001;
+
+// record the scopes timed by ATLAS_TRACE_SCOPE for /pioneer/scopes, see atlas/trace_scope.h
+const bool TRACE_SCOPES = false;
+
+// connections established to every inside node, the ones not busy keep warm as standbys
+const int INWARD_CONNECTIONS_PER_PEER = 2;
+
+// the inside nodes on the same host talk through Unix domain sockets instead of TCP
+const bool INWARD_LOCAL_TRANSPORT = true;
+
+// number the multicast datagrams and retransmit the lost ones on NAKs, see pioneer/net/reliable_multicast.h
+const bool PIONEER_RELIABLE_MULTICAST = true;
+// how often the lost datagrams are asked, in seconds
+const double PIONEER_MCAST_NAK_INTERVAL = 0.05;
+
+// the responses to a multicast call are aggregated per caller, see pioneer/net/ack_aggregator.h
+const bool PIONEER_MCAST_ACK_AGGREGATION = true;
+// how long the responses are kept before sent, in seconds
+const double PIONEER_MCAST_ACK_INTERVAL = 0.01;
+
+// the log records are shipped to the replicas at least this often, in seconds, see pioneer/net/log_replication.h
+const double PIONEER_LOG_REPLICATION_INTERVAL = 0.005;
+
+// a round of the membership gossip, in seconds, see pioneer/net/gossip.h
+const double PIONEER_GOSSIP_INTERVAL = 1.0;
+
+// how long the startup waits for the initial peers to connect before the node is ready anyway, in seconds
+const double PIONEER_INITIAL_PEERS_TIMEOUT = 3.0;
+
+// how often the inside nodes without labels are placed again by their round trip times, in seconds
+const double PIONEER_LOCALITY_INTERVAL = 1.0;
+
+// how often the drain checks the work left, in seconds
+const double PIONEER_DRAIN_INTERVAL = 0.1;
+
+// how often the depth of the worker queue is multicast to the peers, in seconds, see pioneer/net/offload.h
+const double PIONEER_OFFLOAD_INTERVAL = 0.1;
+
+// the batch mode of the client runs the commands so many times, with so many calls in flight, see client.cpp
+const int CLIENT_BATCH_REPEAT = 1;
+const int CLIENT_BATCH_CONCURRENCY = 16;
+// the I/O threads of the client, and the connections to every server, see net::cluster_client
+const int CLIENT_THREADS = 1;
+const int CLIENT_CONNECTIONS_PER_SERVER = 1;
+
 #endif /* CONFIG_H_ */
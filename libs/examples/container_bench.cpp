@@ -0,0 +1,541 @@
+/*
+ * container_bench.cpp
+ *
+ *  Created on: Sep 14, 2013
+ *      Author: vincent
+ */
+
+/*    Copyright 2011 ~ 2013 Vincent Zhang, ivincent.zhang@gmail.com
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+/*
+ * The benchmark of the atlas containers, so the structure of a pioneer table is chosen by numbers.
+ *
+ * Every container is filled with half of the key space, and then the threads run a mix of finds, inserts and erases
+ * on the keys drawn uniformly or by a Zipfian distribution for the given seconds. A run reports the operations
+ * per second, the speedup over the first thread count, so the rows of a container make it's scalability curve,
+ * and the resident memory per entry after the fill.
+ *
+ * The containers not thread safe are guarded by a reader writer lock, as a table would be.
+ *
+ * try : container_bench --containers skip_list,concurrent_btree_map --threads 1,2,4,8 --mix 90:5:5 --format csv
+ * */
+
+#include <malloc.h>
+#include <pthread.h>
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <new>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#include <boost/algorithm/string.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/program_options.hpp>
+
+#include <atlas/container/blocking_concurrent_box.h>
+#include <atlas/container/btree_map.h>
+#include <atlas/container/btree/safe_btree_map.h>
+#include <atlas/container/concurrenct_skip_list.h>
+#include <atlas/container/concurrent_box.h>
+#include <atlas/container/concurrent_btree_map.h>
+#include <atlas/container/sharded_concurrent_box.h>
+#include <atlas/container/ttree_map.h>
+
+#include "benchmark.h"
+
+namespace po = boost::program_options;
+
+using namespace pioneer;
+
+namespace {
+
+  const std::string usage = "usage : container_bench [options], try container_bench --help";
+
+  typedef uint64_t key_type;
+  typedef uint64_t value_type;
+
+  /*
+   * The adapters give the containers the same face : find, insert and erase return if they hit
+   * */
+
+  class skip_list_adapter {
+  public:
+
+    typedef atlas::concurrent_skip_list_map<key_type, value_type> map_type;
+
+    skip_list_adapter() : _map(map_type::createInstance()) {}
+
+    // the accessor pins the epoch for one operation, as a table does
+    bool find(key_type k) {
+      map_type::Accessor a(_map.get());
+      return a.find(k) != a.end();
+    }
+
+    bool insert(key_type k, value_type v) {
+      map_type::Accessor a(_map.get());
+      return a.insert(std::make_pair(k, v)).second;
+    }
+
+    bool erase(key_type k) {
+      map_type::Accessor a(_map.get());
+      return a.erase(k) > 0;
+    }
+
+    size_t size() const { return map_type::Accessor(_map.get()).size(); }
+
+  private:
+
+    std::shared_ptr<map_type> _map;
+  };
+
+  // a map not thread safe under a reader writer lock
+  template<typename Map>
+  class locked_adapter {
+  public:
+
+    locked_adapter() { ::pthread_rwlock_init(&_lock, nullptr); }
+
+    ~locked_adapter() { ::pthread_rwlock_destroy(&_lock); }
+
+    bool find(key_type k) {
+      ::pthread_rwlock_rdlock(&_lock);
+      bool found = _map.find(k) != _map.end();
+      ::pthread_rwlock_unlock(&_lock);
+
+      return found;
+    }
+
+    bool insert(key_type k, value_type v) {
+      ::pthread_rwlock_wrlock(&_lock);
+      bool inserted = _map.insert(std::make_pair(k, v)).second;
+      ::pthread_rwlock_unlock(&_lock);
+
+      return inserted;
+    }
+
+    bool erase(key_type k) {
+      ::pthread_rwlock_wrlock(&_lock);
+      bool erased = _map.erase(k) > 0;
+      ::pthread_rwlock_unlock(&_lock);
+
+      return erased;
+    }
+
+    size_t size() const { return _map.size(); }
+
+  private:
+
+    pthread_rwlock_t _lock;
+    Map _map;
+  };
+
+  class concurrent_btree_adapter {
+  public:
+
+    bool find(key_type k) { return _map.contains(k); }
+
+    bool insert(key_type k, value_type v) { return _map.insert(k, v); }
+
+    bool erase(key_type k) { return _map.erase(k); }
+
+    size_t size() const { return _map.size(); }
+
+  private:
+
+    atlas::concurrent_btree_map<key_type, value_type> _map;
+  };
+
+  class concurrent_box_adapter {
+  public:
+
+    bool find(key_type k) { return _box.get(k).is_initialized(); }
+
+    // the box replaces nothing, an existing key is kept
+    bool insert(key_type k, value_type v) {
+      if (_box.get(k)) return false;
+
+      _box.put(k, v);
+      return true;
+    }
+
+    bool erase(key_type k) { return _box.take(k).is_initialized(); }
+
+    size_t size() const { return _box.size(); }
+
+  private:
+
+    atlas::concurrent_box<key_type, value_type> _box;
+  };
+
+  class sharded_box_adapter {
+  public:
+
+    bool find(key_type k) { return _box.get(k).is_initialized(); }
+
+    bool insert(key_type k, value_type v) { return _box.put(k, v); }
+
+    bool erase(key_type k) { return _box.erase(k); }
+
+    size_t size() const { return _box.size(); }
+
+  private:
+
+    atlas::sharded_concurrent_box<key_type, value_type> _box;
+  };
+
+  class blocking_box_adapter {
+  public:
+
+    blocking_box_adapter() : _box(std::chrono::microseconds(0)) {}
+
+    bool find(key_type k) { return _box.get(k).is_initialized(); }
+
+    bool insert(key_type k, value_type v) { return _box.put(k, v); }
+
+    // never waits for a missing key
+    bool erase(key_type k) {
+      if (!_box.get(k)) return false;
+
+      _box.erase(k);
+      return true;
+    }
+
+    size_t size() const { return _box.size(); }
+
+  private:
+
+    atlas::blocking_concurrent_box<key_type, value_type> _box;
+  };
+
+  // the concurrent containers are aligned to the cache line, a plain new does not honour it before C++17
+  template<typename T>
+  struct aligned_delete {
+    void operator()(T* p) const {
+      p->~T();
+      ::free(p);
+    }
+  };
+
+  template<typename T>
+  using aligned_ptr = std::unique_ptr<T, aligned_delete<T>>;
+
+  template<typename T>
+  aligned_ptr<T> make_aligned() {
+    void* p = nullptr;
+    size_t alignment = std::max(std::alignment_of<T>::value, sizeof(void*));
+    if (::posix_memalign(&p, alignment, sizeof(T)) != 0) throw std::bad_alloc();
+
+    try {
+      return aligned_ptr<T>(new (p) T());
+    }
+    catch (...) {
+      ::free(p);
+      throw;
+    }
+  }
+
+  struct workload {
+    uint64_t keys;        // the key space
+    double read;          // the parts of the operations, sum to 1
+    double insert;
+    std::string distribution;
+    double theta;
+    double duration;
+  };
+
+  struct run_result {
+    std::string container;
+    std::string distribution;
+    int threads;
+    uint64_t ops;
+    uint64_t hits;
+    double seconds;
+    double bytes_per_entry;
+    size_t entries;
+  };
+
+  // the keys of a thread, drawn by the workload's distribution
+  class key_source {
+  public:
+
+    key_source(const workload& w, uint64_t seed) : _keys(w.keys), _state(seed | 1) {
+      if (w.distribution == "zipf") _zipf.reset(new bench::zipf_generator(w.keys, w.theta, seed));
+    }
+
+    key_type next() {
+      if (_zipf) return _zipf->next();
+
+      return random() % _keys;
+    }
+
+    // xorshift64, cheap enough not to be measured
+    uint64_t random() {
+      _state ^= _state << 13;
+      _state ^= _state >> 7;
+      _state ^= _state << 17;
+
+      return _state;
+    }
+
+  private:
+
+    uint64_t _keys;
+    uint64_t _state;
+    std::unique_ptr<bench::zipf_generator> _zipf;
+  };
+
+  template<typename Adapter>
+  run_result run_container(const std::string& name, const workload& w, int threads) {
+    run_result r;
+    r.container = name;
+    r.distribution = w.distribution;
+    r.threads = threads;
+    r.ops = 0;
+    r.hits = 0;
+
+    // give the memory of the last container back, so the resident growth is of this one
+    ::malloc_trim(0);
+    uint64_t before = bench::resident_bytes();
+
+    aligned_ptr<Adapter> map = make_aligned<Adapter>();
+    for (key_type k = 0; k < w.keys; k += 2) map->insert(k, k);
+
+    r.entries = map->size();
+    uint64_t after = bench::resident_bytes();
+    r.bytes_per_entry = r.entries && after > before ? 1.0 * (after - before) / r.entries : 0;
+
+    // the zipf tables are made before the start, they take O(keys)
+    std::vector<std::unique_ptr<key_source>> sources;
+    for (int i = 0; i < threads; ++i) sources.emplace_back(new key_source(w, 0x9E3779B97F4A7C15ULL * (i + 1)));
+
+    std::atomic<int> ready(0);
+    std::atomic<bool> go(false), stop(false);
+    std::vector<uint64_t> ops(threads, 0), hits(threads, 0);
+
+    uint64_t read_bound = static_cast<uint64_t>(w.read * 1000000);
+    uint64_t insert_bound = read_bound + static_cast<uint64_t>(w.insert * 1000000);
+
+    std::vector<std::thread> workers;
+    for (int i = 0; i < threads; ++i) {
+      workers.push_back(std::thread([&, i]() {
+        key_source& keys = *sources[i];
+        uint64_t n = 0, h = 0;
+
+        ++ready;
+        while (!go.load(std::memory_order_acquire)) std::this_thread::yield();
+
+        while (!stop.load(std::memory_order_relaxed)) {
+          // a batch between the checks of the flag
+          for (int j = 0; j < 64; ++j) {
+            key_type k = keys.next();
+            uint64_t op = keys.random() % 1000000;
+
+            bool hit;
+            if (op < read_bound) hit = map->find(k);
+            else if (op < insert_bound) hit = map->insert(k, k);
+            else hit = map->erase(k);
+
+            h += hit;
+          }
+
+          n += 64;
+        }
+
+        ops[i] = n;
+        hits[i] = h;
+      }));
+    }
+
+    while (ready.load() < threads) std::this_thread::yield();
+
+    auto start = std::chrono::steady_clock::now();
+    go.store(true, std::memory_order_release);
+    std::this_thread::sleep_for(std::chrono::duration<double>(w.duration));
+    stop = true;
+
+    for (auto& t : workers) t.join();
+    r.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    for (int i = 0; i < threads; ++i) {
+      r.ops += ops[i];
+      r.hits += hits[i];
+    }
+
+    return r;
+  }
+
+  typedef std::function<run_result(const workload&, int)> container_runner;
+
+  std::map<std::string, container_runner> make_containers() {
+    std::map<std::string, container_runner> containers;
+
+    containers["skip_list"] = std::bind(run_container<skip_list_adapter>, "skip_list",
+        std::placeholders::_1, std::placeholders::_2);
+    containers["btree_map"] = std::bind(run_container<locked_adapter<atlas::btree_map<key_type, value_type>>>,
+        "btree_map", std::placeholders::_1, std::placeholders::_2);
+    containers["safe_btree_map"] = std::bind(run_container<locked_adapter<atlas::safe_btree_map<key_type, value_type>>>,
+        "safe_btree_map", std::placeholders::_1, std::placeholders::_2);
+    containers["ttree_map"] = std::bind(run_container<locked_adapter<atlas::ttree_map<key_type, value_type>>>,
+        "ttree_map", std::placeholders::_1, std::placeholders::_2);
+    containers["concurrent_btree_map"] = std::bind(run_container<concurrent_btree_adapter>, "concurrent_btree_map",
+        std::placeholders::_1, std::placeholders::_2);
+    containers["concurrent_box"] = std::bind(run_container<concurrent_box_adapter>, "concurrent_box",
+        std::placeholders::_1, std::placeholders::_2);
+    containers["sharded_concurrent_box"] = std::bind(run_container<sharded_box_adapter>, "sharded_concurrent_box",
+        std::placeholders::_1, std::placeholders::_2);
+    containers["blocking_concurrent_box"] = std::bind(run_container<blocking_box_adapter>, "blocking_concurrent_box",
+        std::placeholders::_1, std::placeholders::_2);
+
+    return containers;
+  }
+
+  template<typename T>
+  std::vector<T> parse_list(const std::string& spec, const char* sep = ",") {
+    std::vector<std::string> items;
+    boost::split(items, spec, boost::is_any_of(sep), boost::token_compress_on);
+
+    std::vector<T> values;
+    for (const std::string& item : items) {
+      if (!item.empty()) values.push_back(boost::lexical_cast<T>(boost::trim_copy(item)));
+    }
+
+    return values;
+  }
+
+  void report(const run_result& r, double base_ops_per_sec, const std::string& format) {
+    double ops_per_sec = r.seconds > 0 ? r.ops / r.seconds : 0;
+    double speedup = base_ops_per_sec > 0 ? ops_per_sec / base_ops_per_sec : 0;
+    double hit_rate = r.ops ? 1.0 * r.hits / r.ops : 0;
+
+    if (format == "csv") {
+      std::cout << r.container << "," << r.distribution << "," << r.threads << "," << r.ops << "," << ops_per_sec << ","
+                << speedup << "," << hit_rate << "," << r.entries << "," << r.bytes_per_entry << std::endl;
+      return;
+    }
+
+    std::printf("%-24s %-8s %4d threads %14.0f ops/s %6.2fx %6.1f%% hits %10.1f bytes/entry\n", r.container.c_str(),
+        r.distribution.c_str(), r.threads, ops_per_sec, speedup, hit_rate * 100, r.bytes_per_entry);
+  }
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+  po::options_description desc("Allowed options");
+  desc.add_options()
+      ("help", "produce help message")
+      ("containers", po::value<std::string>()->default_value("all"),
+          "skip_list, btree_map, safe_btree_map, ttree_map, concurrent_btree_map, concurrent_box, "
+          "sharded_concurrent_box, blocking_concurrent_box separated by commas, or all")
+      ("threads", po::value<std::string>()->default_value("1,2,4,8"), "the thread counts, separated by commas")
+      ("keys", po::value<uint64_t>()->default_value(1000000), "the key space, half of it is filled before a run")
+      ("mix", po::value<std::string>()->default_value("90:5:5"), "the parts of the finds, inserts and erases")
+      ("distributions", po::value<std::string>()->default_value("uniform,zipf"), "uniform, zipf or both")
+      ("theta", po::value<double>()->default_value(0.99), "the skew of the zipf distribution, in (0, 1)")
+      ("duration", po::value<double>()->default_value(3), "the seconds of a run")
+      ("format", po::value<std::string>()->default_value("text"), "text or csv");
+
+  po::variables_map vm;
+  try {
+    po::store(po::parse_command_line(argc, argv, desc), vm);
+    po::notify(vm);
+  }
+  catch (const std::exception& e) {
+    std::cerr << e.what() << "\n" << usage << std::endl;
+    return 1;
+  }
+
+  if (vm.count("help")) {
+    std::cout << desc << std::endl;
+    return 0;
+  }
+
+  std::map<std::string, container_runner> containers = make_containers();
+
+  workload w;
+  std::vector<std::string> names;
+  std::vector<int> thread_counts;
+  std::vector<std::string> distributions;
+
+  try {
+    w.keys = std::max<uint64_t>(vm["keys"].as<uint64_t>(), 2);
+    w.theta = vm["theta"].as<double>();
+    w.duration = vm["duration"].as<double>();
+
+    std::vector<double> mix = parse_list<double>(vm["mix"].as<std::string>(), ":");
+    if (mix.size() != 3 || mix[0] + mix[1] + mix[2] <= 0) throw std::invalid_argument("the mix is finds:inserts:erases");
+    double total = mix[0] + mix[1] + mix[2];
+    w.read = mix[0] / total;
+    w.insert = mix[1] / total;
+
+    if (w.theta <= 0 || w.theta >= 1) throw std::invalid_argument("the theta must be in (0, 1)");
+
+    names = parse_list<std::string>(vm["containers"].as<std::string>());
+    if (names.size() == 1 && names[0] == "all") {
+      names.clear();
+      for (const auto& c : containers) names.push_back(c.first);
+    }
+
+    for (const std::string& name : names) {
+      if (!containers.count(name)) throw std::invalid_argument("unknown container " + name);
+    }
+
+    thread_counts = parse_list<int>(vm["threads"].as<std::string>());
+    distributions = parse_list<std::string>(vm["distributions"].as<std::string>());
+    for (const std::string& d : distributions) {
+      if (d != "uniform" && d != "zipf") throw std::invalid_argument("unknown distribution " + d);
+    }
+  }
+  catch (const std::exception& e) {
+    std::cerr << e.what() << "\n" << usage << std::endl;
+    return 1;
+  }
+
+  std::string format = vm["format"].as<std::string>();
+  if (format == "csv") {
+    std::cout << "container,distribution,threads,ops,ops_per_sec,speedup,hit_rate,entries,bytes_per_entry" << std::endl;
+  }
+
+  for (const std::string& name : names) {
+    for (const std::string& d : distributions) {
+      w.distribution = d;
+
+      double base = 0;
+      for (int threads : thread_counts) {
+        if (threads <= 0) continue;
+
+        run_result r = containers[name](w, threads);
+
+        // the speedup is over a thread of the first count, so the counts need not start from 1
+        if (base == 0 && r.seconds > 0) base = r.ops / r.seconds / threads;
+
+        report(r, base, format);
+      }
+    }
+  }
+
+  return 0;
+}
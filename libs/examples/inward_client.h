@@ -0,0 +1,102 @@
+/*
+ * inward_client.h
+ *
+ *  Created on: Sep 6, 2013
+ *      Author: vincent
+ */
+
+/*    Copyright 2011 ~ 2013 Vincent Zhang, ivincent.zhang@gmail.com
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#ifndef PIONEER_EXAMPLES_INWARD_CLIENT_H_
+#define PIONEER_EXAMPLES_INWARD_CLIENT_H_
+
+#include <memory>
+#include <string>
+#include <thread>
+
+#include <boost/bind.hpp>
+#include <glog/logging.h>
+
+#include <muduo/base/CountDownLatch.h>
+
+#include <pioneer/net/net.h>
+#include <pioneer/net/net_pools.h>
+#include <pioneer/net/net_handlers.h>
+#include <pioneer/system/thread_pool.h>
+
+namespace pioneer {
+
+  /*
+   * The inward client pool of a tool which calls the servers as an inside node does, so the calls are made by
+   * rpc::p2p_client, the responses are run by the worker pool, which must be initialized first
+   * */
+  class inward_client_service {
+  public:
+
+    inward_client_service() : _ready(1) {}
+
+    ~inward_client_service() { stop(); }
+
+  public:
+
+    // the port of the inward servers, blocks until the pool is running
+    void start(int server_port, int io_threads, int connections_per_peer) {
+      _thread.reset(new std::thread([=]() {
+        system::set_thread_name("client pool");
+
+        auto& pool = net::inward_client_pool::ref();
+        pool.set_server_port(server_port);
+        pool.set_thread_num(io_threads);
+        pool.set_connections_per_peer(connections_per_peer);
+        pool.set_local_transport(false);
+
+        pool.set_connection_callback(boost::bind(net::connection_handler::on_inward_client_connection, _1));
+        pool.set_message_callback(boost::bind(net::message_handler::on_inward_client_message, _1, _2, _3));
+        pool.set_write_complete_callback(boost::bind(net::connection_handler::on_write_complete<net::inward_tag>, _1));
+
+        pool.init();
+        pool.start(boost::bind(&muduo::CountDownLatch::countDown, &_ready));
+      }));
+
+      _ready.wait();
+    }
+
+    // blocks until all the connections to the server are established
+    void connect(const std::string& ip) {
+      muduo::CountDownLatch connected(1);
+      net::inward_client_pool::ref().connect(ip, [&connected](const std::string&) { connected.countDown(); });
+      connected.wait();
+
+      LOG(INFO) << "connected to " << ip;
+    }
+
+    void stop() {
+      if (!_thread) return;
+
+      net::inward_client_pool::ref().stop();
+      _thread->join();
+      _thread.reset();
+    }
+
+  private:
+
+    muduo::CountDownLatch _ready;
+    std::unique_ptr<std::thread> _thread;
+  };
+
+} // pioneer
+
+#endif /* PIONEER_EXAMPLES_INWARD_CLIENT_H_ */
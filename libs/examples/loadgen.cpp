@@ -0,0 +1,640 @@
+/*
+ * loadgen.cpp
+ *
+ *  Created on: Sep 6, 2013
+ *      Author: vincent
+ */
+
+/*    Copyright 2011 ~ 2013 Vincent Zhang, ivincent.zhang@gmail.com
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+/*
+ * The load generator, calls a server as an inside node does, and reports the throughput and the latency.
+ *
+ * closed : every caller waits for the response before the next call, paced if the rate is given
+ * open : the calls are sent on schedule whatever the responses, the rate is required
+ * replay : the request frames captured by a node are sent on their own schedule, sped up by --speed, whatever the
+ *   responses as the open loop, see net::traffic_capture
+ *
+ * The latencies are measured from the time a call is scheduled, not the time it's sent, or, in the closed loop,
+ * the calls missed during a long response are filled in as HdrHistogram does, so a stall of the server is not
+ * hidden by the callers waiting for it, this is the coordinated omission correction.
+ *
+ * try : pioneer_loadgen --target 127.0.0.1:9102 --mode open --rate 20000 --concurrency 4 --duration 30
+ *       pioneer_loadgen --target 127.0.0.1:9102 --mode replay --capture /tmp/pioneer.cap --speed 2
+ * */
+
+#include "config.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <boost/algorithm/string.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/program_options.hpp>
+#include <glog/logging.h>
+
+#include <atlas/fast_random.h>
+#include <atlas/rpc.h>
+#include <atlas/rpc/stats.h>
+
+#include <pioneer/net/net.h>
+#include <pioneer/net/rpc_clients.h>
+#include <pioneer/net/traffic_capture.h>
+#include <pioneer/system/thread_pool.h>
+
+#include "inward_client.h"
+#include "service/rfc_func.h"
+#include "service/rfc_func.client.ipp"
+#include "service/kv.h"
+#include "service/kv.client.ipp"
+
+namespace po = boost::program_options;
+
+using namespace pioneer;
+using namespace pioneer::rpc;
+
+using atlas::rpc::nilctx;
+using atlas::rpc::latency_histogram;
+
+namespace {
+
+  typedef std::chrono::steady_clock clock_type;
+
+  const std::string usage = "usage : pioneer_loadgen [options], try pioneer_loadgen --help";
+
+  inline uint64_t to_ns(clock_type::duration d) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(d).count();
+  }
+
+  inline void record(latency_histogram& h, uint64_t ns) {
+    ++h.counts[latency_histogram::index(ns)];
+    ++h.total;
+    h.sum += ns;
+    if (ns > h.max) h.max = ns;
+  }
+
+  // the calls the caller should have made while it waited, see recordValueWithExpectedInterval of HdrHistogram
+  inline void record(latency_histogram& h, uint64_t ns, uint64_t expected_interval) {
+    record(h, ns);
+
+    if (expected_interval == 0) return;
+    for (uint64_t missed = ns > expected_interval ? ns - expected_interval : 0; missed >= expected_interval;
+        missed -= expected_interval) {
+      record(h, missed);
+    }
+  }
+
+  /*
+   * A function the load is made of, the sample service answers accumulate only, the other functions of it
+   * return nothing, add the functions of the real services here.
+   *
+   * The kv service is called with the random keys of the key space, the value of a put is the payload, and
+   * a missing key is not an error. The loadgen calls as an inside node, so the target serves the keys
+   * itself instead of passing them on to their owners, see kv::routed
+   * */
+  struct operation {
+    std::string name;
+    std::function<rpc_result(p2p_client&, const std::vector<int>&)> sync_call;
+    std::function<void(p2p_client&, const std::vector<int>&, atlas::rpc::rpc_callback_type)> call;
+  };
+
+  struct kv_options {
+    size_t keys;          // the key space
+    size_t batch;         // the keys of a multi_get
+    size_t value;         // bytes of a value
+  };
+
+  inline std::string random_key(size_t keys) {
+    return "key" + std::to_string(atlas::fast_random() % std::max<size_t>(keys, 1));
+  }
+
+  // a missing key is a response
+  inline int kv_error(int err) { return err == kv::not_found ? 0 : err; }
+
+  std::map<int, operation> make_operations(const kv_options& kv_opts) {
+    std::map<int, operation> ops;
+
+    ops[fn_ids::accumulate] = operation{ "accumulate",
+      [](p2p_client& client, const std::vector<int>& payload) {
+        return client.sync_call(rpc_func::accumulate, fn_ids::accumulate, payload, nilctx);
+      },
+      [](p2p_client& client, const std::vector<int>& payload, atlas::rpc::rpc_callback_type cb) {
+        client.call(rpc_func::accumulate, fn_ids::accumulate, cb, payload, nilctx);
+      }
+    };
+
+    ops[fn_ids::kv_get] = operation{ "kv_get",
+      [kv_opts](p2p_client& client, const std::vector<int>&) {
+        rpc_result r = client.sync_call(kv_func::get, fn_ids::kv_get, random_key(kv_opts.keys), nilctx);
+        return kv_error(r.err()) ? r : rpc_result(r.data());
+      },
+      [kv_opts](p2p_client& client, const std::vector<int>&, atlas::rpc::rpc_callback_type cb) {
+        atlas::rpc::rpc_callback_type found = [cb](const std::string& data, int err, atlas::rpc::async_task& task) {
+          cb(data, kv_error(err), task);
+        };
+        client.call(kv_func::get, fn_ids::kv_get, found, random_key(kv_opts.keys), nilctx);
+      }
+    };
+
+    std::string value(kv_opts.value, 'v');
+    ops[fn_ids::kv_put] = operation{ "kv_put",
+      [kv_opts, value](p2p_client& client, const std::vector<int>&) {
+        return client.sync_call(kv_func::put, fn_ids::kv_put, random_key(kv_opts.keys), value, nilctx);
+      },
+      [kv_opts, value](p2p_client& client, const std::vector<int>&, atlas::rpc::rpc_callback_type cb) {
+        client.call(kv_func::put, fn_ids::kv_put, cb, random_key(kv_opts.keys), value, nilctx);
+      }
+    };
+
+    auto random_keys = [kv_opts]() {
+      std::vector<std::string> keys;
+      for (size_t i = 0; i < kv_opts.batch; ++i) keys.push_back(random_key(kv_opts.keys));
+      return keys;
+    };
+    ops[fn_ids::kv_multi_get] = operation{ "kv_multi_get",
+      [random_keys](p2p_client& client, const std::vector<int>&) {
+        return client.sync_call(kv_func::multi_get, fn_ids::kv_multi_get, random_keys(), nilctx);
+      },
+      [random_keys](p2p_client& client, const std::vector<int>&, atlas::rpc::rpc_callback_type cb) {
+        client.call(kv_func::multi_get, fn_ids::kv_multi_get, cb, random_keys(), nilctx);
+      }
+    };
+
+    return ops;
+  }
+
+  // the functions and their weights, for example, "121:3,130:1"
+  class operation_mix {
+  public:
+
+    operation_mix(const std::string& spec, const std::map<int, operation>& ops) : _total(0) {
+      std::vector<std::string> items;
+      boost::split(items, spec, boost::is_any_of(","), boost::token_compress_on);
+
+      for (const std::string& item : items) {
+        if (item.empty()) continue;
+
+        std::vector<std::string> parts;
+        boost::split(parts, item, boost::is_any_of(":"));
+
+        int fn_id = boost::lexical_cast<int>(boost::trim_copy(parts[0]));
+        uint64_t weight = parts.size() > 1 ? boost::lexical_cast<uint64_t>(boost::trim_copy(parts[1])) : 1;
+
+        auto it = ops.find(fn_id);
+        if (it == ops.end()) throw std::invalid_argument("function " + std::to_string(fn_id) + " is not supported");
+        if (weight == 0) continue;
+
+        _total += weight;
+        _choices.push_back(std::make_pair(_total, &it->second));
+      }
+
+      if (_choices.empty()) throw std::invalid_argument("no function to call in the mix " + spec);
+    }
+
+    const operation& next() const {
+      uint64_t r = atlas::fast_random() % _total;
+      for (const auto& c : _choices) {
+        if (r < c.first) return *c.second;
+      }
+
+      return *_choices.back().second;
+    }
+
+  private:
+
+    uint64_t _total;
+    std::vector<std::pair<uint64_t, const operation*>> _choices;
+  };
+
+  struct load_options {
+    std::string target;
+    std::string mode;
+    int concurrency;
+    double rate;          // calls per second of all the callers, 0 for as fast as possible
+    double duration;      // seconds measured
+    double warmup;        // seconds not measured
+    size_t payload;       // bytes of the arguments
+    std::chrono::milliseconds timeout;
+    double speed;         // of the replay, 2 sends the frames of a second in half a second
+  };
+
+  // a captured frame, at it's time from the first one
+  struct replay_frame {
+    uint64_t offset;      // nanoseconds
+    std::string data;
+  };
+
+  // the frames of the capture file in the order of their time, the captures of several nodes may be concatenated
+  std::vector<replay_frame> load_capture(const std::string& path) {
+    std::vector<replay_frame> frames;
+    net::read_capture(path, [&frames](const net::capture_record& r, const char* frame) {
+      frames.push_back(replay_frame{ r.time, std::string(frame, r.size) });
+    });
+
+    std::stable_sort(frames.begin(), frames.end(), [](const replay_frame& a, const replay_frame& b) {
+      return a.offset < b.offset;
+    });
+
+    uint64_t first = frames.empty() ? 0 : frames.front().offset;
+    for (replay_frame& f : frames) f.offset -= first;
+
+    return frames;
+  }
+
+  // the latencies of the measured calls, from the callers, or the threads which run the responses
+  class recorder {
+  public:
+
+    recorder() : _errors(0), _sent(0) {}
+
+  public:
+
+    void add(const latency_histogram& h, uint64_t errors) {
+      std::lock_guard<std::mutex> guard(_mutex);
+      _histogram.add(h);
+      _errors += errors;
+    }
+
+    void record(uint64_t ns, int err) {
+      std::lock_guard<std::mutex> guard(_mutex);
+      if (err) ++_errors;
+      else ::record(_histogram, ns);
+    }
+
+    void sent() { _sent.fetch_add(1, std::memory_order_relaxed); }
+
+    uint64_t sent_count() const { return _sent.load(std::memory_order_relaxed); }
+
+    latency_histogram histogram() const {
+      std::lock_guard<std::mutex> guard(_mutex);
+      return _histogram;
+    }
+
+    uint64_t errors() const {
+      std::lock_guard<std::mutex> guard(_mutex);
+      return _errors;
+    }
+
+  private:
+
+    mutable std::mutex _mutex;
+    latency_histogram _histogram;
+    uint64_t _errors;
+    std::atomic<uint64_t> _sent;
+  };
+
+  class load_generator {
+  public:
+
+    load_generator(const load_options& options, const operation_mix& mix, const std::vector<replay_frame>& frames) :
+      _options(options), _mix(mix), _frames(frames), _payload(std::max<size_t>(options.payload / sizeof(int), 1)),
+      _in_flight(0)
+    {
+      for (size_t i = 0; i < _payload.size(); ++i) _payload[i] = static_cast<int>(i);
+    }
+
+  public:
+
+    void run() {
+      clock_type::time_point start = clock_type::now();
+      _measure_start = start + to_duration(_options.warmup);
+      _end = _measure_start + to_duration(_options.duration);
+
+      std::vector<std::thread> callers;
+      for (int i = 0; i < _options.concurrency; ++i) {
+        if (_options.mode == "open") callers.push_back(std::thread([this, i, start]() { open_loop(i, start); }));
+        else if (_options.mode == "replay") callers.push_back(std::thread([this, i, start]() { replay_loop(i, start); }));
+        else callers.push_back(std::thread([this, i, start]() { closed_loop(i, start); }));
+      }
+
+      for (auto& t : callers) t.join();
+
+      // the open loop waits for the calls on the way, until they time out
+      clock_type::time_point deadline = clock_type::now() + _options.timeout + std::chrono::seconds(1);
+      while (_in_flight.load() > 0 && clock_type::now() < deadline) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+      }
+    }
+
+    const recorder& results() const { return _recorder; }
+
+    uint64_t in_flight() const { return _in_flight.load(); }
+
+  private:
+
+    static clock_type::duration to_duration(double seconds) {
+      return std::chrono::duration_cast<clock_type::duration>(std::chrono::duration<double>(seconds));
+    }
+
+    // the interval of the calls of a caller, 0 if it's not paced
+    uint64_t interval_ns() const {
+      return _options.rate > 0 ? static_cast<uint64_t>(1e9 * _options.concurrency / _options.rate) : 0;
+    }
+
+    std::unique_ptr<p2p_client> make_client() const {
+      std::unique_ptr<p2p_client> client(new p2p_client(rpc::inward_client, _options.target));
+      client->set_timeout(_options.timeout);
+
+      return client;
+    }
+
+    void closed_loop(int caller, clock_type::time_point start) {
+      system::set_thread_name("caller " + std::to_string(caller));
+
+      std::unique_ptr<p2p_client> client = make_client();
+      latency_histogram histogram;
+      uint64_t errors = 0;
+
+      uint64_t interval = interval_ns();
+      // the callers start evenly spread in the first interval
+      clock_type::time_point next = start + std::chrono::nanoseconds(interval * caller / _options.concurrency);
+
+      while (true) {
+        if (interval) std::this_thread::sleep_until(next);
+
+        clock_type::time_point sent = clock_type::now();
+        if (sent >= _end) break;
+
+        rpc_result result = _mix.next().sync_call(*client, _payload);
+        uint64_t latency = to_ns(clock_type::now() - sent);
+
+        if (sent >= _measure_start) {
+          _recorder.sent();
+          if (result.err()) ++errors;
+          else record(histogram, latency, interval);
+        }
+
+        // a late caller does not hurry to catch up, the missed calls are recorded already
+        if (interval) {
+          next += std::chrono::nanoseconds(interval);
+          if (next < clock_type::now()) next = clock_type::now();
+        }
+      }
+
+      _recorder.add(histogram, errors);
+    }
+
+    void open_loop(int caller, clock_type::time_point start) {
+      system::set_thread_name("caller " + std::to_string(caller));
+
+      std::unique_ptr<p2p_client> client = make_client();
+      uint64_t interval = interval_ns();
+      clock_type::time_point scheduled = start + std::chrono::nanoseconds(interval * caller / _options.concurrency);
+
+      for (; scheduled < _end; scheduled += std::chrono::nanoseconds(interval)) {
+        // a late caller sends the calls due at once, every call is timed from it's schedule
+        std::this_thread::sleep_until(scheduled);
+
+        bool measured = scheduled >= _measure_start;
+        if (measured) _recorder.sent();
+
+        _in_flight.fetch_add(1);
+        _mix.next().call(*client, _payload, [this, scheduled, measured](const std::string&, int err, atlas::rpc::async_task&) {
+          if (measured) _recorder.record(to_ns(clock_type::now() - scheduled), err);
+          _in_flight.fetch_sub(1);
+        });
+      }
+    }
+
+    // the caller sends every concurrency-th frame, the time of a frame is it's schedule
+    void replay_loop(int caller, clock_type::time_point start) {
+      system::set_thread_name("caller " + std::to_string(caller));
+
+      std::unique_ptr<p2p_client> client = make_client();
+
+      for (size_t i = caller; i < _frames.size(); i += _options.concurrency) {
+        clock_type::time_point scheduled = start + std::chrono::nanoseconds(
+            static_cast<uint64_t>(_frames[i].offset / _options.speed));
+        std::this_thread::sleep_until(scheduled);
+
+        bool measured = scheduled >= _measure_start;
+        if (measured) _recorder.sent();
+
+        _in_flight.fetch_add(1);
+        client->replay(_frames[i].data, [this, scheduled, measured](const std::string&, int err, atlas::rpc::async_task&) {
+          if (measured) _recorder.record(to_ns(clock_type::now() - scheduled), err);
+          _in_flight.fetch_sub(1);
+        });
+      }
+    }
+
+  private:
+
+    load_options _options;
+    const operation_mix& _mix;
+    const std::vector<replay_frame>& _frames;
+    std::vector<int> _payload;
+
+    clock_type::time_point _measure_start;
+    clock_type::time_point _end;
+
+    recorder _recorder;
+    std::atomic<int64_t> _in_flight;
+  };
+
+  void report(const load_options& options, const load_generator& generator, const std::string& format) {
+    latency_histogram h = generator.results().histogram();
+    uint64_t errors = generator.results().errors();
+    uint64_t sent = generator.results().sent_count();
+    // the closed loop records the missed calls too, the throughput is of the real ones
+    uint64_t completed = sent > errors ? sent - errors : 0;
+    if (options.mode != "closed") completed = h.total;
+
+    double throughput = options.duration > 0 ? completed / options.duration : 0;
+    const double qs[] = { 0.5, 0.9, 0.99, 0.999, 0.9999 };
+
+    if (format == "csv") {
+      std::cout << "mode,target,concurrency,rate,payload,duration,sent,completed,errors,lost,throughput,"
+                << "mean_us,p50_us,p90_us,p99_us,p999_us,p9999_us,max_us\n";
+      std::cout << options.mode << "," << options.target << "," << options.concurrency << "," << options.rate << ","
+                << options.payload << "," << options.duration << "," << sent << "," << completed << "," << errors << ","
+                << generator.in_flight() << "," << throughput << "," << h.mean() / 1e3;
+      for (double q : qs) std::cout << "," << h.percentile(q) / 1e3;
+      std::cout << "," << h.max / 1e3 << std::endl;
+
+      return;
+    }
+
+    char line[256];
+    std::printf("%s loop, %d callers, %.0f calls/s, %zu bytes, against %s for %.1f seconds\n",
+        options.mode.c_str(), options.concurrency, options.rate, options.payload, options.target.c_str(),
+        options.duration);
+    std::printf("sent %llu, completed %llu, errors %llu, lost %llu\n", static_cast<unsigned long long>(sent),
+        static_cast<unsigned long long>(completed), static_cast<unsigned long long>(errors),
+        static_cast<unsigned long long>(generator.in_flight()));
+    std::printf("throughput %.1f calls/s\n", throughput);
+
+    std::snprintf(line, sizeof(line), "latency (us) mean %.1f", h.mean() / 1e3);
+    std::string s(line);
+    for (double q : qs) {
+      std::snprintf(line, sizeof(line), ", p%g %.1f", q * 100, h.percentile(q) / 1e3);
+      s += line;
+    }
+    std::snprintf(line, sizeof(line), ", max %.1f", h.max / 1e3);
+    s += line;
+
+    std::cout << s << std::endl;
+  }
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+  po::options_description desc("Allowed options");
+  desc.add_options()
+      ("help", "produce help message")
+      ("target", po::value<std::string>()->default_value("127.0.0.1:" + std::to_string(PIONEER_INWARD_SERVER_PORT)),
+          "the inward address of the server, ip:port")
+      ("mode", po::value<std::string>()->default_value("closed"), "closed, open or replay")
+      ("capture", po::value<std::string>()->default_value(""), "the capture file of a node to replay, see the server's --capture_file")
+      ("speed", po::value<double>()->default_value(1), "the replay runs the speed times as fast as the capture")
+      ("concurrency", po::value<int>()->default_value(1), "the callers, each with it's own thread")
+      ("rate", po::value<double>()->default_value(0), "the calls per second of all the callers, required by the open loop")
+      ("duration", po::value<double>()->default_value(10), "the seconds measured")
+      ("warmup", po::value<double>()->default_value(2), "the seconds before the measuring")
+      ("payload", po::value<size_t>()->default_value(64), "the bytes of the arguments of a call")
+      ("mix", po::value<std::string>()->default_value(std::to_string(fn_ids::accumulate)),
+          "the function ids and weights, fn_id:weight separated by commas, for example, 141:9,142:1 for the kv service")
+      ("kv_keys", po::value<size_t>()->default_value(100000), "the key space of the kv calls")
+      ("kv_batch", po::value<size_t>()->default_value(16), "the keys of a kv_multi_get")
+      ("timeout", po::value<int>()->default_value(5000), "the timeout of a call, in milliseconds")
+      ("io_threads", po::value<int>()->default_value(2), "the I/O threads of the client pool")
+      ("connections", po::value<int>()->default_value(INWARD_CONNECTIONS_PER_PEER), "the connections to the server")
+      ("worker_threads", po::value<int>()->default_value(2), "the threads running the responses")
+      ("format", po::value<std::string>()->default_value("text"), "text or csv");
+
+  po::variables_map vm;
+  try {
+    po::store(po::parse_command_line(argc, argv, desc), vm);
+    po::notify(vm);
+  }
+  catch (const std::exception& e) {
+    std::cerr << e.what() << "\n" << usage << std::endl;
+    return 1;
+  }
+
+  if (vm.count("help")) {
+    std::cout << desc << std::endl;
+    return 0;
+  }
+
+  google::InitGoogleLogging(argv[0]);
+
+  load_options options;
+  options.target = vm["target"].as<std::string>();
+  options.mode = vm["mode"].as<std::string>();
+  options.concurrency = std::max(vm["concurrency"].as<int>(), 1);
+  options.rate = vm["rate"].as<double>();
+  options.duration = vm["duration"].as<double>();
+  options.warmup = vm["warmup"].as<double>();
+  options.payload = vm["payload"].as<size_t>();
+  options.timeout = std::chrono::milliseconds(vm["timeout"].as<int>());
+  options.speed = vm["speed"].as<double>();
+
+  if (options.mode != "closed" && options.mode != "open" && options.mode != "replay") {
+    std::cerr << "unknown mode " << options.mode << "\n" << usage << std::endl;
+    return 1;
+  }
+
+  if (options.mode == "open" && options.rate <= 0) {
+    std::cerr << "the open loop needs a rate\n" << usage << std::endl;
+    return 1;
+  }
+
+  // the capture sets the length and the rate, the warmup is of the capture's time
+  std::vector<replay_frame> frames;
+  if (options.mode == "replay") {
+    if (options.speed <= 0) {
+      std::cerr << "the replay needs a speed above 0\n" << usage << std::endl;
+      return 1;
+    }
+
+    try {
+      frames = load_capture(vm["capture"].as<std::string>());
+    }
+    catch (const std::exception& e) {
+      std::cerr << e.what() << "\n" << usage << std::endl;
+      return 1;
+    }
+    if (frames.empty()) {
+      std::cerr << "no frame to replay\n" << usage << std::endl;
+      return 1;
+    }
+
+    if (vm["warmup"].defaulted()) options.warmup = 0;
+    double span = frames.back().offset / 1e9 / options.speed;
+    options.duration = std::max(span - options.warmup, 1e-3);
+    options.rate = frames.size() / std::max(span, 1e-3);
+  }
+
+  // a value of a put is the payload
+  kv_options kv_opts = { vm["kv_keys"].as<size_t>(), std::max<size_t>(vm["kv_batch"].as<size_t>(), 1), options.payload };
+  std::map<int, operation> ops = make_operations(kv_opts);
+  std::unique_ptr<operation_mix> mix;
+  try {
+    mix.reset(new operation_mix(vm["mix"].as<std::string>(), ops));
+  }
+  catch (const std::exception& e) {
+    std::cerr << e.what() << "\n" << usage << std::endl;
+    return 1;
+  }
+
+  atlas::rpc::endpoint_id target = atlas::rpc::parse_endpoint(options.target);
+  std::string ip = atlas::rpc::ip_to_string(atlas::rpc::endpoint_ip(target));
+  int port = atlas::rpc::endpoint_port(target);
+  if (port == 0) port = PIONEER_INWARD_SERVER_PORT;
+
+  system::init_worker_pool(vm["worker_threads"].as<int>());
+  net::init_peer_stats();
+
+  inward_client_service client;
+  client.start(port, vm["io_threads"].as<int>(), vm["connections"].as<int>());
+  client.connect(ip);
+
+  // complete the calls no response arrives before the deadline
+  std::atomic<bool> running(true);
+  std::thread sweeper([&running]() {
+    system::set_thread_name("sweeper");
+
+    while (running) {
+      std::this_thread::sleep_for(atlas::rpc::async_task_manager::ref().tick());
+      atlas::rpc::sync_task_manager::ref().sweep();
+      atlas::rpc::async_task_manager::ref().sweep();
+    }
+  });
+
+  load_generator generator(options, *mix, frames);
+  generator.run();
+
+  report(options, generator, vm["format"].as<std::string>());
+
+  running = false;
+  sweeper.join();
+
+  client.stop();
+  system::worker_pool::ref().wait();
+
+  return 0;
+}
@@ -0,0 +1,353 @@
+/*
+ * log_bench.cpp
+ *
+ *  Created on: Sep 16, 2013
+ *      Author: vincent
+ */
+
+/*    Copyright 2011 ~ 2013 Vincent Zhang, ivincent.zhang@gmail.com
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+/*
+ * The benchmark of the transaction log, the commit latency and the throughput of a log file type, rolling or
+ * alternating, for every entry size and committer count of the sweep.
+ *
+ * A committer begins a transaction, commits an entry and ends the transaction in a loop, so the log rolls at
+ * max_log_size as a resource manager's does. The files are :
+ *
+ * sync : ologfile<true>, synced through the page cache
+ * direct : ologfile<true, true>, synced with O_DIRECT
+ * nosync : ologfile<false>, never synced, the cost of the encoding and the writes only
+ *
+ * --no-group makes every commit lead it's own sync, as the log did before the group commit, so the two are
+ * compared on the same disk. Run it on the disk of the logs, tmpfs has no O_DIRECT and syncs nothing.
+ *
+ * try : log_bench --dir /data/log_bench --files sync,direct --sizes 64,1024 --committers 1,4,16 --format csv
+ * */
+
+#include <cstdint>
+#include <cstdio>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <boost/algorithm/string.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/mpl/vector.hpp>
+#include <boost/program_options.hpp>
+
+#include <atlas/rpc/stats.h>
+#include <atlas/transaction/log.hpp>
+
+namespace po = boost::program_options;
+namespace fs = boost::filesystem;
+namespace bt = boost::transact;
+
+using atlas::rpc::latency_histogram;
+
+namespace {
+
+  typedef std::chrono::steady_clock clock_type;
+
+  const std::string usage = "usage : log_bench [options], try log_bench --help";
+
+  inline void record(latency_histogram& h, uint64_t ns) {
+    ++h.counts[latency_histogram::index(ns)];
+    ++h.total;
+    h.sum += ns;
+    if (ns > h.max) h.max = ns;
+  }
+
+  // an entry of a fixed size, the array is bitwise, so it's copied at once, see object_access.hpp
+  template<std::size_t Size>
+  struct bench_entry {
+    char data[Size];
+
+    template<class Archive>
+    void serialize(Archive& ar, const unsigned int) {
+      ar & data;
+    }
+  };
+
+  typedef boost::mpl::vector<bench_entry<64>, bench_entry<256>, bench_entry<1024>, bench_entry<4096>> bench_entries;
+
+  struct bench_options {
+    std::string dir;
+    double duration;
+    std::size_t max_log_size;
+    bool group;
+  };
+
+  struct bench_result {
+    std::string file;
+    std::string rolling;
+    std::size_t size;
+    int committers;
+    bool group;
+    uint64_t commits;
+    uint64_t rolls;
+    double seconds;
+    latency_histogram latency;
+  };
+
+  template<class RollingFile, std::size_t Size>
+  bench_result run_log(const bench_options& options, int committers) {
+    typedef bt::transaction_olog<bench_entries, RollingFile> log_type;
+
+    // every run starts from an empty log
+    fs::path dir(options.dir);
+    fs::remove_all(dir);
+    fs::create_directories(dir);
+
+    RollingFile file((dir / "log").string());
+    log_type log(file, options.max_log_size);
+
+    // begin_transaction() and end_transaction() are not thread safe, the commits are
+    std::mutex tx_mutex;
+    // without the group commit, a commit holds the log until it's synced
+    std::mutex commit_mutex;
+
+    std::atomic<int> ready(0);
+    std::atomic<bool> go(false), stop(false);
+    std::vector<latency_histogram> histograms(committers);
+
+    unsigned int first_log = file.log_id();
+
+    std::vector<std::thread> threads;
+    for (int i = 0; i < committers; ++i) {
+      threads.push_back(std::thread([&, i]() {
+        bench_entry<Size> entry;
+        std::fill(entry.data, entry.data + Size, static_cast<char>('a' + i % 26));
+
+        latency_histogram& h = histograms[i];
+
+        ++ready;
+        while (!go.load(std::memory_order_acquire)) std::this_thread::yield();
+
+        while (!stop.load(std::memory_order_relaxed)) {
+          clock_type::time_point start = clock_type::now();
+
+          typename log_type::id_type tx;
+          {
+            std::lock_guard<std::mutex> guard(tx_mutex);
+            tx = log.begin_transaction();
+          }
+
+          if (options.group) {
+            log.commit(entry);
+          }
+          else {
+            std::lock_guard<std::mutex> guard(commit_mutex);
+            log.commit(entry);
+          }
+
+          {
+            std::lock_guard<std::mutex> guard(tx_mutex);
+            log.end_transaction(tx);
+          }
+
+          record(h, std::chrono::duration_cast<std::chrono::nanoseconds>(clock_type::now() - start).count());
+        }
+      }));
+    }
+
+    while (ready.load() < committers) std::this_thread::yield();
+
+    clock_type::time_point start = clock_type::now();
+    go.store(true, std::memory_order_release);
+    std::this_thread::sleep_for(std::chrono::duration<double>(options.duration));
+    stop = true;
+
+    for (auto& t : threads) t.join();
+
+    bench_result r;
+    r.seconds = std::chrono::duration<double>(clock_type::now() - start).count();
+    r.size = Size;
+    r.committers = committers;
+    r.group = options.group;
+    r.rolls = file.log_id() - first_log;
+
+    for (const latency_histogram& h : histograms) r.latency.add(h);
+    r.commits = r.latency.total;
+
+    return r;
+  }
+
+  typedef std::function<bench_result(const bench_options&, int)> log_runner;
+
+  template<class File>
+  void add_sizes(std::map<std::string, std::map<std::size_t, log_runner>>& runners, const std::string& name) {
+    runners[name][64] = run_log<File, 64>;
+    runners[name][256] = run_log<File, 256>;
+    runners[name][1024] = run_log<File, 1024>;
+    runners[name][4096] = run_log<File, 4096>;
+  }
+
+  template<class File>
+  void add_file(std::map<std::string, std::map<std::size_t, log_runner>>& runners, const std::string& name) {
+    add_sizes<bt::rolling_ologfile<File>>(runners, name + "/rolling");
+    add_sizes<bt::alternating_ologfile<File>>(runners, name + "/alternating");
+  }
+
+  // the runs by "file/rolling", and by the entry size, add the new log files here
+  std::map<std::string, std::map<std::size_t, log_runner>> make_runners() {
+    std::map<std::string, std::map<std::size_t, log_runner>> runners;
+
+    add_file<bt::ologfile<true>>(runners, "sync");
+    add_file<bt::ologfile<true, true>>(runners, "direct");
+    add_file<bt::ologfile<false>>(runners, "nosync");
+
+    return runners;
+  }
+
+  template<typename T>
+  std::vector<T> parse_list(const std::string& spec) {
+    std::vector<std::string> items;
+    boost::split(items, spec, boost::is_any_of(","), boost::token_compress_on);
+
+    std::vector<T> values;
+    for (const std::string& item : items) {
+      if (!item.empty()) values.push_back(boost::lexical_cast<T>(boost::trim_copy(item)));
+    }
+
+    return values;
+  }
+
+  void report(const bench_result& r, const std::string& format) {
+    double commits_per_sec = r.seconds > 0 ? r.commits / r.seconds : 0;
+    double mb_per_sec = commits_per_sec * r.size / (1024 * 1024);
+    const double qs[] = { 0.5, 0.9, 0.99, 0.999 };
+
+    if (format == "csv") {
+      std::cout << r.file << "," << r.rolling << "," << r.size << "," << r.committers << "," << (r.group ? 1 : 0) << ","
+                << r.commits << "," << r.rolls << "," << commits_per_sec << "," << mb_per_sec << ","
+                << r.latency.mean() / 1e3;
+      for (double q : qs) std::cout << "," << r.latency.percentile(q) / 1e3;
+      std::cout << "," << r.latency.max / 1e3 << std::endl;
+
+      return;
+    }
+
+    std::printf("%-7s %-12s %5zu bytes %3d committers%s %10.0f commits/s %8.2f MB/s, latency (us)", r.file.c_str(),
+        r.rolling.c_str(), r.size, r.committers, r.group ? "" : " no group", commits_per_sec, mb_per_sec);
+    for (double q : qs) std::printf(" p%g %.1f", q * 100, r.latency.percentile(q) / 1e3);
+    std::printf(" max %.1f\n", r.latency.max / 1e3);
+  }
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+  po::options_description desc("Allowed options");
+  desc.add_options()
+      ("help", "produce help message")
+      ("dir", po::value<std::string>()->default_value("log_bench"), "the directory of the logs, emptied by every run")
+      ("files", po::value<std::string>()->default_value("sync,direct"), "sync, direct or nosync, separated by commas")
+      ("rolling", po::value<std::string>()->default_value("rolling,alternating"), "rolling, alternating or both")
+      ("sizes", po::value<std::string>()->default_value("64,256,1024,4096"), "the entry sizes, 64, 256, 1024 or 4096")
+      ("committers", po::value<std::string>()->default_value("1,4,16"), "the committer threads, separated by commas")
+      ("duration", po::value<double>()->default_value(5), "the seconds of a run")
+      ("max_log_size", po::value<std::size_t>()->default_value(64 * 1024 * 1024), "the log rolls at this size")
+      ("no-group", "every commit leads it's own sync, as without the group commit")
+      ("format", po::value<std::string>()->default_value("text"), "text or csv");
+
+  po::variables_map vm;
+  try {
+    po::store(po::parse_command_line(argc, argv, desc), vm);
+    po::notify(vm);
+  }
+  catch (const std::exception& e) {
+    std::cerr << e.what() << "\n" << usage << std::endl;
+    return 1;
+  }
+
+  if (vm.count("help")) {
+    std::cout << desc << std::endl;
+    return 0;
+  }
+
+  bench_options options;
+  options.dir = vm["dir"].as<std::string>();
+  options.duration = vm["duration"].as<double>();
+  options.max_log_size = vm["max_log_size"].as<std::size_t>();
+  options.group = !vm.count("no-group");
+
+  std::map<std::string, std::map<std::size_t, log_runner>> runners = make_runners();
+
+  std::vector<std::string> files, rollings;
+  std::vector<std::size_t> sizes;
+  std::vector<int> committer_counts;
+  try {
+    files = parse_list<std::string>(vm["files"].as<std::string>());
+    rollings = parse_list<std::string>(vm["rolling"].as<std::string>());
+    sizes = parse_list<std::size_t>(vm["sizes"].as<std::string>());
+    committer_counts = parse_list<int>(vm["committers"].as<std::string>());
+
+    for (const std::string& file : files) {
+      for (const std::string& rolling : rollings) {
+        auto it = runners.find(file + "/" + rolling);
+        if (it == runners.end()) throw std::invalid_argument("unknown log file " + file + " " + rolling);
+
+        for (std::size_t size : sizes) {
+          if (!it->second.count(size)) throw std::invalid_argument("no entry of " + std::to_string(size) + " bytes");
+        }
+      }
+    }
+  }
+  catch (const std::exception& e) {
+    std::cerr << e.what() << "\n" << usage << std::endl;
+    return 1;
+  }
+
+  std::string format = vm["format"].as<std::string>();
+  if (format == "csv") {
+    std::cout << "file,rolling,size,committers,group,commits,rolls,commits_per_sec,mb_per_sec,"
+              << "mean_us,p50_us,p90_us,p99_us,p999_us,max_us" << std::endl;
+  }
+
+  for (const std::string& file : files) {
+    for (const std::string& rolling : rollings) {
+      for (std::size_t size : sizes) {
+        for (int committers : committer_counts) {
+          if (committers <= 0) continue;
+
+          bench_result r;
+          try {
+            r = runners[file + "/" + rolling][size](options, committers);
+          }
+          catch (const std::exception& e) {
+            std::cerr << file << " " << rolling << " failed : " << e.what() << std::endl;
+            continue;
+          }
+
+          r.file = file;
+          r.rolling = rolling;
+
+          report(r, format);
+        }
+      }
+    }
+  }
+
+  fs::remove_all(options.dir);
+
+  return 0;
+}
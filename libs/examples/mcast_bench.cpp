@@ -0,0 +1,452 @@
+/*
+ * mcast_bench.cpp
+ *
+ *  Created on: Sep 12, 2013
+ *      Author: vincent
+ */
+
+/*    Copyright 2011 ~ 2013 Vincent Zhang, ivincent.zhang@gmail.com
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+/*
+ * The multicast benchmark, sweeps the datagram size, the rate and the senders, and measures the loss,
+ * the reordering and the one way latency of every run from the timestamps in the probes, one csv line a run.
+ *
+ * loop : the senders and the receiver run in this process, over the loopback of the multicast
+ * send : the senders only, the receivers run on the other hosts with --role recv
+ * recv : the receiver only, a run is reported once the senders end it, or when the receiver quits
+ *
+ * The one way latency across the hosts is as good as the clock synchronization of them.
+ *
+ * try : mcast_bench --role loop --sizes 64,512,1400 --rates 10000,100000 --senders 1,4 --duration 5
+ * */
+
+#include "config.h"
+
+#include <time.h>
+
+#include <cstdint>
+#include <cstring>
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <boost/algorithm/string.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/program_options.hpp>
+#include <glog/logging.h>
+#include <muduo/base/CountDownLatch.h>
+#include <muduo/net/EventLoop.h>
+#include <muduo/net/EventLoopThread.h>
+
+#include <atlas/rpc/stats.h>
+#include <pioneer/net/multicast.h>
+
+namespace po = boost::program_options;
+
+using namespace pioneer;
+
+using atlas::rpc::latency_histogram;
+
+namespace {
+
+  const std::string usage = "usage : mcast_bench [options], try mcast_bench --help";
+
+  // the senders end a run by this many end probes, any one of them is enough
+  const int END_PROBES = 3;
+
+  const uint32_t PROBE_MAGIC = 0xBE4C0DE5;
+
+  enum probe_flags { probe_data = 0, probe_end = 1 };
+
+#pragma pack(1)
+
+  // at the head of every datagram, the rest of it is padding up to the size of the run
+  struct probe_header {
+    uint32_t magic;
+    uint32_t flags;     // see probe_flags
+    uint32_t run;       // the runs of a sweep are numbered from 1
+    uint16_t sender;
+    uint16_t senders;
+    uint32_t size;
+    uint32_t rate;      // datagrams per second of all the senders, 0 for unlimited
+    uint64_t seq;       // the datagrams of a sender in a run, from 0, the end probes carry the number sent
+    uint64_t sent_ns;   // the wall clock, so the hosts can be compared
+  };
+
+#pragma pack()
+
+  inline uint64_t wall_clock_ns() {
+    struct timespec ts;
+    ::clock_gettime(CLOCK_REALTIME, &ts);
+
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+  }
+
+  inline void record(latency_histogram& h, uint64_t ns) {
+    ++h.counts[latency_histogram::index(ns)];
+    ++h.total;
+    h.sum += ns;
+    if (ns > h.max) h.max = ns;
+  }
+
+  template<typename T>
+  std::vector<T> parse_list(const std::string& spec) {
+    std::vector<std::string> items;
+    boost::split(items, spec, boost::is_any_of(","), boost::token_compress_on);
+
+    std::vector<T> values;
+    for (const std::string& item : items) {
+      if (!item.empty()) values.push_back(boost::lexical_cast<T>(boost::trim_copy(item)));
+    }
+
+    return values;
+  }
+
+  struct run_config {
+    uint32_t run;
+    uint32_t size;
+    uint32_t rate;
+    uint16_t senders;
+  };
+
+  // what a receiver saw of a sender in a run
+  struct sender_stats {
+    sender_stats() : received(0), duplicates(0), reordered(0), next_seq(0), sent(0), ended(false) {}
+
+    uint64_t received;
+    uint64_t duplicates;
+    uint64_t reordered;   // arrived after a datagram sent later
+    uint64_t next_seq;    // one past the largest seq received
+    uint64_t sent;        // from the end probe
+    bool ended;
+    std::vector<bool> seen;
+  };
+
+  struct run_stats {
+    run_stats() : first_ns(0), last_ns(0), bytes(0) {}
+
+    run_config config;
+    std::vector<sender_stats> senders;
+    latency_histogram latency;
+    uint64_t first_ns;
+    uint64_t last_ns;
+    uint64_t bytes;
+
+    bool ended() const {
+      for (const auto& s : senders) {
+        if (!s.ended) return false;
+      }
+
+      return true;
+    }
+  };
+
+  void print_csv_header() {
+    std::cout << "run,size,rate,senders,recv_buffer,sent,received,lost,loss_rate,duplicates,reordered,"
+              << "received_per_sec,mbps,mean_us,p50_us,p90_us,p99_us,p999_us,max_us" << std::endl;
+  }
+
+  void print_csv(const run_stats& r) {
+    uint64_t sent = 0, received = 0, duplicates = 0, reordered = 0;
+    for (const auto& s : r.senders) {
+      // a sender whose end probes are all lost sent at least the ones seen
+      sent += s.ended ? s.sent : s.next_seq;
+      received += s.received;
+      duplicates += s.duplicates;
+      reordered += s.reordered;
+    }
+
+    uint64_t lost = sent > received ? sent - received : 0;
+    double seconds = r.last_ns > r.first_ns ? (r.last_ns - r.first_ns) / 1e9 : 0;
+    const double qs[] = { 0.5, 0.9, 0.99, 0.999 };
+
+    std::cout << r.config.run << "," << r.config.size << "," << r.config.rate << "," << r.config.senders << ","
+              << net::RECV_BUFFER_SIZE << "," << sent << "," << received << "," << lost << ","
+              << (sent ? 1.0 * lost / sent : 0) << "," << duplicates << "," << reordered << ","
+              << (seconds > 0 ? received / seconds : 0) << "," << (seconds > 0 ? r.bytes * 8 / seconds / 1e6 : 0) << ","
+              << r.latency.mean() / 1e3;
+    for (double q : qs) std::cout << "," << r.latency.percentile(q) / 1e3;
+    std::cout << "," << r.latency.max / 1e3 << std::endl;
+  }
+
+  /*
+   * Counts the probes in the loop of the multicast server, the runs ended by all their senders are reported
+   * at once, the rest when the receiver is flushed
+   * */
+  class probe_receiver {
+  public:
+
+    void on_batch(const net::mcast_datagram* datagrams, size_t count) {
+      uint64_t now = wall_clock_ns();
+
+      std::lock_guard<std::mutex> guard(_mutex);
+      for (size_t i = 0; i < count; ++i) {
+        if (datagrams[i].size < sizeof(probe_header)) continue;
+
+        probe_header h;
+        std::memcpy(&h, datagrams[i].data, sizeof(h));
+        if (h.magic != PROBE_MAGIC || h.senders == 0 || h.sender >= h.senders) continue;
+
+        auto it = _runs.find(h.run);
+        if (it == _runs.end()) {
+          // a run already reported, a late end probe
+          if (h.run <= _last_reported) continue;
+
+          it = _runs.insert(std::make_pair(h.run, run_stats())).first;
+          it->second.config = run_config{ h.run, h.size, h.rate, h.senders };
+          it->second.senders.resize(h.senders);
+        }
+
+        run_stats& r = it->second;
+        sender_stats& s = r.senders[h.sender];
+
+        if (h.flags == probe_end) {
+          s.ended = true;
+          s.sent = h.seq;
+        }
+        else {
+          count_probe(r, s, h, now, datagrams[i].size);
+        }
+
+        if (r.ended()) report(it);
+      }
+    }
+
+    // report the runs not ended, the senders may be gone
+    void flush() {
+      std::lock_guard<std::mutex> guard(_mutex);
+      while (!_runs.empty()) report(_runs.begin());
+    }
+
+  private:
+
+    void count_probe(run_stats& r, sender_stats& s, const probe_header& h, uint64_t now, size_t size) {
+      if (h.seq >= s.seen.size()) s.seen.resize(std::max<size_t>(h.seq + 1, s.seen.size() * 2));
+      if (s.seen[h.seq]) {
+        ++s.duplicates;
+        return;
+      }
+
+      s.seen[h.seq] = true;
+      ++s.received;
+
+      if (h.seq < s.next_seq) ++s.reordered;
+      else s.next_seq = h.seq + 1;
+
+      record(r.latency, now > h.sent_ns ? now - h.sent_ns : 0);
+
+      if (!r.first_ns) r.first_ns = now;
+      r.last_ns = now;
+      r.bytes += size;
+    }
+
+    void report(std::map<uint32_t, run_stats>::iterator it) {
+      print_csv(it->second);
+      if (it->first > _last_reported) _last_reported = it->first;
+
+      _runs.erase(it);
+    }
+
+  private:
+
+    std::mutex _mutex;
+    std::map<uint32_t, run_stats> _runs;
+    uint32_t _last_reported = 0;
+  };
+
+  /*
+   * A sender sends it's part of the rate on schedule, one probe a datagram, by it's own udp_sender, so the
+   * senders are as many sockets and sender threads as the nodes of a cluster
+   * */
+  void send_run(const run_config& config, uint16_t sender, const std::string& group, const std::string& interface,
+      double duration, double burst) {
+    net::udp_sender out;
+    // every probe is a datagram, it's not a length prefixed frame to coalesce
+    out.set_coalescing(false);
+    out.init(group.c_str(), interface);
+
+    std::string datagram(std::max<size_t>(config.size, sizeof(probe_header)), '\0');
+
+    probe_header h;
+    h.magic = PROBE_MAGIC;
+    h.flags = probe_data;
+    h.run = config.run;
+    h.sender = sender;
+    h.senders = config.senders;
+    h.size = datagram.size();
+    h.rate = config.rate;
+    h.seq = 0;
+
+    typedef std::chrono::steady_clock clock_type;
+    uint64_t interval = config.rate ? static_cast<uint64_t>(1e9 * config.senders / config.rate) : 0;
+    // the senders start evenly spread in the first interval
+    clock_type::time_point next = clock_type::now() + std::chrono::nanoseconds(interval * sender / config.senders);
+    clock_type::time_point end = clock_type::now() + std::chrono::duration_cast<clock_type::duration>(
+        std::chrono::duration<double>(duration));
+
+    // a burst lets the datagrams due at once go out by one sendmmsg, the rest are sent on schedule
+    uint64_t burst_count = std::max<uint64_t>(1, interval ? static_cast<uint64_t>(burst * 1e9 / interval) : 1);
+
+    while (true) {
+      if (interval) std::this_thread::sleep_until(next);
+      if (clock_type::now() >= end) break;
+
+      for (uint64_t i = 0; i < burst_count; ++i) {
+        h.sent_ns = wall_clock_ns();
+        std::memcpy(&datagram[0], &h, sizeof(h));
+        if (out.send(datagram) > 0) ++h.seq;
+      }
+
+      if (interval) next += std::chrono::nanoseconds(interval * burst_count);
+    }
+
+    h.flags = probe_end;
+    for (int i = 0; i < END_PROBES; ++i) {
+      std::memcpy(&datagram[0], &h, sizeof(h));
+      out.send(datagram);
+    }
+
+    // the queued probes are sent before the socket is closed
+    out.stop();
+  }
+
+  void sweep(const std::vector<run_config>& runs, const std::string& group, const std::string& interface,
+      double duration, double rest, double burst) {
+    for (const run_config& config : runs) {
+      std::vector<std::thread> senders;
+      for (uint16_t i = 0; i < config.senders; ++i) {
+        senders.push_back(std::thread(send_run, config, i, group, interface, duration, burst));
+      }
+
+      for (auto& t : senders) t.join();
+
+      // let the receivers drain
+      std::this_thread::sleep_for(std::chrono::duration<double>(rest));
+    }
+  }
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+  po::options_description desc("Allowed options");
+  desc.add_options()
+      ("help", "produce help message")
+      ("role", po::value<std::string>()->default_value("loop"), "loop, send or recv")
+      ("group", po::value<std::string>()->default_value("234.1.1.99"),
+          "the multicast group, not the one of the cluster, or an IPv4 broadcast address")
+      ("interface", po::value<std::string>()->default_value(PIONEER_MCAST_INTERFACE),
+          "the interface by name or address, empty to let the kernel choose")
+      ("sizes", po::value<std::string>()->default_value("64,256,1024,1400"), "the datagram sizes, in bytes")
+      ("rates", po::value<std::string>()->default_value("10000,50000,100000"),
+          "the datagrams per second of all the senders, 0 for as fast as possible")
+      ("senders", po::value<std::string>()->default_value("1,2,4"), "the sender counts, each with it's own socket")
+      ("duration", po::value<double>()->default_value(5), "the seconds a run sends")
+      ("rest", po::value<double>()->default_value(1), "the seconds between the runs")
+      ("burst", po::value<double>()->default_value(0), "the seconds of the rate sent at once, 0 for one datagram")
+      ("first_run", po::value<uint32_t>()->default_value(1), "the number of the first run, to tell the sweeps apart");
+
+  po::variables_map vm;
+  try {
+    po::store(po::parse_command_line(argc, argv, desc), vm);
+    po::notify(vm);
+  }
+  catch (const std::exception& e) {
+    std::cerr << e.what() << "\n" << usage << std::endl;
+    return 1;
+  }
+
+  if (vm.count("help")) {
+    std::cout << desc << std::endl;
+    return 0;
+  }
+
+  google::InitGoogleLogging(argv[0]);
+
+  std::string role = vm["role"].as<std::string>();
+  std::string group = vm["group"].as<std::string>();
+  std::string interface = vm["interface"].as<std::string>();
+  double duration = vm["duration"].as<double>();
+  double rest = vm["rest"].as<double>();
+
+  if (role != "loop" && role != "send" && role != "recv") {
+    std::cerr << "unknown role " << role << "\n" << usage << std::endl;
+    return 1;
+  }
+
+  std::vector<run_config> runs;
+  try {
+    uint32_t run = vm["first_run"].as<uint32_t>();
+    for (uint16_t senders : parse_list<uint16_t>(vm["senders"].as<std::string>())) {
+      for (uint32_t rate : parse_list<uint32_t>(vm["rates"].as<std::string>())) {
+        for (uint32_t size : parse_list<uint32_t>(vm["sizes"].as<std::string>())) {
+          if (senders == 0) continue;
+          if (size > net::MAX_COALESCED_SIZE) throw std::invalid_argument("a datagram is " + std::to_string(size)
+              + " bytes, larger than " + std::to_string(net::MAX_COALESCED_SIZE));
+
+          runs.push_back(run_config{ run++, size, rate, senders });
+        }
+      }
+    }
+  }
+  catch (const std::exception& e) {
+    std::cerr << e.what() << "\n" << usage << std::endl;
+    return 1;
+  }
+
+  if (role == "send") {
+    sweep(runs, group, interface, duration, rest, vm["burst"].as<double>());
+    return 0;
+  }
+
+  muduo::net::EventLoopThread loop_thread;
+  muduo::net::EventLoop* loop = loop_thread.startLoop();
+
+  probe_receiver receiver;
+  std::unique_ptr<net::mcast_server> server(new net::mcast_server(loop, group.c_str(), interface));
+  server->set_batch_callback([&receiver](const net::mcast_datagram* datagrams, size_t count) {
+    receiver.on_batch(datagrams, count);
+  });
+  server->start();
+
+  print_csv_header();
+
+  if (role == "loop") {
+    sweep(runs, group, interface, duration, rest, vm["burst"].as<double>());
+  }
+  else {
+    // receive until the input is closed, for example, by ctrl-d
+    std::string line;
+    while (std::getline(std::cin, line)) {}
+  }
+
+  // the server is destroyed in it's loop
+  muduo::CountDownLatch destroyed(1);
+  loop->runInLoop([&server, &destroyed]() {
+    server.reset();
+    destroyed.countDown();
+  });
+  destroyed.wait();
+
+  receiver.flush();
+
+  return 0;
+}
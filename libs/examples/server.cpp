@@ -24,23 +24,48 @@
 
 #include <signal.h>
 
+#include <algorithm>
 #include <cstdlib>
+#include <condition_variable>
+#include <iostream>
+#include <chrono>
 #include <memory>
+#include <mutex>
 #include <thread>
+#include <string>
+#include <vector>
 
+#include <boost/algorithm/string.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/program_options.hpp>
 
+#include <muduo/base/CountDownLatch.h>
 #include <muduo/net/EventLoop.h>
 
 #include <pioneer/net/net.h>
 #include <pioneer/net/net_pools.h>
 #include <pioneer/net/net_handlers.h>
+#include <pioneer/net/call_batches.h>
+#include <pioneer/net/rx_timestamps.h>
+#include <pioneer/net/fair_queue.h>
+#include <pioneer/net/fast_open.h>
+#include <pioneer/net/housekeeping.h>
+#include <pioneer/net/http_gateway.h>
 #include <pioneer/net/multicast.h>
+#include <pioneer/net/xdp_receiver.h>
 #include <pioneer/net/rpc_clients.h>
+#include <pioneer/system/async_logging.h>
+#include <pioneer/system/runtime_config.h>
+
+// the loops of the server are created by our default poller, see net::uring_poller
+#define PIONEER_URING_POLLER
+#include <pioneer/net/uring_poller.h>
 
 #include "service/rfc_func.h"
 #include "service/rfc_func.server.ipp"
+#include "service/cluster_bench.server.ipp"
+#include "service/kv.h"
+#include "service/kv.server.ipp"
 
 namespace bf = boost::filesystem;
 
@@ -56,9 +81,11 @@ using namespace pioneer;
 std::shared_ptr<EventLoop> g_report_server_base_loop;
 std::shared_ptr<EventLoop> g_inward_server_base_loop;
 std::shared_ptr<EventLoop> g_outward_server_base_loop;
-std::shared_ptr<net::mcast_server> g_mcast_server;
+std::shared_ptr<EventLoop> g_mcast_server_base_loop;
+// thread per core, sized before the loops start
+std::vector<std::shared_ptr<EventLoop>> g_core_loops;
 
-void at_signal() {
+void quit_all() {
   if (system::context::system_quitting) {
     LOG(INFO) << "the system is already quitting";
 
@@ -69,11 +96,24 @@ void at_signal() {
 
   net::inward_client_pool::ref().stop();
   net::mcast_client::ref().stop();
+  net::bcast_client::ref().stop();
+  net::mcast_channels::ref().stop();
 
-  if (g_mcast_server) g_mcast_server->stop();
+  if (g_mcast_server_base_loop) g_mcast_server_base_loop->quit();
   if (g_report_server_base_loop) g_report_server_base_loop->quit();
+  net::housekeeping::ref().quit();
   if (g_inward_server_base_loop) g_inward_server_base_loop->quit();
   if (g_outward_server_base_loop) g_outward_server_base_loop->quit();
+  for (auto& loop : g_core_loops) {
+    if (loop) loop->quit();
+  }
+}
+
+// the first signal drains the node if it's enabled, see net::drain, the second one quits at once
+void at_signal() {
+  if (net::drain::ref().request()) return;
+
+  quit_all();
 }
 
 void signal_handler(int signal_no) {
@@ -93,10 +133,14 @@ class pioneer_server {
 public:
 
   pioneer_server(int outward_port, int inward_port, int reporter_port,
-      int outward_server_threads, int inward_server_threads, int icp_threads, bool logtostderr) :
+      int outward_server_threads, int inward_server_threads, int icp_threads,
+      int worker_threads, const std::string& worker_cpus, int worker_numa_node, bool worker_inline, bool worker_ordered,
+      bool thread_per_core, bool reuseport, bool logtostderr) :
     _outward_server_address(outward_port), _inward_server_address(inward_port), _report_server_address(reporter_port),
     _outward_server_threads(outward_server_threads), _inward_server_threads(inward_server_threads), _icp_threads(icp_threads),
-    _logtostderr(logtostderr)
+    _worker_threads(worker_threads), _worker_cpus(worker_cpus), _worker_numa_node(worker_numa_node), _worker_inline(worker_inline),
+    _worker_ordered(worker_ordered), _thread_per_core(thread_per_core), _reuseport(reuseport),
+    _logtostderr(logtostderr), _services_ready(service_count), _kv_bootstrap(false), _mcast_xdp(false)
   {
   }
 
@@ -114,14 +158,37 @@ public:
 
 public:
 
+  // the inside nodes connected before the node is ready, the gossip seeds
+  void set_initial_peers(const std::vector<std::string>& peers) { _initial_peers = peers; }
+
+  // a node joining the cluster pulls the keys of the kv service it owns once it's connected, see rpc::kv::pull
+  void set_kv_bootstrap(bool bootstrap) { _kv_bootstrap = bootstrap; }
+
+  // the datagrams of the cluster group are received by AF_XDP if it's supported, see net::xdp_receiver
+  void set_mcast_xdp(bool xdp) { _mcast_xdp = xdp; }
+
   void start() {
+    // the startup time is reported as pioneer_startup_seconds, see net::metrics
+    std::chrono::steady_clock::time_point start_time = std::chrono::steady_clock::now();
+
     // ****************************** local system ****************************
     init_glog();
 
     install_signal_handlers();
 
+    // the threads are profiled by their names, see system::profiler
+    system::set_thread_name("main");
+    system::init_profiler(PROFILER_HZ);
+
+    // the workers are ready before any request arrives
+    init_worker_pool();
+
+    // the settings tuned while running
+    register_runtime_config();
+
     // ****************************** report server ********************************
     start_report_server();
+    start_housekeeping();
 
     // ****************************** main UDP service *****************************
     // start the mcast server so that we can receive UDP messages from the cluster
@@ -130,16 +197,32 @@ public:
     init_mcast_client();
 
     // ****************************** main TCP server ******************************
-    // start a TCP server in a standalone thread for TCP requests from outward the cluster
-    start_outward_server();
-    // start a TCP server in a standalone thread for TCP requests from inward the cluster
-    start_inward_server();
+    if (_thread_per_core) {
+      // or a loop per core serves both
+      start_core_servers();
+    }
+    else {
+      // start a TCP server in a standalone thread for TCP requests from outward the cluster
+      start_outward_server();
+      // start a TCP server in a standalone thread for TCP requests from inward the cluster
+      start_inward_server();
+    }
 
     // ****************************** main TCP client service ***********************
     // init inner client pool so that we can establish connections to other inner nodes
     init_inward_client_pool();
 
-    sleep(5); // TODO : avoid hard coding
+    // wait until all the services are running
+    _services_ready.wait();
+
+    system::status::startup_time = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - start_time).count();
+
+    LOG(INFO) << "all the services are running in " << system::status::startup_time / 1000.0 << " ms";
+
+    connect_initial_peers();
+    if (_kv_bootstrap) rpc::kv::bootstrap();
+    system::status::ready = true;
 
     LOG(INFO) << "\n\n====================let's go====================\n\n";
 
@@ -156,16 +239,83 @@ public:
     if (g_outward_server_base_loop) g_outward_server_base_loop.reset();
     if (g_inward_server_base_loop) g_inward_server_base_loop.reset();
     if (g_report_server_base_loop) g_report_server_base_loop.reset();
+    if (g_mcast_server_base_loop) g_mcast_server_base_loop.reset();
+    g_core_loops.clear();
   }
 
 protected:
 
   void init_glog() {
-    if (!_logtostderr) google::InitGoogleLogging("pioneer");
+    if (!_logtostderr) {
+      google::InitGoogleLogging("pioneer");
+      // the log files are written by a background thread, see system::async_logging
+      system::init_async_logging(ASYNC_LOG_FLUSH_INTERVAL);
+    }
 
     LOG(INFO) << "glog has been initialized";
   }
 
+  /*
+   * The settings which can be changed while running, by /pioneer/config, the reload of the config file, or
+   * cset_config, the other options take a restart
+   * */
+  void register_runtime_config() {
+    system::runtime_config& config = system::runtime_config::ref();
+
+    config.add<int>("worker_threads", "the workers, the pool still grows up to worker_max_threads",
+        []() { return static_cast<int>(system::worker_pool::ref().size()); },
+        [](int n) {
+          system::worker_pool::ref().size_controller().set_bounds(n, std::max(n, WORKER_POOL_MAX_THREADS));
+        }, 1, 4096);
+
+    std::shared_ptr<std::atomic<int>> max_pending = std::make_shared<std::atomic<int>>(WORKER_POOL_MAX_PENDING);
+    config.add<int>("worker_max_pending", "the bound of the worker pool's queue, 0 for unbounded",
+        [max_pending]() { return max_pending->load(); },
+        [max_pending](int n) {
+          system::worker_pool::ref().set_max_pending(n);
+          max_pending->store(n);
+        }, 0, 100000000);
+
+    config.add<int>("outward_idle_timeout", "close the client connections idle for the seconds, 0 for never",
+        []() { return static_cast<int>(std::chrono::duration_cast<std::chrono::seconds>(net::connection_reaper::ref().idle_timeout()).count()); },
+        [](int n) { net::connection_reaper::ref().set_idle_timeout(std::chrono::seconds(n)); }, 0, 86400);
+
+    config.add<int>("outward_memory_cap", "the MB the buffers of the client connections may take, 0 for no cap",
+        []() { return static_cast<int>(net::connection_reaper::ref().memory_cap() / (1024 * 1024)); },
+        [](int n) { net::connection_reaper::ref().set_memory_cap(static_cast<size_t>(n) * 1024 * 1024); }, 0, 1024 * 1024);
+
+    config.add<int>("checksums", "end the frames built with their CRC-32C, 1 or 0",
+        []() { return atlas::rpc::message::checksums().load() ? 1 : 0; },
+        [](int on) { atlas::rpc::message::checksums() = on != 0; }, 0, 1);
+
+    config.add<int>("compression_threshold", "the smallest body compressed, in bytes",
+        []() { return static_cast<int>(net::frame_compression::ref().threshold()); },
+        [](int n) { net::frame_compression::ref().set_threshold(n); }, 0, 64 * 1024 * 1024);
+
+    config.add<int>("inward_wait_time", "the milliseconds a sender waits for an inside node to connect",
+        []() { return static_cast<int>(net::inward_connection_pool::ref().wait_time().count() / 1000); },
+        [](int n) { net::inward_connection_pool::ref().set_wait_time(std::chrono::milliseconds(n)); }, 0, 600000);
+
+    config.add<int>("outward_wait_time", "the milliseconds a sender waits for an outside node to connect",
+        []() { return static_cast<int>(net::outward_connection_pool::ref().wait_time().count() / 1000); },
+        [](int n) { net::outward_connection_pool::ref().set_wait_time(std::chrono::milliseconds(n)); }, 0, 600000);
+
+    config.add<double>("trace_sample_rate", "the part of the new traces sampled",
+        []() { return atlas::rpc::tracer::instance().sample_rate(); },
+        [](double rate) { atlas::rpc::tracer::instance().set_sample_rate(rate); }, 0.0, 1.0);
+
+    config.add<int>("trace_scopes", "record the scopes timed by ATLAS_TRACE_SCOPE, 1 or 0",
+        []() { return atlas::scope_tracer::instance().enabled() ? 1 : 0; },
+        [](int on) { atlas::scope_tracer::instance().enable(on != 0); }, 0, 1);
+
+    config.add<double>("slow_request_threshold", "the seconds a request runs to be logged as slow",
+        []() { return std::chrono::duration<double>(atlas::rpc::slow_request_log::instance().threshold()).count(); },
+        [](double seconds) {
+          atlas::rpc::slow_request_log::instance().set_threshold(std::chrono::duration_cast<std::chrono::nanoseconds>(
+              std::chrono::duration<double>(seconds)));
+        }, 0.0, 3600.0);
+  }
+
   void install_signal_handlers() {
     ::signal(SIGHUP, &signal_handler); // terminal quit
     ::signal(SIGTERM, &signal_handler); // kill
@@ -173,6 +323,22 @@ protected:
     ::signal(SIGINT, &signal_handler); // ctrl-c
   }
 
+  void init_worker_pool() {
+    // a core runs the requests it reads
+    system::init_worker_pool(_worker_threads > 0 ? _worker_threads : 0, _worker_cpus, _worker_numa_node,
+        _worker_inline || _thread_per_core, _worker_ordered);
+    system::worker_settings::inline_completions = INLINE_COMPLETIONS;
+    system::init_worker_pool_growth(WORKER_POOL_MAX_THREADS, WORKER_POOL_MAX_QUEUE_WAIT, WORKER_POOL_IDLE_TIMEOUT);
+    system::init_control_pool(CONTROL_POOL_THREADS);
+    system::init_admission_control(WORKER_POOL_MAX_PENDING, WORKER_POOL_CODEL_TARGET, WORKER_POOL_CODEL_INTERVAL);
+    atlas::rpc::tracer::instance().set_sample_rate(RPC_TRACE_SAMPLE_RATE);
+    atlas::scope_tracer::instance().enable(TRACE_SCOPES);
+    atlas::rpc::slow_request_log::instance().set_threshold(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::duration<double>(SLOW_REQUEST_THRESHOLD)));
+    atlas::rpc::slow_request_log::instance().set_capture(SLOW_REQUEST_CAPTURE_BYTES, SLOW_REQUEST_CAPTURE_RATE);
+    net::init_peer_stats();
+  }
+
   void start_report_server() {
     auto f = [this]() {
       if (g_report_server_base_loop) return;
@@ -180,11 +346,17 @@ protected:
       LOG(INFO) << "staring report server, listening at " << _report_server_address.toIpPort().c_str() << "...";
 
       g_report_server_base_loop.reset(new EventLoop);
+      net::loop_registry::ref().add("report server", g_report_server_base_loop);
       net::report_server server(g_report_server_base_loop.get(), _report_server_address, "report server");
 
       server.setHttpCallback(boost::bind(message_handler::on_report_server_message, _1, _2));
+      // the live diagnosis, see net::inspector
+      net::register_inspector_commands();
+      rpc::bench::register_commands();
+      rpc::kv::register_commands();
 
       server.start();
+      g_report_server_base_loop->queueInLoop(boost::bind(&muduo::CountDownLatch::countDown, &_services_ready));
       g_report_server_base_loop->loop();
 
       LOG(INFO) << "quit report server";
@@ -194,16 +366,88 @@ protected:
     _main_threads["report_server"] = std::make_shared<std::thread>(f);
   }
 
+  // the periodic jobs run in a loop of their own, see net::housekeeping
+  void start_housekeeping() {
+    net::housekeeping& h = net::housekeeping::ref();
+
+    h.add("rpc sweep", net::timer_handler::rpc_sweep_interval(), net::timer_handler::on_rpc_sweep_timer);
+    h.add("session sweep", 1.0, net::timer_handler::on_session_sweep_timer);
+    h.add("connection sweep", 1.0, net::timer_handler::on_connection_sweep_timer);
+    h.add("stream sweep", 1.0, net::timer_handler::on_stream_sweep_timer);
+    h.add("mcast nak", PIONEER_MCAST_NAK_INTERVAL, net::timer_handler::on_mcast_nak_timer);
+    if (PIONEER_MCAST_ACK_AGGREGATION) {
+      net::ack_aggregator::ref().set_enabled(true);
+      h.add("ack flush", PIONEER_MCAST_ACK_INTERVAL, net::timer_handler::on_ack_flush_timer);
+    }
+    h.add("log replication", PIONEER_LOG_REPLICATION_INTERVAL, net::timer_handler::on_log_replication_timer);
+    h.add("profiler", 1.0, net::timer_handler::on_profiler_timer);
+    if (net::gossip::ref().enabled()) {
+      h.add("gossip", PIONEER_GOSSIP_INTERVAL, net::timer_handler::on_gossip_timer);
+    }
+    if (net::leader_election::ref().enabled()) {
+      h.add("leader", LEADER_ELECTION_TIMEOUT / 10, net::timer_handler::on_leader_timer);
+    }
+    if (net::locality::ref().enabled()) {
+      h.add("locality", PIONEER_LOCALITY_INTERVAL, net::timer_handler::on_locality_timer);
+    }
+    if (net::drain::ref().enabled()) {
+      h.add("drain", PIONEER_DRAIN_INTERVAL, net::timer_handler::on_drain_timer);
+    }
+    // the loads are reported even if this node never passes any request on, it's peers may
+    h.add("offload", PIONEER_OFFLOAD_INTERVAL, net::timer_handler::on_offload_timer);
+    if (net::fair_queue::ref().enabled()) {
+      h.add("fair queue sweep", 10.0, []() { net::fair_queue::ref().sweep(); });
+    }
+
+    _main_threads["housekeeping"] = std::make_shared<std::thread>([]() {
+      net::housekeeping::ref().run();
+      LOG(INFO) << "quit housekeeping";
+    });
+  }
+
   void start_mcast_server() {
     auto f = [this]() {
-      if (g_mcast_server) return;
+      if (g_mcast_server_base_loop) return;
 
       LOG(INFO) << "starting mcast server...";
 
-      g_mcast_server.reset(new net::mcast_server(PIONEER_MULTIGROUP));
+      g_mcast_server_base_loop.reset(new EventLoop);
+      net::loop_registry::ref().add("mcast server", g_mcast_server_base_loop);
+      net::mcast_server server(g_mcast_server_base_loop.get(), PIONEER_MULTIGROUP, PIONEER_MCAST_INTERFACE);
 
-      g_mcast_server->set_message_callback(net::message_handler::on_mcast_message);
-      g_mcast_server->start();
+      server.set_batch_callback(net::message_handler::on_mcast_batch);
+
+      server.start();
+
+      // the socket still joins the group and receives what the program passes on to the stack
+      std::unique_ptr<net::xdp_receiver> xdp;
+      if (_mcast_xdp) {
+        xdp.reset(new net::xdp_receiver(g_mcast_server_base_loop.get(), PIONEER_MULTIGROUP, PIONEER_MCAST_INTERFACE));
+        xdp->set_batch_callback(net::message_handler::on_mcast_batch);
+        if (xdp->open()) xdp->start();
+        else xdp.reset();
+      }
+
+      // the channels share the loop, a service may set it's own callback on it's channel
+      std::vector<std::string> groups;
+      boost::split(groups, PIONEER_MCAST_CHANNELS, boost::is_any_of(","), boost::token_compress_on);
+
+      std::vector<std::shared_ptr<net::mcast_server>> channels;
+      for (const auto& group : groups) {
+        if (group.empty()) continue;
+
+        LOG(INFO) << "joining channel " << group << "...";
+
+        channels.push_back(std::make_shared<net::mcast_server>(g_mcast_server_base_loop.get(), group.c_str(),
+            PIONEER_MCAST_INTERFACE, true));
+        channels.back()->set_batch_callback(net::message_handler::on_mcast_batch);
+        channels.back()->start();
+      }
+
+      g_mcast_server_base_loop->queueInLoop(boost::bind(&muduo::CountDownLatch::countDown, &_services_ready));
+      g_mcast_server_base_loop->loop();
+
+      if (xdp) LOG(INFO) << "AF_XDP received " << xdp->received() << " datagrams, " << xdp->dropped() << " other frames";
 
       LOG(INFO) << "quit mcast server";
     };
@@ -215,7 +459,14 @@ protected:
   void init_mcast_client() {
     LOG(INFO) << "initializing mcast client...";
 
-    net::mcast_client::ref().init(PIONEER_MULTIGROUP);
+    net::mcast_client::ref().set_reliable(PIONEER_RELIABLE_MULTICAST);
+    net::mcast_client::ref().init(PIONEER_MULTIGROUP, PIONEER_MCAST_INTERFACE);
+    net::mcast_channels::ref().set_options(PIONEER_MCAST_INTERFACE, PIONEER_RELIABLE_MULTICAST);
+
+    if (*PIONEER_BCAST_ADDRESS) {
+      net::bcast_client::ref().set_reliable(PIONEER_RELIABLE_MULTICAST);
+      net::bcast_client::ref().init(PIONEER_BCAST_ADDRESS);
+    }
   }
 
   void start_outward_server() {
@@ -225,15 +476,16 @@ protected:
       LOG(INFO) << "starting outward server, listening at " << _outward_server_address.toIpPort().c_str() << "...";
 
       g_outward_server_base_loop.reset(new EventLoop);
-      net::outward_server server(g_outward_server_base_loop.get(), _outward_server_address, "outward server");
-      server.setThreadNum(_outward_server_threads);
+      net::loop_registry::ref().add("outward server", g_outward_server_base_loop);
 
-      server.setConnectionCallback(boost::bind(connection_handler::on_outward_server_connection, _1));
-      server.setMessageCallback(boost::bind(message_handler::on_outward_server_message, _1, _2, _3));
-      server.setWriteCompleteCallback(boost::bind(connection_handler::on_write_complete<outward_tag>, _1));
-
-      server.start();
-      g_outward_server_base_loop->loop();
+      if (_reuseport) {
+        net::outward_reuseport_server server(g_outward_server_base_loop.get(), _outward_server_address, "outward server");
+        serve_outward(server);
+      }
+      else {
+        net::outward_server server(g_outward_server_base_loop.get(), _outward_server_address, "outward server");
+        serve_outward(server);
+      }
 
       LOG(INFO) << "quit outward server";
     };
@@ -242,6 +494,24 @@ protected:
     _main_threads["outward_server"] = std::make_shared<std::thread>(f);
   }
 
+  // a muduo TCP server, or a SO_REUSEPORT group of the same callbacks, runs until the base loop quits
+  template<typename Server>
+  void serve_outward(Server& server) {
+    server.setThreadNum(_outward_server_threads);
+    // the I/O loops are reported until the token is destroyed, before the server
+    std::shared_ptr<void> io_loops_alive = std::make_shared<int>(0);
+    server.setThreadInitCallback(net::loop_registry::ref().io_loops("outward io", io_loops_alive));
+
+    server.setConnectionCallback(boost::bind(connection_handler::on_outward_server_connection, _1));
+    server.setMessageCallback(boost::bind(message_handler::on_outward_server_message, _1, _2, _3));
+    server.setWriteCompleteCallback(boost::bind(message_handler::on_outward_server_write_complete, _1));
+
+    start_listening(server);
+    net::fast_open::ref().enable(outward_port());
+    g_outward_server_base_loop->queueInLoop(boost::bind(&muduo::CountDownLatch::countDown, &_services_ready));
+    g_outward_server_base_loop->loop();
+  }
+
   void start_inward_server() {
     auto f = [this]() {
       if (g_inward_server_base_loop) return;
@@ -249,15 +519,16 @@ protected:
       LOG(INFO) << "starting inner server, listening at " << _inward_server_address.toIpPort().c_str() << "...";
 
       g_inward_server_base_loop.reset(new EventLoop);
-      net::inward_server server(g_inward_server_base_loop.get(), _inward_server_address, "inward server");
-      server.setThreadNum(_inward_server_threads);
+      net::loop_registry::ref().add("inward server", g_inward_server_base_loop);
 
-      server.setConnectionCallback(boost::bind(connection_handler::on_inward_server_connection, _1));
-      server.setMessageCallback(boost::bind(message_handler::on_inward_server_message, _1, _2, _3));
-      server.setWriteCompleteCallback(boost::bind(connection_handler::on_write_complete<inward_tag>, _1));
-
-      server.start();
-      g_inward_server_base_loop->loop();
+      if (_reuseport) {
+        net::inward_reuseport_server server(g_inward_server_base_loop.get(), _inward_server_address, "inward server");
+        serve_inward(server);
+      }
+      else {
+        net::inward_server server(g_inward_server_base_loop.get(), _inward_server_address, "inward server");
+        serve_inward(server);
+      }
 
       LOG(INFO) << "quit inward server";
     };
@@ -266,21 +537,131 @@ protected:
     _main_threads["inward_server"] = std::make_shared<std::thread>(f);
   }
 
+  template<typename Server>
+  void serve_inward(Server& server) {
+    server.setThreadNum(_inward_server_threads);
+    // the I/O loops are reported until the token is destroyed, before the server
+    std::shared_ptr<void> io_loops_alive = std::make_shared<int>(0);
+    server.setThreadInitCallback(net::loop_registry::ref().io_loops("inward io", io_loops_alive));
+
+    server.setConnectionCallback(boost::bind(connection_handler::on_inward_server_connection, _1));
+    server.setMessageCallback(boost::bind(message_handler::on_inward_server_message, _1, _2, _3));
+    server.setWriteCompleteCallback(boost::bind(connection_handler::on_write_complete<inward_tag>, _1));
+
+    // the nodes on this host connect to the local socket, it shares the handlers with the TCP server
+    net::inward_local_server local_server(g_inward_server_base_loop.get(), inward_port(), "inward local server");
+    local_server.setThreadNum(_inward_server_threads);
+
+    local_server.setConnectionCallback(boost::bind(connection_handler::on_inward_server_connection, _1));
+    local_server.setMessageCallback(boost::bind(message_handler::on_inward_server_message, _1, _2, _3));
+    local_server.setWriteCompleteCallback(boost::bind(connection_handler::on_write_complete<inward_tag>, _1));
+
+    start_listening(server);
+    if (INWARD_LOCAL_TRANSPORT) g_inward_server_base_loop->runInLoop([&local_server]() { local_server.start(); });
+    g_inward_server_base_loop->queueInLoop(boost::bind(&muduo::CountDownLatch::countDown, &_services_ready));
+    g_inward_server_base_loop->loop();
+  }
+
+  static void start_listening(muduo::net::TcpServer& server) {
+    server.start();
+  }
+
+  // as the muduo TCP server aborts if the address is in use
+  static void start_listening(net::reuseport_group& server) {
+    if (!server.start()) LOG(FATAL) << "can not listen with SO_REUSEPORT";
+  }
+
+  /*
+   * Thread per core, every core runs one loop, which listens on both the outward and the inward port with SO_REUSEPORT,
+   * and reads, runs and answers the requests of the connections it accepts, no request crosses a thread.
+   * The cores are the worker CPUs, one loop per CPU, or as many as the worker threads if given.
+   * The first core serves the local socket too. It counts as the outward and the inward server once all the cores are up
+   * */
+  void start_core_servers() {
+    std::vector<int> cpus = _worker_cpus.empty() ? system::affinity::node_cpus(_worker_numa_node)
+        : system::affinity::parse_cpu_list(_worker_cpus);
+
+    size_t cores = _worker_threads > 0 ? _worker_threads : cpus.size();
+    if (cores == 0) cores = std::thread::hardware_concurrency();
+    if (cores == 0) cores = 1;
+
+    g_core_loops.resize(cores);
+    auto cores_ready = std::make_shared<muduo::CountDownLatch>(static_cast<int>(cores));
+
+    for (size_t i = 0; i < cores; ++i) {
+      int cpu = cpus.empty() ? -1 : cpus[i % cpus.size()];
+
+      auto f = [this, i, cpu, cores_ready]() {
+        if (cpu >= 0) {
+          system::affinity::pin_current_thread(cpu);
+          system::numa_placement::ref().placed_on_cpu(cpu);
+        }
+
+        std::shared_ptr<EventLoop> loop(new EventLoop);
+        g_core_loops[i] = loop;
+        net::loop_registry::ref().add("core " + std::to_string(i), loop);
+
+        net::outward_shard_server outward(loop.get(), _outward_server_address, "outward server");
+        outward.setConnectionCallback(boost::bind(connection_handler::on_outward_server_connection, _1));
+        outward.setMessageCallback(boost::bind(message_handler::on_outward_server_message, _1, _2, _3));
+        outward.setWriteCompleteCallback(boost::bind(message_handler::on_outward_server_write_complete, _1));
+
+        net::inward_shard_server inward(loop.get(), _inward_server_address, "inward server");
+        inward.setConnectionCallback(boost::bind(connection_handler::on_inward_server_connection, _1));
+        inward.setMessageCallback(boost::bind(message_handler::on_inward_server_message, _1, _2, _3));
+        inward.setWriteCompleteCallback(boost::bind(connection_handler::on_write_complete<inward_tag>, _1));
+
+        net::inward_local_server local_server(loop.get(), inward_port(), "inward local server");
+        local_server.setConnectionCallback(boost::bind(connection_handler::on_inward_server_connection, _1));
+        local_server.setMessageCallback(boost::bind(message_handler::on_inward_server_message, _1, _2, _3));
+        local_server.setWriteCompleteCallback(boost::bind(connection_handler::on_write_complete<inward_tag>, _1));
+
+        // as the muduo TCP server aborts if the address is in use
+        if (!outward.start() || !inward.start()) LOG(FATAL) << "core " << i << " can not listen";
+
+        if (INWARD_LOCAL_TRANSPORT && i == 0) local_server.start();
+
+        LOG(INFO) << "core " << i << (cpu >= 0 ? " on cpu " + std::to_string(cpu) : std::string()) << " is serving";
+
+        loop->queueInLoop(boost::bind(&muduo::CountDownLatch::countDown, cores_ready.get()));
+        loop->loop();
+
+        LOG(INFO) << "quit core " << i;
+      };
+
+      _main_threads["core_server_" + std::to_string(i)] = std::make_shared<std::thread>(f);
+    }
+
+    // the outward and the inward server are ready
+    auto ready = [this, cores_ready]() {
+      cores_ready->wait();
+      net::fast_open::ref().enable(outward_port());
+
+      _services_ready.countDown();
+      _services_ready.countDown();
+    };
+
+    _main_threads["core_servers_ready"] = std::make_shared<std::thread>(ready);
+  }
+
   void init_inward_client_pool() {
     auto f = [this]() {
       LOG(INFO) << "starting inner node client pool service...";
+      system::set_thread_name("client pool");
 
       auto& tcp_client_pool = net::inward_client_pool::ref();
 
       tcp_client_pool.set_server_port(PIONEER_INWARD_SERVER_PORT); // TODO : parameterize this
       tcp_client_pool.set_thread_num(_icp_threads);
+      tcp_client_pool.set_connections_per_peer(INWARD_CONNECTIONS_PER_PEER);
+      tcp_client_pool.set_local_transport(INWARD_LOCAL_TRANSPORT);
 
       tcp_client_pool.set_connection_callback(boost::bind(net::connection_handler::on_inward_client_connection, _1));
       tcp_client_pool.set_message_callback(boost::bind(net::message_handler::on_inward_client_message, _1, _2, _3));
       tcp_client_pool.set_write_complete_callback(boost::bind(net::connection_handler::on_write_complete<net::inward_tag>, _1));
 
       tcp_client_pool.init();
-      tcp_client_pool.start();
+      tcp_client_pool.start(boost::bind(&muduo::CountDownLatch::countDown, &_services_ready));
 
       LOG(INFO)<<"quit inner client pool service";
     };
@@ -289,8 +670,47 @@ protected:
     _main_threads["inward_client_pool"] = std::make_shared<std::thread>(f);
   }
 
+  /*
+   * The initial peers are connected in parallel, once the client pool is running, and waited for until the timeout,
+   * so a peer down delays the readiness by the timeout at most
+   * */
+  void connect_initial_peers() {
+    if (_initial_peers.empty()) return;
+
+    struct state {
+      std::mutex mutex;
+      std::condition_variable cv;
+      size_t left;
+    };
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    std::shared_ptr<state> s = std::make_shared<state>();
+    s->left = _initial_peers.size();
+
+    for (const std::string& peer : _initial_peers) {
+      net::inward_client_pool::ref().connect(peer, [s](const std::string&) {
+        std::lock_guard<std::mutex> guard(s->mutex);
+        if (--s->left == 0) s->cv.notify_all();
+      });
+    }
+
+    std::unique_lock<std::mutex> lock(s->mutex);
+    s->cv.wait_for(lock, std::chrono::duration<double>(PIONEER_INITIAL_PEERS_TIMEOUT), [&s]() { return s->left == 0; });
+
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    if (s->left) LOG(WARNING) << s->left << " of " << _initial_peers.size() << " initial peers are not connected in " << ms << " ms";
+    else LOG(INFO) << "the initial peers are connected in " << ms << " ms";
+  }
+
+  uint16_t inward_port() const { return ntohs(_inward_server_address.portNetEndian()); }
+
+  uint16_t outward_port() const { return ntohs(_outward_server_address.portNetEndian()); }
+
   void at_exit() {
     LOG(INFO) << "all services are stopped, do the cleaning";
+
+    net::traffic_capture::ref().stop();
+    system::async_logging::ref().stop();
   }
 
 private:
@@ -303,8 +723,23 @@ private:
   int _inward_server_threads; // inner server thread number
   int _icp_threads;  // inner client pool thread number
 
+  int _worker_threads; // worker pool thread number, 0 for one per CPU
+  std::string _worker_cpus; // the CPUs the workers are pinned to
+  int _worker_numa_node; // the NUMA node the workers run on
+  bool _worker_inline; // run the requests on the I/O loops
+  bool _worker_ordered; // run the requests of a connection in order
+  bool _thread_per_core; // a loop per core serves the outward and inward requests
+  bool _reuseport; // every I/O loop of the outward and inward servers accepts with SO_REUSEPORT
+
   bool _logtostderr;
 
+  // report server, mcast server, outward server, inward server and inward client pool
+  static const int service_count = 5;
+  muduo::CountDownLatch _services_ready;
+  std::vector<std::string> _initial_peers;
+  bool _kv_bootstrap; // pull the keys of the kv service once connected
+  bool _mcast_xdp; // receive the cluster group by AF_XDP
+
   std::map<std::string, std::shared_ptr<std::thread>> _main_threads;
 };
 
@@ -316,17 +751,90 @@ int main(int argc, char* argv[]) {
   po::options_description desc("allowed options:");
   desc.add_options()
       ("help", "Usage : [options]...")
+      ("config", po::value<std::string>(), "read the options from the file of name = value lines, reloaded by /pioneer/config/reload")
       ("outward_port", po::value<int>()->default_value(PIONEER_OUTWARD_SERVER_PORT), "outward server port")
       ("inward_port", po::value<int>()->default_value(PIONEER_INWARD_SERVER_PORT), "inward server port")
       ("reporter_port", po::value<int>()->default_value(PIONEER_REPORT_SERVER_PORT), "report server port")
       ("outward_server_threads", po::value<int>()->default_value(OUTWARD_SERVER_THREADS), "outward server thread number")
       ("inward_server_threads", po::value<int>()->default_value(INWARD_SERVER_THREADS), "inward server thread number")
       ("icp_threads", po::value<int>()->default_value(INWARD_CLIENT_POOL_THREADS), "inward client pool thread number")
+      ("worker_threads", po::value<int>()->default_value(WORKER_POOL_THREADS), "worker thread number, 0 for one per CPU")
+      ("worker_cpus", po::value<std::string>()->default_value(WORKER_POOL_CPUS), "pin the workers to the CPUs, for example, 2-7")
+      ("worker_numa_node", po::value<int>()->default_value(WORKER_POOL_NUMA_NODE), "run the workers on the NUMA node, -1 for any")
+      ("worker_inline", po::value<bool>()->default_value(WORKER_POOL_INLINE), "run the requests on the I/O threads")
+      ("worker_ordered", po::value<bool>()->default_value(WORKER_POOL_ORDERED), "run the requests of a connection in order")
+      ("thread_per_core", po::value<bool>()->default_value(THREAD_PER_CORE), "a loop per core accepts, runs and answers the requests")
+      ("reuseport", po::value<bool>()->default_value(REUSEPORT), "every I/O loop of the TCP servers accepts with SO_REUSEPORT")
+      ("outward_socket_profile", po::value<std::string>()->default_value(OUTWARD_SOCKET_PROFILE),
+          "the options of the client sockets, default, latency, busy_poll or throughput")
+      ("inward_socket_profile", po::value<std::string>()->default_value(INWARD_SOCKET_PROFILE),
+          "the options of the sockets between the nodes, default, latency, busy_poll or throughput")
+      ("outward_fast_open", po::value<int>()->default_value(OUTWARD_FAST_OPEN),
+          "the queue of TCP Fast Open of the outward listeners, the first request rides in the SYN, 0 for off")
+      ("rx_timestamps", po::value<std::string>()->default_value(RX_TIMESTAMPS),
+          "the receive stamps of the kernel, off, software or hardware, the TCP requests take the loop's wake up")
+      ("outward_idle_timeout", po::value<int>()->default_value(OUTWARD_IDLE_TIMEOUT), "close the client connections idle for the seconds, 0 for never")
+      ("outward_memory_cap", po::value<int>()->default_value(OUTWARD_MEMORY_CAP), "the MB the buffers of the client connections may take, 0 for no cap")
+      ("tls_cert", po::value<std::string>()->default_value(TLS_CERT), "the certificate chain of the outward server in PEM, TLS is off if empty")
+      ("tls_key", po::value<std::string>()->default_value(TLS_KEY), "the private key of the outward server in PEM")
+      ("compression", po::value<bool>()->default_value(COMPRESSION), "send the large frames with LZ4 to the peers which accept it")
+      ("compression_threshold", po::value<int>()->default_value(COMPRESSION_THRESHOLD), "the smallest body compressed, in bytes")
+      ("frame_chunks", po::value<bool>()->default_value(FRAME_CHUNKS), "send the large frames in chunks to the peers which accept it, so the small ones pass them")
+      ("checksums", po::value<bool>()->default_value(CHECKSUMS), "end the frames built with their CRC-32C, the receivers check it before they run them")
+      ("result_cache_size", po::value<int>()->default_value(RESULT_CACHE_SIZE), "the MB the results of the pure functions may take, 0 for no cache")
+      ("io_uring", po::value<bool>()->default_value(IO_URING), "the loops poll with io_uring, or epoll if it's not supported")
+      ("numa", po::value<std::string>()->default_value(NUMA_PLACEMENT), "place the I/O loops and the workers on the NUMA nodes, off, spread or nic")
+      ("numa_interface", po::value<std::string>()->default_value(NUMA_INTERFACE), "the NIC whose node takes the I/O loops and the workers with --numa nic")
+      ("huge_pages", po::value<std::string>()->default_value(HUGE_PAGES), "the arenas and the receive rings on 2MB pages, off, transparent or reserved")
+      ("gossip", po::value<bool>()->default_value(GOSSIP), "the inside nodes are known by gossip instead of the announcing")
+      ("gossip_seeds", po::value<std::string>()->default_value(GOSSIP_SEEDS), "the inside nodes to join by, for example, ip,ip2")
+      ("mcast_xdp", po::value<bool>()->default_value(MCAST_XDP), "receive the cluster group by AF_XDP before the network stack, needs a named PIONEER_MCAST_INTERFACE")
+      ("mcast_dedupe", po::value<bool>()->default_value(MCAST_DEDUPE), "drop the multicast datagrams delivered twice in the window")
+      ("mcast_dedupe_window", po::value<int>()->default_value(MCAST_DEDUPE_WINDOW), "how long a multicast datagram is remembered at least, in milliseconds")
+      ("mcast_suppress_self", po::value<bool>()->default_value(MCAST_SUPPRESS_SELF), "drop the copies of this node's own multicasts looped back, they are run in process with --local_shortcut, or not at all")
+      ("capture_file", po::value<std::string>()->default_value(CAPTURE_FILE), "capture the request frames into the file, to replay them with pioneer_loadgen, none if empty")
+      ("capture_max_mb", po::value<int>()->default_value(CAPTURE_MAX_MB), "the capture stops once the file grows to the MB")
+      ("local_shortcut", po::value<bool>()->default_value(LOCAL_SHORTCUT), "run the calls of this node to itself in process, the multicast ones need the reliable multicast")
+      ("topology", po::value<std::string>()->default_value(TOPOLOGY), "the inward connections, full_mesh, random or rack, needs --gossip but the full mesh")
+      ("overlay_degree", po::value<int>()->default_value(OVERLAY_DEGREE), "the links of a node to the random members on the random topology")
+      ("rack_prefix", po::value<int>()->default_value(RACK_PREFIX), "the ip prefix length of a rack on the rack topology")
+      ("leader_election", po::value<bool>()->default_value(LEADER_ELECTION), "the cluster wide actions run on the elected leader only")
+      ("zone", po::value<std::string>()->default_value(ZONE), "the zone of this node, the requests to any inside node go to the nearest ones")
+      ("rack", po::value<std::string>()->default_value(RACK), "the rack of this node in it's zone")
+      ("drain_timeout", po::value<double>()->default_value(DRAIN_TIMEOUT), "at the first signal, finish the work in flight for the seconds at most before quitting, 0 to quit at once")
+      ("offload_threshold", po::value<double>()->default_value(OFFLOAD_THRESHOLD), "pass the requests opted in on to the less loaded inside nodes above the queued tasks per worker, 0 for never")
+      ("client_quota", po::value<double>()->default_value(CLIENT_QUOTA), "the requests per second of an outward client, the ones beyond are answered busy, 0 for no quota")
+      ("client_quota_burst", po::value<double>()->default_value(CLIENT_QUOTA_BURST), "the requests an outward client may send at once within it's quota, 0 for one second of it")
+      ("fair_queue_in_flight", po::value<int>()->default_value(FAIR_QUEUE_IN_FLIGHT), "the outward requests in the worker pool at once, the others wait their clients' turns, 0 for no fair queueing")
+      ("fair_queue_quantum", po::value<int>()->default_value(FAIR_QUEUE_QUANTUM), "the request bytes a client is given a turn in the fair queue")
+      ("fair_queue_max_queued", po::value<int>()->default_value(FAIR_QUEUE_MAX_QUEUED), "the requests a client may have waiting in the fair queue, the ones beyond are answered busy, 0 for no bound")
+      ("fair_queue_by_client_id", po::value<bool>()->default_value(FAIR_QUEUE_BY_CLIENT_ID), "tell the outward clients by their ip and the client id of their requests, not by their ip only")
+      ("jemalloc_arenas", po::value<bool>()->default_value(JEMALLOC_ARENAS), "the threads of a role allocate from a jemalloc arena of their own, if the server runs on jemalloc")
+      ("http_gateway", po::value<bool>()->default_value(HTTP_GATEWAY), "call the functions by HTTP/JSON on the outward port as well, POST /rpc/<name> with a JSON array of the arguments")
+      ("http_gateway_max_body", po::value<int>()->default_value(HTTP_GATEWAY_MAX_BODY), "the largest HTTP body the gateway takes, in bytes")
+      ("call_batch_size", po::value<int>()->default_value(CALL_BATCH_SIZE), "the queued requests of a function with a batch handler run together, so many at most, 0 runs them one by one")
+      ("kv_log", po::value<std::string>()->default_value(KV_LOG), "log the puts of the kv service to the files of the name, replayed at start, in memory only if empty")
+      ("kv_bootstrap", po::value<bool>()->default_value(KV_BOOTSTRAP), "pull the keys this node owns from the inside nodes once it's connected")
       ("logtostderr", po::value<bool>()->default_value(true), "all logs are written to stderr instead of file")
       ;
 
   po::variables_map vm;
   po::store(po::parse_command_line(argc, argv, desc), vm);
+
+  // the command line wins over the file
+  if (vm.count("config")) {
+    const std::string& path = vm["config"].as<std::string>();
+    try {
+      po::store(po::parse_config_file<char>(path.c_str(), desc), vm);
+    }
+    catch (const std::exception& e) {
+      std::cerr << "can not read " << path << " : " << e.what() << "\n";
+      return 1;
+    }
+
+    system::runtime_config::ref().set_file(path);
+  }
+
   po::notify(vm);
 
   if (vm.count("help")) {
@@ -334,6 +842,121 @@ int main(int argc, char* argv[]) {
     return 0;
   }
 
+  // before any loop is created
+  net::use_io_uring() = vm["io_uring"].as<bool>();
+
+  // before any loop or worker starts
+  system::numa_policy numa;
+  if (!system::numa_placement::named(vm["numa"].as<std::string>(), &numa)) {
+    std::cerr << "unknown numa placement\n" << desc << "\n";
+    return 1;
+  }
+  if (!system::numa_placement::ref().configure(numa, vm["numa_interface"].as<std::string>())) return 1;
+
+  // before any thread takes it's arena
+  atlas::memory::huge_page_mode huge_pages;
+  if (!atlas::memory::huge_page_mode_named(vm["huge_pages"].as<std::string>(), &huge_pages)) {
+    std::cerr << "unknown huge pages mode\n" << desc << "\n";
+    return 1;
+  }
+  if (huge_pages != atlas::memory::huge_pages_off) {
+    atlas::memory::huge_page_resource::instance().set_mode(huge_pages);
+    atlas::memory::set_thread_arena_upstream(&atlas::memory::huge_page_resource::instance());
+  }
+
+  // before any connection comes up
+  net::socket_profile outward_profile, inward_profile;
+  if (!net::socket_profile::named(vm["outward_socket_profile"].as<std::string>(), &outward_profile)
+      || !net::socket_profile::named(vm["inward_socket_profile"].as<std::string>(), &inward_profile)) {
+    std::cerr << "unknown socket profile\n" << desc << "\n";
+    return 1;
+  }
+  net::socket_profiles::ref().set_outward(outward_profile);
+  net::socket_profiles::ref().set_inward(inward_profile);
+
+  net::fast_open::ref().configure(vm["outward_fast_open"].as<int>());
+
+  if (!net::rx_timestamps::ref().configure(vm["rx_timestamps"].as<std::string>())) {
+    std::cerr << "unknown receive timestamps mode\n" << desc << "\n";
+    return 1;
+  }
+
+  net::connection_reaper::ref().set_idle_timeout(std::chrono::seconds(vm["outward_idle_timeout"].as<int>()));
+  net::connection_reaper::ref().set_memory_cap(static_cast<size_t>(vm["outward_memory_cap"].as<int>()) * 1024 * 1024);
+
+  if (!vm["tls_cert"].as<std::string>().empty()) {
+    // the records are never encrypted in user space, see net::tls_session
+    if (!net::tls_context::offload_supported()) {
+      std::cerr << "kernel TLS is not supported, load the tls module\n";
+      return 1;
+    }
+
+    std::shared_ptr<net::tls_context> tls = net::tls_context::server(vm["tls_cert"].as<std::string>(), vm["tls_key"].as<std::string>());
+    if (!tls) return 1;
+    net::tls_contexts::ref().set_outward(tls);
+  }
+
+  net::frame_compression::ref().set_threshold(vm["compression_threshold"].as<int>());
+  net::frame_compression::ref().set_enabled(vm["compression"].as<bool>());
+  net::frame_chunks::ref().set_enabled(vm["frame_chunks"].as<bool>());
+  atlas::rpc::message::checksums() = vm["checksums"].as<bool>();
+
+  net::local_delivery::ref().set_enabled(vm["local_shortcut"].as<bool>());
+
+  net::mcast_dedupe::ref().set_window(std::chrono::milliseconds(vm["mcast_dedupe_window"].as<int>()));
+  net::mcast_dedupe::ref().set_suppress_self(vm["mcast_suppress_self"].as<bool>());
+  net::mcast_dedupe::ref().set_enabled(vm["mcast_dedupe"].as<bool>());
+
+  const std::string& capture_file = vm["capture_file"].as<std::string>();
+  if (!capture_file.empty()) {
+    try {
+      net::traffic_capture::ref().start(capture_file, static_cast<uint64_t>(vm["capture_max_mb"].as<int>()) * 1024 * 1024);
+    }
+    catch (const std::exception& e) {
+      std::cerr << e.what() << "\n";
+      return 1;
+    }
+  }
+
+  atlas::rpc::result_cache::ref().set_capacity(static_cast<size_t>(vm["result_cache_size"].as<int>()) * 1024 * 1024);
+
+  net::overlay_topology topology;
+  if (!net::overlay::named(vm["topology"].as<std::string>(), &topology)) {
+    std::cerr << "unknown topology\n" << desc << "\n";
+    return 1;
+  }
+  if (topology != net::overlay_topology::full_mesh && !vm["gossip"].as<bool>()) {
+    std::cerr << "the " << vm["topology"].as<std::string>() << " topology needs --gossip\n";
+    return 1;
+  }
+  if (vm["leader_election"].as<bool>()) net::leader_election::ref().start(LEADER_ELECTION_TIMEOUT);
+  net::locality::ref().configure(vm["zone"].as<std::string>(), vm["rack"].as<std::string>());
+  net::drain::ref().configure(vm["drain_timeout"].as<double>(), quit_all);
+  net::offload::ref().configure(vm["offload_threshold"].as<double>(), PIONEER_OFFLOAD_INTERVAL);
+  atlas::memory::role_arenas::ref().set_enabled(vm["jemalloc_arenas"].as<bool>());
+  net::http_gateway::ref().configure(vm["http_gateway"].as<bool>(), std::max(vm["http_gateway_max_body"].as<int>(), 0));
+  net::call_batches::ref().configure(std::max(vm["call_batch_size"].as<int>(), 0));
+  net::fair_queue::ref().configure(vm["client_quota"].as<double>(), vm["client_quota_burst"].as<double>(),
+      std::max(vm["fair_queue_in_flight"].as<int>(), 0), std::max(vm["fair_queue_quantum"].as<int>(), 0),
+      std::max(vm["fair_queue_max_queued"].as<int>(), 0), vm["fair_queue_by_client_id"].as<bool>());
+
+  const std::string& kv_log = vm["kv_log"].as<std::string>();
+  if (!kv_log.empty() && !rpc::kv::store::ref().open(kv_log, static_cast<size_t>(KV_LOG_SIZE) * 1024 * 1024)) {
+    std::cerr << "can not open the kv log " << kv_log << "\n";
+    return 1;
+  }
+
+  net::overlay::ref().configure(topology, vm["overlay_degree"].as<int>(), vm["rack_prefix"].as<int>());
+
+  std::vector<std::string> seeds;
+  if (vm["gossip"].as<bool>()) {
+    net::gossip::ref().start(PIONEER_GOSSIP_INTERVAL);
+
+    boost::split(seeds, vm["gossip_seeds"].as<std::string>(), boost::is_any_of(","), boost::token_compress_on);
+    seeds.erase(std::remove(seeds.begin(), seeds.end(), std::string()), seeds.end());
+    for (const std::string& seed : seeds) net::gossip::ref().join(seed);
+  }
+
   // make it a local variable to watch the destruction
   {
     pioneer_server server(
@@ -343,8 +966,18 @@ int main(int argc, char* argv[]) {
         vm["outward_server_threads"].as<int>(),
         vm["inward_server_threads"].as<int>(),
         vm["icp_threads"].as<int>(),
+        vm["worker_threads"].as<int>(),
+        vm["worker_cpus"].as<std::string>(),
+        vm["worker_numa_node"].as<int>(),
+        vm["worker_inline"].as<bool>(),
+        vm["worker_ordered"].as<bool>(),
+        vm["thread_per_core"].as<bool>(),
+        vm["reuseport"].as<bool>(),
         vm["logtostderr"].as<bool>());
 
+    server.set_initial_peers(seeds);
+    server.set_kv_bootstrap(vm["kv_bootstrap"].as<bool>());
+    server.set_mcast_xdp(vm["mcast_xdp"].as<bool>());
     server.start();
   }
 
@@ -0,0 +1,432 @@
+/*
+ * cluster_bench.server.ipp
+ *
+ *  Created on: Sep 17, 2013
+ *      Author: vincent
+ */
+
+/*    Copyright 2011 ~ 2013 Vincent Zhang, ivincent.zhang@gmail.com
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#ifndef RFC_SERVICE_CLUSTER_BENCH_SERVER_H_
+#define RFC_SERVICE_CLUSTER_BENCH_SERVER_H_
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <boost/lexical_cast.hpp>
+#include <muduo/net/EventLoop.h>
+#include <muduo/net/EventLoopThread.h>
+
+#include <atlas/singleton.h>
+#include <atlas/rpc.h>
+#include <atlas/rpc/stats.h>
+#include <pioneer/net/net.h>
+#include <pioneer/net/inspector.h>
+#include <pioneer/net/rpc_clients.h>
+#include <pioneer/system/context.h>
+#include <pioneer/system/thread_pool.h>
+
+#include "rfc_func.h"
+
+namespace pioneer {
+  namespace rpc {
+
+    /*
+     * The cluster benchmark, every node calls bench_echo on every inside node for the duration of the plan,
+     * with a number of calls in flight per peer, so the connections of the full mesh, the multicast of the
+     * plan and the fan in of the results are all measured at once.
+     *
+     * A node starts a run by multicasting the plan, run_bench, every node runs it and responds with it's
+     * latency histogram once the run is over, and the starter folds the responses into one report as they
+     * arrive, see atlas::rpc::gather. A run is started by the report server, /bench/start, or by the client,
+     * cstart_bench, the last report is served by /bench/report, and /bench/cancel stops the last run everywhere
+     * */
+    using atlas::rpc::async_task;
+    using atlas::rpc::gather;
+    using atlas::rpc::gather_status;
+    using atlas::rpc::rpc_callback_type;
+    using atlas::rpc::nilctx;
+
+    namespace bench {
+
+      using atlas::rpc::latency_histogram;
+
+      typedef std::chrono::steady_clock clock_type;
+
+      // the calls in flight after the run are waited for so long before a node reports
+      const std::chrono::milliseconds drain_time(1000);
+
+      // the runs are driven by the timers of their own loop, they never hold a worker thread
+      inline muduo::net::EventLoop* timer_loop() {
+        static muduo::net::EventLoopThread thread;
+        static muduo::net::EventLoop* loop = thread.startLoop();
+
+        return loop;
+      }
+
+      // the run of a node, shared by the callbacks of it's calls
+      struct node_run {
+        node_run(int duration_ms, int size) :
+          payload(size, 'x'), deadline(clock_type::now() + std::chrono::milliseconds(duration_ms)),
+          seconds(duration_ms / 1000.0), peers(0), errors(0) {}
+
+        const std::string payload;
+        const clock_type::time_point deadline;
+        const double seconds;
+        size_t peers;
+        // the starter gives up the run, see starter::cancel
+        atlas::rpc::cancel_token cancel;
+
+        std::mutex mutex;
+        latency_histogram latency;
+        std::atomic<uint64_t> errors;
+      };
+
+      /*
+       * One line a node, the histogram is sent as the non empty buckets, so the starter merges the
+       * percentiles of the cluster instead of averaging them :
+       * ip peers seconds calls errors sum max index:count ...
+       * */
+      inline std::string encode(const node_run& run) {
+        std::ostringstream os;
+        os << (system::context::local_ip.empty() ? std::string("unknown") : system::context::local_ip) << " "
+            << run.peers << " " << run.seconds << " " << run.latency.total << " " << run.errors << " "
+            << run.latency.sum << " " << run.latency.max;
+
+        for (size_t i = 0; i < latency_histogram::bucket_count; ++i) {
+          if (run.latency.counts[i]) os << " " << i << ":" << run.latency.counts[i];
+        }
+
+        return os.str();
+      }
+
+      struct node_report {
+        std::string ip;
+        size_t peers;
+        double seconds;
+        uint64_t errors;
+        latency_histogram latency;
+      };
+
+      inline bool decode(const std::string& line, node_report& r) {
+        std::istringstream is(line);
+        if (!(is >> r.ip >> r.peers >> r.seconds >> r.latency.total >> r.errors >> r.latency.sum >> r.latency.max)) {
+          return false;
+        }
+
+        std::string bucket;
+        while (is >> bucket) {
+          size_t colon = bucket.find(':');
+          if (colon == std::string::npos) return false;
+
+          size_t i = boost::lexical_cast<size_t>(bucket.substr(0, colon));
+          if (i < latency_histogram::bucket_count) r.latency.counts[i] = boost::lexical_cast<uint64_t>(bucket.substr(colon + 1));
+        }
+
+        return true;
+      }
+
+      // keep calling the peer until the run is over, a completion issues the next call
+      inline void call_peer(const std::shared_ptr<node_run>& run, const std::string& ip) {
+        if (clock_type::now() >= run->deadline || system::context::system_quitting || run->cancel.cancelled()) return;
+
+        clock_type::time_point start = clock_type::now();
+
+        rpc_callback_type cb = [run, ip, start](const std::string&, int err, async_task&) {
+          uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(clock_type::now() - start).count();
+
+          if (err) {
+            ++run->errors;
+          }
+          else if (start < run->deadline) {
+            std::lock_guard<std::mutex> guard(run->mutex);
+
+            latency_histogram& h = run->latency;
+            ++h.counts[latency_histogram::index(ns)];
+            ++h.total;
+            h.sum += ns;
+            if (ns > h.max) h.max = ns;
+          }
+
+          // the calls rejected before sent are not retried at once, or the node spins on them
+          if (err == atlas::rpc::rpc_unreachable || err == atlas::rpc::rpc_backpressure) return;
+
+          call_peer(run, ip);
+        };
+
+        p2p_client client(inward_client, ip);
+        client.call(rpc_func::bench_echo, fn_ids::bench_echo, cb, run->payload, nilctx);
+      }
+
+      // the run of this node, the result is sent back to the starter once it's over
+      inline void run(int duration_ms, int concurrency, int size, rpc_context c) {
+        auto r = std::make_shared<node_run>(duration_ms, size);
+        r->cancel = c.get_cancel_token();
+
+        std::shared_ptr<const system::membership> nodes = system::context::inside_nodes.get();
+        r->peers = nodes->ip_list.size();
+
+        LOG(INFO) << "running the cluster bench against " << r->peers << " nodes, " << duration_ms << "ms, "
+            << concurrency << " calls in flight per peer, " << size << " bytes";
+
+        for (const std::string& ip : nodes->ip_list) {
+          for (int i = 0; i < concurrency; ++i) call_peer(r, ip);
+        }
+
+        double seconds = std::chrono::duration<double>(std::chrono::milliseconds(duration_ms) + drain_time).count();
+        timer_loop()->runAfter(seconds, [r, c]() {
+          // nobody waits for the report
+          if (r->cancel.cancelled()) return;
+
+          std::string data;
+          {
+            std::lock_guard<std::mutex> guard(r->mutex);
+            data = encode(*r);
+          }
+
+          p2p_client client(static_cast<client_type>(c.client_id()), c.source());
+          atlas::rpc::dispatcher_manager::ref().respond(client, c, rpc_result(data));
+        });
+      }
+
+      // the report of the cluster, the line of a node is added once it arrives
+      class cluster_report {
+      public:
+
+        cluster_report() : _calls_per_sec(0), _errors(0), _reported(0) {}
+
+        bool add(const std::string& line) {
+          node_report r;
+          if (line.empty() || !decode(line, r)) return false;
+
+          double rate = r.seconds > 0 ? r.latency.total / r.seconds : 0;
+
+          std::ostringstream os;
+          os << r.ip << "\t" << r.peers << "\t" << rate << "\t" << r.errors << "\t" << r.latency.mean() / 1e3
+              << " / " << r.latency.percentile(0.5) / 1e3 << " / " << r.latency.percentile(0.99) / 1e3
+              << " / " << r.latency.percentile(0.999) / 1e3 << " / " << r.latency.max / 1e3 << "\n";
+          _rows += os.str();
+
+          _cluster.add(r.latency);
+          _calls_per_sec += rate;
+          _errors += r.errors;
+          ++_reported;
+
+          return true;
+        }
+
+        std::string str(int run, int nodes, int duration_ms, int concurrency, int size) const {
+          std::ostringstream os;
+          os << "run " << run << ", " << duration_ms << "ms, " << concurrency << " calls in flight per peer, "
+              << size << " bytes\n";
+          os << "node\tpeers\tcalls/s\terrors\tmean/p50/p99/p999/max (us)\n";
+          os << _rows;
+          os << "cluster\t" << _reported << " of " << nodes << " nodes\t" << _calls_per_sec << "\t" << _errors << "\t"
+              << _cluster.mean() / 1e3 << " / " << _cluster.percentile(0.5) / 1e3 << " / " << _cluster.percentile(0.99) / 1e3
+              << " / " << _cluster.percentile(0.999) / 1e3 << " / " << _cluster.max / 1e3 << "\n";
+
+          return os.str();
+        }
+
+      private:
+
+        std::string _rows;
+        latency_histogram _cluster;
+        double _calls_per_sec;
+        uint64_t _errors;
+        int _reported;
+      };
+
+      // the runs started by this node, and the last report
+      class starter : public atlas::singleton<starter> {
+      public:
+
+        typedef std::function<void(const std::string&)> report_callback;
+
+      private:
+
+        friend class atlas::singleton<starter>;
+        starter(const starter&) = delete;
+        starter& operator=(const starter&) = delete;
+
+      public:
+
+        starter() : _last_run(0), _last_session(boost::uuids::nil_uuid()) {}
+
+        /*
+         * Multicast the plan to the cluster, every inside node is expected to respond, the nodes never respond
+         * are left out once the call times out. Return the run number
+         * */
+        int start(int duration_ms, int concurrency, int size, const report_callback& on_report = nullptr) {
+          int run = ++_last_run;
+          int nodes = std::max<int>(system::context::inner_node_count, 1);
+
+          // a node shedding the plan is one failed response, a timeout ends the run with the nodes reported
+          auto add = [](cluster_report& r, const std::string& line) { return r.add(line); };
+          auto done = [this, run, nodes, duration_ms, concurrency, size, on_report]
+                       (cluster_report& r, const gather_status&) {
+            std::string report = r.str(run, nodes, duration_ms, concurrency, size);
+            LOG(INFO) << "the cluster bench is over\n" << report;
+
+            {
+              std::lock_guard<std::mutex> guard(_mutex);
+              _report = report;
+            }
+
+            if (on_report) on_report(report);
+          };
+          rpc_callback_type cb = gather<cluster_report>::callback(cluster_report(), add, done);
+
+          mcast_client client(inward_client, nodes);
+          client.set_timeout(std::chrono::milliseconds(duration_ms) + drain_time + std::chrono::seconds(5));
+          client.call(rpc_func::run_bench, fn_ids::run_bench, cb, run, duration_ms, concurrency, size, nilctx);
+
+          {
+            std::lock_guard<std::mutex> guard(_mutex);
+            _last_session = client.last_session_id();
+          }
+
+          return run;
+        }
+
+        // stop the last run on every node, the nodes stop calling their peers and never report
+        void cancel() {
+          atlas::rpc::uuid session;
+          {
+            std::lock_guard<std::mutex> guard(_mutex);
+            session = _last_session;
+          }
+
+          if (session.is_nil()) return;
+
+          mcast_client client(inward_client, std::max<int>(system::context::inner_node_count, 1));
+          client.cancel(session);
+        }
+
+        std::string report() const {
+          std::lock_guard<std::mutex> guard(_mutex);
+          return _report;
+        }
+
+        int last_run() const { return _last_run; }
+
+      private:
+
+        std::atomic<int> _last_run;
+
+        mutable std::mutex _mutex;
+        std::string _report;
+        atlas::rpc::uuid _last_session;
+      };
+
+      // the commands of the module bench, served by the report server, see net::inspector
+      inline void register_commands() {
+        typedef net::inspector::arg_list arg_list;
+        net::inspector& ins = net::inspector::ref();
+
+        ins.add("bench", "start", [](mn::HttpRequest::Method, const arg_list& args) {
+          int duration = boost::lexical_cast<int>(net::detail::find_arg(args, "duration", "10000"));
+          int concurrency = boost::lexical_cast<int>(net::detail::find_arg(args, "concurrency", "8"));
+          int size = boost::lexical_cast<int>(net::detail::find_arg(args, "size", "64"));
+
+          if (duration <= 0 || concurrency <= 0 || size < 0) throw std::invalid_argument("bad plan");
+
+          int run = starter::ref().start(duration, concurrency, size);
+          return "run " + std::to_string(run) + " started, the report is at /bench/report\n";
+        }, "run the cluster bench, ?duration=10000&concurrency=8&size=64, in milliseconds, calls per peer and bytes");
+
+        ins.add("bench", "cancel", [](mn::HttpRequest::Method, const arg_list&) {
+          starter::ref().cancel();
+          return std::string("the last run is cancelled\n");
+        }, "stop the last cluster bench run started by this node on every node");
+
+        ins.add("bench", "report", [](mn::HttpRequest::Method, const arg_list&) {
+          std::string report = starter::ref().report();
+          return report.empty() ? std::string("no report yet\n") : report;
+        }, "the report of the last cluster bench run started by this node");
+      }
+
+    } // bench
+
+    rpc_result rpc_func::bench_echo(const string& payload, rpc_context c) noexcept {
+      return rpc_result(payload);
+    }
+
+    rpc_result rpc_func::run_bench(int run, int duration_ms, int concurrency, int size, rpc_context c) noexcept {
+      DLOG(INFO) << "cluster bench run " << run << " from " << c.source_ip_port().c_str();
+
+      if (c.empty()) return nullptr;
+
+      bench::run(duration_ms, concurrency, size, c);
+
+      // responded once the run is over
+      return nullptr;
+    }
+
+    rpc_result rpc_func::cstart_bench(int duration_ms, int concurrency, int size, rpc_context c) noexcept {
+      // one run at a time in the cluster, the leader starts it, see net::leader_election
+      bool dropped = false;
+      uint32_t leader = cluster_leader(fn_ids::cstart_bench, &dropped);
+      if (dropped) return c.empty() ? nullptr : rpc_result("no leader is known", atlas::rpc::rpc_unreachable);
+      if (leader) {
+        p2p_client client(inward_client, atlas::rpc::make_endpoint(leader, 0));
+        client.set_timeout(std::chrono::milliseconds(duration_ms) + std::chrono::seconds(10));
+
+        if (c.empty()) {
+          client.call(cstart_bench, fn_ids::cstart_bench, duration_ms, concurrency, size, nilctx);
+          return nullptr;
+        }
+
+        // the report of the leader is passed back to the caller
+        rpc_callback_type cb = [c](const std::string& report, int err, async_task&) {
+          p2p_client caller(static_cast<client_type>(c.client_id()), c.source());
+          atlas::rpc::dispatcher_manager::ref().respond(caller, c, rpc_result(report, err));
+        };
+        client.call(cstart_bench, fn_ids::cstart_bench, cb, duration_ms, concurrency, size, nilctx);
+        return nullptr;
+      }
+
+      if (c.empty()) {
+        bench::starter::ref().start(duration_ms, concurrency, size);
+        return nullptr;
+      }
+
+      // the caller gets the merged report
+      bench::starter::ref().start(duration_ms, concurrency, size, [c](const std::string& report) {
+        p2p_client client(static_cast<client_type>(c.client_id()), c.source());
+        atlas::rpc::dispatcher_manager::ref().respond(client, c, rpc_result(report));
+      });
+
+      return nullptr;
+    }
+
+    ATLAS_BIND_REMOTE_FUNC(bench_echo, rpc_func::bench_echo);
+    ATLAS_BIND_REMOTE_FUNC(run_bench, rpc_func::run_bench);
+    ATLAS_BIND_REMOTE_FUNC(cstart_bench, rpc_func::cstart_bench);
+
+    // the plan is not queued behind the load of the last run
+    PIONEER_RPC_PRIORITY(run_bench, 10);
+
+  } // rpc
+} // pioneer
+
+#endif // RFC_SERVICE_CLUSTER_BENCH_SERVER_H_
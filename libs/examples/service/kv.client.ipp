@@ -0,0 +1,54 @@
+/*
+ * kv.client.ipp
+ *
+ *  Created on: Sep 28, 2013
+ *      Author: vincent
+ */
+
+/*    Copyright 2011 ~ 2013 Vincent Zhang, ivincent.zhang@gmail.com
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#ifndef RFC_SERVICE_KV_CLIENT_H_
+#define RFC_SERVICE_KV_CLIENT_H_
+
+namespace pioneer {
+  namespace rpc {
+
+    // the caller needs the signatures only, see rfc_func.client.ipp
+
+    rpc_result kv_func::get(const string& key, rpc_context c) noexcept {
+      return nullptr;
+    }
+
+    rpc_result kv_func::put(const string& key, const string& value, rpc_context c) noexcept {
+      return nullptr;
+    }
+
+    rpc_result kv_func::multi_get(const std::vector<string>& keys, rpc_context c) noexcept {
+      return nullptr;
+    }
+
+    rpc_result kv_func::snapshot(const string& owner, rpc_context c) noexcept {
+      return nullptr;
+    }
+
+    rpc_result kv_func::log_segment(unsigned int id, rpc_context c) noexcept {
+      return nullptr;
+    }
+
+  } // rpc
+} // pioneer
+
+#endif // RFC_SERVICE_KV_CLIENT_H_
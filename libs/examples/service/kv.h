@@ -0,0 +1,134 @@
+/*
+ * kv.h
+ *
+ *  Created on: Sep 28, 2013
+ *      Author: vincent
+ */
+
+/*    Copyright 2011 ~ 2013 Vincent Zhang, ivincent.zhang@gmail.com
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#ifndef RFC_SERVICE_KV_H_
+#define RFC_SERVICE_KV_H_
+
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include <boost/optional.hpp>
+#include <boost/serialization/string.hpp>
+#include <boost/serialization/vector.hpp>
+
+#include <atlas/rpc/rpc.h>
+
+namespace pioneer {
+  namespace rpc {
+
+    using std::string;
+    using atlas::rpc::rpc_result;
+    using atlas::rpc::rpc_context;
+
+    /*
+     * The partitioned key value service, the keys are spread over the inside nodes by the consistent hash ring
+     * of the membership, a node keeps the keys it owns in a concurrent btree map, and, if it's given a log, see
+     * --kv_log, logs the puts and replays them at start, see kv.server.ipp.
+     *
+     * A client calls any node, which passes the call on to the owner of the key, a multi_get is split by the
+     * owners and merged back in the order of the keys. An inside node routes by the key itself, see hash_client,
+     * so a call from an inside node is served by the node it reaches
+     * */
+    class kv_func {
+    public:
+
+      // the value of the key, or the error kv::not_found
+      static rpc_result get(const string& key, rpc_context c) noexcept;
+
+      // insert or replace, responded once the put is on disk if the owner logs
+      static rpc_result put(const string& key, const string& value, rpc_context c) noexcept;
+
+      // the values of the keys in order, see kv::decode_values
+      static rpc_result multi_get(const std::vector<string>& keys, rpc_context c) noexcept;
+
+      // a server streaming call, the keys of this node the owner has on the ring with the values, all of them
+      // if the owner is empty, a chunk is keys and values in turn, see kv::decode_values and kv::pull
+      static rpc_result snapshot(const string& owner, rpc_context c) noexcept;
+
+      // a rolled log of the node called, the bytes of the file as they are, sent from the file, see
+      // atlas::rpc::file_range, the error kv::not_found for the log being written or one removed
+      static rpc_result log_segment(unsigned int id, rpc_context c) noexcept;
+    };
+
+    namespace kv {
+
+      // the errors of the service, the errors of the RPC layer are negative
+      const int not_found = 1;
+      const int not_durable = 2;
+
+      typedef std::vector<boost::optional<std::string>> value_list;
+
+      // a value is it's length, a colon and the bytes, a missing one is a dash and a colon
+      inline void append_value(std::string& data, const std::string& v) {
+        data += std::to_string(v.size());
+        data += ':';
+        data += v;
+      }
+
+      inline std::string encode_values(const value_list& values) {
+        std::string data;
+        for (const boost::optional<std::string>& v : values) {
+          if (!v) data += "-:";
+          else append_value(data, *v);
+        }
+
+        return data;
+      }
+
+      inline bool decode_values(const std::string& data, value_list& values) {
+        values.clear();
+
+        size_t pos = 0;
+        while (pos < data.size()) {
+          size_t colon = data.find(':', pos);
+          if (colon == std::string::npos) return false;
+
+          if (colon == pos + 1 && data[pos] == '-') {
+            values.push_back(boost::none);
+            pos = colon + 1;
+            continue;
+          }
+
+          char* end = nullptr;
+          unsigned long size = std::strtoul(data.c_str() + pos, &end, 10);
+          if (end != data.c_str() + colon || colon == pos || size > data.size() - colon - 1) return false;
+
+          values.push_back(data.substr(colon + 1, size));
+          pos = colon + 1 + size;
+        }
+
+        return true;
+      }
+
+    } // kv
+
+    ATLAS_REGISTER_REMOTE_FUNC(kv_get, 141);
+    ATLAS_REGISTER_REMOTE_FUNC(kv_put, 142);
+    ATLAS_REGISTER_REMOTE_FUNC(kv_multi_get, 143);
+    ATLAS_REGISTER_REMOTE_FUNC(kv_snapshot, 144);
+    ATLAS_REGISTER_REMOTE_FUNC(kv_log_segment, 145);
+
+  } // rpc
+} // pioneer
+
+#endif /* RFC_SERVICE_KV_H_ */
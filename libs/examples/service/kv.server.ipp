@@ -0,0 +1,642 @@
+/*
+ * kv.server.ipp
+ *
+ *  Created on: Sep 28, 2013
+ *      Author: vincent
+ */
+
+/*    Copyright 2011 ~ 2013 Vincent Zhang, ivincent.zhang@gmail.com
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#ifndef RFC_SERVICE_KV_SERVER_H_
+#define RFC_SERVICE_KV_SERVER_H_
+
+#include <atomic>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+#include <boost/mpl/vector.hpp>
+#include <boost/optional.hpp>
+#include <glog/logging.h>
+
+#include <atlas/singleton.h>
+#include <atlas/rpc.h>
+#include <atlas/trace_scope.h>
+#include <atlas/container/concurrent_btree_map.h>
+#include <atlas/transaction/log.hpp>
+#include <pioneer/net/inspector.h>
+#include <pioneer/net/rpc_clients.h>
+#include <pioneer/net/rpc_stream.h>
+#include <pioneer/system/context.h>
+#include <pioneer/system/thread_pool.h>
+
+#include "kv.h"
+
+namespace pioneer {
+  namespace rpc {
+
+    namespace kv {
+
+      namespace bt = boost::transact;
+
+      using atlas::rpc::async_task;
+      using atlas::rpc::rpc_callback_type;
+      using atlas::rpc::nilctx;
+
+      // a put in the log
+      struct put_entry {
+        std::string key;
+        std::string value;
+
+        template<class Archive>
+        void serialize(Archive& ar, const unsigned int) {
+          ar & key & value;
+        }
+      };
+
+      // all the entries at a checkpoint, the log is replayed from the last one
+      struct snapshot_entry {
+        std::vector<std::string> keys;
+        std::vector<std::string> values;
+
+        template<class Archive>
+        void serialize(Archive& ar, const unsigned int) {
+          ar & keys & values;
+        }
+      };
+
+      typedef boost::mpl::vector<put_entry, snapshot_entry> log_entries;
+
+      // the bytes of a chunk of kv_func::snapshot, a window of them is in flight, see net::rpc_streams
+      const size_t snapshot_chunk = 1024 * 1024;
+      // the entries a piece of the scan of a snapshot visits, the puts to the map wait for a piece only
+      const size_t snapshot_piece = 16 * 1024;
+
+      /*
+       * The keys this node owns, in a concurrent btree map, so the gets of all the workers run in parallel.
+       *
+       * If it's given a log, a put is appended to the log and applied to the map at once, and the caller is
+       * responded once a group commit syncs it, see transaction_olog::commit_async, the worker never waits for
+       * the disk. So a get may see a put not on disk yet, the put is never acknowledged before it is.
+       * The log rolls at it's size, and once it has rolled a few times, the map is written to the new log as a
+       * checkpoint, and the logs before it are removed, so the replay at start is bounded by the map size
+       * */
+      class store : public atlas::singleton<store> {
+      public:
+
+        typedef atlas::concurrent_btree_map<std::string, std::string> map_type;
+        typedef bt::rolling_ologfile<bt::ologfile<true>> log_file;
+        typedef bt::transaction_olog<log_entries, log_file> log_type;
+
+        typedef std::function<void(bool)> durable_callback;
+
+        // the logs rolled before a checkpoint is taken
+        static const unsigned int checkpoint_logs = 4;
+
+      private:
+
+        friend class atlas::singleton<store>;
+        store(const store&) = delete;
+        store& operator=(const store&) = delete;
+
+        // applies the entries of the log in order
+        struct replayer {
+          void operator()(const put_entry& e) const { map->put(e.key, e.value); }
+
+          void operator()(const snapshot_entry& e) const {
+            map->clear();
+            for (size_t i = 0; i < e.keys.size() && i < e.values.size(); ++i) map->put(e.keys[i], e.values[i]);
+          }
+
+          map_type* map;
+        };
+
+      public:
+
+        // public for std::make_shared, see atlas::singleton
+        store() : _checkpoint_log(0), _checkpointing(false), _gets(0), _puts(0), _forwarded(0), _failed(0),
+          _streamed(0), _restored(0) {}
+
+      public:
+
+        // before the servers start, replay the log, and log the puts from now on, return false if it's not readable
+        bool open(const std::string& path, size_t max_log_size) {
+          try {
+            boost::filesystem::path dir = boost::filesystem::path(path).parent_path();
+            if (!dir.empty()) boost::filesystem::create_directories(dir);
+
+            replayer r = { &_map };
+            bt::replay_rolling_log<log_entries, bt::ilogfile<true>>(path, r);
+
+            _file.reset(new log_file(path));
+            _log.reset(new log_type(*_file, max_log_size));
+          }
+          catch (const std::exception& e) {
+            LOG(ERROR) << "can not open the kv log " << path << " : " << e.what();
+            return false;
+          }
+          catch (...) {
+            LOG(ERROR) << "can not open the kv log " << path;
+            return false;
+          }
+
+          _path = path;
+          LOG(INFO) << _map.size() << " keys replayed from the kv log " << path;
+
+          // the replayed logs are dropped
+          checkpoint();
+
+          return true;
+        }
+
+        bool logging() const { return _log != nullptr; }
+
+        boost::optional<std::string> get(const std::string& key) {
+          _gets.fetch_add(1, std::memory_order_relaxed);
+          return _map.get(key);
+        }
+
+        // the callback is called once the put is on disk, at once if it's not logged
+        void put(const std::string& key, const std::string& value, const durable_callback& done) {
+          _puts.fetch_add(1, std::memory_order_relaxed);
+
+          if (!_log) {
+            _map.put(key, value);
+            if (done) done(true);
+            return;
+          }
+
+          bool rolled = false;
+          try {
+            // a checkpoint never misses a put, or sees one not in the log
+            std::lock_guard<std::mutex> guard(_mutex);
+
+            log_type::id_type tx = _log->begin_transaction();
+            try {
+              _log->commit_async(put_entry { key, value }, done ? done : [](bool) {});
+            }
+            catch (...) {
+              _log->end_transaction(tx);
+              throw;
+            }
+
+            _map.put(key, value);
+            _log->end_transaction(tx);
+
+            rolled = _file->log_id() >= _checkpoint_log + checkpoint_logs;
+          }
+          catch (...) {
+            _failed.fetch_add(1, std::memory_order_relaxed);
+            LOG(ERROR) << "can not log the put of " << key;
+
+            if (done) done(false);
+            return;
+          }
+
+          if (rolled && !_checkpointing.exchange(true)) {
+            system::control_pool::ref().schedule(atlas::prio_thread_pool::task_type(1, [this]() {
+              checkpoint();
+              _checkpointing = false;
+            }));
+          }
+        }
+
+        // a key pulled from a peer, see kv::pull, it's not put if it's put here already, logged as a put,
+        // return false if it's here
+        bool restore(const std::string& key, const std::string& value) {
+          if (_map.contains(key)) return false;
+
+          put(key, value, nullptr);
+          _restored.fetch_add(1, std::memory_order_relaxed);
+          return true;
+        }
+
+        // the entries from the key on in the key order, f returns false to stop, see concurrent_btree_map::for_from
+        template<typename F>
+        void scan(const std::string& from, F&& f) const { _map.for_from(from, f); }
+
+        // write the map to a new log and remove the logs before it, the puts wait meanwhile
+        bool checkpoint() {
+          if (!_log) return false;
+
+          std::lock_guard<std::mutex> guard(_mutex);
+
+          snapshot_entry snapshot;
+          snapshot.keys.reserve(_map.size());
+          snapshot.values.reserve(_map.size());
+          _map.for_each([&snapshot](const map_type::value_type& e) {
+            snapshot.keys.push_back(e.first);
+            snapshot.values.push_back(e.second);
+          });
+
+          try {
+            // false if the last roll is not over, the next put retries
+            if (!_log->checkpoint(snapshot)) return false;
+          }
+          catch (...) {
+            LOG(ERROR) << "can not checkpoint the kv log " << _path;
+            return false;
+          }
+
+          _checkpoint_log = _file->log_id();
+          LOG(INFO) << "kv checkpoint of " << snapshot.keys.size() << " keys at log " << _checkpoint_log;
+
+          return true;
+        }
+
+        // a rolled log, the one being written is not, the file stays readable by the range if a checkpoint
+        // removes it meanwhile
+        atlas::rpc::file_range segment(unsigned int id) {
+          std::lock_guard<std::mutex> guard(_mutex);
+          if (!_log || id >= _file->log_id()) return atlas::rpc::file_range();
+
+          return atlas::rpc::file_range::open(_path + '.' + std::to_string(id));
+        }
+
+        void on_forwarded() { _forwarded.fetch_add(1, std::memory_order_relaxed); }
+        void on_streamed(size_t keys) { _streamed.fetch_add(keys, std::memory_order_relaxed); }
+
+        std::string str() const {
+          std::ostringstream os;
+          os << "keys " << _map.size() << "\n"
+              << "gets " << _gets.load(std::memory_order_relaxed) << "\n"
+              << "puts " << _puts.load(std::memory_order_relaxed) << "\n"
+              << "forwarded " << _forwarded.load(std::memory_order_relaxed) << "\n"
+              << "failed puts " << _failed.load(std::memory_order_relaxed) << "\n"
+              << "streamed " << _streamed.load(std::memory_order_relaxed) << "\n"
+              << "restored " << _restored.load(std::memory_order_relaxed) << "\n"
+              << "log " << (_log ? _path : std::string("none")) << "\n";
+
+          return os.str();
+        }
+
+      private:
+
+        map_type _map;
+
+        std::mutex _mutex;
+        std::string _path;
+        std::unique_ptr<log_file> _file;
+        std::unique_ptr<log_type> _log;
+        unsigned int _checkpoint_log;
+        std::atomic<bool> _checkpointing;
+
+        std::atomic<unsigned long long> _gets;
+        std::atomic<unsigned long long> _puts;
+        std::atomic<unsigned long long> _forwarded;
+        std::atomic<unsigned long long> _failed;
+        std::atomic<unsigned long long> _streamed;
+        std::atomic<unsigned long long> _restored;
+      };
+
+      // the owner of the key on the ring, 0 if it's this node, or if no node is known
+      inline uint32_t owner(const std::string& key) {
+        boost::optional<std::string> ip = system::context::inside_nodes.get()->ring.find(key);
+        if (!ip || *ip == system::context::local_ip) return 0;
+
+        return atlas::rpc::parse_ip(*ip);
+      }
+
+      // an inside node routes by the key itself, or it passes a call on to the owner, served here in either case,
+      // a call without a response is routed, it's passed on with one, so it's never passed on twice
+      inline bool routed(rpc_context c) {
+        return !c.empty() && (c.client_id() & inward_client);
+      }
+
+      inline void respond(rpc_context c, const rpc_result& r) {
+        if (c.empty()) return;
+
+        p2p_client client(static_cast<client_type>(c.client_id()), c.source());
+        atlas::rpc::dispatcher_manager::ref().respond(client, c, r);
+      }
+
+      // the client passes a call on to the owner
+      inline void to_owner(p2p_client& client) {
+        store::ref().on_forwarded();
+        client.set_backpressure_policy(bp_fail_fast);
+      }
+
+      // the caller is responded with the response of the owner
+      inline rpc_callback_type relay(rpc_context c) {
+        return [c](const std::string& data, int err, async_task&) { respond(c, rpc_result(data, err)); };
+      }
+
+      // the values of a multi_get split by the owners, the caller is responded once all of them respond
+      class gathering {
+      public:
+
+        gathering(value_list&& values, size_t pending, rpc_context c) :
+          _values(std::move(values)), _pending(pending), _err(0), _c(c) {}
+
+        void add(const std::vector<size_t>& positions, const std::string& data, int err) {
+          value_list values;
+          if (!err && (!decode_values(data, values) || values.size() != positions.size())) err = atlas::rpc::rpc_unreachable;
+
+          {
+            std::lock_guard<std::mutex> guard(_mutex);
+
+            if (err) {
+              if (!_err) _err = err;
+            }
+            else {
+              for (size_t i = 0; i < positions.size(); ++i) _values[positions[i]] = std::move(values[i]);
+            }
+
+            if (--_pending) return;
+          }
+
+          respond(_c, _err ? rpc_result("", _err) : rpc_result(encode_values(_values)));
+        }
+
+      private:
+
+        std::mutex _mutex;
+        value_list _values;
+        size_t _pending;
+        int _err;
+        rpc_context _c;
+      };
+
+      /*
+       * The producer of kv_func::snapshot, the map is scanned in the key order in pieces, each one resumed at the
+       * last key visited, so a large map is streamed without a copy of it, and the puts go on meanwhile, a key
+       * put during the stream is sent if the scan has not passed it yet.
+       * The keys are taken by the ring of this node with the owner on it, so a node which joins pulls it's keys
+       * before every node knows it
+       * */
+      class snapshot_cursor {
+      public:
+
+        explicit snapshot_cursor(const std::string& owner) : _owner(owner), _started(false), _done(false) {
+          if (owner.empty()) return;
+
+          _ring = system::context::inside_nodes.get()->ring;
+          _ring.add(owner);
+          _ring.add(system::context::local_ip);
+        }
+
+        bool operator()(std::string& chunk) {
+          if (_done) return false;
+
+          chunk.reserve(snapshot_chunk + 4096);
+
+          size_t keys = 0;
+          bool full = false;
+          for (;;) {
+            size_t visited = 0;
+            bool resumed = _started;
+            store::ref().scan(_last, [&](const store::map_type::value_type& e) {
+              if (resumed && e.first == _last) return true;
+              if (chunk.size() >= snapshot_chunk) {
+                full = true;
+                return false;
+              }
+              if (++visited > snapshot_piece) return false;
+
+              _last = e.first;
+              _started = true;
+              if (owned(e.first)) {
+                append_value(chunk, e.first);
+                append_value(chunk, e.second);
+                ++keys;
+              }
+
+              return true;
+            });
+
+            if (full) break;
+
+            // the scan reached the end
+            if (visited <= snapshot_piece) {
+              _done = true;
+              break;
+            }
+          }
+
+          store::ref().on_streamed(keys);
+          return full || !chunk.empty();
+        }
+
+      private:
+
+        bool owned(const std::string& key) const {
+          if (_owner.empty()) return true;
+
+          boost::optional<std::string> ip = _ring.find(key);
+          return ip && *ip == _owner;
+        }
+
+      private:
+
+        std::string _owner;
+        atlas::hash_ring _ring;
+        std::string _last;
+        bool _started;
+        bool _done;
+      };
+
+      // pull the keys this node owns from the peer, they are put as the chunks arrive, the keys put here meanwhile
+      // are kept, see store::restore
+      inline void pull(uint32_t peer) {
+        std::string from = atlas::rpc::ip_to_string(peer);
+        std::shared_ptr<size_t> restored = std::make_shared<size_t>(0);
+
+        // in order, one chunk at a time
+        net::rpc_streams::consumer_type consumer = [from, restored](const std::string& chunk, bool last, int ec) {
+          value_list entries;
+          if (!decode_values(chunk, entries) || entries.size() % 2) {
+            LOG(ERROR) << "a broken kv snapshot chunk of " << chunk.size() << " bytes from " << from;
+          }
+          else {
+            for (size_t i = 0; i < entries.size(); i += 2) {
+              if (entries[i] && entries[i + 1] && store::ref().restore(*entries[i], *entries[i + 1])) ++*restored;
+            }
+          }
+
+          if (!last) return;
+
+          if (ec) LOG(WARNING) << "the kv snapshot from " << from << " is cut off, error " << ec << ", " << *restored << " keys pulled";
+          else LOG(INFO) << *restored << " keys pulled from " << from;
+        };
+
+        LOG(INFO) << "pull the kv snapshot from " << from;
+
+        p2p_client client(inward_client, atlas::rpc::make_endpoint(peer, 0));
+        net::rpc_streams::ref().read(client, consumer, kv_func::snapshot, fn_ids::kv_snapshot, system::context::local_ip, nilctx);
+      }
+
+      // a node joining the cluster pulls it's keys from all the inside nodes, return the nodes pulled from
+      inline size_t bootstrap() {
+        size_t peers = 0;
+        std::shared_ptr<const system::membership> nodes = system::context::inside_nodes.get();
+        for (const std::string& ip : nodes->ip_list) {
+          if (ip == system::context::local_ip) continue;
+
+          pull(atlas::rpc::parse_ip(ip));
+          ++peers;
+        }
+
+        return peers;
+      }
+
+      // the commands of the module kv, served by the report server, see net::inspector
+      inline void register_commands() {
+        typedef net::inspector::arg_list arg_list;
+        net::inspector& ins = net::inspector::ref();
+
+        ins.add("kv", "stats", [](mn::HttpRequest::Method, const arg_list&) {
+          return store::ref().str();
+        }, "the keys of this node, and the calls served and passed on to the owners");
+
+        ins.add("kv", "get", [](mn::HttpRequest::Method, const arg_list& args) {
+          boost::optional<std::string> value = store::ref().get(net::detail::find_arg(args, "key", ""));
+          return value ? *value + "\n" : std::string("not found\n");
+        }, "the value of a key of this node, ?key=");
+
+        ins.add("kv", "checkpoint", [](mn::HttpRequest::Method, const arg_list&) {
+          if (!store::ref().logging()) return std::string("no kv log, start with --kv_log\n");
+          return std::string(store::ref().checkpoint() ? "done\n" : "the log is rolling, try later\n");
+        }, "write the keys to a new log, and remove the logs before it");
+
+        ins.add("kv", "pull", [](mn::HttpRequest::Method, const arg_list& args) {
+          std::string from = net::detail::find_arg(args, "from", "");
+          if (from.empty()) return "pulling from " + std::to_string(bootstrap()) + " nodes\n";
+
+          uint32_t ip = atlas::rpc::parse_ip(from);
+          if (!ip) return std::string("not an ip\n");
+
+          pull(ip);
+          return std::string("pulling\n");
+        }, "pull the keys this node owns from an inside node, ?from=ip, or from all of them");
+      }
+
+    } // kv
+
+    rpc_result kv_func::get(const string& key, rpc_context c) noexcept {
+      if (c.empty()) return nullptr;
+
+      uint32_t target = kv::routed(c) ? 0 : kv::owner(key);
+      if (target) {
+        p2p_client client(inward_client, atlas::rpc::make_endpoint(target, 0));
+        kv::to_owner(client);
+        client.call(kv_func::get, fn_ids::kv_get, kv::relay(c), key, kv::nilctx);
+        return nullptr;
+      }
+
+      boost::optional<std::string> value = kv::store::ref().get(key);
+      if (!value) return rpc_result("", kv::not_found);
+
+      return rpc_result(std::move(*value));
+    }
+
+    rpc_result kv_func::put(const string& key, const string& value, rpc_context c) noexcept {
+      uint32_t target = kv::routed(c) ? 0 : kv::owner(key);
+      if (target) {
+        p2p_client client(inward_client, atlas::rpc::make_endpoint(target, 0));
+        kv::to_owner(client);
+        client.call(kv_func::put, fn_ids::kv_put, kv::relay(c), key, value, kv::nilctx);
+        return nullptr;
+      }
+
+      if (c.empty()) {
+        kv::store::ref().put(key, value, nullptr);
+        return nullptr;
+      }
+
+      if (!kv::store::ref().logging()) {
+        kv::store::ref().put(key, value, nullptr);
+        return rpc_result();
+      }
+
+      // responded from the flusher of the log
+      kv::store::ref().put(key, value, [c](bool durable) {
+        kv::respond(c, durable ? rpc_result() : rpc_result("the put is not logged", kv::not_durable));
+      });
+
+      return nullptr;
+    }
+
+    rpc_result kv_func::multi_get(const std::vector<string>& keys, rpc_context c) noexcept {
+      if (c.empty()) return nullptr;
+
+      // the keys of the other owners, and their positions in the keys
+      std::map<uint32_t, std::pair<std::vector<string>, std::vector<size_t>>> remote;
+
+      kv::value_list values(keys.size());
+      bool route = !kv::routed(c);
+      ATLAS_TRACE_SCOPE("kv/multi_get/local");
+      for (size_t i = 0; i < keys.size(); ++i) {
+        uint32_t target = route ? kv::owner(keys[i]) : 0;
+        if (target) {
+          remote[target].first.push_back(keys[i]);
+          remote[target].second.push_back(i);
+        }
+        else {
+          values[i] = kv::store::ref().get(keys[i]);
+        }
+      }
+
+      if (remote.empty()) return rpc_result(kv::encode_values(values));
+
+      ATLAS_TRACE_SCOPE("kv/multi_get/fan_out");
+      auto g = std::make_shared<kv::gathering>(std::move(values), remote.size(), c);
+      for (auto& r : remote) {
+        std::vector<size_t> positions = std::move(r.second.second);
+
+        rpc_callback_type cb = [g, positions](const std::string& data, int err, async_task&) {
+          g->add(positions, data, err);
+        };
+        p2p_client client(inward_client, atlas::rpc::make_endpoint(r.first, 0));
+        kv::to_owner(client);
+        client.call(kv_func::multi_get, fn_ids::kv_multi_get, cb, r.second.first, kv::nilctx);
+      }
+
+      return nullptr;
+    }
+
+    rpc_result kv_func::snapshot(const string& owner, rpc_context c) noexcept {
+      if (c.empty()) return nullptr;
+
+      std::shared_ptr<kv::snapshot_cursor> cursor = std::make_shared<kv::snapshot_cursor>(owner);
+      net::rpc_streams::ref().serve(c, [cursor](std::string& chunk) { return (*cursor)(chunk); });
+
+      return nullptr;
+    }
+
+    rpc_result kv_func::log_segment(unsigned int id, rpc_context c) noexcept {
+      if (c.empty()) return nullptr;
+
+      atlas::rpc::file_range segment = kv::store::ref().segment(id);
+      if (!segment) return rpc_result("", kv::not_found);
+
+      return rpc_result(segment);
+    }
+
+    ATLAS_BIND_REMOTE_FUNC(kv_get, kv_func::get);
+    ATLAS_BIND_REMOTE_FUNC(kv_put, kv_func::put);
+    ATLAS_BIND_REMOTE_FUNC(kv_multi_get, kv_func::multi_get);
+    ATLAS_BIND_REMOTE_FUNC(kv_snapshot, kv_func::snapshot);
+    ATLAS_BIND_REMOTE_FUNC(kv_log_segment, kv_func::log_segment);
+
+  } // rpc
+} // pioneer
+
+#endif // RFC_SERVICE_KV_SERVER_H_
@@ -31,27 +31,37 @@ namespace pioneer {
     // empty functions only, for client side, we just need the function's signature,
     // in order to avoid linkage error, just provide empty implementations
 
-    rpc_result rpc_func::announce_inner_node(const string& ip, rpc_context c) noexcept {
+    rpc_result rpc_func::announce_inner_node(const string& /* ip */, rpc_context /* c */) noexcept {
       return nullptr;
     }
 
-    rpc_result rpc_func::cannounce_inner_node(const string& ip_list, rpc_context c) noexcept {
+    rpc_result rpc_func::cannounce_inner_node(const string& /* ip_list */, rpc_context /* c */) noexcept {
       return nullptr;
     }
 
-    rpc_result rpc_func::accumulate(const std::vector<int>& numbers, rpc_context c) noexcept {
+    rpc_result rpc_func::set_config(const string& /* settings */, rpc_context /* c */) noexcept {
       return nullptr;
     }
 
-    rpc_result rpc_func::udp_test_received(int round, rpc_context c) noexcept {
+    rpc_result rpc_func::cset_config(const string& /* settings */, rpc_context /* c */) noexcept {
       return nullptr;
     }
 
-    rpc_result rpc_func::cstart_udp_test(int rounds, int test_count, int interval, int rest_time, rpc_context c) noexcept {
+    rpc_result rpc_func::accumulate(const std::vector<int>& /* numbers */, rpc_context /* c */) noexcept {
       return nullptr;
     }
 
-    rpc_result rpc_func::start_udp_test(int rounds, int test_count, int interval, int rest_time, rpc_context c) noexcept {
+    rpc_result rpc_func::bench_echo(const string& /* payload */, rpc_context /* c */) noexcept {
+      return nullptr;
+    }
+
+    rpc_result rpc_func::run_bench(int /* run */, int /* duration_ms */, int /* concurrency */, int /* size */,
+        rpc_context /* c */) noexcept {
+      return nullptr;
+    }
+
+    rpc_result rpc_func::cstart_bench(int /* duration_ms */, int /* concurrency */, int /* size */,
+        rpc_context /* c */) noexcept {
       return nullptr;
     }
 
@@ -29,6 +29,7 @@
 #include <boost/serialization/vector.hpp>
 
 #include <atlas/rpc/rpc.h>
+#include <atlas/rpc/dispatcher.h>
 
 namespace pioneer {
   namespace rpc {
@@ -46,9 +47,13 @@ namespace pioneer {
     public:
 
       // illustrate a normal async, non-void return RPC
-      // accumulate all the numbers in the vector and return a result to the client
+      // accumulate all the numbers in the vector and return the sum to the client, a typed_result of an int
       static rpc_result accumulate(const std::vector<int>& numbers, rpc_context c) noexcept;
 
+      // the queued accumulate calls at once, see ATLAS_BIND_REMOTE_BATCH
+      static void accumulate_batch(atlas::rpc::fn_batch<decltype(accumulate)>::calls_type& calls,
+          atlas::rpc::fn_batch<decltype(accumulate)>::results_type& results) noexcept;
+
       // illustrate a normal async, void return RPC
       static rpc_result announce_inner_node(const string& ip, rpc_context c) noexcept;
 
@@ -56,11 +61,22 @@ namespace pioneer {
       // c means cluster wide remote function call, we multicast the RPC, and execute it at each server
       static rpc_result cannounce_inner_node(const string& ip_list, rpc_context c) noexcept;
 
-      static rpc_result udp_test_received(int round, rpc_context c) noexcept;
+      // change the settings changeable while running, the settings are name=value separated by commas,
+      // see system::runtime_config
+      static rpc_result set_config(const string& settings, rpc_context c) noexcept;
+
+      // multicast the settings, every server applies them
+      static rpc_result cset_config(const string& settings, rpc_context c) noexcept;
 
-      static rpc_result cstart_udp_test(int rounds, int test_count, int interval, int rest_time, rpc_context c) noexcept;
+      // the cluster bench, see cluster_bench.server.ipp
+      // the workload, the payload is sent back as it is
+      static rpc_result bench_echo(const string& payload, rpc_context c) noexcept;
 
-      static rpc_result start_udp_test(int rounds, int test_count, int interval, int rest_time, rpc_context c) noexcept;
+      // run the plan against every inside node, and respond with the result once the run is over
+      static rpc_result run_bench(int run, int duration_ms, int concurrency, int size, rpc_context c) noexcept;
+
+      // multicast the plan, and respond with the merged report of all the nodes
+      static rpc_result cstart_bench(int duration_ms, int concurrency, int size, rpc_context c) noexcept;
     };
 
     ATLAS_REGISTER_REMOTE_FUNC(accumulate, 121);
@@ -68,9 +84,12 @@ namespace pioneer {
     ATLAS_REGISTER_REMOTE_FUNC(announce_inner_node, 104);
     ATLAS_REGISTER_REMOTE_FUNC(cannounce_inner_node, 105);
 
-    ATLAS_REGISTER_REMOTE_FUNC(udp_test_received, 110);
-    ATLAS_REGISTER_REMOTE_FUNC(start_udp_test, 111);
-    ATLAS_REGISTER_REMOTE_FUNC(cstart_udp_test, 112);
+    ATLAS_REGISTER_REMOTE_FUNC(set_config, 106);
+    ATLAS_REGISTER_REMOTE_FUNC(cset_config, 107);
+
+    ATLAS_REGISTER_REMOTE_FUNC(bench_echo, 131);
+    ATLAS_REGISTER_REMOTE_FUNC(run_bench, 132);
+    ATLAS_REGISTER_REMOTE_FUNC(cstart_bench, 133);
 
   } // rpc
 } // pioneer
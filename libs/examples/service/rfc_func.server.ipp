@@ -23,48 +23,71 @@
 #ifndef RFC_SERVICE_RFC_FUNC_SERVER_H_
 #define RFC_SERVICE_RFC_FUNC_SERVER_H_
 
+#include <algorithm>
 #include <iterator>
 #include <numeric>
 
+#include <boost/algorithm/string.hpp>
+#include <boost/bind.hpp>
 #include <boost/tokenizer.hpp>
+#include <muduo/net/EventLoop.h>
 
 #include <atlas/rpc.h>
+#include <pioneer/net/gossip.h>
+#include <pioneer/net/leader.h>
 #include <pioneer/net/net.h>
+#include <pioneer/net/offload.h>
 #include <pioneer/system/context.h>
+#include <pioneer/system/runtime_config.h>
+#include <pioneer/system/thread_pool.h>
 
 namespace pioneer {
   namespace rpc {
 
-    using atlas::rpc::rpc_iarchive;
     using atlas::rpc::rpc_context;
-    using atlas::rpc::rf_wrapper;
     using atlas::rpc::async_task;
     using atlas::rpc::rpc_callback_type;
     using atlas::rpc::builtin_rfc;
     using atlas::rpc::nilctx;
 
-    struct ack_callback {
-      ack_callback(unsigned long long r) : round(r) {}
-
-      void operator()(const string& data, int e, async_task& task) {
-        DLOG(INFO) << "got " << task.response_count() << " while " << task.expected_response_count();
-
-        if (task.ready()) {
-          ++system::status::good_ack[round];
-        }
+    // the node to pass a cluster wide call on to, if this node does not lead, see net::leader_election,
+    // 0 if it runs here, or if no leader is known, it's dropped then
+    inline uint32_t cluster_leader(int fn_id, bool* dropped) {
+      *dropped = false;
+      if (net::leader_election::ref().leads()) return 0;
+
+      uint32_t leader = net::leader_election::ref().leader_ip();
+      if (!leader || leader == atlas::rpc::parse_ip(system::context::local_ip)) {
+        LOG(WARNING) << "no leader is known, the cluster wide call " << fn_id << " is dropped";
+        *dropped = true;
+        return 0;
       }
 
-      unsigned long long round;
-    };
+      return leader;
+    }
 
     // we accumulate all the numbers in the vector and return the result to the client
     rpc_result rpc_func::accumulate(const std::vector<int>& numbers, rpc_context c) noexcept {
-      return rpc_result(std::to_string(std::accumulate(numbers.begin(), numbers.end(), 0)));
+      return atlas::rpc::typed_result(std::accumulate(numbers.begin(), numbers.end(), 0));
+    }
+
+    void rpc_func::accumulate_batch(atlas::rpc::fn_batch<decltype(accumulate)>::calls_type& calls,
+        atlas::rpc::fn_batch<decltype(accumulate)>::results_type& results) noexcept {
+      for (size_t i = 0; i < calls.size(); ++i) {
+        const std::vector<int>& numbers = std::get<0>(calls[i]);
+        results[i] = atlas::rpc::typed_result(std::accumulate(numbers.begin(), numbers.end(), 0));
+      }
     }
 
     rpc_result rpc_func::announce_inner_node(const string& ip, rpc_context c) noexcept {
       DLOG(INFO) << "received announcing data node " << ip;
 
+      // a member to gossip with, it's connected once it's gossiped with
+      if (net::gossip::ref().enabled()) {
+        net::gossip::ref().join(ip);
+        return nullptr;
+      }
+
       // catalog and every data node connected to the target data node, including himself
       net::inward_client_pool::ref().connect(ip);
 
@@ -74,6 +97,16 @@ namespace pioneer {
     rpc_result rpc_func::cannounce_inner_node(const string& ip_list, rpc_context c) noexcept {
       DLOG(INFO) << "announcing data nodes " << ip_list;
 
+      // the fan out is coordinated by the leader only
+      bool dropped = false;
+      uint32_t leader = cluster_leader(fn_ids::cannounce_inner_node, &dropped);
+      if (dropped) return nullptr;
+      if (leader) {
+        p2p_client client(inward_client, atlas::rpc::make_endpoint(leader, 0));
+        client.call(cannounce_inner_node, fn_ids::cannounce_inner_node, ip_list, nilctx);
+        return nullptr;
+      }
+
       boost::char_separator<char> sep(",");
       boost::tokenizer<boost::char_separator<char>> tokens(ip_list, sep);
 
@@ -85,103 +118,56 @@ namespace pioneer {
       return nullptr;
     }
 
-    rpc_result rpc_func::udp_test_received(int round, rpc_context c) noexcept {
-      ++system::status::udp_test_received[round];
-
-      return nullptr;
-    }
+    rpc_result rpc_func::set_config(const string& settings, rpc_context c) noexcept {
+      std::vector<std::string> assignments;
+      boost::split(assignments, settings, boost::is_any_of(","), boost::token_compress_on);
+      for (std::string& a : assignments) boost::erase_all(a, " ");
+      assignments.erase(std::remove(assignments.begin(), assignments.end(), ""), assignments.end());
 
-    rpc_result rpc_func::cstart_udp_test(int rounds, int test_count, int interval, int rest_time, rpc_context c) noexcept {
-      mcast_client client;
-      client.call(start_udp_test, fn_ids::start_udp_test, rounds, test_count, interval, rest_time, nilctx);
+      LOG(INFO) << "setting " << settings << " :\n" << system::runtime_config::ref().apply(assignments);
 
       return nullptr;
     }
 
-    rpc_result rpc_func::start_udp_test(int rounds, int test_count, int interval, int rest_time, rpc_context c) noexcept {
-      ::sleep(rest_time);
-
-      system::status::test_rounds = rounds;
+    rpc_result rpc_func::cset_config(const string& settings, rpc_context c) noexcept {
+      DLOG(INFO) << "setting " << settings << " on every server";
 
-      // wait for 5 seconds and then we begin to test
-      for (int i = 0; i < rounds; ++i) {
-        int count = test_count;
-        system::status::udp_test_interval[i] = interval * (rounds - i);
+      bool dropped = false;
+      uint32_t leader = cluster_leader(fn_ids::cset_config, &dropped);
+      if (dropped) return nullptr;
+      if (leader) {
+        p2p_client client(inward_client, atlas::rpc::make_endpoint(leader, 0));
+        client.call(cset_config, fn_ids::cset_config, settings, nilctx);
+        return nullptr;
+      }
 
-        while (0 < count--) {
-          ::usleep(system::status::udp_test_interval[i]);
+      mcast_client client;
+      client.call(set_config, fn_ids::set_config, settings, nilctx);
 
-          ack_callback ack_cb(i);
-          rpc_callback_type cb(ack_cb);
-          mcast_client client(inward_client, system::context::inner_node_count);
-          client.call(udp_test_received, fn_ids::udp_test_received, cb, i, nilctx);
+      return nullptr;
+    }
 
-          ++system::status::udp_test_sent[i];
-        }
+    // bind the implementations to their function ids, the dispatcher finds them in a flat table
+    ATLAS_BIND_REMOTE_FUNC(accumulate, rpc_func::accumulate);
+    ATLAS_BIND_REMOTE_BATCH(accumulate, rpc_func::accumulate, rpc_func::accumulate_batch);
+    // pure, once the result cache is given a capacity, see --result_cache_size
+    ATLAS_RPC_CACHE(accumulate, 60000);
+    // stateless, any inside node runs it for an overloaded one, see net::offload
+    PIONEER_RPC_OFFLOADABLE(accumulate);
 
-        ::sleep(rest_time);
-      }
+    ATLAS_BIND_REMOTE_FUNC(announce_inner_node, rpc_func::announce_inner_node);
+    ATLAS_BIND_REMOTE_FUNC(cannounce_inner_node, rpc_func::cannounce_inner_node);
 
-      return nullptr;
-    }
+    ATLAS_BIND_REMOTE_FUNC(set_config, rpc_func::set_config);
+    ATLAS_BIND_REMOTE_FUNC(cset_config, rpc_func::cset_config);
 
-    // TODO : use meta programming to improve such a complex, ugly code segment
-    class rpc_dispatcher {
-    public:
-
-      static boost::optional<rpc_result> dispatch(int fn_id, const std::string& message, const rpc_context& context) {
-        std::istringstream iss(message);
-        rpc_iarchive ia(iss);
-
-        // LOG(INFO) << "dispatch " << method << " for " << context.session_id() << " from " << context.source_ip();
-
-        switch (fn_id) {
-        case fn_ids::announce_inner_node: {
-          rf_wrapper<decltype(rpc_func::announce_inner_node)> announce_inner_node(rpc_func::announce_inner_node, ia, context);
-          return announce_inner_node();
-        }
-        break;
-        case fn_ids::cannounce_inner_node: {
-          rf_wrapper<decltype(rpc_func::cannounce_inner_node)> cannounce_inner_node(rpc_func::cannounce_inner_node, ia, context);
-          return cannounce_inner_node();
-        }
-        break;
-        case fn_ids::accumulate: {
-          rf_wrapper<decltype(rpc_func::accumulate)> accumulate(rpc_func::accumulate, ia, context);
-          return accumulate();
-        }
-        break;
-        case fn_ids::udp_test_received: {
-          rf_wrapper<decltype(rpc_func::udp_test_received)> udp_test_received(rpc_func::udp_test_received, ia, context);
-          return udp_test_received();
-        }
-        break;
-        case fn_ids::start_udp_test: {
-          rf_wrapper<decltype(rpc_func::start_udp_test)> start_udp_test(rpc_func::start_udp_test, ia, context);
-          return start_udp_test();
-        }
-        break;
-        case fn_ids::cstart_udp_test: {
-          rf_wrapper<decltype(rpc_func::cstart_udp_test)> cstart_udp_test(rpc_func::cstart_udp_test, ia, context);
-          return cstart_udp_test();
-        }
-        break;
-        default:
-          // not be responsible to this rpc
-          return boost::none;
-          // DLOG(INFO) << "no method " << method;
-        break;
-        } // switch
-
-        return boost::none;
-      }
-    };
+    // the membership changes are never queued behind the data plane requests
+    PIONEER_RPC_PRIORITY(announce_inner_node, 10);
+    PIONEER_RPC_PRIORITY(cannounce_inner_node, 10);
+    PIONEER_RPC_PRIORITY(set_config, 10);
+    PIONEER_RPC_PRIORITY(cset_config, 10);
 
   } // rpc
 } // pioneer
 
-// must be placed outside any namespace due to macro's limitation
-// it might be better to use meta programming technology to implement the registering
-ATLAS_REGISTER_RPC_DISPATCHER(pioneer_main_module, pioneer::rpc::rpc_dispatcher::dispatch);
-
 #endif // RFC_SERVICE_RFC_FUNC_SERVER_H_
@@ -0,0 +1,494 @@
+/*
+ * storm_bench.cpp
+ *
+ *  Created on: Sep 17, 2013
+ *      Author: vincent
+ */
+
+/*    Copyright 2011 ~ 2013 Vincent Zhang, ivincent.zhang@gmail.com
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+/*
+ * The startup and connection storm benchmark, the time until a server is ready, and what happens when a fleet of
+ * clients connects to it at once.
+ *
+ * startup : with --server, the server is started by the benchmark, and it's ready once the report server answers
+ * with a non zero pioneer_startup_seconds, which is the time from start() until all the services are running
+ *
+ * storm : the clients connect to the outward or the inward port at the same time, all the connects are sent before
+ * any of them is waited for, so the accept path sees them as a fleet reconnecting after a restart. It reports
+ *
+ * connect : the time until all the connects are done, and the accept rate, the connects beyond the listen backlog
+ *           wait for a SYN retry, a second at least, it's seen as a jump of the max
+ * populated : the time until the connection pool holds all the clients, read from the metrics of the report server,
+ *             the connection callbacks run in the I/O loops after the accepts
+ * drained : the time until the pool is back to it's size before the storm, once the clients close
+ * handle : the cost of a connection callback, see net::connection_stats, the quantiles are since the server started
+ *
+ * The clients take a file descriptor each, the soft limit is raised to the hard one, and the local ports of a host
+ * are 28 thousands by default, see ip_local_port_range, run more benchmarks on more hosts for a larger fleet.
+ *
+ * try : storm_bench --server "./server --logtostderr" --targets outward,inward --clients 1000,10000 --rounds 3
+ * */
+
+#include "config.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <boost/algorithm/string.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/program_options.hpp>
+
+#include <atlas/rpc/stats.h>
+
+namespace po = boost::program_options;
+
+using atlas::rpc::latency_histogram;
+
+namespace {
+
+  typedef std::chrono::steady_clock clock_type;
+
+  const std::string usage = "usage : storm_bench [options], try storm_bench --help";
+
+  // the metrics are polled at this interval while waiting for the server
+  const std::chrono::milliseconds poll_interval(5);
+
+  inline double seconds_since(clock_type::time_point start) {
+    return std::chrono::duration<double>(clock_type::now() - start).count();
+  }
+
+  inline void record(latency_histogram& h, uint64_t ns) {
+    ++h.counts[latency_histogram::index(ns)];
+    ++h.total;
+    h.sum += ns;
+    if (ns > h.max) h.max = ns;
+  }
+
+  sockaddr_in make_address(const std::string& host, int port) {
+    sockaddr_in addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(static_cast<uint16_t>(port));
+
+    if (::inet_pton(AF_INET, host.c_str(), &addr.sin_addr) != 1) throw std::invalid_argument("bad host " + host);
+
+    return addr;
+  }
+
+  // the body of a GET of the report server, empty if it does not answer
+  std::string http_get(const sockaddr_in& addr, const std::string& path) {
+    int fd = ::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) return std::string();
+
+    timeval timeout = { 1, 0 };
+    ::setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    ::setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    std::string response;
+    if (::connect(fd, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr)) == 0) {
+      std::string request = "GET " + path + " HTTP/1.1\r\nHost: storm_bench\r\nConnection: close\r\n\r\n";
+
+      if (::send(fd, request.data(), request.size(), MSG_NOSIGNAL) == static_cast<ssize_t>(request.size())) {
+        char buf[64 * 1024];
+        ssize_t n;
+        while ((n = ::recv(fd, buf, sizeof(buf), 0)) > 0) response.append(buf, n);
+      }
+    }
+
+    ::close(fd);
+
+    // HTTP/1.x 200
+    if (response.size() < 12 || response.compare(9, 3, "200") != 0) return std::string();
+
+    std::string::size_type body = response.find("\r\n\r\n");
+    return body == std::string::npos ? std::string() : response.substr(body + 4);
+  }
+
+  // the value of a sample in the Prometheus text, for example pioneer_connection_pool_size{pool="outward"}, or -1
+  double sample_value(const std::string& metrics, const std::string& key) {
+    std::istringstream is(metrics);
+    std::string line;
+
+    while (std::getline(is, line)) {
+      if (line.size() > key.size() && line.compare(0, key.size(), key) == 0 && line[key.size()] == ' ') {
+        return std::atof(line.c_str() + key.size() + 1);
+      }
+    }
+
+    return -1;
+  }
+
+  double fetch_sample(const sockaddr_in& report, const std::string& key) {
+    return sample_value(http_get(report, "/metrics"), key);
+  }
+
+  // poll the metrics until the sample satisfies the predicate, the seconds it took, or -1 at the timeout
+  template<typename Predicate>
+  double wait_for(const sockaddr_in& report, const std::string& key, clock_type::time_point start, double timeout,
+      Predicate pred) {
+    while (seconds_since(start) < timeout) {
+      double v = fetch_sample(report, key);
+      if (v >= 0 && pred(v)) return seconds_since(start);
+
+      std::this_thread::sleep_for(poll_interval);
+    }
+
+    return -1;
+  }
+
+  // a port of the server, and the names of it's pool and connection type in the metrics
+  struct target {
+    std::string name;
+    int port;
+    std::string pool;
+    std::string type;
+  };
+
+  struct storm_result {
+    std::string target;
+    int clients;
+    int round;
+    int connected;
+    int failed;
+    double connect_seconds;
+    double populated_seconds;
+    double drained_seconds;
+    latency_histogram connect_latency;
+    // the quantiles of the connection callbacks in seconds, -1 if the server does not report them
+    double handle_p50;
+    double handle_p99;
+    double handle_max;
+  };
+
+  storm_result run_storm(const std::string& host, const sockaddr_in& report, const target& t, int clients, int round,
+      double timeout) {
+    storm_result r;
+    r.target = t.name;
+    r.clients = clients;
+    r.round = round;
+    r.connected = r.failed = 0;
+    r.connect_seconds = r.populated_seconds = r.drained_seconds = -1;
+
+    const std::string pool_key = "pioneer_connection_pool_size{pool=\"" + t.pool + "\"}";
+
+    double baseline = fetch_sample(report, pool_key);
+    if (baseline < 0) throw std::runtime_error("no " + pool_key + " from the report server");
+
+    sockaddr_in addr = make_address(host, t.port);
+
+    // the sockets are created before the storm, so the connects are sent back to back
+    std::vector<int> fds;
+    fds.reserve(clients);
+    for (int i = 0; i < clients; ++i) {
+      int fd = ::socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+      if (fd < 0) {
+        for (int f : fds) ::close(f);
+        throw std::runtime_error(std::string("socket : ") + std::strerror(errno));
+      }
+      fds.push_back(fd);
+    }
+
+    int epfd = ::epoll_create1(EPOLL_CLOEXEC);
+    std::vector<clock_type::time_point> started(clients);
+
+    clock_type::time_point start = clock_type::now();
+
+    int pending = 0;
+    for (int i = 0; i < clients; ++i) {
+      started[i] = clock_type::now();
+
+      if (::connect(fds[i], reinterpret_cast<const sockaddr*>(&addr), sizeof(addr)) == 0) {
+        ++r.connected;
+        record(r.connect_latency, std::chrono::duration_cast<std::chrono::nanoseconds>(clock_type::now() - started[i]).count());
+        continue;
+      }
+
+      if (errno != EINPROGRESS) {
+        ++r.failed;
+        continue;
+      }
+
+      epoll_event ev;
+      ev.events = EPOLLOUT;
+      ev.data.u32 = i;
+      ::epoll_ctl(epfd, EPOLL_CTL_ADD, fds[i], &ev);
+      ++pending;
+    }
+
+    std::vector<epoll_event> events(1024);
+    while (pending > 0 && seconds_since(start) < timeout) {
+      int n = ::epoll_wait(epfd, events.data(), events.size(), 100);
+
+      for (int e = 0; e < n; ++e) {
+        int i = events[e].data.u32;
+
+        int error = 0;
+        socklen_t len = sizeof(error);
+        ::getsockopt(fds[i], SOL_SOCKET, SO_ERROR, &error, &len);
+
+        if (error == 0) {
+          ++r.connected;
+          record(r.connect_latency, std::chrono::duration_cast<std::chrono::nanoseconds>(clock_type::now() - started[i]).count());
+        }
+        else {
+          ++r.failed;
+        }
+
+        ::epoll_ctl(epfd, EPOLL_CTL_DEL, fds[i], nullptr);
+        --pending;
+      }
+    }
+
+    // the connects still pending at the timeout failed
+    r.failed += pending;
+    r.connect_seconds = seconds_since(start);
+
+    ::close(epfd);
+
+    double expected = baseline + r.connected;
+    r.populated_seconds = wait_for(report, pool_key, start, timeout, [expected](double v) { return v >= expected; });
+
+    const std::string handle_key = "pioneer_connection_handle_seconds{type=\"" + t.type + "\",quantile=\"";
+    std::string metrics = http_get(report, "/metrics");
+    r.handle_p50 = sample_value(metrics, handle_key + "0.5\"}");
+    r.handle_p99 = sample_value(metrics, handle_key + "0.99\"}");
+    r.handle_max = sample_value(metrics, handle_key + "1\"}");
+
+    clock_type::time_point closed = clock_type::now();
+    for (int fd : fds) ::close(fd);
+
+    r.drained_seconds = wait_for(report, pool_key, closed, timeout, [baseline](double v) { return v <= baseline; });
+
+    return r;
+  }
+
+  // with --server, start the server and wait until it's ready, the seconds it took, or -1
+  double start_server(const std::string& command, const sockaddr_in& report, double timeout, pid_t& pid) {
+    clock_type::time_point start = clock_type::now();
+
+    pid = ::fork();
+    if (pid < 0) throw std::runtime_error(std::string("fork : ") + std::strerror(errno));
+
+    if (pid == 0) {
+      // exec, so the server gets the signals of the shell
+      std::string exec = "exec " + command;
+      ::execl("/bin/sh", "sh", "-c", exec.c_str(), static_cast<char*>(nullptr));
+      ::_exit(127);
+    }
+
+    return wait_for(report, "pioneer_startup_seconds", start, timeout, [](double v) { return v > 0; });
+  }
+
+  void stop_server(pid_t pid) {
+    if (pid <= 0) return;
+
+    ::kill(pid, SIGTERM);
+
+    int status = 0;
+    ::waitpid(pid, &status, 0);
+  }
+
+  // the file descriptors of the clients, or fewer if the hard limit is lower
+  bool raise_fd_limit(rlim_t wanted) {
+    rlimit limit;
+    if (::getrlimit(RLIMIT_NOFILE, &limit) != 0) return false;
+    if (limit.rlim_cur >= wanted) return true;
+
+    limit.rlim_cur = std::min(wanted, limit.rlim_max);
+    if (::setrlimit(RLIMIT_NOFILE, &limit) != 0) return false;
+
+    return limit.rlim_cur >= wanted;
+  }
+
+  template<typename T>
+  std::vector<T> parse_list(const std::string& spec) {
+    std::vector<std::string> items;
+    boost::split(items, spec, boost::is_any_of(","), boost::token_compress_on);
+
+    std::vector<T> values;
+    for (const std::string& item : items) {
+      if (!item.empty()) values.push_back(boost::lexical_cast<T>(boost::trim_copy(item)));
+    }
+
+    return values;
+  }
+
+  // -1 stays -1, the sample is missing
+  inline double to_us(double seconds) {
+    return seconds < 0 ? -1 : seconds * 1e6;
+  }
+
+  void report(const storm_result& r, const std::string& format) {
+    double accept_rate = r.connect_seconds > 0 ? r.connected / r.connect_seconds : 0;
+
+    if (format == "csv") {
+      std::cout << r.target << "," << r.clients << "," << r.round << "," << r.connected << "," << r.failed << ","
+                << r.connect_seconds << "," << accept_rate << "," << r.connect_latency.percentile(0.5) / 1e3 << ","
+                << r.connect_latency.percentile(0.99) / 1e3 << "," << r.connect_latency.max / 1e3 << ","
+                << r.populated_seconds << "," << r.drained_seconds << "," << to_us(r.handle_p50) << ","
+                << to_us(r.handle_p99) << "," << to_us(r.handle_max) << std::endl;
+
+      return;
+    }
+
+    std::printf("%-8s %6d clients round %d : %d connected, %d failed in %.3f s, %.0f accepts/s, connect (us) p50 %.1f "
+        "p99 %.1f max %.1f\n", r.target.c_str(), r.clients, r.round, r.connected, r.failed, r.connect_seconds, accept_rate,
+        r.connect_latency.percentile(0.5) / 1e3, r.connect_latency.percentile(0.99) / 1e3, r.connect_latency.max / 1e3);
+    std::printf("%-8s %6s         populated in %.3f s, drained in %.3f s, handle (us) p50 %.1f p99 %.1f max %.1f\n",
+        "", "", r.populated_seconds, r.drained_seconds, to_us(r.handle_p50), to_us(r.handle_p99), to_us(r.handle_max));
+  }
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+  po::options_description desc("Allowed options");
+  desc.add_options()
+      ("help", "produce help message")
+      ("server", po::value<std::string>(), "the command to start the server, the running one is used if not given")
+      ("host", po::value<std::string>()->default_value("127.0.0.1"), "the ip of the server")
+      ("outward_port", po::value<int>()->default_value(PIONEER_OUTWARD_SERVER_PORT), "outward server port")
+      ("inward_port", po::value<int>()->default_value(PIONEER_INWARD_SERVER_PORT), "inward server port")
+      ("reporter_port", po::value<int>()->default_value(PIONEER_REPORT_SERVER_PORT), "report server port")
+      ("targets", po::value<std::string>()->default_value("outward,inward"), "outward, inward or both")
+      ("clients", po::value<std::string>()->default_value("100,1000,10000"), "the clients of a storm, separated by commas")
+      ("rounds", po::value<int>()->default_value(3), "the storms of every target and client count")
+      ("timeout", po::value<double>()->default_value(30), "the seconds to wait for the server in every step")
+      ("format", po::value<std::string>()->default_value("text"), "text or csv");
+
+  po::variables_map vm;
+  try {
+    po::store(po::parse_command_line(argc, argv, desc), vm);
+    po::notify(vm);
+  }
+  catch (const std::exception& e) {
+    std::cerr << e.what() << "\n" << usage << std::endl;
+    return 1;
+  }
+
+  if (vm.count("help")) {
+    std::cout << desc << std::endl;
+    return 0;
+  }
+
+  std::string host = vm["host"].as<std::string>();
+  double timeout = vm["timeout"].as<double>();
+  int rounds = vm["rounds"].as<int>();
+  std::string format = vm["format"].as<std::string>();
+
+  std::vector<target> targets;
+  std::vector<int> client_counts;
+  sockaddr_in report_address;
+  try {
+    report_address = make_address(host, vm["reporter_port"].as<int>());
+
+    for (const std::string& name : parse_list<std::string>(vm["targets"].as<std::string>())) {
+      if (name == "outward") {
+        targets.push_back(target { name, vm["outward_port"].as<int>(), "outward", "outward server" });
+      }
+      else if (name == "inward") {
+        targets.push_back(target { name, vm["inward_port"].as<int>(), "inward", "inward server" });
+      }
+      else {
+        throw std::invalid_argument("unknown target " + name);
+      }
+    }
+
+    client_counts = parse_list<int>(vm["clients"].as<std::string>());
+  }
+  catch (const std::exception& e) {
+    std::cerr << e.what() << "\n" << usage << std::endl;
+    return 1;
+  }
+
+  int max_clients = 0;
+  for (int clients : client_counts) max_clients = std::max(max_clients, clients);
+  // the sockets of the report server and the standard streams
+  if (!raise_fd_limit(max_clients + 64)) {
+    std::cerr << "the file descriptor limit is below " << max_clients + 64 << ", raise it by ulimit -n" << std::endl;
+    return 1;
+  }
+
+  // a server started by the benchmark is stopped by it, the signals of the benchmark are the server's
+  pid_t server_pid = 0;
+  if (vm.count("server")) {
+    double ready = start_server(vm["server"].as<std::string>(), report_address, timeout, server_pid);
+    if (ready < 0) {
+      std::cerr << "the server is not ready in " << timeout << " s" << std::endl;
+      stop_server(server_pid);
+      return 1;
+    }
+
+    std::printf("ready in %.3f s, the server reports %.3f s from start() until all the services are running\n", ready,
+        fetch_sample(report_address, "pioneer_startup_seconds"));
+  }
+  else {
+    double startup = fetch_sample(report_address, "pioneer_startup_seconds");
+    if (startup < 0) {
+      std::cerr << "the report server does not answer at " << host << ":" << vm["reporter_port"].as<int>() << std::endl;
+      return 1;
+    }
+
+    std::printf("the server reports %.3f s from start() until all the services are running\n", startup);
+  }
+
+  if (format == "csv") {
+    std::cout << "target,clients,round,connected,failed,connect_seconds,accepts_per_sec,connect_p50_us,connect_p99_us,"
+              << "connect_max_us,populated_seconds,drained_seconds,handle_p50_us,handle_p99_us,handle_max_us" << std::endl;
+  }
+
+  int status = 0;
+  for (const target& t : targets) {
+    for (int clients : client_counts) {
+      if (clients <= 0) continue;
+
+      for (int round = 0; round < rounds; ++round) {
+        try {
+          report(run_storm(host, report_address, t, clients, round, timeout), format);
+        }
+        catch (const std::exception& e) {
+          std::cerr << t.name << " " << clients << " clients failed : " << e.what() << std::endl;
+          status = 1;
+        }
+      }
+    }
+  }
+
+  stop_server(server_pid);
+
+  return status;
+}
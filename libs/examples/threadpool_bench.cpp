@@ -0,0 +1,397 @@
+/*
+ * threadpool_bench.cpp
+ *
+ *  Created on: Sep 15, 2013
+ *      Author: vincent
+ */
+
+/*    Copyright 2011 ~ 2013 Vincent Zhang, ivincent.zhang@gmail.com
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+/*
+ * The benchmark of the scheduling policies of the thread pools, the baseline of the scheduler work.
+ *
+ * empty : the producers schedule empty tasks as fast as they can, the tasks per second until all are run
+ * fanout : one thread schedules a fan of tasks and waits for the last one, the latency of a round
+ * io : the producers act as the I/O loops, a read of a batch of requests shares one buffer, and the requests are
+ *      scheduled one by one or by schedule_bulk() as message_handler::run_task and task_batch do, every task spins
+ *      for the work time, the throughput and the queue delay from the schedule to the start of a task, without
+ *      a rate the producers outrun the workers, and the delay is of the backlog
+ *
+ * try : threadpool_bench --pools fifo,ws --benches empty,io --producers 1,2,4 --threads 4 --format csv
+ * */
+
+#include <cstdint>
+#include <cstdio>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <boost/algorithm/string.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/program_options.hpp>
+
+#include <atlas/thread_pool.h>
+#include <atlas/rpc/stats.h>
+
+#include "benchmark.h"
+
+namespace po = boost::program_options;
+
+using namespace pioneer;
+
+using atlas::rpc::latency_histogram;
+
+namespace {
+
+  typedef std::chrono::steady_clock clock_type;
+
+  const std::string usage = "usage : threadpool_bench [options], try threadpool_bench --help";
+
+  inline uint64_t now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(clock_type::now().time_since_epoch()).count();
+  }
+
+  inline void record(latency_histogram& h, uint64_t ns) {
+    ++h.counts[latency_histogram::index(ns)];
+    ++h.total;
+    h.sum += ns;
+    if (ns > h.max) h.max = ns;
+  }
+
+  // burn the CPU for a while, as a cheap request does
+  inline void spin(uint64_t ns) {
+    if (!ns) return;
+
+    uint64_t end = now_ns() + ns;
+    while (now_ns() < end) bench::do_not_optimize(end);
+  }
+
+  // the priority pool takes the prioritized tasks, all the tasks of the benchmark are of the same priority
+  template<typename Pool>
+  struct task_maker {
+    template<typename F>
+    static typename Pool::task_type make(F&& f) { return typename Pool::task_type(std::forward<F>(f)); }
+  };
+
+  template<>
+  struct task_maker<atlas::prio_thread_pool> {
+    template<typename F>
+    static atlas::prio_thread_pool::task_type make(F&& f) {
+      return atlas::prio_thread_pool::task_type(0, boostplus::threadpool::task_func(std::forward<F>(f)));
+    }
+  };
+
+  struct bench_options {
+    size_t threads;
+    uint64_t tasks;
+    int fan;
+    int rounds;
+    int batch;
+    uint64_t work_ns;
+    double rate;        // the requests per second of all the io producers, 0 for as fast as possible
+  };
+
+  struct bench_result {
+    std::string bench;
+    std::string pool;
+    size_t threads;
+    int producers;
+    uint64_t tasks;
+    double seconds;
+    latency_histogram latency;  // of a round for fanout, the queue delay for io, empty for empty
+  };
+
+  // start the producers at once, return the seconds from the start until the pool runs out of tasks
+  template<typename Pool>
+  double run_producers(Pool& pool, int producers, const std::function<void(int)>& produce) {
+    std::atomic<int> ready(0);
+    std::atomic<bool> go(false);
+
+    std::vector<std::thread> threads;
+    for (int i = 0; i < producers; ++i) {
+      threads.push_back(std::thread([&, i]() {
+        ++ready;
+        while (!go.load(std::memory_order_acquire)) std::this_thread::yield();
+
+        produce(i);
+      }));
+    }
+
+    while (ready.load() < producers) std::this_thread::yield();
+
+    clock_type::time_point start = clock_type::now();
+    go.store(true, std::memory_order_release);
+
+    for (auto& t : threads) t.join();
+    pool.wait();
+
+    return std::chrono::duration<double>(clock_type::now() - start).count();
+  }
+
+  template<typename Pool>
+  bench_result empty_tasks(const bench_options& options, int producers) {
+    Pool pool(options.threads);
+
+    bench_result r;
+    r.tasks = options.tasks / producers * producers;
+    r.seconds = run_producers(pool, producers, [&pool, &options, producers](int) {
+      for (uint64_t i = 0; i < options.tasks / producers; ++i) pool.schedule(task_maker<Pool>::make([]() {}));
+    });
+
+    return r;
+  }
+
+  template<typename Pool>
+  bench_result fan_out(const bench_options& options, int) {
+    Pool pool(options.threads);
+
+    bench_result r;
+    r.tasks = static_cast<uint64_t>(options.fan) * options.rounds;
+
+    clock_type::time_point start = clock_type::now();
+    for (int round = 0; round < options.rounds; ++round) {
+      std::atomic<int> left(options.fan);
+      std::atomic<bool> done(false);
+
+      uint64_t begin = now_ns();
+      for (int i = 0; i < options.fan; ++i) {
+        pool.schedule(task_maker<Pool>::make([&left, &done]() {
+          if (left.fetch_sub(1) == 1) done.store(true, std::memory_order_release);
+        }));
+      }
+
+      // the waiter of the fan in spins, as a caller waiting for the responses of a scatter does
+      while (!done.load(std::memory_order_acquire)) std::this_thread::yield();
+      record(r.latency, now_ns() - begin);
+    }
+
+    r.seconds = std::chrono::duration<double>(clock_type::now() - start).count();
+
+    return r;
+  }
+
+  template<typename Pool>
+  bench_result io_producers(const bench_options& options, int producers) {
+    Pool pool(options.threads);
+
+    uint64_t per_producer = options.tasks / producers;
+    size_t batch = std::max(options.batch, 1);
+
+    // every task writes it's own slot, so the workers share no histogram
+    std::vector<uint64_t> delays(per_producer * producers, 0);
+
+    bench_result r;
+    r.tasks = delays.size();
+    r.seconds = run_producers(pool, producers, [&](int producer) {
+      std::vector<typename Pool::task_type> tasks;
+      tasks.reserve(batch);
+
+      // the reads of a producer come at the interval, the producers start evenly spread in the first one
+      uint64_t interval = options.rate > 0 ? static_cast<uint64_t>(1e9 * batch * producers / options.rate) : 0;
+      clock_type::time_point next = clock_type::now() + std::chrono::nanoseconds(interval * producer / producers);
+
+      for (uint64_t i = 0; i < per_producer; i += batch) {
+        if (interval) {
+          std::this_thread::sleep_until(next);
+          next += std::chrono::nanoseconds(interval);
+        }
+
+        // a read of a batch of requests, the requests share the buffer of the read
+        std::shared_ptr<std::string> buffer(new std::string(64 * batch, 'x'));
+
+        size_t count = std::min<uint64_t>(batch, per_producer - i);
+        for (size_t j = 0; j < count; ++j) {
+          uint64_t* slot = &delays[producer * per_producer + i + j];
+          uint64_t scheduled = now_ns();
+          uint64_t work = options.work_ns;
+
+          auto task = task_maker<Pool>::make([buffer, slot, scheduled, work]() {
+            *slot = now_ns() - scheduled;
+            spin(work);
+            bench::do_not_optimize(buffer->size());
+          });
+
+          if (batch == 1) pool.schedule(std::move(task));
+          else tasks.push_back(std::move(task));
+        }
+
+        if (!tasks.empty()) {
+          pool.schedule_bulk(tasks.begin(), tasks.end());
+          tasks.clear();
+        }
+      }
+    });
+
+    for (uint64_t d : delays) record(r.latency, d);
+
+    return r;
+  }
+
+  typedef std::function<bench_result(const bench_options&, int)> bench_function;
+
+  template<typename Pool>
+  void add_pool(std::map<std::string, std::map<std::string, bench_function>>& benches, const std::string& pool) {
+    benches["empty"][pool] = empty_tasks<Pool>;
+    benches["fanout"][pool] = fan_out<Pool>;
+    benches["io"][pool] = io_producers<Pool>;
+  }
+
+  // the benchmarks by their names, and the pools of a benchmark by theirs, add the new policies here
+  std::map<std::string, std::map<std::string, bench_function>> make_benches() {
+    std::map<std::string, std::map<std::string, bench_function>> benches;
+
+    add_pool<atlas::fifo_thread_pool>(benches, "fifo");
+    add_pool<atlas::lifo_thread_pool>(benches, "lifo");
+    add_pool<atlas::prio_thread_pool>(benches, "prio");
+    add_pool<atlas::ws_thread_pool>(benches, "ws");
+    add_pool<atlas::adaptive_thread_pool>(benches, "adaptive");
+
+    return benches;
+  }
+
+  template<typename T>
+  std::vector<T> parse_list(const std::string& spec) {
+    std::vector<std::string> items;
+    boost::split(items, spec, boost::is_any_of(","), boost::token_compress_on);
+
+    std::vector<T> values;
+    for (const std::string& item : items) {
+      if (!item.empty()) values.push_back(boost::lexical_cast<T>(boost::trim_copy(item)));
+    }
+
+    return values;
+  }
+
+  void report(const bench_result& r, const std::string& format) {
+    double tasks_per_sec = r.seconds > 0 ? r.tasks / r.seconds : 0;
+    const double qs[] = { 0.5, 0.9, 0.99, 0.999 };
+
+    if (format == "csv") {
+      std::cout << r.bench << "," << r.pool << "," << r.threads << "," << r.producers << "," << r.tasks << ","
+                << r.seconds << "," << tasks_per_sec << "," << r.latency.mean() / 1e3;
+      for (double q : qs) std::cout << "," << r.latency.percentile(q) / 1e3;
+      std::cout << "," << r.latency.max / 1e3 << std::endl;
+
+      return;
+    }
+
+    std::printf("%-8s %-10s %3zu threads %3d producers %14.0f tasks/s", r.bench.c_str(), r.pool.c_str(), r.threads,
+        r.producers, tasks_per_sec);
+    if (r.latency.total) {
+      std::printf(", %s (us) p50 %.1f p99 %.1f p99.9 %.1f max %.1f", r.bench == "io" ? "queue delay" : "round",
+          r.latency.percentile(0.5) / 1e3, r.latency.percentile(0.99) / 1e3, r.latency.percentile(0.999) / 1e3,
+          r.latency.max / 1e3);
+    }
+    std::printf("\n");
+  }
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+  po::options_description desc("Allowed options");
+  desc.add_options()
+      ("help", "produce help message")
+      ("pools", po::value<std::string>()->default_value("fifo,lifo,prio,ws,adaptive"), "the pools, separated by commas")
+      ("benches", po::value<std::string>()->default_value("empty,fanout,io"), "empty, fanout or io, separated by commas")
+      ("threads", po::value<size_t>()->default_value(std::max(std::thread::hardware_concurrency(), 1u)),
+          "the worker threads of a pool")
+      ("producers", po::value<std::string>()->default_value("1,2,4"), "the producer counts of empty and io")
+      ("tasks", po::value<uint64_t>()->default_value(1000000), "the tasks of a run of empty and io")
+      ("fan", po::value<int>()->default_value(64), "the tasks of a fanout round")
+      ("rounds", po::value<int>()->default_value(10000), "the fanout rounds")
+      ("batch", po::value<int>()->default_value(16), "the requests of a read in io, 1 schedules them one by one")
+      ("work", po::value<uint64_t>()->default_value(1000), "the nanoseconds an io task spins")
+      ("rate", po::value<double>()->default_value(0), "the requests per second of all the io producers, 0 for unlimited")
+      ("format", po::value<std::string>()->default_value("text"), "text or csv");
+
+  po::variables_map vm;
+  try {
+    po::store(po::parse_command_line(argc, argv, desc), vm);
+    po::notify(vm);
+  }
+  catch (const std::exception& e) {
+    std::cerr << e.what() << "\n" << usage << std::endl;
+    return 1;
+  }
+
+  if (vm.count("help")) {
+    std::cout << desc << std::endl;
+    return 0;
+  }
+
+  bench_options options;
+  options.threads = std::max<size_t>(vm["threads"].as<size_t>(), 1);
+  options.tasks = vm["tasks"].as<uint64_t>();
+  options.fan = std::max(vm["fan"].as<int>(), 1);
+  options.rounds = std::max(vm["rounds"].as<int>(), 1);
+  options.batch = vm["batch"].as<int>();
+  options.work_ns = vm["work"].as<uint64_t>();
+  options.rate = vm["rate"].as<double>();
+
+  std::map<std::string, std::map<std::string, bench_function>> benches = make_benches();
+
+  std::vector<std::string> pools, names;
+  std::vector<int> producer_counts;
+  try {
+    pools = parse_list<std::string>(vm["pools"].as<std::string>());
+    names = parse_list<std::string>(vm["benches"].as<std::string>());
+    producer_counts = parse_list<int>(vm["producers"].as<std::string>());
+
+    for (const std::string& name : names) {
+      if (!benches.count(name)) throw std::invalid_argument("unknown benchmark " + name);
+    }
+    for (const std::string& pool : pools) {
+      if (!benches["empty"].count(pool)) throw std::invalid_argument("unknown pool " + pool);
+    }
+  }
+  catch (const std::exception& e) {
+    std::cerr << e.what() << "\n" << usage << std::endl;
+    return 1;
+  }
+
+  std::string format = vm["format"].as<std::string>();
+  if (format == "csv") {
+    std::cout << "bench,pool,threads,producers,tasks,seconds,tasks_per_sec,mean_us,p50_us,p90_us,p99_us,p999_us,max_us"
+              << std::endl;
+  }
+
+  for (const std::string& name : names) {
+    for (const std::string& pool : pools) {
+      // a fanout round has one producer
+      std::vector<int> counts = name == "fanout" ? std::vector<int>(1, 1) : producer_counts;
+
+      for (int producers : counts) {
+        if (producers <= 0) continue;
+
+        bench_result r = benches[name][pool](options, producers);
+        r.bench = name;
+        r.pool = pool;
+        r.threads = options.threads;
+        r.producers = producers;
+
+        report(r, format);
+      }
+    }
+  }
+
+  return 0;
+}
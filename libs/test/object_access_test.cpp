@@ -0,0 +1,157 @@
+/*
+ * object_access_test.cpp
+ *
+ *  Created on: Sep 28, 2013
+ *      Author: vincent
+ */
+
+/*    Copyright 2011 ~ 2013 Vincent Zhang, ivincent.zhang@gmail.com
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+/*
+ * The deltas of object_access, a delta saved against the original patches a copy of it into the modified
+ * object, and a small change logs a few bytes
+ * */
+
+#define BOOST_TEST_MODULE object_access
+#include <boost/test/included/unit_test.hpp>
+
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <string>
+#include <vector>
+
+#include <boost/serialization/is_bitwise_serializable.hpp>
+#include <boost/serialization/string.hpp>
+#include <boost/serialization/vector.hpp>
+
+#include <atlas/transaction/archive.hpp>
+
+namespace bt = boost::transact;
+
+namespace {
+
+  struct page {
+    char bytes[4096];
+  };
+
+  struct profile {
+    uint32_t id;
+    std::string name;
+    std::vector<int> scores;
+
+    template<class Archive>
+    void serialize(Archive& ar, const unsigned int) {
+      ar & id & name & scores;
+    }
+
+    bool operator==(const profile& p) const { return id == p.id && name == p.name && scores == p.scores; }
+  };
+
+}
+
+BOOST_IS_BITWISE_SERIALIZABLE(page)
+
+namespace {
+
+  typedef std::back_insert_iterator<std::vector<char>> output_iterator;
+  typedef std::vector<char>::const_iterator input_iterator;
+
+  template<class T>
+  std::vector<char> save_delta(const T& original, const T& modified) {
+    std::vector<char> delta;
+    bt::char_oarchive<output_iterator> ar { output_iterator(delta) };
+    bt::object_access::save_delta(ar, original, modified);
+    return delta;
+  }
+
+  // patch a copy of the original with the delta
+  template<class T>
+  T load_delta(const T& original, const std::vector<char>& delta) {
+    T t = original;
+    bt::char_iarchive<input_iterator> ar(delta.begin(), delta.end());
+    bt::object_access::load_delta(ar, t);
+    return t;
+  }
+
+}
+
+BOOST_AUTO_TEST_CASE(bitwise_delta) {
+  page original;
+  std::memset(original.bytes, 'o', sizeof(original.bytes));
+
+  page modified = original;
+  modified.bytes[10] = 'a';
+  modified.bytes[11] = 'b';
+  modified.bytes[3000] = 'c';
+
+  const std::vector<char> delta = save_delta(original, modified);
+  BOOST_CHECK_LT(delta.size(), 100u);
+
+  const page patched = load_delta(original, delta);
+  BOOST_CHECK(std::memcmp(patched.bytes, modified.bytes, sizeof(modified.bytes)) == 0);
+
+  // no change, no range
+  BOOST_CHECK_EQUAL(save_delta(original, original).size(), 2 * sizeof(std::size_t));
+}
+
+BOOST_AUTO_TEST_CASE(serialized_delta) {
+  std::vector<int> original(10000);
+  for (int i = 0; i < 10000; ++i) original[i] = i;
+
+  std::vector<int> modified = original;
+  modified[5000] = -1;
+
+  const std::vector<char> delta = save_delta(original, modified);
+  BOOST_CHECK_LT(delta.size(), 100u);
+  BOOST_CHECK(load_delta(original, delta) == modified);
+
+  std::vector<int> shrunk(original.begin(), original.begin() + 100);
+  BOOST_CHECK(load_delta(original, save_delta(original, shrunk)) == shrunk);
+
+  std::vector<int> grown = original;
+  grown.push_back(10000);
+  grown.push_back(10001);
+  BOOST_CHECK(load_delta(original, save_delta(original, grown)) == grown);
+}
+
+BOOST_AUTO_TEST_CASE(member_serialize_delta) {
+  profile original { 7, "original", std::vector<int>(1000, 1) };
+
+  profile modified = original;
+  modified.name = "modified";
+  modified.scores[999] = 2;
+
+  const std::vector<char> delta = save_delta(original, modified);
+  BOOST_CHECK_LT(delta.size(), 200u);
+  BOOST_CHECK(load_delta(original, delta) == modified);
+}
+
+BOOST_AUTO_TEST_CASE(delta_out_of_range_fails) {
+  page original;
+  std::memset(original.bytes, 0, sizeof(original.bytes));
+
+  // one range past the end of the image
+  std::vector<char> delta;
+  {
+    bt::char_oarchive<output_iterator> ar { output_iterator(delta) };
+    const std::size_t size = sizeof(page), count = 1, offset = sizeof(page) - 1, n = 2;
+    ar << size << count << offset << n;
+    ar.save_binary("xx", 2);
+  }
+
+  BOOST_CHECK_THROW(load_delta(original, delta), boost::archive::archive_exception);
+}
@@ -0,0 +1,151 @@
+/*
+ * optimistic_resource_test.cpp
+ *
+ *  Created on: Sep 28, 2013
+ *      Author: vincent
+ */
+
+/*    Copyright 2011 ~ 2013 Vincent Zhang, ivincent.zhang@gmail.com
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+/*
+ * The snapshot isolation of the MVCC resource, alone and under simple_transaction_manager, the conflicting
+ * writers are aborted and retried, the readers never are
+ * */
+
+#define BOOST_TEST_MODULE optimistic_resource
+#include <boost/test/included/unit_test.hpp>
+
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <atlas/transaction/optimistic_resource.hpp>
+#include <atlas/transaction/simple_transaction_manager.hpp>
+#include <atlas/transaction/basic_transaction.hpp>
+
+namespace bt = boost::transact;
+
+namespace {
+
+  typedef bt::optimistic_resource<std::string, int> resource;
+  typedef bt::simple_transaction_manager<resource> manager;
+
+  int value_of(resource& r, const std::string& key) {
+    resource::transaction tx = r.begin_transaction();
+    boost::optional<int> v = r.get(tx, key);
+    r.commit_transaction(tx);
+    return v ? *v : -1;
+  }
+
+}
+
+BOOST_AUTO_TEST_CASE(reads_see_their_snapshot) {
+  resource r;
+
+  resource::transaction writer = r.begin_transaction();
+  r.put(writer, "a", 1);
+  BOOST_CHECK_EQUAL(*r.get(writer, "a"), 1);
+  r.commit_transaction(writer);
+
+  resource::transaction reader = r.begin_transaction();
+  BOOST_CHECK_EQUAL(*r.get(reader, "a"), 1);
+
+  resource::transaction updater = r.begin_transaction();
+  r.put(updater, "a", 2);
+  r.erase(updater, "b");
+  r.commit_transaction(updater);
+
+  // the reader still sees the version of it's begin, and commits without validation
+  BOOST_CHECK_EQUAL(*r.get(reader, "a"), 1);
+  BOOST_CHECK(reader.read_only());
+  r.commit_transaction(reader);
+
+  BOOST_CHECK_EQUAL(value_of(r, "a"), 2);
+  BOOST_CHECK_EQUAL(value_of(r, "b"), -1);
+  BOOST_CHECK_EQUAL(r.committed(), 2u);
+}
+
+BOOST_AUTO_TEST_CASE(conflicting_writer_is_aborted) {
+  resource r;
+
+  resource::transaction first = r.begin_transaction();
+  resource::transaction second = r.begin_transaction();
+
+  r.put(first, "a", r.get(first, "a").get_value_or(0) + 1);
+  r.put(second, "a", r.get(second, "a").get_value_or(0) + 1);
+
+  r.commit_transaction(first);
+  BOOST_CHECK_THROW(r.commit_transaction(second), bt::isolation_exception);
+  // an aborted transaction is already ended
+  r.rollback_transaction(second);
+
+  BOOST_CHECK_EQUAL(value_of(r, "a"), 1);
+}
+
+BOOST_AUTO_TEST_CASE(blind_writes_do_not_conflict) {
+  resource r;
+
+  resource::transaction first = r.begin_transaction();
+  resource::transaction second = r.begin_transaction();
+  r.put(first, "a", 1);
+  r.put(second, "a", 2);
+
+  r.commit_transaction(first);
+  r.commit_transaction(second);
+
+  BOOST_CHECK_EQUAL(value_of(r, "a"), 2);
+}
+
+BOOST_AUTO_TEST_CASE(concurrent_increments_under_the_manager) {
+  resource r(16);
+  manager::connect_resource(r);
+
+  const int threads = 8, increments = 1000;
+  const char* const keys[] = { "a", "b", "c" };
+  std::atomic<int> retries(0);
+
+  std::vector<std::thread> workers;
+  for (int t = 0; t < threads; ++t) {
+    workers.push_back(std::thread([&, t]() {
+      for (int i = 0; i < increments; ++i) {
+        const std::string key = keys[(t + i) % 3];
+
+        for (;;) {
+          try {
+            bt::basic_transaction<manager> tx;
+            resource::transaction& rtx = manager::resource_transaction(*manager::current_transaction());
+            r.put(rtx, key, r.get(rtx, key).get_value_or(0) + 1);
+            tx.commit();
+            break;
+          }
+          catch (bt::isolation_exception&) {
+            ++retries;
+          }
+        }
+      }
+    }));
+  }
+
+  for (std::thread& w : workers) w.join();
+  manager::disconnect_resource();
+
+  int sum = 0;
+  for (const char* key : keys) sum += value_of(r, key);
+  BOOST_CHECK_EQUAL(sum, threads * increments);
+  BOOST_CHECK_EQUAL(r.committed(), unsigned(threads * increments));
+  BOOST_TEST_MESSAGE("retries: " << retries.load());
+}
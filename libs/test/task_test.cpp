@@ -0,0 +1,133 @@
+/*
+ * task_test.cpp
+ *
+ *  Created on: Sep 28, 2013
+ *      Author: vincent
+ */
+
+/*    Copyright 2011 ~ 2013 Vincent Zhang, ivincent.zhang@gmail.com
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+/*
+ * The completion of the pending calls of async_task_manager, a callback is never called after the task is
+ * completed, by it's responses or by a cancel
+ * */
+
+#define BOOST_TEST_MODULE task
+#include <boost/test/included/unit_test.hpp>
+
+#include <atomic>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <boost/uuid/uuid_generators.hpp>
+
+#include <atlas/rpc/task.h>
+
+using atlas::rpc::async_task;
+using atlas::rpc::async_task_manager;
+
+namespace {
+
+  atlas::rpc::uuid new_session() {
+    static boost::uuids::random_generator generate;
+    return generate();
+  }
+
+  // the calls of the callbacks of many sessions, by session
+  struct sessions {
+    explicit sessions(size_t count) : calls(count), ids(count) {
+      for (size_t i = 0; i < count; ++i) {
+        ids[i] = new_session();
+        calls[i] = 0;
+      }
+    }
+
+    atlas::rpc::rpc_callback_type callback(size_t i) {
+      return [this, i](const std::string&, int, async_task&) { ++calls[i]; };
+    }
+
+    std::vector<std::atomic<int>> calls;
+    std::vector<atlas::rpc::uuid> ids;
+  };
+
+  // run the two functions on every session at the same time, in two threads
+  template<typename F1, typename F2>
+  void race(size_t count, F1 f1, F2 f2) {
+    std::atomic<size_t> ready(0);
+    auto run = [&](std::function<void(size_t)> f) {
+      ++ready;
+      while (ready < 2);
+      for (size_t i = 0; i < count; ++i) f(i);
+    };
+
+    std::thread t1(run, std::function<void(size_t)>(f1));
+    std::thread t2(run, std::function<void(size_t)>(f2));
+    t1.join();
+    t2.join();
+  }
+
+  const size_t session_count = 100000;
+
+}
+
+BOOST_AUTO_TEST_CASE(response_racing_a_cancel_is_called_once) {
+  async_task_manager& manager = async_task_manager::ref();
+  sessions s(session_count);
+
+  for (size_t i = 0; i < session_count; ++i) manager.suspend(s.ids[i], s.callback(i));
+
+  race(session_count,
+      [&](size_t i) { manager.resume(s.ids[i], "response"); },
+      [&](size_t i) { manager.cancel(s.ids[i], atlas::rpc::rpc_cancelled); });
+
+  for (size_t i = 0; i < session_count; ++i) BOOST_REQUIRE_EQUAL(s.calls[i].load(), 1);
+  BOOST_CHECK_EQUAL(manager.size(), 0u);
+}
+
+BOOST_AUTO_TEST_CASE(responses_racing_past_a_quorum_are_dropped) {
+  async_task_manager& manager = async_task_manager::ref();
+  sessions s(session_count);
+
+  // 3 receivers, completed by the first 2 responses
+  for (size_t i = 0; i < session_count; ++i) {
+    manager.suspend(s.ids[i], s.callback(i), 3, atlas::rpc::default_rpc_timeout, 2);
+  }
+
+  for (size_t i = 0; i < session_count; ++i) manager.resume(s.ids[i], "response");
+  race(session_count,
+      [&](size_t i) { manager.resume(s.ids[i], "response"); },
+      [&](size_t i) { manager.resume(s.ids[i], "response"); });
+
+  for (size_t i = 0; i < session_count; ++i) BOOST_REQUIRE_EQUAL(s.calls[i].load(), 2);
+  BOOST_CHECK_EQUAL(manager.size(), 0u);
+}
+
+BOOST_AUTO_TEST_CASE(racing_responses_of_a_hedged_call_are_called_once) {
+  async_task_manager& manager = async_task_manager::ref();
+  sessions s(session_count);
+
+  // a hedged call expects one response, and both replicas respond
+  for (size_t i = 0; i < session_count; ++i) manager.suspend(s.ids[i], s.callback(i));
+
+  race(session_count,
+      [&](size_t i) { manager.resume(s.ids[i], "first replica"); },
+      [&](size_t i) { manager.resume(s.ids[i], "second replica"); });
+
+  for (size_t i = 0; i < session_count; ++i) BOOST_REQUIRE_EQUAL(s.calls[i].load(), 1);
+  BOOST_CHECK_EQUAL(manager.size(), 0u);
+}
@@ -0,0 +1,554 @@
+/*
+ * transaction_log_test.cpp
+ *
+ *  Created on: Sep 28, 2013
+ *      Author: vincent
+ */
+
+/*    Copyright 2011 ~ 2013 Vincent Zhang, ivincent.zhang@gmail.com
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+/*
+ * The round trips of the transaction log, the records written by the committers are replayed from the files, every
+ * one once and in the order of each committer. The logs are written under the working directory, run it on a
+ * disk, tmpfs has no O_DIRECT
+ * */
+
+#define BOOST_TEST_MODULE transaction_log
+#include <boost/test/included/unit_test.hpp>
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+#include <boost/mpl/vector.hpp>
+
+#include <atlas/transaction/log.hpp>
+
+namespace bt = boost::transact;
+namespace fs = boost::filesystem;
+
+namespace {
+
+  struct record {
+    uint32_t committer;
+    uint32_t seq;
+
+    template<class Archive>
+    void serialize(Archive& ar, const unsigned int) {
+      ar & committer & seq;
+    }
+  };
+
+  typedef boost::mpl::vector<record> entries;
+
+  // the state of the committers up to a checkpoint
+  struct snapshot {
+    uint32_t records;
+
+    template<class Archive>
+    void serialize(Archive& ar, const unsigned int) {
+      ar & records;
+    }
+  };
+
+  typedef boost::mpl::vector<record, snapshot> checkpointed_entries;
+
+  // an empty directory for the logs of a case, removed with it
+  struct log_dir {
+    explicit log_dir(const std::string& name) : path(fs::current_path() / ("transaction_log_test." + name)) {
+      fs::remove_all(path);
+      fs::create_directories(path);
+    }
+
+    ~log_dir() { fs::remove_all(path); }
+
+    std::string log() const { return (path / "log").string(); }
+
+    fs::path path;
+  };
+
+  // the records replayed, by committer in the order they are met
+  struct collector {
+    void operator()(const record& r) const { (*seen)[r.committer].push_back(r.seq); }
+
+    std::map<uint32_t, std::vector<uint32_t>>* seen;
+  };
+
+  void check_replayed(const std::map<uint32_t, std::vector<uint32_t>>& seen, uint32_t committers, uint32_t records) {
+    BOOST_REQUIRE_EQUAL(seen.size(), committers);
+    for (const auto& s : seen) {
+      BOOST_REQUIRE_EQUAL(s.second.size(), records);
+      for (uint32_t i = 0; i < records; ++i) BOOST_CHECK_EQUAL(s.second[i], i);
+    }
+  }
+
+  // the committers begin a transaction, commit a record and end it in a loop, as a resource manager does
+  template<class OFile, class IFile>
+  void commit_round_trip(const std::string& name, uint32_t committers, uint32_t records, std::size_t max_log_size) {
+    log_dir dir(name);
+
+    {
+      typedef bt::rolling_ologfile<OFile> file_type;
+      file_type file(dir.log());
+      bt::transaction_olog<entries, file_type> log(file, max_log_size);
+      std::mutex m;
+
+      std::vector<std::thread> threads;
+      for (uint32_t c = 0; c < committers; ++c) {
+        threads.push_back(std::thread([&, c]() {
+          for (uint32_t i = 0; i < records; ++i) {
+            unsigned int tx = 0;
+            {
+              std::lock_guard<std::mutex> guard(m);
+              tx = log.begin_transaction();
+            }
+
+            log.commit(record { c, i });
+
+            std::lock_guard<std::mutex> guard(m);
+            log.end_transaction(tx);
+          }
+        }));
+      }
+
+      for (std::thread& t : threads) t.join();
+    }
+
+    std::map<uint32_t, std::vector<uint32_t>> seen;
+    bt::replay_rolling_log<entries, IFile>(dir.log(), collector { &seen });
+
+    check_replayed(seen, committers, records);
+  }
+
+  // what a recovery from a checkpointed log sees
+  struct recovered {
+    std::vector<uint32_t> snapshots;
+    std::vector<uint32_t> records;
+    // the number of records met before the first snapshot
+    std::size_t before_snapshot = 0;
+  };
+
+  struct recovery {
+    void operator()(const snapshot& s) const {
+      if (state->snapshots.empty()) state->before_snapshot = state->records.size();
+      state->snapshots.push_back(s.records);
+    }
+
+    void operator()(const record& r) const { state->records.push_back(r.seq); }
+
+    recovered* state;
+  };
+
+  // one transaction a record, the log rolls only when a transaction begins
+  template<class Log>
+  void commit_records(Log& log, uint32_t from, uint32_t to) {
+    for (uint32_t i = from; i < to; ++i) {
+      const unsigned int tx = log.begin_transaction();
+      log.commit(record { 0, i });
+      log.end_transaction(tx);
+    }
+  }
+
+  std::vector<unsigned int> log_ids(const log_dir& dir) {
+    std::vector<unsigned int> ids;
+    bt::detail::get_existing_log_ids(std::back_inserter(ids), dir.log());
+    std::sort(ids.begin(), ids.end());
+    return ids;
+  }
+
+}
+
+BOOST_AUTO_TEST_CASE(group_commit_round_trip) {
+  commit_round_trip<bt::ologfile<true>, bt::ilogfile<true>>("group_commit", 8, 500, 64 * 1024 * 1024);
+}
+
+BOOST_AUTO_TEST_CASE(group_commit_rolls) {
+  // a few KB a log, so the committers roll it many times
+  commit_round_trip<bt::ologfile<true>, bt::ilogfile<true>>("group_commit_rolls", 4, 1000, 4 * 1024);
+}
+
+BOOST_AUTO_TEST_CASE(unsynced_commit_round_trip) {
+  commit_round_trip<bt::ologfile<false>, bt::ilogfile<false>>("unsynced", 4, 1000, 64 * 1024 * 1024);
+}
+
+BOOST_AUTO_TEST_CASE(direct_commit_round_trip) {
+  // O_DIRECT writes, the sectorizing file pads every commit to a sector
+  commit_round_trip<bt::ologfile<true, true>, bt::ilogfile<true>>("direct", 4, 1000, 64 * 1024);
+}
+
+BOOST_AUTO_TEST_CASE(parallel_replay_keeps_log_order) {
+  log_dir dir("parallel_replay");
+
+  {
+    typedef bt::rolling_ologfile<bt::ologfile<false> > file_type;
+    file_type file(dir.log());
+    bt::transaction_olog<entries, file_type> log(file, 4 * 1024);
+    commit_records(log, 0, 5000);
+  }
+
+  BOOST_REQUIRE_GT(log_ids(dir).size(), 8u);
+
+  // a single reader over the whole rolling log is the reference order
+  std::map<uint32_t, std::vector<uint32_t>> expected;
+  {
+    typedef bt::rolling_ilogfile<bt::ilogfile<false> > file_type;
+    file_type file(dir.log());
+    bt::ilog<entries, file_type> log(file);
+    try {
+      for (;;) log >> collector { &expected };
+    }
+    catch (bt::eof_exception&) {
+    }
+  }
+  check_replayed(expected, 1, 5000);
+
+  for (unsigned int threads : { 1u, 2u, 8u }) {
+    std::map<uint32_t, std::vector<uint32_t>> seen;
+    bt::replay_rolling_log<entries, bt::ilogfile<false>>(dir.log(), collector { &seen }, threads);
+    BOOST_CHECK(seen == expected);
+  }
+}
+
+BOOST_AUTO_TEST_CASE(replay_of_no_log) {
+  log_dir dir("no_log");
+
+  std::map<uint32_t, std::vector<uint32_t>> seen;
+  bt::replay_rolling_log<entries, bt::ilogfile<true>>(dir.log(), collector { &seen });
+  BOOST_CHECK(seen.empty());
+}
+
+BOOST_AUTO_TEST_CASE(replay_of_torn_log_fails) {
+  log_dir dir("torn_log");
+
+  {
+    typedef bt::rolling_ologfile<bt::ologfile<false> > file_type;
+    file_type file(dir.log());
+    bt::transaction_olog<entries, file_type> log(file, 64 * 1024 * 1024);
+    for (uint32_t i = 0; i < 100; ++i) log.commit(record { 0, i });
+  }
+
+  // cut the last entry in the middle
+  std::vector<unsigned int> ids;
+  bt::detail::get_existing_log_ids(std::back_inserter(ids), dir.log());
+  BOOST_REQUIRE_EQUAL(ids.size(), 1u);
+  const fs::path last = dir.log() + '.' + std::to_string(ids.back());
+  fs::resize_file(last, fs::file_size(last) - 1);
+
+  std::map<uint32_t, std::vector<uint32_t>> seen;
+  BOOST_CHECK_THROW((bt::replay_rolling_log<entries, bt::ilogfile<false>>(dir.log(), collector { &seen })), bt::io_failure);
+}
+
+BOOST_AUTO_TEST_CASE(checkpoint_round_trip) {
+  log_dir dir("checkpoint");
+
+  {
+    typedef bt::rolling_ologfile<bt::ologfile<true> > file_type;
+    file_type file(dir.log());
+    bt::transaction_olog<checkpointed_entries, file_type> log(file, 4 * 1024);
+
+    commit_records(log, 0, 1000);
+    BOOST_REQUIRE_GT(log_ids(dir).size(), 1u);
+
+    // a transaction running across the checkpoint keeps the old logs until it ends
+    const unsigned int running = log.begin_transaction();
+    BOOST_REQUIRE(log.checkpoint(snapshot { 1000 }));
+    const unsigned int checkpoint_log = log_ids(dir).back();
+    BOOST_CHECK_GT(log_ids(dir).size(), 1u);
+
+    commit_records(log, 1000, 1500);
+    BOOST_CHECK(!log.checkpoint(snapshot { 1500 }));
+
+    log.end_transaction(running);
+    BOOST_CHECK_EQUAL(log_ids(dir).front(), checkpoint_log);
+
+    commit_records(log, 1500, 2000);
+  }
+
+  recovered state;
+  bt::replay_rolling_log<checkpointed_entries, bt::ilogfile<true>>(dir.log(), recovery { &state });
+
+  // the recovery starts from the snapshot, the records before it were reclaimed
+  BOOST_REQUIRE_EQUAL(state.snapshots.size(), 1u);
+  BOOST_CHECK_EQUAL(state.snapshots.front(), 1000u);
+  BOOST_CHECK_EQUAL(state.before_snapshot, 0u);
+  BOOST_REQUIRE_EQUAL(state.records.size(), 1000u);
+  for (uint32_t i = 0; i < 1000; ++i) BOOST_CHECK_EQUAL(state.records[i], 1000 + i);
+}
+
+BOOST_AUTO_TEST_CASE(checkpoint_reclaims_at_once_when_idle) {
+  log_dir dir("checkpoint_idle");
+
+  typedef bt::rolling_ologfile<bt::ologfile<true> > file_type;
+  file_type file(dir.log());
+  bt::transaction_olog<checkpointed_entries, file_type> log(file, 4 * 1024);
+
+  commit_records(log, 0, 1000);
+  BOOST_REQUIRE(log.checkpoint(snapshot { 1000 }));
+
+  const std::vector<unsigned int> ids = log_ids(dir);
+  BOOST_REQUIRE_EQUAL(ids.size(), 1u);
+  BOOST_CHECK_EQUAL(ids.front(), file.log_id());
+}
+
+BOOST_AUTO_TEST_CASE(log_buffer_round_trip) {
+  log_dir dir("log_buffer");
+  const uint32_t committers = 8, records = 2000;
+
+  {
+    typedef bt::ologfile<true> file_type;
+    file_type file(dir.log());
+    // a small ring, so it wraps and the writers find it full and flush it themselves
+    bt::olog_buffer<entries, file_type, 4096> buffer(file);
+
+    std::vector<std::thread> threads;
+    for (uint32_t c = 0; c < committers; ++c) {
+      threads.push_back(std::thread([&, c]() {
+        for (uint32_t i = 0; i < records; ++i) {
+          buffer << record { c, i };
+          if (i % 100 == 99) buffer.sync();
+        }
+      }));
+    }
+
+    for (std::thread& t : threads) t.join();
+    buffer.sync();
+  }
+
+  std::map<uint32_t, std::vector<uint32_t>> seen;
+  {
+    bt::ilogfile<true> file(dir.log());
+    bt::ilog<entries, bt::ilogfile<true> > log(file);
+    try {
+      for (;;) log >> collector { &seen };
+    }
+    catch (bt::eof_exception&) {
+    }
+  }
+
+  check_replayed(seen, committers, records);
+}
+
+namespace {
+
+  // serialized by the archive itself, the arrays of bitwise elements are copied at once
+  struct keyed {
+    uint32_t id;
+    char key[16];
+    uint64_t counters[4];
+    std::string value;
+
+    template<class Archive>
+    void serialize(Archive& ar, const unsigned int) {
+      ar & id & key & counters & value;
+    }
+  };
+
+  // a class version is stored by boost.serialization only
+  struct versioned {
+    uint32_t id;
+
+    template<class Archive>
+    void serialize(Archive& ar, const unsigned int) {
+      ar & id;
+    }
+  };
+
+}
+
+BOOST_CLASS_VERSION(versioned, 1)
+
+namespace {
+
+  typedef boost::mpl::vector<keyed, versioned> member_entries;
+  typedef bt::char_oarchive<bt::detail::counting_output_iterator> counting_archive;
+
+  BOOST_STATIC_ASSERT((bt::detail::is_direct_serializable<counting_archive, keyed>::value));
+  BOOST_STATIC_ASSERT((!bt::detail::is_direct_serializable<counting_archive, versioned>::value));
+
+  struct member_collector {
+    void operator()(const keyed& k) const { keys->push_back(k); }
+    void operator()(const versioned& v) const { ids->push_back(v.id); }
+
+    std::vector<keyed>* keys;
+    std::vector<uint32_t>* ids;
+  };
+
+}
+
+BOOST_AUTO_TEST_CASE(member_serialize_round_trip) {
+  log_dir dir("member_serialize");
+
+  {
+    bt::ologfile<false> file(dir.log());
+    bt::olog<member_entries, bt::ologfile<false> > log(file);
+    for (uint32_t i = 0; i < 100; ++i) {
+      keyed k;
+      k.id = i;
+      std::snprintf(k.key, sizeof(k.key), "key-%u", i);
+      for (uint64_t c = 0; c < 4; ++c) k.counters[c] = i * c;
+      k.value = std::string(i, 'v');
+
+      log << k << versioned { i };
+    }
+  }
+
+  std::vector<keyed> keys;
+  std::vector<uint32_t> ids;
+  {
+    bt::ilogfile<false> file(dir.log());
+    bt::ilog<member_entries, bt::ilogfile<false> > log(file);
+    try {
+      for (;;) log >> member_collector { &keys, &ids };
+    }
+    catch (bt::eof_exception&) {
+    }
+  }
+
+  BOOST_REQUIRE_EQUAL(keys.size(), 100u);
+  BOOST_REQUIRE_EQUAL(ids.size(), 100u);
+  for (uint32_t i = 0; i < 100; ++i) {
+    BOOST_CHECK_EQUAL(keys[i].id, i);
+    BOOST_CHECK_EQUAL(std::string(keys[i].key), "key-" + std::to_string(i));
+    for (uint64_t c = 0; c < 4; ++c) BOOST_CHECK_EQUAL(keys[i].counters[c], i * c);
+    BOOST_CHECK_EQUAL(keys[i].value, std::string(i, 'v'));
+    BOOST_CHECK_EQUAL(ids[i], i);
+  }
+}
+
+BOOST_AUTO_TEST_CASE(async_commit_round_trip) {
+  log_dir dir("async_commit");
+  const uint32_t committers = 4, records = 1000;
+
+  // the durable records by committer, in the order of the callbacks
+  std::map<uint32_t, std::vector<uint32_t>> durable;
+  std::mutex m;
+  std::size_t failed = 0;
+
+  {
+    typedef bt::rolling_ologfile<bt::ologfile<true> > file_type;
+    file_type file(dir.log());
+    bt::transaction_olog<entries, file_type> log(file);
+
+    std::vector<std::thread> threads;
+    for (uint32_t c = 0; c < committers; ++c) {
+      threads.push_back(std::thread([&, c]() {
+        for (uint32_t i = 0; i < records; ++i) {
+          // a synchronous commit now and then shares the syncs with the flusher
+          if (i % 250 == 249) {
+            log.commit(record { c, i });
+            std::lock_guard<std::mutex> guard(m);
+            durable[c].push_back(i);
+            continue;
+          }
+
+          log.commit_async(record { c, i }, [&, c, i](bool ok) {
+            std::lock_guard<std::mutex> guard(m);
+            if (ok) durable[c].push_back(i);
+            else ++failed;
+          });
+        }
+      }));
+    }
+
+    for (std::thread& t : threads) t.join();
+    // the log fires the callbacks pending before it's destroyed
+  }
+
+  BOOST_CHECK_EQUAL(failed, 0u);
+  BOOST_REQUIRE_EQUAL(durable.size(), committers);
+  for (auto& d : durable) {
+    BOOST_REQUIRE_EQUAL(d.second.size(), records);
+    // a synchronous commit may return before the callbacks of the records it made durable
+    std::sort(d.second.begin(), d.second.end());
+    for (uint32_t i = 0; i < records; ++i) BOOST_CHECK_EQUAL(d.second[i], i);
+  }
+
+  std::map<uint32_t, std::vector<uint32_t>> seen;
+  bt::replay_rolling_log<entries, bt::ilogfile<true>>(dir.log(), collector { &seen });
+  check_replayed(seen, committers, records);
+}
+
+BOOST_AUTO_TEST_CASE(compressed_commit_round_trip) {
+  commit_round_trip<bt::ologfile<true, false, true>, bt::ilogfile<true, true>>("compressed", 4, 1000, 16 * 1024);
+}
+
+namespace {
+
+  // a compressible entry, and the size of a log written with it
+  template<class OFile>
+  uintmax_t write_keyed(const log_dir& dir, uint32_t records) {
+    {
+      OFile file(dir.log());
+      bt::olog<member_entries, OFile> log(file);
+      for (uint32_t i = 0; i < records; ++i) {
+        keyed k = keyed();
+        k.id = i;
+        std::snprintf(k.key, sizeof(k.key), "key-%u", i % 10);
+        k.value = std::string(200, 'a' + i % 4);
+        log << k;
+      }
+    }
+
+    return fs::file_size(dir.log());
+  }
+
+  template<class IFile>
+  std::vector<keyed> read_keyed(const log_dir& dir) {
+    std::vector<keyed> keys;
+    std::vector<uint32_t> ids;
+    IFile file(dir.log());
+    bt::ilog<member_entries, IFile> log(file);
+    try {
+      for (;;) log >> member_collector { &keys, &ids };
+    }
+    catch (bt::eof_exception&) {
+    }
+    return keys;
+  }
+
+}
+
+BOOST_AUTO_TEST_CASE(compressed_log_is_smaller_and_checked) {
+  log_dir plain("plain"), compressed("compressed_keyed");
+
+  const uintmax_t plain_size = write_keyed<bt::ologfile<false> >(plain, 5000);
+  const uintmax_t compressed_size = write_keyed<bt::ologfile<false, false, true> >(compressed, 5000);
+  BOOST_CHECK_LT(compressed_size * 4, plain_size);
+
+  const std::vector<keyed> keys = read_keyed<bt::ilogfile<false, true> >(compressed);
+  BOOST_REQUIRE_EQUAL(keys.size(), 5000u);
+  for (uint32_t i = 0; i < 5000; ++i) {
+    BOOST_CHECK_EQUAL(keys[i].id, i);
+    BOOST_CHECK_EQUAL(keys[i].value, std::string(200, 'a' + i % 4));
+  }
+
+  // a flipped byte in a block fails it's checksum
+  {
+    std::fstream f(compressed.log().c_str(), std::ios::in | std::ios::out | std::ios::binary);
+    f.seekg(compressed_size / 2);
+    const char c = f.get();
+    f.seekp(compressed_size / 2);
+    f.put(~c);
+  }
+  BOOST_CHECK_THROW((read_keyed<bt::ilogfile<false, true> >(compressed)), bt::io_failure);
+}
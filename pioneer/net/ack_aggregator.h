@@ -0,0 +1,146 @@
+/*
+ * ack_aggregator.h
+ *
+ *  Created on: Sep 2, 2013
+ *      Author: vincent
+ */
+
+/*    Copyright 2011 ~ 2013 Vincent Zhang, ivincent.zhang@gmail.com
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#ifndef PIONEER_NET_ACK_AGGREGATOR_H_
+#define PIONEER_NET_ACK_AGGREGATOR_H_
+
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#include <boost/uuid/uuid.hpp>
+#include <atlas/singleton.h>
+#include <atlas/rpc.h>
+
+#include <pioneer/net/rpc_clients.h>
+
+namespace pioneer {
+  namespace net {
+
+    /*
+     * Aggregates the responses of the multicast calls.
+     *
+     * A multicast call with a callback is answered by every receiving node, so a call to 200 nodes brings
+     * 200 responses to the caller at the same time. The responses to the same caller are kept here for
+     * a short interval, and sent as one resume_task_batch call when flush() is called by a timer, or as soon
+     * as max_batch_size of them are kept. The point to point calls are always answered immediately
+     * */
+    class ack_aggregator : public atlas::singleton<ack_aggregator> {
+    public:
+
+      // a batch is sent immediately once it's this large
+      static const size_t max_batch_size = 256;
+
+    private:
+
+      friend class atlas::singleton<ack_aggregator>;
+      ack_aggregator(const ack_aggregator&) = delete;
+      ack_aggregator& operator=(const ack_aggregator&) = delete;
+
+      // the caller and the client type to answer
+      typedef std::pair<atlas::rpc::endpoint_id, int> target_type;
+
+      struct batch {
+        std::vector<boost::uuids::uuid> sids;
+        std::vector<atlas::rpc::rpc_result> results;
+      };
+
+    public:
+
+      ack_aggregator() : _enabled(false), _aggregated(0), _batches(0) {}
+
+    public:
+
+      void set_enabled(bool enabled) { _enabled = enabled; }
+
+      bool enabled() const { return _enabled; }
+
+      // the requests from multicast have no source port, only their callbacks are aggregated
+      bool accept(atlas::rpc::endpoint_id source, int return_type) const {
+        return _enabled && atlas::rpc::endpoint_port(source) == 0 && return_type == atlas::rpc::rpc_async_callback;
+      }
+
+      void add(atlas::rpc::endpoint_id target, int client_id, const boost::uuids::uuid& session_id,
+          const atlas::rpc::rpc_result& result) {
+        batch full;
+
+        {
+          std::lock_guard<std::mutex> guard(_mutex);
+
+          batch& b = _pending[target_type(target, client_id)];
+          b.sids.push_back(session_id);
+          b.results.push_back(result);
+
+          if (b.sids.size() >= max_batch_size) std::swap(full, b);
+        }
+
+        ++_aggregated;
+
+        if (!full.sids.empty()) send(target_type(target, client_id), full);
+      }
+
+      // send all the kept responses, should be called periodically
+      void flush() {
+        std::map<target_type, batch> pending;
+
+        {
+          std::lock_guard<std::mutex> guard(_mutex);
+          std::swap(pending, _pending);
+        }
+
+        for (const auto& p : pending) {
+          if (!p.second.sids.empty()) send(p.first, p.second);
+        }
+      }
+
+      // the responses aggregated and the batches sent
+      uint64_t aggregated() const { return _aggregated; }
+
+      uint64_t batches() const { return _batches; }
+
+    private:
+
+      void send(const target_type& target, const batch& b) {
+        rpc::p2p_client client(static_cast<rpc::client_type>(target.second), target.first);
+        client.call(atlas::rpc::builtin_rfc::resume_task_batch, atlas::rpc::fn_ids::resume_task_batch,
+            b.sids, b.results, atlas::rpc::nilctx);
+
+        ++_batches;
+      }
+
+    private:
+
+      std::atomic<bool> _enabled;
+
+      std::mutex _mutex;
+      std::map<target_type, batch> _pending;
+
+      std::atomic<uint64_t> _aggregated;
+      std::atomic<uint64_t> _batches;
+    };
+
+  } // net
+} // pioneer
+
+#endif /* PIONEER_NET_ACK_AGGREGATOR_H_ */
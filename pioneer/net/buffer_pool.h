@@ -0,0 +1,192 @@
+/*
+ * buffer_pool.h
+ *
+ *  Created on: Sep 20, 2013
+ *      Author: vincent
+ */
+
+/*    Copyright 2011 ~ 2013 Vincent Zhang, ivincent.zhang@gmail.com
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#ifndef PIONEER_NET_BUFFER_POOL_H_
+#define PIONEER_NET_BUFFER_POOL_H_
+
+#include <array>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include <muduo/net/Buffer.h>
+
+#include <atlas/singleton.h>
+
+namespace pioneer {
+  namespace net {
+
+    namespace mn = muduo::net;
+
+    /*
+     * The input buffers of the connections, by size class, from 1KB, muduo's initial size, to 256KB.
+     *
+     * A read which carries complete frames hands the connection's buffer over to the requests it carries,
+     * see connection_handler::handle_tcp_message, the connection takes a pooled buffer in it's place, sized to
+     * the recent reads of the peer, so a connection receiving large messages does not grow from 1KB on every
+     * read, and the buffer comes back here once the last request carried by it is done, instead of being freed.
+     *
+     * Buffers larger than the largest class are freed, so one huge message does not pin it's memory, and every
+     * class keeps at most 16MB, the rest is freed too. The buffers are returned by the worker threads and taken
+     * by the loop threads, one lock per class
+     * */
+    class buffer_pool : public atlas::singleton<buffer_pool> {
+    public:
+
+      enum { min_class_bits = 10, class_count = 9 };
+
+      static const size_t min_size = size_t(1) << min_class_bits;
+      static const size_t max_size = min_size << (class_count - 1);
+      static const size_t max_class_bytes = 16 * 1024 * 1024;
+
+    private:
+
+      friend class atlas::singleton<buffer_pool>;
+      buffer_pool(buffer_pool&)= delete;
+      buffer_pool& operator=(const buffer_pool&)= delete;
+
+    public:
+
+      // public for std::make_shared, see atlas::singleton
+      buffer_pool() : _hits(0), _misses(0), _freed(0), _borrowed(0) {}
+
+      ~buffer_pool() {
+        for (auto& c : _classes) {
+          for (mn::Buffer* b : c.buffers) delete b;
+        }
+      }
+
+      // the class which fits size, no larger than the largest one
+      static int class_of(size_t size) {
+        int c = 0;
+        while (c < class_count - 1 && (min_size << c) < size) ++c;
+        return c;
+      }
+
+      static size_t class_size(int c) { return min_size << c; }
+
+      /*
+       * An empty buffer which can take size bytes without growing, if size is no larger than the largest class.
+       * The buffer goes back to the pool when the last reference is gone, in any thread
+       * */
+      std::shared_ptr<mn::Buffer> borrow(size_t size) {
+        int c = class_of(size);
+        size_class& sc = _classes[c];
+
+        mn::Buffer* b = nullptr;
+        {
+          std::lock_guard<std::mutex> guard(sc.mutex);
+          if (!sc.buffers.empty()) {
+            b = sc.buffers.back();
+            sc.buffers.pop_back();
+          }
+        }
+
+        if (b) {
+          _hits.fetch_add(1, std::memory_order_relaxed);
+        }
+        else {
+          _misses.fetch_add(1, std::memory_order_relaxed);
+
+          b = new mn::Buffer;
+          b->ensureWritableBytes(class_size(c));
+        }
+
+        _borrowed.fetch_add(1, std::memory_order_relaxed);
+        return std::shared_ptr<mn::Buffer>(b, [this](mn::Buffer* b) { give_back(b); });
+      }
+
+      // the buffers taken from the pool, and the ones allocated since the pool was empty
+      unsigned long long hits() const { return _hits.load(std::memory_order_relaxed); }
+      unsigned long long misses() const { return _misses.load(std::memory_order_relaxed); }
+      // the buffers returned but freed, too small, too large, or the class is full
+      unsigned long long freed() const { return _freed.load(std::memory_order_relaxed); }
+      // the buffers the connections and the requests hold now
+      long long borrowed() const { return _borrowed.load(std::memory_order_relaxed); }
+
+      // the buffers kept of the class
+      size_t pooled(int c) const {
+        std::lock_guard<std::mutex> guard(_classes[c].mutex);
+        return _classes[c].buffers.size();
+      }
+
+      size_t pooled_bytes() const {
+        size_t bytes = 0;
+
+        for (int c = 0; c < class_count; ++c) {
+          std::lock_guard<std::mutex> guard(_classes[c].mutex);
+          bytes += _classes[c].buffers.size() * class_size(c);
+        }
+
+        return bytes;
+      }
+
+    private:
+
+      void give_back(mn::Buffer* b) {
+        _borrowed.fetch_sub(1, std::memory_order_relaxed);
+        b->retrieveAll();
+
+        // the largest class it can serve without growing
+        size_t size = b->writableBytes();
+        if (size < min_size || size > max_size * 2) {
+          _freed.fetch_add(1, std::memory_order_relaxed);
+          delete b;
+          return;
+        }
+
+        int c = class_count - 1;
+        while (c > 0 && class_size(c) > size) --c;
+
+        size_class& sc = _classes[c];
+        {
+          std::lock_guard<std::mutex> guard(sc.mutex);
+          if ((sc.buffers.size() + 1) * class_size(c) <= max_class_bytes) {
+            sc.buffers.push_back(b);
+            return;
+          }
+        }
+
+        _freed.fetch_add(1, std::memory_order_relaxed);
+        delete b;
+      }
+
+    private:
+
+      struct size_class {
+        mutable std::mutex mutex;
+        std::vector<mn::Buffer*> buffers;
+      };
+
+      std::array<size_class, class_count> _classes;
+
+      std::atomic<unsigned long long> _hits;
+      std::atomic<unsigned long long> _misses;
+      std::atomic<unsigned long long> _freed;
+      std::atomic<long long> _borrowed;
+    };
+
+  } // net
+} // pioneer
+
+#endif /* PIONEER_NET_BUFFER_POOL_H_ */
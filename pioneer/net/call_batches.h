@@ -0,0 +1,273 @@
+/*
+ * call_batches.h
+ *
+ *  Created on: Sep 28, 2013
+ *      Author: vincent
+ */
+
+/*    Copyright 2011 ~ 2013 Vincent Zhang, ivincent.zhang@gmail.com
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#ifndef PIONEER_NET_CALL_BATCHES_H_
+#define PIONEER_NET_CALL_BATCHES_H_
+
+#include <atomic>
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <glog/logging.h>
+#include <atlas/singleton.h>
+#include <atlas/rpc.h>
+#include <atlas/trace_scope.h>
+#include <atlas/memory/arena.h>
+
+#include <pioneer/system/admission.h>
+#include <pioneer/system/thread_pool.h>
+#include <pioneer/net/request.h>
+
+namespace pioneer {
+  namespace net {
+
+    /*
+     * The queued requests of a function with a batch handler, see ATLAS_BIND_REMOTE_BATCH, run together in one
+     * worker task, so the handler decodes and answers them at once, a lookup or a loop over all of them instead
+     * of one dispatch a request.
+     *
+     * The requests of a function wait in it's list, the first one schedules a task, which takes the list, at most
+     * max_batch, once a worker runs it, and schedules another one for the rest. So no request waits for a batch to
+     * fill, the deadline of a batch is the time it's task waits in the pool, an idle node runs batches of one, a
+     * loaded one runs them as large as the requests queued meanwhile.
+     *
+     * The requests compressed, or of a function whose results are cached or coalesced, go one by one
+     * */
+    class call_batches : public atlas::singleton<call_batches> {
+    private:
+
+      struct pending {
+        pending() : scheduled(false) {}
+
+        std::vector<request_ptr> requests;
+        bool scheduled;
+      };
+
+    private:
+
+      friend class atlas::singleton<call_batches>;
+      call_batches(const call_batches&) = delete;
+      call_batches& operator=(const call_batches&) = delete;
+
+    public:
+
+      // public for std::make_shared, see atlas::singleton
+      call_batches() : _max_batch(0), _batches(0), _calls(0) {}
+
+    public:
+
+      // before the servers start, 0 runs every request alone
+      void configure(size_t max_batch) { _max_batch = max_batch; }
+
+      bool enabled() const { return _max_batch > 1; }
+
+      bool batchable(const request& r) const {
+        if (!enabled()) return false;
+
+        const atlas::rpc::request_header* h = r.message().header();
+        int fn_id = h->fn_id;
+
+        return !(h->flags & atlas::rpc::message_compressed)
+            && atlas::rpc::fn_table::ref().find_batch(fn_id)
+            && !atlas::rpc::result_cache::ref().enabled(fn_id)
+            && !atlas::rpc::request_coalescer::ref().enabled(fn_id, h->return_type);
+      }
+
+      // in the I/O loop, the request joins the list of it's function
+      void add(request_ptr&& r) {
+        int fn_id = r->fn_id();
+        bool schedule = false;
+
+        {
+          std::lock_guard<std::mutex> guard(_mutex);
+          pending& p = _pending[fn_id];
+          p.requests.push_back(std::move(r));
+
+          if (!p.scheduled) p.scheduled = schedule = true;
+        }
+
+        if (schedule) dispatch(fn_id);
+      }
+
+      unsigned long long batches() const { return _batches.load(std::memory_order_relaxed); }
+
+      unsigned long long calls() const { return _calls.load(std::memory_order_relaxed); }
+
+      std::string str() const {
+        std::ostringstream os;
+        unsigned long long b = batches(), c = calls();
+
+        os << "max batch : " << _max_batch << "\n"
+            << "batches : " << b << "\n"
+            << "calls : " << c << ", " << (b ? double(c) / b : 0) << " a batch\n";
+
+        std::lock_guard<std::mutex> guard(_mutex);
+        for (const auto& p : _pending) {
+          const char* name = atlas::rpc::fn_names::ref().find(p.first);
+          os << (name ? name : std::to_string(p.first).c_str()) << " : " << p.second.requests.size() << " queued\n";
+        }
+
+        return os.str();
+      }
+
+    private:
+
+      void dispatch(int fn_id) {
+        atlas::adaptive_thread_pool::task_type task(std::bind(&call_batches::run, this, fn_id));
+        if (system::worker_pool::ref().schedule(std::move(task))) return;
+
+        // the pool is full, the list is rejected
+        std::vector<request_ptr> rejected;
+        {
+          std::lock_guard<std::mutex> guard(_mutex);
+          pending& p = _pending[fn_id];
+          rejected.swap(p.requests);
+          p.scheduled = false;
+        }
+
+        for (const request_ptr& r : rejected) r->reject();
+      }
+
+      // in the worker, up to max_batch of the list
+      void run(int fn_id) {
+        std::vector<request_ptr> batch;
+        bool more = false;
+
+        {
+          std::lock_guard<std::mutex> guard(_mutex);
+          pending& p = _pending[fn_id];
+
+          if (p.requests.size() <= _max_batch) {
+            batch.swap(p.requests);
+          }
+          else {
+            batch.assign(std::make_move_iterator(p.requests.begin()),
+                std::make_move_iterator(p.requests.begin() + _max_batch));
+            p.requests.erase(p.requests.begin(), p.requests.begin() + _max_batch);
+          }
+
+          more = !p.requests.empty();
+          p.scheduled = more;
+        }
+
+        if (more) dispatch(fn_id);
+
+        execute(fn_id, batch);
+      }
+
+      static bool admit(const request& r) {
+        r.record_waits();
+
+        // the caller has given it up while it's queued
+        if (atlas::rpc::cancellations::ref().cancelled(r.session_id())) {
+          session_manager::ref().remove(r.session_id());
+          return false;
+        }
+
+        return true;
+      }
+
+      void execute(int fn_id, const std::vector<request_ptr>& batch) {
+        std::vector<request*> runs;
+        runs.reserve(batch.size());
+
+        for (const request_ptr& r : batch) {
+          if (!system::admission_control::ref().admit(r->enqueued())) r->reject();
+          else if (!r->message().intact()) r->execute();
+          else if (admit(*r)) runs.push_back(r.get());
+        }
+
+        if (runs.empty()) return;
+
+        size_t n = runs.size();
+        std::vector<const atlas::rpc::message*> messages(n);
+        std::vector<atlas::rpc::rpc_context> contexts;
+        std::vector<atlas::rpc::rpc_result> results(n, atlas::rpc::rpc_result(nullptr));
+        std::unique_ptr<bool[]> decoded(new bool[n]);
+
+        contexts.reserve(n);
+        for (size_t i = 0; i < n; ++i) {
+          const atlas::rpc::request_header* h = runs[i]->message().header();
+          messages[i] = &runs[i]->message();
+          contexts.push_back(atlas::rpc::rpc_context(h->client_id, h->return_type, h->session_id, runs[i]->source(),
+              messages[i]->received()));
+        }
+
+        {
+          // the arguments decoded into the arena containers are freed once the handler returns
+          atlas::memory::arena_scope scope;
+          ATLAS_TRACE_SCOPE("rpc/batch");
+
+          try {
+            // the latency of the batch is recorded once
+            atlas::rpc::rpc_stats::timer timer(fn_id);
+            atlas::rpc::fn_table::ref().find_batch(fn_id)(messages.data(), contexts.data(), n, results.data(),
+                decoded.get());
+            timer.finish();
+          }
+          catch (const std::exception& e) {
+            LOG(ERROR) << "the batch of " << n << " calls of fn " << fn_id << " fails, " << e.what();
+            for (size_t i = 0; i < n; ++i) decoded[i] = true;
+          }
+        }
+
+        _batches.fetch_add(1, std::memory_order_relaxed);
+        _calls.fetch_add(n, std::memory_order_relaxed);
+
+        for (size_t i = 0; i < n; ++i) {
+          request& r = *runs[i];
+
+          if (!decoded[i]) {
+            // it fails alone as it would have
+            atlas::memory::arena_scope scope;
+            request::run(r.message(), r.source());
+          }
+          else if (results[i]) {
+            request::respond(r.message(), r.source(), results[i]);
+          }
+
+          atlas::rpc::slow_request_log::instance().check(r.message(), r.source());
+          session_manager::ref().remove(r.session_id());
+        }
+      }
+
+    private:
+
+      size_t _max_batch;
+
+      mutable std::mutex _mutex;
+      std::unordered_map<int, pending> _pending;
+
+      std::atomic<unsigned long long> _batches;
+      std::atomic<unsigned long long> _calls;
+    };
+
+  } // net
+} // pioneer
+
+#endif /* PIONEER_NET_CALL_BATCHES_H_ */
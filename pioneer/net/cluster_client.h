@@ -0,0 +1,296 @@
+/*
+ * cluster_client.h
+ *
+ *  Created on: Sep 28, 2013
+ *      Author: vincent
+ */
+
+/*    Copyright 2011 ~ 2013 Vincent Zhang, ivincent.zhang@gmail.com
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#ifndef PIONEER_NET_CLUSTER_CLIENT_H_
+#define PIONEER_NET_CLUSTER_CLIENT_H_
+
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <boost/bind.hpp>
+#include <boost/ptr_container/ptr_vector.hpp>
+#include <glog/logging.h>
+
+#include <muduo/base/Mutex.h>
+#include <muduo/net/EventLoop.h>
+#include <muduo/net/EventLoopThread.h>
+#include <muduo/net/InetAddress.h>
+#include <muduo/net/TcpClient.h>
+#include <muduo/net/TcpConnection.h>
+
+#include <atlas/rpc.h>
+
+#include <pioneer/net/rpc_clients.h>
+#include <pioneer/net/tls.h>
+
+namespace pioneer {
+  namespace net {
+
+    /*
+     * A connection of an application to an outward server, it reconnects by itself, and the responses are decoded
+     * frame by frame and dispatched on it's loop, so the callbacks and the futures of the calls complete there.
+     * TLS with the server if a context is given, see net::tls_session
+     * */
+    class server_connection {
+    public:
+
+      server_connection(muduo::net::EventLoop* loop, const muduo::net::InetAddress& address,
+          const std::shared_ptr<tls_context>& tls) :
+        _client(loop, address, "pioneer_client"), _tls_context(tls)
+      {
+        _client.setConnectionCallback(boost::bind(&server_connection::on_connection, this, _1));
+        _client.setMessageCallback(boost::bind(&server_connection::on_message, this, _1, _2, _3));
+        _client.setWriteCompleteCallback(boost::bind(&server_connection::on_write_complete, this, _1));
+        _client.enableRetry();
+      }
+
+      server_connection(const server_connection&) = delete;
+      server_connection& operator=(const server_connection&) = delete;
+
+    public:
+
+      void connect() { _client.connect(); }
+
+      void disconnect() { _client.disconnect(); }
+
+      bool connected() const {
+        muduo::MutexLockGuard lock(_mutex);
+        return _connection && _connection->connected();
+      }
+
+      // false if it's down, the message is not sent
+      bool send(const char* message, size_t size) {
+        muduo::net::TcpConnectionPtr conn;
+        {
+          muduo::MutexLockGuard lock(_mutex);
+          conn = _connection;
+        }
+
+        if (!conn || !conn->connected()) return false;
+
+        conn->send(message, size);
+        return true;
+      }
+
+    private:
+
+      // a TLS connection is used once the kernel has the keys
+      void on_connection(const muduo::net::TcpConnectionPtr& conn) {
+        if (_tls_context && conn->connected()) {
+          _tls = std::make_shared<tls_session>(*_tls_context);
+          establish(conn, _tls->start(conn));
+          return;
+        }
+
+        _tls.reset();
+
+        muduo::MutexLockGuard lock(_mutex);
+        _connection = conn->connected() ? conn : muduo::net::TcpConnectionPtr();
+      }
+
+      void on_write_complete(const muduo::net::TcpConnectionPtr& conn) {
+        if (_tls && establish(conn, _tls->on_write_complete(conn))) on_message(conn, conn->inputBuffer(), muduo::Timestamp::now());
+      }
+
+      // return true once the session is handed over, the plaintext decrypted before goes to the input buffer
+      bool establish(const muduo::net::TcpConnectionPtr& conn, tls_session::state state) {
+        if (state == tls_session::failed) {
+          LOG(ERROR) << "TLS failed with " << conn->peerAddress().toIpPort();
+          _tls.reset();
+          conn->shutdown();
+          return false;
+        }
+
+        if (state != tls_session::offloaded) return false;
+
+        muduo::net::Buffer* input = conn->inputBuffer();
+        _tls->plain().append(input->peek(), input->readableBytes());
+        input->retrieveAll();
+        input->swap(_tls->plain());
+        _tls.reset();
+
+        muduo::MutexLockGuard lock(_mutex);
+        _connection = conn;
+
+        return true;
+      }
+
+      // every whole frame in the buffer, a partial one waits for the rest
+      void on_message(const muduo::net::TcpConnectionPtr& conn, muduo::net::Buffer* buf, muduo::Timestamp) {
+        if (_tls && !establish(conn, _tls->on_read(conn, buf))) return;
+
+        while (buf->readableBytes() >= sizeof(int32_t)) {
+          int32_t frame_size = 0;
+          std::memcpy(&frame_size, buf->peek(), sizeof(frame_size));
+
+          if (frame_size < static_cast<int32_t>(sizeof(atlas::rpc::request_header))
+              || !atlas::rpc::message::known_version(buf->peek(), buf->readableBytes())) {
+            LOG(ERROR) << "bad rpc message from " << conn->peerAddress().toIpPort();
+            buf->retrieveAll();
+            conn->shutdown();
+            return;
+          }
+
+          if (buf->readableBytes() < static_cast<size_t>(frame_size)) return;
+
+          // the response is dispatched in place, so the message can borrow the buffer
+          atlas::rpc::message message(buf->peek(), frame_size);
+          atlas::rpc::dispatcher_manager::ref().dispatch(message, atlas::rpc::nilctx);
+
+          buf->retrieve(frame_size);
+        }
+      }
+
+    private:
+
+      muduo::net::TcpClient _client;
+
+      mutable muduo::MutexLock _mutex;
+      muduo::net::TcpConnectionPtr _connection;
+
+      std::shared_ptr<tls_context> _tls_context;
+      // the session during the handshake, the I/O thread only
+      std::shared_ptr<tls_session> _tls;
+    };
+
+    /*
+     * The client library of the applications, the connections to several outward servers over a few I/O threads,
+     * a call goes to the next live connection in turn, so the calls are pipelined over all of them and a server
+     * which is down is skipped until it's back, a call is rejected with rpc_unreachable only if none is up.
+     * The calls are made by a cluster_caller, with a callback, a future or none as any remote_caller, and the
+     * calls no response arrives for complete with rpc_timed_out at their deadlines, the sweep runs on the first
+     * loop. A call sent on a connection which drops completes at it's deadline as well
+     * */
+    class cluster_client {
+    public:
+
+      // ip:port of the servers, every one is connected to so many times
+      cluster_client(const std::vector<std::string>& servers, int threads = 1, int connections_per_server = 1,
+          const std::shared_ptr<tls_context>& tls = nullptr) : _next(0)
+      {
+        threads = std::max(threads, 1);
+        for (int i = 0; i < threads; ++i) _loops.push_back(new muduo::net::EventLoopThread);
+        for (muduo::net::EventLoopThread& t : _loops) _loop_ptrs.push_back(t.startLoop());
+
+        size_t n = 0;
+        for (const std::string& server : servers) {
+          atlas::rpc::endpoint_id endpoint = atlas::rpc::parse_endpoint(server);
+          muduo::net::InetAddress address(atlas::rpc::ip_to_string(atlas::rpc::endpoint_ip(endpoint)),
+              atlas::rpc::endpoint_port(endpoint));
+
+          for (int i = 0; i < std::max(connections_per_server, 1); ++i) {
+            _connections.push_back(new server_connection(_loop_ptrs[n++ % _loop_ptrs.size()], address, tls));
+          }
+        }
+
+        _loop_ptrs.front()->runEvery(atlas::rpc::async_task_manager::ref().tick().count() / 1000.0, []() {
+          atlas::rpc::sync_task_manager::ref().sweep();
+          atlas::rpc::async_task_manager::ref().sweep();
+        });
+      }
+
+      cluster_client(const cluster_client&) = delete;
+      cluster_client& operator=(const cluster_client&) = delete;
+
+      // the connections go before their loops
+      ~cluster_client() {
+        for (server_connection& c : _connections) c.disconnect();
+        _connections.clear();
+      }
+
+    public:
+
+      void connect() {
+        for (server_connection& c : _connections) c.connect();
+      }
+
+      // wait until any connection is up, false if none is before the timeout
+      bool wait_connected(std::chrono::milliseconds timeout) {
+        auto deadline = std::chrono::steady_clock::now() + timeout;
+        while (std::chrono::steady_clock::now() < deadline) {
+          if (connected()) return true;
+
+          std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+
+        return false;
+      }
+
+      // the connections up
+      size_t connected() const {
+        size_t count = 0;
+        for (const server_connection& c : _connections) count += c.connected();
+
+        return count;
+      }
+
+      size_t size() const { return _connections.size(); }
+
+      // on the next live connection, false if none is up
+      bool send(const char* message, size_t size) {
+        size_t n = _connections.size();
+        size_t start = _next.fetch_add(1, std::memory_order_relaxed);
+
+        for (size_t i = 0; i < n; ++i) {
+          if (_connections[(start + i) % n].send(message, size)) return true;
+        }
+
+        return false;
+      }
+
+    private:
+
+      boost::ptr_vector<muduo::net::EventLoopThread> _loops;
+      std::vector<muduo::net::EventLoop*> _loop_ptrs;
+      boost::ptr_vector<server_connection> _connections;
+
+      std::atomic<size_t> _next;
+    };
+
+    // the calls of an application, see cluster_client, a caller is used by one thread at a time
+    class cluster_caller : public atlas::rpc::remote_caller {
+    public:
+
+      cluster_caller(cluster_client& client) : atlas::rpc::remote_caller(rpc::outward_client), _client(client) {}
+
+      virtual ~cluster_caller() {}
+
+    protected:
+
+      virtual void send(const char* message, size_t size) {
+        if (!_client.send(message, size)) reject(message, size, atlas::rpc::rpc_unreachable);
+      }
+
+    private:
+
+      cluster_client& _client;
+    };
+
+  } // net
+} // pioneer
+
+#endif /* PIONEER_NET_CLUSTER_CLIENT_H_ */
@@ -0,0 +1,218 @@
+/*
+ * compression.h
+ *
+ *  Created on: Sep 22, 2013
+ *      Author: vincent
+ */
+
+/*    Copyright 2011 ~ 2013 Vincent Zhang, ivincent.zhang@gmail.com
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#ifndef PIONEER_NET_COMPRESSION_H_
+#define PIONEER_NET_COMPRESSION_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#include <atomic>
+#include <string>
+
+#include <atlas/singleton.h>
+#include <atlas/io/lz4.h>
+#include <atlas/memory/arena.h>
+#include <atlas/rpc/message.h>
+
+namespace pioneer {
+  namespace net {
+
+    /*
+     * The frames sent to a peer are compressed one by one with LZ4 if their bodies are larger than the threshold,
+     * for the links where the bandwidth, not the CPU, is the limit, the membership lists and the merged results
+     * of the calls, for example.
+     *
+     * It's negotiated without a round trip, a node which can decompress sets rpc::message_accepts_compression on
+     * every message it builds, see rpc::message::accepts_compression, and a node compresses only for the peers
+     * seen with the flag, see peer_stats. A frame which does not shrink by 1/8 is sent as it is.
+     *
+     * The receiver decompresses into the arena of the request, see request::execute, so the raw body is freed
+     * with the arguments decoded from it
+     * */
+    class frame_compression : public atlas::singleton<frame_compression> {
+    public:
+
+      typedef atlas::rpc::request_header request_header;
+
+      // as connection_handler::max_frame_size, a larger raw body is taken as garbage
+      static const uint32_t max_raw_size = 64 * 1024 * 1024;
+
+    private:
+
+      friend class atlas::singleton<frame_compression>;
+      frame_compression(const frame_compression&) = delete;
+      frame_compression& operator=(const frame_compression&) = delete;
+
+    public:
+
+      // public for std::make_shared, see atlas::singleton
+      frame_compression() : _enabled(false), _threshold(4096), _frames(0), _raw_bytes(0), _compressed_bytes(0), _failures(0) {}
+
+    public:
+
+      // before any connection comes up
+      void set_enabled(bool enabled) {
+        _enabled = enabled;
+        atlas::rpc::message::accepts_compression() = enabled;
+      }
+
+      bool enabled() const { return _enabled; }
+
+      void set_threshold(size_t bytes) { _threshold.store(bytes, std::memory_order_relaxed); }
+
+      size_t threshold() const { return _threshold.load(std::memory_order_relaxed); }
+
+      /*
+       * Compress the frames in the buffer which are large enough, the buffer may be a batch, return true if any
+       * frame is compressed. A frame which can not be parsed ends the walk, it's sent as it is with the rest
+       * */
+      bool compress(std::string& frames) {
+        size_t threshold = this->threshold();
+        if (!_enabled || frames.size() < sizeof(request_header) + threshold) return false;
+
+        std::string out;
+        size_t offset = 0, copied = 0;
+
+        while (frames.size() - offset >= sizeof(request_header)) {
+          const char* frame = frames.data() + offset;
+
+          int32_t length = field(frame, offsetof(request_header, length));
+          uint8_t flags = static_cast<uint8_t>(frame[offsetof(request_header, flags)]);
+          if (length < static_cast<int32_t>(sizeof(request_header)) || static_cast<size_t>(length) > frames.size() - offset) break;
+
+          size_t body_size = length - sizeof(request_header);
+          if (body_size >= threshold && !(flags & atlas::rpc::message_compressed) && body_size <= max_raw_size) {
+            if (out.empty()) out.reserve(frames.size());
+            out.append(frames, copied, offset - copied);
+
+            if (compress_frame(frame, length, out)) copied = offset + length;
+            else out.append(frame, length), copied = offset + length;
+          }
+
+          offset += length;
+        }
+
+        if (out.empty()) return false;
+
+        out.append(frames, copied, std::string::npos);
+        frames.swap(out);
+
+        return true;
+      }
+
+      /*
+       * The raw message of a compressed one, the body is allocated from the current memory resource of the thread,
+       * the arena of the request, see arena_scope, return false if the body is corrupted
+       * */
+      bool decompress(const atlas::rpc::message& message, atlas::rpc::message* raw) {
+        const char* body = message.body();
+        size_t body_size = message.body_size();
+
+        uint32_t raw_size = 0;
+        if (body_size < sizeof(raw_size)) return fail();
+        std::memcpy(&raw_size, body, sizeof(raw_size));
+        if (raw_size > max_raw_size) return fail();
+
+        size_t length = sizeof(request_header) + raw_size;
+        char* data = static_cast<char*>(atlas::memory::current_resource()->allocate(length));
+
+        request_header h = *message.header();
+        h.length = static_cast<int32_t>(length);
+        h.flags &= ~atlas::rpc::message_compressed;
+        std::memcpy(data, &h, sizeof(h));
+
+        if (!atlas::io::lz4::decompress(body + sizeof(raw_size), body_size - sizeof(raw_size), data + sizeof(h), raw_size)) {
+          return fail();
+        }
+
+        raw->reset(data, length);
+        return true;
+      }
+
+      // the frames compressed, their raw and compressed bytes, and the corrupted ones received
+      unsigned long long frames() const { return _frames.load(std::memory_order_relaxed); }
+      unsigned long long raw_bytes() const { return _raw_bytes.load(std::memory_order_relaxed); }
+      unsigned long long compressed_bytes() const { return _compressed_bytes.load(std::memory_order_relaxed); }
+      unsigned long long failures() const { return _failures.load(std::memory_order_relaxed); }
+
+    private:
+
+      static int32_t field(const char* frame, size_t offset) {
+        int32_t v = 0;
+        std::memcpy(&v, frame + offset, sizeof(v));
+        return v;
+      }
+
+      // append the compressed frame, return false and append nothing if it does not shrink enough
+      bool compress_frame(const char* frame, size_t length, std::string& out) {
+        const char* body = frame + sizeof(request_header);
+        uint32_t raw_size = static_cast<uint32_t>(length - sizeof(request_header));
+        size_t limit = raw_size - raw_size / 8;
+
+        size_t start = out.size();
+        out.resize(start + sizeof(request_header) + sizeof(raw_size) + atlas::io::lz4::bound(raw_size));
+
+        char* p = &out[start];
+        size_t n = atlas::io::lz4::compress(body, raw_size, p + sizeof(request_header) + sizeof(raw_size), limit);
+        if (n == 0) {
+          out.resize(start);
+          return false;
+        }
+
+        request_header h;
+        std::memcpy(&h, frame, sizeof(h));
+        h.length = static_cast<int32_t>(sizeof(request_header) + sizeof(raw_size) + n);
+        h.flags |= atlas::rpc::message_compressed;
+
+        std::memcpy(p, &h, sizeof(h));
+        std::memcpy(p + sizeof(h), &raw_size, sizeof(raw_size));
+        out.resize(start + h.length);
+
+        _frames.fetch_add(1, std::memory_order_relaxed);
+        _raw_bytes.fetch_add(length, std::memory_order_relaxed);
+        _compressed_bytes.fetch_add(h.length, std::memory_order_relaxed);
+
+        return true;
+      }
+
+      bool fail() {
+        _failures.fetch_add(1, std::memory_order_relaxed);
+        return false;
+      }
+
+    private:
+
+      bool _enabled;
+      std::atomic<size_t> _threshold;
+
+      std::atomic<unsigned long long> _frames;
+      std::atomic<unsigned long long> _raw_bytes;
+      std::atomic<unsigned long long> _compressed_bytes;
+      std::atomic<unsigned long long> _failures;
+    };
+
+  } // net
+} // pioneer
+
+#endif /* PIONEER_NET_COMPRESSION_H_ */
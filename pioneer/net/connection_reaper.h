@@ -0,0 +1,245 @@
+/*
+ * connection_reaper.h
+ *
+ *  Created on: Sep 24, 2013
+ *      Author: vincent
+ */
+
+/*    Copyright 2011 ~ 2013 Vincent Zhang, ivincent.zhang@gmail.com
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#ifndef PIONEER_NET_CONNECTION_REAPER_H_
+#define PIONEER_NET_CONNECTION_REAPER_H_
+
+#include <sys/socket.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <vector>
+
+#include <boost/bind.hpp>
+#include <boost/weak_ptr.hpp>
+#include <glog/logging.h>
+#include <muduo/net/Buffer.h>
+#include <muduo/net/EventLoop.h>
+#include <muduo/net/TcpConnection.h>
+
+#include <atlas/singleton.h>
+#include <atlas/container/sharded_concurrent_box.h>
+#include <atlas/container/timer_wheel.h>
+
+namespace pioneer {
+  namespace net {
+
+    namespace mn = muduo::net;
+
+    /*
+     * The outward connections, the ones of the external clients, with the time they were read last and the
+     * memory of their input and output buffers, so a client which leaks connections can not hold them forever.
+     *
+     * A connection which sends nothing for the idle timeout is closed, the deadlines are kept in a timer wheel
+     * as the sessions' are, see session_manager, a deadline of a connection read since is pushed back on expiry.
+     *
+     * Once the buffers of all the connections together exceed the memory cap, the most bloated connections are
+     * closed, the most idle first among the equal ones, until the total is 1/8 below the cap.
+     *
+     * The memory is sampled by the I/O thread of the connection, after a read, a drain of the output buffer,
+     * and when the output buffer crosses the high water mark, the requests holding the input buffers taken over
+     * are not counted, see buffer_pool. Both are checked by sweep(), periodically, in any thread
+     * */
+    class connection_reaper : public atlas::singleton<connection_reaper> {
+    public:
+
+      typedef std::chrono::steady_clock clock;
+
+      enum reason { idle, memory };
+
+    private:
+
+      friend class atlas::singleton<connection_reaper>;
+      connection_reaper(const connection_reaper&) = delete;
+      connection_reaper& operator=(const connection_reaper&) = delete;
+
+    public:
+
+      // public for std::make_shared, see atlas::singleton
+      connection_reaper() : _idle_timeout(clock::duration::zero()), _memory_cap(0), _bytes(0), _reaped_idle(0), _reaped_memory(0) {}
+
+    public:
+
+      // zero for never, the connections tracked before keep their deadline until it's checked
+      void set_idle_timeout(clock::duration timeout) { _idle_timeout.store(timeout, std::memory_order_relaxed); }
+
+      clock::duration idle_timeout() const { return _idle_timeout.load(std::memory_order_relaxed); }
+
+      // zero for no cap
+      void set_memory_cap(size_t bytes) { _memory_cap.store(bytes, std::memory_order_relaxed); }
+
+      size_t memory_cap() const { return _memory_cap.load(std::memory_order_relaxed); }
+
+      // the I/O thread of the connection, once it's up
+      void track(const mn::TcpConnectionPtr& conn) {
+        usage_ptr u = std::make_shared<usage>(conn, clock::now());
+        _connections.put(conn.get(), u);
+
+        clock::duration timeout = idle_timeout();
+        if (timeout != clock::duration::zero()) _idle_deadlines.add(u, clock::now() + timeout);
+      }
+
+      // the I/O thread of the connection, once it's down
+      void untrack(const mn::TcpConnectionPtr& conn) {
+        boost::optional<usage_ptr> u = _connections.take(conn.get());
+        if (u) _bytes.fetch_sub((*u)->bytes.exchange(0), std::memory_order_relaxed);
+      }
+
+      // the I/O thread of the connection, after a read
+      void on_read(const mn::TcpConnectionPtr& conn) {
+        boost::optional<usage_ptr> u = _connections.get(conn.get());
+        if (!u) return;
+
+        (*u)->last_active.store(clock::now().time_since_epoch().count(), std::memory_order_relaxed);
+        sample(conn, **u);
+      }
+
+      // the I/O thread of the connection, when the output buffer changes
+      void sample(const mn::TcpConnectionPtr& conn) {
+        boost::optional<usage_ptr> u = _connections.get(conn.get());
+        if (u) sample(conn, **u);
+      }
+
+      void sweep() {
+        clock::time_point now = clock::now();
+        clock::duration timeout = idle_timeout();
+
+        if (timeout != clock::duration::zero()) {
+          _idle_deadlines.advance(now, [this, now, timeout](const std::weak_ptr<usage>& w) {
+            usage_ptr u = w.lock();
+            if (!u) return;
+
+            clock::time_point last(clock::duration(u->last_active.load(std::memory_order_relaxed)));
+            if (now - last < timeout) {
+              // read since the deadline was set, check it later
+              _idle_deadlines.add(u, last + timeout);
+              return;
+            }
+
+            close(*u, idle);
+          });
+        }
+
+        size_t cap = memory_cap();
+        if (cap && bytes() > cap) shed(now, cap);
+      }
+
+      size_t connections() const { return _connections.size(); }
+
+      // the bytes of the buffers of all the connections, as last sampled
+      size_t bytes() const { return _bytes.load(std::memory_order_relaxed); }
+
+      unsigned long long reaped(reason r) const {
+        return (r == idle ? _reaped_idle : _reaped_memory).load(std::memory_order_relaxed);
+      }
+
+    private:
+
+      struct usage {
+        usage(const mn::TcpConnectionPtr& conn, clock::time_point now) :
+          conn(conn), last_active(now.time_since_epoch().count()), bytes(0) {}
+
+        boost::weak_ptr<mn::TcpConnection> conn;
+        // the steady clock ticks of the last read
+        std::atomic<int64_t> last_active;
+        std::atomic<size_t> bytes;
+      };
+
+      typedef std::shared_ptr<usage> usage_ptr;
+
+      // the memory held by a buffer, not only the bytes in it
+      static size_t capacity(mn::Buffer* b) {
+        return b->prependableBytes() + b->readableBytes() + b->writableBytes();
+      }
+
+      void sample(const mn::TcpConnectionPtr& conn, usage& u) {
+        size_t now = capacity(conn->inputBuffer()) + capacity(conn->outputBuffer());
+        size_t before = u.bytes.exchange(now, std::memory_order_relaxed);
+
+        _bytes.fetch_add(now, std::memory_order_relaxed);
+        _bytes.fetch_sub(before, std::memory_order_relaxed);
+      }
+
+      // the most bloated first, the most idle first among the equal ones
+      void shed(clock::time_point now, size_t cap) {
+        std::vector<usage_ptr> all;
+        all.reserve(_connections.size());
+        _connections.for_each([&all](const std::pair<const mn::TcpConnection* const, usage_ptr>& e) {
+          all.push_back(e.second);
+        });
+
+        std::sort(all.begin(), all.end(), [](const usage_ptr& lhs, const usage_ptr& rhs) {
+          size_t l = lhs->bytes.load(std::memory_order_relaxed), r = rhs->bytes.load(std::memory_order_relaxed);
+          if (l != r) return l > r;
+          return lhs->last_active.load(std::memory_order_relaxed) < rhs->last_active.load(std::memory_order_relaxed);
+        });
+
+        size_t total = bytes();
+        size_t target = cap - cap / 8;
+
+        LOG(WARNING) << "the outward connections take " << total << " bytes, over the cap of " << cap << " bytes";
+
+        for (const usage_ptr& u : all) {
+          if (total <= target) break;
+
+          // the memory is given back once the connection is down, see untrack
+          size_t b = u->bytes.load(std::memory_order_relaxed);
+          total -= std::min(total, b);
+          close(*u, memory);
+        }
+      }
+
+      // closed in it's I/O thread, both directions, so muduo reads the end and tears it down as a normal close
+      void close(usage& u, reason r) {
+        mn::TcpConnectionPtr conn = u.conn.lock();
+        if (!conn) return;
+
+        LOG(INFO) << "close " << conn->peerAddress().toIpPort() << (r == idle ? ", idle for too long" : ", over the memory cap")
+            << ", " << u.bytes.load(std::memory_order_relaxed) << " bytes buffered";
+        ++(r == idle ? _reaped_idle : _reaped_memory);
+
+        conn->getLoop()->runInLoop(boost::bind(&connection_reaper::close_in_loop, conn));
+      }
+
+      static void close_in_loop(const mn::TcpConnectionPtr& conn) {
+        if (conn->connected()) ::shutdown(conn->fd(), SHUT_RDWR);
+      }
+
+    private:
+
+      std::atomic<clock::duration> _idle_timeout;
+      std::atomic<size_t> _memory_cap;
+
+      atlas::sharded_concurrent_box<const mn::TcpConnection*, usage_ptr> _connections;
+      atlas::timer_wheel<std::weak_ptr<usage>> _idle_deadlines { std::chrono::seconds(1) };
+
+      std::atomic<size_t> _bytes;
+      std::atomic<unsigned long long> _reaped_idle;
+      std::atomic<unsigned long long> _reaped_memory;
+    };
+
+  } // net
+} // pioneer
+
+#endif /* PIONEER_NET_CONNECTION_REAPER_H_ */
@@ -0,0 +1,108 @@
+/*
+ * connection_stats.h
+ *
+ *  Created on: Sep 17, 2013
+ *      Author: vincent
+ */
+
+/*    Copyright 2011 ~ 2013 Vincent Zhang, ivincent.zhang@gmail.com
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#ifndef PIONEER_NET_CONNECTION_STATS_H_
+#define PIONEER_NET_CONNECTION_STATS_H_
+
+#include <cstdint>
+#include <array>
+#include <chrono>
+#include <mutex>
+
+#include <atlas/singleton.h>
+#include <atlas/rpc/stats.h>
+
+namespace pioneer {
+  namespace net {
+
+    /*
+     * The cost of the connection callbacks, the pools, the membership and the logging of a connection going up or
+     * down, by connection type, see connection_handler::handle_connection.
+     *
+     * A connection comes and goes once, even a storm of ten thousands of them takes the lock for a few milliseconds
+     * in all, so the histograms are shared under a mutex, unlike the ones of the requests, see atlas::rpc::rpc_stats
+     * */
+    class connection_stats : public atlas::singleton<connection_stats> {
+    public:
+
+      typedef std::chrono::steady_clock clock;
+
+      // the order of connection_handler::connection_type
+      enum { type_count = 3 };
+
+      struct snapshot {
+        snapshot() : up(0), down(0) {}
+
+        uint64_t up;
+        uint64_t down;
+        atlas::rpc::latency_histogram latency;
+      };
+
+    private:
+
+      friend class atlas::singleton<connection_stats>;
+      connection_stats(connection_stats&)= delete;
+      connection_stats& operator=(const connection_stats&)= delete;
+
+    public:
+
+      // public for std::make_shared, see atlas::singleton
+      connection_stats() = default;
+
+      static const char* type_name(int type) {
+        static const char* names[] = { "outward server", "inward server", "inward client" };
+        return (type >= 0 && type < type_count) ? names[type] : "unknown";
+      }
+
+      void record(int type, bool connected, clock::duration d) {
+        if (type < 0 || type >= type_count) return;
+
+        int64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(d).count();
+        uint64_t v = ns > 0 ? ns : 0;
+
+        std::lock_guard<std::mutex> guard(_mutex);
+
+        snapshot& s = _stats[type];
+        if (connected) ++s.up;
+        else ++s.down;
+
+        ++s.latency.counts[atlas::rpc::latency_histogram::index(v)];
+        ++s.latency.total;
+        s.latency.sum += v;
+        if (v > s.latency.max) s.latency.max = v;
+      }
+
+      std::array<snapshot, type_count> collect() const {
+        std::lock_guard<std::mutex> guard(_mutex);
+        return _stats;
+      }
+
+    private:
+
+      mutable std::mutex _mutex;
+      std::array<snapshot, type_count> _stats;
+    };
+
+  } // net
+} // pioneer
+
+#endif /* PIONEER_NET_CONNECTION_STATS_H_ */
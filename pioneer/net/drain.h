@@ -0,0 +1,226 @@
+/*
+ * drain.h
+ *
+ *  Created on: Sep 28, 2013
+ *      Author: vincent
+ */
+
+/*    Copyright 2011 ~ 2013 Vincent Zhang, ivincent.zhang@gmail.com
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#ifndef PIONEER_NET_DRAIN_H_
+#define PIONEER_NET_DRAIN_H_
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <mutex>
+#include <string>
+
+#include <glog/logging.h>
+#include <atlas/singleton.h>
+#include <atlas/rpc.h>
+
+#include <pioneer/system/context.h>
+#include <pioneer/system/status.h>
+#include <pioneer/system/thread_pool.h>
+#include <pioneer/net/fair_queue.h>
+#include <pioneer/net/gossip.h>
+#include <pioneer/net/leader.h>
+#include <pioneer/net/offload.h>
+#include <pioneer/net/request.h>
+#include <pioneer/net/rpc_clients.h>
+
+namespace pioneer {
+  namespace net {
+
+    /*
+     * The graceful leave of a node, for the deploys. Once asked, at the first signal, the node multicasts it's
+     * departure, so the peers take it out of the inside nodes and route no more requests to it, see
+     * rpc::drain_rfc, it's gossiped dead if the gossip is on, the readiness turns to 503, and the new outward
+     * requests are answered busy, so the clients go to another node. The queued requests, the sessions and
+     * the calls of it's own still pending are finished, and the node quits once there are none left, or at
+     * the deadline, whichever comes first, a second signal quits at once.
+     *
+     * The drain is driven by a timer, see poll(), a signal handler only asks for it
+     * */
+    class drain : public atlas::singleton<drain> {
+    public:
+
+      typedef std::chrono::steady_clock clock;
+
+      // the departure is given so long to spread before the node may quit
+      static constexpr double grace = 1.0;
+
+    private:
+
+      friend class atlas::singleton<drain>;
+      drain(const drain&) = delete;
+      drain& operator=(const drain&) = delete;
+
+    public:
+
+      // public for std::make_shared, see atlas::singleton
+      drain() : _timeout(0), _requested(false), _draining(false), _idle_polls(0), _shed(0) {}
+
+    public:
+
+      // before the servers start, the seconds to drain at most, 0 to quit at once, the quit stops every service
+      void configure(double timeout, const std::function<void()>& quit) {
+        _timeout = timeout;
+        _quit = quit;
+      }
+
+      bool enabled() const { return _timeout > 0; }
+
+      // in the signal handler, false if it's asked already
+      bool request() {
+        return enabled() && !_requested.exchange(true);
+      }
+
+      bool draining() const { return _draining.load(std::memory_order_relaxed); }
+
+      // the tasks queued and running, the ones waiting in the fair queue, the requests not answered, and the calls waiting for their responses
+      static size_t in_flight() {
+        return system::worker_pool::ref().pending_tasks() + system::worker_pool::ref().active()
+            + system::control_pool::ref().pending_tasks() + system::control_pool::ref().active()
+            + fair_queue::ref().queued()
+            + session_manager::ref().size()
+            + atlas::rpc::sync_task_manager::ref().size() + atlas::rpc::async_task_manager::ref().size();
+      }
+
+      // in the timer, the node quits once it's idle for two polls in a row, so the last responses are written out
+      void poll() {
+        if (!_requested.load(std::memory_order_relaxed) || system::context::system_quitting) return;
+
+        if (!_draining) {
+          begin();
+          return;
+        }
+
+        clock::time_point now = clock::now();
+        double elapsed = std::chrono::duration<double>(now - _start).count();
+        if (elapsed < grace) return;
+
+        size_t left = in_flight();
+        _idle_polls = left ? 0 : _idle_polls + 1;
+
+        if (_idle_polls >= 2) {
+          LOG(INFO) << "drained in " << elapsed << "s, " << _shed << " outward requests turned away";
+        }
+        else if (elapsed >= _timeout) {
+          LOG(WARNING) << "the drain deadline of " << _timeout << "s passed, " << left << " requests and calls are dropped";
+        }
+        else {
+          return;
+        }
+
+        if (_quit) _quit();
+      }
+
+      // a new outward request, answered busy while draining
+      void on_shed() { _shed.fetch_add(1, std::memory_order_relaxed); }
+
+      unsigned long long shed() const { return _shed.load(std::memory_order_relaxed); }
+
+      // a peer is leaving, it's no longer an inside node, it's connections close once it quits
+      static void peer_left(const std::string& ip) {
+        if (ip.empty() || ip == system::context::local_ip) return;
+
+        LOG(INFO) << "inside node " << ip << " is leaving";
+
+        leader_election::ref().forget(atlas::rpc::parse_ip(ip));
+        offload::ref().forget(atlas::rpc::parse_ip(ip));
+
+        if (gossip::ref().enabled()) {
+          gossip::ref().left(ip);
+          return;
+        }
+
+        uint64_t version = system::context::inside_nodes.update([&ip](system::membership& m) {
+          if (m.ip_list.erase(ip)) m.ring.remove(ip);
+        });
+
+        system::context::inner_node_count = system::context::inside_nodes.get()->ip_list.size();
+
+        LOG(INFO) << system::context::inner_node_count << " inside nodes, version " << version;
+      }
+
+    private:
+
+      void begin();
+
+    private:
+
+      double _timeout;
+      std::function<void()> _quit;
+
+      std::atomic<bool> _requested;
+      std::atomic<bool> _draining;
+      clock::time_point _start;
+      int _idle_polls;
+
+      std::atomic<unsigned long long> _shed;
+    };
+
+  } // net
+
+  namespace rpc {
+
+    using atlas::rpc::rpc_result;
+    using atlas::rpc::rpc_context;
+
+    // builtin rpc
+    ATLAS_REGISTER_REMOTE_FUNC(node_leaving, -12);
+
+    class drain_rfc {
+    public:
+
+      // a node multicasts it's departure as it starts to drain
+      static rpc_result leaving(const std::string& ip, rpc_context c) noexcept {
+        net::drain::peer_left(ip);
+        return nullptr;
+      }
+    };
+
+    ATLAS_BIND_REMOTE_FUNC(node_leaving, drain_rfc::leaving);
+
+    // never queued behind the data plane requests
+    PIONEER_RPC_PRIORITY(node_leaving, 10);
+
+  } // rpc
+
+  namespace net {
+
+    inline void drain::begin() {
+      _start = clock::now();
+      _draining = true;
+      system::status::ready = false;
+
+      LOG(INFO) << "draining, " << in_flight() << " requests and calls in flight, quit in " << _timeout << "s at most";
+
+      if (gossip::ref().enabled()) gossip::ref().leave();
+      if (leader_election::ref().enabled()) leader_election::ref().resign();
+
+      if (!system::context::local_ip.empty()) {
+        rpc::mcast_client client;
+        client.call(rpc::drain_rfc::leaving, rpc::fn_ids::node_leaving, system::context::local_ip, atlas::rpc::nilctx);
+      }
+    }
+
+  } // net
+} // pioneer
+
+#endif /* PIONEER_NET_DRAIN_H_ */
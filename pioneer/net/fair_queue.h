@@ -0,0 +1,359 @@
+/*
+ * fair_queue.h
+ *
+ *  Created on: Sep 28, 2013
+ *      Author: vincent
+ */
+
+/*    Copyright 2011 ~ 2013 Vincent Zhang, ivincent.zhang@gmail.com
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#ifndef PIONEER_NET_FAIR_QUEUE_H_
+#define PIONEER_NET_FAIR_QUEUE_H_
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <atlas/singleton.h>
+#include <atlas/token_bucket.h>
+#include <atlas/container/small_vector.h>
+#include <atlas/rpc.h>
+
+#include <pioneer/system/thread_pool.h>
+#include <pioneer/net/request.h>
+
+namespace pioneer {
+  namespace net {
+
+    /*
+     * The fairness among the outward clients, so one aggressive client can not starve the others by filling the
+     * worker pool, which is one FIFO.
+     *
+     * A client is told by it's ip, or by it's ip and the client id of the header if by_client_id, and has two
+     * limits, both off by default
+     *  1. the quota, a token bucket of the requests per second, a request over it is answered busy at once in the
+     *     I/O loop, before it's request is built, see admit()
+     *  2. the fair queueing, the data plane requests wait in the queues of their clients, and go to the worker
+     *     pool by deficit round robin, at most max_in_flight at once, so the pool's FIFO stays short and the
+     *     order in which the clients are served is set here. A client is given quantum bytes a turn, a request
+     *     costs it's size, capped at 4 quanta, so a client of large requests gets as many bytes, not as many
+     *     requests, as the others. A client with max_queued requests waiting gets busy for the next ones.
+     *
+     * The inside nodes are never limited. Thread safe, one lock, taken once a request in the I/O loops and once
+     * a request done in the workers. The clients idle for long are forgotten, see sweep()
+     * */
+    class fair_queue : public atlas::singleton<fair_queue> {
+    public:
+
+      typedef std::chrono::steady_clock clock;
+
+    private:
+
+      struct item {
+        request_ptr request;
+        size_t cost;
+      };
+
+      struct flow {
+        flow() : deficit(0), active(false), served(0), over_quota(0) {}
+
+        atlas::token_bucket bucket;
+        std::deque<item> queue;
+        int64_t deficit;
+        bool active;
+        clock::time_point last;
+
+        unsigned long long served;
+        unsigned long long over_quota;
+      };
+
+      typedef atlas::small_vector<request_ptr, 16> ready_list;
+
+    private:
+
+      friend class atlas::singleton<fair_queue>;
+      fair_queue(const fair_queue&) = delete;
+      fair_queue& operator=(const fair_queue&) = delete;
+
+    public:
+
+      // public for std::make_shared, see atlas::singleton
+      fair_queue() :
+        _rate(0), _burst(0), _max_in_flight(0), _quantum(16 * 1024), _max_queued(0), _by_client_id(false),
+        _in_flight(0), _queued(0), _over_quota(0) {}
+
+    public:
+
+      /*
+       * Before the servers start. The requests per second and the burst of a client, 0 for no quota, the
+       * requests of the fair queue in the worker pool at once, 0 for no fair queueing, the bytes of a turn, and
+       * the requests a client may have waiting, 0 for no bound
+       * */
+      void configure(double rate, double burst, size_t max_in_flight, size_t quantum, size_t max_queued,
+          bool by_client_id) {
+        std::lock_guard<std::mutex> guard(_mutex);
+
+        _rate = rate > 0 ? rate : 0;
+        _burst = burst > 0 ? burst : _rate;
+        _max_in_flight = max_in_flight;
+        _quantum = quantum > 0 ? quantum : 16 * 1024;
+        _max_queued = max_queued;
+        _by_client_id = by_client_id;
+      }
+
+      bool limited() const { return _rate > 0; }
+
+      bool queueing() const { return _max_in_flight > 0; }
+
+      bool enabled() const { return limited() || queueing(); }
+
+      // the client of an outward frame
+      uint64_t client_of(atlas::rpc::endpoint_id source, const char* frame) const {
+        uint64_t ip = atlas::rpc::endpoint_ip(source);
+        if (!_by_client_id) return ip;
+
+        int16_t id = 0;
+        std::memcpy(&id, frame + offsetof(atlas::rpc::request_header, client_id), sizeof(id));
+        return (ip << 16) | static_cast<uint16_t>(id);
+      }
+
+      // the client of a request which has no header, a call of the HTTP gateway
+      uint64_t client_of(atlas::rpc::endpoint_id source) const {
+        uint64_t ip = atlas::rpc::endpoint_ip(source);
+        return _by_client_id ? ip << 16 : ip;
+      }
+
+      // in the I/O loop, false if the client is over it's quota, the request is answered busy then
+      bool admit(uint64_t client) {
+        if (!limited()) return true;
+
+        clock::time_point now = clock::now();
+
+        std::lock_guard<std::mutex> guard(_mutex);
+        flow& f = flow_of(client, now);
+
+        if (f.bucket.available(now) < 1) {
+          ++f.over_quota;
+          _over_quota.fetch_add(1, std::memory_order_relaxed);
+          return false;
+        }
+
+        f.bucket.consume(1);
+        return true;
+      }
+
+      // the request goes to the worker pool in it's client's turn, it's rejected if the client has too many waiting
+      void enqueue(uint64_t client, request_ptr&& r, size_t size) {
+        ready_list ready;
+        clock::time_point now = clock::now();
+
+        {
+          std::lock_guard<std::mutex> guard(_mutex);
+          flow& f = flow_of(client, now);
+
+          if (_max_queued && f.queue.size() >= _max_queued) {
+            ++f.over_quota;
+            _over_quota.fetch_add(1, std::memory_order_relaxed);
+            r->reject();
+            return;
+          }
+
+          item i = { std::move(r), std::min(size, 4 * _quantum) };
+          f.queue.push_back(std::move(i));
+          ++_queued;
+
+          if (!f.active) {
+            f.active = true;
+            f.deficit = _quantum;
+            _active.push_back(client);
+          }
+
+          pick(ready);
+        }
+
+        dispatch(ready);
+      }
+
+      // the requests waiting, the drain waits for them too
+      size_t queued() const {
+        std::lock_guard<std::mutex> guard(_mutex);
+        return _queued;
+      }
+
+      size_t in_flight() const {
+        std::lock_guard<std::mutex> guard(_mutex);
+        return _in_flight;
+      }
+
+      // the requests answered busy for the quota or a full queue
+      unsigned long long over_quota() const { return _over_quota.load(std::memory_order_relaxed); }
+
+      // in the housekeeping, forget the clients with nothing waiting and idle for the seconds
+      void sweep(double idle = 60) {
+        clock::time_point now = clock::now();
+        std::chrono::duration<double> limit(idle);
+
+        std::lock_guard<std::mutex> guard(_mutex);
+        for (auto it = _flows.begin(); it != _flows.end();) {
+          if (!it->second.active && now - it->second.last > limit) it = _flows.erase(it);
+          else ++it;
+        }
+      }
+
+      std::string str() const {
+        std::ostringstream os;
+
+        std::lock_guard<std::mutex> guard(_mutex);
+        os << "quota : " << (_rate > 0 ? std::to_string(_rate) + " requests per second" : std::string("off")) << "\n"
+            << "fair queueing : " << (_max_in_flight ? std::to_string(_max_in_flight) + " in flight" : std::string("off")) << "\n"
+            << "clients : " << _flows.size() << ", " << _active.size() << " waiting\n"
+            << "queued : " << _queued << "\n"
+            << "in flight : " << _in_flight << "\n"
+            << "over quota : " << _over_quota.load() << "\n";
+
+        // the busiest clients
+        std::vector<std::pair<size_t, uint64_t>> busiest;
+        for (const auto& f : _flows) busiest.push_back(std::make_pair(f.second.queue.size(), f.first));
+        std::sort(busiest.rbegin(), busiest.rend());
+        if (busiest.size() > 20) busiest.resize(20);
+
+        for (const auto& b : busiest) {
+          const flow& f = _flows.find(b.second)->second;
+          uint64_t ip = _by_client_id ? b.second >> 16 : b.second;
+
+          os << atlas::rpc::format_ip(static_cast<uint32_t>(ip)).c_str();
+          if (_by_client_id) os << "/" << static_cast<int16_t>(b.second & 0xffff);
+          os << " : " << f.queue.size() << " queued, " << f.served << " served, " << f.over_quota << " over quota\n";
+        }
+
+        return os.str();
+      }
+
+    private:
+
+      // under the lock
+      flow& flow_of(uint64_t client, clock::time_point now) {
+        auto it = _flows.find(client);
+        if (it == _flows.end()) {
+          it = _flows.insert(std::make_pair(client, flow())).first;
+          it->second.bucket.reset(_rate, _burst);
+        }
+
+        it->second.last = now;
+        return it->second;
+      }
+
+      // under the lock, the requests whose turn it is, while the in flight ones are below the bound
+      void pick(ready_list& ready) {
+        while (_in_flight < _max_in_flight && !_active.empty()) {
+          uint64_t client = _active.front();
+          flow& f = _flows.find(client)->second;
+          item& head = f.queue.front();
+
+          if (f.deficit < static_cast<int64_t>(head.cost)) {
+            // the turn is over, the next one has another quantum
+            f.deficit += _quantum;
+            _active.pop_front();
+            _active.push_back(client);
+            continue;
+          }
+
+          f.deficit -= head.cost;
+          ready.push_back(std::move(head.request));
+          f.queue.pop_front();
+          --_queued;
+          ++_in_flight;
+          ++f.served;
+
+          if (f.queue.empty()) {
+            f.active = false;
+            f.deficit = 0;
+            _active.pop_front();
+          }
+        }
+      }
+
+      // out of the lock, the requests the full pool refuses are rejected, and the next ones picked in their place
+      void dispatch(ready_list& ready) {
+        while (!ready.empty()) {
+          size_t refused = 0;
+          for (request_ptr& r : ready) {
+            net::request* p = r.get();
+            atlas::adaptive_thread_pool::task_type task(std::bind(&fair_queue::run, this, std::move(r)));
+
+            // a rejected task is left untouched, so it still holds the request
+            if (!system::worker_pool::ref().schedule(std::move(task))) {
+              p->reject();
+              ++refused;
+            }
+          }
+
+          ready.clear();
+          if (!refused) return;
+
+          std::lock_guard<std::mutex> guard(_mutex);
+          _in_flight -= refused;
+          pick(ready);
+        }
+      }
+
+      // in the worker, the next request is picked once this one is done
+      void run(const request_ptr& r) {
+        r->execute_or_shed();
+
+        ready_list ready;
+        {
+          std::lock_guard<std::mutex> guard(_mutex);
+          --_in_flight;
+          pick(ready);
+        }
+
+        dispatch(ready);
+      }
+
+    private:
+
+      mutable std::mutex _mutex;
+
+      double _rate;
+      double _burst;
+      size_t _max_in_flight;
+      size_t _quantum;
+      size_t _max_queued;
+      bool _by_client_id;
+
+      std::unordered_map<uint64_t, flow> _flows;
+      // the clients with requests waiting, in their turns
+      std::deque<uint64_t> _active;
+
+      size_t _in_flight;
+      size_t _queued;
+      std::atomic<unsigned long long> _over_quota;
+    };
+
+  } // net
+} // pioneer
+
+#endif /* PIONEER_NET_FAIR_QUEUE_H_ */
@@ -0,0 +1,205 @@
+/*
+ * fast_open.h
+ *
+ *  Created on: Sep 28, 2013
+ *      Author: vincent
+ */
+
+/*    Copyright 2011 ~ 2013 Vincent Zhang, ivincent.zhang@gmail.com
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#ifndef PIONEER_NET_FAST_OPEN_H_
+#define PIONEER_NET_FAST_OPEN_H_
+
+#include <dirent.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+
+#include <atomic>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <glog/logging.h>
+
+#include <atlas/singleton.h>
+
+// linux 3.7, the older headers miss it
+#ifndef TCP_FASTOPEN
+#define TCP_FASTOPEN 23
+#endif
+
+namespace pioneer {
+  namespace net {
+
+    /*
+     * TCP Fast Open on the outward listeners, so a client which has the cookie of the server from an earlier
+     * connection sends it's first request in the SYN, and the request runs before the handshake is done, the short
+     * lived clients, connect, a few calls and close, save a round trip on every connection.
+     *
+     * The server side needs the bit 2 of net.ipv4.tcp_fastopen, the client side the bit 1, the default, and the
+     * client sends with MSG_FASTOPEN or sets TCP_FASTOPEN_CONNECT before it connects. The queue is the most
+     * connections whose handshakes are not done yet but whose data is accepted, beyond it the SYNs with data are
+     * handled as the plain ones.
+     *
+     * The muduo server keeps it's acceptor to itself, so the listeners are found by their port among the sockets of
+     * the process, the SO_REUSEPORT shards of the port included
+     * */
+    class fast_open : public atlas::singleton<fast_open> {
+    public:
+
+      // the bits of net.ipv4.tcp_fastopen
+      static const int client_bit = 1;
+      static const int server_bit = 2;
+
+    private:
+
+      friend class atlas::singleton<fast_open>;
+      fast_open(const fast_open&) = delete;
+      fast_open& operator=(const fast_open&) = delete;
+
+    public:
+
+      // public for std::make_shared, see atlas::singleton
+      fast_open() : _queue(0), _listeners(0) {}
+
+    public:
+
+      // before the servers start, 0 for off
+      void configure(int queue) { _queue = queue > 0 ? queue : 0; }
+
+      bool enabled() const { return _queue > 0; }
+
+      // once the listeners of the port are up, the ones it's set on
+      int enable(uint16_t port) {
+        if (!enabled()) return 0;
+
+        int mode = sysctl();
+        if (mode >= 0 && !(mode & server_bit)) {
+          LOG(WARNING) << "TCP Fast Open is off for the servers, set the bit 2 of net.ipv4.tcp_fastopen";
+        }
+
+        int n = 0;
+        for (int fd : listeners(port)) {
+          if (::setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN, &_queue, sizeof(_queue)) == 0) ++n;
+          else LOG(WARNING) << "can not set TCP_FASTOPEN : " << strerror(errno);
+        }
+
+        _listeners += n;
+        if (n) LOG(INFO) << "TCP Fast Open on " << n << " listeners of port " << port << ", queue " << _queue;
+
+        return n;
+      }
+
+      // net.ipv4.tcp_fastopen, -1 if it's unknown
+      static int sysctl() {
+        std::ifstream in("/proc/sys/net/ipv4/tcp_fastopen");
+        int value = -1;
+
+        in >> value;
+        return in ? value : -1;
+      }
+
+      // the TCPFastOpen counters of the kernel, of /proc/net/netstat
+      static std::vector<std::pair<std::string, long long>> counters() {
+        std::vector<std::pair<std::string, long long>> result;
+        std::ifstream in("/proc/net/netstat");
+
+        // a line of names and a line of values a section
+        std::string names, values;
+        while (std::getline(in, names) && std::getline(in, values)) {
+          if (names.compare(0, 7, "TcpExt:") != 0) continue;
+
+          std::istringstream n(names), v(values);
+          std::string name, value;
+          n >> name;
+          v >> value;
+
+          while (n >> name && v >> value) {
+            if (name.compare(0, 11, "TCPFastOpen") == 0) result.push_back(std::make_pair(name, std::atoll(value.c_str())));
+          }
+        }
+
+        return result;
+      }
+
+      std::string str() const {
+        std::ostringstream os;
+
+        int mode = sysctl();
+        os << "queue : " << (_queue ? std::to_string(_queue) : std::string("off")) << "\n"
+            << "listeners : " << _listeners.load() << "\n"
+            << "net.ipv4.tcp_fastopen : " << mode << ", server " << (mode > 0 && (mode & server_bit) ? "on" : "off")
+            << ", client " << (mode > 0 && (mode & client_bit) ? "on" : "off") << "\n";
+
+        for (const auto& c : counters()) os << c.first << " : " << c.second << "\n";
+
+        return os.str();
+      }
+
+    private:
+
+      // the listening TCP sockets of the process on the port
+      static std::vector<int> listeners(uint16_t port) {
+        std::vector<int> fds;
+
+        DIR* dir = ::opendir("/proc/self/fd");
+        if (!dir) return fds;
+
+        int self = ::dirfd(dir);
+        while (struct dirent* e = ::readdir(dir)) {
+          if (e->d_name[0] == '.') continue;
+
+          int fd = std::atoi(e->d_name);
+          if (fd != self && listening(fd, port)) fds.push_back(fd);
+        }
+        ::closedir(dir);
+
+        return fds;
+      }
+
+      static bool listening(int fd, uint16_t port) {
+        int accepting = 0, type = 0;
+        socklen_t len = sizeof(int);
+        if (::getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &accepting, &len) != 0 || !accepting) return false;
+
+        len = sizeof(int);
+        if (::getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &len) != 0 || type != SOCK_STREAM) return false;
+
+        sockaddr_storage addr;
+        len = sizeof(addr);
+        if (::getsockname(fd, reinterpret_cast<sockaddr*>(&addr), &len) != 0) return false;
+
+        if (addr.ss_family == AF_INET) return ntohs(reinterpret_cast<const sockaddr_in&>(addr).sin_port) == port;
+        if (addr.ss_family == AF_INET6) return ntohs(reinterpret_cast<const sockaddr_in6&>(addr).sin6_port) == port;
+
+        return false;
+      }
+
+    private:
+
+      int _queue;
+      std::atomic<int> _listeners;
+    };
+
+  } // net
+} // pioneer
+
+#endif /* PIONEER_NET_FAST_OPEN_H_ */
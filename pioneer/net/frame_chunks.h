@@ -0,0 +1,248 @@
+/*
+ * frame_chunks.h
+ *
+ *  Created on: Sep 28, 2013
+ *      Author: vincent
+ */
+
+/*    Copyright 2011 ~ 2013 Vincent Zhang, ivincent.zhang@gmail.com
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#ifndef PIONEER_NET_FRAME_CHUNKS_H_
+#define PIONEER_NET_FRAME_CHUNKS_H_
+
+#include <cstring>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+
+#include <glog/logging.h>
+#include <atlas/singleton.h>
+#include <atlas/rpc.h>
+
+namespace pioneer {
+  namespace rpc {
+
+    // builtin rpc, the chunks never reach the dispatcher, the id tells them from the frames
+    ATLAS_REGISTER_REMOTE_FUNC(frame_chunk, -18);
+
+  } // rpc
+
+  namespace net {
+
+#pragma pack(1)
+
+    // follows the header of a chunk, the payload is the bytes of the frame from the offset
+    struct frame_chunk_header {
+      uint32_t total_size;  // the size of the whole frame
+      uint32_t offset;
+    };
+
+#pragma pack()
+
+    /*
+     * A large frame is sent over a connection in chunks, each one a frame of it's own, of the builtin frame_chunk,
+     * so the small frames written meanwhile go between the chunks instead of waiting behind a bulk transfer, see
+     * corked_output. The chunks of a frame are written one after another on one connection, so the receiver
+     * appends them in order, and runs the frame once it's whole, as if it came in one piece.
+     *
+     * It's negotiated as the compression is, a node which can reassemble the chunks sets
+     * rpc::message_accepts_chunks on every message it builds, and a node chunks only for the peers seen with it,
+     * see peer_stats. A frame partly received for reassembly_timeout is dropped, the connection is likely gone
+     * */
+    class frame_chunks : public atlas::singleton<frame_chunks> {
+    public:
+
+      typedef atlas::rpc::request_header request_header;
+      typedef std::chrono::steady_clock clock;
+
+      // a control frame waits for one chunk at most, beside what the socket buffer holds
+      static const size_t chunk_size = 16 * 1024;
+
+      // as connection_handler::max_frame_size
+      static const uint32_t max_frame_size = 64 * 1024 * 1024;
+
+      const std::chrono::seconds reassembly_timeout = std::chrono::seconds(30);
+
+    private:
+
+      friend class atlas::singleton<frame_chunks>;
+      frame_chunks(const frame_chunks&) = delete;
+      frame_chunks& operator=(const frame_chunks&) = delete;
+
+    public:
+
+      // public for std::make_shared, see atlas::singleton
+      frame_chunks() : _enabled(false), _reassembled(0), _dropped(0) {}
+
+    public:
+
+      // before any connection comes up
+      void set_enabled(bool enabled) {
+        _enabled = enabled;
+        atlas::rpc::message::accepts_chunks() = enabled;
+      }
+
+      bool enabled() const { return _enabled; }
+
+      static bool is_chunk(const char* frame) {
+        int32_t fn_id = 0;
+        std::memcpy(&fn_id, frame + offsetof(request_header, fn_id), sizeof(fn_id));
+
+        return fn_id == rpc::fn_ids::frame_chunk;
+      }
+
+      /*
+       * Append the chunk of the frame from the offset to the buffer, the header is the frame's one but the
+       * function id, the length and the priority, return the bytes of the frame taken
+       * */
+      static size_t make_chunk(const std::string& frame, size_t offset, std::string& out) {
+        size_t payload = frame.size() - offset;
+        if (payload > chunk_size) payload = chunk_size;
+
+        request_header h;
+        std::memcpy(&h, frame.data(), sizeof(h));
+        h.length = static_cast<int32_t>(sizeof(h) + sizeof(frame_chunk_header) + payload);
+        h.fn_id = rpc::fn_ids::frame_chunk;
+        // the chunks are not checksummed, the frame is once it's reassembled
+        h.flags &= ~(atlas::rpc::message_compressed | atlas::rpc::message_checksummed);
+        atlas::rpc::message::set_priority(h, atlas::rpc::priority_bulk);
+
+        frame_chunk_header c;
+        c.total_size = static_cast<uint32_t>(frame.size());
+        c.offset = static_cast<uint32_t>(offset);
+
+        out.reserve(out.size() + h.length);
+        out.append(reinterpret_cast<const char*>(&h), sizeof(h));
+        out.append(reinterpret_cast<const char*>(&c), sizeof(c));
+        out.append(frame, offset, payload);
+
+        return payload;
+      }
+
+      // the whole frame once the last chunk arrives on the connection to the peer, nullptr otherwise, thread safe
+      std::shared_ptr<std::string> add(atlas::rpc::endpoint_id peer, const char* chunk, size_t size) {
+        frame_chunk_header c;
+        if (size < sizeof(request_header) + sizeof(c)) return bad(peer);
+
+        std::memcpy(&c, chunk + sizeof(request_header), sizeof(c));
+        const char* payload = chunk + sizeof(request_header) + sizeof(c);
+        size_t payload_size = size - sizeof(request_header) - sizeof(c);
+
+        if (c.total_size < sizeof(request_header) || c.total_size > max_frame_size
+            || c.offset > c.total_size || payload_size > c.total_size - c.offset) {
+          return bad(peer);
+        }
+
+        std::lock_guard<std::mutex> guard(_mutex);
+
+        // a frame starts with it's first chunk, one left partial before is lost
+        if (c.offset == 0) {
+          expire();
+
+          partial& p = _partials[peer];
+          if (p.data) ++_dropped;
+
+          p.data = std::make_shared<std::string>();
+          p.data->reserve(c.total_size);
+          p.total_size = c.total_size;
+          p.start = clock::now();
+        }
+
+        auto it = _partials.find(peer);
+        if (it == _partials.end() || it->second.data->size() != c.offset || it->second.total_size != c.total_size) {
+          if (it != _partials.end()) _partials.erase(it);
+          ++_dropped;
+
+          LOG(ERROR) << "chunk out of order from " << atlas::rpc::endpoint_to_string(peer) << ", drop the frame";
+          return nullptr;
+        }
+
+        std::string& data = *it->second.data;
+        data.append(payload, payload_size);
+        if (data.size() < c.total_size) return nullptr;
+
+        std::shared_ptr<std::string> frame = std::move(it->second.data);
+        _partials.erase(it);
+        ++_reassembled;
+
+        return frame;
+      }
+
+      std::string str() const {
+        size_t partials = 0;
+        {
+          std::lock_guard<std::mutex> guard(_mutex);
+          partials = _partials.size();
+        }
+
+        std::ostringstream os;
+        os << "enabled : " << std::boolalpha << enabled() << "\n"
+            << "chunk size : " << chunk_size << " bytes\n"
+            << "reassembled : " << _reassembled.load(std::memory_order_relaxed) << " frames\n"
+            << "partial : " << partials << " frames\n"
+            << "dropped : " << _dropped.load(std::memory_order_relaxed) << " frames\n";
+
+        return os.str();
+      }
+
+    private:
+
+      struct partial {
+        std::shared_ptr<std::string> data;
+        uint32_t total_size;
+        clock::time_point start;
+      };
+
+      std::shared_ptr<std::string> bad(atlas::rpc::endpoint_id peer) {
+        LOG(ERROR) << "bad chunk from " << atlas::rpc::endpoint_to_string(peer);
+        ++_dropped;
+
+        return nullptr;
+      }
+
+      // the frames of the connections closed in the middle of a frame, with the lock held
+      void expire() {
+        clock::time_point now = clock::now();
+
+        for (auto it = _partials.begin(); it != _partials.end();) {
+          if (now - it->second.start > reassembly_timeout) {
+            it = _partials.erase(it);
+            ++_dropped;
+          }
+          else ++it;
+        }
+      }
+
+    private:
+
+      bool _enabled;
+
+      // by the connection, the peer's ip and port
+      mutable std::mutex _mutex;
+      std::unordered_map<atlas::rpc::endpoint_id, partial> _partials;
+
+      std::atomic<uint64_t> _reassembled;
+      std::atomic<uint64_t> _dropped;
+    };
+
+  } // net
+} // pioneer
+
+#endif /* PIONEER_NET_FRAME_CHUNKS_H_ */
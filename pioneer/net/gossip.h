@@ -0,0 +1,715 @@
+/*
+ * gossip.h
+ *
+ *  Created on: Sep 28, 2013
+ *      Author: vincent
+ */
+
+/*    Copyright 2011 ~ 2013 Vincent Zhang, ivincent.zhang@gmail.com
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#ifndef PIONEER_NET_GOSSIP_H_
+#define PIONEER_NET_GOSSIP_H_
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <set>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <boost/serialization/string.hpp>
+#include <boost/serialization/vector.hpp>
+#include <glog/logging.h>
+#include <atlas/singleton.h>
+#include <atlas/container/small_vector.h>
+#include <atlas/rpc.h>
+
+#include <pioneer/system/context.h>
+#include <pioneer/net/locality.h>
+#include <pioneer/net/overlay.h>
+#include <pioneer/net/rpc_clients.h>
+
+namespace pioneer {
+  namespace net {
+
+    enum member_state : uint8_t { member_alive = 0, member_suspect = 1, member_dead = 2 };
+
+    // what a node knows of a member, the later incarnation wins, and then the worse state
+    struct gossip_entry {
+      uint32_t ip;
+      uint32_t incarnation;
+      uint64_t heartbeat;
+      uint8_t state;
+      // the labels of the member, see net::locality
+      std::string zone;
+      std::string rack;
+
+      template<class Archive>
+      void serialize(Archive& ar, const unsigned int) {
+        ar & ip & incarnation & heartbeat & state & zone & rack;
+      }
+    };
+
+    // the heartbeat of a member, packed, see gossip_delta::heartbeats
+#pragma pack(1)
+    struct gossip_heartbeat {
+      uint32_t ip;
+      uint64_t heartbeat;
+    };
+#pragma pack()
+
+    /*
+     * What a member pushes, the members changed since the version it pushed to us the last time, from, and the
+     * heartbeats. The sender's version counts the changes of it's members, a new member, a state, an incarnation
+     * or the labels, so the entries pushed grow with the churn, not with the cluster. from is 0 for the whole
+     * state, the first push to a member, or the answer to a resync
+     * */
+    struct gossip_delta {
+      uint64_t from;
+      uint64_t to;
+      std::vector<gossip_entry> entries;
+      // gossip_heartbeat one after another, the members alive or suspected, 12 bytes a member
+      std::string heartbeats;
+
+      template<class Archive>
+      void serialize(Archive& ar, const unsigned int) {
+        ar & from & to & entries & heartbeats;
+      }
+    };
+
+    /*
+     * The phi accrual failure detector of a member, the heartbeats of the member arrive as the gossip spreads
+     * them, phi is how unlikely the silence since the last one is, -log10 of the chance that the next one is
+     * still to come, with the intervals taken as exponential. A phi of 8 is about one false suspicion in 10^8
+     * */
+    class phi_detector {
+    public:
+
+      typedef std::chrono::steady_clock clock;
+
+      static const size_t window = 100;
+
+    public:
+
+      // the intervals are never taken shorter than the gossip round
+      phi_detector(clock::time_point now, double min_interval) :
+          _last(now), _sum(0), _min_interval(min_interval) {}
+
+      void heartbeat(clock::time_point now) {
+        double interval = std::chrono::duration<double>(now - _last).count();
+        _last = now;
+
+        _intervals.push_back(interval);
+        _sum += interval;
+        if (_intervals.size() > window) {
+          _sum -= _intervals.front();
+          _intervals.pop_front();
+        }
+      }
+
+      double phi(clock::time_point now) const {
+        double silence = std::chrono::duration<double>(now - _last).count();
+        double mean = _intervals.empty() ? _min_interval : std::max(_sum / _intervals.size(), _min_interval);
+
+        // log10(e)
+        return 0.4342944819 * silence / mean;
+      }
+
+    private:
+
+      clock::time_point _last;
+      std::deque<double> _intervals;
+      double _sum;
+      double _min_interval;
+    };
+
+    /*
+     * The membership of the inside nodes by gossip, in the way of SWIM, instead of a connection to every node
+     * announced. Every round, a node bumps it's own heartbeat and pushes to a few members at random, the fanout,
+     * over the inward connections, so a change reaches the cluster in O(log N) rounds. The members are watched by
+     * phi accrual detectors fed by the heartbeats, see phi_detector.
+     *
+     * A push carries the members changed since the last push to the same member, a versioned delta, and the
+     * heartbeats packed, 12 bytes a member, see gossip_delta. The first push to a member is the whole state, and a
+     * member which sees a gap in the versions pushed to it, a push lost, asks for the whole state again.
+     *
+     * A member whose phi passes the threshold is suspected, and the suspicion is gossiped, the member refutes it
+     * with a new incarnation once it hears it, or it's declared dead after the suspicion rounds, O(log N) too.
+     * The dead are gossiped for a while, so a stale entry never brings them back, and then forgotten, a node
+     * restarting comes back by a new incarnation.
+     *
+     * The alive and the suspected members are the inside nodes, see system::context::inside_nodes, the connections
+     * going up and down no longer change them once the gossip is started. A node joins by a seed, a member
+     * to gossip with, see join(), the members are connected as they are gossiped with, or only the neighbors on
+     * an overlay, see net::overlay
+     * */
+    class gossip : public atlas::singleton<gossip> {
+    public:
+
+      typedef std::chrono::steady_clock clock;
+
+      // the dead are gossiped so many rounds before they are forgotten
+      static const uint64_t dead_rounds = 60;
+
+    private:
+
+      struct member {
+        member(clock::time_point now, double interval) :
+          incarnation(0), heartbeat(0), state(member_alive), since(0), changed(0), connecting(false), detector(now, interval) {}
+
+        uint32_t incarnation;
+        uint64_t heartbeat;
+        member_state state;
+        std::string zone;
+        std::string rack;
+        // the round the state is taken
+        uint64_t since;
+        // the version of the change last made, see gossip_delta
+        uint64_t changed;
+        bool connecting;
+        phi_detector detector;
+      };
+
+      // the targets of a round are the fanout, a few, kept inline
+      enum { fanout_inline = 8 };
+      typedef atlas::small_vector<uint32_t, fanout_inline> target_list;
+      typedef atlas::small_vector<std::string, 4> connect_list;
+
+    private:
+
+      friend class atlas::singleton<gossip>;
+      gossip(const gossip&) = delete;
+      gossip& operator=(const gossip&) = delete;
+
+    public:
+
+      // public for std::make_shared, see atlas::singleton
+      gossip() : _enabled(false), _interval(1.0), _fanout(3), _phi_threshold(8.0), _self(0), _rounds(0), _version(0),
+          _leaving(false), _full_pushes(0), _delta_pushes(0), _entries_pushed(0), _resyncs(0) {}
+
+    public:
+
+      // before the servers start, the interval in seconds, the rounds are driven by a timer, see tick()
+      void start(double interval, size_t fanout = 3, double phi_threshold = 8.0) {
+        std::lock_guard<std::mutex> guard(_mutex);
+
+        _interval = interval;
+        _fanout = fanout;
+        _phi_threshold = phi_threshold;
+        _enabled = true;
+
+        LOG(INFO) << "gossip membership, a round every " << interval << "s to " << fanout << " members";
+      }
+
+      bool enabled() const { return _enabled.load(std::memory_order_relaxed); }
+
+      // a member to gossip with, it tells us the rest of the cluster
+      void join(const std::string& ip) {
+        uint32_t addr = atlas::rpc::parse_ip(ip);
+        if (!addr) return;
+
+        std::lock_guard<std::mutex> guard(_mutex);
+        if (addr == _self || _members.count(addr)) return;
+
+        _members.insert(std::make_pair(addr, member(clock::now(), _interval))).first->second.changed = ++_version;
+        publish();
+      }
+
+      // a round, in the timer of the interval
+      void tick() {
+        atlas::small_vector<gossip_delta, fanout_inline> deltas;
+        target_list targets;
+        connect_list connects;
+
+        {
+          std::lock_guard<std::mutex> guard(_mutex);
+
+          if (!_self && (_leaving || !init_self())) return;
+
+          ++_rounds;
+          clock::time_point now = clock::now();
+          member& me = _members.find(_self)->second;
+          ++me.heartbeat;
+
+          uint64_t suspicion = suspicion_rounds();
+          bool changed = false;
+
+          for (auto it = _members.begin(); it != _members.end();) {
+            member& m = it->second;
+
+            if (it->first != _self) {
+              if (m.state == member_alive && m.detector.phi(now) > _phi_threshold) {
+                set_state(it->first, m, member_suspect);
+                changed = true;
+              }
+              else if (m.state == member_suspect && _rounds - m.since >= suspicion) {
+                set_state(it->first, m, member_dead);
+                changed = true;
+              }
+              else if (m.state == member_dead && _rounds - m.since >= dead_rounds) {
+                _sent.erase(it->first);
+                _seen.erase(it->first);
+                it = _members.erase(it);
+                continue;
+              }
+            }
+
+            ++it;
+          }
+
+          if (changed) publish();
+
+          select(targets, connects);
+
+          std::string heartbeats = pack_heartbeats();
+          for (uint32_t ip : targets) {
+            deltas.push_back(delta(ip));
+            deltas.back().heartbeats = heartbeats;
+          }
+        }
+
+        for (const std::string& ip : connects) inward_client_pool::ref().connect(ip);
+
+        for (size_t i = 0; i < targets.size(); ++i) send(targets[i], deltas[i]);
+      }
+
+      /*
+       * What a member pushes, merged into what we know. The merge does not depend on the order, so a delta is
+       * taken even after a gap, a push of the member lost, and the member is asked for the whole state
+       * */
+      void receive(uint32_t sender, const gossip_delta& d) {
+        bool gap = false;
+        {
+          std::lock_guard<std::mutex> guard(_mutex);
+
+          if (sender) {
+            auto seen = _seen.find(sender);
+            gap = d.from != 0 && (seen == _seen.end() || seen->second != d.from);
+            _seen[sender] = d.to;
+          }
+
+          merge(d.entries);
+          beat(d.heartbeats);
+        }
+
+        if (gap) {
+          ++_resyncs;
+          resync(sender);
+        }
+      }
+
+      // a member has missed a push of ours, it's sent the whole state
+      void resync_to(uint32_t ip) {
+        gossip_delta d;
+        {
+          std::lock_guard<std::mutex> guard(_mutex);
+          if (!_self || _leaving) return;
+
+          _sent.erase(ip);
+          d = delta(ip);
+          d.heartbeats = pack_heartbeats();
+        }
+
+        send(ip, d);
+      }
+
+      // this node leaves, it's gossiped dead by a new incarnation, and the death is never refuted, see net::drain
+      void leave() {
+        std::lock_guard<std::mutex> guard(_mutex);
+
+        _leaving = true;
+        if (!_self) return;
+
+        member& me = _members.find(_self)->second;
+        ++me.incarnation;
+        set_state(_self, me, member_dead);
+        publish();
+      }
+
+      // a member says it's leaving, it's taken dead before the gossip tells
+      void left(const std::string& ip) {
+        uint32_t addr = atlas::rpc::parse_ip(ip);
+
+        std::lock_guard<std::mutex> guard(_mutex);
+
+        auto it = _members.find(addr);
+        if (addr == _self || it == _members.end() || it->second.state == member_dead) return;
+
+        set_state(addr, it->second, member_dead);
+        publish();
+      }
+
+      size_t count(member_state state) const {
+        std::lock_guard<std::mutex> guard(_mutex);
+
+        size_t n = 0;
+        for (const auto& m : _members) if (m.second.state == state) ++n;
+        return n;
+      }
+
+      uint64_t rounds() const {
+        std::lock_guard<std::mutex> guard(_mutex);
+        return _rounds;
+      }
+
+      // a line a member : ip, state, incarnation, heartbeat, phi
+      std::string str() const {
+        std::lock_guard<std::mutex> guard(_mutex);
+
+        static const char* states[] = { "alive", "suspect", "dead" };
+        clock::time_point now = clock::now();
+
+        std::ostringstream os;
+        os << _members.size() << " members, round " << _rounds << ", version " << _version << "\n"
+            << "pushes : " << _full_pushes << " whole, " << _delta_pushes << " deltas, " << _entries_pushed
+            << " entries, " << _resyncs.load() << " resyncs asked\n";
+        for (const auto& m : _members) {
+          os << atlas::rpc::format_ip(m.first).c_str() << (m.first == _self ? " (self)" : "") << "\t"
+              << states[m.second.state] << "\t" << m.second.incarnation << "\t" << m.second.heartbeat << "\t"
+              << (m.first == _self ? 0.0 : m.second.detector.phi(now)) << "\n";
+        }
+
+        return os.str();
+      }
+
+    private:
+
+      // a push to a member, no response
+      void send(uint32_t ip, const gossip_delta& d);
+
+      // ask a member for the whole state, a push of it is lost
+      void resync(uint32_t ip);
+
+      // what a member knows, with the mutex held
+      void merge(const std::vector<gossip_entry>& entries) {
+        clock::time_point now = clock::now();
+        bool changed = false;
+
+        for (const gossip_entry& e : entries) {
+          if (!e.ip || e.state > member_dead) continue;
+          member_state state = static_cast<member_state>(e.state);
+
+          if (_self && e.ip == _self) {
+            refute(e);
+            continue;
+          }
+
+          auto it = _members.find(e.ip);
+          if (it == _members.end()) {
+            it = _members.insert(std::make_pair(e.ip, member(now, _interval))).first;
+            it->second.incarnation = e.incarnation;
+            it->second.heartbeat = e.heartbeat;
+            it->second.state = state;
+            it->second.since = _rounds;
+            it->second.changed = ++_version;
+            label(it->first, it->second, e);
+            changed = true;
+
+            continue;
+          }
+
+          member& m = it->second;
+          if (e.incarnation < m.incarnation) continue;
+
+          if (label(e.ip, m, e)) m.changed = ++_version;
+
+          if (e.heartbeat > m.heartbeat) {
+            m.heartbeat = e.heartbeat;
+            m.detector.heartbeat(now);
+          }
+
+          // a new incarnation refutes, or dies, the worse state wins in the same one
+          if (e.incarnation > m.incarnation || state > m.state) {
+            if (e.incarnation != m.incarnation) m.changed = ++_version;
+            m.incarnation = e.incarnation;
+            if (state != m.state) {
+              set_state(e.ip, m, state);
+              changed = true;
+            }
+          }
+        }
+
+        if (changed) publish();
+      }
+
+      // the heartbeats of the members known, with the mutex held
+      void beat(const std::string& heartbeats) {
+        clock::time_point now = clock::now();
+
+        for (size_t offset = 0; offset + sizeof(gossip_heartbeat) <= heartbeats.size(); offset += sizeof(gossip_heartbeat)) {
+          gossip_heartbeat h;
+          std::memcpy(&h, heartbeats.data() + offset, sizeof(h));
+          if (h.ip == _self) continue;
+
+          auto it = _members.find(h.ip);
+          if (it == _members.end() || h.heartbeat <= it->second.heartbeat) continue;
+
+          it->second.heartbeat = h.heartbeat;
+          it->second.detector.heartbeat(now);
+        }
+      }
+
+      // the members changed since the version last pushed to the member, all of them the first time
+      gossip_delta delta(uint32_t ip) {
+        gossip_delta d;
+
+        auto sent = _sent.find(ip);
+        d.from = sent == _sent.end() ? 0 : sent->second;
+        d.to = _version;
+
+        for (const auto& m : _members) {
+          if (d.from && m.second.changed <= d.from) continue;
+
+          const member& mm = m.second;
+          d.entries.push_back(gossip_entry { m.first, mm.incarnation, mm.heartbeat, static_cast<uint8_t>(mm.state), mm.zone, mm.rack });
+        }
+
+        _sent[ip] = _version;
+        ++(d.from ? _delta_pushes : _full_pushes);
+        _entries_pushed += d.entries.size();
+
+        return d;
+      }
+
+      // the members alive or suspected, this node's own heartbeat among them
+      std::string pack_heartbeats() const {
+        std::string heartbeats;
+        heartbeats.reserve(_members.size() * sizeof(gossip_heartbeat));
+
+        for (const auto& m : _members) {
+          if (m.second.state == member_dead) continue;
+
+          gossip_heartbeat h;
+          h.ip = m.first;
+          h.heartbeat = m.second.heartbeat;
+          heartbeats.append(reinterpret_cast<const char*>(&h), sizeof(h));
+        }
+
+        return heartbeats;
+      }
+
+      // the local ip is known once a connection is up
+      bool init_self() {
+        if (system::context::local_ip.empty()) return false;
+
+        _self = atlas::rpc::parse_ip(system::context::local_ip);
+        if (!_self) return false;
+
+        _members.erase(_self);
+        member& me = _members.insert(std::make_pair(_self, member(clock::now(), _interval))).first->second;
+        me.zone = locality::ref().self().zone;
+        me.rack = locality::ref().self().rack;
+        me.changed = ++_version;
+        publish();
+
+        return true;
+      }
+
+      // a suspicion or a death of our own, we outlive it with a new incarnation
+      void refute(const gossip_entry& e) {
+        member& me = _members.find(_self)->second;
+        if (_leaving || e.state == member_alive || e.incarnation < me.incarnation) return;
+
+        me.incarnation = e.incarnation + 1;
+        me.changed = ++_version;
+        LOG(WARNING) << "refute the " << (e.state == member_dead ? "death" : "suspicion") << " of this node, incarnation "
+            << me.incarnation;
+      }
+
+      // the labels a member is gossiped with, false if they're known
+      static bool label(uint32_t ip, member& m, const gossip_entry& e) {
+        if ((e.zone.empty() && e.rack.empty()) || (e.zone == m.zone && e.rack == m.rack)) return false;
+
+        m.zone = e.zone;
+        m.rack = e.rack;
+        locality::ref().set(ip, e.zone, e.rack);
+
+        return true;
+      }
+
+      void set_state(uint32_t ip, member& m, member_state state) {
+        static const char* states[] = { "alive", "suspect", "dead" };
+
+        LOG(INFO) << "inside node " << atlas::rpc::format_ip(ip).c_str() << " is " << states[state]
+            << ", incarnation " << m.incarnation;
+
+        m.state = state;
+        m.since = _rounds;
+        m.changed = ++_version;
+        if (state == member_dead) m.connecting = false;
+      }
+
+      // 3 * log2(N + 1) rounds, at least 3, about how long a suspicion takes to reach every member
+      uint64_t suspicion_rounds() const {
+        return std::max<uint64_t>(3, 3 * static_cast<uint64_t>(std::ceil(std::log2(_members.size() + 1.0))));
+      }
+
+      // the fanout members at random, the ones not connected yet are connected for the next rounds
+      // on an overlay, the neighbors connected, or any member while there is none, see net::overlay
+      void select(target_list& targets, connect_list& connects) {
+        atlas::small_vector<uint32_t, 64> candidates;
+
+        if (overlay::ref().enabled()) {
+          for (uint32_t ip : overlay::ref().neighbors()) {
+            auto it = _members.find(ip);
+            if (it != _members.end() && it->second.state != member_dead
+                && inward_connection_pool::ref().cached_get_by_ip(ip)) candidates.push_back(ip);
+          }
+        }
+
+        if (candidates.empty()) {
+          for (const auto& m : _members) {
+            if (m.first != _self && m.second.state != member_dead) candidates.push_back(m.first);
+          }
+        }
+
+        for (size_t i = 0; i < candidates.size() && targets.size() < _fanout; ++i) {
+          std::swap(candidates[i], candidates[i + static_cast<size_t>(std::rand()) % (candidates.size() - i)]);
+
+          uint32_t ip = candidates[i];
+          if (inward_connection_pool::ref().cached_get_by_ip(ip)) {
+            targets.push_back(ip);
+            continue;
+          }
+
+          member& m = _members.find(ip)->second;
+          if (!m.connecting) {
+            m.connecting = true;
+            connects.push_back(atlas::rpc::format_ip(ip).c_str());
+          }
+        }
+      }
+
+      // the alive and the suspected members are the inside nodes
+      void publish() {
+        std::set<std::string> ips;
+        for (const auto& m : _members) {
+          if (m.second.state != member_dead) ips.insert(atlas::rpc::format_ip(m.first).c_str());
+        }
+
+        if (ips == _published) return;
+
+        uint64_t version = system::context::inside_nodes.update([this, &ips](system::membership& m) {
+          for (const std::string& ip : _published) {
+            if (!ips.count(ip)) {
+              m.ip_list.erase(ip);
+              m.ring.remove(ip);
+            }
+          }
+
+          for (const std::string& ip : ips) {
+            if (!m.ip_list.count(ip)) {
+              m.ip_list.insert(ip);
+              m.ring.add(ip);
+            }
+          }
+        });
+
+        _published.swap(ips);
+        system::context::inner_node_count = _published.size();
+
+        LOG(INFO) << _published.size() << " inside nodes by gossip, version " << version;
+
+        std::set<uint32_t> members;
+        for (const auto& m : _members) {
+          if (m.second.state != member_dead) members.insert(m.first);
+        }
+        overlay::ref().update(_self, members);
+      }
+
+    private:
+
+      std::atomic<bool> _enabled;
+      double _interval;
+      size_t _fanout;
+      double _phi_threshold;
+
+      mutable std::mutex _mutex;
+      uint32_t _self;
+      uint64_t _rounds;
+      std::map<uint32_t, member> _members;
+      std::set<std::string> _published;
+      // the changes of the members, the version last pushed to a member, and the one last pushed by it
+      uint64_t _version;
+      std::map<uint32_t, uint64_t> _sent;
+      std::map<uint32_t, uint64_t> _seen;
+      bool _leaving;
+
+      uint64_t _full_pushes;
+      uint64_t _delta_pushes;
+      uint64_t _entries_pushed;
+      std::atomic<uint64_t> _resyncs;
+    };
+
+  } // net
+
+  namespace rpc {
+
+    using atlas::rpc::rpc_result;
+    using atlas::rpc::rpc_context;
+
+    // builtin rpc
+    ATLAS_REGISTER_REMOTE_FUNC(gossip_push, -10);
+    ATLAS_REGISTER_REMOTE_FUNC(gossip_resync, -19);
+
+    class gossip_rfc {
+    public:
+
+      // a member pushes us what it knows of the members changed
+      static rpc_result push(const net::gossip_delta& d, rpc_context c) noexcept {
+        net::gossip::ref().receive(c.empty() ? 0 : atlas::rpc::endpoint_ip(c.source()), d);
+        return nullptr;
+      }
+
+      // a member has missed a push of ours
+      static rpc_result resync(rpc_context c) noexcept {
+        if (!c.empty()) net::gossip::ref().resync_to(atlas::rpc::endpoint_ip(c.source()));
+        return nullptr;
+      }
+    };
+
+    ATLAS_BIND_REMOTE_FUNC(gossip_push, gossip_rfc::push);
+    ATLAS_BIND_REMOTE_FUNC(gossip_resync, gossip_rfc::resync);
+
+  } // rpc
+
+  namespace net {
+
+    inline void gossip::send(uint32_t ip, const gossip_delta& d) {
+      rpc::p2p_client client(rpc::inward_client, atlas::rpc::make_endpoint(ip, 0));
+      client.set_backpressure_policy(rpc::bp_fail_fast);
+
+      client.call(rpc::gossip_rfc::push, rpc::fn_ids::gossip_push, d, atlas::rpc::nilctx);
+    }
+
+    inline void gossip::resync(uint32_t ip) {
+      rpc::p2p_client client(rpc::inward_client, atlas::rpc::make_endpoint(ip, 0));
+      client.set_backpressure_policy(rpc::bp_fail_fast);
+
+      client.call(rpc::gossip_rfc::resync, rpc::fn_ids::gossip_resync, atlas::rpc::nilctx);
+    }
+
+  } // net
+} // pioneer
+
+#endif /* PIONEER_NET_GOSSIP_H_ */
@@ -0,0 +1,275 @@
+/*
+ * hedging.h
+ *
+ *  Created on: Sep 26, 2013
+ *      Author: vincent
+ */
+
+/*    Copyright 2011 ~ 2013 Vincent Zhang, ivincent.zhang@gmail.com
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#ifndef PIONEER_NET_HEDGING_H_
+#define PIONEER_NET_HEDGING_H_
+
+#include <cstdlib>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <glog/logging.h>
+#include <atlas/singleton.h>
+#include <atlas/rpc.h>
+#include <atlas/rpc/stats.h>
+#include <atlas/container/sharded_concurrent_box.h>
+
+#include <pioneer/system/context.h>
+#include <pioneer/net/rpc_clients.h>
+
+namespace pioneer {
+  namespace net {
+
+    /*
+     * The hedge delays of the functions, a percentile of the round trips of their hedged calls, the 95th by
+     * default, so about 1 of 20 calls is hedged. A round trip is from the call to the first response.
+     *
+     * The round trips are counted in windows of 1024, the delay is of the last full window, or of the current one
+     * once it has 64, and the default delay before. The hedges are capped at 1/10 of the hedged calls, so a slow
+     * cluster, where every call waits longer than the delay, is not loaded twice
+     * */
+    class hedge_delays : public atlas::singleton<hedge_delays> {
+    public:
+
+      typedef std::chrono::steady_clock clock;
+      typedef atlas::rpc::latency_histogram latency_histogram;
+
+      static const uint64_t window = 1024;
+      static const uint64_t min_samples = 64;
+
+    private:
+
+      friend class atlas::singleton<hedge_delays>;
+      hedge_delays(const hedge_delays&) = delete;
+      hedge_delays& operator=(const hedge_delays&) = delete;
+
+    public:
+
+      // public for std::make_shared, see atlas::singleton
+      hedge_delays() : _default_delay(std::chrono::milliseconds(10)), _percentile(0.95), _calls(0), _hedges(0) {}
+
+    public:
+
+      // before any call is made
+      void set_default_delay(clock::duration delay) { _default_delay = delay; }
+
+      void set_percentile(double q) { _percentile = q; }
+
+      void record(int fn_id, clock::duration round_trip) {
+        uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(round_trip).count();
+        entry_ptr e = get(fn_id);
+
+        std::lock_guard<std::mutex> guard(e->mutex);
+
+        latency_histogram& h = e->current;
+        ++h.counts[latency_histogram::index(ns)];
+        ++h.total;
+        h.sum += ns;
+        if (ns > h.max) h.max = ns;
+
+        if (h.total >= window) {
+          e->last = h;
+          h = latency_histogram();
+        }
+      }
+
+      clock::duration delay(int fn_id) {
+        entry_ptr e = get(fn_id);
+
+        std::lock_guard<std::mutex> guard(e->mutex);
+
+        const latency_histogram& h = e->last.total ? e->last : e->current;
+        if (h.total < min_samples) return _default_delay;
+
+        return std::chrono::nanoseconds(h.percentile(_percentile));
+      }
+
+      // a hedged call is made
+      void on_call() { _calls.fetch_add(1, std::memory_order_relaxed); }
+
+      // return false if the cap is reached
+      bool try_hedge() {
+        unsigned long long calls = _calls.load(std::memory_order_relaxed);
+        if ((_hedges.load(std::memory_order_relaxed) + 1) * 10 > calls) return false;
+
+        _hedges.fetch_add(1, std::memory_order_relaxed);
+        return true;
+      }
+
+      unsigned long long calls() const { return _calls.load(std::memory_order_relaxed); }
+      unsigned long long hedges() const { return _hedges.load(std::memory_order_relaxed); }
+
+    private:
+
+      struct entry {
+        std::mutex mutex;
+        latency_histogram current;
+        latency_histogram last;
+      };
+
+      typedef std::shared_ptr<entry> entry_ptr;
+
+      entry_ptr get(int fn_id) {
+        return _entries.get_or_put(fn_id, []() { return std::make_shared<entry>(); });
+      }
+
+    private:
+
+      clock::duration _default_delay;
+      double _percentile;
+
+      atlas::sharded_concurrent_box<int, entry_ptr> _entries;
+
+      std::atomic<unsigned long long> _calls;
+      std::atomic<unsigned long long> _hedges;
+    };
+
+  } // net
+
+  namespace rpc {
+
+    /*
+     * Hedged calls to a replicated service, for the idempotent reads only. A call goes to the first replica, and
+     * if no response arrives within the hedge delay of the function, see net::hedge_delays, the same message goes
+     * to the second replica. Both copies carry the session id of the call, so the first response completes it and
+     * the later one, even if it arrives at the same time on another thread, finds the task ready under it's mutex
+     * and is dropped, see async_task_manager::resume, the replica which loses still serves it.
+     *
+     * The replicas are the first two inside nodes from the key on the hash ring, or, without a key, two inside
+     * nodes at random. The hedge goes only to a replica connected and not congested, the hedge timers run in the
+     * base loop of the inward client pool.
+     *
+     * Only the calls with a callback are hedged, the other calls are sent to the first replica once
+     * */
+    class hedged_client : public atlas::rpc::remote_caller {
+    public:
+
+      typedef std::chrono::steady_clock clock;
+
+    public:
+
+      hedged_client() : atlas::rpc::remote_caller(client_type::inward_client), _fn_id(0), _hedged(false) {}
+
+      hedged_client(const std::string& key) : atlas::rpc::remote_caller(client_type::inward_client), _key(key),
+        _fn_id(0), _hedged(false) {}
+
+      virtual ~hedged_client() {}
+
+    public:
+
+      using atlas::rpc::remote_caller::call;
+
+      template<typename Functor, typename ... Args>
+      void call(Functor f, int fn_id, atlas::rpc::rpc_callback_type cb, Args ... args) {
+        clock::time_point start = clock::now();
+
+        atlas::rpc::rpc_callback_type timed = [cb, fn_id, start](const std::string& data, int err, atlas::rpc::async_task& task) {
+          if (!err) net::hedge_delays::ref().record(fn_id, clock::now() - start);
+          if (cb) cb(data, err, task);
+        };
+
+        _fn_id = fn_id;
+        _hedged = !batching();
+        atlas::rpc::remote_caller::call(f, fn_id, timed, std::forward<Args>(args)...);
+        _hedged = false;
+      }
+
+      virtual void send(const char* message, size_t size) {
+        std::vector<std::string> replicas = select();
+
+        net::pooled_connection_ptr conn = replicas.empty() ? nullptr : get(replicas[0]);
+        if (!conn) {
+          LOG(ERROR) << "no connection for the replicas of " << (_key.empty() ? "a random key" : _key);
+          reject(message, size, atlas::rpc::rpc_unreachable);
+          return;
+        }
+
+        if (_hedged && replicas.size() > 1) hedge(std::string(message, size), replicas[1]);
+
+        conn->send(message, size);
+      }
+
+    private:
+
+      std::vector<std::string> select() const {
+        std::shared_ptr<const system::membership> nodes = system::context::inside_nodes.get();
+        if (!_key.empty()) return nodes->ring.find(_key, 2);
+
+        std::vector<std::string> replicas;
+        if (nodes->ip_list.empty()) return replicas;
+
+        size_t n = nodes->ip_list.size();
+        size_t first = static_cast<size_t>(std::rand()) % n;
+        size_t second = n > 1 ? (first + 1 + static_cast<size_t>(std::rand()) % (n - 1)) % n : first;
+
+        size_t i = 0;
+        for (const std::string& ip : nodes->ip_list) {
+          if (i == first) replicas.insert(replicas.begin(), ip);
+          else if (i == second) replicas.push_back(ip);
+          ++i;
+        }
+
+        return replicas;
+      }
+
+      static net::pooled_connection_ptr get(const std::string& ip) {
+        net::pooled_connection_ptr conn = net::inward_connection_pool::ref().cached_get_by_ip(ip);
+        if (!conn || conn->congested()) return nullptr;
+
+        return conn;
+      }
+
+      // the message again to the other replica, unless the call is completed by then
+      void hedge(std::string&& message, const std::string& replica) {
+        net::hedge_delays& delays = net::hedge_delays::ref();
+        delays.on_call();
+
+        double seconds = std::chrono::duration<double>(delays.delay(_fn_id)).count();
+        std::shared_ptr<std::string> m = std::make_shared<std::string>(std::move(message));
+
+        net::inward_client_pool::ref().timers().run_after(seconds, [m, replica]() {
+          const atlas::rpc::uuid& id = atlas::rpc::message::get_session_id(m->data());
+          if (!atlas::rpc::async_task_manager::ref().pending(id)) return;
+          if (!net::hedge_delays::ref().try_hedge()) return;
+
+          net::pooled_connection_ptr conn = get(replica);
+          if (conn) conn->send(std::move(*m));
+        });
+      }
+
+    private:
+
+      std::string _key;
+
+      // the call being made, see call()
+      int _fn_id;
+      bool _hedged;
+    };
+
+  } // rpc
+} // pioneer
+
+#endif /* PIONEER_NET_HEDGING_H_ */
@@ -0,0 +1,217 @@
+/*
+ * housekeeping.h
+ *
+ *  Created on: Sep 28, 2013
+ *      Author: vincent
+ */
+
+/*    Copyright 2011 ~ 2013 Vincent Zhang, ivincent.zhang@gmail.com
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#ifndef PIONEER_NET_HOUSEKEEPING_H_
+#define PIONEER_NET_HOUSEKEEPING_H_
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+
+#include <glog/logging.h>
+#include <muduo/net/EventLoop.h>
+#include <atlas/singleton.h>
+
+#include <pioneer/net/loop_monitor.h>
+#include <pioneer/net/loop_timers.h>
+
+namespace pioneer {
+  namespace net {
+
+    /*
+     * The periodic jobs of the process, the sweeps of the expired calls and sessions, the stats, the gossip and
+     * the election rounds, run by one event loop of their own, on a timing wheel, see loop_timers, so no job owns a
+     * thread or sleeps in a worker, and the loops serving the requests never run them.
+     *
+     * A job is registered with a name and an interval, from any thread, before or after the loop runs, and runs
+     * in the loop until it's removed. The wheel ticks every 10ms and is armed only for the next job due, so the
+     * jobs due in the same tick run in one wakeup and an idle process wakes up only for them.
+     *
+     * The jobs are short, one of them delays the others while it runs, a long one posts it's work to the control
+     * pool. The runs and the time every job takes are kept, see str()
+     * */
+    class housekeeping : public atlas::singleton<housekeeping> {
+    public:
+
+      typedef std::function<void()> functor;
+      typedef std::chrono::steady_clock clock;
+
+      // the jobs are not precise to less than a tick
+      static clock::duration tick() { return std::chrono::milliseconds(10); }
+
+    private:
+
+      struct job {
+        job(const std::string& name, double interval, functor&& f) :
+          name(name), interval(interval), f(std::move(f)), runs(0), busy(0), max_busy(0) {}
+
+        std::string name;
+        double interval;
+        functor f;
+        loop_timers::timer_id timer;
+
+        std::atomic<uint64_t> runs;
+        // in microseconds
+        std::atomic<uint64_t> busy;
+        std::atomic<uint64_t> max_busy;
+      };
+
+      typedef std::shared_ptr<job> job_ptr;
+
+    private:
+
+      friend class atlas::singleton<housekeeping>;
+      housekeeping(const housekeeping&) = delete;
+      housekeeping& operator=(const housekeeping&) = delete;
+
+    public:
+
+      // public for std::make_shared, see atlas::singleton
+      housekeeping() : _loop(nullptr), _next_id(0) {}
+
+    public:
+
+      /*
+       * Run f every interval seconds in the loop, the first run is interval seconds later. The id removes it,
+       * see remove()
+       * */
+      size_t add(const std::string& name, double interval, functor f) {
+        job_ptr j = std::make_shared<job>(name, interval, std::move(f));
+
+        std::lock_guard<std::mutex> guard(_mutex);
+
+        size_t id = ++_next_id;
+        _jobs[id] = j;
+        if (_timers) schedule(j);
+
+        return id;
+      }
+
+      void remove(size_t id) {
+        std::lock_guard<std::mutex> guard(_mutex);
+
+        auto it = _jobs.find(id);
+        if (it == _jobs.end()) return;
+
+        if (_timers) _timers->cancel(it->second->timer);
+        _jobs.erase(it);
+      }
+
+      // run f once, delay seconds later, nothing if the loop is not running
+      void run_after(double delay, functor f) {
+        std::lock_guard<std::mutex> guard(_mutex);
+        if (_timers) _timers->run_after(delay, std::move(f));
+      }
+
+      // run the loop in the calling thread until quit(), the jobs added before start now
+      void run() {
+        std::shared_ptr<mn::EventLoop> loop = std::make_shared<mn::EventLoop>();
+        loop_registry::ref().add("housekeeping", loop);
+
+        {
+          std::lock_guard<std::mutex> guard(_mutex);
+
+          _loop = loop.get();
+          _timers.reset(new loop_timers(_loop, tick()));
+          for (const auto& j : _jobs) schedule(j.second);
+
+          LOG(INFO) << "housekeeping runs " << _jobs.size() << " jobs";
+        }
+
+        loop->loop();
+
+        // the timers go before the loop
+        std::lock_guard<std::mutex> guard(_mutex);
+        _timers.reset();
+        _loop = nullptr;
+      }
+
+      // thread safe
+      void quit() {
+        std::lock_guard<std::mutex> guard(_mutex);
+        if (_loop) _loop->quit();
+      }
+
+      bool running() const {
+        std::lock_guard<std::mutex> guard(_mutex);
+        return _loop != nullptr;
+      }
+
+      std::string str() const {
+        std::ostringstream os;
+
+        std::lock_guard<std::mutex> guard(_mutex);
+        os << "jobs : " << _jobs.size() << (_loop ? ", running" : ", not running") << "\n";
+        for (const auto& e : _jobs) {
+          const job& j = *e.second;
+
+          uint64_t runs = j.runs.load(std::memory_order_relaxed);
+          uint64_t busy = j.busy.load(std::memory_order_relaxed);
+
+          os << j.name << " : every " << j.interval << "s, " << runs << " runs, "
+              << (runs ? busy / runs : 0) << "us mean, " << j.max_busy.load(std::memory_order_relaxed) << "us max\n";
+        }
+
+        return os.str();
+      }
+
+    private:
+
+      // under the mutex, the timers are thread safe
+      void schedule(const job_ptr& j) {
+        std::weak_ptr<job> w = j;
+        j->timer = _timers->run_every(j->interval, [w]() {
+          job_ptr j = w.lock();
+          if (j) run_job(*j);
+        });
+      }
+
+      static void run_job(job& j) {
+        loop_busy_scope busy;
+        clock::time_point start = clock::now();
+
+        j.f();
+
+        uint64_t us = std::chrono::duration_cast<std::chrono::microseconds>(clock::now() - start).count();
+        j.runs.fetch_add(1, std::memory_order_relaxed);
+        j.busy.fetch_add(us, std::memory_order_relaxed);
+        if (us > j.max_busy.load(std::memory_order_relaxed)) j.max_busy.store(us, std::memory_order_relaxed);
+      }
+
+    private:
+
+      mutable std::mutex _mutex;
+      mn::EventLoop* _loop;
+      std::unique_ptr<loop_timers> _timers;
+      std::map<size_t, job_ptr> _jobs;
+      size_t _next_id;
+    };
+
+  } // net
+} // pioneer
+
+#endif /* PIONEER_NET_HOUSEKEEPING_H_ */
@@ -0,0 +1,470 @@
+/*
+ * http_gateway.h
+ *
+ *  Created on: Sep 28, 2013
+ *      Author: vincent
+ */
+
+/*    Copyright 2011 ~ 2013 Vincent Zhang, ivincent.zhang@gmail.com
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#ifndef PIONEER_NET_HTTP_GATEWAY_H_
+#define PIONEER_NET_HTTP_GATEWAY_H_
+
+#include <strings.h>
+
+#include <atomic>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+
+#include <boost/weak_ptr.hpp>
+#include <glog/logging.h>
+#include <muduo/net/Buffer.h>
+#include <muduo/net/EventLoop.h>
+#include <muduo/net/TcpConnection.h>
+#include <muduo/net/http/HttpResponse.h>
+#include <atlas/singleton.h>
+#include <atlas/rpc.h>
+#include <atlas/rpc/json.h>
+
+#include <pioneer/system/thread_pool.h>
+#include <pioneer/net/drain.h>
+#include <pioneer/net/fair_queue.h>
+#include <pioneer/net/ip.h>
+
+namespace pioneer {
+  namespace net {
+
+    namespace mn = muduo::net;
+
+    /*
+     * The clients which do not speak the binary frames call the functions by HTTP/1.1 on the outward port,
+     * POST /rpc/<name or id> with a JSON array of the arguments but the context, and get back
+     * {"error": <code>, "result": "<the result, serialized, base64>"}, the result is the bytes a binary client
+     * decodes, see typed_result, the function returns no type the gateway could write as JSON.
+     *
+     * A binary frame starts with it's length, and the length of "POST" or "GET " is far beyond the largest frame,
+     * so a connection is told by the first bytes of every read, see is_http, and both run on the same port.
+     *
+     * The requests are kept alive and pipelined, every complete request in a read is taken, the body is copied
+     * once, and parsed in situ in the worker, the arguments are decoded straight into the argument tuple of the
+     * function, see json_fn_invoker, so a function whose arguments are not of the JSON types, see
+     * json::decodable, is not served. The responses go back in the order of the requests, a response done
+     * early waits for the ones before it. A function which responds later, not by it's result, is answered 202.
+     *
+     * The quotas of the outward clients apply, see fair_queue, a draining node answers 503
+     * */
+    class http_gateway : public atlas::singleton<http_gateway> {
+    public:
+
+      // a pipeline deeper than this is answered 503
+      static const size_t max_pipeline = 128;
+      static const size_t max_header = 8 * 1024;
+
+    private:
+
+      // the responses of a connection, in the order of it's requests
+      struct session {
+        session(const mn::TcpConnectionPtr& conn) : conn(conn), next(0), sent(0) {}
+
+        boost::weak_ptr<mn::TcpConnection> conn;
+        uint64_t next;      // in the loop only
+
+        std::mutex mutex;
+        uint64_t sent;
+        std::map<uint64_t, std::pair<std::string, bool>> done;
+      };
+
+      typedef std::shared_ptr<session> session_ptr;
+
+      struct call {
+        session_ptr s;
+        uint64_t seq;
+        bool close;
+        atlas::rpc::endpoint_id source;
+        int fn_id;
+        std::string body;
+      };
+
+    private:
+
+      friend class atlas::singleton<http_gateway>;
+      http_gateway(const http_gateway&) = delete;
+      http_gateway& operator=(const http_gateway&) = delete;
+
+    public:
+
+      // public for std::make_shared, see atlas::singleton
+      http_gateway() : _enabled(false), _max_body(1024 * 1024), _requests(0), _errors(0) {}
+
+    public:
+
+      // before the servers start, the names of the functions are all registered by then
+      void configure(bool enabled, size_t max_body) {
+        _enabled = enabled;
+        _max_body = max_body;
+
+        atlas::rpc::fn_names::ref().for_each([this](int fn_id, const char* name) { _ids[name] = fn_id; });
+      }
+
+      bool enabled() const { return _enabled; }
+
+      // the bytes read start a HTTP request, not a binary frame
+      static bool is_http(const char* p, size_t size) {
+        if (size < 4) return false;
+
+        return std::memcmp(p, "POST", 4) == 0 || std::memcmp(p, "GET ", 4) == 0 || std::memcmp(p, "PUT ", 4) == 0
+            || std::memcmp(p, "HEAD", 4) == 0 || std::memcmp(p, "DELE", 4) == 0 || std::memcmp(p, "OPTI", 4) == 0;
+      }
+
+      // in the I/O loop, every complete request in the buffer is taken, a partial one is left for the next read
+      void on_message(const mn::TcpConnectionPtr& conn, mn::Buffer* buf) {
+        session_ptr s = session_of(conn);
+        atlas::rpc::endpoint_id source = ip::to_endpoint(conn->peerAddress().getSockAddrInet());
+
+        while (buf->readableBytes()) {
+          const char* begin = buf->peek();
+          size_t readable = buf->readableBytes();
+
+          const char* header_end = static_cast<const char*>(::memmem(begin, std::min(readable, max_header), "\r\n\r\n", 4));
+          if (!header_end) {
+            if (readable >= max_header) reject(conn, buf, s, 431, "the header is too large");
+            return;
+          }
+          header_end += 4;
+
+          std::string method, path;
+          size_t length = 0;
+          bool close = false, chunked = false;
+          if (!parse_header(begin, header_end, method, path, length, close, chunked)) {
+            reject(conn, buf, s, 400, "bad request");
+            return;
+          }
+          if (chunked) {
+            reject(conn, buf, s, 501, "the chunked bodies are not taken");
+            return;
+          }
+          if (length > _max_body) {
+            reject(conn, buf, s, 413, "the body is too large");
+            return;
+          }
+
+          size_t total = (header_end - begin) + length;
+          if (readable < total) return;
+
+          _requests.fetch_add(1, std::memory_order_relaxed);
+          uint64_t seq = s->next++;
+
+          int fn_id = 0;
+          if (method != "POST" || path.compare(0, 5, "/rpc/") != 0) {
+            respond(s, seq, 404, error_body("POST /rpc/<function> only"), close);
+          }
+          else if (!find_id(path.substr(5), fn_id)) {
+            respond(s, seq, 404, error_body("no function " + path.substr(5)), close);
+          }
+          else if (drain::ref().draining()) {
+            respond(s, seq, 503, error_body("the node is draining"), close);
+          }
+          else if (seq - sent(*s) >= max_pipeline) {
+            respond(s, seq, 503, error_body("too many requests in the pipeline"), close);
+          }
+          else if (!fair_queue::ref().admit(fair_queue::ref().client_of(source))) {
+            respond(s, seq, 503, error_body("over the quota"), close);
+          }
+          else {
+            std::shared_ptr<call> c = std::make_shared<call>();
+            c->s = s;
+            c->seq = seq;
+            c->close = close;
+            c->source = source;
+            c->fn_id = fn_id;
+            c->body.assign(header_end, length);
+
+            atlas::adaptive_thread_pool::task_type task(std::bind(&http_gateway::run, this, c));
+            if (!system::worker_pool::ref().schedule(std::move(task))) {
+              respond(s, seq, 503, error_body("the node is busy"), close);
+            }
+          }
+
+          buf->retrieve(total);
+          if (close) {
+            buf->retrieveAll();
+            return;
+          }
+        }
+      }
+
+      // the connection went down
+      void erase(const mn::TcpConnectionPtr& conn) {
+        std::lock_guard<std::mutex> guard(_mutex);
+        _sessions.erase(conn.get());
+      }
+
+      unsigned long long requests() const { return _requests.load(std::memory_order_relaxed); }
+
+      unsigned long long errors() const { return _errors.load(std::memory_order_relaxed); }
+
+      std::string str() const {
+        std::ostringstream os;
+        os << "gateway : " << (_enabled ? "on" : "off") << "\n"
+            << "requests : " << requests() << "\n"
+            << "errors : " << errors() << "\n";
+
+        std::lock_guard<std::mutex> guard(_mutex);
+        os << "connections : " << _sessions.size() << "\n";
+
+        return os.str();
+      }
+
+    private:
+
+      session_ptr session_of(const mn::TcpConnectionPtr& conn) {
+        std::lock_guard<std::mutex> guard(_mutex);
+
+        session_ptr& s = _sessions[conn.get()];
+        if (!s) s = std::make_shared<session>(conn);
+        return s;
+      }
+
+      static uint64_t sent(session& s) {
+        std::lock_guard<std::mutex> guard(s.mutex);
+        return s.sent;
+      }
+
+      bool find_id(const std::string& name, int& fn_id) const {
+        auto it = _ids.find(name);
+        if (it != _ids.end()) {
+          fn_id = it->second;
+          return true;
+        }
+
+        // or by the id
+        char* end = nullptr;
+        long id = std::strtol(name.c_str(), &end, 10);
+        if (name.empty() || *end || !atlas::rpc::fn_table::ref().find(static_cast<int>(id))) return false;
+
+        fn_id = static_cast<int>(id);
+        return true;
+      }
+
+      static bool parse_header(const char* p, const char* end, std::string& method, std::string& path,
+          size_t& length, bool& close, bool& chunked) {
+        const char* eol = static_cast<const char*>(::memmem(p, end - p, "\r\n", 2));
+        const char* sp1 = static_cast<const char*>(std::memchr(p, ' ', eol - p));
+        if (!sp1) return false;
+        const char* sp2 = static_cast<const char*>(std::memchr(sp1 + 1, ' ', eol - sp1 - 1));
+        if (!sp2) return false;
+
+        method.assign(p, sp1);
+        path.assign(sp1 + 1, sp2);
+        std::string version(sp2 + 1, eol);
+        if (version.compare(0, 5, "HTTP/") != 0) return false;
+
+        // HTTP/1.0 closes unless it's kept alive
+        bool keep_alive = version != "HTTP/1.0";
+
+        for (p = eol + 2; p < end - 2; p = eol + 2) {
+          eol = static_cast<const char*>(::memmem(p, end - p, "\r\n", 2));
+          const char* colon = static_cast<const char*>(std::memchr(p, ':', eol - p));
+          if (!colon) return false;
+
+          std::string name(p, colon);
+          const char* v = colon + 1;
+          while (v < eol && (*v == ' ' || *v == '\t')) ++v;
+          std::string value(v, eol);
+
+          if (::strcasecmp(name.c_str(), "Content-Length") == 0) {
+            char* e = nullptr;
+            unsigned long long n = std::strtoull(value.c_str(), &e, 10);
+            if (value.empty() || *e) return false;
+            length = static_cast<size_t>(n);
+          }
+          else if (::strcasecmp(name.c_str(), "Connection") == 0) {
+            if (::strcasecmp(value.c_str(), "close") == 0) keep_alive = false;
+            else if (::strcasecmp(value.c_str(), "keep-alive") == 0) keep_alive = true;
+          }
+          else if (::strcasecmp(name.c_str(), "Transfer-Encoding") == 0) {
+            chunked = ::strcasecmp(value.c_str(), "identity") != 0;
+          }
+        }
+
+        close = !keep_alive;
+        return true;
+      }
+
+      // a bad request ends the connection, it's bytes can not be told from the next request's
+      void reject(const mn::TcpConnectionPtr&, mn::Buffer* buf, const session_ptr& s, int status, const std::string& why) {
+        _requests.fetch_add(1, std::memory_order_relaxed);
+        respond(s, s->next++, status, error_body(why), true);
+        buf->retrieveAll();
+      }
+
+      // in the worker
+      void run(const std::shared_ptr<call>& c) {
+        atlas::rpc::json::document d;
+        if (!d.parse(c->body.data(), c->body.size())) {
+          respond(c->s, c->seq, 400, error_body("bad JSON, " + d.error()), c->close);
+          return;
+        }
+
+        atlas::rpc::fn_table& table = atlas::rpc::fn_table::ref();
+        atlas::rpc::json_invoker_type invoker = table.find_json(c->fn_id);
+        if (!invoker) {
+          respond(c->s, c->seq, 415, error_body("the arguments of the function are not JSON types"), c->close);
+          return;
+        }
+
+        // no response is sent by the dispatcher, the result goes back here
+        atlas::rpc::rpc_context context(0, atlas::rpc::rpc_async_no_callback, atlas::rpc::nil_uuid(), c->source);
+        atlas::rpc::rpc_result result(nullptr);
+
+        try {
+          atlas::rpc::rpc_stats::timer timer(c->fn_id);
+          if (!invoker(d, d.root(), context, result)) {
+            respond(c->s, c->seq, 400, error_body("the arguments do not match the function"), c->close);
+            return;
+          }
+          timer.finish();
+        }
+        catch (const std::exception& e) {
+          respond(c->s, c->seq, 500, error_body(e.what()), c->close);
+          return;
+        }
+
+        if (!result) {
+          respond(c->s, c->seq, 202, "{\"deferred\":true}", c->close);
+          return;
+        }
+
+        std::string body = "{\"error\":" + std::to_string(result.err()) + ",\"result\":\"";
+        append_base64(body, result.data());
+        body += "\"}";
+
+        respond(c->s, c->seq, 200, body, c->close);
+      }
+
+      static std::string error_body(const std::string& why) {
+        std::string body = "{\"error\":";
+        atlas::rpc::json::append_string(body, why.data(), why.size());
+        body += '}';
+
+        return body;
+      }
+
+      static void append_base64(std::string& out, const std::string& in) {
+        static const char table[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+        const unsigned char* p = reinterpret_cast<const unsigned char*>(in.data());
+        size_t n = in.size(), i = 0;
+        out.reserve(out.size() + (n + 2) / 3 * 4);
+
+        for (; i + 3 <= n; i += 3) {
+          uint32_t v = (p[i] << 16) | (p[i + 1] << 8) | p[i + 2];
+          out += table[v >> 18];
+          out += table[(v >> 12) & 0x3f];
+          out += table[(v >> 6) & 0x3f];
+          out += table[v & 0x3f];
+        }
+
+        if (i < n) {
+          uint32_t v = p[i] << 16;
+          if (i + 1 < n) v |= p[i + 1] << 8;
+
+          out += table[v >> 18];
+          out += table[(v >> 12) & 0x3f];
+          out += i + 1 < n ? table[(v >> 6) & 0x3f] : '=';
+          out += '=';
+        }
+      }
+
+      static const char* reason(int status) {
+        switch (status) {
+        case 200: return "OK";
+        case 202: return "Accepted";
+        case 400: return "Bad Request";
+        case 404: return "Not Found";
+        case 413: return "Payload Too Large";
+        case 415: return "Unsupported Media Type";
+        case 431: return "Request Header Fields Too Large";
+        case 500: return "Internal Server Error";
+        case 501: return "Not Implemented";
+        default: return "Service Unavailable";
+        }
+      }
+
+      /*
+       * From any thread, the response waits for the ones before it, the ones in order are sent at once. They are
+       * always posted to the loop, so a response done in the loop does not pass the ones posted by the workers
+       * */
+      void respond(const session_ptr& s, uint64_t seq, int status, const std::string& body, bool close) {
+        if (status >= 400) _errors.fetch_add(1, std::memory_order_relaxed);
+
+        mn::HttpResponse response(close);
+        response.setStatusCode(static_cast<mn::HttpResponse::HttpStatusCode>(status));
+        response.setStatusMessage(reason(status));
+        response.setContentType("application/json");
+        response.setBody(body);
+
+        mn::Buffer out;
+        response.appendToBuffer(&out);
+        std::string bytes(out.peek(), out.readableBytes());
+
+        mn::TcpConnectionPtr conn = s->conn.lock();
+        if (!conn) return;
+
+        std::lock_guard<std::mutex> guard(s->mutex);
+        s->done[seq] = std::make_pair(std::move(bytes), close);
+
+        std::shared_ptr<std::string> batch = std::make_shared<std::string>();
+        bool closing = false;
+        for (auto it = s->done.begin(); it != s->done.end() && it->first == s->sent; it = s->done.erase(it)) {
+          *batch += it->second.first;
+          closing = closing || it->second.second;
+          ++s->sent;
+        }
+
+        if (batch->empty()) return;
+
+        conn->getLoop()->queueInLoop([conn, batch, closing]() {
+          conn->send(batch->data(), batch->size());
+          if (closing) conn->shutdown();
+        });
+      }
+
+    private:
+
+      bool _enabled;
+      size_t _max_body;
+      std::unordered_map<std::string, int> _ids;
+
+      mutable std::mutex _mutex;
+      std::unordered_map<const mn::TcpConnection*, session_ptr> _sessions;
+
+      std::atomic<unsigned long long> _requests;
+      std::atomic<unsigned long long> _errors;
+    };
+
+  } // net
+} // pioneer
+
+#endif /* PIONEER_NET_HTTP_GATEWAY_H_ */
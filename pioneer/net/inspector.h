@@ -0,0 +1,530 @@
+/*
+ * inspector.h
+ *
+ *  Created on: Sep 6, 2013
+ *      Author: vincent
+ */
+
+/*    Copyright 2011 ~ 2013 Vincent Zhang, ivincent.zhang@gmail.com
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#ifndef PIONEER_NET_INSPECTOR_H_
+#define PIONEER_NET_INSPECTOR_H_
+
+#include <dirent.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cctype>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <boost/algorithm/string.hpp>
+#include <boost/lexical_cast.hpp>
+#include <muduo/net/http/HttpRequest.h>
+#include <muduo/net/http/HttpResponse.h>
+#include <atlas/singleton.h>
+#include <atlas/rpc.h>
+#include <atlas/rpc/stats.h>
+#include <atlas/rpc/trace.h>
+#include <atlas/rpc/slow_log.h>
+#include <atlas/memory/jemalloc.h>
+#include <atlas/trace_scope.h>
+
+#include <pioneer/system/thread_pool.h>
+#include <pioneer/system/admission.h>
+#include <pioneer/system/profiler.h>
+#include <pioneer/system/runtime_config.h>
+#include <pioneer/net/frame_chunks.h>
+#include <pioneer/net/gossip.h>
+#include <pioneer/net/call_batches.h>
+#include <pioneer/net/fair_queue.h>
+#include <pioneer/net/fast_open.h>
+#include <pioneer/net/housekeeping.h>
+#include <pioneer/net/http_gateway.h>
+#include <pioneer/net/leader.h>
+#include <pioneer/net/local_delivery.h>
+#include <pioneer/net/mcast_dedupe.h>
+#include <pioneer/net/net.h>
+#include <pioneer/net/request.h>
+#include <pioneer/net/rx_timestamps.h>
+#include <pioneer/net/loop_monitor.h>
+#include <pioneer/net/offload.h>
+#include <pioneer/net/traffic_capture.h>
+
+namespace pioneer {
+  namespace net {
+
+    /*
+     * The live diagnosis of the node, the commands are served by the report server as /module/command/arg...,
+     * or /module/command?name=value&..., the query parameters follow the path arguments,
+     * and /help lists them all, like muduo::net::Inspector, which runs it's own HTTP server and is not built in
+     * our muduo, so the commands share the report server here. The process commands are the ones of
+     * muduo::net::ProcessInspector, in the module proc.
+     *
+     * The commands are called in the report server's thread, they must not block
+     * */
+    class inspector : public atlas::singleton<inspector> {
+    public:
+
+      typedef std::vector<std::string> arg_list;
+      typedef std::function<std::string(mn::HttpRequest::Method, const arg_list&)> callback;
+
+    private:
+
+      friend class atlas::singleton<inspector>;
+      inspector(const inspector&) = delete;
+      inspector& operator=(const inspector&) = delete;
+
+      struct command {
+        callback cb;
+        std::string help;
+      };
+
+    public:
+
+      inspector() { register_process_commands(); }
+
+    public:
+
+      void add(const std::string& module, const std::string& name, const callback& cb, const std::string& help) {
+        std::lock_guard<std::mutex> guard(_mutex);
+
+        command& c = _modules[module][name];
+        c.cb = cb;
+        c.help = help;
+      }
+
+      // return false if the request is not a command, it's handled by others then
+      bool handle(const mn::HttpRequest& request, mn::HttpResponse* response) {
+        std::string path(request.path().data(), request.path().size());
+
+        // the query parameters are the arguments after the path ones, see detail::find_arg
+        std::string query;
+        size_t q = path.find('?');
+        if (q != std::string::npos) {
+          query = path.substr(q + 1);
+          path.resize(q);
+        }
+
+        arg_list args;
+        boost::split(args, path, boost::is_any_of("/"), boost::token_compress_on);
+        args.erase(std::remove(args.begin(), args.end(), std::string()), args.end());
+
+        if (args.size() == 1 && args[0] == "help") {
+          respond(response, help());
+          return true;
+        }
+
+        callback cb;
+        {
+          std::lock_guard<std::mutex> guard(_mutex);
+
+          auto m = args.empty() ? _modules.end() : _modules.find(args[0]);
+          if (m == _modules.end()) return false;
+
+          if (args.size() < 2 || m->second.find(args[1]) == m->second.end()) {
+            respond(response, help(m->first));
+            return true;
+          }
+
+          cb = m->second.find(args[1])->second.cb;
+        }
+
+        args.erase(args.begin(), args.begin() + 2);
+
+        if (!query.empty()) {
+          arg_list params;
+          boost::split(params, query, boost::is_any_of("&"), boost::token_compress_on);
+          for (const std::string& p : params) if (!p.empty()) args.push_back(p);
+        }
+
+        try {
+          respond(response, cb(request.method(), args));
+        }
+        catch (const std::exception& e) {
+          respond(response, std::string("error : ") + e.what() + "\n");
+        }
+
+        return true;
+      }
+
+    private:
+
+      std::string help(const std::string& module = "") const {
+        std::lock_guard<std::mutex> guard(_mutex);
+
+        std::ostringstream os;
+        for (const auto& m : _modules) {
+          if (!module.empty() && m.first != module) continue;
+
+          for (const auto& c : m.second) {
+            os << "/" << m.first << "/" << c.first << "\t" << c.second.help << "\n";
+          }
+        }
+
+        return os.str();
+      }
+
+      static void respond(mn::HttpResponse* response, const std::string& body) {
+        response->setStatusCode(mn::HttpResponse::k200Ok);
+        response->setStatusMessage("OK");
+        response->setContentType("text/plain");
+        response->setBody(muduo::string(body.data(), body.size()));
+      }
+
+      void register_process_commands() {
+        add("proc", "pid", [](mn::HttpRequest::Method, const arg_list&) {
+          return boost::lexical_cast<std::string>(::getpid()) + "\n";
+        }, "print pid");
+
+        add("proc", "status", [](mn::HttpRequest::Method, const arg_list&) {
+          return read_file("/proc/self/status");
+        }, "print /proc/self/status");
+
+        add("proc", "opened_files", [](mn::HttpRequest::Method, const arg_list&) {
+          return boost::lexical_cast<std::string>(list_dir("/proc/self/fd").size()) + "\n";
+        }, "count /proc/self/fd");
+
+        add("proc", "threads", [](mn::HttpRequest::Method, const arg_list&) {
+          std::ostringstream os;
+          for (const std::string& tid : list_dir("/proc/self/task")) {
+            os << tid << "\t" << read_file("/proc/self/task/" + tid + "/comm");
+          }
+          return os.str();
+        }, "list /proc/self/task");
+      }
+
+      static std::string read_file(const std::string& name) {
+        std::ifstream in(name.c_str());
+        std::ostringstream os;
+        os << in.rdbuf();
+
+        return os.str();
+      }
+
+      static std::vector<std::string> list_dir(const std::string& name) {
+        std::vector<std::string> entries;
+
+        DIR* dir = ::opendir(name.c_str());
+        if (!dir) return entries;
+
+        while (struct dirent* e = ::readdir(dir)) {
+          if (e->d_name[0] != '.') entries.push_back(e->d_name);
+        }
+        ::closedir(dir);
+
+        std::sort(entries.begin(), entries.end());
+        return entries;
+      }
+
+    private:
+
+      mutable std::mutex _mutex;
+      std::map<std::string, std::map<std::string, command>> _modules;
+    };
+
+    namespace detail {
+
+      template<typename Pool>
+      void dump_connection_pool(std::ostream& os, const char* name, const Pool& pool) {
+        std::vector<pooled_connection_ptr> connections = pool.connections();
+
+        os << name << " : " << connections.size() << " connections, " << pool.peer_count() << " peers\n";
+        for (const pooled_connection_ptr& c : connections) {
+          os << "  " << c->connection()->peerAddress().toIpPort().c_str()
+              << "\tin flight " << c->in_flight()
+              << "\tpending bytes " << c->pending_bytes()
+              << "\tframes " << c->output().frames() << " in " << c->output().writes() << " sends, "
+              << c->output().chunks() << " chunks, " << c->output().files() << " from files, "
+              << c->output().file_slices() << " slices copied"
+              << "\tdrain latency " << std::chrono::duration_cast<std::chrono::microseconds>(
+                  pooled_connection::clock::duration(c->latency())).count() << "us"
+              << (c->congested() ? "\tcongested" : "") << "\n";
+        }
+      }
+
+      template<typename Pool>
+      void dump_thread_pool(std::ostream& os, const char* name, const Pool& pool) {
+        os << name << " pool : " << pool.size() << " threads, " << pool.active() << " active, "
+            << pool.pending_tasks() << " pending\n";
+      }
+
+      // the value of the argument name=value, or the default
+      inline std::string find_arg(const inspector::arg_list& args, const std::string& name, const std::string& def) {
+        for (const std::string& a : args) {
+          if (a.size() > name.size() && a.compare(0, name.size(), name) == 0 && a[name.size()] == '=') {
+            return a.substr(name.size() + 1);
+          }
+        }
+
+        return def;
+      }
+
+      // the printable characters as they are, the others in hex
+      inline std::string escape(const std::string& data) {
+        static const char digits[] = "0123456789abcdef";
+
+        std::string s;
+        for (unsigned char c : data) {
+          if (std::isprint(c) && c != '\\') {
+            s.push_back(c);
+          }
+          else {
+            s += "\\x";
+            s.push_back(digits[c >> 4]);
+            s.push_back(digits[c & 0xf]);
+          }
+        }
+
+        return s;
+      }
+
+    } // detail
+
+    // the commands of the module pioneer, called once the report server starts
+    inline void register_inspector_commands() {
+      typedef inspector::arg_list arg_list;
+      inspector& ins = inspector::ref();
+
+      // the profiles of the last seconds, see system::profiler, "pprof binary profile" reads them
+      ins.add("pprof", "profile", [](mn::HttpRequest::Method, const arg_list& args) {
+        system::profiler& p = system::profiler::instance();
+        if (!p.running()) throw std::runtime_error("the profiler is off, see PROFILER_HZ");
+
+        size_t seconds = boost::lexical_cast<size_t>(detail::find_arg(args, "seconds", "30"));
+        return p.profile(seconds, detail::find_arg(args, "thread", ""));
+      }, "the CPU profile of the last seconds, ?seconds=30&thread=worker, the threads are told by /pprof/threads");
+
+      ins.add("pprof", "threads", [](mn::HttpRequest::Method, const arg_list& args) {
+        size_t seconds = boost::lexical_cast<size_t>(detail::find_arg(args, "seconds", "30"));
+
+        std::ostringstream os;
+        os << system::profiler::instance().samples() << " samples, " << system::profiler::instance().lost() << " lost\n";
+        for (const auto& r : system::profiler::instance().roles(seconds)) os << r.first << "\t" << r.second << "\n";
+        return os.str();
+      }, "the samples of the last seconds per thread role, ?seconds=30");
+
+      ins.add("pprof", "heap", [](mn::HttpRequest::Method, const arg_list&) {
+        return system::profiler::heap();
+      }, "the statistics of the heap, see malloc_info(3)");
+
+      ins.add("pioneer", "pools", [](mn::HttpRequest::Method, const arg_list&) {
+        std::ostringstream os;
+        detail::dump_connection_pool(os, "outward", outward_connection_pool::ref());
+        detail::dump_connection_pool(os, "inward", inward_connection_pool::ref());
+        os << "inward clients : " << inward_client_pool::ref().size() << "\n";
+        return os.str();
+      }, "dump the connection pools");
+
+      ins.add("pioneer", "sessions", [](mn::HttpRequest::Method, const arg_list&) {
+        return boost::lexical_cast<std::string>(session_manager::ref().size()) + " sessions\n";
+      }, "count the sessions");
+
+      ins.add("pioneer", "tasks", [](mn::HttpRequest::Method, const arg_list&) {
+        std::ostringstream os;
+        os << "sync calls : " << atlas::rpc::sync_task_manager::ref().size() << " pending\n"
+            << "async calls : " << atlas::rpc::async_task_manager::ref().size() << " pending\n";
+        detail::dump_thread_pool(os, "worker", system::worker_pool::ref());
+        detail::dump_thread_pool(os, "control", system::control_pool::ref());
+        os << "shed requests : " << system::admission_control::ref().shed() << "\n";
+        return os.str();
+      }, "dump the pending calls and tasks");
+
+      ins.add("pioneer", "hot_fns", [](mn::HttpRequest::Method, const arg_list& args) {
+        size_t top = args.empty() ? 10 : boost::lexical_cast<size_t>(args[0]);
+
+        std::map<int, atlas::rpc::fn_latency> stats = atlas::rpc::rpc_stats::instance().collect();
+        std::vector<std::pair<uint64_t, int>> calls;
+        for (const auto& fn : stats) calls.push_back(std::make_pair(fn.second.stages[atlas::rpc::stage_handler].total, fn.first));
+
+        std::sort(calls.begin(), calls.end(), std::greater<std::pair<uint64_t, int>>());
+        if (calls.size() > top) calls.resize(top);
+
+        std::ostringstream os;
+        os << "fn id\tcalls\thandler p50/p99/max (us)\tqueue wait p99 (us)\treceive p99 (us)\n";
+        for (const auto& c : calls) {
+          const atlas::rpc::fn_latency& l = stats[c.second];
+          const atlas::rpc::latency_histogram& h = l.stages[atlas::rpc::stage_handler];
+
+          os << c.second << "\t" << c.first << "\t" << h.percentile(0.5) / 1000.0 << " / " << h.percentile(0.99) / 1000.0
+              << " / " << h.max / 1000.0 << "\t" << l.stages[atlas::rpc::stage_queue_wait].percentile(0.99) / 1000.0
+              << "\t" << l.stages[atlas::rpc::stage_receive].percentile(0.99) / 1000.0 << "\n";
+        }
+        return os.str();
+      }, "the most called functions, /pioneer/hot_fns/[top]");
+
+      ins.add("pioneer", "traces", [](mn::HttpRequest::Method, const arg_list& args) {
+        size_t max = args.empty() ? 1000 : boost::lexical_cast<size_t>(args[0]);
+
+        // the spans taken are gone, the exporters and the readers share the ring
+        std::vector<atlas::rpc::span> spans;
+        atlas::rpc::tracer::instance().drain(spans, max);
+
+        std::ostringstream os;
+        os << "trace id\tspan id\tparent span id\tfn id\tstart (us)\tduration (us)\n";
+        for (const atlas::rpc::span& s : spans) {
+          os << std::hex << s.trace_id << "\t" << s.span_id << "\t" << s.parent_span_id << "\t" << std::dec
+              << s.fn_id << "\t" << s.start << "\t" << s.duration / 1000.0 << "\n";
+        }
+        return os.str();
+      }, "take the sampled spans recorded, /pioneer/traces/[max]");
+
+      // a file for chrome://tracing or Perfetto, the scopes of every thread as a flame chart
+      ins.add("pioneer", "scopes", [](mn::HttpRequest::Method, const arg_list&) {
+        atlas::scope_tracer& t = atlas::scope_tracer::instance();
+        if (!t.enabled()) throw std::runtime_error("the scopes are not recorded, see the setting trace_scopes");
+
+        return t.dump();
+      }, "the scopes timed by ATLAS_TRACE_SCOPE lately, in the trace event format");
+
+      ins.add("pioneer", "slow_requests", [](mn::HttpRequest::Method, const arg_list&) {
+        std::vector<atlas::rpc::slow_request> requests = atlas::rpc::slow_request_log::instance().collect();
+
+        std::ostringstream os;
+        os << atlas::rpc::slow_request_log::instance().total() << " slow requests, the latest " << requests.size() << " :\n";
+        for (const atlas::rpc::slow_request& r : requests) {
+          os << r.time << "\tfn id " << r.fn_id << "\tsession " << r.session_id << "\tfrom "
+              << atlas::rpc::format_endpoint(r.source).c_str();
+          for (int s = 0; s < atlas::rpc::rpc_stage_count; ++s) {
+            os << "\t" << atlas::rpc::stage_name(s) << " " << r.stages[s] / 1000.0 << "us";
+          }
+          if (!r.arguments.empty()) os << "\targuments " << detail::escape(r.arguments);
+          os << "\n";
+        }
+        return os.str();
+      }, "dump the requests slower than the threshold");
+
+      ins.add("pioneer", "loops", [](mn::HttpRequest::Method, const arg_list&) {
+        std::ostringstream os;
+        for (const loop_registry::entry_type& e : loop_registry::ref().loops()) {
+          std::shared_ptr<void> owner = e.owner.lock();
+          if (!owner) continue;
+
+          os << e.monitor->name() << "\tutilization " << e.monitor->utilization()
+              << "\tevents per iteration " << e.monitor->events_per_iteration()
+              << "\tpending functors " << e.monitor->pending_functors() << "\n";
+        }
+        return os.str();
+      }, "dump the event loops");
+
+      ins.add("pioneer", "housekeeping", [](mn::HttpRequest::Method, const arg_list&) {
+        return housekeeping::ref().str();
+      }, "the periodic jobs, their runs and the time they take");
+
+      ins.add("pioneer", "allocator", [](mn::HttpRequest::Method, const arg_list&) {
+        return atlas::memory::role_arenas::ref().str();
+      }, "the heap of jemalloc, fragmentation and the arenas of the thread roles");
+
+      ins.add("pioneer", "http_gateway", [](mn::HttpRequest::Method, const arg_list&) {
+        return http_gateway::ref().str();
+      }, "the calls by HTTP/JSON on the outward port");
+
+      ins.add("pioneer", "fast_open", [](mn::HttpRequest::Method, const arg_list&) {
+        return fast_open::ref().str();
+      }, "TCP Fast Open of the outward listeners, and the counters of the kernel");
+
+      ins.add("pioneer", "rx_timestamps", [](mn::HttpRequest::Method, const arg_list&) {
+        return rx_timestamps::ref().str();
+      }, "the receive timestamps of the kernel, the datagrams stamped and not");
+
+      ins.add("pioneer", "call_batches", [](mn::HttpRequest::Method, const arg_list&) {
+        return call_batches::ref().str();
+      }, "the requests run together by the batch handlers, the batches and the queued ones");
+
+      ins.add("pioneer", "fair_queue", [](mn::HttpRequest::Method, const arg_list&) {
+        return fair_queue::ref().str();
+      }, "the quotas and the fair queueing of the outward clients, the busiest ones");
+
+      ins.add("pioneer", "members", [](mn::HttpRequest::Method, const arg_list&) -> std::string {
+        if (!gossip::ref().enabled()) return "the gossip is off\n";
+
+        return gossip::ref().str();
+      }, "dump the members known by gossip, ip, state, incarnation, heartbeat and phi");
+
+      ins.add("pioneer", "overlay", [](mn::HttpRequest::Method, const arg_list&) -> std::string {
+        if (!overlay::ref().enabled()) return "the inward connections are a full mesh\n";
+
+        return overlay::ref().str();
+      }, "dump the members reachable on the overlay, and the neighbor to each");
+
+      ins.add("pioneer", "local", [](mn::HttpRequest::Method, const arg_list&) -> std::string {
+        return local_delivery::ref().str();
+      }, "dump the sends of this node to itself which are run in process");
+
+      ins.add("pioneer", "numa", [](mn::HttpRequest::Method, const arg_list&) -> std::string {
+        return system::numa_placement::ref().str();
+      }, "dump the NUMA nodes and the threads placed on them");
+
+      ins.add("pioneer", "chunks", [](mn::HttpRequest::Method, const arg_list&) -> std::string {
+        return frame_chunks::ref().str();
+      }, "dump the large frames received in chunks");
+
+      ins.add("pioneer", "capture", [](mn::HttpRequest::Method, const arg_list& args) -> std::string {
+        std::string file = detail::find_arg(args, "file", "");
+        if (!file.empty()) {
+          uint64_t max_mb = boost::lexical_cast<uint64_t>(detail::find_arg(args, "max_mb", "1024"));
+          traffic_capture::ref().start(file, max_mb * 1024 * 1024);
+        }
+        else if (detail::find_arg(args, "stop", "") == "1") {
+          traffic_capture::ref().stop();
+        }
+
+        return traffic_capture::ref().str();
+      }, "capture the request frames, /pioneer/capture?file=path&max_mb=1024 to start, ?stop=1 to stop");
+
+      ins.add("pioneer", "mcast_dedupe", [](mn::HttpRequest::Method, const arg_list&) -> std::string {
+        return mcast_dedupe::ref().str();
+      }, "dump the multicast datagrams passed and dropped as duplicates");
+
+      ins.add("pioneer", "leader", [](mn::HttpRequest::Method, const arg_list&) -> std::string {
+        if (!leader_election::ref().enabled()) return "no leader election, every node coordinates\n";
+
+        return leader_election::ref().str();
+      }, "dump the role of this node, the term, the leader and the voters");
+
+      ins.add("pioneer", "locality", [](mn::HttpRequest::Method, const arg_list&) -> std::string {
+        if (!locality::ref().enabled()) return "no zone or rack is given\n";
+
+        return locality::ref().str();
+      }, "dump the zone and the rack of the inside nodes, and their distance");
+
+      ins.add("pioneer", "offload", [](mn::HttpRequest::Method, const arg_list&) -> std::string {
+        if (!offload::ref().enabled()) return "no offload, start with --offload_threshold\n";
+
+        return offload::ref().str();
+      }, "dump the queued tasks per worker of this node and of the peers, the requests are passed on to");
+
+      ins.add("pioneer", "config", [](mn::HttpRequest::Method, const arg_list& args) -> std::string {
+        if (args.empty()) return system::runtime_config::ref().str();
+
+        return system::runtime_config::ref().apply(args);
+      }, "dump the settings changeable while running, or change them by ?name=value");
+
+      ins.add("pioneer", "reload_config", [](mn::HttpRequest::Method, const arg_list&) {
+        return system::runtime_config::ref().reload();
+      }, "apply the settings changeable while running from the config file");
+    }
+
+  } // net
+} // pioneer
+
+#endif /* PIONEER_NET_INSPECTOR_H_ */
@@ -24,7 +24,13 @@
 #define PIONEER_NET_IP_H_
 
 #include <arpa/inet.h>
+#include <ifaddrs.h>
+#include <net/if.h>
+#include <netinet/in.h>
 #include <cstring>
+#include <string>
+
+#include <atlas/rpc/endpoint.h>
 
 namespace pioneer {
 
@@ -43,6 +49,66 @@ namespace pioneer {
       return ip_port.substr(ip_port.find(":") + 1);
     }
 
+    // the packed endpoint of the address, no string is built
+    static atlas::rpc::endpoint_id to_endpoint(const sockaddr_in& addr) {
+      return atlas::rpc::make_endpoint(ntohl(addr.sin_addr.s_addr), ntohs(addr.sin_port));
+    }
+
+    static sockaddr_in to_sockaddr(atlas::rpc::endpoint_id e) {
+      sockaddr_in addr;
+      std::memset(&addr, 0, sizeof(addr));
+      addr.sin_family = AF_INET;
+      addr.sin_addr.s_addr = htonl(atlas::rpc::endpoint_ip(e));
+      addr.sin_port = htons(atlas::rpc::endpoint_port(e));
+
+      return addr;
+    }
+
+    // the IPv4 address of a received source, an IPv4-mapped IPv6 address is unmapped, the other IPv6
+    // addresses have no IPv4 one, so they are given as INADDR_ANY with the port kept
+    static sockaddr_in to_ipv4(const sockaddr_in6& addr) {
+      sockaddr_in v4;
+      std::memset(&v4, 0, sizeof(v4));
+      v4.sin_family = AF_INET;
+
+      if (addr.sin6_family == AF_INET) {
+        std::memcpy(&v4, &addr, sizeof(v4));
+      }
+      else if (addr.sin6_family == AF_INET6) {
+        v4.sin_port = addr.sin6_port;
+        if (IN6_IS_ADDR_V4MAPPED(&addr.sin6_addr)) std::memcpy(&v4.sin_addr, &addr.sin6_addr.s6_addr[12], 4);
+      }
+
+      return v4;
+    }
+
+    // the index of a network interface given by it's name or one of it's IPv4 addresses, 0 if not found
+    static unsigned interface_index(const std::string& name_or_ip) {
+      if (name_or_ip.empty()) return 0;
+
+      unsigned index = ::if_nametoindex(name_or_ip.c_str());
+      if (index) return index;
+
+      in_addr addr;
+      if (::inet_pton(AF_INET, name_or_ip.c_str(), &addr) != 1) return 0;
+
+      ifaddrs* interfaces = nullptr;
+      if (::getifaddrs(&interfaces) == -1) return 0;
+
+      for (ifaddrs* i = interfaces; i; i = i->ifa_next) {
+        if (!i->ifa_addr || i->ifa_addr->sa_family != AF_INET) continue;
+
+        if (reinterpret_cast<const sockaddr_in*>(i->ifa_addr)->sin_addr.s_addr == addr.s_addr) {
+          index = ::if_nametoindex(i->ifa_name);
+          break;
+        }
+      }
+
+      ::freeifaddrs(interfaces);
+
+      return index;
+    }
+
     static std::string get_ip_port(const sockaddr_in& addr) {
       char host[INET_ADDRSTRLEN] = "INVALID";
       ::inet_ntop(AF_INET, &addr.sin_addr, host, sizeof host);
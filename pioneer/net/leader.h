@@ -0,0 +1,497 @@
+/*
+ * leader.h
+ *
+ *  Created on: Sep 28, 2013
+ *      Author: vincent
+ */
+
+/*    Copyright 2011 ~ 2013 Vincent Zhang, ivincent.zhang@gmail.com
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#ifndef PIONEER_NET_LEADER_H_
+#define PIONEER_NET_LEADER_H_
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <set>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <boost/lexical_cast.hpp>
+#include <glog/logging.h>
+#include <atlas/singleton.h>
+#include <atlas/container/small_vector.h>
+#include <atlas/fast_random.h>
+#include <atlas/lock.h>
+#include <atlas/rpc.h>
+
+#include <pioneer/system/context.h>
+#include <pioneer/system/thread_pool.h>
+#include <pioneer/net/rpc_clients.h>
+
+namespace pioneer {
+  namespace net {
+
+    /*
+     * The leader of the inside nodes, so a cluster wide action, a multicast fan out, is coordinated by one node
+     * only, whichever node it's asked of, see run_on_leader(). It's the election of Raft without the log, over
+     * the inward connections : a follower hearing no heartbeat for the election timeout, randomized in [T, 2T),
+     * stands for a new term, and leads once a majority of the voters grant it their votes, a voter grants one
+     * vote a term.
+     *
+     * The leader holds a lease, it leads only while it's valid. The heartbeats are sent 3 times an election
+     * timeout, the lease is extended to 0.8 T after a heartbeat sent once a majority acks it. A voter which has
+     * heard the leader within T grants no vote to another node, so no other node leads before the lease ends.
+     *
+     * The voters are the inside nodes ever known, a node is no longer a voter once it leaves by a drain,
+     * see net::drain, so a partition never makes a smaller majority on it's side
+     * */
+    class leader_election : public atlas::singleton<leader_election> {
+    public:
+
+      typedef std::chrono::steady_clock clock;
+
+      enum role_type { follower, candidate, leader };
+
+    private:
+
+      // what the callers read, published under the mutex at every change, see publish()
+      struct leader_view {
+        uint32_t leader;
+        bool leads;
+        uint64_t term;
+        clock::time_point lease;
+      };
+
+      // the acks of a heartbeat round
+      struct heartbeat_round {
+        clock::time_point sent;
+        std::set<uint32_t> acks;
+      };
+
+    private:
+
+      friend class atlas::singleton<leader_election>;
+      leader_election(const leader_election&) = delete;
+      leader_election& operator=(const leader_election&) = delete;
+
+    public:
+
+      // public for std::make_shared, see atlas::singleton
+      leader_election() : _enabled(false), _timeout(std::chrono::seconds(1)), _self(0), _role(follower), _term(0),
+        _voted_for(0), _leader(0), _resigned(false), _round(0), _elections(0) {}
+
+    public:
+
+      // before the servers start, the election timeout in seconds, the timer ticks 10 times within it, see tick()
+      void start(double election_timeout) {
+        std::lock_guard<std::mutex> guard(_mutex);
+
+        _timeout = std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(election_timeout));
+        _election_deadline = clock::now() + random_timeout();
+        _enabled = true;
+
+        LOG(INFO) << "leader election, the election timeout is " << election_timeout << "s";
+      }
+
+      bool enabled() const { return _enabled.load(std::memory_order_relaxed); }
+
+      // the lease is held, read without the mutex, as leader_ip() and term()
+      bool is_leader() const {
+        leader_view v = _view.load();
+        return v.leads && clock::now() < v.lease;
+      }
+
+      // this node coordinates the cluster wide actions, it does if there is no election
+      bool leads() const { return !enabled() || is_leader(); }
+
+      // the leader as far as we know, this node if it leads, 0 if none is known
+      uint32_t leader_ip() const { return _view.load().leader; }
+
+      uint64_t term() const { return _view.load().term; }
+
+      // the task runs here if this node leads, return false if it does not
+      bool run_on_leader(const std::function<void()>& task) {
+        if (!leads()) return false;
+
+        task();
+        return true;
+      }
+
+      // this node stands no more, the others elect a new leader once the lease ends, see net::drain
+      void resign() {
+        std::lock_guard<std::mutex> guard(_mutex);
+
+        _resigned = true;
+        if (_role == leader) LOG(INFO) << "resign the leadership of term " << _term;
+
+        _role = follower;
+        _lease = clock::time_point();
+        if (_leader == _self) _leader = 0;
+        publish();
+      }
+
+      // the node leaves the cluster, it's no longer a voter
+      void forget(uint32_t ip) {
+        std::lock_guard<std::mutex> guard(_mutex);
+        _voters.erase(ip);
+      }
+
+      // in the timer, stand for a new term if the leader is silent, or send the heartbeats if we lead
+      void tick() {
+        atlas::small_vector<uint32_t, 8> targets;
+        uint64_t term = 0, round = 0;
+        bool votes = false;
+
+        {
+          std::lock_guard<std::mutex> guard(_mutex);
+
+          if (!_self && !init_self()) return;
+          update_voters();
+
+          clock::time_point now = clock::now();
+
+          if (_role == leader) {
+            // no majority has acked us for long, the others are electing
+            if (now - _last_heard > _timeout) {
+              LOG(WARNING) << "the lease of term " << _term << " is lost, step down";
+              become_follower(_term, 0);
+              return;
+            }
+
+            if (now < _next_heartbeat) return;
+
+            _next_heartbeat = now + _timeout / 3;
+            round = ++_round;
+            _rounds[round].sent = now;
+            while (_rounds.size() > 8) _rounds.erase(_rounds.begin());
+
+            // with no other voter, the lease is ours at once
+            extend(round, _self);
+          }
+          else {
+            if (_resigned || now < _election_deadline) return;
+
+            ++_term;
+            ++_elections;
+            _role = candidate;
+            _voted_for = _self;
+            _leader = 0;
+            _votes.clear();
+            _votes.insert(_self);
+            _election_deadline = now + random_timeout();
+            publish();
+
+            LOG(INFO) << "stand for term " << _term << ", " << _voters.size() + 1 << " voters";
+
+            if (_votes.size() >= quorum()) {
+              become_leader();
+              return;
+            }
+
+            votes = true;
+          }
+
+          term = _term;
+          targets.assign(_voters.begin(), _voters.end());
+        }
+
+        for (uint32_t ip : targets) {
+          if (votes) request_vote(ip, term);
+          else send_heartbeat(ip, term, round);
+        }
+      }
+
+      // a candidate asks for our vote, return our term and whether it's granted
+      std::pair<uint64_t, bool> vote(uint64_t term, uint32_t candidate) {
+        std::lock_guard<std::mutex> guard(_mutex);
+
+        _voters.insert(candidate);
+
+        // the leader is alive, the candidate is cut off from it, or too hasty
+        clock::time_point now = clock::now();
+        if (_leader && _leader != candidate && now - _last_heard < _timeout) return std::make_pair(_term, false);
+
+        if (term < _term) return std::make_pair(_term, false);
+        if (term > _term) become_follower(term, 0);
+
+        if (_voted_for && _voted_for != candidate) return std::make_pair(_term, false);
+
+        _voted_for = candidate;
+        _election_deadline = now + random_timeout();
+
+        return std::make_pair(_term, true);
+      }
+
+      // the leader of the term is alive, return our term and whether it's accepted
+      std::pair<uint64_t, bool> heartbeat(uint64_t term, uint32_t leader_ip) {
+        std::lock_guard<std::mutex> guard(_mutex);
+
+        _voters.insert(leader_ip);
+        if (term < _term) return std::make_pair(_term, false);
+
+        if (term > _term || _role != follower || _leader != leader_ip) {
+          become_follower(term, leader_ip);
+          LOG(INFO) << "inside node " << atlas::rpc::ip_to_string(leader_ip) << " leads term " << term;
+        }
+
+        _last_heard = clock::now();
+        _election_deadline = _last_heard + random_timeout();
+
+        return std::make_pair(_term, true);
+      }
+
+      // the elections this node stood for
+      uint64_t elections() const { return _elections.load(std::memory_order_relaxed); }
+
+      std::string str() const {
+        static const char* roles[] = { "follower", "candidate", "leader" };
+
+        std::lock_guard<std::mutex> guard(_mutex);
+        clock::time_point now = clock::now();
+
+        std::ostringstream os;
+        os << roles[_role] << ", term " << _term << ", leader " << (_leader ? atlas::rpc::ip_to_string(_leader) : "unknown");
+        if (_role == leader) {
+          os << ", lease " << (now < _lease ? std::chrono::duration<double>(_lease - now).count() : 0.0) << "s";
+        }
+        os << "\n" << _voters.size() + 1 << " voters :";
+        for (uint32_t ip : _voters) os << " " << atlas::rpc::ip_to_string(ip);
+        os << "\n";
+
+        return os.str();
+      }
+
+    private:
+
+      void request_vote(uint32_t ip, uint64_t term);
+
+      void send_heartbeat(uint32_t ip, uint64_t term, uint64_t round);
+
+      void on_vote(uint32_t voter, uint64_t term, uint64_t voter_term, bool granted) {
+        std::lock_guard<std::mutex> guard(_mutex);
+
+        if (voter_term > _term) {
+          become_follower(voter_term, 0);
+          return;
+        }
+
+        if (_role != candidate || term != _term || !granted) return;
+
+        _votes.insert(voter);
+        if (_votes.size() >= quorum()) become_leader();
+      }
+
+      void on_heartbeat_ack(uint32_t voter, uint64_t term, uint64_t round, uint64_t voter_term, bool accepted) {
+        std::lock_guard<std::mutex> guard(_mutex);
+
+        if (voter_term > _term) {
+          LOG(INFO) << "term " << voter_term << " is seen, step down";
+          become_follower(voter_term, 0);
+          return;
+        }
+
+        if (_role != leader || term != _term || !accepted) return;
+
+        extend(round, voter);
+      }
+
+      // the lease is extended from the time the round is sent, once a majority acks it, the mutex is held
+      void extend(uint64_t round, uint32_t voter) {
+        auto it = _rounds.find(round);
+        if (it == _rounds.end()) return;
+
+        it->second.acks.insert(voter);
+        it->second.acks.insert(_self);
+        if (it->second.acks.size() < quorum()) return;
+
+        clock::time_point lease = it->second.sent + _timeout * 4 / 5;
+        if (lease > _lease) _lease = lease;
+        _last_heard = it->second.sent;
+        publish();
+      }
+
+      // the mutex is held
+      void become_leader() {
+        _role = leader;
+        _leader = _self;
+        _lease = clock::time_point();
+        _next_heartbeat = _last_heard = clock::now();
+        _rounds.clear();
+        publish();
+
+        LOG(INFO) << "lead term " << _term << " by " << _votes.size() << " votes of " << _voters.size() + 1;
+      }
+
+      // the mutex is held
+      void become_follower(uint64_t term, uint32_t leader_ip) {
+        if (term > _term) _voted_for = 0;
+
+        _term = term;
+        _role = follower;
+        _leader = leader_ip;
+        _lease = clock::time_point();
+        _election_deadline = clock::now() + random_timeout();
+        publish();
+      }
+
+      // the mutex is held, the role, the term, the leader or the lease changed
+      void publish() { _view.store(leader_view { _leader, _role == leader, _term, _lease }); }
+
+      size_t quorum() const { return (_voters.size() + 1) / 2 + 1; }
+
+      // the inside nodes are voters from the time they are known, the mutex is held
+      void update_voters() {
+        for (const std::string& ip : system::context::inside_nodes.get()->ip_list) {
+          uint32_t addr = atlas::rpc::parse_ip(ip);
+          if (addr && addr != _self) _voters.insert(addr);
+        }
+      }
+
+      // the local ip is known once a connection is up
+      bool init_self() {
+        if (system::context::local_ip.empty()) return false;
+
+        _self = atlas::rpc::parse_ip(system::context::local_ip);
+        _voters.erase(_self);
+
+        return _self != 0;
+      }
+
+      clock::duration random_timeout() const {
+        return _timeout + clock::duration(atlas::fast_random(static_cast<size_t>(_timeout.count()) + 1));
+      }
+
+    private:
+
+      std::atomic<bool> _enabled;
+      clock::duration _timeout;
+
+      mutable std::mutex _mutex;
+      uint32_t _self;
+      std::set<uint32_t> _voters;
+
+      role_type _role;
+      uint64_t _term;
+      uint32_t _voted_for;
+      uint32_t _leader;
+      bool _resigned;
+      std::set<uint32_t> _votes;
+
+      clock::time_point _election_deadline;
+      // the leader is last heard, or a majority acked us
+      clock::time_point _last_heard;
+      clock::time_point _lease;
+      clock::time_point _next_heartbeat;
+
+      // asked by every cluster wide call, so the readers never wait for the election
+      atlas::seqlock<leader_view> _view;
+
+      uint64_t _round;
+      std::map<uint64_t, heartbeat_round> _rounds;
+
+      std::atomic<uint64_t> _elections;
+    };
+
+  } // net
+
+  namespace rpc {
+
+    using atlas::rpc::rpc_result;
+    using atlas::rpc::rpc_context;
+
+    // builtin rpc
+    ATLAS_REGISTER_REMOTE_FUNC(leader_vote, -14);
+    ATLAS_REGISTER_REMOTE_FUNC(leader_heartbeat, -15);
+
+    class leader_rfc {
+    public:
+
+      // the response is the term of ours, and 1 if the vote is granted
+      static rpc_result vote(uint64_t term, rpc_context c) noexcept {
+        std::pair<uint64_t, bool> r = net::leader_election::ref().vote(term, atlas::rpc::endpoint_ip(c.source()));
+        return rpc_result(boost::lexical_cast<std::string>(r.first) + (r.second ? " 1" : " 0"));
+      }
+
+      // the response is the term of ours, and 1 if the leader is accepted
+      static rpc_result heartbeat(uint64_t term, rpc_context c) noexcept {
+        std::pair<uint64_t, bool> r = net::leader_election::ref().heartbeat(term, atlas::rpc::endpoint_ip(c.source()));
+        return rpc_result(boost::lexical_cast<std::string>(r.first) + (r.second ? " 1" : " 0"));
+      }
+
+      // the term and the flag of a response, false if it's malformed
+      static bool parse(const std::string& data, uint64_t* term, bool* ok) {
+        size_t space = data.find(' ');
+        if (space == std::string::npos) return false;
+
+        try {
+          *term = boost::lexical_cast<uint64_t>(data.substr(0, space));
+        }
+        catch (const boost::bad_lexical_cast&) {
+          return false;
+        }
+
+        *ok = data.compare(space + 1, std::string::npos, "1") == 0;
+        return true;
+      }
+    };
+
+    ATLAS_BIND_REMOTE_FUNC(leader_vote, leader_rfc::vote);
+    ATLAS_BIND_REMOTE_FUNC(leader_heartbeat, leader_rfc::heartbeat);
+
+    // an election is never queued behind the data plane requests
+    PIONEER_RPC_PRIORITY(leader_vote, 10);
+    PIONEER_RPC_PRIORITY(leader_heartbeat, 10);
+
+  } // rpc
+
+  namespace net {
+
+    inline void leader_election::request_vote(uint32_t ip, uint64_t term) {
+      rpc::p2p_client client(rpc::inward_client, atlas::rpc::make_endpoint(ip, 0));
+      client.set_backpressure_policy(rpc::bp_fail_fast);
+      client.set_timeout(std::chrono::duration_cast<std::chrono::milliseconds>(_timeout));
+
+      atlas::rpc::rpc_callback_type cb = [this, ip, term](const std::string& data, int err, atlas::rpc::async_task&) {
+        uint64_t voter_term = 0;
+        bool granted = false;
+        if (!err && rpc::leader_rfc::parse(data, &voter_term, &granted)) on_vote(ip, term, voter_term, granted);
+      };
+
+      client.call(rpc::leader_rfc::vote, rpc::fn_ids::leader_vote, cb, term, atlas::rpc::nilctx);
+    }
+
+    inline void leader_election::send_heartbeat(uint32_t ip, uint64_t term, uint64_t round) {
+      rpc::p2p_client client(rpc::inward_client, atlas::rpc::make_endpoint(ip, 0));
+      client.set_backpressure_policy(rpc::bp_fail_fast);
+      client.set_timeout(std::chrono::duration_cast<std::chrono::milliseconds>(_timeout));
+
+      atlas::rpc::rpc_callback_type cb = [this, ip, term, round](const std::string& data, int err, atlas::rpc::async_task&) {
+        uint64_t voter_term = 0;
+        bool accepted = false;
+        if (!err && rpc::leader_rfc::parse(data, &voter_term, &accepted)) on_heartbeat_ack(ip, term, round, voter_term, accepted);
+      };
+
+      client.call(rpc::leader_rfc::heartbeat, rpc::fn_ids::leader_heartbeat, cb, term, atlas::rpc::nilctx);
+    }
+
+  } // net
+} // pioneer
+
+#endif /* PIONEER_NET_LEADER_H_ */
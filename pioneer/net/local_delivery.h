@@ -0,0 +1,125 @@
+/*
+ * local_delivery.h
+ *
+ *  Created on: Sep 28, 2013
+ *      Author: vincent
+ */
+
+/*    Copyright 2011 ~ 2013 Vincent Zhang, ivincent.zhang@gmail.com
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#ifndef PIONEER_NET_LOCAL_DELIVERY_H_
+#define PIONEER_NET_LOCAL_DELIVERY_H_
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <sstream>
+#include <string>
+
+#include <atlas/singleton.h>
+#include <atlas/rpc.h>
+
+namespace pioneer {
+  namespace net {
+
+    /*
+     * The frames a node sends to itself, a p2p call to the node's own ip, or the node's own copy of a call
+     * multicast to the cluster, are handed to the receiver in process, instead of going out of a socket and
+     * coming back through the loopback or the multicast loop. The receiver runs them as the frames of a
+     * datagram from this node, so they are scheduled by their priorities as any, and the responses come back
+     * the same way, see message_handler::run_frames.
+     *
+     * The frames are still encoded, since the dispatcher and the responses work on frames, it's the socket,
+     * the copies of the kernel and the stream parsing which are skipped
+     * */
+    class local_delivery : public atlas::singleton<local_delivery> {
+    public:
+
+      // runs the frames sent to this node, the buffer is owned by the frames
+      typedef std::function<void(const std::shared_ptr<std::string>& frames)> receiver_type;
+
+    private:
+
+      friend class atlas::singleton<local_delivery>;
+      local_delivery(const local_delivery&) = delete;
+      local_delivery& operator=(const local_delivery&) = delete;
+
+    public:
+
+      // public for std::make_shared, see atlas::singleton
+      local_delivery() : _enabled(true), _self(0), _delivered(0), _bytes(0) {}
+
+    public:
+
+      void set_enabled(bool enabled) { _enabled = enabled; }
+
+      bool enabled() const { return _enabled.load(std::memory_order_relaxed); }
+
+      // during the static initialization, see net::message_handler
+      void set_receiver(const receiver_type& receiver) { _receiver = receiver; }
+
+      // the ip of this node, once it's known, see message_handler::try_set_local_ip
+      void set_self(uint32_t ip) { _self.store(ip, std::memory_order_relaxed); }
+
+      uint32_t self() const { return _self.load(std::memory_order_relaxed); }
+
+      // the frames to the ip are delivered in process, the applications have no receiver, so they never are
+      bool local(uint32_t ip) const {
+        return ip && ip == self() && enabled() && _receiver;
+      }
+
+      // the message is one frame or several ones packed, it's copied, since the sender's buffer is reused
+      void deliver(const char* message, size_t size) {
+        ++_delivered;
+        _bytes += size;
+
+        _receiver(std::make_shared<std::string>(message, size));
+      }
+
+      void deliver(std::string&& message) {
+        ++_delivered;
+        _bytes += message.size();
+
+        _receiver(std::make_shared<std::string>(std::move(message)));
+      }
+
+      uint64_t delivered() const { return _delivered.load(std::memory_order_relaxed); }
+
+      uint64_t bytes() const { return _bytes.load(std::memory_order_relaxed); }
+
+      std::string str() const {
+        std::ostringstream os;
+        os << "enabled : " << std::boolalpha << enabled() << "\n"
+            << "self : " << (self() ? atlas::rpc::ip_to_string(self()) : std::string("unknown")) << "\n"
+            << "delivered : " << delivered() << " sends, " << bytes() << " bytes\n";
+
+        return os.str();
+      }
+
+    private:
+
+      std::atomic<bool> _enabled;
+      std::atomic<uint32_t> _self;
+      receiver_type _receiver;
+
+      std::atomic<uint64_t> _delivered;
+      std::atomic<uint64_t> _bytes;
+    };
+
+  } // net
+} // pioneer
+
+#endif /* PIONEER_NET_LOCAL_DELIVERY_H_ */
@@ -0,0 +1,456 @@
+/*
+ * local_transport.h
+ *
+ *  Created on: Aug 28, 2013
+ *      Author: vincent
+ */
+
+/*    Copyright 2011 ~ 2013 Vincent Zhang, ivincent.zhang@gmail.com
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#ifndef PIONEER_NET_LOCAL_TRANSPORT_H_
+#define PIONEER_NET_LOCAL_TRANSPORT_H_
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <ifaddrs.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
+
+#include <algorithm>
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+
+#include <boost/bind.hpp>
+#include <glog/logging.h>
+#include <muduo/net/Channel.h>
+#include <muduo/net/EventLoop.h>
+#include <muduo/net/EventLoopThreadPool.h>
+#include <muduo/net/InetAddress.h>
+#include <muduo/net/TcpClient.h>
+#include <muduo/net/TcpConnection.h>
+
+#include <pioneer/net/ip.h>
+
+namespace pioneer {
+  namespace net {
+
+    namespace mn = muduo::net;
+
+    /*
+     * The nodes on the same host talk through Unix domain sockets instead of TCP, so the messages
+     * skip the TCP/IP stack. The connections are plain muduo TcpConnections over the Unix socket,
+     * they are put into the same connection pools, and the senders never know the difference.
+     *
+     * A node listens on the abstract socket named by it's inward port, nothing is left in the file system.
+     * The connections are named by the IPv4 addresses they would have on TCP : the client side peer is
+     * the address it dialed, the server side peer is the host ip with a synthetic port below the
+     * ephemeral port range, which is unique among the local connections
+     * */
+    class local_address {
+    public:
+
+      static sockaddr_un make(uint16_t port, socklen_t* len) {
+        sockaddr_un addr;
+        std::memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+
+        // abstract namespace, the first byte of the path is 0
+        std::string name = "pioneer.inward." + std::to_string(port);
+        std::memcpy(addr.sun_path + 1, name.data(), std::min(name.size(), sizeof(addr.sun_path) - 1));
+
+        *len = static_cast<socklen_t>(offsetof(sockaddr_un, sun_path) + 1 + name.size());
+        return addr;
+      }
+
+      // whether the ip belongs to this host, the interfaces are read once
+      static bool is_local(const std::string& ip) {
+        const std::set<std::string>& addresses = local_ips();
+        return addresses.count(ip) || ip.compare(0, 4, "127.") == 0;
+      }
+
+      // the first non-loopback ip of this host, the peers on this host have the same one
+      static std::string host_ip() {
+        const std::set<std::string>& addresses = local_ips();
+        for (const std::string& ip : addresses) {
+          if (ip.compare(0, 4, "127.") != 0) return ip;
+        }
+
+        return "127.0.0.1";
+      }
+
+    private:
+
+      static const std::set<std::string>& local_ips() {
+        static const std::set<std::string> addresses = read_interfaces();
+        return addresses;
+      }
+
+      static std::set<std::string> read_interfaces() {
+        std::set<std::string> addresses;
+
+        ifaddrs* interfaces = nullptr;
+        if (::getifaddrs(&interfaces) == -1) {
+          LOG(ERROR) << strerror(errno);
+          return addresses;
+        }
+
+        for (ifaddrs* i = interfaces; i; i = i->ifa_next) {
+          if (!i->ifa_addr || i->ifa_addr->sa_family != AF_INET) continue;
+
+          const sockaddr_in* addr = reinterpret_cast<const sockaddr_in*>(i->ifa_addr);
+          addresses.insert(ip::get_ip_part(ip::get_ip_port(*addr)));
+        }
+
+        ::freeifaddrs(interfaces);
+
+        return addresses;
+      }
+    };
+
+    // the clients in the tcp client pool, over TCP or a local socket
+    class transport_client {
+    public:
+
+      virtual ~transport_client() {}
+
+    public:
+
+      virtual void connect() = 0;
+
+      virtual void disconnect() = 0;
+
+      // the I/O loop of the client, it's destroyed there
+      virtual mn::EventLoop* loop() const = 0;
+    };
+
+    class tcp_transport_client : public transport_client {
+    public:
+
+      tcp_transport_client(mn::EventLoop* loop, const mn::InetAddress& server_address, const std::string& name,
+          const mn::ConnectionCallback& on_connection, const mn::MessageCallback& on_message,
+          const mn::WriteCompleteCallback& on_write_complete) : _loop(loop), _client(loop, server_address, name.c_str()) {
+        _client.setConnectionCallback(on_connection);
+        _client.setMessageCallback(on_message);
+        _client.setWriteCompleteCallback(on_write_complete);
+      }
+
+      virtual ~tcp_transport_client() {}
+
+    public:
+
+      virtual void connect() { _client.connect(); }
+
+      virtual void disconnect() { _client.disconnect(); }
+
+      virtual mn::EventLoop* loop() const { return _loop; }
+
+    private:
+
+      mn::EventLoop* _loop;
+      mn::TcpClient _client;
+    };
+
+    /*
+     * Connects to the local socket of a node on this host, retries with backoff until it succeeds
+     * or is disconnected, as the muduo connector does. Once the connection is closed, it's not reconnected,
+     * the tcp client pool replaces the client by it's reconnect policy
+     * */
+    class local_client : public transport_client {
+    public:
+
+      local_client(mn::EventLoop* loop, const mn::InetAddress& server_address, const std::string& name,
+          const mn::ConnectionCallback& on_connection, const mn::MessageCallback& on_message,
+          const mn::WriteCompleteCallback& on_write_complete) : _impl(std::make_shared<impl>()) {
+        _impl->loop = loop;
+        _impl->server_address = server_address;
+        _impl->name = name;
+        _impl->on_connection = on_connection;
+        _impl->on_message = on_message;
+        _impl->on_write_complete = on_write_complete;
+      }
+
+      // the connection, if any, is closed in it's loop, the callbacks may still be called until then
+      virtual ~local_client() { disconnect(); }
+
+    public:
+
+      virtual void connect() {
+        _impl->connecting = true;
+
+        std::shared_ptr<impl> self = _impl;
+        _impl->loop->runInLoop([self]() { self->do_connect(); });
+      }
+
+      virtual void disconnect() {
+        _impl->connecting = false;
+
+        std::lock_guard<std::mutex> guard(_impl->mutex);
+        if (_impl->connection) _impl->connection->shutdown();
+      }
+
+      virtual mn::EventLoop* loop() const { return _impl->loop; }
+
+    private:
+
+      // shared with the timers and the connection callbacks, which may outlive the client
+      struct impl : public std::enable_shared_from_this<impl> {
+        static const int initial_retry_delay_ms = 500;
+        static const int max_retry_delay_ms = 30 * 1000;
+
+        impl() : loop(nullptr), connecting(false), retry_delay_ms(initial_retry_delay_ms), next_conn_id(1) {}
+
+        // run in the loop
+        void do_connect() {
+          if (!connecting) return;
+
+          int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+          if (fd == -1) {
+            LOG(ERROR) << strerror(errno);
+            retry();
+            return;
+          }
+
+          socklen_t len = 0;
+          sockaddr_un addr = local_address::make(ntohs(server_address.portNetEndian()), &len);
+
+          // a local connect never goes in progress, it fails with EAGAIN if the backlog is full
+          if (::connect(fd, reinterpret_cast<const sockaddr*>(&addr), len) == -1) {
+            DLOG(INFO) << name << " failed to connect to the local socket : " << strerror(errno);
+
+            ::close(fd);
+            retry();
+            return;
+          }
+
+          retry_delay_ms = initial_retry_delay_ms;
+          establish(fd);
+        }
+
+        void retry() {
+          std::shared_ptr<impl> self = shared_from_this();
+          loop->runAfter(retry_delay_ms / 1000.0, [self]() { self->do_connect(); });
+
+          retry_delay_ms = (retry_delay_ms * 2 < max_retry_delay_ms) ? retry_delay_ms * 2 : max_retry_delay_ms;
+        }
+
+        void establish(int fd) {
+          // named as the muduo clients do, the tcp client pool takes the client name from it
+          std::string peer_ip_port = server_address.toIpPort();
+          std::string conn_name = name + ":" + peer_ip_port + "#" + std::to_string(next_conn_id++);
+
+          // the local address is a synthetic one on the dialed ip, which is an ip of this host
+          static std::atomic<uint16_t> next_port(1);
+          mn::InetAddress local(ip::get_ip_part(peer_ip_port), synthetic_port(next_port));
+
+          mn::TcpConnectionPtr conn(new mn::TcpConnection(loop, conn_name.c_str(), fd, local, server_address));
+          conn->setConnectionCallback(on_connection);
+          conn->setMessageCallback(on_message);
+          conn->setWriteCompleteCallback(on_write_complete);
+
+          std::shared_ptr<impl> self = shared_from_this();
+          conn->setCloseCallback([self](const mn::TcpConnectionPtr& c) { self->on_close(c); });
+
+          {
+            std::lock_guard<std::mutex> guard(mutex);
+            connection = conn;
+          }
+
+          conn->connectEstablished();
+
+          // disconnected while connecting
+          if (!connecting) conn->shutdown();
+        }
+
+        void on_close(const mn::TcpConnectionPtr& conn) {
+          {
+            std::lock_guard<std::mutex> guard(mutex);
+            connection.reset();
+          }
+
+          loop->queueInLoop(boost::bind(&mn::TcpConnection::connectDestroyed, conn));
+        }
+
+        mn::EventLoop* loop;
+        mn::InetAddress server_address = mn::InetAddress(0);
+        std::string name;
+
+        mn::ConnectionCallback on_connection;
+        mn::MessageCallback on_message;
+        mn::WriteCompleteCallback on_write_complete;
+
+        std::atomic<bool> connecting;
+        int retry_delay_ms;
+        int next_conn_id;
+
+        std::mutex mutex;
+        mn::TcpConnectionPtr connection;
+      };
+
+    public:
+
+      // in [1, 32767], below the ephemeral port range, so they never collide with a TCP connection
+      static uint16_t synthetic_port(std::atomic<uint16_t>& next) {
+        return static_cast<uint16_t>(next++ % 32767 + 1);
+      }
+
+    private:
+
+      std::shared_ptr<impl> _impl;
+    };
+
+    /*
+     * Accepts the nodes on this host on the local socket of the inward port, runs in the base loop
+     * and spreads the connections over it's own I/O loops, as the muduo TCP server does.
+     * The connections are established and destroyed in the same way, so the handlers work for both
+     * */
+    class local_server {
+    public:
+
+      local_server(mn::EventLoop* loop, uint16_t port, const std::string& name) :
+        _loop(loop), _port(port), _name(name), _listen_fd(-1), _thread_num(0), _next_conn_id(1),
+        _host_ip(local_address::host_ip()), _next_port(1)
+      {}
+
+      ~local_server() {
+        if (_channel) {
+          _channel->disableAll();
+          _loop->removeChannel(_channel.get());
+        }
+
+        if (_listen_fd != -1) ::close(_listen_fd);
+
+        for (auto& v : _connections) {
+          mn::TcpConnectionPtr conn = v.second;
+          conn->getLoop()->runInLoop(boost::bind(&mn::TcpConnection::connectDestroyed, conn));
+        }
+      }
+
+      local_server(const local_server&) = delete;
+      local_server& operator=(const local_server&) = delete;
+
+    public:
+
+      void setThreadNum(int num) { _thread_num = num; }
+
+      void setConnectionCallback(const mn::ConnectionCallback& cb) { _on_connection = cb; }
+
+      void setMessageCallback(const mn::MessageCallback& cb) { _on_message = cb; }
+
+      void setWriteCompleteCallback(const mn::WriteCompleteCallback& cb) { _on_write_complete = cb; }
+
+      // must be called in the loop, return false if we can not listen, the nodes fall back to TCP then
+      bool start() {
+        _listen_fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (_listen_fd == -1) {
+          LOG(ERROR) << strerror(errno);
+          return false;
+        }
+
+        socklen_t len = 0;
+        sockaddr_un addr = local_address::make(_port, &len);
+
+        if (::bind(_listen_fd, reinterpret_cast<const sockaddr*>(&addr), len) == -1 || ::listen(_listen_fd, SOMAXCONN) == -1) {
+          LOG(ERROR) << _name << " can not listen on the local socket : " << strerror(errno);
+
+          ::close(_listen_fd);
+          _listen_fd = -1;
+          return false;
+        }
+
+        _io_thread_pool.reset(new mn::EventLoopThreadPool(_loop));
+        _io_thread_pool->setThreadNum(_thread_num);
+        _io_thread_pool->start();
+
+        _channel.reset(new mn::Channel(_loop, _listen_fd));
+        _channel->setReadCallback(boost::bind(&local_server::on_accept, this));
+        _channel->enableReading();
+
+        return true;
+      }
+
+    private:
+
+      void on_accept() {
+        while (true) {
+          int fd = ::accept4(_listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+          if (fd == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) LOG(ERROR) << strerror(errno);
+            return;
+          }
+
+          // the peer is on this host, so it has the same ip as us
+          mn::InetAddress peer(_host_ip, local_client::synthetic_port(_next_port));
+          mn::InetAddress local(_host_ip, _port);
+
+          std::string conn_name = _name + ":" + peer.toIpPort() + "#" + std::to_string(_next_conn_id++);
+
+          mn::EventLoop* io_loop = _io_thread_pool->getNextLoop();
+          mn::TcpConnectionPtr conn(new mn::TcpConnection(io_loop, conn_name.c_str(), fd, local, peer));
+          _connections[conn_name] = conn;
+
+          conn->setConnectionCallback(_on_connection);
+          conn->setMessageCallback(_on_message);
+          conn->setWriteCompleteCallback(_on_write_complete);
+          conn->setCloseCallback(boost::bind(&local_server::on_close, this, _1));
+
+          io_loop->runInLoop(boost::bind(&mn::TcpConnection::connectEstablished, conn));
+        }
+      }
+
+      // run in the I/O loop of the connection
+      void on_close(const mn::TcpConnectionPtr& conn) {
+        _loop->runInLoop(boost::bind(&local_server::remove_connection, this, conn));
+      }
+
+      // run in the base loop
+      void remove_connection(const mn::TcpConnectionPtr& conn) {
+        _connections.erase(conn->name().c_str());
+        conn->getLoop()->queueInLoop(boost::bind(&mn::TcpConnection::connectDestroyed, conn));
+      }
+
+    private:
+
+      mn::EventLoop* _loop;
+      uint16_t _port;
+      std::string _name;
+      int _listen_fd;
+      int _thread_num;
+      int _next_conn_id;
+      std::string _host_ip;
+      std::atomic<uint16_t> _next_port;
+
+      std::unique_ptr<mn::Channel> _channel;
+      std::shared_ptr<mn::EventLoopThreadPool> _io_thread_pool;
+
+      mn::ConnectionCallback _on_connection;
+      mn::MessageCallback _on_message;
+      mn::WriteCompleteCallback _on_write_complete;
+
+      // accessed in the base loop only
+      std::map<std::string, mn::TcpConnectionPtr> _connections;
+    };
+
+  } // net
+} // pioneer
+
+#endif /* PIONEER_NET_LOCAL_TRANSPORT_H_ */
@@ -0,0 +1,181 @@
+/*
+ * locality.h
+ *
+ *  Created on: Sep 28, 2013
+ *      Author: vincent
+ */
+
+/*    Copyright 2011 ~ 2013 Vincent Zhang, ivincent.zhang@gmail.com
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#ifndef PIONEER_NET_LOCALITY_H_
+#define PIONEER_NET_LOCALITY_H_
+
+#include <array>
+#include <atomic>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+
+#include <glog/logging.h>
+#include <atlas/singleton.h>
+#include <atlas/versioned_snapshot.h>
+#include <atlas/rpc.h>
+
+#include <pioneer/net/net.h>
+
+namespace pioneer {
+  namespace net {
+
+    // the distances of the peers, the nearer the smaller
+    enum locality_distance { same_rack = 0, same_zone = 1, other_zone = 2, locality_distance_count = 3 };
+
+    // the labels of a node, empty if not given
+    struct node_labels {
+      std::string zone;
+      std::string rack;
+    };
+
+    typedef std::unordered_map<uint32_t, node_labels> labels_map;
+
+    struct locality_tag {};
+
+    /*
+     * The zone and the rack of the inside nodes, so the requests to any node go to the nearest ones, see
+     * rpc::random_client. A node is given it's labels by --zone and --rack, and tells them to the nodes it
+     * connects to, see rpc::locality_rfc, the gossip spreads them too, see net::gossip.
+     *
+     * A peer is in the same rack if both labels match, in the same zone if the zones do, and in another zone
+     * if not, a peer without labels is placed by the round trip time measured to it, and in the same zone
+     * until it's measured. The connections are taken from the nearest peers first, by the power of two
+     * choices, which compares the round trip times as well, and the farther ones only if they are congested,
+     * see connection_pool::nearest_get. Off unless this node is given a label
+     * */
+    class locality : public atlas::singleton<locality> {
+    public:
+
+      // a peer without labels is in the same rack below the round trip time, and in the same zone below the other
+      static const int64_t rack_rtt = 250 * 1000;
+      static const int64_t zone_rtt = 2 * 1000 * 1000;
+
+    private:
+
+      friend class atlas::singleton<locality>;
+      locality(const locality&) = delete;
+      locality& operator=(const locality&) = delete;
+
+    public:
+
+      // public for std::make_shared, see atlas::singleton
+      locality() : _version(1) {
+        for (auto& p : _selected) p = 0;
+      }
+
+    public:
+
+      // before the servers start
+      void configure(const std::string& zone, const std::string& rack) {
+        _self.zone = zone;
+        _self.rack = rack;
+
+        if (enabled()) LOG(INFO) << "locality aware routing, zone " << zone << ", rack " << rack;
+      }
+
+      bool enabled() const { return !_self.zone.empty() || !_self.rack.empty(); }
+
+      const node_labels& self() const { return _self; }
+
+      // the labels of a peer, told by it, or by the gossip
+      void set(uint32_t ip, const std::string& zone, const std::string& rack) {
+        if (!ip || (zone.empty() && rack.empty())) return;
+
+        const labels_map& known = *_labels.get();
+        auto it = known.find(ip);
+        if (it != known.end() && it->second.zone == zone && it->second.rack == rack) return;
+
+        _labels.update([ip, &zone, &rack](labels_map& m) { m[ip] = node_labels { zone, rack }; });
+        _version.fetch_add(1, std::memory_order_release);
+
+        LOG(INFO) << "inside node " << atlas::rpc::ip_to_string(ip) << " is in zone " << zone << ", rack " << rack;
+      }
+
+      // the peers without labels are placed again by their round trip times, in a timer
+      void refresh() { _version.fetch_add(1, std::memory_order_release); }
+
+      // the connections are sorted again once it changes, see connection_pool::nearest_get
+      uint64_t version() const { return _version.load(std::memory_order_acquire); }
+
+      // the round trip time in nanoseconds, 0 if not measured yet
+      int distance(uint32_t ip, int64_t rtt) const {
+        const labels_map& known = *_labels.get();
+
+        auto it = known.find(ip);
+        if (it == known.end()) {
+          if (rtt == 0) return same_zone;
+          return rtt < rack_rtt ? same_rack : rtt < zone_rtt ? same_zone : other_zone;
+        }
+
+        const node_labels& peer = it->second;
+        if (peer.zone != _self.zone) return other_zone;
+
+        return peer.rack == _self.rack ? same_rack : same_zone;
+      }
+
+      void on_selected(int distance) {
+        if (distance >= 0 && distance < locality_distance_count) _selected[distance].fetch_add(1, std::memory_order_relaxed);
+      }
+
+      unsigned long long selected(int distance) const { return _selected[distance].load(std::memory_order_relaxed); }
+
+      // a line a peer labeled : ip, zone, rack, distance
+      std::string str() const {
+        static const char* distances[] = { "same rack", "same zone", "other zone" };
+
+        std::ostringstream os;
+        os << "zone " << _self.zone << ", rack " << _self.rack << "\n";
+        for (const auto& p : *_labels.get()) {
+          os << atlas::rpc::ip_to_string(p.first) << "\t" << p.second.zone << "\t" << p.second.rack << "\t"
+              << distances[distance(p.first, 0)] << "\n";
+        }
+
+        return os.str();
+      }
+
+    private:
+
+      node_labels _self;
+      atlas::versioned_snapshot<labels_map, locality_tag> _labels;
+      std::atomic<uint64_t> _version;
+
+      std::array<std::atomic<unsigned long long>, locality_distance_count> _selected;
+    };
+
+    // a connection to any inside node, the nearest ones first if the locality is known
+    inline pooled_connection_ptr nearest_inward_get() {
+      locality& l = locality::ref();
+      if (!l.enabled()) return inward_connection_pool::ref().random_get();
+
+      int distance = same_zone;
+      pooled_connection_ptr conn = inward_connection_pool::ref().nearest_get(
+          [&l](uint32_t ip, int64_t rtt) { return l.distance(ip, rtt); }, l.version(), &distance);
+      if (conn) l.on_selected(distance);
+
+      return conn;
+    }
+
+  } // net
+} // pioneer
+
+#endif /* PIONEER_NET_LOCALITY_H_ */
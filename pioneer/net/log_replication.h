@@ -0,0 +1,392 @@
+/*
+ * log_replication.h
+ *
+ *  Created on: Sep 6, 2013
+ *      Author: vincent
+ */
+
+/*    Copyright 2011 ~ 2013 Vincent Zhang, ivincent.zhang@gmail.com
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#ifndef PIONEER_NET_LOG_REPLICATION_H_
+#define PIONEER_NET_LOG_REPLICATION_H_
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <boost/lexical_cast.hpp>
+#include <boost/serialization/string.hpp>
+#include <boost/serialization/vector.hpp>
+#include <glog/logging.h>
+#include <atlas/singleton.h>
+#include <atlas/rpc.h>
+
+#include <pioneer/net/rpc_clients.h>
+
+namespace pioneer {
+  namespace net {
+
+    /*
+     * The primary side of the log replication.
+     *
+     * The log records are numbered by the primary, and streamed to the replicas over the persistent inward
+     * connections in batches, a replica answers every batch with the last record it has in order, see
+     * log_replica. The batches are sent by flush(), which is called by a timer and by every commit(), so the
+     * concurrent commits share the batches, and more batches may be in flight to a replica at the same time.
+     * A failed batch rewinds the replica to it's last ack, the records are sent again by the next flush.
+     *
+     * commit() returns once a quorum of the replicas has the record, it's used instead of a local fsync, the
+     * record survives the failure of the primary after a shorter wait. The records are kept until every replica
+     * acks them, at most max_window of them, a replica lagging behind is excluded from the quorum, and needs
+     * a full resync before it's configured again.
+     *
+     * The records are opaque bytes, for example, the entries of a transaction_olog serialized by the caller
+     * */
+    class log_replicator : public atlas::singleton<log_replicator> {
+    public:
+
+      // the records in a batch
+      static const size_t max_batch_records = 1024;
+      // the records kept for the replicas
+      static const size_t max_window = 64 * 1024;
+
+    private:
+
+      friend class atlas::singleton<log_replicator>;
+      log_replicator(const log_replicator&) = delete;
+      log_replicator& operator=(const log_replicator&) = delete;
+
+      struct replica {
+        replica(atlas::rpc::endpoint_id target) : target(target), sent(0), acked(0), lagging(false) {}
+
+        atlas::rpc::endpoint_id target;
+        uint64_t sent;
+        uint64_t acked;
+        bool lagging;
+      };
+
+      struct batch {
+        batch(size_t index, atlas::rpc::endpoint_id target, uint64_t first, uint64_t last) :
+            index(index), target(target), first(first), last(last) {}
+
+        size_t index;
+        atlas::rpc::endpoint_id target;
+        // [first, last]
+        uint64_t first;
+        uint64_t last;
+        std::vector<std::string> records;
+      };
+
+    public:
+
+      log_replicator() : _quorum(0), _first(1), _last(0), _batches(0), _failures(0) {}
+
+    public:
+
+      // the replicas, port 0 for any connection to the node, and the acks a commit needs
+      void configure(const std::vector<atlas::rpc::endpoint_id>& replicas, size_t quorum) {
+        std::lock_guard<std::mutex> guard(_mutex);
+
+        _replicas.clear();
+        for (atlas::rpc::endpoint_id target : replicas) {
+          _replicas.push_back(replica(target));
+          _replicas.back().sent = _replicas.back().acked = _first - 1;
+        }
+
+        _quorum = std::min(quorum, replicas.size());
+      }
+
+      bool enabled() const {
+        std::lock_guard<std::mutex> guard(_mutex);
+        return !_replicas.empty();
+      }
+
+      // append the record without waiting, return it's number
+      uint64_t append(const std::string& record) {
+        std::lock_guard<std::mutex> guard(_mutex);
+
+        // nobody to ship to
+        if (_replicas.empty()) {
+          _first = _last + 2;
+          return ++_last;
+        }
+
+        _window.push_back(record);
+        return ++_last;
+      }
+
+      // append the record and wait until a quorum of the replicas has it, return false on timeout
+      bool commit(const std::string& record, std::chrono::milliseconds timeout) {
+        uint64_t lsn = append(record);
+        flush();
+
+        return wait(lsn, timeout);
+      }
+
+      // wait until a quorum of the replicas has all the records up to the number
+      bool wait(uint64_t lsn, std::chrono::milliseconds timeout) {
+        std::unique_lock<std::mutex> lock(_mutex);
+
+        return _acked_cond.wait_for(lock, timeout, [this, lsn]() { return quorum_acked() >= lsn; });
+      }
+
+      // send the unsent records to every replica, should be called periodically
+      void flush() {
+        std::vector<batch> batches;
+
+        {
+          std::lock_guard<std::mutex> guard(_mutex);
+
+          for (size_t i = 0; i < _replicas.size(); ++i) {
+            replica& r = _replicas[i];
+
+            while (!r.lagging && r.sent < _last) {
+              uint64_t first = r.sent + 1;
+              uint64_t last = std::min<uint64_t>(_last, r.sent + max_batch_records);
+
+              batches.push_back(batch(i, r.target, first, last));
+              batches.back().records.assign(_window.begin() + (first - _first), _window.begin() + (last - _first + 1));
+              r.sent = last;
+            }
+          }
+        }
+
+        for (const batch& b : batches) send(b);
+      }
+
+      // the last record a quorum of the replicas has
+      uint64_t committed() const {
+        std::lock_guard<std::mutex> guard(_mutex);
+        return quorum_acked();
+      }
+
+      // the batches sent and failed
+      uint64_t batches() const { return _batches; }
+
+      uint64_t failures() const { return _failures; }
+
+    private:
+
+      void send(const batch& b);
+
+      void on_ack(const batch& b, uint64_t acked) {
+        {
+          std::lock_guard<std::mutex> guard(_mutex);
+
+          replica* r = find(b.index, b.target);
+          if (!r) return;
+
+          if (acked > r->acked) r->acked = acked;
+          // the replica misses the records before the batch, send them again from it's ack
+          if (acked < b.last && r->sent > r->acked) r->sent = r->acked;
+
+          trim();
+        }
+
+        _acked_cond.notify_all();
+      }
+
+      void on_failure(const batch& b, int err) {
+        ++_failures;
+
+        std::lock_guard<std::mutex> guard(_mutex);
+
+        replica* r = find(b.index, b.target);
+        if (r) r->sent = r->acked;
+
+        LOG(WARNING) << "log replication to " << atlas::rpc::endpoint_to_string(b.target) << " failed, error " << err;
+      }
+
+      // the replicas may be reconfigured while the batches are in flight
+      replica* find(size_t index, atlas::rpc::endpoint_id target) {
+        if (index >= _replicas.size() || _replicas[index].target != target) return nullptr;
+        return &_replicas[index];
+      }
+
+      // the mutex is held
+      uint64_t quorum_acked() const {
+        if (_quorum == 0) return _last;
+
+        std::vector<uint64_t> acks;
+        for (const replica& r : _replicas) {
+          if (!r.lagging) acks.push_back(r.acked);
+        }
+
+        if (acks.size() < _quorum) return 0;
+
+        std::nth_element(acks.begin(), acks.begin() + (_quorum - 1), acks.end(), std::greater<uint64_t>());
+        return acks[_quorum - 1];
+      }
+
+      // drop the records every replica has, or the oldest ones if too many are kept, the mutex is held
+      void trim() {
+        uint64_t oldest = _last;
+        for (const replica& r : _replicas) {
+          if (!r.lagging) oldest = std::min(oldest, r.acked);
+        }
+
+        if (_last - oldest > max_window) {
+          oldest = _last - max_window;
+
+          for (replica& r : _replicas) {
+            if (!r.lagging && r.acked < oldest) {
+              r.lagging = true;
+              LOG(ERROR) << "replica " << atlas::rpc::endpoint_to_string(r.target) << " is lagging behind, it needs a resync";
+            }
+          }
+        }
+
+        while (_first <= oldest && !_window.empty()) {
+          _window.pop_front();
+          ++_first;
+        }
+      }
+
+    private:
+
+      mutable std::mutex _mutex;
+      std::condition_variable _acked_cond;
+
+      std::vector<replica> _replicas;
+      size_t _quorum;
+
+      // the records [_first, _last] not acked by every replica
+      std::deque<std::string> _window;
+      uint64_t _first;
+      uint64_t _last;
+
+      std::atomic<uint64_t> _batches;
+      std::atomic<uint64_t> _failures;
+    };
+
+    /*
+     * The replica side of the log replication, the records from every primary are passed to the sink in order,
+     * the duplicates are dropped, and a batch beyond the next record is ignored, it's sent again after the ack,
+     * which is always the last record passed to the sink
+     * */
+    class log_replica : public atlas::singleton<log_replica> {
+    public:
+
+      // the primary, the number and the record
+      typedef std::function<void(uint32_t, uint64_t, const std::string&)> sink_type;
+
+    private:
+
+      friend class atlas::singleton<log_replica>;
+      log_replica(const log_replica&) = delete;
+      log_replica& operator=(const log_replica&) = delete;
+
+    public:
+
+      log_replica() {}
+
+    public:
+
+      void set_sink(sink_type sink) {
+        std::lock_guard<std::mutex> guard(_mutex);
+        _sink = sink;
+      }
+
+      // return the last record applied from the primary
+      uint64_t receive(uint32_t primary, uint64_t first, const std::vector<std::string>& records) {
+        std::lock_guard<std::mutex> guard(_mutex);
+
+        uint64_t& next = _next[primary];
+        if (next == 0) next = 1;
+
+        for (size_t i = 0; i < records.size(); ++i) {
+          uint64_t lsn = first + i;
+          if (lsn != next) continue;
+
+          if (_sink) _sink(primary, lsn, records[i]);
+          ++next;
+        }
+
+        return next - 1;
+      }
+
+    private:
+
+      std::mutex _mutex;
+      sink_type _sink;
+      std::map<uint32_t, uint64_t> _next;
+    };
+
+  } // net
+
+  namespace rpc {
+
+    using atlas::rpc::rpc_result;
+    using atlas::rpc::rpc_context;
+
+    // builtin rpc
+    ATLAS_REGISTER_REMOTE_FUNC(log_replicate, -5);
+
+    class log_replication_rfc {
+    public:
+
+      // a primary streams us a batch of it's log records
+      static rpc_result replicate(uint64_t first, const std::vector<std::string>& records, rpc_context c) noexcept {
+        uint64_t acked = net::log_replica::ref().receive(atlas::rpc::endpoint_ip(c.source()), first, records);
+
+        return rpc_result(boost::lexical_cast<std::string>(acked));
+      }
+    };
+
+    ATLAS_BIND_REMOTE_FUNC(log_replicate, log_replication_rfc::replicate);
+
+  } // rpc
+
+  namespace net {
+
+    inline void log_replicator::send(const batch& b) {
+      rpc::p2p_client client(rpc::inward_client, b.target);
+      client.set_backpressure_policy(rpc::bp_fail_fast);
+
+      // the callback needs the range only
+      batch range(b.index, b.target, b.first, b.last);
+
+      atlas::rpc::rpc_callback_type cb = [this, range](const std::string& data, int err, atlas::rpc::async_task&) {
+        if (err) {
+          on_failure(range, err);
+          return;
+        }
+
+        try {
+          on_ack(range, boost::lexical_cast<uint64_t>(data));
+        }
+        catch (const boost::bad_lexical_cast&) {
+          on_failure(range, atlas::rpc::rpc_unreachable);
+        }
+      };
+
+      client.call(rpc::log_replication_rfc::replicate, rpc::fn_ids::log_replicate, cb, b.first, b.records,
+          atlas::rpc::nilctx);
+
+      ++_batches;
+    }
+
+  } // net
+} // pioneer
+
+#endif /* PIONEER_NET_LOG_REPLICATION_H_ */
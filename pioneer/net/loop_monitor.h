@@ -0,0 +1,252 @@
+/*
+ * loop_monitor.h
+ *
+ *  Created on: Sep 6, 2013
+ *      Author: vincent
+ */
+
+/*    Copyright 2011 ~ 2013 Vincent Zhang, ivincent.zhang@gmail.com
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#ifndef PIONEER_NET_LOOP_MONITOR_H_
+#define PIONEER_NET_LOOP_MONITOR_H_
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <boost/bind.hpp>
+#include <boost/function.hpp>
+#include <muduo/base/Timestamp.h>
+#include <muduo/net/EventLoop.h>
+#include <atlas/singleton.h>
+
+#include <pioneer/system/numa.h>
+#include <pioneer/system/profiler.h>
+
+namespace pioneer {
+  namespace net {
+
+    namespace mn = muduo::net;
+
+    /*
+     * The utilization of an event loop, muduo::perf_counter is process wide, so the loops overwrite each other.
+     *
+     * The loop is busy from the return of the poll to the end of the last callback of the iteration, see
+     * loop_busy_scope, so the reads done by muduo before the message callbacks are counted too, the rest of the
+     * iteration is the poll wait. The loop samples itself every sample_interval seconds in it's own thread, the
+     * others read the atomics only
+     * */
+    class loop_monitor : public std::enable_shared_from_this<loop_monitor> {
+    public:
+
+      loop_monitor(const std::string& name, mn::EventLoop* loop) :
+          _name(name), _loop(loop), _iteration(-1), _mark(0), _busy(0), _callbacks(0), _utilization(0),
+          _events_per_iteration(0), _last_sample(muduo::Timestamp::now().microSecondsSinceEpoch()),
+          _last_busy(0), _last_callbacks(0), _last_iteration(0) {
+      }
+
+      loop_monitor(const loop_monitor&) = delete;
+      loop_monitor& operator=(const loop_monitor&) = delete;
+
+    public:
+
+      static const int sample_interval = 1;
+
+      // attach to the calling thread, it's the thread of the loop, the sampling timer keeps the monitor alive
+      // as long as the loop
+      void attach() {
+        current() = this;
+        _loop->runEvery(sample_interval, boost::bind(&loop_monitor::sample, shared_from_this()));
+      }
+
+      // the monitor of the loop the calling thread runs, if any
+      static loop_monitor*& current() {
+        static __thread loop_monitor* m = nullptr;
+        return m;
+      }
+
+      // called at the end of every callback in the loop thread
+      void end_callback() {
+        int64_t now = muduo::Timestamp::now().microSecondsSinceEpoch();
+
+        // the first callback of the iteration counts from the return of the poll
+        int64_t iteration = _loop->iteration();
+        if (iteration != _iteration) {
+          _iteration = iteration;
+          _mark = _loop->pollReturnTime().microSecondsSinceEpoch();
+        }
+
+        if (now > _mark) _busy.store(_busy.load(std::memory_order_relaxed) + (now - _mark), std::memory_order_relaxed);
+        _mark = now;
+
+        _callbacks.store(_callbacks.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+      }
+
+    public:
+
+      const std::string& name() const { return _name; }
+
+      mn::EventLoop* loop() const { return _loop; }
+
+      // in seconds since the loop started
+      double busy_seconds() const { return _busy.load(std::memory_order_relaxed) / 1e6; }
+
+      unsigned long long callbacks() const { return _callbacks.load(std::memory_order_relaxed); }
+
+      // the busy time of the last sample interval, 0 ~ 1
+      double utilization() const { return _utilization.load(std::memory_order_relaxed); }
+
+      double events_per_iteration() const { return _events_per_iteration.load(std::memory_order_relaxed); }
+
+      // the functors queued by runInLoop and queueInLoop, not run yet, a loop_queue counts as one drain
+      size_t pending_functors() const { return _loop->queueSize(); }
+
+    private:
+
+      void sample() {
+        int64_t now = muduo::Timestamp::now().microSecondsSinceEpoch();
+        int64_t busy = _busy.load(std::memory_order_relaxed);
+        int64_t callbacks = _callbacks.load(std::memory_order_relaxed);
+        int64_t iteration = _loop->iteration();
+
+        if (now > _last_sample) {
+          double u = 1.0 * (busy - _last_busy) / (now - _last_sample);
+          _utilization.store(u < 1 ? u : 1, std::memory_order_relaxed);
+        }
+        if (iteration > _last_iteration) {
+          _events_per_iteration.store(1.0 * (callbacks - _last_callbacks) / (iteration - _last_iteration),
+              std::memory_order_relaxed);
+        }
+
+        _last_sample = now;
+        _last_busy = busy;
+        _last_callbacks = callbacks;
+        _last_iteration = iteration;
+      }
+
+    private:
+
+      std::string _name;
+      mn::EventLoop* _loop;
+
+      // the loop thread only
+      int64_t _iteration;
+      int64_t _mark;
+
+      // in microseconds
+      std::atomic<int64_t> _busy;
+      std::atomic<int64_t> _callbacks;
+
+      std::atomic<double> _utilization;
+      std::atomic<double> _events_per_iteration;
+
+      // the loop thread only, the last sample
+      int64_t _last_sample;
+      int64_t _last_busy;
+      int64_t _last_callbacks;
+      int64_t _last_iteration;
+    };
+
+    // put at the beginning of the callbacks run by the loops, it does nothing in a thread without a monitor
+    class loop_busy_scope {
+    public:
+
+      loop_busy_scope() = default;
+
+      loop_busy_scope(const loop_busy_scope&) = delete;
+      loop_busy_scope& operator=(const loop_busy_scope&) = delete;
+
+      ~loop_busy_scope() {
+        loop_monitor* m = loop_monitor::current();
+        if (m) m->end_callback();
+      }
+    };
+
+    /*
+     * The event loops reported by the metrics, a loop is registered by the thread which runs it, before it runs.
+     * A loop is reported while it's owner is alive, the owner of the I/O loops of a server is a token destroyed
+     * before the server, see io_loops
+     * */
+    class loop_registry : public atlas::singleton<loop_registry> {
+    private:
+
+      friend class atlas::singleton<loop_registry>;
+      loop_registry(const loop_registry&) = delete;
+      loop_registry& operator=(const loop_registry&) = delete;
+
+    public:
+
+      struct entry_type {
+        std::weak_ptr<void> owner;
+        std::shared_ptr<loop_monitor> monitor;
+      };
+
+      typedef boost::function<void(mn::EventLoop*)> thread_init_callback;
+
+      loop_registry() = default;
+
+    public:
+
+      void add(const std::string& name, const std::shared_ptr<mn::EventLoop>& loop) {
+        add(name, loop.get(), loop);
+      }
+
+      // the thread is named after the loop as well, see system::thread_role
+      void add(const std::string& name, mn::EventLoop* loop, const std::shared_ptr<void>& owner) {
+        system::set_thread_name(name);
+
+        entry_type e = { owner, std::make_shared<loop_monitor>(name, loop) };
+        e.monitor->attach();
+
+        std::lock_guard<std::mutex> guard(_mutex);
+
+        // drop the loops gone
+        _loops.erase(std::remove_if(_loops.begin(), _loops.end(), [](const entry_type& l) { return l.owner.expired(); }),
+            _loops.end());
+        _loops.push_back(e);
+      }
+
+      // the thread init callback of a server, which registers it's I/O loops as "name 0", "name 1" and so on
+      thread_init_callback io_loops(const std::string& name, const std::shared_ptr<void>& owner) {
+        auto next = std::make_shared<std::atomic<int>>(0);
+        std::weak_ptr<void> weak_owner = owner;
+
+        return [this, name, weak_owner, next](mn::EventLoop* loop) {
+          system::numa_placement::ref().place_io_thread();
+
+          std::shared_ptr<void> owner = weak_owner.lock();
+          if (owner) add(name + " " + std::to_string(next->fetch_add(1)), loop, owner);
+        };
+      }
+
+      std::vector<entry_type> loops() const {
+        std::lock_guard<std::mutex> guard(_mutex);
+        return _loops;
+      }
+
+    private:
+
+      mutable std::mutex _mutex;
+      std::vector<entry_type> _loops;
+    };
+
+  } // net
+} // pioneer
+
+#endif /* PIONEER_NET_LOOP_MONITOR_H_ */
@@ -0,0 +1,136 @@
+/*
+ * loop_queue.h
+ *
+ *  Created on: Sep 18, 2013
+ *      Author: vincent
+ */
+
+/*    Copyright 2011 ~ 2013 Vincent Zhang, ivincent.zhang@gmail.com
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#ifndef PIONEER_NET_LOOP_QUEUE_H_
+#define PIONEER_NET_LOOP_QUEUE_H_
+
+#include <atomic>
+#include <functional>
+#include <memory>
+
+#include <boost/bind.hpp>
+#include <muduo/net/EventLoop.h>
+
+#include <atlas/container/mpsc_queue.h>
+
+namespace pioneer {
+  namespace net {
+
+    namespace mn = muduo::net;
+
+    /*
+     * The functors posted to a loop by many threads, without any lock, in the order they are posted.
+     *
+     * muduo's runInLoop appends a functor under the loop's mutex and writes the loop's eventfd for every post,
+     * so the senders of a loop contend on the mutex. A post here is a push into atlas::mpsc_queue, one exchange,
+     * and only the post which finds the queue idle hands a drain over to the loop by queueInLoop, the posts
+     * made before the drain runs ride along, so there is one lock and one wakeup per drain whatever the number
+     * of the senders.
+     *
+     * The loop can not tell us whether it sleeps, muduo is prebuilt, the drain scheduled is the next best thing,
+     * a loop busy with a drain is not woken up again.
+     *
+     * The queue outlives it's owner until the drain scheduled runs, the functors not run when the loop
+     * quits are destroyed with the queue. A functor may be run once a drain is over, so the work of the functors
+     * drained together can be done once, for example, the writes of the frames to a connection, see set_on_drained
+     * */
+    class loop_queue {
+    public:
+
+      typedef std::function<void()> functor;
+
+    private:
+
+      struct impl {
+        explicit impl(mn::EventLoop* loop) : loop(loop), scheduled(false), draining(false) {}
+
+        mn::EventLoop* loop;
+        atlas::mpsc_queue<functor> functors;
+
+        // a drain is queued in the loop and not started yet
+        std::atomic<bool> scheduled;
+        // the loop thread only
+        bool draining;
+        functor on_drained;
+      };
+
+    public:
+
+      explicit loop_queue(mn::EventLoop* loop) : _impl(std::make_shared<impl>(loop)) {}
+
+      loop_queue(const loop_queue&) = delete;
+      loop_queue& operator=(const loop_queue&) = delete;
+
+    public:
+
+      mn::EventLoop* loop() const { return _impl->loop; }
+
+      // in the loop thread after every drain, set it before the first post, it must not hold the owner
+      void set_on_drained(const functor& f) { _impl->on_drained = f; }
+
+      // a functor posted now runs in the calling thread, before returning
+      bool runs_inline() const {
+        return _impl->loop->isInLoopThread() && !_impl->draining && !_impl->scheduled.load(std::memory_order_acquire);
+      }
+
+      // as runInLoop, it runs in the calling thread if it's the loop's, unless the functors posted before are
+      // not run yet, then it runs after them
+      template<typename Functor>
+      void post(Functor&& f) {
+        if (runs_inline()) {
+          f();
+          return;
+        }
+
+        _impl->functors.push(functor(std::forward<Functor>(f)));
+
+        if (!_impl->scheduled.exchange(true, std::memory_order_acq_rel)) {
+          _impl->loop->queueInLoop(boost::bind(&loop_queue::drain, _impl));
+        }
+      }
+
+    private:
+
+      // in the loop thread, the posts after the flag is cleared schedule the next drain, so does a post
+      // which is half done when the queue looks empty
+      static void drain(const std::shared_ptr<impl>& q) {
+        q->scheduled.exchange(false, std::memory_order_acq_rel);
+
+        q->draining = true;
+        functor f;
+        while (q->functors.pop(f)) {
+          f();
+        }
+        q->draining = false;
+
+        if (q->on_drained) q->on_drained();
+      }
+
+    private:
+
+      std::shared_ptr<impl> _impl;
+    };
+
+  } // net
+} // pioneer
+
+#endif /* PIONEER_NET_LOOP_QUEUE_H_ */
@@ -0,0 +1,476 @@
+/*
+ * loop_timers.h
+ *
+ *  Created on: Sep 19, 2013
+ *      Author: vincent
+ */
+
+/*    Copyright 2011 ~ 2013 Vincent Zhang, ivincent.zhang@gmail.com
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#ifndef PIONEER_NET_LOOP_TIMERS_H_
+#define PIONEER_NET_LOOP_TIMERS_H_
+
+#include <cstdint>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include <muduo/net/EventLoop.h>
+
+namespace pioneer {
+  namespace net {
+
+    namespace mn = muduo::net;
+
+    /*
+     * The timers of a loop in a hierarchical timing wheel, as runAfter, runEvery and cancel of the loop.
+     *
+     * muduo's TimerQueue keeps every timer in a std::set, O(log n) and an allocation for each timer, and it's
+     * linked prebuilt, so the wheel sits beside it. Four levels of 256 slots cover 2^32 ticks, a timer is put
+     * into the slot of it's expiration on the level which it's distance falls into and is moved one level down
+     * when the lower level comes around, so add and cancel are O(1), a timer is moved at most three times.
+     * The nodes come from a slab which is never given back until the wheel is gone, a stale timer_id reads a
+     * node which is reused or free, the sequence tells.
+     *
+     * The wheel takes one muduo timer at a time, armed for the next slot which is not empty, or the next slot
+     * which moves the timers down, and none when the wheel is empty.
+     *
+     * Safe to call from other threads, the timers are linked in the loop, the functors run in the loop.
+     * The slab is locked to take a node, it's uncontended when the timers are made in the loop, as they mostly are.
+     * When the wheel is destroyed out of the loop, the timers not run are dropped at the next tick
+     * */
+    class loop_timers {
+    public:
+
+      typedef std::function<void()> functor;
+      typedef std::chrono::steady_clock clock;
+
+      enum { level_bits = 8, slot_count = 1 << level_bits, level_count = 4 };
+
+    private:
+
+      struct node {
+        enum state_type { free, pending, linked, running, cancelled };
+
+        node() : next(nullptr), pprev(nullptr), expire(0), interval(0), seq(0), state(free) {}
+
+        node* next;
+        node** pprev;
+
+        // in ticks
+        int64_t expire;
+        int64_t interval;
+
+        uint64_t seq;
+        state_type state;
+
+        functor f;
+      };
+
+    public:
+
+      class timer_id {
+      public:
+
+        timer_id() : _node(nullptr), _seq(0) {}
+
+        bool valid() const { return _node != nullptr; }
+
+      private:
+
+        friend class loop_timers;
+        timer_id(node* n, uint64_t seq) : _node(n), _seq(seq) {}
+
+        node* _node;
+        uint64_t _seq;
+      };
+
+    private:
+
+      struct impl : public std::enable_shared_from_this<impl> {
+        impl(mn::EventLoop* loop, clock::duration tick) :
+          loop(loop), tick(tick), start(clock::now()), current(0), count(0),
+          wakeup_tick(-1), advancing(false), closed(false), free_list(nullptr), next_seq(0)
+        {
+          for (auto& level : slots) {
+            for (node*& head : level) head = nullptr;
+          }
+        }
+
+        // any thread
+        node* alloc(functor&& f, int64_t expire, int64_t interval) {
+          node* n = nullptr;
+          {
+            std::lock_guard<std::mutex> guard(slab_mutex);
+
+            if (!free_list) {
+              chunks.emplace_back(new node[chunk_size]);
+              node* chunk = chunks.back().get();
+              for (size_t i = 0; i < chunk_size; ++i) {
+                chunk[i].next = free_list;
+                free_list = &chunk[i];
+              }
+            }
+
+            n = free_list;
+            free_list = n->next;
+
+            n->seq = ++next_seq;
+            n->state = node::pending;
+          }
+
+          n->next = nullptr;
+          n->pprev = nullptr;
+          n->expire = expire;
+          n->interval = interval;
+          n->f = std::move(f);
+
+          return n;
+        }
+
+        // the loop thread, or the last owner
+        void release(node* n) {
+          // the functor may hold the last reference of something which calls us back, destroy it first
+          functor f;
+          f.swap(n->f);
+          f = nullptr;
+
+          std::lock_guard<std::mutex> guard(slab_mutex);
+
+          n->state = node::free;
+          n->next = free_list;
+          free_list = n;
+        }
+
+        int64_t now_tick() const {
+          clock::duration d = clock::now() - start;
+          return d.count() > 0 ? d / tick : 0;
+        }
+
+        // the loop thread
+        void link(node* n) {
+          int64_t e = n->expire < current ? current : n->expire;
+          int64_t delta = e - current;
+
+          int level = 0;
+          while (level < level_count - 1 && delta >= (int64_t(1) << (level_bits * (level + 1)))) ++level;
+
+          // beyond the wheel, it's moved down from the top level again when it comes around
+          if (level == level_count - 1 && delta >= (int64_t(1) << (level_bits * level_count))) {
+            e = current + (int64_t(1) << (level_bits * level_count)) - 1;
+          }
+
+          node*& head = slots[level][(e >> (level_bits * level)) & (slot_count - 1)];
+
+          n->next = head;
+          if (head) head->pprev = &n->next;
+          head = n;
+          n->pprev = &head;
+
+          n->state = node::linked;
+        }
+
+        static void unlink(node* n) {
+          *n->pprev = n->next;
+          if (n->next) n->next->pprev = n->pprev;
+
+          n->next = nullptr;
+          n->pprev = nullptr;
+        }
+
+        void add(node* n) {
+          if (closed.load(std::memory_order_acquire) || n->state == node::cancelled) {
+            release(n);
+            return;
+          }
+
+          // the wheel stops turning when it's empty, catch up at once rather than tick by tick
+          if (count.load(std::memory_order_relaxed) == 0 && !advancing) {
+            int64_t now = now_tick();
+            if (current < now) current = now;
+          }
+
+          link(n);
+          count.fetch_add(1, std::memory_order_relaxed);
+
+          // the armed muduo timer comes before this one, or the wheel is re-armed after the tick in progress
+          if (advancing) return;
+          if (wakeup_tick >= 0 && n->expire >= wakeup_tick) return;
+
+          arm();
+        }
+
+        void cancel(node* n, uint64_t seq) {
+          // the node may be taken by another thread just now
+          {
+            std::lock_guard<std::mutex> guard(slab_mutex);
+            if (n->seq != seq || n->state == node::free) return;
+          }
+
+          switch (n->state) {
+          case node::linked:
+            unlink(n);
+            count.fetch_sub(1, std::memory_order_relaxed);
+            release(n);
+            break;
+          case node::pending:
+          case node::running:
+            // the add in flight drops it, the periodic one in it's callback is not linked again
+            n->state = node::cancelled;
+            break;
+          default:
+            break;
+          }
+        }
+
+        // move the timers of a slot of an upper level down, relative to the current tick
+        void cascade(int level) {
+          node*& slot = slots[level][(current >> (level_bits * level)) & (slot_count - 1)];
+
+          node* head = slot;
+          slot = nullptr;
+          if (head) head->pprev = &head;
+
+          while (node* n = head) {
+            unlink(n);
+            link(n);
+          }
+        }
+
+        void advance(int64_t now) {
+          advancing = true;
+
+          while (current <= now) {
+            if (count.load(std::memory_order_relaxed) == 0) {
+              current = now + 1;
+              break;
+            }
+
+            int64_t t = current;
+            for (int level = 1; level < level_count; ++level) {
+              if ((t >> (level_bits * (level - 1))) & (slot_count - 1)) break;
+              cascade(level);
+            }
+
+            node*& slot = slots[0][t & (slot_count - 1)];
+
+            // the expired ones are taken out first, so the ones added by the callbacks go to the ticks after
+            node* head = slot;
+            slot = nullptr;
+            if (head) head->pprev = &head;
+
+            current = t + 1;
+
+            while (node* n = head) {
+              unlink(n);
+
+              // put at the edge of the wheel, not due yet
+              if (n->expire > t) {
+                link(n);
+                continue;
+              }
+
+              count.fetch_sub(1, std::memory_order_relaxed);
+
+              n->state = node::running;
+              n->f();
+
+              if (n->state == node::cancelled || n->interval == 0 || closed.load(std::memory_order_acquire)) {
+                release(n);
+                continue;
+              }
+
+              n->expire = t + n->interval;
+              link(n);
+              count.fetch_add(1, std::memory_order_relaxed);
+            }
+          }
+
+          advancing = false;
+        }
+
+        // the next tick which has something to do, the lowest level is never empty across the slots to come
+        int64_t next_tick() const {
+          for (int64_t d = 0; d < slot_count; ++d) {
+            int64_t t = current + d;
+            if ((t & (slot_count - 1)) == 0) return t;
+            if (slots[0][t & (slot_count - 1)]) return t;
+          }
+
+          return current + slot_count;
+        }
+
+        void arm() {
+          if (wakeup_tick >= 0) {
+            loop->cancel(wakeup_timer);
+            wakeup_tick = -1;
+          }
+
+          if (count.load(std::memory_order_relaxed) == 0) return;
+
+          wakeup_tick = next_tick();
+
+          clock::duration d = start + tick * wakeup_tick - clock::now();
+          int64_t us = std::chrono::duration_cast<std::chrono::microseconds>(d).count() + 1;
+
+          std::shared_ptr<impl> self = shared_from_this();
+          wakeup_timer = loop->runAfter(us > 0 ? us / 1000000.0 : 0.0, [self]() { self->on_tick(); });
+        }
+
+        void on_tick() {
+          wakeup_tick = -1;
+
+          if (closed.load(std::memory_order_acquire)) {
+            clear();
+            return;
+          }
+
+          advance(now_tick());
+          arm();
+        }
+
+        void clear() {
+          for (auto& level : slots) {
+            for (node*& head : level) {
+              while (node* n = head) {
+                unlink(n);
+                release(n);
+              }
+            }
+          }
+
+          count.store(0, std::memory_order_relaxed);
+        }
+
+        static const size_t chunk_size = 256;
+
+        mn::EventLoop* loop;
+
+        const clock::duration tick;
+        const clock::time_point start;
+
+        // the loop thread only, the next tick to process
+        int64_t current;
+        node* slots[level_count][slot_count];
+
+        // the linked timers
+        std::atomic<size_t> count;
+
+        // the tick which the muduo timer is armed for, -1 if none
+        int64_t wakeup_tick;
+        mn::TimerId wakeup_timer;
+        bool advancing;
+
+        std::atomic<bool> closed;
+
+        std::mutex slab_mutex;
+        std::vector<std::unique_ptr<node[]>> chunks;
+        node* free_list;
+        uint64_t next_seq;
+      };
+
+    public:
+
+      explicit loop_timers(mn::EventLoop* loop, clock::duration tick = std::chrono::milliseconds(1)) :
+        _impl(std::make_shared<impl>(loop, tick))
+      {}
+
+      ~loop_timers() {
+        if (_impl->loop->isInLoopThread()) {
+          if (_impl->wakeup_tick >= 0) _impl->loop->cancel(_impl->wakeup_timer);
+          _impl->wakeup_tick = -1;
+          _impl->clear();
+        }
+
+        _impl->closed.store(true, std::memory_order_release);
+      }
+
+      loop_timers(const loop_timers&) = delete;
+      loop_timers& operator=(const loop_timers&) = delete;
+
+    public:
+
+      mn::EventLoop* loop() const { return _impl->loop; }
+
+      clock::duration tick() const { return _impl->tick; }
+
+      // the timers linked in the wheel, not the ones in flight from the other threads
+      size_t size() const { return _impl->count.load(std::memory_order_relaxed); }
+
+      // run f after delay seconds, no earlier, at most one tick later
+      timer_id run_after(double delay, functor f) {
+        return schedule(delay, 0, std::move(f));
+      }
+
+      // run f every interval seconds, the first run is interval seconds later
+      timer_id run_every(double interval, functor f) {
+        int64_t ticks = to_ticks(interval);
+        return schedule(interval, ticks > 0 ? ticks : 1, std::move(f));
+      }
+
+      void cancel(timer_id id) {
+        if (!id.valid()) return;
+
+        if (_impl->loop->isInLoopThread()) {
+          _impl->cancel(id._node, id._seq);
+          return;
+        }
+
+        std::shared_ptr<impl> q = _impl;
+        _impl->loop->runInLoop([q, id]() { q->cancel(id._node, id._seq); });
+      }
+
+    private:
+
+      int64_t to_ticks(double seconds) const {
+        if (seconds <= 0) return 0;
+
+        std::chrono::duration<double> d(seconds);
+        return static_cast<int64_t>(d / _impl->tick);
+      }
+
+      timer_id schedule(double delay, int64_t interval, functor&& f) {
+        // the first tick after the deadline, a partial tick is never rounded down
+        std::chrono::duration<double> d(delay > 0 ? delay : 0);
+        clock::duration at = (clock::now() - _impl->start) + std::chrono::duration_cast<clock::duration>(d);
+        int64_t expire = at / _impl->tick + 1;
+
+        node* n = _impl->alloc(std::move(f), expire, interval);
+        timer_id id(n, n->seq);
+
+        if (_impl->loop->isInLoopThread()) {
+          _impl->add(n);
+        }
+        else {
+          std::shared_ptr<impl> q = _impl;
+          _impl->loop->runInLoop([q, n]() { q->add(n); });
+        }
+
+        return id;
+      }
+
+    private:
+
+      std::shared_ptr<impl> _impl;
+    };
+
+  } // net
+} // pioneer
+
+#endif /* PIONEER_NET_LOOP_TIMERS_H_ */
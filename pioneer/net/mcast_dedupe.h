@@ -0,0 +1,228 @@
+/*
+ * mcast_dedupe.h
+ *
+ *  Created on: Sep 28, 2013
+ *      Author: vincent
+ */
+
+/*    Copyright 2011 ~ 2013 Vincent Zhang, ivincent.zhang@gmail.com
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#ifndef PIONEER_NET_MCAST_DEDUPE_H_
+#define PIONEER_NET_MCAST_DEDUPE_H_
+
+#include <cstddef>
+#include <cstring>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <sstream>
+#include <string>
+
+#include <atlas/singleton.h>
+#include <atlas/rpc.h>
+
+namespace pioneer {
+  namespace net {
+
+    /*
+     * The multicast datagrams seen lately, by the session id of their first frame, so a datagram delivered
+     * twice, by the network or by a sender sending it again, is run once. Every frame is given a new session id
+     * when it's built, and a datagram always starts at the first frame of a send, see udp_sender::send_batch,
+     * so the first session id tells the datagram.
+     *
+     * The ids are kept in two Bloom filters, the current one takes the new ids, and both are looked up, the older
+     * one is cleared and becomes the current one once the window passes, or the current one holds max_entries,
+     * so an id is remembered for a window at least, unless the rate is so high the filters fill faster. A false
+     * positive drops a datagram which is not a duplicate, it's about 1 in 40000 at the most, both filters full,
+     * below the loss of the plain UDP, and the reliable multicast drops it's duplicates exactly anyway.
+     *
+     * With the self suppression, the sends of this node to the cluster group are remembered too, so their copies
+     * looped back are dropped, and the local delivery runs the node's own copy, see rpc::mcast_client
+     * */
+    class mcast_dedupe : public atlas::singleton<mcast_dedupe> {
+    public:
+
+      // 512KB a filter, the 32 bits an entry and the 7 hashes keep the false positives about 1 in 90000 a full filter
+      static const size_t filter_bits = 1 << 22;
+      static const size_t max_entries = filter_bits / 32;
+      static const int hashes = 7;
+
+    private:
+
+      struct filter {
+        filter() : words(new std::atomic<uint64_t>[filter_bits / 64]), entries(0) { clear(); }
+
+        void clear() {
+          for (size_t i = 0; i < filter_bits / 64; ++i) words[i].store(0, std::memory_order_relaxed);
+          entries.store(0, std::memory_order_relaxed);
+        }
+
+        std::unique_ptr<std::atomic<uint64_t>[]> words;
+        std::atomic<size_t> entries;
+      };
+
+      friend class atlas::singleton<mcast_dedupe>;
+      mcast_dedupe(const mcast_dedupe&) = delete;
+      mcast_dedupe& operator=(const mcast_dedupe&) = delete;
+
+    public:
+
+      // public for std::make_shared, see atlas::singleton
+      mcast_dedupe() : _enabled(true), _suppress_self(false), _window(std::chrono::milliseconds(500)),
+        _current(0), _rotated(std::chrono::steady_clock::now()), _ticks(0), _passed(0), _dropped(0), _own(0) {}
+
+    public:
+
+      void set_enabled(bool enabled) { _enabled = enabled; }
+
+      bool enabled() const { return _enabled.load(std::memory_order_relaxed); }
+
+      void set_suppress_self(bool suppress) { _suppress_self = suppress; }
+
+      bool suppress_self() const { return _suppress_self.load(std::memory_order_relaxed); }
+
+      // how long a datagram is remembered at least, before startup
+      void set_window(std::chrono::milliseconds window) { _window = window; }
+
+      // a message this node multicasts to the cluster group, it's first frame is remembered to drop the copy looped back, thread safe
+      void sent(const char* message, size_t size) {
+        if (!suppress_self() || !enabled()) return;
+
+        uint64_t h1, h2;
+        if (!hash(message, size, h1, h2)) return;
+
+        insert(_filters[_current.load(std::memory_order_acquire)], h1, h2);
+        ++_own;
+      }
+
+      /*
+       * True if the datagram, or the message reassembled, is seen in the window, it's remembered otherwise. The
+       * receiving loop only, the data is not copied, a datagram which does not start with a frame is never dropped
+       * */
+      bool duplicate(const char* data, size_t size) {
+        if (!enabled()) return false;
+
+        uint64_t h1, h2;
+        if (!hash(data, size, h1, h2)) return false;
+
+        rotate();
+
+        size_t current = _current.load(std::memory_order_relaxed);
+        if (contains(_filters[current], h1, h2) || contains(_filters[1 - current], h1, h2)) {
+          ++_dropped;
+          return true;
+        }
+
+        insert(_filters[current], h1, h2);
+        ++_passed;
+
+        return false;
+      }
+
+      uint64_t passed() const { return _passed.load(std::memory_order_relaxed); }
+
+      uint64_t dropped() const { return _dropped.load(std::memory_order_relaxed); }
+
+      std::string str() const {
+        std::ostringstream os;
+        os << "enabled : " << std::boolalpha << enabled() << "\n"
+            << "suppress self : " << suppress_self() << "\n"
+            << "window : " << _window.count() << " ms\n"
+            << "passed : " << passed() << " datagrams\n"
+            << "dropped : " << dropped() << " datagrams, the copies of this node's own sends included\n"
+            << "own : " << _own.load(std::memory_order_relaxed) << " sends remembered\n";
+
+        return os.str();
+      }
+
+    private:
+
+      // the two halves of the session id mixed, the other hashes are derived from them, see Kirsch and Mitzenmacher
+      static bool hash(const char* data, size_t size, uint64_t& h1, uint64_t& h2) {
+        if (size < sizeof(atlas::rpc::request_header) || !atlas::rpc::message::known_version(data, size)) return false;
+
+        uint64_t halves[2];
+        std::memcpy(halves, data + offsetof(atlas::rpc::request_header, session_id), sizeof(halves));
+
+        h1 = mix(halves[0] ^ mix(halves[1]));
+        h2 = mix(h1 ^ halves[1]) | 1;
+
+        return true;
+      }
+
+      static uint64_t mix(uint64_t x) {
+        x ^= x >> 33;
+        x *= 0xff51afd7ed558ccdULL;
+        x ^= x >> 33;
+        x *= 0xc4ceb9fe1a85ec53ULL;
+        x ^= x >> 33;
+
+        return x;
+      }
+
+      static void insert(filter& f, uint64_t h1, uint64_t h2) {
+        for (int i = 0; i < hashes; ++i) {
+          size_t bit = (h1 + i * h2) & (filter_bits - 1);
+          f.words[bit / 64].fetch_or(uint64_t(1) << (bit % 64), std::memory_order_relaxed);
+        }
+
+        f.entries.fetch_add(1, std::memory_order_relaxed);
+      }
+
+      static bool contains(const filter& f, uint64_t h1, uint64_t h2) {
+        for (int i = 0; i < hashes; ++i) {
+          size_t bit = (h1 + i * h2) & (filter_bits - 1);
+          if (!(f.words[bit / 64].load(std::memory_order_relaxed) & (uint64_t(1) << (bit % 64)))) return false;
+        }
+
+        return true;
+      }
+
+      // the senders insert into the current filter only, so the older one is cleared while they insert
+      void rotate() {
+        size_t current = _current.load(std::memory_order_relaxed);
+        if (_filters[current].entries.load(std::memory_order_relaxed) < max_entries) {
+          // the clock is read once in 64 datagrams
+          if ((++_ticks & 63) || std::chrono::steady_clock::now() - _rotated < _window) return;
+        }
+
+        _filters[1 - current].clear();
+        _current.store(1 - current, std::memory_order_release);
+        _rotated = std::chrono::steady_clock::now();
+      }
+
+    private:
+
+      std::atomic<bool> _enabled;
+      std::atomic<bool> _suppress_self;
+      std::chrono::milliseconds _window;
+
+      filter _filters[2];
+      std::atomic<size_t> _current;
+
+      // the receiving loop only
+      std::chrono::steady_clock::time_point _rotated;
+      uint32_t _ticks;
+
+      std::atomic<uint64_t> _passed;
+      std::atomic<uint64_t> _dropped;
+      std::atomic<uint64_t> _own;
+    };
+
+  } // net
+} // pioneer
+
+#endif /* PIONEER_NET_MCAST_DEDUPE_H_ */
@@ -0,0 +1,176 @@
+/*
+ * mcast_tasks.h
+ *
+ *  Created on: Sep 3, 2013
+ *      Author: vincent
+ */
+
+/*    Copyright 2011 ~ 2013 Vincent Zhang, ivincent.zhang@gmail.com
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#ifndef PIONEER_NET_MCAST_TASKS_H_
+#define PIONEER_NET_MCAST_TASKS_H_
+
+#include <cstring>
+#include <atomic>
+#include <chrono>
+#include <memory>
+
+#include <glog/logging.h>
+#include <atlas/singleton.h>
+#include <atlas/rpc.h>
+
+#include <pioneer/system/thread_pool.h>
+#include <pioneer/net/ip.h>
+#include <pioneer/net/multicast.h>
+#include <pioneer/net/request.h>
+#include <pioneer/net/rx_timestamps.h>
+
+namespace pioneer {
+  namespace net {
+
+    /*
+     * The allocation free path of the multicast requests.
+     *
+     * A datagram is copied into a slot of a fixed ring, and the worker pool gets a task holding nothing but
+     * the slot pointer, which the std::function keeps in place. The worker decodes the frames from the slot,
+     * executes them without sessions, since a multicast request is never continued by a later request,
+     * and frees the slot. The slots are allocated once, if they are all busy, the caller takes the
+     * allocating path, see message_handler::on_mcast_batch
+     * */
+    class mcast_task_ring : public atlas::singleton<mcast_task_ring> {
+    public:
+
+      static const size_t slot_count = 1024;
+
+      struct slot {
+        std::atomic<bool> busy;
+        atlas::rpc::endpoint_id source;
+        // the receive stamp and the dispatch, see request::record_waits
+        int64_t received;
+        int64_t receive_wait;
+        std::chrono::steady_clock::time_point dispatched;
+        size_t size;
+        char data[MESSAGE_BUFFER_SIZE];
+      };
+
+    private:
+
+      friend class atlas::singleton<mcast_task_ring>;
+      mcast_task_ring(const mcast_task_ring&) = delete;
+      mcast_task_ring& operator=(const mcast_task_ring&) = delete;
+
+    public:
+
+      mcast_task_ring() : _slots(new slot[slot_count]), _cursor(0) {
+        for (size_t i = 0; i < slot_count; ++i) _slots[i].busy = false;
+      }
+
+    public:
+
+      /*
+       * Copy the datagram into a free slot and schedule it, return false if there is no free slot.
+       * For multicast, the responses go to any connection of the source node, so the port is dropped
+       * */
+      bool schedule(const sockaddr_in& from, const char* data, size_t size) {
+        if (size > static_cast<size_t>(MESSAGE_BUFFER_SIZE)) return false;
+
+        slot* s = acquire();
+        if (!s) return false;
+
+        s->source = atlas::rpc::make_endpoint(atlas::rpc::endpoint_ip(ip::to_endpoint(from)), 0);
+        s->received = rx_timestamps::current();
+        s->receive_wait = rx_timestamps::since(s->received);
+        s->dispatched = std::chrono::steady_clock::now();
+        s->size = size;
+        std::memcpy(s->data, data, size);
+
+        if (system::worker_settings::run_inline) {
+          execute(s);
+          return true;
+        }
+
+        if (!system::worker_pool::ref().schedule([s]() { mcast_task_ring::execute(s); })) {
+          release(s);
+          return false;
+        }
+
+        return true;
+      }
+
+    private:
+
+      // any thread, a slot is taken by the one who flips it's busy flag
+      slot* acquire() {
+        for (size_t i = 0; i < slot_count; ++i) {
+          slot& s = _slots[_cursor.fetch_add(1, std::memory_order_relaxed) % slot_count];
+
+          bool busy = false;
+          if (s.busy.compare_exchange_strong(busy, true, std::memory_order_acquire)) return &s;
+        }
+
+        return nullptr;
+      }
+
+      static void release(slot* s) { s->busy.store(false, std::memory_order_release); }
+
+      // the sender may pack several frames into one datagram, see mcast_client
+      static void execute(slot* s) noexcept {
+        const char* frame = s->data;
+        const char* end = s->data + s->size;
+
+        while (frame < end) {
+          int32_t frame_size = 0;
+          if (end - frame >= static_cast<ptrdiff_t>(sizeof(int32_t))) std::memcpy(&frame_size, frame, sizeof(frame_size));
+
+          if (frame_size < static_cast<int32_t>(sizeof(atlas::rpc::request_header)) || frame_size > end - frame
+              || !atlas::rpc::message::known_version(frame, frame_size)) {
+            LOG(ERROR) << "bad frame, size " << frame_size << " from " << atlas::rpc::endpoint_to_string(s->source)
+                << ", drop the rest of the datagram";
+            break;
+          }
+
+          try {
+            // borrowed from the slot, which is freed after all the frames are executed
+            atlas::memory::arena_scope scope;
+            atlas::rpc::message m(frame, frame_size);
+            m.set_received(s->received);
+
+            request::record_waits(m.header()->fn_id, s->receive_wait, s->dispatched);
+            request::run(m, s->source);
+          }
+          catch (const std::exception& e) {
+            LOG(ERROR) << e.what();
+          }
+          catch (...) {
+            LOG(ERROR) << "unexpected exception";
+          }
+
+          frame += frame_size;
+        }
+
+        release(s);
+      }
+
+    private:
+
+      std::unique_ptr<slot[]> _slots;
+      std::atomic<size_t> _cursor;
+    };
+
+  } // net
+} // pioneer
+
+#endif /* PIONEER_NET_MCAST_TASKS_H_ */
@@ -0,0 +1,511 @@
+/*
+ * metrics.h
+ *
+ *  Created on: Sep 6, 2013
+ *      Author: vincent
+ */
+
+/*    Copyright 2011 ~ 2013 Vincent Zhang, ivincent.zhang@gmail.com
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#ifndef PIONEER_NET_METRICS_H_
+#define PIONEER_NET_METRICS_H_
+
+#include <array>
+#include <functional>
+#include <iomanip>
+#include <map>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <boost/lexical_cast.hpp>
+#include <atlas/singleton.h>
+#include <atlas/rpc.h>
+#include <atlas/rpc/stats.h>
+#include <atlas/rpc/trace.h>
+#include <atlas/rpc/slow_log.h>
+#include <atlas/memory/huge_pages.h>
+#include <atlas/memory/jemalloc.h>
+
+#include <pioneer/system/status.h>
+#include <pioneer/system/runtime_config.h>
+#include <pioneer/system/thread_pool.h>
+#include <pioneer/system/admission.h>
+#include <pioneer/net/net.h>
+#include <pioneer/net/buffer_pool.h>
+#include <pioneer/net/compression.h>
+#include <pioneer/net/connection_reaper.h>
+#include <pioneer/net/call_batches.h>
+#include <pioneer/net/rx_timestamps.h>
+#include <pioneer/net/fair_queue.h>
+#include <pioneer/net/http_gateway.h>
+#include <pioneer/net/connection_stats.h>
+#include <pioneer/net/drain.h>
+#include <pioneer/net/gossip.h>
+#include <pioneer/net/hedging.h>
+#include <pioneer/net/leader.h>
+#include <pioneer/net/loop_monitor.h>
+#include <pioneer/net/offload.h>
+#include <pioneer/net/request.h>
+#include <pioneer/net/log_replication.h>
+#include <pioneer/net/rpc_stream.h>
+
+namespace pioneer {
+  namespace net {
+
+    /*
+     * The metrics of the node for the monitoring, collected as flat samples, and written in the Prometheus text
+     * format or in JSON, see message_handler::handle_http_message.
+     *
+     * The iterations and the poll return time of the event loops are read from the report server's thread
+     * without any synchronization, a sample may be off by one iteration, it's fine for the monitoring
+     * */
+    class metrics {
+    public:
+
+      typedef std::vector<std::pair<std::string, std::string>> labels_type;
+
+      struct sample {
+        sample(const std::string& name, const char* type, double value, const labels_type& labels = labels_type()) :
+            name(name), type(type), value(value), labels(labels) {}
+
+        std::string name;
+        const char* type; // counter or gauge
+        double value;
+        labels_type labels;
+      };
+
+    public:
+
+      // the samples of the same name are adjacent
+      static std::vector<sample> collect() {
+        std::vector<sample> samples;
+
+        samples.push_back(sample("pioneer_startup_seconds", "gauge", system::status::startup_time / 1e6));
+        samples.push_back(sample("pioneer_ready", "gauge", system::status::ready ? 1 : 0));
+        samples.push_back(sample("pioneer_draining", "gauge", drain::ref().draining() ? 1 : 0));
+        samples.push_back(sample("pioneer_drain_shed_total", "counter", drain::ref().shed()));
+        samples.push_back(sample("pioneer_offloaded_total", "counter", offload::ref().offloaded()));
+        samples.push_back(sample("pioneer_offload_runs_total", "counter", offload::ref().ran()));
+        samples.push_back(sample("pioneer_offload_fallbacks_total", "counter", offload::ref().fallbacks()));
+        samples.push_back(sample("pioneer_config_changes_total", "counter", system::runtime_config::ref().changes()));
+
+        // mcast
+        samples.push_back(sample("pioneer_mcast_sent_total", "counter", system::status::mcast_sent));
+        samples.push_back(sample("pioneer_mcast_received_total", "counter", system::status::mcast_received));
+
+        // connections
+        samples.push_back(sample("pioneer_connections_active", "gauge", system::status::active_outer_connections,
+            { { "side", "outer" } }));
+        samples.push_back(sample("pioneer_connections_active", "gauge", system::status::active_inner_connections,
+            { { "side", "inner" } }));
+        samples.push_back(sample("pioneer_connections_failed_total", "counter", system::status::failed_outer_connections,
+            { { "side", "outer" } }));
+        samples.push_back(sample("pioneer_connections_failed_total", "counter", system::status::failed_inner_connections,
+            { { "side", "inner" } }));
+
+        samples.push_back(sample("pioneer_connection_pool_size", "gauge", outward_connection_pool::ref().size(),
+            { { "pool", "outward" } }));
+        samples.push_back(sample("pioneer_connection_pool_size", "gauge", inward_connection_pool::ref().size(),
+            { { "pool", "inward" } }));
+        samples.push_back(sample("pioneer_connection_pool_size", "gauge", inward_client_pool::ref().size(),
+            { { "pool", "inward_client" } }));
+        samples.push_back(sample("pioneer_connection_pool_peers", "gauge", outward_connection_pool::ref().peer_count(),
+            { { "pool", "outward" } }));
+        samples.push_back(sample("pioneer_connection_pool_peers", "gauge", inward_connection_pool::ref().peer_count(),
+            { { "pool", "inward" } }));
+
+        add_connection_stats(samples);
+        add_peers(samples);
+
+        // the input buffers, see buffer_pool
+        samples.push_back(sample("pioneer_buffer_pool_borrowed_total", "counter", buffer_pool::ref().hits(),
+            { { "result", "hit" } }));
+        samples.push_back(sample("pioneer_buffer_pool_borrowed_total", "counter", buffer_pool::ref().misses(),
+            { { "result", "miss" } }));
+        samples.push_back(sample("pioneer_buffer_pool_freed_total", "counter", buffer_pool::ref().freed()));
+        samples.push_back(sample("pioneer_buffer_pool_bytes", "gauge", buffer_pool::ref().pooled_bytes()));
+        samples.push_back(sample("pioneer_buffer_pool_in_use", "gauge", buffer_pool::ref().borrowed()));
+        for (int c = 0; c < buffer_pool::class_count; ++c) {
+          samples.push_back(sample("pioneer_buffer_pool_buffers", "gauge", buffer_pool::ref().pooled(c),
+              { { "size", std::to_string(buffer_pool::class_size(c)) } }));
+        }
+
+        // the arenas and the receive rings on the huge pages, see atlas::memory::huge_page_resource
+        const atlas::memory::huge_page_resource& huge = atlas::memory::huge_page_resource::instance();
+        if (huge.enabled()) {
+          for (int b = 0; b < atlas::memory::backing_count; ++b) {
+            samples.push_back(sample("pioneer_huge_pages_mapped_bytes", "gauge", huge.mapped(b),
+                { { "backing", atlas::memory::backing_name(b) } }));
+          }
+          samples.push_back(sample("pioneer_huge_pages_in_use_bytes", "gauge", huge.in_use()));
+          samples.push_back(sample("pioneer_huge_pages_free_bytes", "gauge", huge.free_bytes()));
+        }
+
+        // the heap, on jemalloc only, see atlas::memory::jemalloc
+        atlas::memory::jemalloc::totals heap;
+        if (atlas::memory::jemalloc::refresh() && atlas::memory::jemalloc::read_totals(heap)) {
+          samples.push_back(sample("pioneer_allocator_allocated_bytes", "gauge", heap.allocated));
+          samples.push_back(sample("pioneer_allocator_active_bytes", "gauge", heap.active));
+          samples.push_back(sample("pioneer_allocator_resident_bytes", "gauge", heap.resident));
+          samples.push_back(sample("pioneer_allocator_mapped_bytes", "gauge", heap.mapped));
+          samples.push_back(sample("pioneer_allocator_retained_bytes", "gauge", heap.retained));
+          samples.push_back(sample("pioneer_allocator_metadata_bytes", "gauge", heap.metadata));
+          samples.push_back(sample("pioneer_allocator_fragmentation_ratio", "gauge", heap.fragmentation()));
+          for (const auto& r : atlas::memory::role_arenas::ref().arenas()) {
+            samples.push_back(sample("pioneer_allocator_arena_active_bytes", "gauge",
+                atlas::memory::jemalloc::arena_active(r.second), { { "role", r.first } }));
+          }
+        }
+
+        // the client connections closed by the reaper, and their buffers, see connection_reaper
+        const connection_reaper& reaper = connection_reaper::ref();
+        samples.push_back(sample("pioneer_outward_connection_buffer_bytes", "gauge", reaper.bytes()));
+        samples.push_back(sample("pioneer_connections_reaped_total", "counter", reaper.reaped(connection_reaper::idle),
+            { { "reason", "idle" } }));
+        samples.push_back(sample("pioneer_connections_reaped_total", "counter", reaper.reaped(connection_reaper::memory),
+            { { "reason", "memory" } }));
+
+        // the results of the pure functions, see atlas::rpc::result_cache
+        const atlas::rpc::result_cache& cache = atlas::rpc::result_cache::ref();
+        samples.push_back(sample("pioneer_result_cache_lookups_total", "counter", cache.hits(), { { "result", "hit" } }));
+        samples.push_back(sample("pioneer_result_cache_lookups_total", "counter", cache.misses(), { { "result", "miss" } }));
+        samples.push_back(sample("pioneer_result_cache_evictions_total", "counter", cache.evictions()));
+
+        // the requests which share the execution of an identical one, see atlas::rpc::request_coalescer
+        samples.push_back(sample("pioneer_rpc_coalesced_total", "counter", atlas::rpc::request_coalescer::ref().coalesced()));
+
+        // the sessions cancelled by their callers, see atlas::rpc::cancellations
+        samples.push_back(sample("pioneer_rpc_cancelled_total", "counter", atlas::rpc::cancellations::ref().cancelled()));
+
+        // the hedged calls, and the hedges sent, see hedge_delays
+        samples.push_back(sample("pioneer_hedged_calls_total", "counter", hedge_delays::ref().calls()));
+        samples.push_back(sample("pioneer_hedges_total", "counter", hedge_delays::ref().hedges()));
+
+        // the streaming calls, see rpc_streams
+        const rpc_streams& streams = rpc_streams::ref();
+        samples.push_back(sample("pioneer_rpc_streams", "gauge", streams.sources(), { { "side", "source" } }));
+        samples.push_back(sample("pioneer_rpc_streams", "gauge", streams.sinks(), { { "side", "sink" } }));
+        samples.push_back(sample("pioneer_rpc_stream_chunks_total", "counter", streams.chunks_sent(),
+            { { "direction", "sent" } }));
+        samples.push_back(sample("pioneer_rpc_stream_chunks_total", "counter", streams.chunks_received(),
+            { { "direction", "received" } }));
+        samples.push_back(sample("pioneer_rpc_streams_aborted_total", "counter", streams.aborted()));
+
+        // the members by their state, and the rounds, see gossip
+        const gossip& members = gossip::ref();
+        if (members.enabled()) {
+          samples.push_back(sample("pioneer_gossip_members", "gauge", members.count(member_alive), { { "state", "alive" } }));
+          samples.push_back(sample("pioneer_gossip_members", "gauge", members.count(member_suspect), { { "state", "suspect" } }));
+          samples.push_back(sample("pioneer_gossip_members", "gauge", members.count(member_dead), { { "state", "dead" } }));
+          samples.push_back(sample("pioneer_gossip_rounds_total", "counter", members.rounds()));
+        }
+
+        // the neighbors on the overlay, and the frames relayed, see overlay
+        const overlay& o = overlay::ref();
+        if (o.enabled()) {
+          samples.push_back(sample("pioneer_overlay_neighbors", "gauge", o.neighbors().size()));
+          samples.push_back(sample("pioneer_overlay_relayed_total", "counter", o.relays(), { { "side", "origin" } }));
+          samples.push_back(sample("pioneer_overlay_relayed_total", "counter", o.forwards(), { { "side", "hop" } }));
+        }
+
+        // the leader of the cluster wide actions, see leader_election
+        const leader_election& election = leader_election::ref();
+        if (election.enabled()) {
+          samples.push_back(sample("pioneer_leader", "gauge", election.is_leader() ? 1 : 0));
+          samples.push_back(sample("pioneer_leader_term", "gauge", election.term()));
+          samples.push_back(sample("pioneer_leader_elections_total", "counter", election.elections()));
+        }
+
+        // the inside nodes selected by their distance, see locality
+        const locality& l = locality::ref();
+        if (l.enabled()) {
+          samples.push_back(sample("pioneer_locality_selected_total", "counter", l.selected(same_rack), { { "distance", "same_rack" } }));
+          samples.push_back(sample("pioneer_locality_selected_total", "counter", l.selected(same_zone), { { "distance", "same_zone" } }));
+          samples.push_back(sample("pioneer_locality_selected_total", "counter", l.selected(other_zone), { { "distance", "other_zone" } }));
+        }
+
+        // the frames sent compressed, see frame_compression
+        const frame_compression& compression = frame_compression::ref();
+        samples.push_back(sample("pioneer_compressed_frames_total", "counter", compression.frames()));
+        samples.push_back(sample("pioneer_compression_bytes_total", "counter", compression.raw_bytes(),
+            { { "side", "raw" } }));
+        samples.push_back(sample("pioneer_compression_bytes_total", "counter", compression.compressed_bytes(),
+            { { "side", "compressed" } }));
+        samples.push_back(sample("pioneer_decompression_failures_total", "counter", compression.failures()));
+
+        // the frames received which fail their checksums, see atlas::rpc::message::intact
+        samples.push_back(sample("pioneer_corrupted_frames_total", "counter", atlas::rpc::message::corrupted_frames().load()));
+
+        // thread pools
+        add_pools(samples);
+        samples.push_back(sample("pioneer_requests_shed_total", "counter", system::admission_control::ref().shed()));
+        samples.push_back(sample("pioneer_fair_queue_queued", "gauge", fair_queue::ref().queued()));
+        samples.push_back(sample("pioneer_fair_queue_in_flight", "gauge", fair_queue::ref().in_flight()));
+        samples.push_back(sample("pioneer_over_quota_total", "counter", fair_queue::ref().over_quota()));
+        samples.push_back(sample("pioneer_call_batches_total", "counter", call_batches::ref().batches()));
+        samples.push_back(sample("pioneer_call_batch_calls_total", "counter", call_batches::ref().calls()));
+        if (rx_timestamps::ref().enabled()) {
+          samples.push_back(sample("pioneer_rx_stamped_datagrams_total", "counter", rx_timestamps::ref().stamped()));
+          samples.push_back(sample("pioneer_rx_unstamped_datagrams_total", "counter", rx_timestamps::ref().unstamped()));
+        }
+        if (http_gateway::ref().enabled()) {
+          samples.push_back(sample("pioneer_http_gateway_requests_total", "counter", http_gateway::ref().requests()));
+          samples.push_back(sample("pioneer_http_gateway_errors_total", "counter", http_gateway::ref().errors()));
+        }
+
+        // rpc
+        samples.push_back(sample("pioneer_rpc_pending_tasks", "gauge", atlas::rpc::sync_task_manager::ref().size(),
+            { { "kind", "sync" } }));
+        samples.push_back(sample("pioneer_rpc_pending_tasks", "gauge", atlas::rpc::async_task_manager::ref().size(),
+            { { "kind", "async" } }));
+        samples.push_back(sample("pioneer_sessions", "gauge", session_manager::ref().size()));
+        samples.push_back(sample("pioneer_log_replication_batches_total", "counter", log_replicator::ref().batches()));
+        samples.push_back(sample("pioneer_log_replication_failures_total", "counter", log_replicator::ref().failures()));
+
+        add_rpc_stats(samples);
+
+        samples.push_back(sample("pioneer_rpc_slow_requests_total", "counter", atlas::rpc::slow_request_log::instance().total()));
+
+        samples.push_back(sample("pioneer_trace_spans_total", "counter", atlas::rpc::tracer::instance().recorded()));
+        samples.push_back(sample("pioneer_trace_spans_dropped_total", "counter", atlas::rpc::tracer::instance().dropped()));
+        samples.push_back(sample("pioneer_trace_spans_pending", "gauge", atlas::rpc::tracer::instance().pending()));
+
+        add_loops(samples);
+
+        return samples;
+      }
+
+      static void write_prometheus(std::ostream& os, const std::vector<sample>& samples) {
+        os << std::setprecision(12);
+
+        const std::string* last = nullptr;
+        for (const sample& s : samples) {
+          if (!last || *last != s.name) os << "# TYPE " << s.name << " " << s.type << "\n";
+          last = &s.name;
+
+          os << s.name;
+          if (!s.labels.empty()) {
+            os << "{";
+            for (size_t i = 0; i < s.labels.size(); ++i) {
+              os << (i ? "," : "") << s.labels[i].first << "=\"" << s.labels[i].second << "\"";
+            }
+            os << "}";
+          }
+          os << " " << s.value << "\n";
+        }
+      }
+
+      static void write_json(std::ostream& os, const std::vector<sample>& samples) {
+        os << std::setprecision(12) << "[";
+
+        for (size_t i = 0; i < samples.size(); ++i) {
+          const sample& s = samples[i];
+
+          os << (i ? "," : "") << "{\"name\":\"" << s.name << "\",\"type\":\"" << s.type << "\",\"labels\":{";
+          for (size_t j = 0; j < s.labels.size(); ++j) {
+            os << (j ? "," : "") << "\"" << s.labels[j].first << "\":\"" << s.labels[j].second << "\"";
+          }
+          os << "},\"value\":" << s.value << "}";
+        }
+
+        os << "]";
+      }
+
+    private:
+
+      // the loops sampled by their monitors, see loop_monitor
+      static void add_loops(std::vector<sample>& samples) {
+        std::vector<loop_registry::entry_type> loops;
+        // the loops are kept while they are read
+        std::vector<std::shared_ptr<void>> alive;
+
+        for (const loop_registry::entry_type& e : loop_registry::ref().loops()) {
+          std::shared_ptr<void> owner = e.owner.lock();
+          if (!owner) continue;
+
+          alive.push_back(owner);
+          loops.push_back(e);
+        }
+
+        muduo::Timestamp now = muduo::Timestamp::now();
+
+        for (const loop_registry::entry_type& e : loops) {
+          samples.push_back(sample("pioneer_event_loop_iterations_total", "counter", e.monitor->loop()->iteration(),
+              { { "loop", e.monitor->name() } }));
+        }
+        for (const loop_registry::entry_type& e : loops) {
+          samples.push_back(sample("pioneer_event_loop_busy_seconds_total", "counter", e.monitor->busy_seconds(),
+              { { "loop", e.monitor->name() } }));
+        }
+        for (const loop_registry::entry_type& e : loops) {
+          samples.push_back(sample("pioneer_event_loop_callbacks_total", "counter", e.monitor->callbacks(),
+              { { "loop", e.monitor->name() } }));
+        }
+        for (const loop_registry::entry_type& e : loops) {
+          samples.push_back(sample("pioneer_event_loop_utilization", "gauge", e.monitor->utilization(),
+              { { "loop", e.monitor->name() } }));
+        }
+        for (const loop_registry::entry_type& e : loops) {
+          samples.push_back(sample("pioneer_event_loop_events_per_iteration", "gauge", e.monitor->events_per_iteration(),
+              { { "loop", e.monitor->name() } }));
+        }
+        for (const loop_registry::entry_type& e : loops) {
+          samples.push_back(sample("pioneer_event_loop_pending_functors", "gauge", e.monitor->pending_functors(),
+              { { "loop", e.monitor->name() } }));
+        }
+        for (const loop_registry::entry_type& e : loops) {
+          // a loop busy in a callback for long has an old poll return time
+          muduo::Timestamp polled = e.monitor->loop()->pollReturnTime();
+          if (polled.valid()) {
+            samples.push_back(sample("pioneer_event_loop_poll_age_seconds", "gauge", muduo::timeDifference(now, polled),
+                { { "loop", e.monitor->name() } }));
+          }
+        }
+      }
+
+      // the connections gone up and down and the cost of their callbacks, by type, see connection_stats
+      static void add_connection_stats(std::vector<sample>& samples) {
+        static const double quantiles[] = { 0.5, 0.99, 0.999 };
+
+        std::array<connection_stats::snapshot, connection_stats::type_count> stats = connection_stats::ref().collect();
+
+        for (int t = 0; t < connection_stats::type_count; ++t) {
+          samples.push_back(sample("pioneer_connection_events_total", "counter", stats[t].up,
+              { { "type", connection_stats::type_name(t) }, { "event", "up" } }));
+          samples.push_back(sample("pioneer_connection_events_total", "counter", stats[t].down,
+              { { "type", connection_stats::type_name(t) }, { "event", "down" } }));
+        }
+
+        for (int t = 0; t < connection_stats::type_count; ++t) {
+          const atlas::rpc::latency_histogram& h = stats[t].latency;
+          if (h.total == 0) continue;
+
+          for (double q : quantiles) {
+            samples.push_back(sample("pioneer_connection_handle_seconds", "gauge", h.percentile(q) / 1e9,
+                { { "type", connection_stats::type_name(t) }, { "quantile", boost::lexical_cast<std::string>(q) } }));
+          }
+          samples.push_back(sample("pioneer_connection_handle_seconds", "gauge", h.max / 1e9,
+              { { "type", connection_stats::type_name(t) }, { "quantile", "1" } }));
+        }
+      }
+
+      // the traffic of every peer ip, by pool, see peer_stats
+      static void add_peers(std::vector<sample>& samples) {
+        std::vector<std::pair<const char*, peer_snapshot>> peers;
+        for (const peer_snapshot& p : outward_connection_pool::ref().peers()) peers.push_back(std::make_pair("outward", p));
+        for (const peer_snapshot& p : inward_connection_pool::ref().peers()) peers.push_back(std::make_pair("inward", p));
+
+        auto add = [&samples, &peers](const char* name, const char* type, std::function<double(const peer_snapshot&)> value) {
+          for (const auto& p : peers) {
+            samples.push_back(sample(name, type, value(p.second),
+                { { "pool", p.first }, { "peer", atlas::rpc::ip_to_string(p.second.ip) } }));
+          }
+        };
+
+        add("pioneer_peer_connections", "gauge", [](const peer_snapshot& p) { return p.connections; });
+        add("pioneer_peer_sent_bytes_total", "counter", [](const peer_snapshot& p) { return p.stats->bytes_out.load(); });
+        add("pioneer_peer_sent_messages_total", "counter", [](const peer_snapshot& p) { return p.stats->messages_out.load(); });
+        add("pioneer_peer_received_bytes_total", "counter", [](const peer_snapshot& p) { return p.stats->bytes_in.load(); });
+        add("pioneer_peer_received_messages_total", "counter", [](const peer_snapshot& p) { return p.stats->messages_in.load(); });
+        add("pioneer_peer_in_flight_messages", "gauge", [](const peer_snapshot& p) { return p.in_flight; });
+        add("pioneer_peer_pending_bytes", "gauge", [](const peer_snapshot& p) { return p.pending_bytes; });
+        add("pioneer_peer_output_high_water_bytes", "gauge", [](const peer_snapshot& p) { return p.stats->high_water.load(); });
+        add("pioneer_peer_rtt_seconds", "gauge", [](const peer_snapshot& p) { return p.stats->rtt.load() / 1e9; });
+        add("pioneer_peer_responses_total", "counter", [](const peer_snapshot& p) { return p.stats->responses.load(); });
+        add("pioneer_peer_reconnects_total", "counter", [](const peer_snapshot& p) { return p.stats->reconnects.load(); });
+        add("pioneer_peer_disconnects_total", "counter", [](const peer_snapshot& p) { return p.stats->disconnects.load(); });
+      }
+
+      // the state of a thread pool, read once, so the samples of the pools can be grouped by name
+      struct pool_sample {
+        const char* name;
+        size_t threads;
+        size_t active;
+        size_t pending;
+        boostplus::threadpool::pool_statistics stats;
+      };
+
+      template<typename Pool>
+      static pool_sample sample_pool(const char* name, const Pool& pool) {
+        pool_sample p = { name, pool.size(), pool.active(), pool.pending_tasks(), pool.statistics() };
+        return p;
+      }
+
+      // the rate of the busy seconds over the threads is the utilization, the queue delays are since the start
+      static void add_pools(std::vector<sample>& samples) {
+        const pool_sample pools[] = {
+          sample_pool("worker", system::worker_pool::ref()),
+          sample_pool("control", system::control_pool::ref())
+        };
+
+        for (const pool_sample& p : pools) samples.push_back(sample("pioneer_pool_threads", "gauge", p.threads, { { "pool", p.name } }));
+        for (const pool_sample& p : pools) samples.push_back(sample("pioneer_pool_active_tasks", "gauge", p.active, { { "pool", p.name } }));
+        for (const pool_sample& p : pools) samples.push_back(sample("pioneer_pool_pending_tasks", "gauge", p.pending, { { "pool", p.name } }));
+        for (const pool_sample& p : pools) {
+          samples.push_back(sample("pioneer_pool_executed_tasks_total", "counter", p.stats.executed, { { "pool", p.name } }));
+        }
+        for (const pool_sample& p : pools) {
+          samples.push_back(sample("pioneer_pool_stolen_tasks_total", "counter", p.stats.steals, { { "pool", p.name } }));
+        }
+        for (const pool_sample& p : pools) {
+          samples.push_back(sample("pioneer_pool_remote_node_tasks_total", "counter", p.stats.remote_takes, { { "pool", p.name } }));
+        }
+        for (const pool_sample& p : pools) {
+          samples.push_back(sample("pioneer_pool_busy_seconds_total", "counter", p.stats.busy / 1e9, { { "pool", p.name } }));
+        }
+        for (const pool_sample& p : pools) {
+          for (double q : { 0.5, 0.99, 0.999 }) {
+            samples.push_back(sample("pioneer_pool_queue_delay_seconds", "gauge", p.stats.delay_percentile(q) / 1e9,
+                { { "pool", p.name }, { "quantile", boost::lexical_cast<std::string>(q) } }));
+          }
+        }
+      }
+
+      // the calls and the latency quantiles in seconds of every function and stage, see atlas::rpc::rpc_stats
+      static void add_rpc_stats(std::vector<sample>& samples) {
+        static const double quantiles[] = { 0.5, 0.99, 0.999 };
+
+        std::map<int, atlas::rpc::fn_latency> stats = atlas::rpc::rpc_stats::instance().collect();
+
+        for (const auto& fn : stats) {
+          samples.push_back(sample("pioneer_rpc_calls_total", "counter", fn.second.stages[atlas::rpc::stage_handler].total,
+              { { "fn_id", boost::lexical_cast<std::string>(fn.first) } }));
+        }
+
+        for (const auto& fn : stats) {
+          std::string fn_id = boost::lexical_cast<std::string>(fn.first);
+
+          for (int s = 0; s < atlas::rpc::rpc_stage_count; ++s) {
+            const atlas::rpc::latency_histogram& h = fn.second.stages[s];
+            if (h.total == 0) continue;
+
+            for (double q : quantiles) {
+              samples.push_back(sample("pioneer_rpc_latency_seconds", "gauge", h.percentile(q) / 1e9,
+                  { { "fn_id", fn_id }, { "stage", atlas::rpc::stage_name(s) }, { "quantile",
+                      boost::lexical_cast<std::string>(q) } }));
+            }
+          }
+        }
+      }
+    };
+
+  } // net
+} // pioneer
+
+#endif /* PIONEER_NET_METRICS_H_ */
@@ -30,159 +30,557 @@
 #include <netinet/in.h>
 
 #include <functional>
+#include <map>
 #include <mutex>
 #include <array>
-
+#include <atomic>
+#include <condition_variable>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <random>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#include <boost/bind.hpp>
+#include <boost/uuid/nil_generator.hpp>
 #include <atlas/singleton.h>
+#include <atlas/token_bucket.h>
+#include <atlas/container/mpsc_queue.h>
+#include <atlas/memory/huge_pages.h>
+#include <atlas/rpc/message.h>
 #include <glog/logging.h>
+#include <muduo/net/Channel.h>
+#include <muduo/net/EventLoop.h>
 #include <pioneer/net/ip.h>
+#include <pioneer/net/rx_timestamps.h>
 
 namespace pioneer {
   namespace net {
 
+    namespace mn = muduo::net;
+
     // The arguments are : source ip, data buffer, data size
     typedef std::function<void(const std::string&, const char*, size_t)> mcast_message_callback;
 
+    // a received datagram, the data is valid until the callback returns
+    struct mcast_datagram {
+      sockaddr_in source;   // INADDR_ANY for an IPv6 source, which can not be answered over the inward connections
+      const char* data;
+      size_t size;
+      int64_t received;     // the stamp of the kernel in nanoseconds since the epoch, 0 if none, see rx_timestamps
+    };
+
+    // The arguments are : the datagrams received by one system call, the number of them
+    typedef std::function<void(const mcast_datagram*, size_t)> mcast_batch_callback;
+
     // TODO : move to config file
     static const int MULTICAST_PORT = 1234;
     static const size_t RECV_BUFFER_SIZE = 220 * 1024;
     static const int MESSAGE_BUFFER_SIZE = 3.5 * 1024; // TODO : check the buffer size
-    static const int MAX_WAIT_TIME = 2;
+    // the most datagrams received by one system call
+    static const int RECV_BATCH_SIZE = 32;
+    // the most datagrams sent by one system call
+    static const int SEND_BATCH_SIZE = 32;
+    // small frames are packed into one datagram up to this size, so it's never fragmented on an ethernet
+    static const size_t MAX_COALESCED_SIZE = 1472;
+    // the datagrams kept by a reliable sender for retransmission
+    static const size_t RETRANSMIT_RING_SIZE = 4096;
+
+#pragma pack(1)
+
+    // prepended to every datagram in the reliable mode, the magic is negative as a frame length,
+    // so a reliable datagram is never taken as a plain one
+    struct rmcast_header {
+      uint32_t magic;
+      uint32_t flags;   // see rmcast_flags
+      uint64_t sender;  // a random id of the sender process, a restarted sender gets a new one
+      uint64_t seq;     // the datagram sequence of the sender, starts from 1, the heartbeats carry the last sent one
+    };
+
+#pragma pack()
+
+    static const uint32_t RMCAST_MAGIC = 0xF00DCA57;
+
+    enum rmcast_flags { rmcast_data = 0, rmcast_retransmit = 1, rmcast_heartbeat = 2 };
+
+#pragma pack(1)
+
+    // a message larger than a datagram is sent in fragments, each one starts with this header,
+    // the magic is negative as a frame length too
+    struct mcast_fragment_header {
+      uint32_t magic;
+      uint32_t message_seq;             // numbers the fragmented messages of a sender
+      uint32_t total_size;              // the size of the whole message
+      uint16_t index;
+      uint16_t count;
+      boost::uuids::uuid session_id;    // the session of the first frame of the message
+    };
+
+#pragma pack()
+
+    static const uint32_t MCAST_FRAGMENT_MAGIC = 0xF00DF4A6;
+    // the payload of a fragment, so a fragment fits in a datagram with the reliable header
+    static const size_t MAX_FRAGMENT_PAYLOAD = MAX_COALESCED_SIZE - sizeof(rmcast_header) - sizeof(mcast_fragment_header);
+    // the largest message to multicast
+    static const size_t MAX_MCAST_MESSAGE_SIZE = 16 * 1024 * 1024;
+
+    inline bool is_mcast_fragment(const char* data, size_t size) {
+      uint32_t magic = 0;
+      if (size >= sizeof(mcast_fragment_header)) std::memcpy(&magic, data, sizeof(magic));
+
+      return magic == MCAST_FRAGMENT_MAGIC;
+    }
+
+    /*
+     * Reassembles the fragmented messages, keyed by the sender ip, the session id and the message sequence.
+     * At most max_partial_messages messages are reassembled at the same time, a message not completed in
+     * reassembly_timeout is dropped, and if the table is full, the oldest one is dropped for a new one
+     * */
+    class mcast_reassembler : public atlas::singleton<mcast_reassembler> {
+    public:
+
+      static const size_t max_partial_messages = 256;
+
+      const std::chrono::seconds reassembly_timeout = std::chrono::seconds(5);
+
+    private:
+
+      friend class atlas::singleton<mcast_reassembler>;
+      mcast_reassembler(const mcast_reassembler&) = delete;
+      mcast_reassembler& operator=(const mcast_reassembler&) = delete;
+
+      typedef std::chrono::steady_clock clock;
+
+    public:
+
+      mcast_reassembler() : _dropped(0) {}
+
+    public:
+
+      // return the whole message once the last fragment arrives, nullptr otherwise
+      std::shared_ptr<std::string> add(const sockaddr_in& source, const char* data, size_t size) {
+        mcast_fragment_header h;
+        std::memcpy(&h, data, sizeof(h));
+        data += sizeof(h);
+        size -= sizeof(h);
+
+        if (h.count == 0 || h.index >= h.count || h.total_size > MAX_MCAST_MESSAGE_SIZE
+            || h.index * MAX_FRAGMENT_PAYLOAD + size > h.total_size) {
+          LOG(ERROR) << "bad fragment from " << ip::get_ip_port(source);
+          return nullptr;
+        }
+
+        key k { source.sin_addr.s_addr, h.message_seq, h.session_id };
+
+        std::lock_guard<std::mutex> guard(_mutex);
+
+        auto it = _partials.find(k);
+        if (it == _partials.end()) {
+          make_room();
+
+          partial p;
+          p.data = std::make_shared<std::string>(h.total_size, '\0');
+          p.received.assign(h.count, false);
+          p.remaining = h.count;
+          p.start = clock::now();
+          it = _partials.insert(std::make_pair(k, p)).first;
+        }
+
+        partial& p = it->second;
+        if (p.received.size() != h.count || p.received[h.index]) return nullptr;
+
+        std::memcpy(&(*p.data)[h.index * MAX_FRAGMENT_PAYLOAD], data, size);
+        p.received[h.index] = true;
+
+        if (--p.remaining > 0) return nullptr;
 
+        std::shared_ptr<std::string> message = std::move(p.data);
+        _partials.erase(it);
+
+        return message;
+      }
+
+      // the messages never completed
+      uint64_t dropped() const { return _dropped; }
+
+    private:
+
+      struct key {
+        uint32_t ip;
+        uint32_t message_seq;
+        boost::uuids::uuid session_id;
+
+        bool operator<(const key& other) const {
+          if (ip != other.ip) return ip < other.ip;
+          if (message_seq != other.message_seq) return message_seq < other.message_seq;
+
+          return session_id < other.session_id;
+        }
+      };
+
+      struct partial {
+        std::shared_ptr<std::string> data;
+        std::vector<bool> received;
+        size_t remaining;
+        clock::time_point start;
+      };
+
+      // drop the expired messages, and the oldest one if it's still full
+      void make_room() {
+        clock::time_point now = clock::now();
+
+        for (auto it = _partials.begin(); it != _partials.end();) {
+          if (now - it->second.start > reassembly_timeout) {
+            it = _partials.erase(it);
+            ++_dropped;
+          }
+          else ++it;
+        }
+
+        if (_partials.size() < max_partial_messages) return;
+
+        auto oldest = std::min_element(_partials.begin(), _partials.end(),
+            [](const std::pair<const key, partial>& lhs, const std::pair<const key, partial>& rhs) {
+          return lhs.second.start < rhs.second.start;
+        });
+
+        _partials.erase(oldest);
+        ++_dropped;
+      }
+
+    private:
+
+      std::mutex _mutex;
+      std::map<key, partial> _partials;
+      std::atomic<uint64_t> _dropped;
+    };
+
+    /*
+     * The multicast socket is non-blocking and registered as a channel of an event loop, so it can share the loop
+     * with other services, and stops as soon as the loop quits.
+     *
+     * When the socket is readable, the datagrams are received in batches of up to RECV_BATCH_SIZE by one
+     * recvmmsg until the socket is drained, or MAX_BATCHES_PER_EVENT batches are taken, so a flood does not
+     * starve the other channels of the loop. The buffers are reused for the next batch without clearing,
+     * the lengths tell the valid bytes, and only the loop thread touches them, so there is no lock
+     * */
     class mcast_server {
     public:
 
-      mcast_server(const char* multi_group) : _running(false), _recv_sockfd(0), _from_addr_len(sizeof(sockaddr_in)) {
+      static const int MAX_BATCHES_PER_EVENT = 8;
+
+    public:
+
+      /*
+       * The group is an IPv4 or an IPv6 multicast address, the interface to join on is given by it's name,
+       * for example, "eth1", or one of it's IPv4 addresses, an empty one lets the kernel choose by the routes.
+       * An IPv6 server receives the IPv4 datagrams too, for example, the broadcasts.
+       *
+       * A server receives the datagrams to it's own group only, so several servers can join different groups
+       * on the same port, the kernel drops the groups not joined. If bind_group is set, the socket is bound to
+       * the group address instead of the any address, and no broadcast or unicast datagram is received,
+       * for the channels beside the cluster group, see mcast_channels
+       * */
+      mcast_server(mn::EventLoop* loop, const char* multi_group, const std::string& interface = "",
+          bool bind_group = false) : _loop(loop), _recv_sockfd(-1), _buffers(RECV_BATCH_SIZE * MESSAGE_BUFFER_SIZE),
+          _stamped(false) {
+        init_batch();
+
         int recv_buf_size = RECV_BUFFER_SIZE;
-        struct sockaddr_in mcast_addr;
-        struct ip_mreq recv_mcast_req;
 
-        _recv_sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+        in6_addr group6;
+        bool v6 = (inet_pton(AF_INET6, multi_group, &group6) == 1);
+
+        unsigned if_index = ip::interface_index(interface);
+        if (!interface.empty() && !if_index) LOG(ERROR) << "no interface " << interface << ", let the kernel choose one";
+
+        _recv_sockfd = socket(v6 ? AF_INET6 : AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
         if (_recv_sockfd  == -1) {
           LOG(ERROR) << strerror(errno);
           return;
         }
 
-        bzero(&mcast_addr, sizeof(struct sockaddr_in));
-        mcast_addr.sin_family = AF_INET;
-        mcast_addr.sin_addr.s_addr = htonl(INADDR_ANY);
-        mcast_addr.sin_port = htons(MULTICAST_PORT);
-
-        if (bind(_recv_sockfd, (struct sockaddr *) &mcast_addr, sizeof(struct sockaddr_in)) == -1) {
+        // the nodes on the same host join the same group on the same port
+        int reuse = 1;
+        if (setsockopt(_recv_sockfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(int)) == -1) {
           LOG(ERROR) << strerror(errno);
           return;
         }
 
-        int reuseaddr = 1;
-        if (setsockopt(_recv_sockfd, SOL_SOCKET, SO_REUSEADDR, &reuseaddr, sizeof(int)) == -1) {
+        in_addr group4;
+        group4.s_addr = htonl(INADDR_ANY);
+        if (!v6 && bind_group) inet_pton(AF_INET, multi_group, &group4);
+
+        if (!(v6 ? bind_ipv6(bind_group ? group6 : in6addr_any, if_index) : bind_ipv4(group4))) return;
+
+        if (setsockopt(_recv_sockfd, SOL_SOCKET, SO_RCVBUF, &recv_buf_size, sizeof(int)) == -1) {
           LOG(ERROR) << strerror(errno);
           return;
         }
 
-        if (setsockopt(_recv_sockfd, SOL_SOCKET, SO_RCVBUF, &recv_buf_size, sizeof(int)) == -1) {
+        // the datagrams come with the kernel's stamps, see rx_timestamps
+        _stamped = rx_timestamps::ref().enable(_recv_sockfd);
+
+        int joined = 0;
+        if (v6) {
+          struct ipv6_mreq recv_mcast_req;
+          recv_mcast_req.ipv6mr_multiaddr = group6;
+          recv_mcast_req.ipv6mr_interface = if_index;
+
+          joined = setsockopt(_recv_sockfd, IPPROTO_IPV6, IPV6_JOIN_GROUP, &recv_mcast_req, sizeof(recv_mcast_req));
+        }
+        else {
+          struct ip_mreqn recv_mcast_req;
+          bzero(&recv_mcast_req, sizeof(recv_mcast_req));
+          inet_pton(AF_INET, multi_group, &(recv_mcast_req.imr_multiaddr));
+          recv_mcast_req.imr_address.s_addr = htonl(INADDR_ANY);
+          recv_mcast_req.imr_ifindex = if_index;
+
+          joined = setsockopt(_recv_sockfd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &recv_mcast_req, sizeof(recv_mcast_req));
+        }
+
+        if (joined == -1) {
           LOG(ERROR) << strerror(errno);
           return;
         }
+      }
+
+      // must be destroyed in the loop thread, after the loop quits if it's not stopped
+      ~mcast_server() {
+        close_channel();
+      }
+
+      mcast_server(const mcast_server&) = delete;
+      mcast_server& operator=(const mcast_server&) = delete;
+
+    public:
+
+      // thread safe, the datagrams are received in the loop once it's running
+      void start() {
+        _loop->runInLoop(boost::bind(&mcast_server::start_in_loop, this));
+      }
+
+      void set_message_callback(const mcast_message_callback& cb) { _on_message = cb; }
+
+      // the batch callback is preferred if both are set
+      void set_batch_callback(const mcast_batch_callback& cb) { _on_batch = cb; }
+
+      // thread safe
+      void stop() {
+        _loop->runInLoop(boost::bind(&mcast_server::close_channel, this));
+      }
 
-        // timeout
-        struct timeval tv{MAX_WAIT_TIME, 0};
-        if (setsockopt(_recv_sockfd, SOL_SOCKET, SO_RCVTIMEO, (char*)&tv, sizeof(tv)) == -1) {
+    private:
+
+      bool bind_ipv4(in_addr addr) {
+        // by default, a socket bound to the any address receives all the groups joined by any socket on the host
+#ifdef IP_MULTICAST_ALL
+        int all = 0;
+        if (setsockopt(_recv_sockfd, IPPROTO_IP, IP_MULTICAST_ALL, &all, sizeof(int)) == -1) {
           LOG(ERROR) << strerror(errno);
-          return;
+          return false;
         }
+#endif
 
-        inet_pton(AF_INET, multi_group, &(recv_mcast_req.imr_multiaddr));
-        recv_mcast_req.imr_interface.s_addr = htonl(INADDR_ANY);
+        struct sockaddr_in mcast_addr;
+        bzero(&mcast_addr, sizeof(struct sockaddr_in));
+        mcast_addr.sin_family = AF_INET;
+        mcast_addr.sin_addr = addr;
+        mcast_addr.sin_port = htons(MULTICAST_PORT);
 
-        if (setsockopt(_recv_sockfd, IPPROTO_IP, IP_ADD_MEMBERSHIP, (const char*)&recv_mcast_req,
-            sizeof(struct ip_mreq)) == -1)
-        {
+        if (bind(_recv_sockfd, (struct sockaddr *) &mcast_addr, sizeof(struct sockaddr_in)) == -1) {
           LOG(ERROR) << strerror(errno);
-          return;
+          return false;
         }
+
+        return true;
       }
 
-      ~mcast_server() {
-        if (_recv_sockfd) {
-          close(_recv_sockfd);
-          _recv_sockfd = 0;
+      bool bind_ipv6(const in6_addr& addr, unsigned if_index) {
+        // the IPv4 datagrams come with IPv4-mapped addresses
+        int v6only = 0;
+        if (setsockopt(_recv_sockfd, IPPROTO_IPV6, IPV6_V6ONLY, &v6only, sizeof(int)) == -1) {
+          LOG(ERROR) << strerror(errno);
+          return false;
         }
+
+        // the mapped IPv4 groups follow IP_MULTICAST_ALL, the IPv6 ones follow IPV6_MULTICAST_ALL since Linux 4.20
+        int all = 0;
+#ifdef IP_MULTICAST_ALL
+        setsockopt(_recv_sockfd, IPPROTO_IP, IP_MULTICAST_ALL, &all, sizeof(int));
+#endif
+#ifdef IPV6_MULTICAST_ALL
+        setsockopt(_recv_sockfd, IPPROTO_IPV6, IPV6_MULTICAST_ALL, &all, sizeof(int));
+#endif
+
+        struct sockaddr_in6 mcast_addr;
+        bzero(&mcast_addr, sizeof(struct sockaddr_in6));
+        mcast_addr.sin6_family = AF_INET6;
+        mcast_addr.sin6_addr = addr;
+        mcast_addr.sin6_port = htons(MULTICAST_PORT);
+        // a link local group needs the interface
+        if (IN6_IS_ADDR_MC_LINKLOCAL(&addr)) mcast_addr.sin6_scope_id = if_index;
+
+        if (bind(_recv_sockfd, (struct sockaddr *) &mcast_addr, sizeof(struct sockaddr_in6)) == -1) {
+          LOG(ERROR) << strerror(errno);
+          return false;
+        }
+
+        return true;
       }
 
-    public:
+      void start_in_loop() {
+        if (_recv_sockfd == -1 || _channel) return;
 
-      void start() {
-        _running = true;
+        _channel.reset(new mn::Channel(_loop, _recv_sockfd));
+        _channel->setReadCallback(boost::bind(&mcast_server::on_readable, this));
+        _channel->enableReading();
+      }
 
-        while (_running) {
-          std::lock_guard<std::mutex> guard(_mutex);
+      void close_channel() {
+        if (_channel) {
+          _channel->disableAll();
+          _loop->removeChannel(_channel.get());
+          _channel.reset();
+        }
 
-          _buffer.fill('\0');
-          int num_bytes = recvfrom(_recv_sockfd, _buffer.data(), _buffer.size(), 0,
-              (struct sockaddr*)&_from_addr, &_from_addr_len);
+        if (_recv_sockfd != -1) {
+          close(_recv_sockfd);
+          _recv_sockfd = -1;
+        }
+      }
 
-          if (num_bytes == -1) {
-            if (errno != EAGAIN || errno != EWOULDBLOCK) {
-              LOG(ERROR) << strerror(errno);
-            }
+      void on_readable() {
+        for (int batch = 0; batch < MAX_BATCHES_PER_EVENT; ++batch) {
+          // the kernel overwrites the address and the control lengths
+          for (auto& h : _headers) h.msg_hdr.msg_namelen = sizeof(sockaddr_in6);
+          if (_stamped) {
+            for (auto& h : _headers) h.msg_hdr.msg_controllen = rx_timestamps::control_size;
+          }
 
-            continue;
+          int count = recvmmsg(_recv_sockfd, _headers.data(), _headers.size(), MSG_DONTWAIT, nullptr);
+
+          if (count == -1) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) LOG(ERROR) << strerror(errno);
+
+            return;
           }
 
-          // ++system::status::mcast_received;
+          dispatch(count);
 
-          // DLOG(INFO) << num_bytes << " bytes received from " << ip::get_ip_port(_from_addr);
+          // drained
+          if (count < RECV_BATCH_SIZE) return;
+        }
+      }
 
-          std::string ip_port = ip::get_ip_port(_from_addr);
-          _on_message(ip_port, _buffer.data(), num_bytes);
-        } // while
+      void init_batch() {
+        for (int i = 0; i < RECV_BATCH_SIZE; ++i) {
+          _iovecs[i].iov_base = &_buffers[i * MESSAGE_BUFFER_SIZE];
+          _iovecs[i].iov_len = MESSAGE_BUFFER_SIZE;
+
+          std::memset(&_headers[i], 0, sizeof(mmsghdr));
+          _headers[i].msg_hdr.msg_iov = &_iovecs[i];
+          _headers[i].msg_hdr.msg_iovlen = 1;
+          _headers[i].msg_hdr.msg_name = &_sources[i];
+          _headers[i].msg_hdr.msg_namelen = sizeof(sockaddr_in6);
+          _headers[i].msg_hdr.msg_control = &_controls[i];
+        }
       }
 
-      void set_message_callback(const mcast_message_callback& cb) { _on_message = cb; }
+      void dispatch(int count) {
+        size_t n = 0;
 
-      void stop() {
-        _running = false;
+        for (int i = 0; i < count; ++i) {
+          sockaddr_in source = ip::to_ipv4(_sources[i]);
 
-        if (_recv_sockfd) {
-          close(_recv_sockfd);
-          _recv_sockfd = 0;
+          if (_headers[i].msg_hdr.msg_flags & MSG_TRUNC) {
+            LOG(ERROR) << "drop a datagram larger than " << MESSAGE_BUFFER_SIZE << " bytes from " << ip::get_ip_port(source);
+            continue;
+          }
+
+          _datagrams[n].source = source;
+          _datagrams[n].data = static_cast<const char*>(_iovecs[i].iov_base);
+          _datagrams[n].size = _headers[i].msg_len;
+          _datagrams[n].received = _stamped ? rx_timestamps::ref().read(_headers[i].msg_hdr) : 0;
+          ++n;
+        }
+
+        if (_on_batch) {
+          if (n) _on_batch(_datagrams.data(), n);
+          return;
+        }
+
+        if (!_on_message) return;
+
+        for (size_t i = 0; i < n; ++i) {
+          _on_message(ip::get_ip_port(_datagrams[i].source), _datagrams[i].data, _datagrams[i].size);
         }
       }
 
     private:
 
-      bool _running;
+      mn::EventLoop* _loop;
       int _recv_sockfd;
-      sockaddr_in _from_addr;
-      unsigned int _from_addr_len;
+      std::unique_ptr<mn::Channel> _channel;
 
       mcast_message_callback _on_message;
-
-      std::mutex _mutex;
-      std::array<char, MESSAGE_BUFFER_SIZE> _buffer;
+      mcast_batch_callback _on_batch;
+
+      // a ring of RECV_BATCH_SIZE buffers, refilled by every recvmmsg, on the huge pages if they're on
+      atlas::memory::resource_buffer _buffers;
+      std::array<iovec, RECV_BATCH_SIZE> _iovecs;
+      // large enough for both IPv4 and IPv6 addresses
+      std::array<sockaddr_in6, RECV_BATCH_SIZE> _sources;
+      std::array<mmsghdr, RECV_BATCH_SIZE> _headers;
+      std::array<mcast_datagram, RECV_BATCH_SIZE> _datagrams;
+
+      // the control messages, the receive stamps, if they're on
+      bool _stamped;
+      std::array<std::aligned_storage<rx_timestamps::control_size, std::alignment_of<cmsghdr>::value>::type,
+          RECV_BATCH_SIZE> _controls;
     };
 
-    class mcast_client : public atlas::singleton<mcast_client> {
-    private:
+    /*
+     * The senders push the messages into a lock-free queue and return immediately, a sender thread drains
+     * the queue and sends up to SEND_BATCH_SIZE datagrams by one sendmmsg. If coalescing is enabled,
+     * consecutive small frames are packed into one datagram up to MAX_COALESCED_SIZE, the receivers split
+     * them by the frame lengths, see message_handler::on_mcast_batch.
+     *
+     * The target is an IPv4 or IPv6 multicast group, or an IPv4 broadcast address
+     * */
+    class udp_sender {
+    public:
 
-      friend class atlas::singleton<mcast_client>;
+      // a sender idle for this long multicasts a heartbeat, so the receivers find the lost tail datagrams
+      const std::chrono::milliseconds heartbeat_interval = std::chrono::milliseconds(200);
 
     public:
 
-      mcast_client() : _send_buf_size(0), _mcast_addr_len(0), _send_sockfd(0) {
+      udp_sender() : _send_buf_size(0), _send_sockfd(0), _dest_len(0), _running(false), _idle(false),
+        _coalescing(true), _bytes_per_sec(0), _packets_per_sec(0), _burst_seconds(0), _rate_changed(false),
+        _next_message_seq(0), _reliable(false), _sender_id(random_sender_id()), _next_seq(1),
+        _heartbeat_seq(0), _heartbeats_left(0), _ring(RETRANSMIT_RING_SIZE) {
       }
 
-      ~mcast_client() {
-        if (_send_sockfd) close(_send_sockfd);
+      ~udp_sender() {
+        if (_send_sockfd) __stop();
       }
 
+      udp_sender(const udp_sender&) = delete;
+      udp_sender& operator=(const udp_sender&) = delete;
+
     public:
 
-      void init(const char* multi_group) {
-        // std::call_once(_init_once, __init, multi_group);
+      // the interface to send on is given by it's name or one of it's IPv4 addresses, an empty one lets the kernel
+      // choose by the routes, a broadcast always goes out of the interface routed to the broadcast address
+      void init(const char* address, const std::string& interface = "") {
+        // std::call_once(_init_once, __init, address, interface);
         if (_send_sockfd) return;
 
-        __init(multi_group);
+        __init(address, interface);
       }
 
       void stop() {
@@ -196,46 +594,110 @@ namespace pioneer {
         return send(message.data(), message.size());
       }
 
+      // pack small frames into one datagram, every message must be a length prefixed frame then
+      void set_coalescing(bool enabled) { _coalescing = enabled; }
+
+      /*
+       * Pace the datagrams by the bytes and the datagrams per second, 0 for unlimited, the senders never
+       * wait, the messages wait in the queue. The burst is given in seconds of the rates, and is at least
+       * one datagram. The retransmissions and heartbeats are not paced, thread safe
+       * */
+      void set_rate(double bytes_per_sec, double packets_per_sec, double burst_seconds = 0.01) {
+        std::lock_guard<std::mutex> guard(_rate_mutex);
+
+        _bytes_per_sec = bytes_per_sec;
+        _packets_per_sec = packets_per_sec;
+        _burst_seconds = burst_seconds;
+
+        _rate_changed = true;
+      }
+
+      // number the datagrams and keep the last RETRANSMIT_RING_SIZE of them for retransmission,
+      // the receivers ask for the lost ones by NAKs, see rmcast_receiver, must be set before init()
+      void set_reliable(bool enabled) { _reliable = enabled; }
+
+      bool reliable() const { return _reliable; }
+
+      uint64_t sender_id() const { return _sender_id; }
+
+      // multicast the datagrams again, the ones out of the ring are lost for ever, return the number resent
+      size_t retransmit(const std::vector<uint64_t>& seqs) {
+        if (!_running || !_reliable) return 0;
+
+        size_t resent = 0;
+
+        std::lock_guard<std::mutex> guard(_ring_mutex);
+        for (uint64_t seq : seqs) {
+          retained_datagram& d = _ring[seq % _ring.size()];
+          if (d.seq != seq) continue;
+
+          rmcast_header* h = reinterpret_cast<rmcast_header*>(&d.data[0]);
+          h->flags = rmcast_retransmit;
+
+          if (sendto(_send_sockfd, d.data.data(), d.data.size(), 0, (struct sockaddr*) &_dest, _dest_len) == -1) {
+            LOG(ERROR) << strerror(errno);
+            break;
+          }
+
+          ++resent;
+        }
+
+        return resent;
+      }
+
+      // never blocks, return the bytes queued, a message larger than MAX_COALESCED_SIZE is sent in fragments
       int send(const char* message, const int len) {
-        if (!_send_sockfd) {
+        if (!_running) {
           LOG(INFO) << "the socket is closed";
           return -1;
         }
 
         if (!message || !len) return 0;
 
-        std::lock_guard<std::mutex> guard(_send_mutex);
-        int num_bytes = sendto(_send_sockfd, message, len, 0, (struct sockaddr*) &_mcast_addr, sizeof(struct sockaddr));
-        if (num_bytes == -1) {
-          LOG(ERROR) << strerror(errno);
-
-          return -1;
+        if (static_cast<size_t>(len) > MAX_COALESCED_SIZE - sizeof(rmcast_header)) {
+          if (!push_fragments(message, len)) return -1;
+        }
+        else {
+          _queue.push(std::string(message, len));
         }
 
-        // ++system::status::mcast_sent;
-        // DLOG(INFO) << "multicast " << num_bytes << " bytes";
+        // the sender thread is going to sleep, wake it up, the lock is taken only in this case
+        if (_idle.load()) {
+          std::lock_guard<std::mutex> guard(_wake_mutex);
+          _wake.notify_one();
+        }
 
-        return num_bytes;
+        return len;
       }
 
     protected:
 
-      void __init(const char* multi_group) {
+      void __init(const char* address, const std::string& interface) {
         _send_buf_size = RECV_BUFFER_SIZE;
 
-        _send_sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+        bzero(&_dest, sizeof(_dest));
+
+        sockaddr_in* dest4 = reinterpret_cast<sockaddr_in*>(&_dest);
+        sockaddr_in6* dest6 = reinterpret_cast<sockaddr_in6*>(&_dest);
+
+        if (inet_pton(AF_INET6, address, &dest6->sin6_addr) == 1) {
+          dest6->sin6_family = AF_INET6;
+          dest6->sin6_port = htons(MULTICAST_PORT);
+          _dest_len = sizeof(sockaddr_in6);
+        }
+        else {
+          dest4->sin_family = AF_INET;
+          inet_pton(AF_INET, address, &dest4->sin_addr);
+          dest4->sin_port = htons(MULTICAST_PORT);
+          _dest_len = sizeof(sockaddr_in);
+        }
+
+        _send_sockfd = socket(_dest.ss_family, SOCK_DGRAM, 0);
         if (_send_sockfd == -1) {
           LOG(ERROR) << strerror(errno);
           return;
         }
 
-        bzero(&_mcast_addr, sizeof(struct sockaddr_in));
-        _mcast_addr.sin_family = AF_INET;
-
-        inet_pton(AF_INET, multi_group, &_mcast_addr.sin_addr);
-        _mcast_addr.sin_port = htons(MULTICAST_PORT);
-        _mcast_addr_len = sizeof(_mcast_addr);
-
         if (-1 == setsockopt(_send_sockfd, SOL_SOCKET, SO_SNDBUF, &_send_buf_size, sizeof(int))) {
           LOG(ERROR) << strerror(errno);
           return;
@@ -246,23 +708,419 @@ namespace pioneer {
           LOG(ERROR) << strerror(errno);
           return;
         }
+
+        if (!select_interface(interface)) return;
+
+        _running = true;
+        _sender.reset(new std::thread(&udp_sender::run, this));
       }
 
+      // the messages queued already are sent before the socket is closed
       void __stop() {
+        _running = false;
+
+        {
+          std::lock_guard<std::mutex> guard(_wake_mutex);
+          _wake.notify_one();
+        }
+
+        if (_sender && _sender->joinable()) _sender->join();
+        _sender.reset();
+
         close(_send_sockfd);
         _send_sockfd = 0;
       }
 
+      // multicast out of the interface, or enable broadcasting for a broadcast address
+      bool select_interface(const std::string& interface) {
+        unsigned if_index = ip::interface_index(interface);
+        if (!interface.empty() && !if_index) LOG(ERROR) << "no interface " << interface << ", let the kernel choose one";
+
+        int r = 0;
+        if (_dest.ss_family == AF_INET6) {
+          if (if_index) r = setsockopt(_send_sockfd, IPPROTO_IPV6, IPV6_MULTICAST_IF, &if_index, sizeof(if_index));
+        }
+        else if (IN_MULTICAST(ntohl(reinterpret_cast<sockaddr_in*>(&_dest)->sin_addr.s_addr))) {
+          if (if_index) {
+            struct ip_mreqn req;
+            bzero(&req, sizeof(req));
+            req.imr_ifindex = if_index;
+
+            r = setsockopt(_send_sockfd, IPPROTO_IP, IP_MULTICAST_IF, &req, sizeof(req));
+          }
+        }
+        else {
+          int broadcast = 1;
+          r = setsockopt(_send_sockfd, SOL_SOCKET, SO_BROADCAST, &broadcast, sizeof(int));
+        }
+
+        if (r == -1) {
+          LOG(ERROR) << strerror(errno);
+          return false;
+        }
+
+        return true;
+      }
+
+    private:
+
+      // the sender thread
+      void run() {
+        auto last_sent = std::chrono::steady_clock::now();
+
+        while (_running || !_queue.empty()) {
+          int limit = pace();
+          if (limit == 0) continue;
+
+          if (send_batch(limit)) {
+            last_sent = std::chrono::steady_clock::now();
+            continue;
+          }
+
+          if (_reliable && std::chrono::steady_clock::now() - last_sent >= heartbeat_interval) {
+            send_heartbeat();
+            last_sent = std::chrono::steady_clock::now();
+          }
+
+          std::unique_lock<std::mutex> lock(_wake_mutex);
+          _idle = true;
+          // a push racing with going idle is picked up by the timeout at the latest
+          if (_queue.empty() && _running) _wake.wait_for(lock, std::chrono::milliseconds(10));
+          _idle = false;
+        }
+      }
+
+      /*
+       * The most datagrams allowed to send now by the rate, 0 if we have waited for the tokens.
+       * A batch may run into debt by one datagram of bytes, it's paid by the next batch.
+       * The queued messages are sent at full speed once the sender is stopping
+       * */
+      int pace() {
+        if (_rate_changed.exchange(false)) {
+          std::lock_guard<std::mutex> guard(_rate_mutex);
+
+          double max_datagram = MAX_COALESCED_SIZE + sizeof(rmcast_header);
+          _byte_bucket.reset(_bytes_per_sec, std::max(_bytes_per_sec * _burst_seconds, max_datagram));
+          _packet_bucket.reset(_packets_per_sec, std::max(_packets_per_sec * _burst_seconds, 1.0));
+        }
+
+        if (!_running || (_byte_bucket.unlimited() && _packet_bucket.unlimited())) return SEND_BATCH_SIZE;
+
+        auto now = atlas::token_bucket::clock::now();
+        auto wait = std::max(_byte_bucket.wait_time(now), _packet_bucket.wait_time(now));
+        if (wait > atlas::token_bucket::clock::duration::zero()) {
+          if (_queue.empty()) return SEND_BATCH_SIZE;
+
+          std::this_thread::sleep_for(std::min<atlas::token_bucket::clock::duration>(wait, std::chrono::milliseconds(10)));
+          return 0;
+        }
+
+        int limit = SEND_BATCH_SIZE;
+        if (!_packet_bucket.unlimited()) {
+          limit = std::min(limit, std::max(1, static_cast<int>(_packet_bucket.available(now))));
+        }
+        if (!_byte_bucket.unlimited()) {
+          int datagrams = static_cast<int>(_byte_bucket.available(now) / MAX_COALESCED_SIZE);
+          limit = std::min(limit, std::max(1, datagrams));
+        }
+
+        return limit;
+      }
+
+      // return false if there is nothing to send
+      bool send_batch(int max_datagrams) {
+        size_t frames = 0;
+        size_t iovs = 0;
+        int datagrams = 0;
+
+        // the header is counted in the size of a reliable datagram
+        const size_t header_size = _reliable ? sizeof(rmcast_header) : 0;
+
+        while (datagrams < max_datagrams && frames < _pending.size() && _queue.pop(_pending[frames])) {
+          const std::string& m = _pending[frames];
+
+          // append to the last datagram if it still fits, it's iovecs are the last ones, the fragments are sent alone
+          bool fragment = is_mcast_fragment(m.data(), m.size());
+          if (_coalescing && datagrams > 0 && !fragment && !_fragment_datagram[datagrams - 1]
+              && _sizes[datagrams - 1] + m.size() <= MAX_COALESCED_SIZE) {
+            ++_headers[datagrams - 1].msg_hdr.msg_iovlen;
+            _sizes[datagrams - 1] += m.size();
+          }
+          else {
+            std::memset(&_headers[datagrams], 0, sizeof(mmsghdr));
+            _headers[datagrams].msg_hdr.msg_name = &_dest;
+            _headers[datagrams].msg_hdr.msg_namelen = _dest_len;
+            _headers[datagrams].msg_hdr.msg_iov = &_iovecs[iovs];
+            _headers[datagrams].msg_hdr.msg_iovlen = 1;
+            _sizes[datagrams] = header_size + m.size();
+            _fragment_datagram[datagrams] = fragment;
+
+            if (_reliable) {
+              rmcast_header& h = _rm_headers[datagrams];
+              h.magic = RMCAST_MAGIC;
+              h.flags = rmcast_data;
+              h.sender = _sender_id;
+              h.seq = _next_seq++;
+
+              _iovecs[iovs].iov_base = &h;
+              _iovecs[iovs].iov_len = sizeof(h);
+              ++iovs;
+              ++_headers[datagrams].msg_hdr.msg_iovlen;
+            }
+
+            ++datagrams;
+          }
+
+          _iovecs[iovs].iov_base = const_cast<char*>(m.data());
+          _iovecs[iovs].iov_len = m.size();
+          ++iovs;
+
+          ++frames;
+        }
+
+        if (!datagrams) return false;
+
+        if (_reliable) retain(datagrams);
+
+        int sent = 0;
+        while (sent < datagrams) {
+          int n = sendmmsg(_send_sockfd, &_headers[sent], datagrams - sent, 0);
+          if (n == -1) {
+            if (errno == EINTR) continue;
+
+            LOG(ERROR) << strerror(errno) << ", drop " << (datagrams - sent) << " datagrams";
+            break;
+          }
+
+          sent += n;
+        }
+
+        _packet_bucket.consume(datagrams);
+        if (!_byte_bucket.unlimited()) {
+          size_t bytes = 0;
+          for (int i = 0; i < datagrams; ++i) bytes += _sizes[i];
+          _byte_bucket.consume(bytes);
+        }
+
+        for (size_t i = 0; i < frames; ++i) std::string().swap(_pending[i]);
+
+        return true;
+      }
+
+      // copy the datagrams into the retransmit ring before they are sent, so a NAK never misses one
+      void retain(int datagrams) {
+        std::lock_guard<std::mutex> guard(_ring_mutex);
+
+        for (int i = 0; i < datagrams; ++i) {
+          const msghdr& m = _headers[i].msg_hdr;
+          retained_datagram& d = _ring[_rm_headers[i].seq % _ring.size()];
+
+          d.seq = _rm_headers[i].seq;
+          d.data.clear();
+          for (size_t j = 0; j < m.msg_iovlen; ++j) {
+            d.data.append(static_cast<const char*>(m.msg_iov[j].iov_base), m.msg_iov[j].iov_len);
+          }
+        }
+      }
+
+      // split the message into fragments of MAX_FRAGMENT_PAYLOAD, they are queued together
+      bool push_fragments(const char* message, size_t len) {
+        if (len > MAX_MCAST_MESSAGE_SIZE) {
+          LOG(ERROR) << "drop a " << len << " bytes message, the largest to multicast is " << MAX_MCAST_MESSAGE_SIZE;
+          return false;
+        }
+
+        mcast_fragment_header h;
+        h.magic = MCAST_FRAGMENT_MAGIC;
+        h.message_seq = _next_message_seq++;
+        h.total_size = static_cast<uint32_t>(len);
+        h.count = static_cast<uint16_t>((len + MAX_FRAGMENT_PAYLOAD - 1) / MAX_FRAGMENT_PAYLOAD);
+        h.session_id = len >= sizeof(atlas::rpc::request_header) ?
+            atlas::rpc::message::get_session_id(message, len) : boost::uuids::nil_uuid();
+
+        for (uint16_t i = 0; i < h.count; ++i) {
+          size_t offset = i * MAX_FRAGMENT_PAYLOAD;
+          size_t size = std::min(MAX_FRAGMENT_PAYLOAD, len - offset);
+          h.index = i;
+
+          std::string fragment;
+          fragment.reserve(sizeof(h) + size);
+          fragment.append(reinterpret_cast<const char*>(&h), sizeof(h));
+          fragment.append(message + offset, size);
+
+          _queue.push(std::move(fragment));
+        }
+
+        return true;
+      }
+
+      // a few heartbeats for the last datagram, since a heartbeat may be lost too
+      void send_heartbeat() {
+        uint64_t last = _next_seq - 1;
+        if (last == 0) return;
+
+        if (last != _heartbeat_seq) {
+          _heartbeat_seq = last;
+          _heartbeats_left = 3;
+        }
+
+        if (_heartbeats_left == 0) return;
+        --_heartbeats_left;
+
+        rmcast_header h = { RMCAST_MAGIC, rmcast_heartbeat, _sender_id, last };
+        if (sendto(_send_sockfd, &h, sizeof(h), 0, (struct sockaddr*) &_dest, _dest_len) == -1) {
+          LOG(ERROR) << strerror(errno);
+        }
+      }
+
+      static uint64_t random_sender_id() {
+        std::random_device rd;
+        return (static_cast<uint64_t>(rd()) << 32) | rd();
+      }
+
     private:
 
       int _send_buf_size;
-      int _mcast_addr_len;
       int _send_sockfd;
-      sockaddr_in _mcast_addr;
+      sockaddr_storage _dest;
+      socklen_t _dest_len;
 
       std::once_flag _init_once;
       std::once_flag _stop_once;
-      std::mutex _send_mutex;
+
+      std::atomic<bool> _running;
+      std::unique_ptr<std::thread> _sender;
+      atlas::mpsc_queue<std::string> _queue;
+
+      // the sender thread sleeps on it when the queue is empty
+      std::atomic<bool> _idle;
+      std::mutex _wake_mutex;
+      std::condition_variable _wake;
+
+      std::atomic<bool> _coalescing;
+
+      // the pacing, the buckets are used by the sender thread only
+      std::mutex _rate_mutex;
+      double _bytes_per_sec;
+      double _packets_per_sec;
+      double _burst_seconds;
+      std::atomic<bool> _rate_changed;
+      atlas::token_bucket _byte_bucket;
+      atlas::token_bucket _packet_bucket;
+
+      // accessed by the sender thread only, a batch has at most SEND_BATCH_SIZE datagrams of SEND_BATCH_SIZE * 4 frames
+      std::array<std::string, SEND_BATCH_SIZE * 4> _pending;
+      std::array<iovec, SEND_BATCH_SIZE * 5> _iovecs;
+      std::array<mmsghdr, SEND_BATCH_SIZE> _headers;
+      std::array<size_t, SEND_BATCH_SIZE> _sizes;
+      std::array<bool, SEND_BATCH_SIZE> _fragment_datagram;
+
+      std::atomic<uint32_t> _next_message_seq;
+
+      // the reliable mode
+      std::atomic<bool> _reliable;
+      const uint64_t _sender_id;
+      uint64_t _next_seq;
+      uint64_t _heartbeat_seq;
+      int _heartbeats_left;
+      std::array<rmcast_header, SEND_BATCH_SIZE> _rm_headers;
+
+      struct retained_datagram {
+        retained_datagram() : seq(0) {}
+
+        uint64_t seq;
+        std::string data;
+      };
+
+      std::mutex _ring_mutex;
+      std::vector<retained_datagram> _ring;
+    };
+
+    // to the multicast group of the cluster
+    class mcast_client : public udp_sender, public atlas::singleton<mcast_client> {
+    private:
+
+      friend class atlas::singleton<mcast_client>;
+    };
+
+    // to a subnet broadcast address, received by the mcast servers on the same port
+    class bcast_client : public udp_sender, public atlas::singleton<bcast_client> {
+    private:
+
+      friend class atlas::singleton<bcast_client>;
+    };
+
+    /*
+     * The channels are multicast groups beside the cluster group, for example, one for a service or a shard,
+     * a node joins only the channels it serves by a mcast_server for each, so the datagrams of the other
+     * channels are dropped by the kernel or the NIC, not by the RPC dispatcher.
+     *
+     * The senders to the channels are created on the first use, and share the interface and the reliable mode
+     * */
+    class mcast_channels : public atlas::singleton<mcast_channels> {
+    private:
+
+      friend class atlas::singleton<mcast_channels>;
+      mcast_channels(const mcast_channels&) = delete;
+      mcast_channels& operator=(const mcast_channels&) = delete;
+
+    public:
+
+      mcast_channels() : _reliable(false), _stopped(false) {}
+
+      ~mcast_channels() { stop(); }
+
+    public:
+
+      // applied to the senders created later
+      void set_options(const std::string& interface, bool reliable) {
+        std::lock_guard<std::mutex> guard(_mutex);
+
+        _interface = interface;
+        _reliable = reliable;
+      }
+
+      // the sender to the group, nullptr if stopped
+      udp_sender* get(const std::string& group) {
+        std::lock_guard<std::mutex> guard(_mutex);
+        if (_stopped) return nullptr;
+
+        auto it = _senders.find(group);
+        if (it != _senders.end()) return it->second.get();
+
+        std::unique_ptr<udp_sender> sender(new udp_sender);
+        sender->set_reliable(_reliable);
+        sender->init(group.c_str(), _interface);
+
+        return (_senders[group] = std::move(sender)).get();
+      }
+
+      // the sender owns the sender id of a reliable datagram, nullptr if not found
+      udp_sender* find(uint64_t sender_id) {
+        std::lock_guard<std::mutex> guard(_mutex);
+
+        for (const auto& s : _senders) {
+          if (s.second->sender_id() == sender_id) return s.second.get();
+        }
+
+        return nullptr;
+      }
+
+      // the messages queued already are sent
+      void stop() {
+        std::lock_guard<std::mutex> guard(_mutex);
+
+        _stopped = true;
+        for (const auto& s : _senders) s.second->stop();
+      }
+
+    private:
+
+      std::mutex _mutex;
+      std::string _interface;
+      bool _reliable;
+      bool _stopped;
+      std::map<std::string, std::unique_ptr<udp_sender>> _senders;
     };
 
   } // net
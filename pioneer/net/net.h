@@ -25,9 +25,13 @@
 
 #include <muduo/net/TcpServer.h>
 #include <muduo/net/http/HttpServer.h>
+#include <glog/logging.h>
+#include <atlas/rpc/task.h>
 
+#include <pioneer/net/local_transport.h>
 #include <pioneer/net/multicast.h>
 #include <pioneer/net/net_pools.h>
+#include <pioneer/net/reuseport_server.h>
 
 namespace pioneer {
   namespace net {
@@ -51,9 +55,29 @@ namespace pioneer {
     typedef mn::TcpServer outward_server;
     // TCP server serves for inside clients
     typedef mn::TcpServer inward_server;
+    // one shard per core of the servers above, see thread per core in server.cpp
+    typedef reuseport_server outward_shard_server;
+    typedef reuseport_server inward_shard_server;
+    // the servers above with a SO_REUSEPORT listener in every I/O loop, see reuseport_group
+    typedef reuseport_group outward_reuseport_server;
+    typedef reuseport_group inward_reuseport_server;
+    // serves for inside clients on this host, through the local socket of the inward port
+    typedef local_server inward_local_server;
     // HTTP server used to report the system status
     typedef mn::HttpServer report_server;
 
+    // the round trip time of a peer is the time the calls wait for it's responses, see peer_stats,
+    // a peer inside the cluster is looked up first
+    inline void init_peer_stats() {
+      atlas::rpc::async_task_manager::ref().set_response_callback(
+          [](atlas::rpc::endpoint_id source, std::chrono::nanoseconds elapsed) {
+        uint32_t ip = atlas::rpc::endpoint_ip(source);
+        if (!inward_connection_pool::ref().on_response(ip, elapsed)) outward_connection_pool::ref().on_response(ip, elapsed);
+      });
+
+      LOG(INFO) << "peer stats : round trip time from the responses";
+    }
+
   } // net
 } // pioneer
 
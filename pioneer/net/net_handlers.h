@@ -23,6 +23,11 @@
 #ifndef PIONEER_NET_HANDLERS_H_
 #define PIONEER_NET_HANDLERS_H_
 
+#include <cstddef>
+#include <cstring>
+#include <map>
+#include <vector>
+
 #include <glog/logging.h>
 #include <glog/stl_logging.h>
 #include <atlas/io/iomanip.h> // put_time
@@ -30,8 +35,32 @@
 #include <muduo/net/http/HttpRequest.h>
 #include <muduo/net/http/HttpResponse.h>
 
+#include <pioneer/net/buffer_pool.h>
+#include <pioneer/net/call_batches.h>
+#include <pioneer/net/inspector.h>
 #include <pioneer/net/ip.h>
+#include <pioneer/net/log_replication.h>
+#include <pioneer/net/connection_reaper.h>
+#include <pioneer/net/connection_stats.h>
+#include <pioneer/net/drain.h>
+#include <pioneer/net/fair_queue.h>
+#include <pioneer/net/frame_chunks.h>
+#include <pioneer/net/gossip.h>
+#include <pioneer/net/http_gateway.h>
+#include <pioneer/net/leader.h>
+#include <pioneer/net/local_delivery.h>
+#include <pioneer/net/loop_monitor.h>
+#include <pioneer/net/mcast_dedupe.h>
+#include <pioneer/net/mcast_tasks.h>
+#include <pioneer/net/metrics.h>
+#include <pioneer/net/offload.h>
+#include <pioneer/net/reliable_multicast.h>
 #include <pioneer/net/request.h>
+#include <pioneer/net/rpc_stream.h>
+#include <pioneer/net/rx_timestamps.h>
+#include <pioneer/net/socket_profile.h>
+#include <pioneer/net/tls.h>
+#include <pioneer/net/traffic_capture.h>
 #include <pioneer/system/status.h>
 #include <pioneer/system/context.h>
 #include <pioneer/system/thread_pool.h>
@@ -50,27 +79,35 @@ namespace pioneer {
 
       // connections actively connected by an app engine
       static void on_outward_server_connection(const mn::TcpConnectionPtr& conn) {
+        loop_busy_scope busy;
         handle_connection(outward_server_connection, conn);
       }
 
       // connections accepted by data node server
       static void on_inward_server_connection(const mn::TcpConnectionPtr& conn) {
+        loop_busy_scope busy;
         handle_connection(inward_server_connection, conn);
       }
 
       // connections actively connected by this data node server
       static void on_inward_client_connection(const mn::TcpConnectionPtr& conn) {
+        loop_busy_scope busy;
         handle_connection(inward_client_connection, conn);
       }
 
       template<typename pool_tag>
       static void on_write_complete(const mn::TcpConnectionPtr& conn) {
-        connection_pool<pool_tag>::ref().put(conn);
+        loop_busy_scope busy;
+        connection_pool<pool_tag>::ref().on_write_complete(conn);
       }
 
     private:
 
       static void handle_connection(connection_type type, const mn::TcpConnectionPtr& conn) {
+        connection_stats::clock::time_point start = connection_stats::clock::now();
+        // a connection going down is destroyed by the handlers
+        bool connected = conn->connected();
+
         std::string peer_ip_port = conn->peerAddress().toIpPort();
         std::string local_ip_port = conn->localAddress().toIpPort();
 
@@ -78,6 +115,16 @@ namespace pioneer {
 
         try_set_local_ip(ip::get_ip_part(local_ip_port));
 
+        if (connected) {
+          const socket_profiles& profiles = socket_profiles::ref();
+          (type == outward_server_connection ? profiles.outward() : profiles.inward()).apply(conn->fd());
+        }
+
+        atlas::sharded_counter& active = (type == outward_server_connection) ?
+            system::status::active_outer_connections : system::status::active_inner_connections;
+        if (conn->connected()) ++active;
+        else --active;
+
         if (type == inward_client_connection) {
           handle_inner_client_connection(conn);
           stat_inward_connection(conn);
@@ -90,6 +137,8 @@ namespace pioneer {
           handle_outward_server_connection(conn);
           stat_outward_connection(conn);
         }
+
+        connection_stats::ref().record(type, connected, connection_stats::clock::now() - start);
       }
 
       static void handle_outward_server_connection(const mn::TcpConnectionPtr& conn) {
@@ -98,10 +147,17 @@ namespace pioneer {
 
         bool connected = conn->connected();
         if (connected) {
-          outward_connection_pool::ref().put(conn);
+          // a TLS connection is pooled once the kernel has the keys, see message_handler::establish_tls
+          const std::shared_ptr<tls_context>& tls = tls_contexts::ref().outward();
+          if (tls) conn->setContext(std::make_shared<tls_session>(*tls));
+          else outward_connection_pool::ref().put(conn);
+
+          connection_reaper::ref().track(conn);
         }
         else {
-          outward_connection_pool::ref().erase(peer_ip_port);
+          connection_reaper::ref().untrack(conn);
+          outward_connection_pool::ref().erase(conn);
+          if (http_gateway::ref().enabled()) http_gateway::ref().erase(conn);
 
           // server side half-close : close the connection channel
           conn->shutdown();
@@ -120,7 +176,7 @@ namespace pioneer {
           inward_connection_pool::ref().put(conn);
         }
         else {
-          inward_connection_pool::ref().erase(peer_ip_port);
+          inward_connection_pool::ref().erase(conn);
 
           // server side half-close : close the connection channel
           conn->shutdown();
@@ -137,16 +193,13 @@ namespace pioneer {
         bool connected = conn->connected();
         if (connected) {
           inward_connection_pool::ref().put(conn);
+
+          // the peer routes to us by our labels
+          if (locality::ref().enabled()) rpc::locality_rfc::tell(peer_ip);
         }
         else {
-          inward_connection_pool::ref().erase(peer_ip_port);
-          inward_client_pool::ref().erase(peer_ip_port);
-
-          if (inward_client_pool::ref().empty()) {
-            // since all connections raised by client are disconnected,
-            // the tcp client pool can stop safely
-            inward_client_pool::ref().destroy();
-          }
+          // the client pool reconnects it, or removes it if the pool is stopping
+          inward_connection_pool::ref().erase(conn);
         }
       }
 
@@ -156,17 +209,16 @@ namespace pioneer {
 
         bool connected = conn->connected();
 
-        std::lock_guard<std::mutex> guard(system::context::mutex);
-        if (connected) {
-          system::context::outside_ip_list.insert(peer_ip);
-        }
-        else {
-          system::context::outside_ip_list.erase(peer_ip);
-        }
+        uint64_t version = system::context::outside_nodes.update([&peer_ip, connected](system::membership& m) {
+          if (connected) m.ip_list.insert(peer_ip);
+          else m.ip_list.erase(peer_ip);
+        });
 
-        system::context::outside_node_count = system::context::outside_ip_list.size();
+        size_t count = system::context::outside_nodes.get()->ip_list.size();
+        system::context::outside_node_count = count;
 
-        LOG(INFO) << "outside ip list : " << system::context::outside_ip_list;
+        LOG(INFO) << "outside node " << peer_ip << (connected ? " joined" : " left")
+            << ", " << count << " nodes, version " << version;
       }
 
       static void stat_inward_connection(const mn::TcpConnectionPtr& conn) {
@@ -175,86 +227,476 @@ namespace pioneer {
 
         bool connected = conn->connected();
 
-        std::lock_guard<std::mutex> guard(system::context::mutex);
-        if (connected) {
-          system::context::inside_ip_list.insert(peer_ip);
-        }
-        else {
-          system::context::inside_ip_list.erase(peer_ip);
+        // the gossip tells who the inside nodes are, a connection coming and going is not a member doing so
+        if (gossip::ref().enabled()) {
+          LOG(INFO) << "inside node " << peer_ip << (connected ? " connected" : " disconnected");
+          return;
         }
 
-        system::context::inner_node_count = system::context::inside_ip_list.size();
+        uint64_t version = system::context::inside_nodes.update([&peer_ip, connected](system::membership& m) {
+          if (connected) {
+            m.ip_list.insert(peer_ip);
+            m.ring.add(peer_ip);
+          }
+          else {
+            m.ip_list.erase(peer_ip);
+            m.ring.remove(peer_ip);
+          }
+        });
+
+        size_t count = system::context::inside_nodes.get()->ip_list.size();
+        system::context::inner_node_count = count;
 
-        LOG(INFO) << "inside ip list : " << system::context::inside_ip_list;
+        LOG(INFO) << "inside node " << peer_ip << (connected ? " joined" : " left")
+            << ", " << count << " nodes, version " << version;
       }
 
       static void try_set_local_ip(const std::string& local_ip) {
         std::lock_guard<std::mutex> guard(system::context::mutex);
         if (system::context::local_ip.empty()) {
           system::context::local_ip = local_ip;
+          local_delivery::ref().set_self(atlas::rpc::endpoint_ip(atlas::rpc::parse_endpoint(local_ip)));
         }
       }
     };
 
+    class timer_handler {
+    public:
+
+      // complete the pending RPC calls whose deadlines have passed, with rpc_timed_out
+      static void on_rpc_sweep_timer() {
+        loop_busy_scope busy;
+        atlas::rpc::sync_task_manager::ref().sweep();
+        atlas::rpc::async_task_manager::ref().sweep();
+      }
+
+      // remove the sessions which are idle for too long, and forget the old cancellations
+      static void on_session_sweep_timer() {
+        loop_busy_scope busy;
+        session_manager::ref().sweep();
+        atlas::rpc::cancellations::ref().sweep();
+      }
+
+      // close the outward connections idle for too long, or the most bloated ones over the memory cap
+      static void on_connection_sweep_timer() {
+        loop_busy_scope busy;
+        connection_reaper::ref().sweep();
+      }
+
+      // drop the streams idle for too long, see rpc_streams
+      static void on_stream_sweep_timer() {
+        loop_busy_scope busy;
+        rpc_streams::ref().sweep();
+      }
+
+      // ask the multicast senders for the lost datagrams
+      static void on_mcast_nak_timer() {
+        loop_busy_scope busy;
+        rpc::rmcast_rfc::send_naks();
+      }
+
+      // send the aggregated responses of the multicast calls
+      static void on_ack_flush_timer() {
+        loop_busy_scope busy;
+        ack_aggregator::ref().flush();
+      }
+
+      // ship the log records appended since the last commit to the replicas
+      static void on_log_replication_timer() {
+        loop_busy_scope busy;
+        log_replicator::ref().flush();
+      }
+
+      // move the profiler's samples into the window of the second, see system::profiler
+      static void on_profiler_timer() {
+        loop_busy_scope busy;
+        system::profiler::instance().collect();
+      }
+
+      // a round of the membership gossip, see net::gossip
+      static void on_gossip_timer() {
+        loop_busy_scope busy;
+        gossip::ref().tick();
+      }
+
+      // stand for the leader, or keep the lease, see net::leader_election
+      static void on_leader_timer() {
+        leader_election::ref().tick();
+      }
+
+      // the peers without labels are placed again by their round trip times, see net::locality
+      static void on_locality_timer() {
+        locality::ref().refresh();
+      }
+
+      // drive the drain once it's asked, see net::drain
+      static void on_drain_timer() {
+        drain::ref().poll();
+      }
+
+      // the load of this node to the peers, see net::offload
+      static void on_offload_timer() {
+        offload::ref().report();
+      }
+
+      // in seconds
+      static double rpc_sweep_interval() {
+        return atlas::rpc::async_task_manager::ref().tick().count() / 1000.0;
+      }
+    };
+
+    /*
+     * The data plane tasks pulled out of one read, they are scheduled into the worker pool at once,
+     * see thread_pool::schedule_bulk, the tasks which the full pool refuses are rejected
+     * */
+    class task_batch {
+    public:
+
+      typedef atlas::adaptive_thread_pool::task_type task_type;
+
+    public:
+
+      task_batch() = default;
+      task_batch(const task_batch&) = delete;
+      task_batch& operator=(const task_batch&) = delete;
+
+    public:
+
+      void add(request_ptr&& request) {
+        _requests.push_back(request.get());
+        _tasks.push_back(task_type(std::bind(&request::execute_or_shed, std::move(request))));
+      }
+
+      void flush() {
+        if (_tasks.empty()) return;
+
+        // a rejected task is left untouched, so it still holds it's request
+        size_t scheduled = system::worker_pool::ref().schedule_bulk(_tasks.begin(), _tasks.end());
+        for (size_t i = scheduled; i < _requests.size(); ++i) _requests[i]->reject();
+
+        _tasks.clear();
+        _requests.clear();
+      }
+
+    private:
+
+      std::vector<task_type> _tasks;
+      std::vector<request*> _requests;
+    };
+
     class message_handler {
     public:
 
       enum message_type { outer_message, inner_message, reporter_message };
 
+      // a frame larger than this is considered to be garbage, and the connection will be closed
+      static const int32_t max_frame_size = 64 * 1024 * 1024;
+
     public:
 
       static void on_outward_server_message(const mn::TcpConnectionPtr& conn, mn::Buffer* buf, muduo::Timestamp t) {
+        loop_busy_scope busy;
+        // before the input buffer is taken over, it's the most the connection holds
+        connection_reaper::ref().on_read(conn);
+
+        std::shared_ptr<tls_session> tls = tls_session_of(conn);
+        if (tls) {
+          // after a failure the bytes are dropped until the peer closes
+          if (tls->get_state() == tls_session::failed) {
+            buf->retrieveAll();
+            return;
+          }
+
+          if (!establish_tls(conn, tls->on_read(conn, buf), *tls)) return;
+        }
+
+        // a HTTP client on the same port, see http_gateway
+        if (http_gateway::ref().enabled() && http_gateway::is_http(buf->peek(), buf->readableBytes())) {
+          http_gateway::ref().on_message(conn, buf);
+          return;
+        }
+
         handle_tcp_message(outer_message, conn, buf, t);
       }
 
+      // the handshake of a TLS connection may finish once it's output is written out
+      static void on_outward_server_write_complete(const mn::TcpConnectionPtr& conn) {
+        loop_busy_scope busy;
+
+        connection_reaper::ref().sample(conn);
+
+        std::shared_ptr<tls_session> tls = tls_session_of(conn);
+        if (!tls) {
+          outward_connection_pool::ref().on_write_complete(conn);
+          return;
+        }
+
+        if (tls->get_state() != tls_session::failed && establish_tls(conn, tls->on_write_complete(conn), *tls)) {
+          handle_tcp_message(outer_message, conn, conn->inputBuffer(), muduo::Timestamp::now());
+        }
+      }
+
       static void on_inward_client_message(const mn::TcpConnectionPtr& conn, mn::Buffer* buf, muduo::Timestamp t) {
+        loop_busy_scope busy;
         handle_tcp_message(inner_message, conn, buf, t);
       }
 
       static void on_inward_server_message(const mn::TcpConnectionPtr& conn, mn::Buffer* buf, muduo::Timestamp t) {
+        loop_busy_scope busy;
         handle_tcp_message(inner_message, conn, buf, t);
       }
 
       static void on_mcast_message(const std::string& source_ip_port, const char* message, size_t len) {
-        // for multicast, the source port must not be used to send back the respond
-        run_task(ip::get_ip_part(source_ip_port), message, len);
+        loop_busy_scope busy;
+        // the receive buffer of the mcast server is reused for the next datagram, so we have to keep a copy
+        std::shared_ptr<std::string> datagram(new std::string(message, len));
+
+        // for multicast, the source port must not be used to send back the respond, port 0 means any connection of the node
+        atlas::rpc::endpoint_id source = atlas::rpc::parse_endpoint(source_ip_port);
+        run_task(atlas::rpc::make_endpoint(atlas::rpc::endpoint_ip(source), 0), datagram, datagram->data(), datagram->size());
+      }
+
+      // the datagrams are copied into the slots of the task ring, and only if the ring is full,
+      // into a buffer shared by the requests of the datagram, the duplicates are dropped before
+      static void on_mcast_batch(const mcast_datagram* datagrams, size_t count) {
+        loop_busy_scope busy;
+        for (size_t i = 0; i < count; ++i) {
+          const char* data = datagrams[i].data;
+          size_t size = datagrams[i].size;
+          rx_time_scope stamp(datagrams[i].received);
+
+          // it's been run in process already, see rpc::mcast_client
+          if (looped_back(data, size)) continue;
+
+          // strip the header of a reliable datagram, and drop the duplicates
+          if (!rmcast_receiver::ref().accept(datagrams[i].source, data, size)) continue;
+
+          // a large message is run once all the fragments arrive, from it's own buffer
+          if (is_mcast_fragment(data, size)) {
+            std::shared_ptr<std::string> message = mcast_reassembler::ref().add(datagrams[i].source, data, size);
+            if (message && !mcast_dedupe::ref().duplicate(message->data(), message->size())) {
+              run_frames(datagrams[i].source, message, message->data(), message->size());
+            }
+
+            continue;
+          }
+
+          // delivered twice, or this node's own, see mcast_dedupe
+          if (mcast_dedupe::ref().duplicate(data, size)) continue;
+
+          if (mcast_task_ring::ref().schedule(datagrams[i].source, data, size)) continue;
+
+          std::shared_ptr<std::string> datagram(new std::string(data, size));
+          run_frames(datagrams[i].source, datagram, datagram->data(), datagram->size());
+        }
+      }
+
+      // the frames this node sends to itself, see net::local_delivery
+      static void on_local_frames(const std::shared_ptr<std::string>& frames) {
+        run_frames(atlas::rpc::make_endpoint(local_delivery::ref().self(), 0), frames, frames->data(), frames->size());
       }
 
       static void on_report_server_message(const mn::HttpRequest& request, mn::HttpResponse* response) {
+        loop_busy_scope busy;
+        if (inspector::ref().handle(request, response)) return;
+
         handle_http_message(request, response);
       }
 
     private:
 
-      static void handle_tcp_message(message_type type, const mn::TcpConnectionPtr& conn, mn::Buffer* buf, muduo::Timestamp t) {
-        const char* message = buf->peek();
-        size_t len = buf->readableBytes();
+      /*
+       * Once the kernel has the keys of a TLS connection, the connection is pooled, which replaces the session in
+       * it's context, and the plaintext of the records decrypted before goes to the input buffer, return true if
+       * the input buffer should be handled
+       * */
+      static bool establish_tls(const mn::TcpConnectionPtr& conn, tls_session::state state, tls_session& tls) {
+        if (state == tls_session::failed) {
+          LOG(ERROR) << "TLS failed with " << conn->peerAddress().toIpPort() << ", close the connection";
+          ++system::status::failed_outer_connections;
+          conn->shutdown();
+          return false;
+        }
 
-        DLOG(INFO) << "message: " << len << " bytes, "
-            << conn->peerAddress().toIpPort() << " -> " << conn->localAddress().toIpPort();
+        if (state != tls_session::offloaded) return false;
 
-        const atlas::rpc::request_header* header = reinterpret_cast<const atlas::rpc::request_header*>(buf->peek());
+        outward_connection_pool::ref().put(conn);
 
-        // TODO : handle TCP stick package problem
+        mn::Buffer* input = conn->inputBuffer();
+        tls.plain().append(input->peek(), input->readableBytes());
+        input->retrieveAll();
+        input->swap(tls.plain());
 
-        if (len < sizeof(header->length) || (int32_t)len < header->length) {
-          LOG(INFO) << "i will read more data. read " << len
-              << " bytes while " << header->length << " bytes expected.";
+        return true;
+      }
 
-          return;
-        }
+      // a reliable datagram of this node's own to the cluster, while the copy of this node is delivered in process
+      static bool looped_back(const char* data, size_t size) {
+        if (size < sizeof(rmcast_header) || !mcast_client::ref().reliable()) return false;
 
-        try {
-          run_task(conn->peerAddress().toIpPort(), message, len);
+        local_delivery& local = local_delivery::ref();
+        if (!local.local(local.self())) return false;
+
+        rmcast_header h;
+        std::memcpy(&h, data, sizeof(h));
+        return h.magic == RMCAST_MAGIC && h.sender == mcast_client::ref().sender_id();
+      }
+
+      // the sender may pack several frames into one datagram, see mcast_client
+      static void run_frames(const sockaddr_in& from, const atlas::rpc::message::holder_type& holder,
+          const char* data, size_t size) {
+        // for multicast, the source port must not be used to send back the respond, port 0 means any connection of the node
+        run_frames(atlas::rpc::make_endpoint(atlas::rpc::endpoint_ip(ip::to_endpoint(from)), 0), holder, data, size);
+      }
+
+      static void run_frames(atlas::rpc::endpoint_id source, const atlas::rpc::message::holder_type& holder,
+          const char* data, size_t size) {
+        task_batch batch;
+
+        const char* frame = data;
+        const char* end = data + size;
+        while (frame < end) {
+          int32_t frame_size = 0;
+          if (end - frame >= static_cast<ptrdiff_t>(sizeof(int32_t))) std::memcpy(&frame_size, frame, sizeof(frame_size));
+
+          if (frame_size < static_cast<int32_t>(sizeof(atlas::rpc::request_header)) || frame_size > end - frame
+              || !atlas::rpc::message::known_version(frame, frame_size)) {
+            LOG(ERROR) << "bad frame, size " << frame_size << " from " << atlas::rpc::endpoint_to_string(source) << ", drop the rest of the datagram";
+            break;
+          }
+
+          try {
+            run_task(source, holder, frame, frame_size, &batch);
+          }
+          catch (const net_error& e) {
+            LOG(ERROR) << e.what();
+          }
+          catch (...) {
+            LOG(ERROR) << "unexpected exception";
+          }
+
+          frame += frame_size;
         }
-        catch (const net_error& e) {
-          LOG(ERROR) << e.what();
+
+        batch.flush();
+      }
+
+      static void handle_tcp_message(message_type type, const mn::TcpConnectionPtr& conn, mn::Buffer* buf, muduo::Timestamp t) {
+        // the peer is packed once per read, the ip:port string is built for logging only
+        atlas::rpc::endpoint_id peer = ip::to_endpoint(conn->peerAddress().getSockAddrInet());
+
+        DVLOG(2) << "message: " << buf->readableBytes() << " bytes, " << conn->peerAddress().toIpPort() << " -> " << conn->localAddress().toIpPort();
+
+        const socket_profiles& profiles = socket_profiles::ref();
+        (type == outer_message ? profiles.outward() : profiles.inward()).on_read(conn->fd());
+
+        // muduo reads without the control messages, the requests take the time the loop woke up, see rx_timestamps
+        rx_time_scope stamp(rx_timestamps::ref().enabled() ? t.microSecondsSinceEpoch() * 1000 : 0);
+
+        // the requests are executed in the worker threads after this callback returns, instead of copying
+        // every request out of the connection's buffer, we take over the whole buffer and share it among
+        // the requests it carries, only the partial tail frame, if any, is copied back
+        std::shared_ptr<mn::Buffer> frames;
+        mn::Buffer* source = buf;
+
+        task_batch batch;
+        size_t messages = 0, bytes = 0;
+        int32_t flags = 0;
+
+        // a single read may carry several pipelined requests, and the last one may be incomplete,
+        // so we pull every complete frame out of the buffer and leave the partial tail for the next read
+        while (source->readableBytes() >= sizeof(int32_t)) {
+          int32_t frame_size = 0;
+          std::memcpy(&frame_size, source->peek(), sizeof(frame_size));
+
+          if (frame_size < static_cast<int32_t>(sizeof(atlas::rpc::request_header)) || frame_size > max_frame_size
+              || !atlas::rpc::message::known_version(source->peek(), source->readableBytes())) {
+            LOG(ERROR) << "bad frame, size " << frame_size << " from " << conn->peerAddress().toIpPort() << ", close the connection";
+
+            source->retrieveAll();
+            conn->shutdown();
+
+            if (type == outer_message) ++system::status::failed_outer_connections;
+            else ++system::status::failed_inner_connections;
+
+            // the requests before the bad frame are still served
+            batch.flush();
+            count_received(conn, bytes, messages);
+            return;
+          }
+
+          if (source->readableBytes() < static_cast<size_t>(frame_size)) {
+            DVLOG(2) << "i will read more data. read " << source->readableBytes()
+                << " bytes while " << frame_size << " bytes expected.";
+
+            break;
+          }
+
+          if (!frames) {
+            // the connection reads on into a pooled buffer sized to the recent reads, the one taken over
+            // goes back to the pool when the last request in it is done
+            size_t read = buf->readableBytes();
+            peer_stats* stats = peer_stats_of(conn);
+
+            frames = buffer_pool::ref().borrow(stats ? stats->on_read(read) : read);
+            frames->swap(*buf);
+            source = frames.get();
+          }
+
+          flags |= static_cast<uint8_t>(source->peek()[offsetof(atlas::rpc::request_header, flags)]);
+
+          try {
+            // a large frame, or several ones sent together, is run once it's last chunk arrives, see frame_chunks
+            if (frame_chunks::is_chunk(source->peek())) run_chunk(peer, source->peek(), frame_size);
+            // a draining node takes no new outward work, the client goes to another node
+            else if (type == outer_message && drain::ref().draining()) shed_task(peer, frames, source->peek(), frame_size);
+            else if (type == outer_message && fair_queue::ref().enabled()) run_outward_task(peer, frames, source->peek(), frame_size, &batch);
+            else run_task(peer, frames, source->peek(), frame_size, &batch);
+          }
+          catch (const net_error& e) {
+            LOG(ERROR) << e.what();
+          }
+          catch (...) {
+            LOG(ERROR) << "unexpected exception";
+          }
+
+          source->retrieve(frame_size);
+          bytes += frame_size;
+          ++messages;
         }
-        catch (...) {
-          LOG(ERROR) << "unexpected exception";
+
+        batch.flush();
+        count_received(conn, bytes, messages);
+        if (flags & atlas::rpc::message_accepts_compression) accept_compression(conn);
+        if (flags & atlas::rpc::message_accepts_chunks) accept_chunks(conn);
+
+        if (frames && frames->readableBytes()) {
+          buf->append(frames->peek(), frames->readableBytes());
         }
+      }
+
+      static void count_received(const mn::TcpConnectionPtr& conn, size_t bytes, size_t messages) {
+        if (messages == 0) return;
+
+        peer_stats* stats = peer_stats_of(conn);
+        if (stats) stats->on_receive(bytes, messages);
+      }
+
+      // the frames sent to the peer may be compressed from now on, see frame_compression
+      static void accept_compression(const mn::TcpConnectionPtr& conn) {
+        peer_stats* stats = peer_stats_of(conn);
+        if (stats && !stats->accepts_compression.load(std::memory_order_relaxed)) stats->accepts_compression = true;
+      }
 
-        buf->retrieveAll();
+      // the large frames sent to the peer may be chunked from now on, see frame_chunks
+      static void accept_chunks(const mn::TcpConnectionPtr& conn) {
+        peer_stats* stats = peer_stats_of(conn);
+        if (stats && !stats->accepts_chunks.load(std::memory_order_relaxed)) stats->accepts_chunks = true;
+      }
+
+      static void run_chunk(atlas::rpc::endpoint_id peer, const char* chunk, size_t size) {
+        std::shared_ptr<std::string> frames = frame_chunks::ref().add(peer, chunk, size);
+        if (frames) run_frames(peer, frames, frames->data(), frames->size());
       }
 
       static void handle_http_message(const mn::HttpRequest& request, mn::HttpResponse* response) {
@@ -274,27 +716,14 @@ namespace pioneer {
               << "<li>" << "elapsed:" << elapsed << "s</li>"
               << "</ol>";
 
-          std::stringstream ss2;
-          ss2 << "<ol>";
-          for (size_t i = 0; i < system::status::test_rounds; ++i) {
-            unsigned long long sent = system::status::udp_test_sent[i];
-            double failure_rate = (sent == 0) ? 0 : (1 - 1.0 * system::status::good_ack[i] / sent);
-
-            ss2 << "<li>"
-                << "<span style='padding:10px'>" << "mcast sent:" << system::status::udp_test_sent[i] << "</span>"
-                << "<span style='padding:10px'>" << "mcast received:" << system::status::udp_test_received[i] << "</span>"
-                << "<span style='padding:10px'>" << "interval:" << (system::status::udp_test_interval[i] / 1000.0) << "ms</span>"
-                << "<span style='padding:10px'>" << "good ack:" << system::status::good_ack[i] << "</span>"
-                << "<span style='padding:10px'>" << "failure rate:" << 100 * failure_rate << "%</span>"
-                << "</li>";
-          }
-          ss2 << "</ol>";
+          std::stringstream ss4;
+          write_rpc_stats(ss4, elapsed);
 
           std::stringstream ss3;
           ss3 << "<html><head><title>pioneer server status report</title></head>"
               << "<body><h1>pioneer server status report</h1>"
               << ss.str()
-              << ss2.str()
+              << ss4.str()
               << "</body></html>";
 
           system::status::last_check_time = now;
@@ -303,6 +732,30 @@ namespace pioneer {
           muduo::string result(str.data(), str.size());
           response->setBody(result);
         }
+        else if (request.path() == "/ready") {
+          // for the deployments, a node is taken into service once it's ready, 503 before, and out once it drains
+          bool ready = system::status::ready.load(std::memory_order_acquire);
+
+          response->setStatusCode(ready ? mn::HttpResponse::k200Ok : static_cast<mn::HttpResponse::HttpStatusCode>(503));
+          response->setStatusMessage(ready ? "OK" : "Service Unavailable");
+          response->setContentType("text/plain");
+          response->setBody(ready ? "ready\n" : drain::ref().draining() ? "draining\n" : "starting\n");
+        }
+        else if (request.path() == "/metrics" || request.path() == "/metrics.json") {
+          // for the scrapers, in the Prometheus text format, or in JSON
+          bool json = (request.path() == "/metrics.json");
+
+          std::stringstream ss;
+          if (json) metrics::write_json(ss, metrics::collect());
+          else metrics::write_prometheus(ss, metrics::collect());
+
+          response->setStatusCode(mn::HttpResponse::k200Ok);
+          response->setStatusMessage("OK");
+          response->setContentType(json ? "application/json" : "text/plain; version=0.0.4");
+
+          std::string str = ss.str();
+          response->setBody(muduo::string(str.data(), str.size()));
+        }
         else {
           response->setStatusCode(mn::HttpResponse::k404NotFound);
           response->setStatusMessage("Not Found");
@@ -310,14 +763,154 @@ namespace pioneer {
         }
       }
 
-      // build a executable task and put the task into the worker thread pool
-      static void run_task(const std::string& source_ip_port, const char* message, size_t len) {
-        auto request = session_manager::ref().build_request(source_ip_port, message, len);
-        system::worker_pool::ref().schedule(std::bind(&request::execute, request));
+      // the calls and the latency percentiles of every stage per function id, see atlas::rpc::rpc_stats,
+      // the throughput is the calls since the last check, the page is served by one thread
+      static void write_rpc_stats(std::ostream& os, time_t elapsed) {
+        static std::map<int, unsigned long long> last_calls;
+
+        os << "<table border='1' cellpadding='4'><tr><th>fn id</th><th>calls</th><th>calls/s</th>";
+        for (int s = 0; s < atlas::rpc::rpc_stage_count; ++s) {
+          os << "<th>" << atlas::rpc::stage_name(s) << " p50/p99/p999/max (us)</th>";
+        }
+        os << "</tr>";
+
+        for (const auto& fn : atlas::rpc::rpc_stats::instance().collect()) {
+          unsigned long long calls = fn.second.stages[atlas::rpc::stage_handler].total;
+          unsigned long long& last = last_calls[fn.first];
+          double rate = (elapsed > 0 && calls >= last) ? 1.0 * (calls - last) / elapsed : 0;
+          last = calls;
+
+          os << "<tr><td>" << fn.first << "</td><td>" << calls << "</td><td>" << rate << "</td>";
+          for (const atlas::rpc::latency_histogram& h : fn.second.stages) {
+            os << "<td>" << h.percentile(0.5) / 1000.0 << " / " << h.percentile(0.99) / 1000.0 << " / "
+                << h.percentile(0.999) / 1000.0 << " / " << h.max / 1000.0 << "</td>";
+          }
+          os << "</tr>";
+        }
+
+        os << "</table>";
+      }
+
+      // respond the busy error without building a request
+      static void shed_task(atlas::rpc::endpoint_id source, const atlas::rpc::message::holder_type& holder,
+          const char* message, size_t len) {
+        drain::ref().on_shed();
+        request::shed(atlas::rpc::message(holder, message, len), source);
       }
 
+      // the client over it's quota is answered busy at once, the others' data plane requests wait their turns,
+      // see fair_queue
+      static void run_outward_task(atlas::rpc::endpoint_id source, const atlas::rpc::message::holder_type& holder,
+          const char* message, size_t len, task_batch* batch) {
+        fair_queue& queue = fair_queue::ref();
+        uint64_t client = queue.client_of(source, message);
+
+        if (!queue.admit(client)) {
+          request::shed(atlas::rpc::message(holder, message, len), source);
+          return;
+        }
+
+        run_task(source, holder, message, len, batch, queue.queueing() ? &client : nullptr);
+      }
+
+      // build a executable task and put the task into the worker thread pool, or the control pool
+      // if it's a control plane one, see fn_priorities, or run it here if inline, the data plane ones of a connection
+      // keep their order if ordered, see worker_strands, and are rejected when we are overloaded, see admission_control
+      // the message is borrowed from the holder, which is kept alive until the task finishes
+      // the unordered data plane tasks are collected into the batch if any, and scheduled when it's flushed, or
+      // wait in the fair queue if it's an outward client's, see fair_queue
+      static void run_task(atlas::rpc::endpoint_id source, const atlas::rpc::message::holder_type& holder,
+          const char* message, size_t len, task_batch* batch = nullptr, const uint64_t* client = nullptr) {
+        // a response is a lookup and a callback, no session, no request and no hop to a worker
+        if (system::worker_settings::inline_completions && completion(message, len)) {
+          complete(source, message, len);
+          return;
+        }
+
+        traffic_capture::ref().record(source, message, len);
+
+        auto request = session_manager::ref().build_request(source, holder, message, len);
+
+        if (system::worker_settings::run_inline) {
+          request->execute();
+          return;
+        }
+
+        // the request is moved into the task, which keeps it inline, no allocation and no reference counting
+        unsigned priority = system::fn_priorities::ref().find(request->fn_id());
+        if (priority != system::fn_priorities::data_plane) {
+          system::control_pool::ref().schedule(atlas::prio_thread_pool::task_type(priority,
+              std::bind(&request::execute, std::move(request))));
+        }
+        else if (offload::ref().overloaded() && offload::ref().offloadable(request->fn_id())) {
+          // a less loaded peer runs it, or it's queued here
+          uint32_t peer = offload::ref().target();
+          if (peer) request->offload(peer);
+          else schedule_data_plane(source, std::move(request), batch, client, len);
+        }
+        else {
+          schedule_data_plane(source, std::move(request), batch, client, len);
+        }
+      }
+
+      // the builtin calls which deliver the results of this node's calls, a compressed one goes to the workers
+      static bool completion(const char* message, size_t len) {
+        atlas::rpc::request_header h;
+        std::memcpy(&h, message, sizeof(h));
+
+        if (h.flags & atlas::rpc::message_compressed) return false;
+
+        return h.fn_id == atlas::rpc::fn_ids::resume_task || h.fn_id == atlas::rpc::fn_ids::resume_thread
+            || h.fn_id == atlas::rpc::fn_ids::resume_task_batch;
+      }
+
+      // the response is decoded from the buffer it's read into, the caller's callback or future completes here
+      static void complete(atlas::rpc::endpoint_id source, const char* message, size_t len) {
+        atlas::memory::arena_scope scope;
+
+        atlas::rpc::message m(message, len);
+        const atlas::rpc::request_header* h = m.header();
+        atlas::rpc::rpc_context context(h->client_id, h->return_type, h->session_id, source);
+
+        atlas::rpc::dispatcher_manager::ref().dispatch(m, context);
+      }
+
+      // the ordered ones keep the order of their connection, not the turns of the fair queue, the ones of a
+      // function with a batch handler run with the others queued, see call_batches
+      static void schedule_data_plane(atlas::rpc::endpoint_id source, request_ptr&& request, task_batch* batch,
+          const uint64_t* client = nullptr, size_t len = 0) {
+        if (system::worker_settings::ordered) {
+          system::worker_strands::ref().schedule(source, std::bind(&request::execute_or_shed, std::move(request)));
+        }
+        else if (client) {
+          fair_queue::ref().enqueue(*client, std::move(request), len);
+        }
+        else if (call_batches::ref().batchable(*request)) {
+          call_batches::ref().add(std::move(request));
+        }
+        else if (batch) {
+          batch->add(std::move(request));
+        }
+        else {
+          net::request* r = request.get();
+          atlas::adaptive_thread_pool::task_type task(std::bind(&request::execute_or_shed, std::move(request)));
+
+          // the worker pool is full, a rejected task is left untouched, so it still holds the request
+          if (!system::worker_pool::ref().schedule(std::move(task))) r->reject();
+        }
+      }
+
+    };
+
+    // the frames sent to this node itself are run as the ones of a datagram from it
+    struct local_receiver_binder {
+      local_receiver_binder() {
+        local_delivery::ref().set_receiver(&message_handler::on_local_frames);
+      }
     };
 
+    static local_receiver_binder __pioneer_local_receiver;
+
   } // net
 } // pioneer
 
@@ -23,22 +23,47 @@
 #ifndef PIONEER_NET_POOLS_H_
 #define PIONEER_NET_POOLS_H_
 
+#include <pthread.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <cerrno>
+#include <cstring>
+
 #include <string>
 #include <atomic>
+#include <deque>
 #include <map>
+#include <memory>
+#include <set>
+#include <unordered_map>
+#include <vector>
+#include <algorithm>
 #include <mutex>
 #include <condition_variable>
+#include <functional>
 
+#include <boost/any.hpp>
 #include <boost/bind.hpp>
 #include <boost/ptr_container/ptr_map.hpp>
 #include <glog/logging.h>
 #include <atlas/singleton.h>
-#include <atlas/container/blocking_concurrent_box.h>
+#include <atlas/fast_random.h>
+#include <atlas/rpc/result.h>
 #include <muduo/net/EventLoop.h>
 #include <muduo/net/EventLoopThreadPool.h>
 #include <muduo/net/TcpClient.h>
 #include <muduo/net/TcpConnection.h>
 
+#include <pioneer/system/numa.h>
+#include <pioneer/system/profiler.h>
+#include <pioneer/system/status.h>
+#include <pioneer/net/compression.h>
+#include <pioneer/net/connection_reaper.h>
+#include <pioneer/net/frame_chunks.h>
+#include <pioneer/net/ip.h>
+#include <pioneer/net/local_transport.h>
+#include <pioneer/net/loop_queue.h>
+#include <pioneer/net/loop_timers.h>
 #include <pioneer/net/net_error.h>
 
 namespace pioneer {
@@ -46,13 +71,588 @@ namespace pioneer {
 
     namespace mn = muduo::net;
 
+    /*
+     * The traffic of a peer ip in a pool, over all the connections to any port of it, the counters are kept while the
+     * node runs, so they add up across the reconnects.
+     *
+     * The bytes and messages out are counted by the senders, the ones in by the I/O thread of the connection, which
+     * finds the stats in the context of the connection, see peer_stats_of. The round trip time is the
+     * time a caller waits for a response of the peer, see async_task_manager::set_response_callback
+     * */
+    struct peer_stats {
+      peer_stats() : bytes_out(0), messages_out(0), bytes_in(0), messages_in(0), connects(0), reconnects(0),
+        disconnects(0), high_water(0), rtt(0), responses(0), read_size(0), accepts_compression(false), accepts_chunks(false) {}
+
+      void on_send(size_t size, size_t pending) {
+        bytes_out += size;
+        ++messages_out;
+
+        size_t mark = high_water.load(std::memory_order_relaxed);
+        while (pending > mark && !high_water.compare_exchange_weak(mark, pending, std::memory_order_relaxed));
+      }
+
+      void on_receive(size_t size, size_t messages) {
+        bytes_in += size;
+        messages_in += messages;
+      }
+
+      // the average bytes of the reads which carry complete frames, 1/8 for the new sample as rtt, returns it
+      size_t on_read(size_t size) {
+        size_t average = read_size.load(std::memory_order_relaxed);
+        average = average == 0 ? size : average - average / 8 + size / 8;
+        read_size.store(average, std::memory_order_relaxed);
+
+        return average;
+      }
+
+      void on_response(std::chrono::nanoseconds elapsed) {
+        // exponentially weighted moving average, 1/8 for the new sample, the first one is taken as it is,
+        // two responders may race on it and lose a sample, it's fine for an estimation
+        int64_t sample = elapsed.count(), average = rtt.load(std::memory_order_relaxed);
+        rtt.store(average == 0 ? sample : average + (sample - average) / 8, std::memory_order_relaxed);
+        ++responses;
+      }
+
+      std::atomic<unsigned long long> bytes_out;
+      std::atomic<unsigned long long> messages_out;
+      std::atomic<unsigned long long> bytes_in;
+      std::atomic<unsigned long long> messages_in;
+
+      std::atomic<unsigned long long> connects;
+      // the connections established to replace the ones lost
+      std::atomic<unsigned long long> reconnects;
+      std::atomic<unsigned long long> disconnects;
+
+      // the most bytes ever queued on a connection to the peer
+      std::atomic<size_t> high_water;
+
+      // the average round trip time in nanoseconds, 0 if no response is seen yet
+      std::atomic<int64_t> rtt;
+      std::atomic<unsigned long long> responses;
+
+      // the average bytes of a read, see on_read
+      std::atomic<size_t> read_size;
+
+      // the peer is seen with rpc::message_accepts_compression, see frame_compression
+      std::atomic<bool> accepts_compression;
+
+      // the peer is seen with rpc::message_accepts_chunks, see frame_chunks
+      std::atomic<bool> accepts_chunks;
+    };
+
+    typedef std::shared_ptr<peer_stats> peer_stats_ptr;
+
+    // the stats of a peer ip in a pool, and the connections to it now, see connection_pool::peers
+    struct peer_snapshot {
+      uint32_t ip;
+      size_t connections;
+      size_t in_flight;
+      size_t pending_bytes;
+      peer_stats_ptr stats;
+    };
+
+    // the stats of the peer of a pooled connection, kept in the connection's context by connection_pool::put,
+    // nullptr if the connection is not pooled yet, the I/O thread of the connection only
+    inline peer_stats* peer_stats_of(const mn::TcpConnectionPtr& conn) {
+      const peer_stats_ptr* stats = boost::any_cast<peer_stats_ptr>(&conn->getContext());
+      return stats ? stats->get() : nullptr;
+    }
+
+    /*
+     * The frames to a connection corked in the loop thread, and written by one send once the loop is done with the
+     * batch, so the responses to the pipelined requests, which complete in a burst, take one write. The frames
+     * posted by other threads are flushed once their drain is over, see loop_queue::set_on_drained, the ones sent
+     * in the loop thread at the end of the iteration of the loop, by a functor queued.
+     *
+     * The control frames, see rpc::message_priority, are corked apart, and written before the others. A large
+     * frame is not corked, it's queued and written in chunks to the peers which accept them, a chunk once the
+     * output buffer is drained, so the frames written meanwhile go between the chunks, and a response waits for
+     * a chunk at most instead of a bulk transfer, see frame_chunks. It's written as it is to the other peers.
+     *
+     * A frame whose data is a file range, see atlas::rpc::file_range, is written by sendfile between it's head
+     * and it's tail, so the kernel copies the file to the socket, kTLS included. The range starts once the output
+     * buffer is drained and goes on until the socket is full, then a slice of it is read and written through the
+     * output buffer, so muduo tells once the socket takes more, see pump(). The other frames are corked meanwhile,
+     * they can not go into the middle of it
+     * */
+    class corked_output {
+    public:
+
+      static const size_t max_corked = 64 * 1024;
+
+      // the bytes of a file range read and written through the output buffer once the socket is full
+      static const size_t file_slice = 64 * 1024;
+
+    public:
+
+      corked_output(const mn::TcpConnectionPtr& conn, const peer_stats_ptr& stats = peer_stats_ptr()) :
+        _conn(conn), _stats(stats), _flush_queued(false), _bulk_offset(0), _backlog(0), _writes(0), _frames(0), _chunks(0),
+        _files(0), _file_slices(0) {}
+
+      corked_output(const corked_output&) = delete;
+      corked_output& operator=(const corked_output&) = delete;
+
+    public:
+
+      // the loop thread only
+      void write(std::string&& message) {
+        bump(_frames);
+        if (message.size() >= max_corked && !sending_file()) {
+          if (chunking()) {
+            queue_bulk(std::move(message));
+            return;
+          }
+
+          flush();
+          send(std::move(message));
+          return;
+        }
+
+        std::string& cork = lane(message.data(), message.size());
+        if (cork.empty()) cork.swap(message);
+        else cork.append(message);
+
+        if (_urgent.size() + _corked.size() >= max_corked) flush();
+      }
+
+      void write(const char* message, size_t size) {
+        bump(_frames);
+        if (size >= max_corked && !sending_file()) {
+          if (chunking()) {
+            queue_bulk(std::string(message, size));
+            return;
+          }
+
+          flush();
+          bump(_writes);
+          _conn->send(message, size);
+          return;
+        }
+
+        lane(message, size).append(message, size);
+        if (_urgent.size() + _corked.size() >= max_corked) flush();
+      }
+
+      // a frame written in the loop thread out of a drain, the flush runs at the end of the iteration
+      static void write_in_loop(const std::shared_ptr<corked_output>& output, const char* message, size_t size) {
+        output->write(message, size);
+        output->queue_flush(output);
+      }
+
+      static void write_in_loop(const std::shared_ptr<corked_output>& output, std::string&& message) {
+        output->write(std::move(message));
+        output->queue_flush(output);
+      }
+
+      // the frame around the file range, after the frames written before it, see atlas::rpc::remote_caller::respond_file
+      void write_file(std::string&& head, const atlas::rpc::file_range& file, std::string&& tail) {
+        bump(_frames);
+        flush();
+
+        file_frame f = { std::move(head), file, std::move(tail), 0, false };
+        _file_frames.push_back(std::move(f));
+        _backlog.store(_backlog.load(std::memory_order_relaxed) + file.length, std::memory_order_relaxed);
+
+        if (_file_frames.size() == 1) pump_files();
+      }
+
+      // the control frames first, by the same send, they wait for the range being written
+      void flush() {
+        _flush_queued = false;
+        if (sending_file() || (_urgent.empty() && _corked.empty())) return;
+
+        std::string corked;
+        if (_urgent.empty()) {
+          corked.swap(_corked);
+        }
+        else {
+          corked.swap(_urgent);
+          corked.append(_corked);
+          _corked.clear();
+        }
+
+        send(std::move(corked));
+      }
+
+      // the next chunk of the large frames once the output buffer is drained, see pooled_connection::on_write_complete,
+      // the file ranges first
+      void pump() {
+        if (sending_file() && !pump_files()) return;
+        if (_bulk.empty() || _conn->outputBuffer()->readableBytes()) return;
+
+        std::string chunk;
+        const std::string& frame = _bulk.front();
+        _bulk_offset += frame_chunks::make_chunk(frame, _bulk_offset, chunk);
+        _backlog.store(_backlog.load(std::memory_order_relaxed) - (chunk.size() - sizeof(atlas::rpc::request_header)
+            - sizeof(frame_chunk_header)), std::memory_order_relaxed);
+
+        if (_bulk_offset == frame.size()) {
+          _bulk.pop_front();
+          _bulk_offset = 0;
+        }
+
+        bump(_chunks);
+        send(std::move(chunk));
+      }
+
+      // the frames and the sends they took, and the chunks of the large ones
+      size_t frames() const { return _frames.load(std::memory_order_relaxed); }
+
+      size_t writes() const { return _writes.load(std::memory_order_relaxed); }
+
+      size_t chunks() const { return _chunks.load(std::memory_order_relaxed); }
+
+      // the frames written from files, and the slices of them written through the output buffer
+      size_t files() const { return _files.load(std::memory_order_relaxed); }
+
+      size_t file_slices() const { return _file_slices.load(std::memory_order_relaxed); }
+
+      // the bytes of the large frames not written yet
+      size_t backlog() const { return _backlog.load(std::memory_order_relaxed); }
+
+    private:
+
+      struct file_frame {
+        std::string head;
+        atlas::rpc::file_range file;
+        std::string tail;
+        // the bytes of the range written
+        size_t sent;
+        bool started;
+      };
+
+    private:
+
+      bool sending_file() const { return !_file_frames.empty(); }
+
+      // true once every file frame is written, the frames corked meanwhile are flushed then
+      bool pump_files() {
+        while (!_file_frames.empty()) {
+          file_frame& f = _file_frames.front();
+          if (!f.started) {
+            f.started = true;
+            send(std::move(f.head));
+          }
+
+          // the range goes after what muduo has buffered
+          if (_conn->outputBuffer()->readableBytes()) return false;
+
+          while (f.sent < f.file.length) {
+            off_t offset = f.file.offset + f.sent;
+            ssize_t n = ::sendfile(_conn->fd(), f.file.fd(), &offset, f.file.length - f.sent);
+            if (n > 0) {
+              advance(f, n);
+              continue;
+            }
+
+            if (n < 0 && errno == EINTR) continue;
+
+            // the socket is full, or it takes no sendfile, muduo tells once the slice is written
+            if (!write_slice(f)) {
+              LOG(ERROR) << "can not read the file range of a frame to " << _conn->peerAddress().toIpPort().c_str()
+                  << ", the connection is closed";
+              abort_files();
+            }
+
+            return false;
+          }
+
+          send(std::move(f.tail));
+          bump(_files);
+          _file_frames.pop_front();
+        }
+
+        flush();
+        return true;
+      }
+
+      bool write_slice(file_frame& f) {
+        atlas::rpc::file_range slice(f.file);
+        slice.offset += f.sent;
+        slice.length = f.file.length - f.sent < file_slice ? f.file.length - f.sent : file_slice;
+
+        std::string data;
+        if (!slice.read(data)) return false;
+
+        advance(f, data.size());
+        bump(_file_slices);
+        send(std::move(data));
+
+        return true;
+      }
+
+      void advance(file_frame& f, size_t n) {
+        f.sent += n;
+        _backlog.store(_backlog.load(std::memory_order_relaxed) - n, std::memory_order_relaxed);
+      }
+
+      // the peer can not parse past a frame cut short, see connection_reaper
+      void abort_files() {
+        for (const file_frame& f : _file_frames) {
+          _backlog.store(_backlog.load(std::memory_order_relaxed) - (f.file.length - f.sent), std::memory_order_relaxed);
+        }
+        _file_frames.clear();
+
+        ::shutdown(_conn->fd(), SHUT_RDWR);
+      }
+
+      // the loop thread is the only writer
+      static void bump(std::atomic<size_t>& counter) {
+        counter.store(counter.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+      }
+
+      // the peer reassembles the chunks, see frame_chunks
+      bool chunking() const {
+        return _stats && _stats->accepts_chunks.load(std::memory_order_relaxed) && frame_chunks::ref().enabled();
+      }
+
+      std::string& lane(const char* message, size_t size) {
+        bool control = size >= sizeof(atlas::rpc::request_header)
+            && atlas::rpc::message::priority(message) == atlas::rpc::priority_control;
+
+        return control ? _urgent : _corked;
+      }
+
+      void queue_bulk(std::string&& message) {
+        _backlog.store(_backlog.load(std::memory_order_relaxed) + message.size(), std::memory_order_relaxed);
+        _bulk.push_back(std::move(message));
+        pump();
+      }
+
+      void queue_flush(const std::shared_ptr<corked_output>& self) {
+        if (_flush_queued || _corked.empty()) return;
+
+        _flush_queued = true;
+        _conn->getLoop()->queueInLoop(boost::bind(&corked_output::flush, self));
+      }
+
+      void send(std::string&& data) {
+        bump(_writes);
+        _conn->send(std::move(data));
+      }
+
+    private:
+
+      mn::TcpConnectionPtr _conn;
+      peer_stats_ptr _stats;
+      std::string _urgent;
+      std::string _corked;
+      bool _flush_queued;
+
+      // the large frames, the front one is written from the offset
+      std::deque<std::string> _bulk;
+      size_t _bulk_offset;
+      std::atomic<size_t> _backlog;
+
+      // the frames from files, the front one is being written
+      std::deque<file_frame> _file_frames;
+
+      std::atomic<size_t> _writes;
+      std::atomic<size_t> _frames;
+      std::atomic<size_t> _chunks;
+      std::atomic<size_t> _files;
+      std::atomic<size_t> _file_slices;
+    };
+
+    typedef std::shared_ptr<corked_output> corked_output_ptr;
+
+    // a connection shared by all the senders, with the number of the messages and bytes
+    // sent since the output buffer of the connection was drained last time, and the average time
+    // the output buffer takes to drain, they are used to select the least loaded connection
+    //
+    // the connection is congested once the output buffer reaches the high water mark, and stays congested
+    // until the buffer is drained, the senders should stop sending to a congested connection, so the memory
+    // used by a slow peer is bounded
+    class pooled_connection {
+    public:
+
+      typedef std::chrono::steady_clock clock;
+
+    public:
+
+      pooled_connection(const mn::TcpConnectionPtr& conn, size_t high_water_mark, const peer_stats_ptr& stats) :
+        _conn(conn), _stats(stats), _output(std::make_shared<corked_output>(conn, stats)), _queue(conn->getLoop()),
+        _in_flight(0), _pending_bytes(0), _send_start(0), _latency(0), _high_water_mark(high_water_mark), _congested(false)
+      {
+        _queue.set_on_drained(boost::bind(&corked_output::flush, _output));
+      }
+
+    public:
+
+      const mn::TcpConnectionPtr& connection() const { return _conn; }
+
+      // shared by all the connections to the peer ip in the pool
+      peer_stats& stats() const { return *_stats; }
+
+      const corked_output& output() const { return *_output; }
+
+      // thread safe, the whole message is queued to the I/O thread, frames are never interleaved, see loop_queue
+      void send(const char* message, size_t size) {
+        if (compresses(size)) {
+          send(std::string(message, size));
+          return;
+        }
+
+        on_send(size);
+
+        if (_queue.runs_inline()) corked_output::write_in_loop(_output, message, size);
+        else _queue.post(send_functor(_output, std::string(message, size)));
+      }
+
+      // the message is moved to the I/O thread, not copied, the large frames are compressed if the peer accepts it
+      void send(std::string&& message) {
+        if (compresses(message.size())) frame_compression::ref().compress(message);
+
+        on_send(message.size());
+
+        if (_queue.runs_inline()) corked_output::write_in_loop(_output, std::move(message));
+        else _queue.post(send_functor(_output, std::move(message)));
+      }
+
+      /*
+       * Thread safe, the frame around a file range, see atlas::rpc::remote_caller::respond_file, the range is
+       * written from the file by the I/O thread. False if it's too small to be worth it, or the frame would be
+       * compressed, the caller sends it from memory then
+       * */
+      bool send_file(std::string&& head, const atlas::rpc::file_range& file, std::string&& tail) {
+        size_t size = head.size() + file.length + tail.size();
+        if (file.length < corked_output::max_corked || compresses(size)) return false;
+
+        on_send(size);
+
+        if (_queue.runs_inline()) _output->write_file(std::move(head), file, std::move(tail));
+        else _queue.post(file_functor(_output, std::move(head), file, std::move(tail)));
+
+        return true;
+      }
+
+      // called when the output buffer is drained, in the I/O thread
+      void on_write_complete() {
+        _output->pump();
+
+        int64_t start = _send_start.exchange(0);
+        if (start) {
+          // exponentially weighted moving average, 1/8 for the new sample
+          int64_t sample = clock::now().time_since_epoch().count() - start;
+          _latency = _latency + (sample - _latency) / 8;
+        }
+
+        _in_flight = 0;
+        _pending_bytes = _output->backlog();
+
+        {
+          std::lock_guard<std::mutex> guard(_writable_mutex);
+          _congested = false;
+        }
+
+        _writable.notify_all();
+      }
+
+      // called when the output buffer reaches the high water mark
+      void on_high_water_mark() { _congested = true; }
+
+      // the bytes sent since last drain are counted too, since muduo reports the high water mark
+      // in the I/O thread, some time later
+      bool congested() const { return _congested || _pending_bytes >= _high_water_mark; }
+
+      // return false if the connection is still congested after the timeout
+      bool wait_writable(std::chrono::milliseconds timeout) {
+        std::unique_lock<std::mutex> lock(_writable_mutex);
+        return _writable.wait_for(lock, timeout, [this]() { return !congested(); });
+      }
+
+      size_t in_flight() const { return _in_flight; }
+
+      size_t pending_bytes() const { return _pending_bytes; }
+
+      // the average time to drain the output buffer, in clock ticks
+      int64_t latency() const { return _latency; }
+
+      // less bytes waiting to be written first, then the peer responds sooner, and then the faster one to drain,
+      // the connections to the same peer share the round trip time, the peers not measured yet are not compared
+      bool less_loaded_than(const pooled_connection& other) const {
+        size_t lhs = pending_bytes(), rhs = other.pending_bytes();
+        if (lhs != rhs) return lhs < rhs;
+
+        int64_t lhs_rtt = _stats->rtt.load(std::memory_order_relaxed);
+        int64_t rhs_rtt = other._stats->rtt.load(std::memory_order_relaxed);
+        if (lhs_rtt && rhs_rtt && lhs_rtt != rhs_rtt) return lhs_rtt < rhs_rtt;
+
+        return latency() < other.latency();
+      }
+
+    private:
+
+      // corks in the I/O thread, the message is moved in and out, the drain flushes it
+      struct send_functor {
+        send_functor(const corked_output_ptr& output, std::string&& message) : output(output), message(std::move(message)) {}
+
+        void operator()() { output->write(std::move(message)); }
+
+        corked_output_ptr output;
+        std::string message;
+      };
+
+      struct file_functor {
+        file_functor(const corked_output_ptr& output, std::string&& head, const atlas::rpc::file_range& file,
+            std::string&& tail) : output(output), head(std::move(head)), file(file), tail(std::move(tail)) {}
+
+        void operator()() { output->write_file(std::move(head), file, std::move(tail)); }
+
+        corked_output_ptr output;
+        std::string head;
+        atlas::rpc::file_range file;
+        std::string tail;
+      };
+
+      bool compresses(size_t size) const {
+        const frame_compression& c = frame_compression::ref();
+        return c.enabled() && size >= atlas::rpc::message::request_header_size + c.threshold()
+            && _stats->accepts_compression.load(std::memory_order_relaxed);
+      }
+
+      void on_send(size_t size) {
+        if (_in_flight++ == 0) _send_start = clock::now().time_since_epoch().count();
+        _stats->on_send(size, _pending_bytes += size);
+      }
+
+    private:
+
+      mn::TcpConnectionPtr _conn;
+      peer_stats_ptr _stats;
+      // the frames are written in batches, see corked_output
+      corked_output_ptr _output;
+      // the senders of all the threads post to the I/O loop without a lock
+      loop_queue _queue;
+      std::atomic<size_t> _in_flight;
+      std::atomic<size_t> _pending_bytes;
+      std::atomic<int64_t> _send_start;
+      std::atomic<int64_t> _latency;
+
+      const size_t _high_water_mark;
+      std::atomic<bool> _congested;
+      std::mutex _writable_mutex;
+      std::condition_variable _writable;
+    };
+
+    typedef std::shared_ptr<pooled_connection> pooled_connection_ptr;
+
+    /*
+     * Holds all the connections to every peer, several connections can be established to one peer.
+     * The connections stay in the pool until they are disconnected, any number of senders can write
+     * to one connection concurrently, get() returns the least loaded connection to the peer
+     *
+     * Every change of the connections bumps the epoch, a sender thread keeps it's own copy of the connections
+     * it used, see cached_get(), which is valid as long as the epoch does not change, so a steady sender
+     * never takes the pool lock
+     * */
     template<typename pool_tag>
     class connection_pool : public atlas::singleton<connection_pool<pool_tag>> {
     public:
 
       const uint64_t default_wait_time = 60 * 1000; // 1 minute
 
-      typedef std::map<std::string, mn::TcpConnectionPtr>::const_iterator iterator;
+      const size_t default_high_water_mark = 64 * 1024 * 1024;
 
     private:
 
@@ -60,42 +660,450 @@ namespace pioneer {
       connection_pool(connection_pool&)= delete;
       connection_pool& operator=(const connection_pool&)= delete;
 
+      typedef std::vector<pooled_connection_ptr> peer_connections;
+
+      // the connections a thread has looked up, by peer and by ip, as of the epoch
+      struct thread_cache {
+        thread_cache() : epoch(0) {}
+
+        uint64_t epoch;
+        std::unordered_map<atlas::rpc::endpoint_id, peer_connections> by_peer;
+        std::unordered_map<uint32_t, peer_connections> by_ip;
+      };
+
     public:
 
       // TODO : make it private
-      connection_pool() : _connections(std::chrono::microseconds(default_wait_time)) {}
+      connection_pool() : _wait_time(std::chrono::microseconds(default_wait_time)), _high_water_mark(default_high_water_mark),
+        _epoch(1), _tiers_epoch(0), _tiers_version(0) {
+        // the cache of a thread is deleted when the thread exits, so it never keeps a closed connection alive
+        ::pthread_key_create(&_cache_key, [](void* cache) { delete static_cast<thread_cache*>(cache); });
+      }
+
+      ~connection_pool() { ::pthread_key_delete(_cache_key); }
+
+      // the maximum bytes queued in the output buffer of a connection before it is congested,
+      // affects the connections put later
+      void set_high_water_mark(size_t bytes) { _high_water_mark = bytes; }
 
-      // take a connection and remove it from the pool
-      mn::TcpConnectionPtr take(const std::string& ip_port) {
-        DLOG(INFO) << "take connection for" << ip_port;
+      // how long a sender waits for a connection which is not up yet
+      void set_wait_time(std::chrono::microseconds wait_time) { _wait_time.store(wait_time, std::memory_order_relaxed); }
 
-        return *_connections.take(ip_port);
+      std::chrono::microseconds wait_time() const { return _wait_time.load(std::memory_order_relaxed); }
+
+      // get the least loaded connection to the peer, wait for a while if there is no connection to the peer yet
+      pooled_connection_ptr get(atlas::rpc::endpoint_id peer) { return wait_get(peer, wait_time()); }
+
+      // wait at most the timeout for a connection to the peer
+      pooled_connection_ptr get(atlas::rpc::endpoint_id peer, std::chrono::milliseconds timeout) {
+        return wait_get(peer, timeout);
+      }
+
+      pooled_connection_ptr get(const std::string& ip_port) { return get(atlas::rpc::parse_endpoint(ip_port)); }
+
+      pooled_connection_ptr get(const std::string& ip_port, std::chrono::milliseconds timeout) {
+        return get(atlas::rpc::parse_endpoint(ip_port), timeout);
       }
 
-      mn::TcpConnectionPtr random_take() { return *_connections.random_take(); }
+      // get the least loaded connection to any port of the peer ip, a node may connect to us from
+      // a random port, and we may connect to it too, any of them works
+      pooled_connection_ptr get_by_ip(uint32_t ip) {
+        std::lock_guard<std::mutex> guard(_mutex);
+
+        auto it = _by_ip.find(ip);
+        if (it == _by_ip.end()) return nullptr;
+
+        return least_loaded(it->second);
+      }
+
+      pooled_connection_ptr get_by_ip(const std::string& ip) { return get_by_ip(atlas::rpc::parse_ip(ip)); }
+
+      // as get(), from the calling thread's cache if the connections have not changed since it's last lookup
+      pooled_connection_ptr cached_get(atlas::rpc::endpoint_id peer) {
+        thread_cache& cache = local_cache();
+
+        auto it = cache.by_peer.find(peer);
+        if (it != cache.by_peer.end()) return least_loaded(it->second);
+
+        pooled_connection_ptr c = get(peer);
+        if (c) fill_cache(cache, _connections, peer, cache.by_peer);
+
+        return c;
+      }
+
+      // as get_by_ip(), from the calling thread's cache
+      pooled_connection_ptr cached_get_by_ip(uint32_t ip) {
+        thread_cache& cache = local_cache();
+
+        auto it = cache.by_ip.find(ip);
+        if (it != cache.by_ip.end()) return least_loaded(it->second);
+
+        pooled_connection_ptr c = get_by_ip(ip);
+        if (c) fill_cache(cache, _by_ip, ip, cache.by_ip);
+
+        return c;
+      }
+
+      pooled_connection_ptr cached_get_by_ip(const std::string& ip) { return cached_get_by_ip(atlas::rpc::parse_ip(ip)); }
+
+      // bumped by every put and erase
+      uint64_t epoch() const { return _epoch.load(std::memory_order_acquire); }
+
+      // select a connection to any peer by the power of two choices : pick two connections randomly,
+      // and use the less loaded one, this spreads the load almost as even as checking all of them
+      pooled_connection_ptr random_get() {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _connected.wait_for(lock, wait_time(), [this]() { return !_all.empty(); });
+
+        if (_all.empty()) return nullptr;
+        if (_all.size() == 1) return _all.front();
+
+        size_t first = atlas::fast_random(_all.size());
+        // never select the same one twice
+        size_t second = (first + 1 + atlas::fast_random(_all.size() - 1)) % _all.size();
+
+        const pooled_connection_ptr& lhs = _all[first];
+        const pooled_connection_ptr& rhs = _all[second];
+
+        return rhs->less_loaded_than(*lhs) ? rhs : lhs;
+      }
+
+      /*
+       * As random_get(), among the connections of the nearest peers, the farther ones are taken only if the choice
+       * among the nearer ones is congested. The distance of a peer is distance(ip, rtt), the smaller the nearer,
+       * the peers are sorted by it again once the connections change, or the version does, see net::locality.
+       * The distance of the one selected is put in *selected if it's given
+       * */
+      template<typename Distance>
+      pooled_connection_ptr nearest_get(const Distance& distance, uint64_t version, int* selected = nullptr) {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _connected.wait_for(lock, wait_time(), [this]() { return !_all.empty(); });
+
+        if (_all.empty()) return nullptr;
+
+        uint64_t epoch = _epoch.load(std::memory_order_relaxed);
+        if (_tiers_epoch != epoch || _tiers_version != version) {
+          std::map<int, peer_connections> tiers;
+          for (const pooled_connection_ptr& c : _all) {
+            uint32_t ip = atlas::rpc::endpoint_ip(endpoint_of(c->connection()));
+            tiers[distance(ip, c->stats().rtt.load(std::memory_order_relaxed))].push_back(c);
+          }
+
+          _tiers.clear();
+          for (auto& t : tiers) _tiers.push_back(std::make_pair(t.first, std::move(t.second)));
+          _tiers_epoch = epoch;
+          _tiers_version = version;
+        }
 
+        pooled_connection_ptr chosen;
+        for (const auto& tier : _tiers) {
+          const peer_connections& connections = tier.second;
+
+          if (connections.size() == 1) chosen = connections.front();
+          else {
+            size_t first = atlas::fast_random(connections.size());
+            size_t second = (first + 1 + atlas::fast_random(connections.size() - 1)) % connections.size();
+            chosen = connections[second]->less_loaded_than(*connections[first]) ? connections[second] : connections[first];
+          }
+
+          if (selected) *selected = tier.first;
+          if (!chosen->congested()) break;
+        }
+
+        return chosen;
+      }
+
+      // must be called in the I/O thread of the connection, for example, the connection callback
       void put(const mn::TcpConnectionPtr& conn) {
-        auto ip_port = conn->peerAddress().toIpPort();
-        _connections.put(ip_port, conn);
+        atlas::rpc::endpoint_id peer = endpoint_of(conn);
+
+        conn->setHighWaterMarkCallback(boost::bind(&connection_pool::on_high_water_mark, this, _1, _2),
+            _high_water_mark);
+
+        {
+          std::lock_guard<std::mutex> guard(_mutex);
+
+          peer_connections& connections = _connections[peer];
+          if (find(connections, conn) != connections.end()) return;
+
+          // a connection replacing one lost is a reconnect
+          peer_stats_ptr& stats = _peers[atlas::rpc::endpoint_ip(peer)];
+          if (!stats) stats = std::make_shared<peer_stats>();
+          else if (stats->disconnects > stats->reconnects) ++stats->reconnects;
+          ++stats->connects;
+
+          // the I/O thread counts the bytes read on it, see peer_stats_of
+          conn->setContext(stats);
+
+          pooled_connection_ptr c = std::make_shared<pooled_connection>(conn, _high_water_mark, stats);
+          connections.push_back(c);
+          _by_ip[atlas::rpc::endpoint_ip(peer)].push_back(c);
+          _all.push_back(c);
+          ++_epoch;
+        }
+
+        _connected.notify_all();
+
+        DVLOG(2) << "put " << conn->peerAddress().toIpPort() << ", pool size : " << size();
+      }
+
+      void on_write_complete(const mn::TcpConnectionPtr& conn) {
+        pooled_connection_ptr c = find(conn);
+        if (c) c->on_write_complete();
+      }
+
+      void on_high_water_mark(const mn::TcpConnectionPtr& conn, size_t size) {
+        LOG(WARNING) << conn->peerAddress().toIpPort() << " is congested, " << size << " bytes are queued";
+        connection_reaper::ref().sample(conn);
+
+        pooled_connection_ptr c = find(conn);
+        if (c) c->on_high_water_mark();
+      }
+
+      // remove one connection
+      void erase(const mn::TcpConnectionPtr& conn) {
+        atlas::rpc::endpoint_id peer = endpoint_of(conn);
+
+        std::lock_guard<std::mutex> guard(_mutex);
+
+        auto it = _connections.find(peer);
+        if (it == _connections.end()) return;
+
+        auto pos = find(it->second, conn);
+        if (pos != it->second.end()) {
+          ++(*pos)->stats().disconnects;
+          remove_from_all(*pos);
+          remove_from_ip_index(*pos);
+          it->second.erase(pos);
+          ++_epoch;
+        }
 
-        DLOG(INFO) << "put " << ip_port << ", pool size : " << _connections.size();
+        if (it->second.empty()) _connections.erase(it);
+
+        DLOG(INFO) << "pool size : " << _all.size();
+      }
+
+      // remove all the connections to the peer
+      void erase(const std::string& ip_port) { erase(atlas::rpc::parse_endpoint(ip_port)); }
+
+      void erase(atlas::rpc::endpoint_id peer) {
+        std::lock_guard<std::mutex> guard(_mutex);
+
+        auto it = _connections.find(peer);
+        if (it == _connections.end()) return;
+
+        for (const pooled_connection_ptr& c : it->second) {
+          ++c->stats().disconnects;
+          remove_from_all(c);
+          remove_from_ip_index(c);
+        }
+        _connections.erase(it);
+        ++_epoch;
+
+        DLOG(INFO) << "pool size : " << _all.size();
+      }
+
+      void clear() {
+        std::lock_guard<std::mutex> guard(_mutex);
+        _connections.clear();
+        _by_ip.clear();
+        _all.clear();
+        ++_epoch;
+      }
+
+      bool empty() const { return size() == 0; }
+
+      // the number of connections
+      size_t size() const {
+        std::lock_guard<std::mutex> guard(_mutex);
+        return _all.size();
       }
 
-      void erase(const std::string& ip_port) {
-        _connections.erase(ip_port);
+      // the number of peers
+      size_t peer_count() const {
+        std::lock_guard<std::mutex> guard(_mutex);
+        return _connections.size();
+      }
 
-        DLOG(INFO) << "pool size : " << _connections.size();
+      // a copy of all the connections, for the diagnosis
+      std::vector<pooled_connection_ptr> connections() const {
+        std::lock_guard<std::mutex> guard(_mutex);
+        return _all;
       }
 
-      void clear() { _connections.clear(); }
+      // every peer ip ever connected, including the ones disconnected now, for the metrics
+      std::vector<peer_snapshot> peers() const {
+        std::lock_guard<std::mutex> guard(_mutex);
+
+        std::vector<peer_snapshot> result;
+        result.reserve(_peers.size());
+
+        for (const auto& p : _peers) {
+          peer_snapshot s = { p.first, 0, 0, 0, p.second };
 
-      bool empty() const { return _connections.empty(); }
+          auto it = _by_ip.find(p.first);
+          if (it != _by_ip.end()) {
+            s.connections = it->second.size();
+            for (const pooled_connection_ptr& c : it->second) {
+              s.in_flight += c->in_flight();
+              s.pending_bytes += c->pending_bytes();
+            }
+          }
 
-      size_t size() const { return _connections.size(); }
+          result.push_back(s);
+        }
+
+        return result;
+      }
+
+      // a response from the peer comes after the time, false if the peer is not connected to the pool, never takes
+      // the pool lock unless the calling thread has not looked up the peer since the connections changed
+      bool on_response(uint32_t ip, std::chrono::nanoseconds elapsed) {
+        pooled_connection_ptr c = cached_get_by_ip(ip);
+        if (c) c->stats().on_response(elapsed);
+
+        return c != nullptr;
+      }
 
     private:
 
-      atlas::blocking_concurrent_box<std::string, mn::TcpConnectionPtr> _connections;
+      // the calling thread's cache, emptied if the connections have changed since it's filled
+      thread_cache& local_cache() {
+        thread_cache* cache = static_cast<thread_cache*>(::pthread_getspecific(_cache_key));
+        if (!cache) {
+          cache = new thread_cache;
+          ::pthread_setspecific(_cache_key, cache);
+        }
+
+        uint64_t epoch = _epoch.load(std::memory_order_acquire);
+        if (cache->epoch != epoch) {
+          cache->by_peer.clear();
+          cache->by_ip.clear();
+          cache->epoch = epoch;
+        }
+
+        return *cache;
+      }
+
+      // copy the connections of the key, unless they have changed since the cache is emptied
+      template<typename Index, typename Key, typename Cached>
+      void fill_cache(thread_cache& cache, const Index& index, Key key, Cached& cached) {
+        std::lock_guard<std::mutex> guard(_mutex);
+
+        if (_epoch.load(std::memory_order_relaxed) != cache.epoch) return;
+
+        auto it = index.find(key);
+        if (it != index.end()) cached[key] = it->second;
+      }
+
+      static atlas::rpc::endpoint_id endpoint_of(const mn::TcpConnectionPtr& conn) {
+        return ip::to_endpoint(conn->peerAddress().getSockAddrInet());
+      }
+
+      template<typename Duration>
+      pooled_connection_ptr wait_get(atlas::rpc::endpoint_id peer, Duration timeout) {
+        std::unique_lock<std::mutex> lock(_mutex);
+
+        typename std::unordered_map<atlas::rpc::endpoint_id, peer_connections>::const_iterator it;
+        _connected.wait_for(lock, timeout, [this, peer, &it]() {
+          it = _connections.find(peer);
+          return it != _connections.end();
+        });
+
+        if (it == _connections.end()) return nullptr;
+
+        return least_loaded(it->second);
+      }
+
+      pooled_connection_ptr find(const mn::TcpConnectionPtr& conn) const {
+        std::lock_guard<std::mutex> guard(_mutex);
+
+        auto it = _connections.find(endpoint_of(conn));
+        if (it == _connections.end()) return nullptr;
+
+        auto pos = std::find_if(it->second.begin(), it->second.end(), [&conn](const pooled_connection_ptr& c) {
+          return c->connection() == conn;
+        });
+
+        return pos == it->second.end() ? nullptr : *pos;
+      }
+
+      static typename peer_connections::iterator find(peer_connections& connections, const mn::TcpConnectionPtr& conn) {
+        return std::find_if(connections.begin(), connections.end(), [&conn](const pooled_connection_ptr& c) {
+          return c->connection() == conn;
+        });
+      }
+
+      static const pooled_connection_ptr& least_loaded(const peer_connections& connections) {
+        auto it = std::min_element(connections.begin(), connections.end(),
+            [](const pooled_connection_ptr& lhs, const pooled_connection_ptr& rhs) {
+          return lhs->less_loaded_than(*rhs);
+        });
+
+        return *it;
+      }
+
+      // the order does not matter, so swap the last one in and pop it
+      void remove_from_all(const pooled_connection_ptr& c) {
+        auto it = std::find(_all.begin(), _all.end(), c);
+        if (it == _all.end()) return;
+
+        std::swap(*it, _all.back());
+        _all.pop_back();
+      }
+
+      void remove_from_ip_index(const pooled_connection_ptr& c) {
+        auto it = _by_ip.find(atlas::rpc::endpoint_ip(endpoint_of(c->connection())));
+        if (it == _by_ip.end()) return;
+
+        it->second.erase(std::remove(it->second.begin(), it->second.end(), c), it->second.end());
+        if (it->second.empty()) _by_ip.erase(it);
+      }
+
+    private:
+
+      std::atomic<std::chrono::microseconds> _wait_time;
+      std::atomic<size_t> _high_water_mark;
+
+      mutable std::mutex _mutex;
+      std::condition_variable _connected;
+
+      // keyed by the packed peer address, so a lookup neither builds nor hashes a string
+      std::unordered_map<atlas::rpc::endpoint_id, peer_connections> _connections;
+      // the same connections indexed by the peer ip, in host byte order
+      std::unordered_map<uint32_t, peer_connections> _by_ip;
+      // all the connections in one array, so we can select one by index
+      std::vector<pooled_connection_ptr> _all;
+      // by the peer ip, never removed, a node has a few peers
+      std::unordered_map<uint32_t, peer_stats_ptr> _peers;
+
+      // changed under the mutex
+      std::atomic<uint64_t> _epoch;
+      pthread_key_t _cache_key;
+
+      // the connections by the distance of their peers, nearest first, as of the epoch and the version, see nearest_get
+      std::vector<std::pair<int, peer_connections>> _tiers;
+      uint64_t _tiers_epoch;
+      uint64_t _tiers_version;
+    };
+
+    // the delay before the n-th reconnect attempt is min(initial * 2^(n-1), max), minus a random part of
+    // at most jitter of it, so the nodes reconnect to a peer at different time after a network blip
+    struct reconnect_policy {
+      reconnect_policy() : initial(std::chrono::milliseconds(100)), max(std::chrono::seconds(30)), jitter(0.5) {}
+
+      std::chrono::milliseconds delay(int attempt) const {
+        int64_t d = initial.count();
+        for (int i = 1; i < attempt && d < max.count(); ++i) d *= 2;
+        d = std::min<int64_t>(d, max.count());
+
+        int64_t random_part = static_cast<int64_t>(d * jitter * (atlas::fast_random(1000) / 1000.0));
+        return std::chrono::milliseconds(d - random_part);
+      }
+
+      std::chrono::milliseconds initial;
+      std::chrono::milliseconds max;
+      double jitter;
     };
 
     // we may need several different TCP client pool singletons, so we make it a template
@@ -108,12 +1116,21 @@ namespace pioneer {
       tcp_client_pool(tcp_client_pool&)= delete;
       tcp_client_pool& operator=(const tcp_client_pool&)= delete;
 
-      typedef boost::ptr_multimap<std::string, mn::TcpClient> tcp_client_container;
+      // the clients are keyed by the peer endpoints, no string is built for a connection event
+      typedef boost::ptr_multimap<atlas::rpc::endpoint_id, transport_client> tcp_client_container;
+
+    public:
+
+      typedef std::function<void()> stopped_callback;
+      typedef std::function<void()> started_callback;
+      // called with the peer ip:port when all the connections to the peer are established
+      typedef std::function<void(const std::string&)> ready_callback;
 
     public:
 
       // TODO : make it private
-      tcp_client_pool() : _stopping(false), _stopped(false), _thread_num(1), _server_port(0), _base_loop(nullptr) {}
+      tcp_client_pool() : _stopping(false), _stopped(false), _thread_num(1), _server_port(0), _connections_per_peer(1),
+        _local_transport(false), _stop_timeout(std::chrono::seconds(30)), _next_client_id(0), _base_loop(nullptr) {}
 
       /// init/deinit section
     public:
@@ -124,39 +1141,90 @@ namespace pioneer {
 
       void set_thread_num(int num) { _thread_num = num; }
 
+      // connections established by connect(), a peer can take traffic on all of them once it's ready,
+      // the connection pool selects the least loaded one, so the idle ones keep warm as standbys
+      void set_connections_per_peer(int num) { _connections_per_peer = std::max(1, num); }
+
+      // connect to the peers on this host through their local sockets instead of TCP, see local_server
+      void set_local_transport(bool enabled) { _local_transport = enabled; }
+
       void set_connection_callback(const mn::ConnectionCallback& cb) { _on_connection = cb; }
 
       void set_message_callback(const mn::MessageCallback& cb) { _on_message = cb; }
 
       void set_write_complete_callback(const mn::WriteCompleteCallback& cb) { _on_write_complete = cb; }
 
+      // a client disconnected by the peer or the network reconnects by this policy
+      void set_reconnect_policy(const reconnect_policy& policy) { _reconnect_policy = policy; }
+
+      // the connections not closed in this time are destroyed by force when the pool stops
+      void set_stop_timeout(std::chrono::milliseconds timeout) { _stop_timeout = timeout; }
+
       void init() {
         _base_loop = new mn::EventLoop;
+        _base_queue.reset(new loop_queue(_base_loop));
+        _base_timers.reset(new loop_timers(_base_loop));
 
         // all the loops in the thread pool will stop if the base loop quits
         _io_thread_pool.reset(new mn::EventLoopThreadPool(_base_loop));
         if (_thread_num) _io_thread_pool->setThreadNum(_thread_num);
       }
 
-      void start() {
-        _io_thread_pool->start();
+      // the callback is called in the base loop once the loop is running
+      void start(const started_callback& cb = started_callback()) {
+        _io_thread_pool->start([](mn::EventLoop*) {
+          system::set_thread_name("client io");
+          system::numa_placement::ref().place_io_thread();
+        });
+
+        if (cb) _base_loop->queueInLoop(cb);
         _base_loop->loop();
       }
 
-      void stop() {
-        if (_stopping || _stopped) return;
+      /*
+       * Thread safe, never blocks.
+       * All the connections are closed in parallel in their own I/O loops, the pool stops as soon as
+       * the last one is closed, or the stop timeout expires, and then the callback is called in the base loop
+       * */
+      void stop(const stopped_callback& cb = stopped_callback()) {
+        if (_stopping.exchange(true) || _stopped) return;
 
-        _stopping = true;
+        _on_stopped = cb;
 
-        _base_loop->runInLoop(boost::bind(&tcp_client_pool::do_stop, this));
+        _base_queue->post(boost::bind(&tcp_client_pool::do_stop, this));
       }
 
+      bool stopped() const { return _stopped; }
+
       /// data structure access section
     public:
 
-      void erase(const std::string& peer_ip_port) {
-        std::lock_guard<std::mutex> guard(_tcp_client_pool_mutex);
-        _tcp_client_pool.erase(peer_ip_port);
+      void erase(const std::string& peer_ip_port) { erase(atlas::rpc::parse_endpoint(peer_ip_port)); }
+
+      void erase(atlas::rpc::endpoint_id peer) {
+        bool drained = false;
+
+        {
+          std::lock_guard<std::mutex> guard(_tcp_client_pool_mutex);
+
+          auto range = _tcp_client_pool.equal_range(peer);
+          for (auto it = range.begin(); it != range.end(); ++it) {
+            for (auto c = _clients_by_name.begin(); c != _clients_by_name.end(); ++c) {
+              if (c->second == it->second) {
+                _clients_by_name.erase(c);
+                break;
+              }
+            }
+          }
+
+          while (_tcp_client_pool.count(peer)) destroy_client(_tcp_client_pool.find(peer));
+          drained = _tcp_client_pool.empty();
+        }
+
+        // the last connection is closed, so the pool can stop safely
+        if (_stopping && drained) {
+          _base_loop->queueInLoop(boost::bind(&tcp_client_pool::do_finish_stop, this));
+        }
       }
 
       size_t size() const {
@@ -174,64 +1242,94 @@ namespace pioneer {
 
       /*
        * Thread safe
+       * Establish connections_per_peer connections to the target, the callback is called in an I/O loop
+       * when all of them are established
        * */
-      void connect(const std::string& target_ip) noexcept {
-        _base_loop->runInLoop(boost::bind(&tcp_client_pool::do_connect, this, target_ip));
+      void connect(const std::string& target_ip, const ready_callback& cb = ready_callback()) noexcept {
+        _base_queue->post(boost::bind(&tcp_client_pool::do_connect, this, target_ip, cb));
       }
 
       /*
        * Thread safe
        * */
       void disconnect(const std::string& target_ip) noexcept {
-        _base_loop->runInLoop(boost::bind(&tcp_client_pool::do_disconnect, this, target_ip));
+        _base_queue->post(boost::bind(&tcp_client_pool::do_disconnect, this, target_ip));
+      }
+
+      /*
+       * Thread safe
+       * Reconnect the disconnected clients to the peer now instead of waiting for the backoff delay,
+       * for example, a sender finds no connection to the peer
+       * */
+      void reconnect_now(atlas::rpc::endpoint_id peer) noexcept {
+        _base_queue->post(boost::bind(&tcp_client_pool::do_reconnect_now, this, peer));
       }
 
+      void reconnect_now(const std::string& peer_ip_port) noexcept { reconnect_now(atlas::rpc::parse_endpoint(peer_ip_port)); }
+
+      // the timers of the base loop, thread safe, the functors run in the base loop, after init()
+      loop_timers& timers() { return *_base_timers; }
+
       /*
        * Thread safe
        * */
       void refresh(const std::string& target_ip) noexcept {
-        _base_loop->runInLoop(boost::bind(&tcp_client_pool::do_refresh, this, target_ip));
+        _base_queue->post(boost::bind(&tcp_client_pool::do_refresh, this, target_ip));
       }
 
       /*
        * Thread safe
        * */
       void disconnect_all() noexcept {
-        _base_loop->runInLoop(boost::bind(&tcp_client_pool::do_disconnect_all, this));
+        _base_queue->post(boost::bind(&tcp_client_pool::do_disconnect_all, this));
       }
 
       /*
        * Thread safe
        * */
       void refresh_all() noexcept {
-        _base_loop->runInLoop(boost::bind(&tcp_client_pool::do_refresh_all, this));
+        _base_queue->post(boost::bind(&tcp_client_pool::do_refresh_all, this));
       }
 
-      void destroy() { _destroyed_cv.notify_one(); }
-
     protected:
 
       void do_stop() {
         LOG(INFO) << "stopping client pool, please wait...";
 
+        if (empty()) {
+          do_finish_stop();
+          return;
+        }
+
         // client side half-close, which means the write channel is closed,
         // but the socket file descriptor is not closed by system call close(2) yet.
         // it's still possible to receive data from the socket after disconnect is called,
         // until the server side closes the socket file descriptor by close(2)
+        // every connection is closed in it's own I/O loop, so they are closed in parallel
         do_disconnect_all();
 
-        // wait until all connections raised by TcpClient are disconnected, and then
-        // we can safely destroy all the connections
-        std::unique_lock<std::mutex> lock(_destroyed_mutex);
-        // TODO : avoid hard coding
-        _destroyed_cv.wait_for(lock, std::chrono::seconds(30), [this]() {
-          return _tcp_client_pool.empty();
-        });
+        // never block the base loop, it's the loop which finishes the stopping when the connections are closed,
+        // the timer destroys the connections not closed in time
+        double timeout = std::chrono::duration_cast<std::chrono::duration<double>>(_stop_timeout).count();
+        _stop_timer = _base_timers->run_after(timeout, boost::bind(&tcp_client_pool::do_finish_stop, this));
+      }
+
+      // run in the base loop, only the first call takes effect
+      void do_finish_stop() {
+        if (_stopped) return;
+
+        // finished before the timeout
+        _base_timers->cancel(_stop_timer);
 
-        if (!_tcp_client_pool.empty()) {
-          LOG(INFO) << "force disconnect " << _tcp_client_pool.size() << " connections";
+        {
+          std::lock_guard<std::mutex> guard(_tcp_client_pool_mutex);
+          if (!_tcp_client_pool.empty()) {
+            LOG(INFO) << "force disconnect " << _tcp_client_pool.size() << " connections";
 
-          _tcp_client_pool.clear();
+            _tcp_client_pool.clear();
+          }
+
+          _clients_by_name.clear();
         }
 
         // quit all sub loops and threads
@@ -243,9 +1341,11 @@ namespace pioneer {
         LOG(INFO) << "inner client pool stopped";
 
         _stopped = true;
+
+        if (_on_stopped) _on_stopped();
       }
 
-      void do_connect(const std::string& target_ip) {
+      void do_connect(const std::string& target_ip, const ready_callback& cb) {
         if (_stopping) {
           LOG(INFO) << "sorry, have a rest";
           return;
@@ -254,38 +1354,194 @@ namespace pioneer {
         // DLOG(INFO) << "try establish a connection " << system::context::local_ip << " -> " << target_ip;
 
         mn::InetAddress server_address(target_ip, _server_port);
-        std::string name = std::string("tcp_client_") + std::to_string(_tcp_client_pool.size());
+        atlas::rpc::endpoint_id peer = ip::to_endpoint(server_address.getSockAddrInet());
+
+        {
+          std::lock_guard<std::mutex> guard(_warming_mutex);
+          _warming[peer] = warming_peer { _connections_per_peer, cb };
+        }
+
+        _disconnected_peers.erase(peer);
+
+        // the clients are spread over the I/O loops, so the handshakes go in parallel
+        for (int i = 0; i < _connections_per_peer; ++i) {
+          new_client(server_address);
+        }
+      }
+
+      // run in the base loop
+      void new_client(const mn::InetAddress& server_address) {
+        atlas::rpc::endpoint_id peer = ip::to_endpoint(server_address.getSockAddrInet());
+        std::string name = std::string("tcp_client_") + std::to_string(_next_client_id++);
+
+        mn::ConnectionCallback on_connection = boost::bind(&tcp_client_pool::on_connection, this, _1);
+
+        transport_client* client = nullptr;
+        if (_local_transport && local_address::is_local(atlas::rpc::ip_to_string(atlas::rpc::endpoint_ip(peer)))) {
+          client = new local_client(_io_thread_pool->getNextLoop(), server_address, name,
+              on_connection, _on_message, _on_write_complete);
+        }
+        else {
+          client = new tcp_transport_client(_io_thread_pool->getNextLoop(), server_address, name,
+              on_connection, _on_message, _on_write_complete);
+        }
+
+        {
+          // DLOG(INFO) << "save the TcpClient for server : " << atlas::rpc::format_endpoint(peer);
+          std::lock_guard<std::mutex> guard(_tcp_client_pool_mutex);
+          _tcp_client_pool.insert(peer, client);
+          _clients_by_name[name] = client;
+        }
 
-        mn::TcpClient* client = new mn::TcpClient(_io_thread_pool->getNextLoop(), server_address, name);
-        client->setConnectionCallback(_on_connection);
-        client->setMessageCallback(_on_message);
-        client->setWriteCompleteCallback(_on_write_complete);
         client->connect();
+      }
 
-        std::string peer_ip_port = server_address.toIpPort();
-        // DLOG(INFO) << "save the TcpClient for server : " << peer_ip_port;
+      // run in the base loop, the connection of the client must be closed already
+      void remove_client(atlas::rpc::endpoint_id peer, const std::string& name) {
         std::lock_guard<std::mutex> guard(_tcp_client_pool_mutex);
-        _tcp_client_pool.insert(peer_ip_port, client);
+
+        auto c = _clients_by_name.find(name);
+        if (c == _clients_by_name.end()) return;
+
+        auto range = _tcp_client_pool.equal_range(peer);
+        for (auto it = range.begin(); it != range.end(); ++it) {
+          if (it->second == c->second) {
+            destroy_client(it);
+            break;
+          }
+        }
+
+        _clients_by_name.erase(c);
+      }
+
+      /*
+       * The muduo client closes it's connection in it's own loop, so it's destroyed there too, after the closing
+       * functors queued already, a client destroyed in the base loop races with them on the connection.
+       * The pool mutex is held
+       * */
+      void destroy_client(tcp_client_container::iterator it) {
+        transport_client* client = _tcp_client_pool.release(it).release();
+        client->loop()->queueInLoop([client]() { delete client; });
+      }
+
+      // run in the base loop
+      void on_client_down(atlas::rpc::endpoint_id peer, const std::string& name) {
+        if (_stopping) {
+          remove_client(peer, name);
+
+          // the last connection is closed, so the pool can stop safely
+          if (empty()) do_finish_stop();
+
+          return;
+        }
+
+        // disconnected by ourself
+        if (_disconnected_peers.count(peer)) {
+          remove_client(peer, name);
+          return;
+        }
+
+        // lost by the peer or the network, the client pools connect to the inside nodes only
+        ++system::status::failed_inner_connections;
+
+        int attempt = 0;
+        {
+          std::lock_guard<std::mutex> guard(_reconnect_mutex);
+          attempt = ++_reconnect_attempts[peer];
+        }
+
+        std::chrono::milliseconds delay = _reconnect_policy.delay(attempt);
+        LOG(INFO) << name << " to " << atlas::rpc::format_endpoint(peer) << " is down, reconnect in " << delay.count() << "ms";
+
+        _reconnecting.insert(std::make_pair(peer, name));
+        _base_timers->run_after(delay.count() / 1000.0, boost::bind(&tcp_client_pool::do_reconnect, this, peer, name));
+      }
+
+      // run in the base loop, replace the disconnected client with a new one, does nothing if it's done already
+      void do_reconnect(atlas::rpc::endpoint_id peer, const std::string& name) {
+        auto range = _reconnecting.equal_range(peer);
+        auto it = std::find_if(range.first, range.second, [&name](const std::pair<const atlas::rpc::endpoint_id, std::string>& v) {
+          return v.second == name;
+        });
+
+        if (it == range.second) return;
+        _reconnecting.erase(it);
+
+        if (_stopping) return;
+
+        remove_client(peer, name);
+
+        new_client(mn::InetAddress(ip::to_sockaddr(peer)));
+      }
+
+      void do_reconnect_now(atlas::rpc::endpoint_id peer) {
+        std::vector<std::string> names;
+
+        auto range = _reconnecting.equal_range(peer);
+        for (auto it = range.first; it != range.second; ++it) names.push_back(it->second);
+
+        for (const auto& name : names) do_reconnect(peer, name);
+      }
+
+      // run in the I/O loops
+      void on_connection(const mn::TcpConnectionPtr& conn) {
+        if (_on_connection) _on_connection(conn);
+
+        atlas::rpc::endpoint_id peer = ip::to_endpoint(conn->peerAddress().getSockAddrInet());
+
+        if (!conn->connected()) {
+          // the connection name is the client name followed by ":peer#id"
+          std::string name = conn->name().substr(0, conn->name().find(':'));
+          _base_loop->queueInLoop(boost::bind(&tcp_client_pool::on_client_down, this, peer, name));
+
+          return;
+        }
+
+        {
+          std::lock_guard<std::mutex> guard(_reconnect_mutex);
+          _reconnect_attempts.erase(peer);
+        }
+
+        ready_callback cb;
+
+        {
+          std::lock_guard<std::mutex> guard(_warming_mutex);
+
+          auto it = _warming.find(peer);
+          if (it == _warming.end() || --it->second.remaining > 0) return;
+
+          cb = std::move(it->second.on_ready);
+          _warming.erase(it);
+        }
+
+        LOG(INFO) << "all connections to " << atlas::rpc::format_endpoint(peer) << " are established";
+
+        if (cb) cb(atlas::rpc::endpoint_to_string(peer));
       }
 
       void do_disconnect(const std::string& target_ip) {
-        std::lock_guard<std::mutex> guard(_tcp_client_pool_mutex);
+        atlas::rpc::endpoint_id peer = server_endpoint(target_ip);
 
-        auto it = _tcp_client_pool.find(target_ip);
+        // the clients are removed instead of reconnected once they are down
+        _disconnected_peers.insert(peer);
 
-        if (it != _tcp_client_pool.end()) {
+        std::lock_guard<std::mutex> guard(_tcp_client_pool_mutex);
+
+        auto range = _tcp_client_pool.equal_range(peer);
+        for (auto it = range.begin(); it != range.end(); ++it) {
           it->second->disconnect();
         }
       }
 
+      // the clients are replaced by new ones by the reconnect policy once they are down
       void do_refresh(const std::string& target_ip) {
-        std::lock_guard<std::mutex> guard(_tcp_client_pool_mutex);
+        atlas::rpc::endpoint_id peer = server_endpoint(target_ip);
 
-        auto it = _tcp_client_pool.find(target_ip);
+        std::lock_guard<std::mutex> guard(_tcp_client_pool_mutex);
 
-        if (it != _tcp_client_pool.end()) {
+        auto range = _tcp_client_pool.equal_range(peer);
+        for (auto it = range.begin(); it != range.end(); ++it) {
           it->second->disconnect();
-          it->second->connect();
         }
       }
 
@@ -304,29 +1560,59 @@ namespace pioneer {
         typedef typename tcp_client_container::reference reference;
         std::for_each(_tcp_client_pool.begin(), _tcp_client_pool.end(), [this](reference v) {
           v.second->disconnect();
-          v.second->connect();
         });
       }
 
+      // the clients to a target are keyed by it's ip and the server port
+      atlas::rpc::endpoint_id server_endpoint(const std::string& target_ip) const {
+        return atlas::rpc::make_endpoint(atlas::rpc::parse_ip(target_ip), _server_port);
+      }
+
     private:
 
       std::atomic<bool> _stopping;
       std::atomic<bool> _stopped;
       int _thread_num;
       unsigned short _server_port;
+      int _connections_per_peer;
+      bool _local_transport;
+      std::chrono::milliseconds _stop_timeout;
+      reconnect_policy _reconnect_policy;
+      size_t _next_client_id;
 
       mn::EventLoop* _base_loop;
+      // the requests of all the threads to the base loop, see connect()
+      std::unique_ptr<loop_queue> _base_queue;
+      // the reconnect backoffs and the stop timeout, a storm of disconnections arms thousands of them
+      std::unique_ptr<loop_timers> _base_timers;
+      loop_timers::timer_id _stop_timer;
       std::shared_ptr<mn::EventLoopThreadPool> _io_thread_pool;
 
       mn::ConnectionCallback _on_connection;
       mn::MessageCallback _on_message;
       mn::WriteCompleteCallback _on_write_complete;
+      stopped_callback _on_stopped;
 
       mutable std::mutex _tcp_client_pool_mutex;
       tcp_client_container _tcp_client_pool;
+      std::map<std::string, transport_client*> _clients_by_name;
+
+      // the failed attempts since the last successful connection to the peer
+      std::mutex _reconnect_mutex;
+      std::map<atlas::rpc::endpoint_id, int> _reconnect_attempts;
+
+      // accessed in the base loop only
+      std::multimap<atlas::rpc::endpoint_id, std::string> _reconnecting;
+      std::set<atlas::rpc::endpoint_id> _disconnected_peers;
+
+      // the peers whose connections are not all established yet
+      struct warming_peer {
+        int remaining;
+        ready_callback on_ready;
+      };
 
-      mutable std::mutex _destroyed_mutex;
-      std::condition_variable _destroyed_cv;
+      std::mutex _warming_mutex;
+      std::map<atlas::rpc::endpoint_id, warming_peer> _warming;
     };
 
   } // net
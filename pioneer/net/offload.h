@@ -0,0 +1,309 @@
+/*
+ * offload.h
+ *
+ *  Created on: Sep 28, 2013
+ *      Author: vincent
+ */
+
+/*    Copyright 2011 ~ 2013 Vincent Zhang, ivincent.zhang@gmail.com
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#ifndef PIONEER_NET_OFFLOAD_H_
+#define PIONEER_NET_OFFLOAD_H_
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+
+#include <glog/logging.h>
+#include <atlas/singleton.h>
+#include <atlas/fast_random.h>
+#include <atlas/rpc.h>
+
+#include <pioneer/system/context.h>
+#include <pioneer/system/thread_pool.h>
+#include <pioneer/net/compression.h>
+#include <pioneer/net/request.h>
+#include <pioneer/net/rpc_clients.h>
+
+namespace pioneer {
+  namespace net {
+
+    /*
+     * The work stealing between the inside nodes, the worker pool balances the tasks of a node only, so a node
+     * with a hot shard queues while it's peers are idle. Every node multicasts the depth of it's worker queue
+     * a few times a second, see rpc::offload_rfc::report, and a node whose queue is deeper than the threshold
+     * per worker passes the new requests of the functions opted in on to the least loaded peer instead of
+     * queueing them, see PIONEER_RPC_OFFLOADABLE, the peer runs the frame as it is, and the response goes back
+     * to the caller through this node, so the cluster throughput tracks the capacity of all the nodes.
+     *
+     * A peer is taken by the power of two choices among the ones reported recently, and only if it's
+     * queue is shorter by the margin, the depth of a peer is raised by every request passed on until it
+     * reports again, so a burst is not passed on to one peer. A request the peer can not be reached for
+     * is queued here as usual.
+     *
+     * A function opted in answers with it's result, never later by itself, it's run with no state of this node
+     * */
+    class offload : public atlas::singleton<offload> {
+    public:
+
+      typedef std::chrono::steady_clock clock;
+
+      // the tasks per worker a peer must have fewer of than this node to be given any
+      static constexpr double margin = 2.0;
+
+    private:
+
+      struct peer_load {
+        double depth;         // the queued tasks per worker
+        clock::time_point reported;
+      };
+
+    private:
+
+      friend class atlas::singleton<offload>;
+      offload(const offload&) = delete;
+      offload& operator=(const offload&) = delete;
+
+    public:
+
+      // public for std::make_shared, see atlas::singleton
+      offload() : _threshold(0), _interval(0), _offloaded(0), _ran(0), _fallbacks(0) {}
+
+    public:
+
+      // before the servers start, the queued tasks per worker above which the requests are passed on,
+      // 0 never passes any on, the loads are reported every interval in seconds anyway
+      void configure(double threshold, double interval) {
+        _threshold = threshold;
+        _interval = interval;
+
+        if (enabled()) LOG(INFO) << "offload the requests to the peers above " << threshold << " queued tasks per worker";
+      }
+
+      bool enabled() const { return _threshold > 0; }
+
+      // during the static initialization, see PIONEER_RPC_OFFLOADABLE
+      void allow(int fn_id) { _offloadable.insert(fn_id); }
+
+      bool offloadable(int fn_id) const { return _offloadable.count(fn_id) > 0; }
+
+      // the queued tasks per worker of this node
+      static double depth() {
+        const atlas::adaptive_thread_pool& pool = system::worker_pool::ref();
+        return static_cast<double>(pool.pending_tasks()) / std::max<size_t>(pool.size(), 1);
+      }
+
+      bool overloaded() const { return enabled() && depth() >= _threshold; }
+
+      // the peer to pass a request on to, 0 if none is less loaded enough
+      uint32_t target() {
+        double self = depth();
+        clock::time_point fresh = clock::now() - std::chrono::duration_cast<clock::duration>(
+            std::chrono::duration<double>(_interval * 3));
+
+        std::lock_guard<std::mutex> guard(_mutex);
+
+        uint32_t choices[2] = { 0, 0 };
+        size_t candidates = 0;
+        for (const auto& p : _peers) {
+          if (p.second.reported < fresh || p.second.depth + margin > self) continue;
+
+          // a reservoir sample of two
+          ++candidates;
+          if (candidates <= 2) choices[candidates - 1] = p.first;
+          else if (atlas::fast_random() % candidates < 2) choices[atlas::fast_random() % 2] = p.first;
+        }
+
+        if (!candidates) return 0;
+
+        uint32_t ip = choices[0];
+        if (choices[1] && _peers[choices[1]].depth < _peers[ip].depth) ip = choices[1];
+
+        // until it reports again
+        _peers[ip].depth += 1.0 / std::max<size_t>(system::worker_pool::ref().size(), 1);
+        return ip;
+      }
+
+      void on_report(uint32_t ip, double depth) {
+        if (!ip || ip == atlas::rpc::parse_ip(system::context::local_ip)) return;
+
+        std::lock_guard<std::mutex> guard(_mutex);
+        _peers[ip] = peer_load { depth, clock::now() };
+      }
+
+      // a peer is gone, see net::drain
+      void forget(uint32_t ip) {
+        std::lock_guard<std::mutex> guard(_mutex);
+        _peers.erase(ip);
+      }
+
+      // in a timer, the load of this node to the peers
+      void report();
+
+      void on_offloaded() { _offloaded.fetch_add(1, std::memory_order_relaxed); }
+      void on_ran() { _ran.fetch_add(1, std::memory_order_relaxed); }
+      void on_fallback() { _fallbacks.fetch_add(1, std::memory_order_relaxed); }
+
+      // the requests passed on to the peers, run for them, and queued here since the peer was not reached
+      unsigned long long offloaded() const { return _offloaded.load(std::memory_order_relaxed); }
+      unsigned long long ran() const { return _ran.load(std::memory_order_relaxed); }
+      unsigned long long fallbacks() const { return _fallbacks.load(std::memory_order_relaxed); }
+
+      // a line a peer : ip, queued tasks per worker, seconds since reported
+      std::string str() const {
+        std::ostringstream os;
+        os << "threshold " << _threshold << ", depth " << depth() << "\n";
+
+        clock::time_point now = clock::now();
+        std::lock_guard<std::mutex> guard(_mutex);
+        for (const auto& p : _peers) {
+          os << atlas::rpc::ip_to_string(p.first) << "\t" << p.second.depth << "\t"
+              << std::chrono::duration<double>(now - p.second.reported).count() << "s\n";
+        }
+
+        return os.str();
+      }
+
+    private:
+
+      double _threshold;
+      double _interval;
+
+      std::unordered_set<int> _offloadable;
+
+      mutable std::mutex _mutex;
+      std::unordered_map<uint32_t, peer_load> _peers;
+
+      std::atomic<unsigned long long> _offloaded;
+      std::atomic<unsigned long long> _ran;
+      std::atomic<unsigned long long> _fallbacks;
+    };
+
+    struct offloadable_binder {
+      offloadable_binder(int fn_id) { offload::ref().allow(fn_id); }
+    };
+
+  } // net
+
+  namespace rpc {
+
+    using atlas::rpc::rpc_result;
+    using atlas::rpc::rpc_context;
+
+    // builtin rpc
+    ATLAS_REGISTER_REMOTE_FUNC(offload_report, -16);
+    ATLAS_REGISTER_REMOTE_FUNC(offload_run, -17);
+
+    class offload_rfc {
+    public:
+
+      // a peer multicasts the queued tasks per worker of it's own
+      static rpc_result report(const std::string& ip, double depth, rpc_context c) noexcept {
+        net::offload::ref().on_report(atlas::rpc::parse_ip(ip), depth);
+        return nullptr;
+      }
+
+      // a request passed on by an overloaded peer, the result is returned to it
+      static rpc_result run(const std::string& frame, rpc_context c) noexcept {
+        if (frame.size() < atlas::rpc::message::request_header_size
+            || !atlas::rpc::message::known_version(frame.data(), frame.size())) {
+          return rpc_result("", atlas::rpc::rpc_unreachable);
+        }
+
+        net::offload::ref().on_ran();
+
+        atlas::rpc::message message(frame.data(), frame.size());
+        const atlas::rpc::request_header* h = message.header();
+        atlas::rpc::rpc_context context(h->client_id, h->return_type, h->session_id, c.empty() ? atlas::rpc::nil_endpoint : c.source());
+
+        atlas::memory::arena_scope scope;
+        if (!(h->flags & atlas::rpc::message_compressed)) return atlas::rpc::dispatcher_manager::ref().dispatch(message, context);
+
+        atlas::rpc::message raw;
+        if (!net::frame_compression::ref().decompress(message, &raw)) return rpc_result("", atlas::rpc::rpc_unreachable);
+
+        return atlas::rpc::dispatcher_manager::ref().dispatch(raw, context);
+      }
+    };
+
+    ATLAS_BIND_REMOTE_FUNC(offload_report, offload_rfc::report);
+    ATLAS_BIND_REMOTE_FUNC(offload_run, offload_rfc::run);
+
+    // the loads are not queued behind the load they report, the requests passed on queue as any request does
+    PIONEER_RPC_PRIORITY(offload_report, 10);
+    PIONEER_RPC_PRIORITY(offload_run, system::fn_priorities::data_plane);
+
+  } // rpc
+
+  namespace net {
+
+    inline void offload::report() {
+      if (system::context::local_ip.empty()) return;
+
+      rpc::mcast_client client;
+      client.call(rpc::offload_rfc::report, rpc::fn_ids::offload_report, system::context::local_ip, depth(), atlas::rpc::nilctx);
+    }
+
+    inline void request::offload(uint32_t peer) noexcept {
+      net::offload::ref().on_offloaded();
+
+      const atlas::rpc::request_header* h = _message.header();
+
+      // the header is copied out of the frame, so the whole frame is right before the body
+      std::string frame(_message.body() - atlas::rpc::message::request_header_size, _message.frame_size());
+      atlas::rpc::rpc_context context(h->client_id, h->return_type, h->session_id, _source);
+      endpoint_id source = _source;
+
+      session_manager::ref().remove(_session_id);
+
+      rpc::p2p_client client(rpc::inward_client, atlas::rpc::make_endpoint(peer, 0));
+      client.set_backpressure_policy(rpc::bp_fail_fast);
+
+      // a one way call is passed on one way
+      if (h->return_type != atlas::rpc::rpc_sync && h->return_type != atlas::rpc::rpc_async_callback) {
+        client.call(rpc::offload_rfc::run, rpc::fn_ids::offload_run, frame, atlas::rpc::nilctx);
+        return;
+      }
+
+      atlas::rpc::rpc_callback_type cb = [frame, context, source](const std::string& data, int err, atlas::rpc::async_task&) {
+        // never sent, it's queued here as usual
+        if (err == atlas::rpc::rpc_unreachable || err == atlas::rpc::rpc_backpressure) {
+          net::offload::ref().on_fallback();
+
+          auto f = std::make_shared<std::string>(frame);
+          system::worker_pool::ref().schedule(atlas::adaptive_thread_pool::task_type([f, source]() {
+            request::run(atlas::rpc::message(f->data(), f->size()), source);
+          }));
+          return;
+        }
+
+        rpc::p2p_client response_client(static_cast<rpc::client_type>(context.client_id()), context.source());
+        atlas::rpc::dispatcher_manager::ref().respond(response_client, context, atlas::rpc::rpc_result(data, err));
+      };
+      client.call(rpc::offload_rfc::run, rpc::fn_ids::offload_run, cb, frame, atlas::rpc::nilctx);
+    }
+
+  } // net
+} // pioneer
+
+#define PIONEER_RPC_OFFLOADABLE(func_name) \
+  static ::pioneer::net::offloadable_binder __pioneer_fn_offloadable_##func_name(fn_ids::func_name)
+
+#endif /* PIONEER_NET_OFFLOAD_H_ */
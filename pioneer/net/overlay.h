@@ -0,0 +1,312 @@
+/*
+ * overlay.h
+ *
+ *  Created on: Sep 28, 2013
+ *      Author: vincent
+ */
+
+/*    Copyright 2011 ~ 2013 Vincent Zhang, ivincent.zhang@gmail.com
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#ifndef PIONEER_NET_OVERLAY_H_
+#define PIONEER_NET_OVERLAY_H_
+
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <set>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <glog/logging.h>
+#include <atlas/singleton.h>
+#include <atlas/versioned_snapshot.h>
+#include <atlas/container/hash_ring.h>
+#include <atlas/rpc.h>
+
+#include <pioneer/net/net.h>
+
+namespace pioneer {
+  namespace net {
+
+    enum class overlay_topology { full_mesh, random_k, rack_aware };
+
+    // the neighbors of this node, and the neighbor to reach every other member through
+    struct overlay_routes {
+      std::set<uint32_t> neighbors;
+      std::unordered_map<uint32_t, uint32_t> next_hops;
+    };
+
+    struct overlay_tag {};
+
+    /*
+     * The inward connections of a large cluster, instead of the full mesh, where every node keeps a connection to
+     * every other one. Every node computes the same graph of the members, so it knows the neighbors of every member,
+     * connects to it's own, and reaches the others through them, see rpc::p2p_client and rpc::overlay_rfc. The
+     * members are known by gossip, see net::gossip, the overlay needs it.
+     *
+     *  random_k : every member links to the k members after it on a hash ring, and the next one by ip, so the
+     *    graph is connected, and O(log N) hops wide at most, a node keeps about 2k + 2 connections
+     *  rack_aware : the members of a rack are a full mesh, and every two racks are linked by one pair of their
+     *    members, a member is in the rack of it's ip prefix, 3 hops at most
+     *
+     * The graph is computed again once the members change, a hash ring keeps most of the links of random_k
+     * where they are. Of two neighbors, the one with the lower ip connects, the other is connected
+     * */
+    class overlay : public atlas::singleton<overlay> {
+    public:
+
+      // a relayed frame is dropped after so many hops, the graph is never that wide
+      static const int max_hops = 8;
+
+      // runs a frame relayed to this node as a request of it's origin
+      typedef std::function<void(uint32_t origin, const std::string& frame)> receiver_type;
+
+    private:
+
+      friend class atlas::singleton<overlay>;
+      overlay(const overlay&) = delete;
+      overlay& operator=(const overlay&) = delete;
+
+    public:
+
+      // public for std::make_shared, see atlas::singleton
+      overlay() : _topology(overlay_topology::full_mesh), _degree(3), _rack_prefix(24), _self(0), _relayed(0), _forwarded(0) {}
+
+    public:
+
+      // full_mesh, random or rack
+      static bool named(const std::string& name, overlay_topology* topology) {
+        if (name == "full_mesh") *topology = overlay_topology::full_mesh;
+        else if (name == "random") *topology = overlay_topology::random_k;
+        else if (name == "rack") *topology = overlay_topology::rack_aware;
+        else return false;
+
+        return true;
+      }
+
+      // before the servers start, the degree is used by random_k, the ip prefix length of a rack by rack_aware
+      void configure(overlay_topology topology, size_t degree = 3, int rack_prefix = 24) {
+        _topology = topology;
+        _degree = std::max<size_t>(degree, 1);
+        _rack_prefix = std::min(std::max(rack_prefix, 0), 32);
+      }
+
+      bool enabled() const { return _topology != overlay_topology::full_mesh; }
+
+      // during the static initialization, see net::request
+      void set_receiver(const receiver_type& receiver) { _receiver = receiver; }
+
+      const receiver_type& receiver() const { return _receiver; }
+
+      uint32_t self() const { return _self.load(std::memory_order_relaxed); }
+
+      // the members changed, including this node, see gossip::publish
+      void update(uint32_t self, const std::set<uint32_t>& members) {
+        if (!enabled() || !self) return;
+
+        std::lock_guard<std::mutex> guard(_mutex);
+        _self = self;
+
+        std::vector<uint32_t> all(members.begin(), members.end());
+        if (!members.count(self)) {
+          all.push_back(self);
+          std::sort(all.begin(), all.end());
+        }
+
+        std::map<uint32_t, std::set<uint32_t>> g = graph(all);
+
+        overlay_routes next;
+        next.neighbors = g[self];
+        route(g, self, next.next_hops);
+
+        std::set<uint32_t> previous = _routes.get()->neighbors;
+        _routes.update([&next](overlay_routes& r) { r = next; });
+
+        // of two neighbors, the lower ip connects
+        for (uint32_t ip : next.neighbors) {
+          if (self < ip && !previous.count(ip)) inward_client_pool::ref().connect(atlas::rpc::ip_to_string(ip));
+        }
+        for (uint32_t ip : previous) {
+          if (self < ip && !next.neighbors.count(ip)) inward_client_pool::ref().disconnect(atlas::rpc::ip_to_string(ip));
+        }
+
+        LOG(INFO) << next.neighbors.size() << " neighbors of " << all.size() << " members on the overlay";
+      }
+
+      bool neighbor(uint32_t ip) const { return _routes.get()->neighbors.count(ip) > 0; }
+
+      // the neighbor to send to for the target, 0 if there is no route
+      uint32_t next_hop(uint32_t target) const {
+        const overlay_routes& r = *_routes.get();
+
+        auto it = r.next_hops.find(target);
+        return it == r.next_hops.end() ? 0 : it->second;
+      }
+
+      // a member which is not a neighbor is reached through one
+      bool relayed(uint32_t target) const {
+        if (!enabled() || !target || target == self()) return false;
+
+        return !neighbor(target) && next_hop(target) != 0;
+      }
+
+      std::vector<uint32_t> neighbors() const {
+        const std::set<uint32_t>& n = _routes.get()->neighbors;
+        return std::vector<uint32_t>(n.begin(), n.end());
+      }
+
+      // the frames of this node sent through a neighbor, and the ones of others passed on
+      void on_relayed() { _relayed.fetch_add(1, std::memory_order_relaxed); }
+      void on_forwarded() { _forwarded.fetch_add(1, std::memory_order_relaxed); }
+
+      unsigned long long relays() const { return _relayed.load(std::memory_order_relaxed); }
+      unsigned long long forwards() const { return _forwarded.load(std::memory_order_relaxed); }
+
+      // a line a member reachable : ip, the next hop
+      std::string str() const {
+        const overlay_routes& r = *_routes.get();
+
+        std::ostringstream os;
+        os << r.neighbors.size() << " neighbors, " << r.next_hops.size() << " members reachable\n";
+        for (const auto& hop : r.next_hops) {
+          os << atlas::rpc::ip_to_string(hop.first) << "\t"
+              << (hop.first == hop.second ? "neighbor" : "via " + atlas::rpc::ip_to_string(hop.second)) << "\n";
+        }
+
+        return os.str();
+      }
+
+    private:
+
+      // the links of every member, both ways, the members are sorted
+      std::map<uint32_t, std::set<uint32_t>> graph(const std::vector<uint32_t>& members) const {
+        std::map<uint32_t, std::set<uint32_t>> g;
+        for (uint32_t m : members) g[m];
+
+        auto link = [&g](uint32_t a, uint32_t b) {
+          if (a == b) return;
+          g[a].insert(b);
+          g[b].insert(a);
+        };
+
+        if (_topology == overlay_topology::random_k) {
+          atlas::hash_ring ring(16);
+          for (uint32_t m : members) ring.add(atlas::rpc::ip_to_string(m));
+
+          for (size_t i = 0; i < members.size(); ++i) {
+            std::string ip = atlas::rpc::ip_to_string(members[i]);
+            for (const std::string& n : ring.find(ip + "#overlay", _degree + 1)) {
+              if (n != ip) link(members[i], atlas::rpc::parse_ip(n));
+            }
+
+            link(members[i], members[(i + 1) % members.size()]);
+          }
+        }
+        else if (_topology == overlay_topology::rack_aware) {
+          std::map<uint32_t, std::vector<uint32_t>> racks;
+          for (uint32_t m : members) racks[rack(m)].push_back(m);
+
+          for (const auto& r : racks) {
+            for (size_t i = 0; i < r.second.size(); ++i) {
+              for (size_t j = i + 1; j < r.second.size(); ++j) link(r.second[i], r.second[j]);
+            }
+          }
+
+          for (auto a = racks.begin(); a != racks.end(); ++a) {
+            for (auto b = std::next(a); b != racks.end(); ++b) {
+              link(gateway(a->second, b->first), gateway(b->second, a->first));
+            }
+          }
+        }
+
+        return g;
+      }
+
+      // the shortest paths from this node, the first hop of each
+      static void route(const std::map<uint32_t, std::set<uint32_t>>& g, uint32_t self,
+          std::unordered_map<uint32_t, uint32_t>& next_hops) {
+        std::deque<uint32_t> queue;
+
+        for (uint32_t n : g.find(self)->second) {
+          next_hops[n] = n;
+          queue.push_back(n);
+        }
+
+        while (!queue.empty()) {
+          uint32_t m = queue.front();
+          queue.pop_front();
+
+          for (uint32_t n : g.find(m)->second) {
+            if (n == self || next_hops.count(n)) continue;
+
+            next_hops[n] = next_hops[m];
+            queue.push_back(n);
+          }
+        }
+      }
+
+      uint32_t rack(uint32_t ip) const {
+        return _rack_prefix == 0 ? 0 : ip >> (32 - _rack_prefix);
+      }
+
+      // the member of the rack linked to the other rack, the same on every node
+      static uint32_t gateway(const std::vector<uint32_t>& rack_members, uint32_t other_rack) {
+        uint32_t best = rack_members.front();
+        uint64_t best_score = mix(best, other_rack);
+
+        for (uint32_t m : rack_members) {
+          uint64_t score = mix(m, other_rack);
+          if (score < best_score) {
+            best = m;
+            best_score = score;
+          }
+        }
+
+        return best;
+      }
+
+      // splitmix64 of the pair
+      static uint64_t mix(uint32_t a, uint32_t b) {
+        uint64_t x = (static_cast<uint64_t>(a) << 32 | b) + 0x9e3779b97f4a7c15ULL;
+        x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+        return x ^ (x >> 31);
+      }
+
+    private:
+
+      overlay_topology _topology;
+      size_t _degree;
+      int _rack_prefix;
+      receiver_type _receiver;
+
+      std::mutex _mutex;
+      std::atomic<uint32_t> _self;
+      atlas::versioned_snapshot<overlay_routes, overlay_tag> _routes;
+
+      std::atomic<unsigned long long> _relayed;
+      std::atomic<unsigned long long> _forwarded;
+    };
+
+  } // net
+} // pioneer
+
+#endif /* PIONEER_NET_OVERLAY_H_ */
@@ -0,0 +1,263 @@
+/*
+ * reliable_multicast.h
+ *
+ *  Created on: Aug 30, 2013
+ *      Author: vincent
+ */
+
+/*    Copyright 2011 ~ 2013 Vincent Zhang, ivincent.zhang@gmail.com
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#ifndef PIONEER_NET_RELIABLE_MULTICAST_H_
+#define PIONEER_NET_RELIABLE_MULTICAST_H_
+
+#include <cstring>
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include <boost/serialization/vector.hpp>
+#include <glog/logging.h>
+#include <atlas/singleton.h>
+#include <atlas/rpc.h>
+
+#include <pioneer/net/multicast.h>
+#include <pioneer/net/rpc_clients.h>
+
+namespace pioneer {
+  namespace net {
+
+    /*
+     * The receiver side of the reliable multicast.
+     *
+     * Every sender numbers it's datagrams, see mcast_client::set_reliable. The receiver tracks the next
+     * sequence expected from every sender, a datagram beyond it opens a gap, and the datagrams in the gap are
+     * asked again by NAKs sent over the inward TCP connections, the heartbeats of an idle sender reveal the lost
+     * tail datagrams. The datagrams are delivered as soon as they arrive, in any order, as plain UDP does,
+     * and the duplicates are dropped.
+     *
+     * A missing datagram is asked max_nak_attempts times at most, a gap larger than max_missing is truncated,
+     * the datagrams given up are counted as lost
+     * */
+    class rmcast_receiver : public atlas::singleton<rmcast_receiver> {
+    public:
+
+      static const size_t max_missing = 1024;
+      static const int max_nak_attempts = 3;
+
+      // the state of a sender not heard for this long is dropped
+      const std::chrono::minutes idle_sender_timeout = std::chrono::minutes(10);
+
+      // the NAKs to one sender
+      struct nak {
+        uint32_t ip;
+        uint64_t sender;
+        std::vector<uint64_t> seqs;
+      };
+
+    private:
+
+      friend class atlas::singleton<rmcast_receiver>;
+      rmcast_receiver(const rmcast_receiver&) = delete;
+      rmcast_receiver& operator=(const rmcast_receiver&) = delete;
+
+      typedef std::chrono::steady_clock clock;
+
+    public:
+
+      rmcast_receiver() : _recovered(0), _lost(0) {}
+
+    public:
+
+      /*
+       * Strip the header of a reliable datagram, return false if the datagram should be dropped, for example,
+       * a duplicate or a heartbeat. The plain datagrams are accepted as they are
+       * */
+      bool accept(const sockaddr_in& source, const char*& data, size_t& size) {
+        if (size < sizeof(rmcast_header)) return true;
+
+        rmcast_header h;
+        std::memcpy(&h, data, sizeof(h));
+        if (h.magic != RMCAST_MAGIC) return true;
+
+        data += sizeof(h);
+        size -= sizeof(h);
+
+        std::lock_guard<std::mutex> guard(_mutex);
+
+        auto it = _senders.find(h.sender);
+        if (it == _senders.end()) {
+          // we know nothing before the first datagram seen
+          sender_state s;
+          s.next = (h.flags == rmcast_heartbeat) ? h.seq + 1 : h.seq;
+          it = _senders.insert(std::make_pair(h.sender, s)).first;
+        }
+
+        sender_state& s = it->second;
+        s.ip = ntohl(source.sin_addr.s_addr);
+        s.last_seen = clock::now();
+
+        if (h.flags == rmcast_heartbeat) {
+          if (h.seq >= s.next) {
+            add_missing(s, s.next, h.seq + 1);
+            s.next = h.seq + 1;
+          }
+
+          return false;
+        }
+
+        if (h.seq >= s.next) {
+          add_missing(s, s.next, h.seq);
+          s.next = h.seq + 1;
+
+          return true;
+        }
+
+        // an old one, deliver it only if we are waiting for it
+        if (s.missing.erase(h.seq)) {
+          ++_recovered;
+          return true;
+        }
+
+        return false;
+      }
+
+      // the NAKs to send now, called periodically
+      std::vector<nak> collect_naks() {
+        std::vector<nak> naks;
+        clock::time_point now = clock::now();
+
+        std::lock_guard<std::mutex> guard(_mutex);
+
+        for (auto it = _senders.begin(); it != _senders.end();) {
+          sender_state& s = it->second;
+
+          if (s.missing.empty()) {
+            if (now - s.last_seen > idle_sender_timeout) it = _senders.erase(it);
+            else ++it;
+
+            continue;
+          }
+
+          nak n;
+          n.ip = s.ip;
+          n.sender = it->first;
+
+          for (auto m = s.missing.begin(); m != s.missing.end();) {
+            if (m->second >= max_nak_attempts) {
+              ++_lost;
+              m = s.missing.erase(m);
+              continue;
+            }
+
+            ++m->second;
+            n.seqs.push_back(m->first);
+            ++m;
+          }
+
+          if (!n.seqs.empty()) naks.push_back(std::move(n));
+          ++it;
+        }
+
+        return naks;
+      }
+
+      uint64_t recovered() const { return _recovered; }
+
+      uint64_t lost() const { return _lost; }
+
+    private:
+
+      struct sender_state {
+        sender_state() : ip(0), next(1) {}
+
+        uint32_t ip;
+        uint64_t next;
+        clock::time_point last_seen;
+        // the missing sequences, and the NAKs sent for each
+        std::map<uint64_t, int> missing;
+      };
+
+      // [first, last)
+      void add_missing(sender_state& s, uint64_t first, uint64_t last) {
+        if (last - first > max_missing) {
+          _lost += last - first - max_missing;
+          first = last - max_missing;
+        }
+
+        for (uint64_t seq = first; seq < last; ++seq) s.missing[seq] = 0;
+
+        while (s.missing.size() > max_missing) {
+          s.missing.erase(s.missing.begin());
+          ++_lost;
+        }
+      }
+
+    private:
+
+      std::mutex _mutex;
+      std::unordered_map<uint64_t, sender_state> _senders;
+
+      std::atomic<uint64_t> _recovered;
+      std::atomic<uint64_t> _lost;
+    };
+
+  } // net
+
+  namespace rpc {
+
+    using atlas::rpc::rpc_result;
+    using atlas::rpc::rpc_context;
+
+    // builtin rpc
+    ATLAS_REGISTER_REMOTE_FUNC(mcast_nak, -3);
+
+    class rmcast_rfc {
+    public:
+
+      // a receiver asks us to multicast or broadcast the datagrams again
+      static rpc_result nak(uint64_t sender, const std::vector<uint64_t>& seqs, rpc_context c) noexcept {
+        net::udp_sender* s = nullptr;
+        if (sender == net::mcast_client::ref().sender_id()) s = &net::mcast_client::ref();
+        else if (sender == net::bcast_client::ref().sender_id()) s = &net::bcast_client::ref();
+        else s = net::mcast_channels::ref().find(sender);
+
+        if (!s) return nullptr;
+
+        size_t resent = s->retransmit(seqs);
+        DLOG(INFO) << c.source_ip() << " asked for " << seqs.size() << " datagrams, " << resent << " resent";
+
+        return nullptr;
+      }
+
+      // send the NAKs collected by the receiver to the senders, fail fast since they are asked again later
+      static void send_naks() {
+        for (const auto& n : net::rmcast_receiver::ref().collect_naks()) {
+          p2p_client client(inward_client, atlas::rpc::make_endpoint(n.ip, 0));
+          client.set_backpressure_policy(bp_fail_fast);
+          client.call(nak, fn_ids::mcast_nak, n.sender, n.seqs, atlas::rpc::nilctx);
+        }
+      }
+    };
+
+    ATLAS_BIND_REMOTE_FUNC(mcast_nak, rmcast_rfc::nak);
+
+  } // rpc
+} // pioneer
+
+#endif /* PIONEER_NET_RELIABLE_MULTICAST_H_ */
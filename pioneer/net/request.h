@@ -25,20 +25,32 @@
 
 #include <string>
 #include <deque>
+#include <atomic>
+#include <chrono>
 
 #include <glog/logging.h>
 #include <boost/uuid/uuid.hpp>
 #include <atlas/rpc.h>
+#include <atlas/trace_scope.h>
+#include <atlas/container/sharded_concurrent_box.h>
+#include <atlas/container/timer_wheel.h>
+#include <atlas/memory/pool_allocator.h>
+#include <atlas/memory/arena.h>
 
 #include <pioneer/system/context.h>
+#include <pioneer/system/admission.h>
+#include <pioneer/net/compression.h>
 #include <pioneer/net/ip.h>
 #include <pioneer/net/rpc_clients.h>
+#include <pioneer/net/rx_timestamps.h>
+#include <pioneer/net/ack_aggregator.h>
 
 namespace pioneer {
   namespace net {
 
     using std::string;
     using boost::uuids::uuid;
+    using atlas::rpc::endpoint_id;
 
     enum class error_category {
       no_error = 0,
@@ -61,25 +73,67 @@ namespace pioneer {
     class request {
     public:
 
-      request(const uuid& session_id, const session_ptr& s, const char* msg, size_t msg_size, const string& source_ip_port) :
-          _message(msg, msg_size), _session(s), _source_ip_port(source_ip_port)
-      {}
+      // the request borrows the message from the holder's buffer, the message body is never copied
+      request(const uuid& session_id, const session_ptr& s, const atlas::rpc::message::holder_type& holder,
+          const char* msg, size_t msg_size, endpoint_id source) :
+          _session_id(session_id), _message(holder, msg, msg_size), _session(s), _source(source),
+          _enqueued(std::chrono::steady_clock::now())
+      {
+        // built by the I/O loop which read it, see rx_time_scope
+        _message.set_received(rx_timestamps::current());
+        _receive_wait = rx_timestamps::since(_message.received());
+      }
 
     public:
 
       session_ptr session() const { return _session.lock(); }
 
-      void execute() noexcept {
-        rpc::p2p_client response_client(static_cast<rpc::client_type>(_message.header()->client_id), _source_ip_port);
-        atlas::rpc::dispatcher_manager::ref().execute(response_client, _message, _source_ip_port);
-      }
+      int fn_id() const { return _message.header()->fn_id; }
+
+      const uuid& session_id() const { return _session_id; }
+
+      const atlas::rpc::message& message() const { return _message; }
+
+      endpoint_id source() const { return _source; }
+
+      std::chrono::steady_clock::time_point enqueued() const { return _enqueued; }
+
+      // in the worker, the time from it's receive to it's dispatch, and from it's dispatch to now
+      void record_waits() const { record_waits(fn_id(), _receive_wait, _enqueued); }
+
+      // the receive wait is -1 if it's not stamped, see rx_timestamps
+      static void record_waits(int fn_id, int64_t receive_wait, std::chrono::steady_clock::time_point dispatched);
+
+      // the session is removed once the request is executed
+      void execute() noexcept;
+
+      // a data plane request which has waited too long is rejected instead, see admission_control
+      void execute_or_shed() noexcept;
+
+      // respond the busy error instead of executing, the session is removed as well
+      void reject() noexcept;
+
+      // pass the request on to a less loaded inside node, the session is removed as well, see net::offload
+      void offload(uint32_t peer) noexcept;
+
+      // execute a message sent without a session and respond to the source
+      static void run(const atlas::rpc::message& message, endpoint_id source);
+
+      // respond the busy error to the source without executing the message
+      static void shed(const atlas::rpc::message& message, endpoint_id source);
+
+      // respond the result of the message to the source, in a batch of acks if it's a multicast one
+      static void respond(const atlas::rpc::message& message, endpoint_id source, const atlas::rpc::rpc_result& result);
 
     private:
 
+      uuid _session_id;
       atlas::rpc::message _message;
       std::weak_ptr<pioneer::net::session> _session;
 
-      std::string _source_ip_port;
+      endpoint_id _source;
+      std::chrono::steady_clock::time_point _enqueued;
+      int64_t _receive_wait;
     };
 
     typedef std::shared_ptr<request> request_ptr;
@@ -87,7 +141,11 @@ namespace pioneer {
     class session : public std::enable_shared_from_this<session> {
     public:
 
-      session(const uuid& id) : _id(id) { }
+      typedef std::chrono::steady_clock clock;
+
+    public:
+
+      session(const uuid& id) : _id(id), _last_active(clock::now().time_since_epoch().count()) { }
 
       ~session() { }
 
@@ -95,12 +153,18 @@ namespace pioneer {
 
     public:
 
-      void build_request(const char* message, size_t size, const std::string& source_ip_port) {
-        _request.reset(new net::request(_id, shared_from_this(), message, size, source_ip_port));
+      void build_request(const atlas::rpc::message::holder_type& holder, const char* message, size_t size,
+          endpoint_id source) {
+        touch();
+        _request = atlas::memory::make_pooled<net::request>(_id, shared_from_this(), holder, message, size, source);
       }
 
       const request_ptr& request() const { return _request; }
 
+      void touch() { _last_active = clock::now().time_since_epoch().count(); }
+
+      clock::time_point last_active() const { return clock::time_point(clock::duration(_last_active.load())); }
+
     private:
 
       /*
@@ -109,6 +173,7 @@ namespace pioneer {
        * */
       uuid _id;
       request_ptr _request;
+      std::atomic<clock::rep> _last_active;
     };
 
     bool operator<(const session& lhs, const session& rhs) {
@@ -119,6 +184,8 @@ namespace pioneer {
       return lhs.id() == rhs.id();
     }
 
+    // a session is removed when it's request is executed, sessions never finished, for example,
+    // when the worker pool is shutting down, are removed after they have been idle for idle_timeout
     class session_manager : public atlas::singleton<session_manager> {
     private:
 
@@ -126,6 +193,12 @@ namespace pioneer {
       session_manager(session_manager&)= delete;
       session_manager& operator=(const session_manager&)= delete;
 
+    public:
+
+      typedef session::clock clock;
+
+      const std::chrono::seconds idle_timeout = std::chrono::seconds(60);
+
     public:
 
       // TODO : make it private, and allow singleton to access it only
@@ -133,76 +206,221 @@ namespace pioneer {
 
     public:
 
-      const request_ptr& build_request(const std::string& source_ip_port, const char* data, size_t len) {
+      // return by value, the session may be removed by a worker as soon as the request is built
+      request_ptr build_request(endpoint_id source, const atlas::rpc::message::holder_type& holder,
+          const char* data, size_t len) {
         const uuid& session_id = atlas::rpc::message::get_session_id(data, len);
 
         // DLOG(INFO) << "session : " << session_id;
 
-        session_ptr s;
-        bool found = false;
-
-        // critical area
-        {
-          std::lock_guard<std::mutex> guard(_mutex);
-          auto it = _sessions.find(session_id);
-          found = (it != _sessions.end());
+        // there is a session token, but we can not find a session in this node,
+        // this means this is a request from an inner-cluster-client, we should
+        // create one session with the pass-in session id
+        bool created = false;
+        session_ptr s = _sessions.get_or_put(session_id, [&session_id, &created]() {
+          created = true;
+          return atlas::memory::make_pooled<session>(session_id);
+        });
 
-          if (found) {
-            s = it->second;
-          }
-          else {
-            // there is a session token, but we can not find a session in this node,
-            // this means this is a request from an inner-cluster-client, we should
-            // create one session with the pass-in session id
-            s.reset(new session(session_id));
-            _sessions.insert(std::make_pair(s->id(), s));
-          }
-        }
+        if (created) _idle_deadlines.add(session_id, clock::now() + idle_timeout);
 
-        s->build_request(data, len, source_ip_port);
+        s->build_request(holder, data, len, source);
 
         return s->request();
       }
 
       session_ptr get(const uuid& session_id) const {
-        std::lock_guard<std::mutex> guard(_mutex);
+        boost::optional<session_ptr> s = _sessions.get(session_id);
 
-        session_ptr s;
-        auto it = _sessions.find(session_id);
-        if (it != _sessions.end()) {
-          s = it->second;
-        }
-
-        return s;
+        return s ? *s : session_ptr();
       }
 
+      // the session is released out of the shard lock
       void remove(const uuid& session_id) {
-        std::lock_guard<std::mutex> guard(_mutex);
+        _sessions.take(session_id);
+      }
 
-        auto it = _sessions.find(session_id);
-        if(it != _sessions.end()) {
-          // if(it->second->request()->response()->is_cluster_canremove())
-          _sessions.erase(session_id);
-        }
+      // remove the sessions idle for idle_timeout, should be called periodically
+      void sweep() {
+        clock::time_point now = clock::now();
+
+        _idle_deadlines.advance(now, [this, now](const uuid& id) {
+          bool active = false;
+
+          _sessions.erase_if(id, [this, now, &active](const session_ptr& s) {
+            active = (now - s->last_active() < idle_timeout);
+            return !active;
+          });
+
+          // touched since the deadline was set, check it later
+          if (active) _idle_deadlines.add(id, now + idle_timeout);
+        });
       }
 
       size_t size() const {
-        std::lock_guard<std::mutex> guard(_mutex);
         return _sessions.size();
       }
 
       void clear() {
-        std::lock_guard<std::mutex> guard(_mutex);
         _sessions.clear();
       }
 
     private:
 
-      mutable std::mutex _mutex;
-      std::map<uuid, session_ptr> _sessions;
+      // a session is made from the pool in the section, see build_request
+      atlas::spin_sharded_box<uuid, session_ptr, atlas::uuid_hash> _sessions;
+      atlas::timer_wheel<uuid> _idle_deadlines { std::chrono::seconds(1) };
     };
 
+    inline void request::record_waits(int fn_id, int64_t receive_wait,
+        std::chrono::steady_clock::time_point dispatched) {
+      atlas::rpc::rpc_stats& stats = atlas::rpc::rpc_stats::instance();
+
+      if (receive_wait >= 0) stats.record(fn_id, atlas::rpc::stage_receive, std::chrono::nanoseconds(receive_wait));
+      stats.record(fn_id, atlas::rpc::stage_queue_wait, std::chrono::steady_clock::now() - dispatched);
+    }
+
+    inline void request::execute() noexcept {
+      record_waits();
+
+      // the caller has given it up while it's queued, nobody waits for the response
+      if (atlas::rpc::cancellations::ref().cancelled(_session_id)) {
+        session_manager::ref().remove(_session_id);
+        return;
+      }
+
+      {
+        // the arguments decoded into the arena containers are freed in one shot once the function returns
+        atlas::memory::arena_scope scope;
+
+        if (_message.header()->flags & atlas::rpc::message_compressed) {
+          // the raw body lives in the arena too
+          atlas::rpc::message raw;
+          if (frame_compression::ref().decompress(_message, &raw)) {
+            raw.set_received(_message.received());
+            run(raw, _source);
+          }
+          else {
+            LOG(ERROR) << "corrupted compressed message, fn " << _message.header()->fn_id << " from " << atlas::rpc::endpoint_to_string(_source);
+          }
+        }
+        else {
+          run(_message, _source);
+        }
+      }
+
+      session_manager::ref().remove(_session_id);
+    }
+
+    inline void request::execute_or_shed() noexcept {
+      if (system::admission_control::ref().admit(_enqueued)) execute();
+      else reject();
+    }
+
+    inline void request::reject() noexcept {
+      system::admission_control::ref().count_shed();
+
+      try {
+        shed(_message, _source);
+      }
+      catch (const std::exception& e) {
+        LOG(ERROR) << e.what();
+      }
+
+      session_manager::ref().remove(_session_id);
+    }
+
+    inline void request::run(const atlas::rpc::message& message, endpoint_id source) {
+      // the scopes of the handler are nested in it, see atlas::scope_tracer
+      ATLAS_TRACE_SCOPE("rpc/request");
+
+      const atlas::rpc::request_header* h = message.header();
+
+      // the responses to a multicast call are sent back in batches
+      if (ack_aggregator::ref().accept(source, h->return_type)) {
+        atlas::rpc::rpc_context context(h->client_id, h->return_type, h->session_id, source, message.received());
+
+        atlas::rpc::rpc_result result = atlas::rpc::dispatcher_manager::ref().dispatch(message, context);
+        if (result) {
+          atlas::rpc::rpc_stats::clock::time_point start = atlas::rpc::rpc_stats::clock::now();
+          ack_aggregator::ref().add(source, h->client_id, h->session_id, result);
+          atlas::rpc::rpc_stats::instance().record(h->fn_id, atlas::rpc::stage_respond,
+              atlas::rpc::rpc_stats::clock::now() - start);
+        }
+
+        atlas::rpc::slow_request_log::instance().check(message, source);
+      }
+      else {
+        rpc::p2p_client response_client(static_cast<rpc::client_type>(h->client_id), source);
+
+        atlas::rpc::request_coalescer& coalescer = atlas::rpc::request_coalescer::ref();
+        if (!coalescer.enabled(h->fn_id, h->return_type)) {
+          atlas::rpc::dispatcher_manager::ref().execute(response_client, message, source);
+          return;
+        }
+
+        // an identical request in flight responds for us too
+        atlas::rpc::rpc_context context(h->client_id, h->return_type, h->session_id, source, message.received());
+        bool joined = false;
+        atlas::rpc::request_coalescer::flight_ptr flight = coalescer.lead_or_join(message,
+            [context](const atlas::rpc::rpc_result& result) {
+          rpc::p2p_client client(static_cast<rpc::client_type>(context.client_id()), context.source());
+          atlas::rpc::dispatcher_manager::ref().respond(client, context, result);
+        }, joined);
+        if (joined) return;
+
+        atlas::rpc::rpc_result result(nullptr);
+        try {
+          result = atlas::rpc::dispatcher_manager::ref().execute(response_client, message, source);
+        }
+        catch (...) {
+          coalescer.land(flight, nullptr);
+          throw;
+        }
+
+        coalescer.land(flight, result);
+      }
+    }
+
+    inline void request::shed(const atlas::rpc::message& message, endpoint_id source) {
+      respond(message, source, atlas::rpc::rpc_result(std::string(), atlas::rpc::rpc_busy));
+    }
+
+    inline void request::respond(const atlas::rpc::message& message, endpoint_id source,
+        const atlas::rpc::rpc_result& result) {
+      const atlas::rpc::request_header* h = message.header();
+
+      if (ack_aggregator::ref().accept(source, h->return_type)) {
+        ack_aggregator::ref().add(source, h->client_id, h->session_id, result);
+      }
+      else {
+        atlas::rpc::rpc_context context(h->client_id, h->return_type, h->session_id, source);
+        rpc::p2p_client response_client(static_cast<rpc::client_type>(h->client_id), source);
+        atlas::rpc::dispatcher_manager::ref().respond(response_client, context, result);
+      }
+    }
+
+    // the frames relayed to this node on the overlay
+    struct overlay_receiver_binder {
+      overlay_receiver_binder() {
+        overlay::ref().set_receiver([](uint32_t origin, const std::string& frame) {
+          request::run(atlas::rpc::message(frame.data(), frame.size()), atlas::rpc::make_endpoint(origin, 0));
+        });
+      }
+    };
+
+    static overlay_receiver_binder __pioneer_overlay_receiver;
+
   } // db
+
+  namespace rpc {
+
+    // the relayed calls are data plane ones, whatever they call
+    PIONEER_RPC_PRIORITY(overlay_relay, system::fn_priorities::data_plane);
+    // the labels of a peer are known before the requests to it are routed
+    PIONEER_RPC_PRIORITY(locality_hello, 10);
+
+  } // rpc
 } // pioneer
 
 #endif /* NET_REQUEST_H_ */
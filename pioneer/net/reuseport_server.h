@@ -0,0 +1,294 @@
+/*
+ * reuseport_server.h
+ *
+ *  Created on: Sep 5, 2013
+ *      Author: vincent
+ */
+
+/*    Copyright 2011 ~ 2013 Vincent Zhang, ivincent.zhang@gmail.com
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#ifndef PIONEER_NET_REUSEPORT_SERVER_H_
+#define PIONEER_NET_REUSEPORT_SERVER_H_
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+
+#include <atomic>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <boost/bind.hpp>
+#include <glog/logging.h>
+#include <muduo/base/CountDownLatch.h>
+#include <muduo/net/Channel.h>
+#include <muduo/net/EventLoop.h>
+#include <muduo/net/EventLoopThreadPool.h>
+#include <muduo/net/InetAddress.h>
+#include <muduo/net/TcpConnection.h>
+
+// linux 3.9, the older headers miss it
+#ifndef SO_REUSEPORT
+#define SO_REUSEPORT 15
+#endif
+
+namespace pioneer {
+  namespace net {
+
+    namespace mn = muduo::net;
+
+    /*
+     * One shard of a TCP server, every loop listens on the same port with SO_REUSEPORT, and the kernel
+     * spreads the incoming connections over the listeners. Unlike the muduo TCP server, a connection lives
+     * in the loop which accepts it, it's messages are read, handled and answered in that loop, so nothing
+     * is handed over to another thread. The connections are established and destroyed as the muduo TCP server
+     * does, so the handlers work for both.
+     *
+     * Not thread safe, everything runs in the loop
+     * */
+    class reuseport_server {
+    public:
+
+      reuseport_server(mn::EventLoop* loop, const mn::InetAddress& listen_address, const std::string& name) :
+        _loop(loop), _listen_address(listen_address), _name(name), _listen_fd(-1), _next_conn_id(1)
+      {}
+
+      ~reuseport_server() {
+        if (_channel) {
+          _channel->disableAll();
+          _loop->removeChannel(_channel.get());
+        }
+
+        if (_listen_fd != -1) ::close(_listen_fd);
+
+        for (auto& v : _connections) {
+          v.second->connectDestroyed();
+        }
+      }
+
+      reuseport_server(const reuseport_server&) = delete;
+      reuseport_server& operator=(const reuseport_server&) = delete;
+
+    public:
+
+      void setConnectionCallback(const mn::ConnectionCallback& cb) { _on_connection = cb; }
+
+      void setMessageCallback(const mn::MessageCallback& cb) { _on_message = cb; }
+
+      void setWriteCompleteCallback(const mn::WriteCompleteCallback& cb) { _on_write_complete = cb; }
+
+      // must be called in the loop, return false if we can not listen, for example, the kernel has no SO_REUSEPORT
+      bool start() {
+        _listen_fd = ::socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_TCP);
+        if (_listen_fd == -1) {
+          LOG(ERROR) << strerror(errno);
+          return false;
+        }
+
+        int on = 1;
+        const sockaddr_in& addr = _listen_address.getSockAddrInet();
+        if (::setsockopt(_listen_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) == -1
+            || ::setsockopt(_listen_fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) == -1
+            || ::bind(_listen_fd, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr)) == -1
+            || ::listen(_listen_fd, SOMAXCONN) == -1) {
+          LOG(ERROR) << _name << " can not listen at " << _listen_address.toIpPort().c_str() << " : " << strerror(errno);
+
+          ::close(_listen_fd);
+          _listen_fd = -1;
+          return false;
+        }
+
+        _channel.reset(new mn::Channel(_loop, _listen_fd));
+        _channel->setReadCallback(boost::bind(&reuseport_server::on_accept, this));
+        _channel->enableReading();
+
+        return true;
+      }
+
+    private:
+
+      void on_accept() {
+        while (true) {
+          sockaddr_in peer_addr;
+          socklen_t len = sizeof(peer_addr);
+
+          int fd = ::accept4(_listen_fd, reinterpret_cast<sockaddr*>(&peer_addr), &len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+          if (fd == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) LOG(ERROR) << strerror(errno);
+            return;
+          }
+
+          sockaddr_in local_addr;
+          len = sizeof(local_addr);
+          std::memset(&local_addr, 0, sizeof(local_addr));
+          if (::getsockname(fd, reinterpret_cast<sockaddr*>(&local_addr), &len) == -1) LOG(ERROR) << strerror(errno);
+
+          mn::InetAddress peer(peer_addr);
+          mn::InetAddress local(local_addr);
+
+          // named as the muduo servers do
+          std::string conn_name = _name + ":" + _listen_address.toIpPort().c_str() + "#" + std::to_string(_next_conn_id++);
+
+          mn::TcpConnectionPtr conn(new mn::TcpConnection(_loop, conn_name.c_str(), fd, local, peer));
+          _connections[conn_name] = conn;
+
+          conn->setConnectionCallback(_on_connection);
+          conn->setMessageCallback(_on_message);
+          conn->setWriteCompleteCallback(_on_write_complete);
+          conn->setCloseCallback(boost::bind(&reuseport_server::on_close, this, _1));
+
+          conn->connectEstablished();
+        }
+      }
+
+      void on_close(const mn::TcpConnectionPtr& conn) {
+        _connections.erase(conn->name().c_str());
+        _loop->queueInLoop(boost::bind(&mn::TcpConnection::connectDestroyed, conn));
+      }
+
+    private:
+
+      mn::EventLoop* _loop;
+      mn::InetAddress _listen_address;
+      std::string _name;
+      int _listen_fd;
+      int _next_conn_id;
+
+      std::unique_ptr<mn::Channel> _channel;
+
+      mn::ConnectionCallback _on_connection;
+      mn::MessageCallback _on_message;
+      mn::WriteCompleteCallback _on_write_complete;
+
+      std::map<std::string, mn::TcpConnectionPtr> _connections;
+    };
+
+    /*
+     * A TCP server made of reuseport_server shards, one in each of it's I/O loops, in place of a muduo TCP server,
+     * which accepts in the base loop only and hands the connections over to the I/O loops round robin.
+     * A burst of connects, a reconnect storm or the full mesh of a node announcement, is accepted by all the loops
+     * at once, the kernel spreads the connections by their addresses.
+     *
+     * Made and started in the base loop as the muduo TCP server, with no I/O thread the base loop is the only shard
+     * */
+    class reuseport_group {
+    public:
+
+      typedef boost::function<void(mn::EventLoop*)> thread_init_callback;
+
+    public:
+
+      reuseport_group(mn::EventLoop* base_loop, const mn::InetAddress& listen_address, const std::string& name) :
+        _base_loop(base_loop), _listen_address(listen_address), _name(name), _thread_num(0),
+        _pool(new mn::EventLoopThreadPool(base_loop))
+      {}
+
+      // the shards are destroyed in their own loops, before the I/O threads quit
+      ~reuseport_group() {
+        for (auto& shard : _shards) {
+          mn::EventLoop* loop = shard.first;
+          reuseport_server* server = shard.second.release();
+
+          if (loop == _base_loop) {
+            delete server;
+            continue;
+          }
+
+          muduo::CountDownLatch done(1);
+          loop->runInLoop([server, &done]() {
+            delete server;
+            done.countDown();
+          });
+          done.wait();
+        }
+
+        _shards.clear();
+        _pool.reset();
+      }
+
+      reuseport_group(const reuseport_group&) = delete;
+      reuseport_group& operator=(const reuseport_group&) = delete;
+
+    public:
+
+      void setThreadNum(int n) { _thread_num = n; }
+
+      void setThreadInitCallback(const thread_init_callback& cb) { _thread_init = cb; }
+
+      void setConnectionCallback(const mn::ConnectionCallback& cb) { _on_connection = cb; }
+
+      void setMessageCallback(const mn::MessageCallback& cb) { _on_message = cb; }
+
+      void setWriteCompleteCallback(const mn::WriteCompleteCallback& cb) { _on_write_complete = cb; }
+
+      // in the base loop, return false unless every shard listens, the ones listening already keep listening
+      bool start() {
+        _pool->setThreadNum(_thread_num);
+        _pool->start(_thread_init);
+
+        std::atomic<bool> ok(true);
+        int shards = _thread_num > 0 ? _thread_num : 1;
+
+        for (int i = 0; i < shards; ++i) {
+          // round robin, every I/O loop once, or the base loop
+          mn::EventLoop* loop = _pool->getNextLoop();
+
+          std::unique_ptr<reuseport_server> server(new reuseport_server(loop, _listen_address, _name));
+          server->setConnectionCallback(_on_connection);
+          server->setMessageCallback(_on_message);
+          server->setWriteCompleteCallback(_on_write_complete);
+
+          reuseport_server* s = server.get();
+          _shards.push_back(std::make_pair(loop, std::move(server)));
+
+          muduo::CountDownLatch started(1);
+          loop->runInLoop([s, &ok, &started]() {
+            if (!s->start()) ok = false;
+            started.countDown();
+          });
+          started.wait();
+        }
+
+        if (ok) LOG(INFO) << _name << " listens in " << shards << " loops with SO_REUSEPORT";
+
+        return ok;
+      }
+
+    private:
+
+      mn::EventLoop* _base_loop;
+      mn::InetAddress _listen_address;
+      std::string _name;
+      int _thread_num;
+
+      std::unique_ptr<mn::EventLoopThreadPool> _pool;
+      std::vector<std::pair<mn::EventLoop*, std::unique_ptr<reuseport_server>>> _shards;
+
+      thread_init_callback _thread_init;
+      mn::ConnectionCallback _on_connection;
+      mn::MessageCallback _on_message;
+      mn::WriteCompleteCallback _on_write_complete;
+    };
+
+  } // net
+} // pioneer
+
+#endif /* PIONEER_NET_REUSEPORT_SERVER_H_ */
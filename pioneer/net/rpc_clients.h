@@ -24,7 +24,12 @@
 #define PIONEER_RPC_CLIENTS_H_
 
 #include <atlas/rpc/rpc.h>
+#include <pioneer/system/context.h>
 #include <pioneer/net/net.h>
+#include <pioneer/net/local_delivery.h>
+#include <pioneer/net/locality.h>
+#include <pioneer/net/mcast_dedupe.h>
+#include <pioneer/net/overlay.h>
 
 namespace pioneer {
   namespace rpc {
@@ -34,6 +39,13 @@ namespace pioneer {
 
     enum client_type { outward_client = 0x01, inward_client = 0x02, any_client = outward_client | inward_client };
 
+    // what to do if the target connection is congested
+    enum backpressure_policy {
+      bp_fail_fast, // the calls fail with rpc_backpressure immediately
+      bp_block,     // wait for the connection to drain until the deadline, and then fail
+      bp_reroute    // send to another less loaded connection, for the stateless services only
+    };
+
     class bcast_client : public atlas::rpc::remote_caller {
     public:
 
@@ -45,7 +57,7 @@ namespace pioneer {
     protected:
 
       virtual void send(const char* message, size_t sz) {
-        // TODO : employ a broadcast client
+        net::bcast_client::ref().send(message, sz);
       }
     };
 
@@ -55,37 +67,304 @@ namespace pioneer {
       mcast_client(client_type client = client_type::any_client, int response_expected = 1)
         : atlas::rpc::remote_caller(client, response_expected) {}
 
+      // to a channel instead of the cluster group, only the nodes joined the channel receive the calls
+      mcast_client(const std::string& group, client_type client = client_type::any_client, int response_expected = 1)
+        : atlas::rpc::remote_caller(client, response_expected), _group(group) {}
+
       virtual ~mcast_client() {}
 
     public:
 
       virtual void send(const char* message, size_t sz) {
-        net::mcast_client::ref().send(message, sz);
+        if (_group.empty()) {
+          // remembered before it may loop back
+          net::mcast_dedupe& dedupe = net::mcast_dedupe::ref();
+          dedupe.sent(message, sz);
+
+          net::mcast_client::ref().send(message, sz);
+
+          // this node's own copy is run in process, the one looped back is dropped, see message_handler::on_mcast_batch
+          net::local_delivery& local = net::local_delivery::ref();
+          if ((net::mcast_client::ref().reliable() || (dedupe.suppress_self() && dedupe.enabled())) && local.local(local.self())) {
+            local.deliver(message, sz);
+          }
+
+          return;
+        }
+
+        net::udp_sender* sender = net::mcast_channels::ref().get(_group);
+        if (!sender || sender->send(message, sz) == -1) reject(message, sz, atlas::rpc::rpc_unreachable);
       }
+
+    private:
+
+      std::string _group;
+    };
+
+    // builtin rpc
+    ATLAS_REGISTER_REMOTE_FUNC(overlay_relay, -11);
+
+    class overlay_rfc {
+    public:
+
+      // a frame on it's way from the origin to the target on the overlay, see net::overlay
+      static atlas::rpc::rpc_result relay(uint32_t origin, uint32_t target, int hops, const std::string& frame,
+          atlas::rpc::rpc_context c) noexcept;
     };
 
     class p2p_client : public atlas::rpc::remote_caller {
     public:
 
-      p2p_client(client_type client, const std::string& ip) : atlas::rpc::remote_caller(client), _client(client), _ip(ip) {}
+      // how long a sender waits for an inside node to reconnect
+      const std::chrono::milliseconds reconnect_wait_time = std::chrono::milliseconds(200);
+
+    public:
+
+      // ip:port, or ip for any connection to the node
+      p2p_client(client_type client, const std::string& ip) : atlas::rpc::remote_caller(client), _client(client),
+        _target(atlas::rpc::parse_endpoint(ip)), _bp_policy(bp_block), _bp_timeout(std::chrono::seconds(1)) {}
+
+      // port 0 of the target means any connection to the node
+      p2p_client(client_type client, atlas::rpc::endpoint_id target) : atlas::rpc::remote_caller(client), _client(client),
+        _target(target), _bp_policy(bp_block), _bp_timeout(std::chrono::seconds(1)) {}
 
       virtual ~p2p_client() {}
 
     public:
 
+      // the timeout is used by bp_block only
+      void set_backpressure_policy(backpressure_policy policy,
+          std::chrono::milliseconds timeout = std::chrono::milliseconds(1000)) {
+        _bp_policy = policy;
+        _bp_timeout = timeout;
+      }
+
       virtual void send(const char* message, size_t size) {
-        mn::TcpConnectionPtr conn;
+        if (local()) {
+          net::local_delivery::ref().deliver(message, size);
+          return;
+        }
+
+        net::pooled_connection_ptr conn = select(message, size);
+        if (conn) conn->send(message, size);
+      }
+
+      // the responses and the calls are built for one send, they are moved down to the connection
+      virtual void send(std::string&& message) {
+        if (local()) {
+          net::local_delivery::ref().deliver(std::move(message));
+          return;
+        }
+
+        net::pooled_connection_ptr conn = select(message.data(), message.size());
+        if (conn) conn->send(std::move(message));
+      }
+
+      // the range is written from the file by the I/O thread, see pooled_connection::send_file, the frame to this
+      // node itself, or relayed on the overlay, is sent from memory
+      virtual bool send_file(std::string&& head, const atlas::rpc::file_range& file, std::string&& tail) {
+        if (local() || net::overlay::ref().relayed(atlas::rpc::endpoint_ip(_target))) return false;
+
+        // it's dropped as any other frame would be
+        net::pooled_connection_ptr conn = select(head.data(), head.size());
+        if (!conn) return true;
+
+        return conn->send_file(std::move(head), file, std::move(tail));
+      }
+
+      // the frame in a relay call to the next hop to the target on the overlay, return false if there is no route
+      static bool forward(uint32_t origin, uint32_t target, int hops, const char* frame, size_t size);
+
+    private:
+
+      // this node itself, port 0 is the node, an outward client on this host has a port of it's own
+      bool local() const {
+        return (client_type::inward_client & _client) && atlas::rpc::endpoint_port(_target) == 0
+            && net::local_delivery::ref().local(atlas::rpc::endpoint_ip(_target));
+      }
+
+      // the connection to send the message to, or nullptr if the message is rejected
+      net::pooled_connection_ptr select(const char* message, size_t size) {
+        net::pooled_connection_ptr conn;
 
         if (!conn && (client_type::inward_client & _client)) {
-          conn = net::inward_connection_pool::ref().take(_ip);
+          conn = get(net::inward_connection_pool::ref());
+
+          // an inside node which is not a neighbor is reached through one, see net::overlay
+          uint32_t target = atlas::rpc::endpoint_ip(_target);
+          if (!conn && net::overlay::ref().relayed(target)) {
+            net::overlay& o = net::overlay::ref();
+            if (forward(o.self(), target, net::overlay::max_hops, message, size)) o.on_relayed();
+            else reject(message, size, atlas::rpc::rpc_unreachable);
+
+            return nullptr;
+          }
+
+          // the connection may be waiting for reconnecting, try it now, and queue for a while
+          if (!conn && atlas::rpc::endpoint_port(_target)) {
+            net::inward_client_pool::ref().reconnect_now(_target);
+            conn = net::inward_connection_pool::ref().get(_target, reconnect_wait_time);
+          }
         }
 
         if (!conn && (client_type::outward_client & _client)) {
-          conn = net::outward_connection_pool::ref().take(_ip);
+          conn = get(net::outward_connection_pool::ref());
+        }
+
+        if (!conn) {
+          LOG(ERROR) << "no connection for " << atlas::rpc::endpoint_to_string(_target);
+          reject(message, size, atlas::rpc::rpc_unreachable);
+          return nullptr;
+        }
+
+        if (conn->congested() && !relieve(conn)) {
+          LOG(WARNING) << "drop " << size << " bytes to " << atlas::rpc::endpoint_to_string(_target)
+              << ", the connection is congested";
+          reject(message, size, atlas::rpc::rpc_backpressure);
+          return nullptr;
+        }
+
+        return conn;
+      }
+
+      // from the sending thread's cache, no pool lock while the connections do not change
+      template<typename pool_type>
+      net::pooled_connection_ptr get(pool_type& pool) {
+        if (atlas::rpc::endpoint_port(_target) == 0) return pool.cached_get_by_ip(atlas::rpc::endpoint_ip(_target));
+
+        return pool.cached_get(_target);
+      }
+
+      // apply the backpressure policy, return false if we can not send, conn may be replaced by another one
+      bool relieve(net::pooled_connection_ptr& conn) {
+        if (_bp_policy == bp_block) return conn->wait_writable(_bp_timeout);
+
+        if (_bp_policy == bp_reroute) {
+          net::pooled_connection_ptr other;
+
+          if (client_type::inward_client & _client) other = net::nearest_inward_get();
+          if ((!other || other->congested()) && (client_type::outward_client & _client)) {
+            other = net::outward_connection_pool::ref().random_get();
+          }
+
+          if (!other || other->congested()) return false;
+
+          conn = other;
+          return true;
+        }
+
+        return false;
+      }
+
+    private:
+
+      int _client;
+      atlas::rpc::endpoint_id _target;
+
+      backpressure_policy _bp_policy;
+      std::chrono::milliseconds _bp_timeout;
+    };
+
+    inline bool p2p_client::forward(uint32_t origin, uint32_t target, int hops, const char* frame, size_t size) {
+      uint32_t hop = net::overlay::ref().next_hop(target);
+
+      net::pooled_connection_ptr conn = hop ? net::inward_connection_pool::ref().cached_get_by_ip(hop) : nullptr;
+      if (!conn) return false;
+
+      atlas::rpc::message_builder builder(inward_client);
+      conn->send(builder.build(overlay_rfc::relay, fn_ids::overlay_relay, origin, target, hops,
+          std::string(frame, size), atlas::rpc::nilctx));
+
+      return true;
+    }
+
+    // passed on to the next hop, or run here as if it came from the origin, so the response is relayed back
+    inline atlas::rpc::rpc_result overlay_rfc::relay(uint32_t origin, uint32_t target, int hops,
+        const std::string& frame, atlas::rpc::rpc_context c) noexcept {
+      net::overlay& o = net::overlay::ref();
+
+      if (target != o.self()) {
+        if (hops <= 1 || !p2p_client::forward(origin, target, hops - 1, frame.data(), frame.size())) {
+          LOG(WARNING) << "drop a frame relayed from " << atlas::rpc::ip_to_string(origin) << " to "
+              << atlas::rpc::ip_to_string(target) << ", " << (hops <= 1 ? "too many hops" : "no route");
+          return nullptr;
         }
 
+        o.on_forwarded();
+        return nullptr;
+      }
+
+      if (!o.receiver() || frame.size() < sizeof(atlas::rpc::request_header)
+          || !atlas::rpc::message::known_version(frame.data(), frame.size())) {
+        LOG(ERROR) << "drop a frame relayed from " << atlas::rpc::ip_to_string(origin);
+        return nullptr;
+      }
+
+      try {
+        o.receiver()(origin, frame);
+      }
+      catch (const std::exception& e) {
+        LOG(ERROR) << e.what();
+      }
+
+      return nullptr;
+    }
+
+    ATLAS_BIND_REMOTE_FUNC(overlay_relay, overlay_rfc::relay);
+
+    // builtin rpc
+    ATLAS_REGISTER_REMOTE_FUNC(locality_hello, -13);
+
+    class locality_rfc {
+    public:
+
+      // a node tells the zone and the rack of it's own to the node it connects to, see net::locality
+      static atlas::rpc::rpc_result hello(const std::string& zone, const std::string& rack, atlas::rpc::rpc_context c) noexcept {
+        net::locality::ref().set(atlas::rpc::endpoint_ip(c.source()), zone, rack);
+        return nullptr;
+      }
+
+      // in the connection callback, once an inside node is connected
+      static void tell(const std::string& ip) {
+        const net::node_labels& self = net::locality::ref().self();
+
+        p2p_client client(inward_client, ip);
+        client.set_backpressure_policy(bp_fail_fast);
+        client.call(hello, fn_ids::locality_hello, self.zone, self.rack, atlas::rpc::nilctx);
+      }
+    };
+
+    ATLAS_BIND_REMOTE_FUNC(locality_hello, locality_rfc::hello);
+
+    // select the inside node by the key on the consistent hash ring, so the requests with the same key
+    // always go to the same node while the cluster membership does not change
+    // for example, we need to send the requests for a cache entry to the node caches it
+    class hash_client : public atlas::rpc::remote_caller {
+    public:
+
+      hash_client(const std::string& key) : atlas::rpc::remote_caller(client_type::inward_client), _key(key) {}
+
+      virtual ~hash_client() {}
+
+    public:
+
+      virtual void send(const char* message, size_t size) {
+        boost::optional<std::string> ip = system::context::inside_nodes.get()->ring.find(_key);
+
+        if (!ip) {
+          LOG(ERROR) << "no inside node for key " << _key;
+          return;
+        }
+
+        // the key is this node's own
+        if (net::local_delivery::ref().local(atlas::rpc::endpoint_ip(atlas::rpc::parse_endpoint(*ip)))) {
+          net::local_delivery::ref().deliver(message, size);
+          return;
+        }
+
+        net::pooled_connection_ptr conn = net::inward_connection_pool::ref().cached_get_by_ip(*ip);
         if (!conn) {
-          LOG(ERROR) << "no connection for " << _ip;
+          LOG(ERROR) << "no connection for " << *ip;
           return;
         }
 
@@ -94,8 +373,7 @@ namespace pioneer {
 
     private:
 
-      int _client;
-      std::string _ip;
+      std::string _key;
     };
 
     // random select a connection in the connection pool to send message
@@ -109,18 +387,25 @@ namespace pioneer {
     public:
 
       virtual void send(const char* message, size_t size) {
-        mn::TcpConnectionPtr conn;
+        net::pooled_connection_ptr conn;
 
         if (client_type::inward_client & _client_id) {
-          conn = net::inward_connection_pool::ref().random_take();
+          conn = net::nearest_inward_get();
         }
 
         if (!conn && (client_type::outward_client & _client_id)) {
-          conn = net::outward_connection_pool::ref().random_take();
+          conn = net::outward_connection_pool::ref().random_get();
         }
 
         if (!conn) {
           LOG(ERROR) << "no connection";
+          reject(message, size, atlas::rpc::rpc_unreachable);
+          return;
+        }
+
+        // the less loaded one of two random choices is congested, the cluster is overloaded
+        if (conn->congested()) {
+          reject(message, size, atlas::rpc::rpc_backpressure);
           return;
         }
 
@@ -0,0 +1,489 @@
+/*
+ * rpc_stream.h
+ *
+ *  Created on: Sep 25, 2013
+ *      Author: vincent
+ */
+
+/*    Copyright 2011 ~ 2013 Vincent Zhang, ivincent.zhang@gmail.com
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#ifndef PIONEER_NET_RPC_STREAM_H_
+#define PIONEER_NET_RPC_STREAM_H_
+
+#include <atomic>
+#include <chrono>
+#include <exception>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <boost/serialization/string.hpp>
+#include <glog/logging.h>
+#include <atlas/singleton.h>
+#include <atlas/rpc.h>
+#include <atlas/container/sharded_concurrent_box.h>
+
+#include <pioneer/system/thread_pool.h>
+#include <pioneer/net/rpc_clients.h>
+
+namespace pioneer {
+  namespace net {
+
+    /*
+     * The streaming calls, the result of a server streaming call, or the argument of a client streaming call,
+     * is a sequence of chunks sent one by one over the connections of the call, so neither side holds all of it.
+     *
+     * A stream is the session id of a call made by remote_caller::stream_call, the chunks and the credits go
+     * by two builtin calls, stream_chunk and stream_credit. The consumer grants the producer a window of chunks
+     * and more as it consumes them, half a window at a time, so at most a window is in flight, and a producer
+     * faster than it's consumer waits without holding anything.
+     *
+     * The producer is pulled, a function which fills the next chunk, it's called in the worker threads, as the
+     * credits arrive, never in two threads at the same time. The consumer is called with the chunks in order
+     * in the control threads, it should be fast, the chunks which overtake the others are held until their turn.
+     *
+     * A server streaming call :
+     *    the caller : rpc_streams::ref().read(client, consumer, f, fn_id, args...)
+     *    the handler of f : rpc_streams::ref().serve(c, producer), and return nullptr
+     * A client streaming call :
+     *    the caller : rpc_future future = rpc_streams::ref().write(client, producer, f, fn_id, args...)
+     *    the handler of f : rpc_streams::ref().accept(c, consumer), and return nullptr, the consumer calls
+     *      rpc_streams::respond(c, result) after the last chunk, the future gets the result
+     *
+     * A stream which moves nothing for the idle timeout is dropped, the consumer gets rpc_timed_out, so the
+     * streams of a peer gone or a call shed are not kept forever
+     * */
+    class rpc_streams : public atlas::singleton<rpc_streams> {
+    public:
+
+      typedef std::chrono::steady_clock clock;
+      typedef atlas::rpc::uuid uuid;
+      typedef atlas::rpc::endpoint_id endpoint_id;
+      typedef atlas::rpc::rpc_context rpc_context;
+      typedef atlas::rpc::rpc_result rpc_result;
+
+      // fill the chunk and return true, or return false once there is no more, an exception aborts the stream
+      typedef std::function<bool(std::string& chunk)> producer_type;
+      // the chunks in order, the last call has last set, with rpc_success if the stream is complete,
+      // the chunk of the last call is empty
+      typedef std::function<void(const std::string& chunk, bool last, int ec)> consumer_type;
+
+      // the chunks in flight of a stream
+      static const uint32_t window = 16;
+
+    private:
+
+      friend class atlas::singleton<rpc_streams>;
+      rpc_streams(const rpc_streams&) = delete;
+      rpc_streams& operator=(const rpc_streams&) = delete;
+
+    public:
+
+      // public for std::make_shared, see atlas::singleton
+      rpc_streams() : _idle_timeout(std::chrono::seconds(30)), _chunks_sent(0), _chunks_received(0), _aborted(0) {}
+
+    public:
+
+      void set_idle_timeout(clock::duration timeout) { _idle_timeout = timeout; }
+
+      /*
+       * The caller of a server streaming call, the consumer is registered before the call is sent. If the callee
+       * responds instead of streaming, a shed call for example, the consumer ends with the error
+       * */
+      template<typename Caller, typename Functor, typename ... Args>
+      void read(Caller& caller, consumer_type consumer, Functor f, int fn_id, Args ... args) {
+        std::chrono::milliseconds timeout = caller.timeout();
+
+        caller.stream_call(f, fn_id, [this, consumer, timeout](const uuid& id) {
+          open_sink(id, consumer, 0, atlas::rpc::nil_endpoint)->awaited = true;
+
+          atlas::rpc::sync_task_manager::ref().suspend(id, timeout).then([this, id](const rpc_result& r) {
+            if (r.err() != atlas::rpc::rpc_success && r.err() != atlas::rpc::rpc_timed_out) abort_sink(id, r.err());
+          });
+        }, std::forward<Args>(args)...);
+      }
+
+      /*
+       * The caller of a client streaming call, the producer is pumped once the callee accepts the stream, the
+       * future gets the response of the callee, within the timeout of the caller
+       * */
+      template<typename Caller, typename Functor, typename ... Args>
+      atlas::rpc::rpc_future write(Caller& caller, producer_type producer, Functor f, int fn_id, Args ... args) {
+        atlas::rpc::rpc_future future;
+        std::chrono::milliseconds timeout = caller.timeout();
+
+        caller.stream_call(f, fn_id, [this, producer, timeout, &future](const uuid& id) {
+          // no peer and no credits until the callee accepts, see on_credit
+          open_source(id, producer, 0, 0, atlas::rpc::nil_endpoint);
+          future = atlas::rpc::sync_task_manager::ref().suspend(id, timeout);
+        }, std::forward<Args>(args)...);
+
+        return future;
+      }
+
+      // the handler of a server streaming call, the first window is pumped in the calling thread
+      void serve(const rpc_context& c, producer_type producer) {
+        pump(open_source(c.session_id(), producer, window, c.client_id(), c.source()));
+      }
+
+      // the handler of a client streaming call
+      void accept(const rpc_context& c, consumer_type consumer) {
+        open_sink(c.session_id(), consumer, c.client_id(), c.source());
+        send_credit(c.client_id(), c.source(), c.session_id(), window, false);
+      }
+
+      // the response to a client streaming call, once the last chunk is consumed
+      static void respond(const rpc_context& c, const rpc_result& result) {
+        rpc::p2p_client client(static_cast<rpc::client_type>(c.client_id()), c.source());
+        atlas::rpc::dispatcher_manager::ref().respond(client, c, result);
+      }
+
+      // the builtin stream_chunk, in a control thread
+      void on_chunk(const uuid& id, uint64_t seq, const std::string& data, bool last, int ec, const rpc_context& c) {
+        _chunks_received.fetch_add(1, std::memory_order_relaxed);
+
+        boost::optional<sink_ptr> s = _sinks.get(id);
+        if (!s) {
+          // cancelled or timed out already, stop the producer
+          if (!last) send_credit(c.client_id(), c.source(), id, 0, true);
+          return;
+        }
+
+        receive(*s, seq, data, last, ec, c);
+      }
+
+      // the builtin stream_credit, in a control thread, the pump goes to the worker threads
+      void on_credit(const uuid& id, uint32_t credits, bool cancel, const rpc_context& c) {
+        boost::optional<source_ptr> s = _sources.get(id);
+        if (!s) return;
+
+        source_ptr source = *s;
+        {
+          std::lock_guard<std::mutex> guard(source->mutex);
+
+          source->touch();
+          if (source->peer == atlas::rpc::nil_endpoint) {
+            source->client = c.client_id();
+            source->peer = c.source();
+          }
+
+          if (cancel) source->done = true;
+          else source->credits += credits;
+
+          if (source->pumping) return;
+        }
+
+        if (cancel) {
+          close_source(id);
+          return;
+        }
+
+        if (!system::worker_pool::ref().schedule([this, source]() { pump(source); })) pump(source);
+      }
+
+      // drop the streams idle for too long, in any thread
+      void sweep() {
+        int64_t deadline = (clock::now() - _idle_timeout).time_since_epoch().count();
+
+        std::vector<uuid> expired;
+        _sources.for_each([&expired, deadline](const std::pair<const uuid, source_ptr>& e) {
+          if (e.second->last_active.load(std::memory_order_relaxed) < deadline) expired.push_back(e.first);
+        });
+        for (const uuid& id : expired) {
+          LOG(WARNING) << "stream " << id << " is not consumed for too long, drop it";
+          close_source(id);
+        }
+
+        expired.clear();
+        _sinks.for_each([&expired, deadline](const std::pair<const uuid, sink_ptr>& e) {
+          if (e.second->last_active.load(std::memory_order_relaxed) < deadline) expired.push_back(e.first);
+        });
+        for (const uuid& id : expired) {
+          LOG(WARNING) << "stream " << id << " receives nothing for too long, drop it";
+          abort_sink(id, atlas::rpc::rpc_timed_out);
+        }
+      }
+
+      size_t sources() const { return _sources.size(); }
+      size_t sinks() const { return _sinks.size(); }
+
+      unsigned long long chunks_sent() const { return _chunks_sent.load(std::memory_order_relaxed); }
+      unsigned long long chunks_received() const { return _chunks_received.load(std::memory_order_relaxed); }
+      // the streams which end with an error, on either side
+      unsigned long long aborted() const { return _aborted.load(std::memory_order_relaxed); }
+
+    private:
+
+      struct stream {
+        stream(const uuid& id, int client, endpoint_id peer) :
+          id(id), client(client), peer(peer), done(false), last_active(0) { touch(); }
+
+        void touch() { last_active.store(clock::now().time_since_epoch().count(), std::memory_order_relaxed); }
+
+        const uuid id;
+        std::mutex mutex;
+        // the peer is learned from it's first message if it's not known when the stream is opened
+        int client;
+        endpoint_id peer;
+        bool done;
+        // the steady clock ticks of the last chunk or credit
+        std::atomic<int64_t> last_active;
+      };
+
+      struct source : public stream {
+        source(const uuid& id, producer_type producer, uint32_t credits, int client, endpoint_id peer) :
+          stream(id, client, peer), producer(producer), credits(credits), seq(0), pumping(false) {}
+
+        producer_type producer;
+        uint32_t credits;
+        // touched by the pumping thread only
+        uint64_t seq;
+        bool pumping;
+      };
+
+      struct chunk {
+        std::string data;
+        bool last;
+        int ec;
+      };
+
+      struct sink : public stream {
+        sink(const uuid& id, consumer_type consumer, int client, endpoint_id peer) :
+          stream(id, client, peer), consumer(consumer), awaited(false), next(0), consumed(0) {}
+
+        consumer_type consumer;
+        // the sink of a read, a future waits for the response of the callee
+        bool awaited;
+        uint64_t next;
+        // since the last grant
+        uint32_t consumed;
+        // the chunks ahead of next, at most a window of them
+        std::map<uint64_t, chunk> pending;
+      };
+
+      typedef std::shared_ptr<source> source_ptr;
+      typedef std::shared_ptr<sink> sink_ptr;
+
+      source_ptr open_source(const uuid& id, producer_type producer, uint32_t credits, int client, endpoint_id peer) {
+        source_ptr s = std::make_shared<source>(id, producer, credits, client, peer);
+        _sources.put(id, s);
+        return s;
+      }
+
+      sink_ptr open_sink(const uuid& id, consumer_type consumer, int client, endpoint_id peer) {
+        sink_ptr s = std::make_shared<sink>(id, consumer, client, peer);
+        _sinks.put(id, s);
+        return s;
+      }
+
+      void close_source(const uuid& id) { _sources.erase(id); }
+
+      // send chunks while there are credits, by one thread at a time
+      void pump(const source_ptr& s) {
+        {
+          std::lock_guard<std::mutex> guard(s->mutex);
+          if (s->pumping || s->done || !s->credits || s->peer == atlas::rpc::nil_endpoint) return;
+          s->pumping = true;
+        }
+
+        rpc::p2p_client client(static_cast<rpc::client_type>(s->client), s->peer);
+
+        for (;;) {
+          std::string data;
+          bool more = false;
+          int ec = atlas::rpc::rpc_success;
+
+          try {
+            more = s->producer(data);
+          }
+          catch (const std::exception& e) {
+            LOG(ERROR) << "stream " << s->id << " aborted, " << e.what();
+            _aborted.fetch_add(1, std::memory_order_relaxed);
+            ec = atlas::rpc::rpc_stream_aborted;
+          }
+
+          if (!more) data.clear();
+          send_chunk(client, s->id, s->seq++, data, !more, ec);
+
+          std::lock_guard<std::mutex> guard(s->mutex);
+          s->touch();
+
+          if (!more || s->done) {
+            s->done = true;
+            s->pumping = false;
+            break;
+          }
+
+          if (--s->credits == 0) {
+            s->pumping = false;
+            return;
+          }
+        }
+
+        if (s->done) close_source(s->id);
+      }
+
+      // deliver the chunks in order, and grant more once half a window is consumed
+      void receive(const sink_ptr& s, uint64_t seq, const std::string& data, bool last, int ec, const rpc_context& c) {
+        uint32_t grant = 0;
+        bool ended = false, cancel = false;
+        int end_ec = atlas::rpc::rpc_success;
+
+        {
+          std::lock_guard<std::mutex> guard(s->mutex);
+          if (s->done) return;
+
+          s->touch();
+          if (s->peer == atlas::rpc::nil_endpoint) {
+            s->client = c.client_id();
+            s->peer = c.source();
+          }
+
+          if (seq != s->next) {
+            // a producer never runs more than a window ahead
+            if (seq < s->next || s->pending.size() >= window) {
+              LOG(ERROR) << "stream " << s->id << " gets chunk " << seq << " while it waits for " << s->next;
+              ended = cancel = true;
+              end_ec = atlas::rpc::rpc_stream_aborted;
+              s->done = true;
+              s->consumer(std::string(), true, end_ec);
+            }
+            else {
+              s->pending[seq] = chunk { data, last, ec };
+              return;
+            }
+          }
+          else {
+            s->consumer(data, last, ec);
+            ++s->next;
+            ++s->consumed;
+            ended = last;
+            end_ec = ec;
+
+            for (auto it = s->pending.begin(); !ended && it != s->pending.end() && it->first == s->next; ) {
+              s->consumer(it->second.data, it->second.last, it->second.ec);
+              ++s->next;
+              ++s->consumed;
+              ended = it->second.last;
+              end_ec = it->second.ec;
+              it = s->pending.erase(it);
+            }
+
+            if (ended) s->done = true;
+            else if (s->consumed >= window / 2) {
+              grant = s->consumed;
+              s->consumed = 0;
+            }
+          }
+        }
+
+        if (grant || cancel) send_credit(s->client, s->peer, s->id, grant, cancel);
+        if (ended) end_sink(s, end_ec);
+      }
+
+      // the end of a sink which is not done yet, the consumer is told
+      void abort_sink(const uuid& id, int ec) {
+        boost::optional<sink_ptr> s = _sinks.get(id);
+        if (!s) return;
+
+        {
+          std::lock_guard<std::mutex> guard((*s)->mutex);
+          if ((*s)->done) return;
+
+          (*s)->done = true;
+          (*s)->consumer(std::string(), true, ec);
+        }
+
+        if ((*s)->peer != atlas::rpc::nil_endpoint) send_credit((*s)->client, (*s)->peer, id, 0, true);
+        end_sink(*s, ec);
+      }
+
+      void end_sink(const sink_ptr& s, int ec) {
+        if (ec != atlas::rpc::rpc_success) _aborted.fetch_add(1, std::memory_order_relaxed);
+
+        _sinks.erase(s->id);
+        if (s->awaited) atlas::rpc::sync_task_manager::ref().resume(s->id, std::string(), atlas::rpc::rpc_success);
+      }
+
+      // defined after the builtin calls
+      void send_chunk(rpc::p2p_client& client, const uuid& id, uint64_t seq, const std::string& data, bool last, int ec);
+      void send_credit(int client, endpoint_id peer, const uuid& id, uint32_t credits, bool cancel);
+
+    private:
+
+      clock::duration _idle_timeout;
+
+      atlas::sharded_concurrent_box<uuid, source_ptr, atlas::uuid_hash> _sources;
+      atlas::sharded_concurrent_box<uuid, sink_ptr, atlas::uuid_hash> _sinks;
+
+      std::atomic<unsigned long long> _chunks_sent;
+      std::atomic<unsigned long long> _chunks_received;
+      std::atomic<unsigned long long> _aborted;
+    };
+
+  } // net
+
+  namespace rpc {
+
+    using atlas::rpc::rpc_result;
+    using atlas::rpc::rpc_context;
+
+    // builtin rpc
+    ATLAS_REGISTER_REMOTE_FUNC(stream_chunk, -6);
+    ATLAS_REGISTER_REMOTE_FUNC(stream_credit, -7);
+
+    class rpc_stream_rfc {
+    public:
+
+      // a producer sends us the next chunk of a stream
+      static rpc_result chunk(const atlas::rpc::uuid& id, uint64_t seq, const std::string& data, bool last, int ec,
+          rpc_context c) noexcept {
+        net::rpc_streams::ref().on_chunk(id, seq, data, last, ec, c);
+        return nullptr;
+      }
+
+      // a consumer grants us more chunks of a stream, or cancels it
+      static rpc_result credit(const atlas::rpc::uuid& id, uint32_t credits, bool cancel, rpc_context c) noexcept {
+        net::rpc_streams::ref().on_credit(id, credits, cancel, c);
+        return nullptr;
+      }
+    };
+
+    ATLAS_BIND_REMOTE_FUNC(stream_chunk, rpc_stream_rfc::chunk);
+    ATLAS_BIND_REMOTE_FUNC(stream_credit, rpc_stream_rfc::credit);
+
+  } // rpc
+
+  namespace net {
+
+    inline void rpc_streams::send_chunk(rpc::p2p_client& client, const uuid& id, uint64_t seq, const std::string& data,
+        bool last, int ec) {
+      client.call(rpc::rpc_stream_rfc::chunk, rpc::fn_ids::stream_chunk, id, seq, data, last, ec, atlas::rpc::nilctx);
+      _chunks_sent.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    inline void rpc_streams::send_credit(int client, endpoint_id peer, const uuid& id, uint32_t credits, bool cancel) {
+      rpc::p2p_client caller(static_cast<rpc::client_type>(client), peer);
+      caller.call(rpc::rpc_stream_rfc::credit, rpc::fn_ids::stream_credit, id, credits, cancel, atlas::rpc::nilctx);
+    }
+
+  } // net
+} // pioneer
+
+#endif /* PIONEER_NET_RPC_STREAM_H_ */
@@ -0,0 +1,211 @@
+/*
+ * rx_timestamps.h
+ *
+ *  Created on: Sep 28, 2013
+ *      Author: vincent
+ */
+
+/*    Copyright 2011 ~ 2013 Vincent Zhang, ivincent.zhang@gmail.com
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#ifndef PIONEER_NET_RX_TIMESTAMPS_H_
+#define PIONEER_NET_RX_TIMESTAMPS_H_
+
+#include <sys/socket.h>
+#include <linux/net_tstamp.h>
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+
+#include <atomic>
+#include <chrono>
+#include <sstream>
+#include <string>
+
+#include <glog/logging.h>
+
+#include <atlas/singleton.h>
+
+// linux 2.6.30, the older headers miss it
+#ifndef SO_TIMESTAMPING
+#define SO_TIMESTAMPING 37
+#endif
+#ifndef SCM_TIMESTAMPING
+#define SCM_TIMESTAMPING SO_TIMESTAMPING
+#endif
+
+namespace pioneer {
+  namespace net {
+
+    /*
+     * The receive timestamps of the kernel, SO_TIMESTAMPING, so the latency of a request is split into the time
+     * from it's arrival to it's dispatch by the I/O loop, the wait in the worker pool and the execution, see
+     * atlas::rpc::stage_receive.
+     *
+     * The modes :
+     *  off : nothing is stamped by the kernel
+     *  software : the kernel stamps the packets once the driver hands them over, in CLOCK_REALTIME
+     *  hardware : the NIC stamps them, the interface must have it's receive stamping turned on, for example by
+     *    hwstamp_ctl, and it's clock synced to the system's one, by phc2sys, the software stamps are taken for the
+     *    packets the NIC does not stamp
+     *
+     * The stamps come with the control messages of recvmsg, so the multicast socket, which is read by recvmmsg, is
+     * stamped. The TCP connections are read by muduo with readv, which drops the control messages, their requests
+     * take the time the loop wakes up for the read instead, so their receive stage is the time the loop spends on
+     * the read before it's dispatched, the frames before it included.
+     *
+     * The stamp of the read being handled is kept by the loop thread, see rx_time_scope, the requests built during
+     * it take it, in nanoseconds since the epoch, 0 if unknown
+     * */
+    class rx_timestamps : public atlas::singleton<rx_timestamps> {
+    public:
+
+      enum mode { off = 0, software, hardware };
+
+      // the room of the control messages of a datagram
+      static const size_t control_size = CMSG_SPACE(3 * sizeof(timespec));
+
+    private:
+
+      friend class atlas::singleton<rx_timestamps>;
+      rx_timestamps(const rx_timestamps&) = delete;
+      rx_timestamps& operator=(const rx_timestamps&) = delete;
+
+    public:
+
+      // public for std::make_shared, see atlas::singleton
+      rx_timestamps() : _mode(off), _stamped(0), _unstamped(0) {}
+
+    public:
+
+      // before the servers start, false if the name is unknown
+      bool configure(const std::string& name) {
+        if (name == "off") _mode = off;
+        else if (name == "software") _mode = software;
+        else if (name == "hardware") _mode = hardware;
+        else return false;
+
+        return true;
+      }
+
+      bool enabled() const { return _mode != off; }
+
+      mode get_mode() const { return _mode; }
+
+      // the socket's datagrams are stamped from now on, false if it's off or the kernel refuses
+      bool enable(int fd) const {
+        if (!enabled()) return false;
+
+        int flags = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE;
+        if (_mode == hardware) flags |= SOF_TIMESTAMPING_RX_HARDWARE | SOF_TIMESTAMPING_RAW_HARDWARE;
+
+        if (::setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags)) == 0) return true;
+
+        static std::atomic<bool> warned(false);
+        if (!warned.exchange(true)) LOG(WARNING) << "can not set SO_TIMESTAMPING : " << strerror(errno);
+
+        return false;
+      }
+
+      // the stamp of a received datagram, the hardware one if any, 0 if there is none
+      int64_t read(const msghdr& h) {
+        for (cmsghdr* c = CMSG_FIRSTHDR(const_cast<msghdr*>(&h)); c; c = CMSG_NXTHDR(const_cast<msghdr*>(&h), c)) {
+          if (c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_TIMESTAMPING) continue;
+
+          // the software stamp, the legacy one, and the raw hardware one
+          timespec ts[3];
+          std::memcpy(ts, CMSG_DATA(c), sizeof(ts));
+
+          int64_t stamp = nanoseconds(ts[2]);
+          if (!stamp) stamp = nanoseconds(ts[0]);
+
+          if (stamp) {
+            _stamped.fetch_add(1, std::memory_order_relaxed);
+            return stamp;
+          }
+        }
+
+        _unstamped.fetch_add(1, std::memory_order_relaxed);
+        return 0;
+      }
+
+      unsigned long long stamped() const { return _stamped.load(std::memory_order_relaxed); }
+
+      unsigned long long unstamped() const { return _unstamped.load(std::memory_order_relaxed); }
+
+      static int64_t now() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+      }
+
+      // the nanoseconds from the stamp to now, -1 if it's not stamped
+      static int64_t since(int64_t stamp) {
+        if (!stamp) return -1;
+
+        int64_t d = now() - stamp;
+        return d > 0 ? d : 0;
+      }
+
+      // the stamp of the read the calling loop thread handles, see rx_time_scope
+      static int64_t& current() {
+        static __thread int64_t stamp = 0;
+        return stamp;
+      }
+
+      std::string str() const {
+        static const char* names[] = { "off", "software", "hardware" };
+
+        std::ostringstream os;
+        os << "mode : " << names[_mode] << "\n"
+            << "stamped datagrams : " << stamped() << "\n"
+            << "unstamped datagrams : " << unstamped() << "\n";
+
+        return os.str();
+      }
+
+    private:
+
+      static int64_t nanoseconds(const timespec& ts) {
+        return static_cast<int64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+      }
+
+    private:
+
+      mode _mode;
+
+      std::atomic<unsigned long long> _stamped;
+      std::atomic<unsigned long long> _unstamped;
+    };
+
+    // the requests built by the loop thread in the scope were received at the stamp, in nanoseconds since the epoch
+    class rx_time_scope {
+    public:
+
+      explicit rx_time_scope(int64_t stamp) : _saved(rx_timestamps::current()) { rx_timestamps::current() = stamp; }
+
+      ~rx_time_scope() { rx_timestamps::current() = _saved; }
+
+      rx_time_scope(const rx_time_scope&) = delete;
+      rx_time_scope& operator=(const rx_time_scope&) = delete;
+
+    private:
+
+      int64_t _saved;
+    };
+
+  } // net
+} // pioneer
+
+#endif /* PIONEER_NET_RX_TIMESTAMPS_H_ */
@@ -0,0 +1,174 @@
+/*
+ * socket_profile.h
+ *
+ *  Created on: Sep 21, 2013
+ *      Author: vincent
+ */
+
+/*    Copyright 2011 ~ 2013 Vincent Zhang, ivincent.zhang@gmail.com
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#ifndef PIONEER_NET_SOCKET_PROFILE_H_
+#define PIONEER_NET_SOCKET_PROFILE_H_
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <cerrno>
+#include <cstring>
+
+#include <atomic>
+#include <string>
+
+#include <glog/logging.h>
+
+#include <atlas/singleton.h>
+
+// linux 3.11, the older headers miss it
+#ifndef SO_BUSY_POLL
+#define SO_BUSY_POLL 46
+#endif
+
+namespace pioneer {
+  namespace net {
+
+    /*
+     * The options of the TCP sockets of a server, applied when a connection comes up, see connection_handler.
+     *
+     * The kernel defaults leave Nagle on, so a small response waits for the ACK of the previous one, which the
+     * peer delays for up to 40ms. The named profiles :
+     *
+     *  default : the kernel defaults
+     *  latency : TCP_NODELAY, TCP_QUICKACK re-armed after every read, since the kernel clears it, and keepalive
+     *  busy_poll : latency, and the socket busy polls the device queue for 50us on a blocking read, needs
+     *    CAP_NET_ADMIN to raise it above net.core.busy_read
+     *  throughput : Nagle on, 4MB send and receive buffers, and keepalive
+     *
+     * A buffer size set on an established connection does not change the window scale negotiated already,
+     * it still caps the memory the kernel takes for the connection.
+     * The local socket connections are not TCP, they are left alone
+     * */
+    struct socket_profile {
+      socket_profile() : nodelay(false), quickack(false), busy_poll(0), send_buffer(0), receive_buffer(0), keepalive(false) {}
+
+      static bool named(const std::string& name, socket_profile* profile) {
+        socket_profile p;
+
+        if (name == "default") {}
+        else if (name == "latency" || name == "busy_poll") {
+          p.nodelay = true;
+          p.quickack = true;
+          p.keepalive = true;
+          if (name == "busy_poll") p.busy_poll = 50;
+        }
+        else if (name == "throughput") {
+          p.send_buffer = 4 * 1024 * 1024;
+          p.receive_buffer = 4 * 1024 * 1024;
+          p.keepalive = true;
+        }
+        else {
+          return false;
+        }
+
+        *profile = p;
+        return true;
+      }
+
+      // once a connection comes up
+      void apply(int fd) const {
+        if (!is_tcp(fd)) return;
+
+        if (nodelay) set<IPPROTO_TCP, TCP_NODELAY>(fd, 1, "TCP_NODELAY");
+        if (quickack) set<IPPROTO_TCP, TCP_QUICKACK>(fd, 1, "TCP_QUICKACK");
+        if (busy_poll) set<SOL_SOCKET, SO_BUSY_POLL>(fd, busy_poll, "SO_BUSY_POLL");
+        if (send_buffer) set<SOL_SOCKET, SO_SNDBUF>(fd, send_buffer, "SO_SNDBUF");
+        if (receive_buffer) set<SOL_SOCKET, SO_RCVBUF>(fd, receive_buffer, "SO_RCVBUF");
+        if (keepalive) set<SOL_SOCKET, SO_KEEPALIVE>(fd, 1, "SO_KEEPALIVE");
+      }
+
+      // after a read, the ACK of the request goes out at once instead of waiting for the response
+      void on_read(int fd) const {
+        if (!quickack) return;
+
+        int on = 1;
+        ::setsockopt(fd, IPPROTO_TCP, TCP_QUICKACK, &on, sizeof(on));
+      }
+
+      bool nodelay;
+      bool quickack;
+      // microseconds, 0 for none
+      int busy_poll;
+      // bytes, 0 for the kernel default
+      int send_buffer;
+      int receive_buffer;
+      bool keepalive;
+
+    private:
+
+      static bool is_tcp(int fd) {
+        sockaddr_storage addr;
+        socklen_t len = sizeof(addr);
+
+        if (::getsockname(fd, reinterpret_cast<sockaddr*>(&addr), &len) == -1) return false;
+        return addr.ss_family == AF_INET || addr.ss_family == AF_INET6;
+      }
+
+      // an option the kernel refuses is logged once, it would be refused for every connection
+      template<int Level, int Option>
+      static void set(int fd, int value, const char* name) {
+        if (::setsockopt(fd, Level, Option, &value, sizeof(value)) == 0) return;
+
+        static std::atomic<bool> warned(false);
+        if (!warned.exchange(true)) LOG(WARNING) << "can not set " << name << " : " << strerror(errno);
+      }
+    };
+
+    /*
+     * The socket profiles of the servers, set once before the servers start, the outward one for the connections
+     * of the clients, the inward one for the connections between the nodes, on both sides
+     * */
+    class socket_profiles : public atlas::singleton<socket_profiles> {
+    private:
+
+      friend class atlas::singleton<socket_profiles>;
+      socket_profiles(const socket_profiles&) = delete;
+      socket_profiles& operator=(const socket_profiles&) = delete;
+
+    public:
+
+      // public for std::make_shared, see atlas::singleton
+      socket_profiles() = default;
+
+    public:
+
+      const socket_profile& outward() const { return _outward; }
+
+      const socket_profile& inward() const { return _inward; }
+
+      void set_outward(const socket_profile& profile) { _outward = profile; }
+
+      void set_inward(const socket_profile& profile) { _inward = profile; }
+
+    private:
+
+      socket_profile _outward;
+      socket_profile _inward;
+    };
+
+  } // net
+} // pioneer
+
+#endif /* PIONEER_NET_SOCKET_PROFILE_H_ */
@@ -0,0 +1,534 @@
+/*
+ * tls.h
+ *
+ *  Created on: Sep 23, 2013
+ *      Author: vincent
+ */
+
+/*    Copyright 2011 ~ 2013 Vincent Zhang, ivincent.zhang@gmail.com
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#ifndef PIONEER_NET_TLS_H_
+#define PIONEER_NET_TLS_H_
+
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <linux/tls.h>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+
+#include <memory>
+#include <string>
+
+#include <boost/any.hpp>
+#include <glog/logging.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/kdf.h>
+#include <openssl/ssl.h>
+
+#include <muduo/net/Buffer.h>
+#include <muduo/net/TcpConnection.h>
+
+#include <atlas/singleton.h>
+
+// linux 4.13, the older headers miss them
+#ifndef TCP_ULP
+#define TCP_ULP 31
+#endif
+
+#ifndef SOL_TLS
+#define SOL_TLS 282
+#endif
+
+namespace pioneer {
+  namespace net {
+
+    namespace mn = muduo::net;
+
+    namespace detail {
+      void on_tls_keylog(const SSL* ssl, const char* line);
+    } // detail
+
+    /*
+     * The TLS settings shared by the connections of a server or a client, TLS 1.3 with AES-GCM only, the ciphers
+     * the kernel can take over, and no session tickets, since a ticket sent after the handshake would be a record
+     * the kernel does not expect, see tls_session
+     * */
+    class tls_context {
+    public:
+
+      ~tls_context() { SSL_CTX_free(_ctx); }
+
+      tls_context(const tls_context&) = delete;
+      tls_context& operator=(const tls_context&) = delete;
+
+      // the certificate chain and the private key in PEM, nullptr if they can not be loaded, the errors are logged
+      static std::shared_ptr<tls_context> server(const std::string& cert_file, const std::string& key_file) {
+        SSL_CTX* ctx = make(TLS_server_method());
+        if (!ctx) return nullptr;
+
+        if (SSL_CTX_use_certificate_chain_file(ctx, cert_file.c_str()) != 1
+            || SSL_CTX_use_PrivateKey_file(ctx, key_file.c_str(), SSL_FILETYPE_PEM) != 1
+            || SSL_CTX_check_private_key(ctx) != 1) {
+          log_errors("can not load " + cert_file + " and " + key_file);
+          SSL_CTX_free(ctx);
+          return nullptr;
+        }
+
+        return std::shared_ptr<tls_context>(new tls_context(ctx, true));
+      }
+
+      // the server's certificate is verified against the CAs in PEM, nullptr if they can not be loaded
+      static std::shared_ptr<tls_context> client(const std::string& ca_file) {
+        SSL_CTX* ctx = make(TLS_client_method());
+        if (!ctx) return nullptr;
+
+        if (SSL_CTX_load_verify_locations(ctx, ca_file.c_str(), nullptr) != 1) {
+          log_errors("can not load " + ca_file);
+          SSL_CTX_free(ctx);
+          return nullptr;
+        }
+        SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, nullptr);
+
+        return std::shared_ptr<tls_context>(new tls_context(ctx, false));
+      }
+
+      /*
+       * Whether the kernel takes over the record layer, the tls module, linux 4.13 for sending and 4.17 for
+       * receiving, it's probed once on a loopback connection
+       * */
+      static bool offload_supported() {
+        static const bool supported = probe();
+        return supported;
+      }
+
+      SSL_CTX* native() const { return _ctx; }
+
+      bool is_server() const { return _server; }
+
+      static void log_errors(const std::string& what) {
+        unsigned long e = ERR_get_error();
+        if (!e) LOG(ERROR) << what;
+
+        for (; e; e = ERR_get_error()) {
+          char reason[256];
+          ERR_error_string_n(e, reason, sizeof(reason));
+          LOG(ERROR) << what << " : " << reason;
+        }
+      }
+
+    private:
+
+      tls_context(SSL_CTX* ctx, bool server) : _ctx(ctx), _server(server) {}
+
+      static SSL_CTX* make(const SSL_METHOD* method) {
+        SSL_CTX* ctx = SSL_CTX_new(method);
+        if (!ctx) {
+          log_errors("can not create the TLS context");
+          return nullptr;
+        }
+
+        SSL_CTX_set_min_proto_version(ctx, TLS1_3_VERSION);
+        SSL_CTX_set_ciphersuites(ctx, "TLS_AES_128_GCM_SHA256:TLS_AES_256_GCM_SHA384");
+        SSL_CTX_set_options(ctx, SSL_OP_NO_TICKET);
+        SSL_CTX_set_num_tickets(ctx, 0);
+        // the only way OpenSSL hands out the traffic secrets
+        SSL_CTX_set_keylog_callback(ctx, &detail::on_tls_keylog);
+
+        return ctx;
+      }
+
+      static bool probe() {
+        int listener = ::socket(AF_INET, SOCK_STREAM, 0);
+        int client = ::socket(AF_INET, SOCK_STREAM, 0);
+
+        sockaddr_in addr;
+        std::memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        socklen_t len = sizeof(addr);
+
+        // the connection is established in the backlog, there is no need to accept it
+        bool supported = listener >= 0 && client >= 0
+            && ::bind(listener, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0
+            && ::listen(listener, 1) == 0
+            && ::getsockname(listener, reinterpret_cast<sockaddr*>(&addr), &len) == 0
+            && ::connect(client, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0
+            && ::setsockopt(client, SOL_TCP, TCP_ULP, "tls", sizeof("tls")) == 0;
+
+        if (client >= 0) ::close(client);
+        if (listener >= 0) ::close(listener);
+
+        return supported;
+      }
+
+    private:
+
+      SSL_CTX* _ctx;
+      bool _server;
+    };
+
+    /*
+     * A TLS connection whose handshake runs in OpenSSL and whose records, once the handshake is done, are
+     * encrypted and decrypted by the kernel, kTLS, so the plain send and read paths of muduo, and sendfile,
+     * keep working unchanged, with no copy and no crypto on the I/O thread.
+     *
+     * The handshake is fed from the input buffer of the connection record by record through memory BIOs, and
+     * it's output is sent through the connection. Then :
+     *
+     *  the sending keys go to the kernel as soon as the handshake output is written out, nothing is encrypted
+     *    with them in OpenSSL, so the sequence starts at 0
+     *  the records read before the kernel takes over are decrypted in OpenSSL, counted for the receiving
+     *    sequence, and kept as plaintext, see plain(), until the input buffer ends on a record boundary, then
+     *    the receiving keys go to the kernel, the records not read yet are decrypted by it
+     *
+     * The keys are derived from the traffic secrets, HKDF-Expand-Label of RFC 8446. A record other than the
+     * application data after the offload, an alert or a key update, fails the read and closes the connection.
+     *
+     * The I/O thread of the connection only
+     * */
+    class tls_session {
+    public:
+
+      enum state { handshaking, draining, offloaded, failed };
+
+      // the header, and the largest TLS 1.3 record after it
+      static const size_t record_header_size = 5;
+      static const size_t max_record_size = 16384 + 256;
+
+    public:
+
+      explicit tls_session(const tls_context& context) :
+        _ssl(SSL_new(context.native())), _state(handshaking), _ulp_attached(false), _tx_offloaded(false),
+        _rx_offloaded(false), _rx_seq(0)
+      {
+        _rbio = BIO_new(BIO_s_mem());
+        _wbio = BIO_new(BIO_s_mem());
+
+        SSL_set_bio(_ssl, _rbio, _wbio);
+        SSL_set_ex_data(_ssl, session_index(), this);
+
+        if (context.is_server()) SSL_set_accept_state(_ssl);
+        else SSL_set_connect_state(_ssl);
+      }
+
+      ~tls_session() {
+        release();
+      }
+
+      tls_session(const tls_session&) = delete;
+      tls_session& operator=(const tls_session&) = delete;
+
+    public:
+
+      // the client sends it's hello, the server waits for the one of the client
+      state start(const mn::TcpConnectionPtr& conn) {
+        if (!SSL_is_server(_ssl)) handshake(conn);
+        return _state;
+      }
+
+      // take the records read out of buf
+      state on_read(const mn::TcpConnectionPtr& conn, mn::Buffer* buf) {
+        if (_state == offloaded || _state == failed) return _state;
+
+        // the kernel decrypts already, the sending keys wait for the handshake output to drain
+        if (_rx_offloaded) {
+          _plain.append(buf->peek(), buf->readableBytes());
+          buf->retrieveAll();
+          return _state;
+        }
+
+        while (buf->readableBytes() >= record_header_size) {
+          const unsigned char* header = reinterpret_cast<const unsigned char*>(buf->peek());
+          size_t size = record_header_size + ((header[3] << 8) | header[4]);
+
+          if (size > record_header_size + max_record_size) {
+            fail("bad TLS record");
+            return _state;
+          }
+          if (buf->readableBytes() < size) break;
+
+          BIO_write(_rbio, buf->peek(), static_cast<int>(size));
+          buf->retrieve(size);
+
+          if (_state == handshaking ? !handshake(conn) : !decrypt()) return _state;
+        }
+
+        if (_state == draining && buf->readableBytes() == 0) {
+          if (!offload(conn->fd(), TLS_RX, SSL_is_server(_ssl) ? _client_secret : _server_secret, _rx_seq)) return _state;
+          _rx_offloaded = true;
+        }
+
+        return finish(conn);
+      }
+
+      // the handshake output may have been queued
+      state on_write_complete(const mn::TcpConnectionPtr& conn) {
+        if (_state != draining) return _state;
+        return finish(conn);
+      }
+
+      // the plaintext of the records decrypted before the kernel took over, it goes before anything read later
+      mn::Buffer& plain() { return _plain; }
+
+      state get_state() const { return _state; }
+
+    private:
+
+      friend void detail::on_tls_keylog(const SSL* ssl, const char* line);
+
+      static int session_index() {
+        static const int index = SSL_get_ex_new_index(0, nullptr, nullptr, nullptr, nullptr);
+        return index;
+      }
+
+      bool handshake(const mn::TcpConnectionPtr& conn) {
+        int r = SSL_do_handshake(_ssl);
+        // the alert of a failed handshake is sent too
+        flush(conn);
+
+        if (r == 1) {
+          _state = draining;
+          return true;
+        }
+
+        if (SSL_get_error(_ssl, r) == SSL_ERROR_WANT_READ) return true;
+        return fail("TLS handshake failed");
+      }
+
+      bool decrypt() {
+        // every record after the handshake is protected by the traffic keys
+        ++_rx_seq;
+
+        char chunk[16384];
+        int n = 0;
+        while ((n = SSL_read(_ssl, chunk, sizeof(chunk))) > 0) _plain.append(chunk, n);
+
+        int e = SSL_get_error(_ssl, n);
+        if (e == SSL_ERROR_WANT_READ) return true;
+        return fail(e == SSL_ERROR_ZERO_RETURN ? "TLS closed by the peer" : "TLS read failed");
+      }
+
+      void flush(const mn::TcpConnectionPtr& conn) {
+        char chunk[4096];
+        int n = 0;
+        while ((n = BIO_read(_wbio, chunk, sizeof(chunk))) > 0) conn->send(chunk, n);
+      }
+
+      // the sending keys go to the kernel once the handshake output left the output buffer
+      state finish(const mn::TcpConnectionPtr& conn) {
+        if (_state != draining) return _state;
+
+        if (!_tx_offloaded && conn->outputBuffer()->readableBytes() == 0) {
+          if (!offload(conn->fd(), TLS_TX, SSL_is_server(_ssl) ? _server_secret : _client_secret, 0)) return _state;
+          _tx_offloaded = true;
+        }
+
+        if (_tx_offloaded && _rx_offloaded) {
+          _state = offloaded;
+          release();
+        }
+
+        return _state;
+      }
+
+      bool offload(int fd, int direction, const std::string& secret, uint64_t seq) {
+        if (!_ulp_attached) {
+          if (::setsockopt(fd, SOL_TCP, TCP_ULP, "tls", sizeof("tls")) == -1) {
+            return fail(std::string("can not attach kernel TLS : ") + strerror(errno));
+          }
+          _ulp_attached = true;
+        }
+
+        const SSL_CIPHER* cipher = SSL_get_current_cipher(_ssl);
+        const EVP_MD* md = SSL_CIPHER_get_handshake_digest(cipher);
+        uint16_t suite = SSL_CIPHER_get_protocol_id(cipher);
+        size_t key_size = suite == 0x1301 ? TLS_CIPHER_AES_GCM_128_KEY_SIZE : TLS_CIPHER_AES_GCM_256_KEY_SIZE;
+
+        unsigned char key[TLS_CIPHER_AES_GCM_256_KEY_SIZE];
+        unsigned char iv[TLS_CIPHER_AES_GCM_128_SALT_SIZE + TLS_CIPHER_AES_GCM_128_IV_SIZE];
+        if (secret.empty() || !expand_label(md, secret, "key", key, key_size) || !expand_label(md, secret, "iv", iv, sizeof(iv))) {
+          return fail("can not derive the TLS keys");
+        }
+
+        unsigned char rec_seq[8];
+        for (int i = 7; i >= 0; --i, seq >>= 8) rec_seq[i] = static_cast<unsigned char>(seq);
+
+        // TLS 1.3 keeps the whole nonce, the kernel takes it as the salt and the iv
+        int r = 0;
+        if (suite == 0x1301) {
+          tls12_crypto_info_aes_gcm_128 info;
+          std::memset(&info, 0, sizeof(info));
+          info.info.version = TLS_1_3_VERSION;
+          info.info.cipher_type = TLS_CIPHER_AES_GCM_128;
+          std::memcpy(info.key, key, sizeof(info.key));
+          std::memcpy(info.salt, iv, sizeof(info.salt));
+          std::memcpy(info.iv, iv + sizeof(info.salt), sizeof(info.iv));
+          std::memcpy(info.rec_seq, rec_seq, sizeof(info.rec_seq));
+
+          r = ::setsockopt(fd, SOL_TLS, direction, &info, sizeof(info));
+          OPENSSL_cleanse(&info, sizeof(info));
+        }
+        else {
+          tls12_crypto_info_aes_gcm_256 info;
+          std::memset(&info, 0, sizeof(info));
+          info.info.version = TLS_1_3_VERSION;
+          info.info.cipher_type = TLS_CIPHER_AES_GCM_256;
+          std::memcpy(info.key, key, sizeof(info.key));
+          std::memcpy(info.salt, iv, sizeof(info.salt));
+          std::memcpy(info.iv, iv + sizeof(info.salt), sizeof(info.iv));
+          std::memcpy(info.rec_seq, rec_seq, sizeof(info.rec_seq));
+
+          r = ::setsockopt(fd, SOL_TLS, direction, &info, sizeof(info));
+          OPENSSL_cleanse(&info, sizeof(info));
+        }
+
+        OPENSSL_cleanse(key, sizeof(key));
+        OPENSSL_cleanse(iv, sizeof(iv));
+
+        if (r == -1) return fail(std::string("can not offload TLS to the kernel : ") + strerror(errno));
+        return true;
+      }
+
+      // HKDF-Expand-Label(secret, label, "", size) of RFC 8446
+      static bool expand_label(const EVP_MD* md, const std::string& secret, const char* label, unsigned char* out, size_t size) {
+        unsigned char info[2 + 1 + 255 + 1];
+        size_t label_size = std::strlen("tls13 ") + std::strlen(label);
+
+        info[0] = static_cast<unsigned char>(size >> 8);
+        info[1] = static_cast<unsigned char>(size);
+        info[2] = static_cast<unsigned char>(label_size);
+        std::memcpy(info + 3, "tls13 ", 6);
+        std::memcpy(info + 9, label, label_size - 6);
+        info[3 + label_size] = 0;
+
+        EVP_PKEY_CTX* ctx = EVP_PKEY_CTX_new_id(EVP_PKEY_HKDF, nullptr);
+        bool ok = ctx && EVP_PKEY_derive_init(ctx) > 0
+            && EVP_PKEY_CTX_set_hkdf_mode(ctx, EVP_PKEY_HKDEF_MODE_EXPAND_ONLY) > 0
+            && EVP_PKEY_CTX_set_hkdf_md(ctx, md) > 0
+            && EVP_PKEY_CTX_set1_hkdf_key(ctx, reinterpret_cast<const unsigned char*>(secret.data()), static_cast<int>(secret.size())) > 0
+            && EVP_PKEY_CTX_add1_hkdf_info(ctx, info, static_cast<int>(4 + label_size)) > 0
+            && EVP_PKEY_derive(ctx, out, &size) > 0;
+
+        EVP_PKEY_CTX_free(ctx);
+        return ok;
+      }
+
+      bool fail(const std::string& what) {
+        tls_context::log_errors(what);
+        _state = failed;
+        release();
+
+        return false;
+      }
+
+      // the secrets and OpenSSL are not needed once the kernel has the keys
+      void release() {
+        OPENSSL_cleanse(&_client_secret[0], _client_secret.size());
+        OPENSSL_cleanse(&_server_secret[0], _server_secret.size());
+        _client_secret.clear();
+        _server_secret.clear();
+
+        // the BIOs go with it
+        if (_ssl) SSL_free(_ssl);
+        _ssl = nullptr;
+      }
+
+    private:
+
+      SSL* _ssl;
+      BIO* _rbio;
+      BIO* _wbio;
+
+      state _state;
+      bool _ulp_attached;
+      bool _tx_offloaded;
+      bool _rx_offloaded;
+      // the records decrypted by OpenSSL, the kernel goes on from here
+      uint64_t _rx_seq;
+
+      std::string _client_secret;
+      std::string _server_secret;
+
+      mn::Buffer _plain;
+    };
+
+    namespace detail {
+
+      // "<label> <client random> <secret>" in hex, only the first application traffic secrets are kept
+      inline void on_tls_keylog(const SSL* ssl, const char* line) {
+        tls_session* session = static_cast<tls_session*>(SSL_get_ex_data(ssl, tls_session::session_index()));
+        if (!session) return;
+
+        std::string* secret = nullptr;
+        if (!std::strncmp(line, "CLIENT_TRAFFIC_SECRET_0 ", 24)) secret = &session->_client_secret;
+        else if (!std::strncmp(line, "SERVER_TRAFFIC_SECRET_0 ", 24)) secret = &session->_server_secret;
+        else return;
+
+        const char* hex = std::strrchr(line, ' ');
+        if (!hex) return;
+
+        secret->clear();
+        for (++hex; hex[0] && hex[1]; hex += 2) {
+          char byte[3] = { hex[0], hex[1], 0 };
+          secret->push_back(static_cast<char>(std::strtoul(byte, nullptr, 16)));
+        }
+      }
+
+    } // detail
+
+    // the TLS session of a connection during the handshake, kept in the connection's context, nullptr otherwise
+    inline std::shared_ptr<tls_session> tls_session_of(const mn::TcpConnectionPtr& conn) {
+      const std::shared_ptr<tls_session>* session = boost::any_cast<std::shared_ptr<tls_session>>(&conn->getContext());
+      return session ? *session : nullptr;
+    }
+
+    /*
+     * The TLS contexts of the servers, set once before the servers start, nullptr for plaintext, only the
+     * outward server takes TLS for now
+     * */
+    class tls_contexts : public atlas::singleton<tls_contexts> {
+    private:
+
+      friend class atlas::singleton<tls_contexts>;
+      tls_contexts(const tls_contexts&) = delete;
+      tls_contexts& operator=(const tls_contexts&) = delete;
+
+    public:
+
+      // public for std::make_shared, see atlas::singleton
+      tls_contexts() = default;
+
+    public:
+
+      const std::shared_ptr<tls_context>& outward() const { return _outward; }
+
+      void set_outward(const std::shared_ptr<tls_context>& context) { _outward = context; }
+
+    private:
+
+      std::shared_ptr<tls_context> _outward;
+    };
+
+  } // net
+} // pioneer
+
+#endif /* PIONEER_NET_TLS_H_ */
@@ -0,0 +1,248 @@
+/*
+ * traffic_capture.h
+ *
+ *  Created on: Sep 28, 2013
+ *      Author: vincent
+ */
+
+/*    Copyright 2011 ~ 2013 Vincent Zhang, ivincent.zhang@gmail.com
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#ifndef PIONEER_NET_TRAFFIC_CAPTURE_H_
+#define PIONEER_NET_TRAFFIC_CAPTURE_H_
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <glog/logging.h>
+#include <atlas/singleton.h>
+#include <atlas/rpc.h>
+
+#include <pioneer/system/async_logging.h>
+
+namespace pioneer {
+  namespace net {
+
+#pragma pack(1)
+
+    // the file starts with it
+    struct capture_file_header {
+      char magic[8];        // "PNRCAP1\0"
+      uint32_t version;     // of the records, see capture_record
+      uint32_t reserved;
+    };
+
+    // follows the file header one after another, the frame follows the record, as it's received
+    struct capture_record {
+      uint64_t time;        // nanoseconds since the epoch, the time the frame is run
+      uint64_t source;      // the endpoint it's from, the port is 0 for a multicast datagram
+      uint32_t size;        // bytes of the frame
+    };
+
+#pragma pack()
+
+    /*
+     * The request frames this node receives, written to a file to replay them against a node later, see the
+     * replay mode of pioneer_loadgen. The frames are recorded where every path meets, message_handler::run_task,
+     * so the ones of the connections, of the multicast, of this node to itself and the ones reassembled from
+     * chunks are all captured, and the responses, which complete this node's own calls, are not. The builtin
+     * calls are the cluster's own chatter and are left out, but the batches, which carry the data plane calls.
+     *
+     * The records go through the async logging, the I/O thread copies a frame into it's buffer and returns, the
+     * flusher writes it with the lines, so a capture costs the I/O threads a copy, and nothing at all but a
+     * relaxed load while it's off. The capture stops by itself once the file holds max_bytes
+     * */
+    class traffic_capture : public atlas::singleton<traffic_capture> {
+    public:
+
+      static const uint32_t version = 1;
+
+    private:
+
+      friend class atlas::singleton<traffic_capture>;
+      traffic_capture(const traffic_capture&) = delete;
+      traffic_capture& operator=(const traffic_capture&) = delete;
+
+      // the file the flusher writes the records to
+      class file_sink : public system::async_logging::sink {
+      public:
+
+        explicit file_sink(std::FILE* file) : _file(file) {}
+
+        virtual ~file_sink() { std::fclose(_file); }
+
+        virtual void write(const char* data, size_t size) { std::fwrite(data, 1, size, _file); }
+
+        virtual void flush() { std::fflush(_file); }
+
+      private:
+
+        std::FILE* _file;
+      };
+
+    public:
+
+      // public for std::make_shared, see atlas::singleton
+      traffic_capture() : _on(false), _sink(-1), _max_bytes(0), _bytes(0), _frames(0), _full(0) {}
+
+    public:
+
+      // start to capture into the file, truncated, a capture running is stopped first
+      void start(const std::string& path, uint64_t max_bytes) {
+        std::lock_guard<std::mutex> guard(_mutex);
+        close();
+
+        std::FILE* file = std::fopen(path.c_str(), "wb");
+        if (!file) throw std::runtime_error("can not open the capture file " + path + " : " + std::strerror(errno));
+
+        capture_file_header h;
+        std::memset(&h, 0, sizeof(h));
+        std::memcpy(h.magic, "PNRCAP1", 8);
+        h.version = version;
+        std::fwrite(&h, sizeof(h), 1, file);
+
+        _path = path;
+        _max_bytes = max_bytes;
+        _bytes.store(sizeof(h), std::memory_order_relaxed);
+        _frames.store(0, std::memory_order_relaxed);
+        _full.store(0, std::memory_order_relaxed);
+
+        _sink.store(system::async_logging::ref().add_sink(std::make_shared<file_sink>(file)), std::memory_order_relaxed);
+        _on.store(true, std::memory_order_release);
+
+        LOG(INFO) << "capture the traffic into " << path;
+      }
+
+      // the records taken before are written, the file is closed
+      void stop() {
+        std::lock_guard<std::mutex> guard(_mutex);
+        close();
+      }
+
+      bool capturing() const { return _on.load(std::memory_order_relaxed); }
+
+      // the request frame run from the source, thread safe
+      void record(atlas::rpc::endpoint_id source, const char* frame, size_t size) {
+        if (!_on.load(std::memory_order_acquire)) return;
+
+        int32_t fn_id = 0;
+        std::memcpy(&fn_id, frame + offsetof(atlas::rpc::request_header, fn_id), sizeof(fn_id));
+        if (fn_id < 0 && fn_id != atlas::rpc::fn_ids::call_batch) return;
+
+        uint64_t bytes = sizeof(capture_record) + size;
+        if (_bytes.fetch_add(bytes, std::memory_order_relaxed) + bytes > _max_bytes) {
+          // the next frame may still fit, the file is full anyway
+          if (_on.exchange(false)) LOG(WARNING) << "the capture file " << _path << " is full, stop capturing";
+          ++_full;
+          return;
+        }
+
+        // stopped meanwhile
+        int sink = _sink.load(std::memory_order_relaxed);
+        if (sink < 0) return;
+
+        capture_record r;
+        r.time = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+        r.source = source;
+        r.size = static_cast<uint32_t>(size);
+
+        system::async_logging::ref().write(sink, reinterpret_cast<const char*>(&r), sizeof(r), frame, size);
+        ++_frames;
+      }
+
+      std::string str() const {
+        std::lock_guard<std::mutex> guard(_mutex);
+
+        std::ostringstream os;
+        os << "capturing : " << std::boolalpha << capturing() << "\n"
+            << "file : " << (_path.empty() ? "none" : _path) << "\n"
+            << "frames : " << _frames.load(std::memory_order_relaxed) << "\n"
+            << "bytes : " << _bytes.load(std::memory_order_relaxed) << " of " << _max_bytes << "\n"
+            << "left out : " << _full.load(std::memory_order_relaxed) << " frames, the file is full\n";
+
+        return os.str();
+      }
+
+    private:
+
+      // with the mutex held
+      void close() {
+        _on.store(false, std::memory_order_release);
+
+        int sink = _sink.exchange(-1);
+        if (sink >= 0) {
+          system::async_logging::ref().remove_sink(sink);
+          LOG(INFO) << "captured " << _frames.load() << " frames into " << _path;
+        }
+      }
+
+    private:
+
+      std::atomic<bool> _on;
+      std::atomic<int> _sink;
+
+      mutable std::mutex _mutex;
+      std::string _path;
+      uint64_t _max_bytes;
+
+      std::atomic<uint64_t> _bytes;
+      std::atomic<uint64_t> _frames;
+      std::atomic<uint64_t> _full;
+    };
+
+    /*
+     * Read the frames of a capture file, in the order they were captured, throw if it's not one. A file cut short,
+     * the node is killed while capturing, ends at the last whole record
+     * */
+    inline void read_capture(const std::string& path,
+        const std::function<void(const capture_record&, const char* frame)>& on_frame) {
+      std::unique_ptr<std::FILE, int (*)(std::FILE*)> file(std::fopen(path.c_str(), "rb"), &std::fclose);
+      if (!file) throw std::runtime_error("can not open the capture file " + path + " : " + std::strerror(errno));
+
+      capture_file_header h;
+      if (std::fread(&h, sizeof(h), 1, file.get()) != 1 || std::memcmp(h.magic, "PNRCAP1", 8) != 0) {
+        throw std::runtime_error(path + " is not a capture file");
+      }
+      if (h.version != traffic_capture::version) {
+        throw std::runtime_error(path + " is of the capture version " + std::to_string(h.version));
+      }
+
+      capture_record r;
+      std::vector<char> frame;
+      while (std::fread(&r, sizeof(r), 1, file.get()) == 1) {
+        if (r.size < sizeof(atlas::rpc::request_header)) throw std::runtime_error(path + " is corrupted");
+
+        frame.resize(r.size);
+        if (std::fread(frame.data(), 1, r.size, file.get()) != r.size) break;
+
+        on_frame(r, frame.data());
+      }
+    }
+
+  } // net
+} // pioneer
+
+#endif /* PIONEER_NET_TRAFFIC_CAPTURE_H_ */
@@ -0,0 +1,401 @@
+/*
+ * uring_poller.h
+ *
+ *  Created on: Sep 18, 2013
+ *      Author: vincent
+ */
+
+/*    Copyright 2011 ~ 2013 Vincent Zhang, ivincent.zhang@gmail.com
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#ifndef PIONEER_NET_URING_POLLER_H_
+#define PIONEER_NET_URING_POLLER_H_
+
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+
+#include <algorithm>
+#include <atomic>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <glog/logging.h>
+#include <muduo/net/Channel.h>
+#include <muduo/net/Poller.h>
+#include <muduo/net/poller/EPollPoller.h>
+
+// linux 5.1, the older headers miss them
+#ifndef __NR_io_uring_setup
+#define __NR_io_uring_setup 425
+#endif
+#ifndef __NR_io_uring_enter
+#define __NR_io_uring_enter 426
+#endif
+
+namespace pioneer {
+  namespace net {
+
+    namespace mn = muduo::net;
+
+    /*
+     * A muduo poller on io_uring, the interest changes and the waiting of a loop iteration are one syscall.
+     *
+     * A channel is watched by a one shot poll, which is armed again before the next wait, so the events are
+     * level triggered as epoll's, a socket not read to the end is reported again. The polls armed, removed and
+     * re-armed during an iteration are queued in the submission ring, and submitted by the io_uring_enter which
+     * waits for the next events, where epoll takes an epoll_ctl for every change, for example every time
+     * a connection starts and stops waiting for it's output buffer to drain, and for every connection coming
+     * and going.
+     *
+     * The reads and the writes are still done by muduo's TcpConnection when a socket is ready, muduo is built
+     * without io_uring, so the multishot accept and recv, the provided buffer rings and the batched sends, which
+     * need their own connection type, are not done here.
+     *
+     * A poll completes with it's user data, the fd and the generation of the channel when it's armed, the
+     * completions of a removed channel, or of a channel whose fd is reused, are stale and ignored.
+     *
+     * Not thread safe, everything runs in the loop, see Poller
+     * */
+    class uring_poller : public mn::Poller {
+    public:
+
+      static const unsigned default_entries = 1024;
+
+    private:
+
+      // the user data of the timeouts and the removals, never a fd
+      static const uint64_t internal_data = uint64_t(0xffffffff) << 32;
+
+      struct watch {
+        watch() : channel(nullptr), generation(0), armed_events(0), armed(false), pending(false) {}
+
+        mn::Channel* channel;
+        uint32_t generation;
+        // the events of the poll armed
+        int armed_events;
+        bool armed;
+        // in the list to arm before the next wait
+        bool pending;
+      };
+
+    public:
+
+      // throw if io_uring is not supported, linux 5.1
+      explicit uring_poller(mn::EventLoop* loop, unsigned entries = default_entries) : mn::Poller(loop),
+        _ring_fd(-1), _sq_ring(nullptr), _cq_ring(nullptr), _sqes(nullptr), _sq_ring_size(0), _cq_ring_size(0),
+        _generation(0) {
+        io_uring_params params;
+        std::memset(&params, 0, sizeof(params));
+
+        _ring_fd = ::syscall(__NR_io_uring_setup, entries, &params);
+        if (_ring_fd < 0) throw std::runtime_error(std::string("io_uring_setup : ") + std::strerror(errno));
+
+        _sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        _cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+
+        bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+        if (single_mmap) _sq_ring_size = _cq_ring_size = std::max(_sq_ring_size, _cq_ring_size);
+
+        _sq_ring = map(_sq_ring_size, IORING_OFF_SQ_RING);
+        _cq_ring = single_mmap ? _sq_ring : map(_cq_ring_size, IORING_OFF_CQ_RING);
+        _sqes = static_cast<io_uring_sqe*>(map(params.sq_entries * sizeof(io_uring_sqe), IORING_OFF_SQES));
+        _sqe_count = params.sq_entries;
+
+        char* sq = static_cast<char*>(_sq_ring);
+        _sq_head = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+        _sq_tail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+        _sq_mask = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+        _sq_array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+
+        char* cq = static_cast<char*>(_cq_ring);
+        _cq_head = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+        _cq_tail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+        _cq_mask = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+        _cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+
+        LOG(INFO) << "io_uring poller, " << params.sq_entries << " submission entries";
+      }
+
+      virtual ~uring_poller() {
+        if (_sqes) ::munmap(_sqes, _sqe_count * sizeof(io_uring_sqe));
+        if (_cq_ring && _cq_ring != _sq_ring) ::munmap(_cq_ring, _cq_ring_size);
+        if (_sq_ring) ::munmap(_sq_ring, _sq_ring_size);
+        if (_ring_fd >= 0) ::close(_ring_fd);
+      }
+
+      uring_poller(const uring_poller&) = delete;
+      uring_poller& operator=(const uring_poller&) = delete;
+
+    public:
+
+      // muduo polls at most kPollTimeMs, a negative timeout waits for ever
+      virtual muduo::Timestamp poll(int timeout_ms, ChannelList* active_channels) {
+        arm_pending();
+
+        unsigned wait = 0;
+        if (!completed()) {
+          wait = 1;
+
+          if (timeout_ms >= 0) {
+            // completes after the timeout, or once anything else completes
+            _timeout.tv_sec = timeout_ms / 1000;
+            _timeout.tv_nsec = (timeout_ms % 1000) * 1000000LL;
+
+            io_uring_sqe* sqe = get_sqe();
+            sqe->opcode = IORING_OP_TIMEOUT;
+            sqe->fd = -1;
+            sqe->addr = reinterpret_cast<uint64_t>(&_timeout);
+            sqe->len = 1;
+            sqe->off = 1;
+            sqe->user_data = internal_data;
+          }
+        }
+
+        if (enter(wait) < 0 && errno != EINTR) {
+          LOG(ERROR) << "io_uring_enter : " << std::strerror(errno);
+        }
+
+        muduo::Timestamp now(muduo::Timestamp::now());
+        reap(active_channels);
+
+        return now;
+      }
+
+      virtual void updateChannel(mn::Channel* channel) {
+        assertInLoopThread();
+
+        int fd = channel->fd();
+        auto it = _watches.find(fd);
+
+        if (it == _watches.end() || it->second.channel != channel) {
+          // a new channel, or a new one of a reused fd
+          if (it != _watches.end()) disarm(fd, it->second);
+
+          watch& w = _watches[fd];
+          w = watch();
+          w.channel = channel;
+          w.generation = ++_generation;
+          // added, as EPollPoller marks it
+          channel->set_index(1);
+
+          if (!channel->isNoneEvent()) push_pending(fd, w);
+          return;
+        }
+
+        watch& w = it->second;
+        if (w.armed && w.armed_events == channel->events()) return;
+
+        // the events changed, the poll armed is removed, and one of the new events is armed before the next wait
+        if (w.armed) disarm(fd, w);
+        if (!channel->isNoneEvent()) push_pending(fd, w);
+      }
+
+      virtual void removeChannel(mn::Channel* channel) {
+        assertInLoopThread();
+
+        auto it = _watches.find(channel->fd());
+        if (it == _watches.end() || it->second.channel != channel) return;
+
+        disarm(it->first, it->second);
+        _watches.erase(it);
+        channel->set_index(-1);
+      }
+
+    private:
+
+      void* map(size_t size, off_t offset) {
+        void* p = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _ring_fd, offset);
+        if (p == MAP_FAILED) {
+          int err = errno;
+          ::close(_ring_fd);
+          throw std::runtime_error(std::string("io_uring mmap : ") + std::strerror(err));
+        }
+
+        return p;
+      }
+
+      static uint64_t user_data(int fd, uint32_t generation) {
+        return (static_cast<uint64_t>(static_cast<uint32_t>(fd)) << 32) | generation;
+      }
+
+      // the ring is full, submit what's queued to make room
+      io_uring_sqe* get_sqe() {
+        unsigned tail = *_sq_tail;
+        while (tail - __atomic_load_n(_sq_head, __ATOMIC_ACQUIRE) >= _sqe_count) {
+          if (enter(0) < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            LOG(ERROR) << "io_uring_enter : " << std::strerror(errno);
+          }
+        }
+
+        unsigned index = tail & _sq_mask;
+        io_uring_sqe* sqe = &_sqes[index];
+        std::memset(sqe, 0, sizeof(*sqe));
+
+        _sq_array[index] = index;
+        __atomic_store_n(_sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+        return sqe;
+      }
+
+      // submit everything queued, the kernel moves the head past the entries it has taken
+      int enter(unsigned min_complete) {
+        unsigned to_submit = *_sq_tail - __atomic_load_n(_sq_head, __ATOMIC_ACQUIRE);
+        if (to_submit == 0 && min_complete == 0) return 0;
+
+        unsigned flags = min_complete ? IORING_ENTER_GETEVENTS : 0;
+
+        return ::syscall(__NR_io_uring_enter, _ring_fd, to_submit, min_complete, flags, nullptr, 0);
+      }
+
+      bool completed() const {
+        return __atomic_load_n(_cq_head, __ATOMIC_RELAXED) != __atomic_load_n(_cq_tail, __ATOMIC_ACQUIRE);
+      }
+
+      void push_pending(int fd, watch& w) {
+        if (w.pending) return;
+
+        w.pending = true;
+        _pending.push_back(fd);
+      }
+
+      // the channels completed or changed since the last wait, with their events now
+      void arm_pending() {
+        for (int fd : _pending) {
+          auto it = _watches.find(fd);
+          if (it == _watches.end()) continue;
+
+          watch& w = it->second;
+          w.pending = false;
+          if (w.armed || w.channel->isNoneEvent()) continue;
+
+          io_uring_sqe* sqe = get_sqe();
+          sqe->opcode = IORING_OP_POLL_ADD;
+          sqe->fd = fd;
+          sqe->poll32_events = static_cast<uint32_t>(w.channel->events());
+          sqe->user_data = user_data(fd, w.generation);
+
+          w.armed = true;
+          w.armed_events = w.channel->events();
+        }
+
+        _pending.clear();
+      }
+
+      // the completion of the poll removed is stale, a new generation is armed
+      void disarm(int fd, watch& w) {
+        if (!w.armed) return;
+
+        io_uring_sqe* sqe = get_sqe();
+        sqe->opcode = IORING_OP_POLL_REMOVE;
+        sqe->fd = -1;
+        sqe->addr = user_data(fd, w.generation);
+        sqe->user_data = internal_data;
+
+        w.armed = false;
+        w.generation = ++_generation;
+      }
+
+      void reap(ChannelList* active_channels) {
+        unsigned head = __atomic_load_n(_cq_head, __ATOMIC_RELAXED);
+        unsigned tail = __atomic_load_n(_cq_tail, __ATOMIC_ACQUIRE);
+
+        for (; head != tail; ++head) {
+          const io_uring_cqe& cqe = _cqes[head & _cq_mask];
+          if ((cqe.user_data & internal_data) == internal_data) continue;
+
+          int fd = static_cast<int>(cqe.user_data >> 32);
+          auto it = _watches.find(fd);
+          if (it == _watches.end() || it->second.generation != static_cast<uint32_t>(cqe.user_data)) continue;
+
+          watch& w = it->second;
+          w.armed = false;
+
+          // the poll failed, the channel's error callback tells
+          w.channel->set_revents(cqe.res >= 0 ? cqe.res : POLLERR);
+          active_channels->push_back(w.channel);
+
+          push_pending(fd, w);
+        }
+
+        __atomic_store_n(_cq_head, head, __ATOMIC_RELEASE);
+      }
+
+    private:
+
+      int _ring_fd;
+      void* _sq_ring;
+      void* _cq_ring;
+      io_uring_sqe* _sqes;
+      size_t _sq_ring_size;
+      size_t _cq_ring_size;
+      unsigned _sqe_count;
+
+      unsigned* _sq_head;
+      unsigned* _sq_tail;
+      unsigned _sq_mask;
+      unsigned* _sq_array;
+
+      unsigned* _cq_head;
+      unsigned* _cq_tail;
+      unsigned _cq_mask;
+      io_uring_cqe* _cqes;
+
+      uint32_t _generation;
+      __kernel_timespec _timeout;
+
+      std::unordered_map<int, watch> _watches;
+      // the fds to arm before the next wait
+      std::vector<int> _pending;
+    };
+
+    // the new loops poll with io_uring, set it before the loops are created, see newDefaultPoller
+    inline std::atomic<bool>& use_io_uring() {
+      static std::atomic<bool> enabled(false);
+      return enabled;
+    }
+
+  } // net
+} // pioneer
+
+/*
+ * The program defines the default poller of muduo instead of muduo's DefaultPoller.cc, which is not linked then,
+ * define it in one translation unit only, the one of main(). A loop falls back to epoll if io_uring is not enabled,
+ * or not supported by the kernel, or not permitted, for example by seccomp in a container
+ * */
+#ifdef PIONEER_URING_POLLER
+
+muduo::net::Poller* muduo::net::Poller::newDefaultPoller(muduo::net::EventLoop* loop) {
+  if (pioneer::net::use_io_uring()) {
+    try {
+      return new pioneer::net::uring_poller(loop);
+    }
+    catch (const std::exception& e) {
+      LOG(WARNING) << e.what() << ", fall back to epoll";
+    }
+  }
+
+  return new muduo::net::EPollPoller(loop);
+}
+
+#endif // PIONEER_URING_POLLER
+
+#endif /* PIONEER_NET_URING_POLLER_H_ */
@@ -0,0 +1,544 @@
+/*
+ * xdp_receiver.h
+ *
+ *  Created on: Sep 28, 2013
+ *      Author: vincent
+ */
+
+/*    Copyright 2011 ~ 2013 Vincent Zhang, ivincent.zhang@gmail.com
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#ifndef PIONEER_NET_XDP_RECEIVER_H_
+#define PIONEER_NET_XDP_RECEIVER_H_
+
+#include <arpa/inet.h>
+#include <linux/bpf.h>
+#include <linux/ethtool.h>
+#include <linux/if_ether.h>
+#include <linux/if_link.h>
+#include <linux/if_xdp.h>
+#include <linux/sockios.h>
+#include <net/ethernet.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <boost/bind.hpp>
+#include <glog/logging.h>
+#include <muduo/net/Channel.h>
+#include <muduo/net/EventLoop.h>
+
+#include <pioneer/net/ip.h>
+#include <pioneer/net/multicast.h>
+
+// the older headers miss them
+#ifndef AF_XDP
+#define AF_XDP 44
+#endif
+#ifndef SOL_XDP
+#define SOL_XDP 283
+#endif
+
+namespace pioneer {
+  namespace net {
+
+    namespace mn = muduo::net;
+
+    /*
+     * The datagrams of the cluster group taken off the NIC by AF_XDP, before the kernel's network stack, for the rates
+     * where the stack burns a core even with recvmmsg. An XDP program on the interface redirects the IPv4 UDP packets
+     * to the group and the port, unfragmented and with no IP options, to an AF_XDP socket of the receive queue they
+     * arrive at, every other packet goes on to the stack as before. The frames land in a UMEM, a region shared with the
+     * kernel, the datagrams are handed to the batch callback right where they are, and the frames are given back
+     * to the fill ring once it returns, see mcast_server for the callback.
+     *
+     * The socket of the group is still needed, it joins the group, so the NIC accepts it's frames, and it receives
+     * what the program leaves to the stack, the datagrams looped back on this host and the broadcasts, for example.
+     *
+     * Linux 5.9 for the XDP link, and CAP_NET_ADMIN and CAP_BPF, or root. The kernel copies the frames in if the
+     * driver has no zero copy mode. open() returns false if anything is not supported, nothing is left attached
+     * then, and the socket path carries all. The program is detached once the receiver is closed, or the process
+     * exits, since it's held by the link fd only
+     * */
+    class xdp_receiver {
+    public:
+
+      static const uint32_t frame_size = 4096;
+      static const uint32_t frame_count = 2048;
+      static const uint32_t ring_size = 2048;
+
+    private:
+
+      // the producer and the consumer of a ring mapped from the socket
+      struct ring {
+        ring() : producer(nullptr), consumer(nullptr), desc(nullptr), map(nullptr), map_size(0) {}
+
+        std::atomic<uint32_t>* producer;
+        std::atomic<uint32_t>* consumer;
+        void* desc;
+
+        void* map;
+        size_t map_size;
+      };
+
+      // a socket bound to a receive queue of the interface, with it's own UMEM
+      struct queue_socket {
+        queue_socket() : fd(-1), umem(nullptr) {}
+
+        int fd;
+        char* umem;
+        ring rx;
+        ring fill;
+        std::unique_ptr<mn::Channel> channel;
+      };
+
+    public:
+
+      xdp_receiver(mn::EventLoop* loop, const std::string& group, const std::string& interface, int port = MULTICAST_PORT) :
+        _loop(loop), _group(group), _interface(interface), _port(port), _if_index(0), _map_fd(-1), _prog_fd(-1),
+        _link_fd(-1), _received(0), _dropped(0) {}
+
+      // must be destroyed in the loop thread, after the loop quits if it's not stopped
+      ~xdp_receiver() {
+        close();
+      }
+
+      xdp_receiver(const xdp_receiver&) = delete;
+      xdp_receiver& operator=(const xdp_receiver&) = delete;
+
+    public:
+
+      void set_batch_callback(const mcast_batch_callback& cb) { _on_batch = cb; }
+
+      // attach the program and bind the sockets, false if it's not supported here, the socket path is used then
+      bool open() {
+        in_addr group;
+        if (inet_pton(AF_INET, _group.c_str(), &group) != 1) {
+          LOG(WARNING) << "no AF_XDP for the group " << _group << ", IPv4 only";
+          return false;
+        }
+
+        _if_index = ip::interface_index(_interface);
+        if (!_if_index) {
+          LOG(WARNING) << "no AF_XDP without the interface of the multicast";
+          return false;
+        }
+
+        size_t queues = queue_count();
+
+        if (!create_map(queues) || !load_program(group.s_addr) || !open_sockets(queues) || !attach()) {
+          close();
+          return false;
+        }
+
+        LOG(INFO) << "AF_XDP receives the group " << _group << ":" << _port << " on " << _interface
+            << ", " << queues << " queues";
+
+        return true;
+      }
+
+      // thread safe, the datagrams are received in the loop once it's running
+      void start() {
+        _loop->runInLoop(boost::bind(&xdp_receiver::start_in_loop, this));
+      }
+
+      // detach the program and release the sockets, the loop thread only once started
+      void close() {
+        if (_link_fd != -1) ::close(_link_fd);
+        _link_fd = -1;
+
+        for (queue_socket& s : _sockets) {
+          if (s.channel) {
+            s.channel->disableAll();
+            _loop->removeChannel(s.channel.get());
+            s.channel.reset();
+          }
+
+          unmap(s.rx);
+          unmap(s.fill);
+          if (s.fd != -1) ::close(s.fd);
+          if (s.umem) ::munmap(s.umem, static_cast<size_t>(frame_size) * frame_count);
+        }
+        _sockets.clear();
+
+        if (_prog_fd != -1) ::close(_prog_fd);
+        if (_map_fd != -1) ::close(_map_fd);
+        _prog_fd = _map_fd = -1;
+      }
+
+      // the datagrams handed to the callback, and the frames which are not datagrams of the group
+      uint64_t received() const { return _received.load(std::memory_order_relaxed); }
+
+      uint64_t dropped() const { return _dropped.load(std::memory_order_relaxed); }
+
+    private:
+
+      static long bpf(int cmd, bpf_attr* attr) {
+        return ::syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+      }
+
+      // the combined and the receive channels of the NIC, 1 if the driver does not tell
+      size_t queue_count() const {
+        int fd = ::socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+        if (fd == -1) return 1;
+
+        ethtool_channels channels;
+        std::memset(&channels, 0, sizeof(channels));
+        channels.cmd = ETHTOOL_GCHANNELS;
+
+        ifreq req;
+        std::memset(&req, 0, sizeof(req));
+        if_indextoname(_if_index, req.ifr_name);
+        req.ifr_data = reinterpret_cast<char*>(&channels);
+
+        size_t count = 1;
+        if (::ioctl(fd, SIOCETHTOOL, &req) == 0) count = std::max<size_t>(channels.combined_count + channels.rx_count, 1);
+
+        ::close(fd);
+        return count;
+      }
+
+      bool create_map(size_t queues) {
+        bpf_attr attr;
+        std::memset(&attr, 0, sizeof(attr));
+        attr.map_type = BPF_MAP_TYPE_XSKMAP;
+        attr.key_size = sizeof(uint32_t);
+        attr.value_size = sizeof(uint32_t);
+        attr.max_entries = static_cast<uint32_t>(queues);
+
+        _map_fd = static_cast<int>(bpf(BPF_MAP_CREATE, &attr));
+        if (_map_fd == -1) {
+          LOG(WARNING) << "no AF_XDP, the socket map is not created, " << strerror(errno);
+          return false;
+        }
+
+        return true;
+      }
+
+      static bpf_insn insn(uint8_t code, uint8_t dst, uint8_t src, int16_t off, int32_t imm) {
+        bpf_insn i;
+        i.code = code;
+        i.dst_reg = dst;
+        i.src_reg = src;
+        i.off = off;
+        i.imm = imm;
+
+        return i;
+      }
+
+      /*
+       * The program, by hand, there is no BPF compiler in the build :
+       *
+       *  if the packet is shorter than the headers, or not IPv4, or has options, or is not UDP, or is a fragment,
+       *  or is not to the group and the port, pass it to the stack, or else redirect it to the socket of it's queue,
+       *  and pass it if there is none
+       * */
+      bool load_program(uint32_t group) {
+        const size_t headers = sizeof(ether_header) + 20 + 8;
+        std::vector<bpf_insn> p;
+        std::vector<size_t> to_pass;
+
+        // r6 = ctx, r2 = data, r3 = data_end
+        p.push_back(insn(BPF_ALU64 | BPF_MOV | BPF_X, 6, 1, 0, 0));
+        p.push_back(insn(BPF_LDX | BPF_MEM | BPF_W, 2, 1, offsetof(xdp_md, data), 0));
+        p.push_back(insn(BPF_LDX | BPF_MEM | BPF_W, 3, 1, offsetof(xdp_md, data_end), 0));
+        // if data + headers > data_end, pass
+        p.push_back(insn(BPF_ALU64 | BPF_MOV | BPF_X, 4, 2, 0, 0));
+        p.push_back(insn(BPF_ALU64 | BPF_ADD | BPF_K, 4, 0, 0, static_cast<int32_t>(headers)));
+        to_pass.push_back(p.size());
+        p.push_back(insn(BPF_JMP | BPF_JGT | BPF_X, 4, 3, 0, 0));
+
+        // the fields are compared as they are in the packet, in the network order
+        auto field_ne = [&p, &to_pass](uint8_t size, int16_t offset, int32_t value) {
+          p.push_back(insn(BPF_LDX | BPF_MEM | size, 5, 2, offset, 0));
+          to_pass.push_back(p.size());
+          p.push_back(insn(BPF_JMP | BPF_JNE | BPF_K, 5, 0, 0, value));
+        };
+
+        field_ne(BPF_H, 12, htons(ETH_P_IP));
+        field_ne(BPF_B, 14, 0x45);
+        field_ne(BPF_B, 14 + 9, IPPROTO_UDP);
+
+        // no more fragments and offset 0
+        p.push_back(insn(BPF_LDX | BPF_MEM | BPF_H, 5, 2, 14 + 6, 0));
+        p.push_back(insn(BPF_ALU64 | BPF_AND | BPF_K, 5, 0, 0, htons(0x3fff)));
+        to_pass.push_back(p.size());
+        p.push_back(insn(BPF_JMP | BPF_JNE | BPF_K, 5, 0, 0, 0));
+
+        // the group is compared by a register, an immediate is sign extended to 64 bits
+        p.push_back(insn(BPF_LDX | BPF_MEM | BPF_W, 5, 2, 14 + 16, 0));
+        p.push_back(insn(BPF_LD | BPF_DW | BPF_IMM, 7, 0, 0, static_cast<int32_t>(group)));
+        p.push_back(insn(0, 0, 0, 0, 0));
+        to_pass.push_back(p.size());
+        p.push_back(insn(BPF_JMP | BPF_JNE | BPF_X, 5, 7, 0, 0));
+
+        field_ne(BPF_H, 14 + 20 + 2, htons(static_cast<uint16_t>(_port)));
+
+        // return bpf_redirect_map(&sockets, ctx->rx_queue_index, XDP_PASS)
+        p.push_back(insn(BPF_LDX | BPF_MEM | BPF_W, 2, 6, offsetof(xdp_md, rx_queue_index), 0));
+        p.push_back(insn(BPF_LD | BPF_DW | BPF_IMM, 1, BPF_PSEUDO_MAP_FD, 0, _map_fd));
+        p.push_back(insn(0, 0, 0, 0, 0));
+        p.push_back(insn(BPF_ALU64 | BPF_MOV | BPF_K, 3, 0, 0, XDP_PASS));
+        p.push_back(insn(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_redirect_map));
+        p.push_back(insn(BPF_JMP | BPF_EXIT, 0, 0, 0, 0));
+
+        // pass :
+        size_t pass = p.size();
+        p.push_back(insn(BPF_ALU64 | BPF_MOV | BPF_K, 0, 0, 0, XDP_PASS));
+        p.push_back(insn(BPF_JMP | BPF_EXIT, 0, 0, 0, 0));
+
+        for (size_t j : to_pass) p[j].off = static_cast<int16_t>(pass - j - 1);
+
+        static const char license[] = "GPL";
+        std::vector<char> log(64 * 1024);
+
+        bpf_attr attr;
+        std::memset(&attr, 0, sizeof(attr));
+        attr.prog_type = BPF_PROG_TYPE_XDP;
+        attr.insn_cnt = static_cast<uint32_t>(p.size());
+        attr.insns = reinterpret_cast<uint64_t>(p.data());
+        attr.license = reinterpret_cast<uint64_t>(license);
+        attr.log_level = 1;
+        attr.log_size = static_cast<uint32_t>(log.size());
+        attr.log_buf = reinterpret_cast<uint64_t>(log.data());
+
+        _prog_fd = static_cast<int>(bpf(BPF_PROG_LOAD, &attr));
+        if (_prog_fd == -1) {
+          LOG(WARNING) << "no AF_XDP, the program is not loaded, " << strerror(errno) << "\n" << log.data();
+          return false;
+        }
+
+        return true;
+      }
+
+      bool open_sockets(size_t queues) {
+        for (size_t q = 0; q < queues; ++q) {
+          _sockets.push_back(queue_socket());
+          if (!open_socket(_sockets.back(), static_cast<uint32_t>(q))) return false;
+        }
+
+        return true;
+      }
+
+      bool open_socket(queue_socket& s, uint32_t queue) {
+        size_t umem_size = static_cast<size_t>(frame_size) * frame_count;
+        void* umem = ::mmap(nullptr, umem_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+        if (umem == MAP_FAILED) return fail("the UMEM is not mapped");
+        s.umem = static_cast<char*>(umem);
+
+        s.fd = ::socket(AF_XDP, SOCK_RAW | SOCK_CLOEXEC, 0);
+        if (s.fd == -1) return fail("no AF_XDP socket");
+
+        xdp_umem_reg reg;
+        std::memset(&reg, 0, sizeof(reg));
+        reg.addr = reinterpret_cast<uint64_t>(s.umem);
+        reg.len = umem_size;
+        reg.chunk_size = frame_size;
+        reg.headroom = 0;
+        if (::setsockopt(s.fd, SOL_XDP, XDP_UMEM_REG, &reg, sizeof(reg)) == -1) return fail("the UMEM is not registered");
+
+        // the completion ring is required by the bind, though nothing is sent
+        int size = ring_size;
+        if (::setsockopt(s.fd, SOL_XDP, XDP_UMEM_FILL_RING, &size, sizeof(size)) == -1
+            || ::setsockopt(s.fd, SOL_XDP, XDP_UMEM_COMPLETION_RING, &size, sizeof(size)) == -1
+            || ::setsockopt(s.fd, SOL_XDP, XDP_RX_RING, &size, sizeof(size)) == -1) {
+          return fail("the rings are not sized");
+        }
+
+        xdp_mmap_offsets off;
+        socklen_t len = sizeof(off);
+        if (::getsockopt(s.fd, SOL_XDP, XDP_MMAP_OFFSETS, &off, &len) == -1) return fail("no ring offsets");
+
+        if (!map(s.fd, off.rx, ring_size * sizeof(xdp_desc), XDP_PGOFF_RX_RING, s.rx)
+            || !map(s.fd, off.fr, ring_size * sizeof(uint64_t), XDP_UMEM_PGOFF_FILL_RING, s.fill)) {
+          return fail("the rings are not mapped");
+        }
+
+        // every frame is the kernel's to fill
+        uint64_t* addrs = static_cast<uint64_t*>(s.fill.desc);
+        uint32_t filled = std::min(frame_count, ring_size);
+        for (uint32_t i = 0; i < filled; ++i) addrs[i] = static_cast<uint64_t>(i) * frame_size;
+        s.fill.producer->store(filled, std::memory_order_release);
+
+        sockaddr_xdp addr;
+        std::memset(&addr, 0, sizeof(addr));
+        addr.sxdp_family = AF_XDP;
+        addr.sxdp_ifindex = _if_index;
+        addr.sxdp_queue_id = queue;
+        if (::bind(s.fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == -1) return fail("the socket is not bound");
+
+        bpf_attr attr;
+        std::memset(&attr, 0, sizeof(attr));
+        attr.map_fd = _map_fd;
+        attr.key = reinterpret_cast<uint64_t>(&queue);
+        attr.value = reinterpret_cast<uint64_t>(&s.fd);
+        if (bpf(BPF_MAP_UPDATE_ELEM, &attr) == -1) return fail("the socket is not in the map");
+
+        return true;
+      }
+
+      bool attach() {
+        bpf_attr attr;
+        std::memset(&attr, 0, sizeof(attr));
+        attr.link_create.prog_fd = _prog_fd;
+        attr.link_create.target_ifindex = _if_index;
+        attr.link_create.attach_type = BPF_XDP;
+
+        _link_fd = static_cast<int>(bpf(BPF_LINK_CREATE, &attr));
+
+        // the driver has no XDP of it's own, the generic one runs it once the stack has a buffer, slower, yet it's not copied twice
+        if (_link_fd == -1 && errno == EOPNOTSUPP) {
+          attr.link_create.flags = XDP_FLAGS_SKB_MODE;
+          _link_fd = static_cast<int>(bpf(BPF_LINK_CREATE, &attr));
+        }
+
+        if (_link_fd == -1) return fail("the program is not attached");
+
+        return true;
+      }
+
+      static bool fail(const char* what) {
+        LOG(WARNING) << "no AF_XDP, " << what << ", " << strerror(errno);
+        return false;
+      }
+
+      static bool map(int fd, const xdp_ring_offset& off, size_t desc_size, off_t pgoff, ring& r) {
+        r.map_size = off.desc + desc_size;
+        r.map = ::mmap(nullptr, r.map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, pgoff);
+        if (r.map == MAP_FAILED) {
+          r.map = nullptr;
+          return false;
+        }
+
+        char* base = static_cast<char*>(r.map);
+        r.producer = reinterpret_cast<std::atomic<uint32_t>*>(base + off.producer);
+        r.consumer = reinterpret_cast<std::atomic<uint32_t>*>(base + off.consumer);
+        r.desc = base + off.desc;
+
+        return true;
+      }
+
+      static void unmap(ring& r) {
+        if (r.map) ::munmap(r.map, r.map_size);
+        r = ring();
+      }
+
+      void start_in_loop() {
+        for (queue_socket& s : _sockets) {
+          if (s.channel) continue;
+
+          s.channel.reset(new mn::Channel(_loop, s.fd));
+          s.channel->setReadCallback(boost::bind(&xdp_receiver::on_readable, this, &s));
+          s.channel->enableReading();
+        }
+      }
+
+      // the frames received in batches of RECV_BATCH_SIZE, and given back to the fill ring after every batch
+      void on_readable(queue_socket* s) {
+        for (int batch = 0; batch < mcast_server::MAX_BATCHES_PER_EVENT; ++batch) {
+          uint32_t consumer = s->rx.consumer->load(std::memory_order_relaxed);
+          uint32_t available = s->rx.producer->load(std::memory_order_acquire) - consumer;
+          if (!available) return;
+
+          uint32_t count = std::min<uint32_t>(available, RECV_BATCH_SIZE);
+          const xdp_desc* descs = static_cast<const xdp_desc*>(s->rx.desc);
+
+          size_t n = 0;
+          for (uint32_t i = 0; i < count; ++i) {
+            const xdp_desc& d = descs[(consumer + i) & (ring_size - 1)];
+            _addrs[i] = d.addr;
+
+            if (parse(s->umem + d.addr, d.len, _datagrams[n])) ++n;
+            else _dropped.fetch_add(1, std::memory_order_relaxed);
+          }
+
+          if (n && _on_batch) _on_batch(_datagrams.data(), n);
+          _received.fetch_add(n, std::memory_order_relaxed);
+
+          s->rx.consumer->store(consumer + count, std::memory_order_release);
+
+          // the fill ring holds every frame the rx ring does not, so there is always room
+          uint32_t producer = s->fill.producer->load(std::memory_order_relaxed);
+          uint64_t* addrs = static_cast<uint64_t*>(s->fill.desc);
+          for (uint32_t i = 0; i < count; ++i) addrs[(producer + i) & (ring_size - 1)] = _addrs[i] & ~static_cast<uint64_t>(frame_size - 1);
+          s->fill.producer->store(producer + count, std::memory_order_release);
+
+          if (count < RECV_BATCH_SIZE) return;
+        }
+      }
+
+      // the UDP payload of an Ethernet frame the program let through, the lengths are checked again
+      static bool parse(const char* frame, uint32_t len, mcast_datagram& d) {
+        const size_t ip_offset = sizeof(ether_header), udp_offset = ip_offset + 20, payload_offset = udp_offset + 8;
+        if (len < payload_offset) return false;
+
+        uint16_t udp_len = 0;
+        std::memcpy(&udp_len, frame + udp_offset + 4, sizeof(udp_len));
+        udp_len = ntohs(udp_len);
+        if (udp_len < 8 || udp_offset + udp_len > len) return false;
+
+        std::memset(&d.source, 0, sizeof(d.source));
+        d.source.sin_family = AF_INET;
+        std::memcpy(&d.source.sin_addr.s_addr, frame + ip_offset + 12, sizeof(uint32_t));
+        std::memcpy(&d.source.sin_port, frame + udp_offset, sizeof(uint16_t));
+
+        d.data = frame + payload_offset;
+        d.size = udp_len - 8;
+        // the frames bypass the stack, no skb, no stamp
+        d.received = 0;
+
+        return true;
+      }
+
+    private:
+
+      mn::EventLoop* _loop;
+      const std::string _group;
+      const std::string _interface;
+      const int _port;
+
+      unsigned _if_index;
+      int _map_fd;
+      int _prog_fd;
+      int _link_fd;
+
+      // the sockets are never added once started, so the channels may point at them
+      std::vector<queue_socket> _sockets;
+
+      mcast_batch_callback _on_batch;
+      std::array<mcast_datagram, RECV_BATCH_SIZE> _datagrams;
+      std::array<uint64_t, RECV_BATCH_SIZE> _addrs;
+
+      std::atomic<uint64_t> _received;
+      std::atomic<uint64_t> _dropped;
+    };
+
+  } // net
+} // pioneer
+
+#endif /* PIONEER_NET_XDP_RECEIVER_H_ */
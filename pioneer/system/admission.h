@@ -0,0 +1,113 @@
+/*
+ * admission.h
+ *
+ *  Created on: Sep 4, 2013
+ *      Author: vincent
+ */
+
+/*    Copyright 2011 ~ 2013 Vincent Zhang, ivincent.zhang@gmail.com
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#ifndef PIONEER_SYSTEM_ADMISSION_H_
+#define PIONEER_SYSTEM_ADMISSION_H_
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+
+#include <glog/logging.h>
+#include <atlas/singleton.h>
+#include <atlas/codel.h>
+
+#include <pioneer/system/thread_pool.h>
+
+namespace pioneer {
+  namespace system {
+
+    /*
+     * The overload protection of the data plane requests, they are rejected by the busy error in two places
+     *  1. at the door, the worker pool holds at most max_pending tasks, see work_stealing_scheduler::set_capacity
+     *  2. at the head of the queue, a request which has waited too long is shed by CoDel, since it's caller may
+     *     already give up, see atlas::codel
+     * The control plane requests are never rejected
+     * */
+    class admission_control : public atlas::singleton<admission_control> {
+    public:
+
+      typedef atlas::codel::clock clock;
+
+    private:
+
+      friend class atlas::singleton<admission_control>;
+      admission_control(const admission_control&) = delete;
+      admission_control& operator=(const admission_control&) = delete;
+
+    public:
+
+      admission_control() : _enabled(false), _shed(0) {}
+
+    public:
+
+      void set_codel(clock::duration target, clock::duration interval) {
+        std::lock_guard<std::mutex> guard(_mutex);
+
+        _codel.reset(target, interval);
+        _enabled = _codel.enabled();
+      }
+
+      // called by the worker which is going to execute the request
+      bool admit(clock::time_point enqueued) {
+        if (!_enabled.load(std::memory_order_relaxed)) return true;
+
+        clock::time_point now = clock::now();
+
+        std::lock_guard<std::mutex> guard(_mutex);
+        return !_codel.should_drop(now - enqueued, now);
+      }
+
+      // the requests shed by both the bound and CoDel
+      void count_shed() { ++_shed; }
+
+      unsigned long long shed() const { return _shed.load(); }
+
+    private:
+
+      std::atomic<bool> _enabled;
+      std::mutex _mutex;
+      atlas::codel _codel;
+
+      std::atomic<unsigned long long> _shed;
+    };
+
+    /*
+     * max_pending : the bound of the worker pool's queue, 0 means unbounded
+     * codel_target : the standing queue delay to shed at, in seconds, 0 disables CoDel
+     * codel_interval : how long the delay must stand before shedding, in seconds
+     * */
+    inline void init_admission_control(size_t max_pending, double codel_target, double codel_interval) {
+      worker_pool::ref().set_max_pending(max_pending);
+
+      std::chrono::duration<double> target(codel_target);
+      std::chrono::duration<double> interval(codel_interval);
+      admission_control::ref().set_codel(std::chrono::duration_cast<admission_control::clock::duration>(target),
+          std::chrono::duration_cast<admission_control::clock::duration>(interval));
+
+      LOG(INFO) << "admission control : max pending " << max_pending << ", codel target " << codel_target << "s";
+    }
+
+  } // system
+} // pioneer
+
+#endif /* PIONEER_SYSTEM_ADMISSION_H_ */
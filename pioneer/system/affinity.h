@@ -0,0 +1,111 @@
+/*
+ * affinity.h
+ *
+ *  Created on: Sep 4, 2013
+ *      Author: vincent
+ */
+
+/*    Copyright 2011 ~ 2013 Vincent Zhang, ivincent.zhang@gmail.com
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#ifndef PIONEER_SYSTEM_AFFINITY_H_
+#define PIONEER_SYSTEM_AFFINITY_H_
+
+#include <pthread.h>
+#include <sched.h>
+
+#include <cstdlib>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include <boost/algorithm/string.hpp>
+#include <glog/logging.h>
+
+namespace pioneer {
+  namespace system {
+
+    // CPU lists in the kernel's format, "0-3,8,10-11", and the placement of the current thread
+    class affinity {
+    public:
+
+      // the CPUs of the list, empty if the list is malformed
+      static std::vector<int> parse_cpu_list(const std::string& list) {
+        std::vector<int> cpus;
+
+        std::vector<std::string> ranges;
+        boost::split(ranges, list, boost::is_any_of(","), boost::token_compress_on);
+
+        for (auto range : ranges) {
+          boost::trim(range);
+          if (range.empty()) continue;
+
+          char* end = nullptr;
+          long first = std::strtol(range.c_str(), &end, 10);
+          long last = first;
+          if (*end == '-') last = std::strtol(end + 1, &end, 10);
+
+          if (*end || first < 0 || last < first || last >= CPU_SETSIZE) {
+            LOG(ERROR) << "bad cpu list " << list;
+            return std::vector<int>();
+          }
+
+          for (long cpu = first; cpu <= last; ++cpu) cpus.push_back(static_cast<int>(cpu));
+        }
+
+        return cpus;
+      }
+
+      // the CPUs of a NUMA node, empty if there is no such node
+      static std::vector<int> node_cpus(int node) {
+        if (node < 0) return std::vector<int>();
+
+        std::ifstream file("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+
+        std::string list;
+        if (!std::getline(file, list)) {
+          LOG(ERROR) << "no numa node " << node;
+          return std::vector<int>();
+        }
+
+        return parse_cpu_list(list);
+      }
+
+      static bool pin_current_thread(int cpu) {
+        return pin_current_thread(std::vector<int>(1, cpu));
+      }
+
+      // the thread runs on any of the CPUs
+      static bool pin_current_thread(const std::vector<int>& cpus) {
+        if (cpus.empty()) return false;
+
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for (int cpu : cpus) CPU_SET(cpu, &set);
+
+        int error = ::pthread_setaffinity_np(::pthread_self(), sizeof(set), &set);
+        if (error) {
+          LOG(ERROR) << "failed to set the cpu affinity, error " << error;
+          return false;
+        }
+
+        return true;
+      }
+    };
+
+  } // system
+} // pioneer
+
+#endif /* PIONEER_SYSTEM_AFFINITY_H_ */
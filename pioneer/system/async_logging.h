@@ -0,0 +1,422 @@
+/*
+ * async_logging.h
+ *
+ *  Created on: Sep 6, 2013
+ *      Author: vincent
+ */
+
+/*    Copyright 2011 ~ 2013 Vincent Zhang, ivincent.zhang@gmail.com
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#ifndef PIONEER_SYSTEM_ASYNC_LOGGING_H_
+#define PIONEER_SYSTEM_ASYNC_LOGGING_H_
+
+#include <pthread.h>
+
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <glog/logging.h>
+#include <atlas/singleton.h>
+#include <atlas/container/ring_buffer.h>
+
+namespace pioneer {
+  namespace system {
+
+    /*
+     * The asynchronous backend of glog, like muduo::AsyncLogging, the lines formatted by glog are appended to the
+     * buffer of the calling thread, with no lock and no system call, and a background thread writes them to the log
+     * files of glog every flush_interval, or once a buffer is full. The log files are still written, rolled and named
+     * by glog, the backend stands between glog and it's file loggers, see google::base::SetLogger.
+     *
+     * A buffer is single producer, the owner appends and publishes the committed size, the flusher writes what's
+     * committed and remembers where it stops, so a buffer is written while it's filled. A full buffer is sealed, handed
+     * to the flusher, and replaced by a new one. The lines are dropped if the flusher falls behind more than
+     * max_sealed buffers of a thread, like muduo does, the I/O threads never wait for the disk.
+     *
+     * The lines of a thread are in order, the lines of different threads are interleaved per flush, the timestamps of
+     * glog tell the order. A FATAL line, and Flush(), write everything before they return.
+     *
+     * The records of other files than the log ones go the same way, a sink is added for the file, and the records
+     * written to it are buffered with the lines, see net::traffic_capture. A record larger than a buffer, and any
+     * record while the backend is not started, is written in the calling thread
+     * */
+    class async_logging : public atlas::singleton<async_logging> {
+    public:
+
+      static const size_t buffer_size = 64 * 1024;
+      static const size_t max_sealed = 16;
+
+      // a file the records are written to by the flusher
+      class sink {
+      public:
+
+        virtual ~sink() {}
+
+        virtual void write(const char* data, size_t size) = 0;
+
+        virtual void flush() = 0;
+      };
+
+      typedef std::shared_ptr<sink> sink_ptr;
+
+    private:
+
+      friend class atlas::singleton<async_logging>;
+      async_logging(const async_logging&) = delete;
+      async_logging& operator=(const async_logging&) = delete;
+
+      // a record is the size, the severity and the line, or the record of a sink, the severity is -1 - the sink
+      struct record_header {
+        uint32_t size;
+        int32_t severity;
+      };
+
+      struct buffer {
+        buffer() : committed(0), flushed(0) {}
+
+        char data[buffer_size];
+        // written by the owner
+        std::atomic<size_t> committed;
+        // the flusher only
+        size_t flushed;
+      };
+
+      struct thread_log {
+        thread_log() : current(new buffer), sealed(max_sealed), closed(false), dropped(0) {}
+
+        ~thread_log() { delete current.load(std::memory_order_relaxed); }
+
+        std::atomic<buffer*> current;
+        atlas::spsc_ring<buffer*> sealed;
+        std::atomic<bool> closed;
+        std::atomic<unsigned long long> dropped;
+      };
+
+      // the logger of a severity installed into glog, see start()
+      class logger : public google::base::Logger {
+      public:
+
+        logger(int severity, google::base::Logger* file) : _severity(severity), _file(file) {}
+
+        virtual void Write(bool force_flush, time_t timestamp, const char* message, int message_len) {
+          async_logging::ref().append(_severity, nullptr, 0, message, message_len, force_flush);
+        }
+
+        virtual void Flush() { async_logging::ref().flush(); }
+
+        virtual google::uint32 LogSize() { return _file->LogSize(); }
+
+        google::base::Logger* file() const { return _file; }
+
+      private:
+
+        int _severity;
+        google::base::Logger* _file;
+      };
+
+    public:
+
+      async_logging() : _dropped(0), _running(false), _wakeup(false) {
+        ::pthread_key_create(&_exit_key, &async_logging::on_thread_exit);
+        for (int s = 0; s < google::NUM_SEVERITIES; ++s) _files[s] = nullptr;
+      }
+
+      ~async_logging() { stop(); }
+
+    public:
+
+      // put the backend between glog and it's log files, called once glog is initialized
+      void start(double flush_interval) {
+        {
+          std::lock_guard<std::mutex> guard(_mutex);
+          if (_running) return;
+
+          for (int s = 0; s < google::NUM_SEVERITIES; ++s) _files[s] = google::base::GetLogger(s);
+
+          _flush_interval = std::chrono::milliseconds(static_cast<long long>(flush_interval * 1000));
+          _running = true;
+          _flusher = std::thread(&async_logging::run, this);
+        }
+
+        // out of the mutex, glog holds it's own lock while it calls the loggers, glog owns the loggers
+        for (int s = 0; s < google::NUM_SEVERITIES; ++s) google::base::SetLogger(s, new logger(s, _files[s]));
+      }
+
+      // write everything and stop the flusher, the lines logged later are written by the callers
+      void stop() {
+        {
+          std::lock_guard<std::mutex> guard(_mutex);
+          if (!_running) return;
+
+          _running = false;
+        }
+
+        wakeup();
+        _flusher.join();
+
+        flush();
+      }
+
+      // write all the lines committed, by all the threads, and flush the files
+      void flush() {
+        std::lock_guard<std::mutex> guard(_mutex);
+        flush_all();
+      }
+
+      // the id to write the records of the sink by, the records are written in the order of each thread
+      int add_sink(const sink_ptr& s) {
+        std::lock_guard<std::mutex> guard(_mutex);
+
+        _sinks.push_back(s);
+        return static_cast<int>(_sinks.size() - 1);
+      }
+
+      // the records written before are flushed, the later ones are dropped
+      void remove_sink(int id) {
+        std::lock_guard<std::mutex> guard(_mutex);
+
+        flush_all();
+        _sinks[id].reset();
+      }
+
+      // the header and the data are one record, so a reader never finds one without the other
+      void write(int sink, const char* header, size_t header_size, const char* data, size_t size) {
+        append(-1 - sink, header, header_size, data, size, false);
+      }
+
+      unsigned long long dropped() const {
+        std::lock_guard<std::mutex> guard(_mutex);
+
+        unsigned long long n = _dropped;
+        for (const thread_log* t : _threads) n += t->dropped.load(std::memory_order_relaxed);
+
+        return n;
+      }
+
+    private:
+
+      void append(int severity, const char* prefix, size_t prefix_size, const char* message, size_t size, bool force_flush) {
+        if (!_running.load(std::memory_order_relaxed)) {
+          write_through(severity, prefix, prefix_size, message, size);
+          return;
+        }
+
+        size_t required = sizeof(record_header) + prefix_size + size;
+        if (required > buffer_size) {
+          write_through(severity, prefix, prefix_size, message, size);
+          return;
+        }
+
+        thread_log& t = local();
+        buffer* b = t.current.load(std::memory_order_relaxed);
+        size_t used = b->committed.load(std::memory_order_relaxed);
+
+        if (used + required > buffer_size) {
+          if (!t.sealed.try_push(b)) {
+            // the flusher is far behind, keep the buffer
+            t.dropped.store(t.dropped.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+            return;
+          }
+
+          // published after the sealed one, see flush_thread
+          b = new buffer;
+          t.current.store(b, std::memory_order_release);
+          used = 0;
+
+          wakeup();
+        }
+
+        record_header h = { static_cast<uint32_t>(prefix_size + size), severity };
+        std::memcpy(b->data + used, &h, sizeof(h));
+        if (prefix_size) std::memcpy(b->data + used + sizeof(h), prefix, prefix_size);
+        std::memcpy(b->data + used + sizeof(h) + prefix_size, message, size);
+        b->committed.store(used + required, std::memory_order_release);
+
+        if (severity == google::FATAL) flush();
+        else if (force_flush) wakeup();
+      }
+
+      // the line is written in the calling thread, after the lines before of the thread
+      void write_through(int severity, const char* prefix, size_t prefix_size, const char* message, size_t size) {
+        std::lock_guard<std::mutex> guard(_mutex);
+
+        flush_all();
+        if (severity < 0) {
+          const sink_ptr& s = _sinks[-1 - severity];
+          if (s && prefix_size) s->write(prefix, prefix_size);
+          if (s) s->write(message, size);
+
+          return;
+        }
+
+        google::base::Logger* file = _files[severity];
+        if (file) {
+          file->Write(true, std::time(nullptr), message, static_cast<int>(size));
+        }
+      }
+
+      void wakeup() {
+        {
+          std::lock_guard<std::mutex> guard(_wakeup_mutex);
+          _wakeup = true;
+        }
+        _wakeup_cond.notify_one();
+      }
+
+      void run() {
+        while (_running.load()) {
+          {
+            std::unique_lock<std::mutex> lock(_wakeup_mutex);
+            _wakeup_cond.wait_for(lock, _flush_interval, [this]() { return _wakeup; });
+            _wakeup = false;
+          }
+
+          flush();
+        }
+      }
+
+      // the mutex is held
+      void flush_all() {
+        for (size_t i = 0; i < _threads.size();) {
+          thread_log* t = _threads[i];
+          flush_thread(*t);
+
+          // the thread is gone, and so are it's lines
+          if (t->closed.load(std::memory_order_acquire)) {
+            flush_thread(*t);
+            _dropped += t->dropped.load(std::memory_order_relaxed);
+
+            _threads[i] = _threads.back();
+            _threads.pop_back();
+            delete t;
+          }
+          else {
+            ++i;
+          }
+        }
+
+        for (int s = 0; s < google::NUM_SEVERITIES; ++s) {
+          if (_files[s]) _files[s]->Flush();
+        }
+
+        for (const sink_ptr& s : _sinks) {
+          if (s) s->flush();
+        }
+      }
+
+      // the flusher, or the mutex is held
+      void flush_thread(thread_log& t) {
+        // the buffers sealed before the current one is installed are all in the ring then
+        buffer* current = t.current.load(std::memory_order_acquire);
+
+        std::vector<buffer*> done;
+        buffer* b = nullptr;
+        while (t.sealed.try_pop(b)) {
+          write_buffer(*b);
+          done.push_back(b);
+        }
+
+        write_buffer(*current);
+
+        // the current one may be sealed and taken above, it's written, so it's freed here
+        for (buffer* d : done) delete d;
+      }
+
+      void write_buffer(buffer& b) {
+        size_t committed = b.committed.load(std::memory_order_acquire);
+        time_t now = std::time(nullptr);
+
+        while (b.flushed < committed) {
+          record_header h;
+          std::memcpy(&h, b.data + b.flushed, sizeof(h));
+
+          if (h.severity < 0) {
+            const sink_ptr& s = _sinks[-1 - h.severity];
+            if (s) s->write(b.data + b.flushed + sizeof(h), h.size);
+          }
+          else {
+            google::base::Logger* file = _files[h.severity];
+            if (file) file->Write(false, now, b.data + b.flushed + sizeof(h), h.size);
+          }
+
+          b.flushed += sizeof(h) + h.size;
+        }
+      }
+
+      thread_log& local() {
+        // gcc 4.7 does not support thread_local
+        static __thread thread_log* t = nullptr;
+        if (!t) {
+          t = new thread_log;
+
+          std::lock_guard<std::mutex> guard(_mutex);
+          _threads.push_back(t);
+          ::pthread_setspecific(_exit_key, &t);
+        }
+
+        return *t;
+      }
+
+      // the lines are written by the flusher later, a thread logs again on exit gets a new log
+      static void on_thread_exit(void* p) {
+        thread_log*& t = *static_cast<thread_log**>(p);
+
+        t->closed.store(true, std::memory_order_release);
+        t = nullptr;
+      }
+
+    private:
+
+      pthread_key_t _exit_key;
+      google::base::Logger* _files[google::NUM_SEVERITIES];
+      // by their ids, a removed one is null
+      std::vector<sink_ptr> _sinks;
+
+      mutable std::mutex _mutex;
+      std::vector<thread_log*> _threads;
+      unsigned long long _dropped;
+
+      std::atomic<bool> _running;
+      std::chrono::milliseconds _flush_interval;
+      std::thread _flusher;
+
+      std::mutex _wakeup_mutex;
+      std::condition_variable _wakeup_cond;
+      bool _wakeup;
+    };
+
+    /*
+     * flush_interval : how often the lines are written to the log files, in seconds
+     * */
+    inline void init_async_logging(double flush_interval) {
+      async_logging::ref().start(flush_interval);
+
+      LOG(INFO) << "asynchronous logging : flush every " << flush_interval << "s";
+    }
+
+  } // system
+} // pioneer
+
+#endif /* PIONEER_SYSTEM_ASYNC_LOGGING_H_ */
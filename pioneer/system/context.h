@@ -29,9 +29,22 @@
 #include <mutex>
 #include <condition_variable>
 
+#include <atlas/container/hash_ring.h>
+#include <atlas/versioned_snapshot.h>
+
 namespace pioneer {
   namespace system {
 
+    // the nodes we are connected to, never modified once published, see versioned_snapshot
+    struct membership {
+      std::set<std::string> ip_list;
+      // the same nodes on a consistent hash ring, used to route the requests by key
+      atlas::hash_ring ring;
+    };
+
+    struct outside_tag {};
+    struct inside_tag {};
+
     struct context {
       static std::string local_ip;
 
@@ -41,12 +54,9 @@ namespace pioneer {
       static std::atomic<int> outside_node_count;
       static std::atomic<int> inner_node_count;
 
-      // ip list
-      // TODO : change to concurrent_skip_list
-      // static atlas::concurrent_skip_list<std::string> outside_ip_list;
-      // static atlas::concurrent_skip_list<std::string> inside_ip_list;
-      static std::set<std::string> outside_ip_list;
-      static std::set<std::string> inside_ip_list;
+      // the membership snapshots, reading them takes no lock
+      static atlas::versioned_snapshot<membership, outside_tag> outside_nodes;
+      static atlas::versioned_snapshot<membership, inside_tag> inside_nodes;
 
       // mutex for common usage for all context variables
       static std::mutex mutex;
@@ -60,8 +70,8 @@ namespace pioneer {
     std::atomic<int> context::outside_node_count = ATOMIC_VAR_INIT(0);
     std::atomic<int> context::inner_node_count = ATOMIC_VAR_INIT(0);
 
-    std::set<std::string> context::outside_ip_list;
-    std::set<std::string> context::inside_ip_list;
+    atlas::versioned_snapshot<membership, outside_tag> context::outside_nodes;
+    atlas::versioned_snapshot<membership, inside_tag> context::inside_nodes;
 
     std::mutex context::mutex;
 
@@ -0,0 +1,238 @@
+/*
+ * numa.h
+ *
+ *  Created on: Sep 28, 2013
+ *      Author: vincent
+ */
+
+/*    Copyright 2011 ~ 2013 Vincent Zhang, ivincent.zhang@gmail.com
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#ifndef PIONEER_SYSTEM_NUMA_H_
+#define PIONEER_SYSTEM_NUMA_H_
+
+#include <algorithm>
+#include <atomic>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <glog/logging.h>
+#include <atlas/singleton.h>
+#include <atlas/numa.h>
+
+#include <pioneer/system/affinity.h>
+
+namespace pioneer {
+  namespace system {
+
+    // the nodes of the box and their CPUs, read from sysfs, one node if there is no NUMA
+    class numa_topology {
+    public:
+
+      numa_topology() {
+        std::ifstream file("/sys/devices/system/node/online");
+
+        std::string list;
+        if (std::getline(file, list)) {
+          for (int node : affinity::parse_cpu_list(list)) {
+            std::vector<int> cpus = affinity::node_cpus(node);
+            if (cpus.empty()) continue;
+
+            _nodes.push_back(node);
+            for (int cpu : cpus) _cpu_nodes[cpu] = node;
+            _cpus[node] = cpus;
+          }
+        }
+      }
+
+    public:
+
+      // the online nodes with CPUs, in order
+      const std::vector<int>& nodes() const { return _nodes; }
+
+      const std::vector<int>& cpus(int node) const {
+        static const std::vector<int> none;
+
+        auto it = _cpus.find(node);
+        return it == _cpus.end() ? none : it->second;
+      }
+
+      // -1 if it's not known
+      int node_of_cpu(int cpu) const {
+        auto it = _cpu_nodes.find(cpu);
+        return it == _cpu_nodes.end() ? -1 : it->second;
+      }
+
+      // the node the NIC is attached to, -1 if it's not known, a virtual one for example
+      static int interface_node(const std::string& interface) {
+        if (interface.empty()) return -1;
+
+        std::ifstream file("/sys/class/net/" + interface + "/device/numa_node");
+
+        int node = -1;
+        if (!(file >> node)) return -1;
+
+        return node;
+      }
+
+    private:
+
+      std::vector<int> _nodes;
+      std::map<int, std::vector<int>> _cpus;
+      std::map<int, int> _cpu_nodes;
+    };
+
+    enum class numa_policy {
+      off,      // the threads float, as the kernel places them
+      spread,   // the I/O loops and the workers spread evenly over the nodes
+      nic       // the I/O loops and the workers on the node of the NIC only
+    };
+
+    /*
+     * The placement of the I/O loops and the workers on the NUMA nodes, so a request is read, run and answered
+     * on one node, and the memory it touches is on that node.
+     *
+     * Every I/O loop and every worker is pinned to the CPUs of a node, round robin over the nodes used, and marks
+     * the node, see atlas::current_numa_node. The worker pool has an injection ring per node, an I/O loop
+     * schedules into the ring of it's node, and the workers of the node take from it first, so the workers of a
+     * node are it's shard, and an idle node still helps a busy one. The arenas of the threads are first touched
+     * by their own threads, and the huge page regions prefer the node of the thread which maps them, see
+     * atlas::memory::huge_page_resource.
+     *
+     * With spread, every node, and the NIC on it, has it's own I/O loops and workers, with nic, the ones of the
+     * node of the NIC take everything, for a box with one NIC where the other nodes run something else. Nothing
+     * is done on a box of one node. Configured once at startup, before any loop or worker starts
+     * */
+    class numa_placement : public atlas::singleton<numa_placement> {
+    private:
+
+      friend class atlas::singleton<numa_placement>;
+      numa_placement(const numa_placement&) = delete;
+      numa_placement& operator=(const numa_placement&) = delete;
+
+    public:
+
+      // public for std::make_shared, see atlas::singleton
+      numa_placement() : _policy(numa_policy::off), _next_io(0), _next_worker(0) {}
+
+    public:
+
+      static bool named(const std::string& name, numa_policy* policy) {
+        if (name == "off") *policy = numa_policy::off;
+        else if (name == "spread") *policy = numa_policy::spread;
+        else if (name == "nic") *policy = numa_policy::nic;
+        else return false;
+
+        return true;
+      }
+
+      // false if the policy can not be taken, nic without the node of the interface
+      bool configure(numa_policy policy, const std::string& interface) {
+        _nodes.clear();
+        _policy = numa_policy::off;
+
+        if (policy == numa_policy::off) return true;
+
+        if (_topology.nodes().size() < 2) {
+          LOG(INFO) << "one numa node, nothing to place";
+          return true;
+        }
+
+        if (policy == numa_policy::nic) {
+          int node = numa_topology::interface_node(interface);
+          if (node < 0 || _topology.cpus(node).empty()) {
+            LOG(ERROR) << "the numa node of the interface " << (interface.empty() ? "none" : interface) << " is not known";
+            return false;
+          }
+
+          _nodes.push_back(node);
+        }
+        else {
+          _nodes = _topology.nodes();
+        }
+
+        _policy = policy;
+        LOG(INFO) << "numa placement : " << (policy == numa_policy::nic ? "nic" : "spread") << ", " << _nodes.size()
+            << " nodes used of " << _topology.nodes().size();
+
+        return true;
+      }
+
+      bool enabled() const { return _policy != numa_policy::off; }
+
+      // the injection rings of the worker pool, by the node ids, see atlas::numa_slot
+      size_t slots() const {
+        int max = 0;
+        for (int n : _nodes) max = std::max(max, n);
+
+        return enabled() ? static_cast<size_t>(max) + 1 : 1;
+      }
+
+      // the next I/O loop thread, called in the thread
+      void place_io_thread() {
+        if (enabled()) place(_nodes[_next_io.fetch_add(1) % _nodes.size()]);
+      }
+
+      // the next worker, called in the thread
+      void place_worker() {
+        if (enabled()) place(_nodes[_next_worker.fetch_add(1) % _nodes.size()]);
+      }
+
+      // a thread pinned to the CPU by other means, a core loop for example, marks the node
+      void placed_on_cpu(int cpu) {
+        if (!enabled()) return;
+
+        atlas::current_numa_node() = _topology.node_of_cpu(cpu);
+      }
+
+      std::string str() const {
+        std::ostringstream os;
+        os << "policy : " << (_policy == numa_policy::off ? "off" : _policy == numa_policy::nic ? "nic" : "spread") << "\n";
+        for (int node : _topology.nodes()) {
+          bool used = false;
+          for (int n : _nodes) used = used || n == node;
+
+          os << "node " << node << " : " << _topology.cpus(node).size() << " cpus" << (used ? ", used" : "") << "\n";
+        }
+        os << "io threads placed : " << _next_io.load() << "\n"
+            << "workers placed : " << _next_worker.load() << "\n";
+
+        return os.str();
+      }
+
+    private:
+
+      void place(int node) {
+        affinity::pin_current_thread(_topology.cpus(node));
+        atlas::current_numa_node() = node;
+      }
+
+    private:
+
+      numa_topology _topology;
+      numa_policy _policy;
+      std::vector<int> _nodes;
+
+      std::atomic<size_t> _next_io;
+      std::atomic<size_t> _next_worker;
+    };
+
+  } // system
+} // pioneer
+
+#endif /* PIONEER_SYSTEM_NUMA_H_ */
@@ -0,0 +1,342 @@
+/*
+ * profiler.h
+ *
+ *  Created on: Sep 6, 2013
+ *      Author: vincent
+ */
+
+/*    Copyright 2011 ~ 2013 Vincent Zhang, ivincent.zhang@gmail.com
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#ifndef PIONEER_SYSTEM_PROFILER_H_
+#define PIONEER_SYSTEM_PROFILER_H_
+
+#include <errno.h>
+#include <execinfo.h>
+#include <malloc.h>
+#include <signal.h>
+#include <sys/prctl.h>
+#include <sys/time.h>
+
+#include <cctype>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <glog/logging.h>
+#include <atlas/memory/jemalloc.h>
+
+namespace pioneer {
+  namespace system {
+
+    // the role of a thread is it's name without the number, the thread "outward io 3" is an "outward io"
+    inline std::string thread_role(const char* name) {
+      std::string role(name);
+      while (!role.empty() && (std::isdigit(role.back()) || role.back() == ' ' || role.back() == '_')) role.pop_back();
+
+      return role.empty() ? std::string("unnamed") : role;
+    }
+
+    // the name of the calling thread, seen by top -H, gdb and the profiler, the kernel keeps 15 characters,
+    // the thread allocates from the arena of it's role on jemalloc, see atlas::memory::role_arenas
+    inline void set_thread_name(const std::string& name) {
+      ::prctl(PR_SET_NAME, name.substr(0, 15).c_str(), 0, 0, 0);
+      atlas::memory::role_arenas::ref().bind(thread_role(name.c_str()));
+    }
+
+    /*
+     * A sampling CPU profiler always on in production, like the one of gperftools.
+     *
+     * SIGPROF is sent every 1/hz second of CPU time the process consumes, to the thread which consumes it, the
+     * handler takes the stack and the name of the thread into a free slot of a fixed table, with no lock and no
+     * allocation. The housekeeping loop moves the samples into per second windows, see collect(), the latest
+     * window_count windows are kept, so a profile of the last N seconds is served at once, without profiling on
+     * demand in the report server's loop.
+     *
+     * The profiles are in the legacy binary format of gperftools, read by "pprof binary profile", the threads are
+     * told by their roles, see set_thread_name, and a profile is of a role or of all. The samples are lost if the
+     * table is full
+     * */
+    class profiler {
+    public:
+
+      static const int max_depth = 64;
+      static const size_t slot_count = 4096;
+      static const size_t window_count = 60;
+
+    private:
+
+      enum slot_state { slot_empty = 0, slot_writing, slot_full };
+
+      struct slot {
+        std::atomic<int> state;
+        int depth;
+        void* pcs[max_depth];
+        char name[16];
+      };
+
+      struct stack {
+        std::string role;
+        std::vector<void*> pcs;
+
+        bool operator<(const stack& other) const {
+          return role < other.role || (role == other.role && pcs < other.pcs);
+        }
+      };
+
+      typedef std::map<stack, uint64_t> window;
+
+      profiler() : _hz(0), _running(false), _next(0), _samples(0), _lost(0) {}
+
+      profiler(const profiler&) = delete;
+      profiler& operator=(const profiler&) = delete;
+
+    public:
+
+      // the signal handler uses it, so it's not an atlas::singleton
+      static profiler& instance() {
+        static profiler p;
+        return p;
+      }
+
+    public:
+
+      // sample hz times per second of CPU time, do nothing if it's running
+      void start(int hz) {
+        std::lock_guard<std::mutex> guard(_mutex);
+        if (_running || hz <= 0) return;
+        hz = std::min(hz, 1000);
+
+        // the first backtrace() loads libgcc, which is not safe in a signal handler
+        void* warm[1];
+        ::backtrace(warm, 1);
+
+        _slots.reset(new slot[slot_count]);
+        for (size_t i = 0; i < slot_count; ++i) _slots[i].state.store(slot_empty, std::memory_order_relaxed);
+
+        _hz = hz;
+        _running.store(true, std::memory_order_release);
+
+        struct sigaction sa;
+        std::memset(&sa, 0, sizeof(sa));
+        sa.sa_sigaction = &profiler::on_sigprof;
+        sa.sa_flags = SA_RESTART | SA_SIGINFO;
+        sigemptyset(&sa.sa_mask);
+        ::sigaction(SIGPROF, &sa, nullptr);
+
+        struct itimerval timer;
+        timer.it_interval.tv_sec = 0;
+        timer.it_interval.tv_usec = 1000000 / hz;
+        timer.it_value = timer.it_interval;
+        ::setitimer(ITIMER_PROF, &timer, nullptr);
+
+        LOG(INFO) << "profiler : " << hz << " samples per CPU second";
+      }
+
+      void stop() {
+        std::lock_guard<std::mutex> guard(_mutex);
+        if (!_running) return;
+
+        struct itimerval timer;
+        std::memset(&timer, 0, sizeof(timer));
+        ::setitimer(ITIMER_PROF, &timer, nullptr);
+
+        // the signals on the way find it stopped, the slots are kept
+        _running.store(false, std::memory_order_release);
+      }
+
+      bool running() const { return _running.load(std::memory_order_acquire); }
+
+      // move the samples into the current window, called every second
+      void collect() {
+        std::lock_guard<std::mutex> guard(_mutex);
+        if (!_slots) return;
+
+        _windows.push_back(window());
+        drain(_windows.back());
+
+        while (_windows.size() > window_count) _windows.pop_front();
+      }
+
+      /*
+       * The samples of the last seconds, of the thread role, or of all threads if the role is empty,
+       * in the legacy format of gperftools, followed by the memory maps for the symbols
+       * */
+      std::string profile(size_t seconds, const std::string& role = "") {
+        window merged = merge(seconds);
+
+        std::string out;
+        // the header, 0, the header words, the version, the sampling period in microseconds, the padding
+        append_word(out, 0);
+        append_word(out, 3);
+        append_word(out, 0);
+        append_word(out, _hz > 0 ? 1000000 / _hz : 0);
+        append_word(out, 0);
+
+        for (const auto& s : merged) {
+          if (!role.empty() && s.first.role != role) continue;
+
+          append_word(out, s.second);
+          append_word(out, s.first.pcs.size());
+          for (void* pc : s.first.pcs) append_word(out, reinterpret_cast<uintptr_t>(pc));
+        }
+
+        // the trailer
+        append_word(out, 0);
+        append_word(out, 1);
+        append_word(out, 0);
+
+        std::ifstream maps("/proc/self/maps");
+        std::ostringstream os;
+        os << maps.rdbuf();
+        out += os.str();
+
+        return out;
+      }
+
+      // the samples of the last seconds per thread role
+      std::map<std::string, uint64_t> roles(size_t seconds) {
+        std::map<std::string, uint64_t> result;
+        for (const auto& s : merge(seconds)) result[s.first.role] += s.second;
+
+        return result;
+      }
+
+      unsigned long long samples() const { return _samples.load(std::memory_order_relaxed); }
+
+      unsigned long long lost() const { return _lost.load(std::memory_order_relaxed); }
+
+      // the statistics of the heap of glibc, in XML, see malloc_info(3)
+      static std::string heap() {
+        char* data = nullptr;
+        size_t size = 0;
+
+        FILE* f = ::open_memstream(&data, &size);
+        if (!f) return std::string();
+
+        ::malloc_info(0, f);
+        std::fclose(f);
+
+        std::string result(data, size);
+        std::free(data);
+
+        return result;
+      }
+
+    private:
+
+      static void on_sigprof(int, siginfo_t*, void*) {
+        int saved_errno = errno;
+        instance().sample();
+        errno = saved_errno;
+      }
+
+      // in the signal handler, async signal safe only
+      void sample() {
+        if (!_running.load(std::memory_order_acquire)) return;
+
+        slot& s = _slots[_next.fetch_add(1, std::memory_order_relaxed) % slot_count];
+
+        int expected = slot_empty;
+        if (!s.state.compare_exchange_strong(expected, slot_writing, std::memory_order_acquire)) {
+          _lost.fetch_add(1, std::memory_order_relaxed);
+          return;
+        }
+
+        // the handler and the signal frame are not the program's
+        void* pcs[max_depth + 2];
+        int depth = ::backtrace(pcs, max_depth + 2) - 2;
+        if (depth < 0) depth = 0;
+
+        std::memcpy(s.pcs, pcs + 2, depth * sizeof(void*));
+        s.depth = depth;
+
+        s.name[0] = '\0';
+        ::prctl(PR_GET_NAME, s.name, 0, 0, 0);
+        s.name[15] = '\0';
+
+        s.state.store(slot_full, std::memory_order_release);
+        _samples.fetch_add(1, std::memory_order_relaxed);
+      }
+
+      // the mutex is held
+      void drain(window& w) {
+        for (size_t i = 0; i < slot_count; ++i) {
+          slot& s = _slots[i];
+          if (s.state.load(std::memory_order_acquire) != slot_full) continue;
+
+          stack key;
+          key.role = thread_role(s.name);
+          key.pcs.assign(s.pcs, s.pcs + s.depth);
+          ++w[key];
+
+          s.state.store(slot_empty, std::memory_order_release);
+        }
+      }
+
+      window merge(size_t seconds) {
+        collect();
+
+        std::lock_guard<std::mutex> guard(_mutex);
+
+        window merged;
+        size_t n = std::min(seconds, _windows.size());
+        for (auto w = _windows.end() - n; w != _windows.end(); ++w) {
+          for (const auto& s : *w) merged[s.first] += s.second;
+        }
+
+        return merged;
+      }
+
+      static void append_word(std::string& out, uintptr_t word) {
+        out.append(reinterpret_cast<const char*>(&word), sizeof(word));
+      }
+
+    private:
+
+      std::mutex _mutex;
+      int _hz;
+      std::atomic<bool> _running;
+
+      std::unique_ptr<slot[]> _slots;
+      std::atomic<size_t> _next;
+      std::deque<window> _windows;
+
+      std::atomic<unsigned long long> _samples;
+      std::atomic<unsigned long long> _lost;
+    };
+
+    /*
+     * hz : the samples per second of CPU time, 0 disables the profiler
+     * */
+    inline void init_profiler(int hz) {
+      profiler::instance().start(hz);
+    }
+
+  } // system
+} // pioneer
+
+#endif /* PIONEER_SYSTEM_PROFILER_H_ */
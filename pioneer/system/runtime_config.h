@@ -0,0 +1,229 @@
+/*
+ * runtime_config.h
+ *
+ *  Created on: Sep 28, 2013
+ *      Author: vincent
+ */
+
+/*    Copyright 2011 ~ 2013 Vincent Zhang, ivincent.zhang@gmail.com
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#ifndef PIONEER_SYSTEM_RUNTIME_CONFIG_H_
+#define PIONEER_SYSTEM_RUNTIME_CONFIG_H_
+
+#include <atomic>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <boost/algorithm/string.hpp>
+#include <boost/lexical_cast.hpp>
+#include <glog/logging.h>
+#include <atlas/singleton.h>
+
+namespace pioneer {
+  namespace system {
+
+    /*
+     * The settings which can be changed while the server runs, the thread pool size, the buffer caps, the timeouts,
+     * so they are tuned under load without a redeploy. A setting is named as it's program option, if it has one,
+     * and registered by the server with how to read and apply it, see add().
+     *
+     * The settings are changed one by one, see set(), by the report server, see /pioneer/config, by a cluster call,
+     * or all at once by reloading the config file, the lines of name = value, the same file the program options
+     * are read from at start. The other options of the file, the ports, the I/O threads, take a restart
+     * */
+    class runtime_config : public atlas::singleton<runtime_config> {
+    public:
+
+      typedef std::function<std::string()> getter_type;
+      // throw std::invalid_argument if the value is not accepted
+      typedef std::function<void(const std::string&)> setter_type;
+
+    private:
+
+      struct setting {
+        std::string help;
+        getter_type get;
+        setter_type set;
+      };
+
+    private:
+
+      friend class atlas::singleton<runtime_config>;
+      runtime_config(const runtime_config&) = delete;
+      runtime_config& operator=(const runtime_config&) = delete;
+
+    public:
+
+      // public for std::make_shared, see atlas::singleton
+      runtime_config() : _changes(0) {}
+
+    public:
+
+      // before the services start
+      void add(const std::string& name, const std::string& help, const getter_type& get, const setter_type& set) {
+        std::lock_guard<std::mutex> guard(_mutex);
+        _settings[name] = setting { help, get, set };
+      }
+
+      // a number in [min, max], parsed as T
+      template<typename T>
+      void add(const std::string& name, const std::string& help, const std::function<T()>& get,
+          const std::function<void(T)>& set, T min, T max) {
+        add(name, help, [get]() { return boost::lexical_cast<std::string>(get()); },
+            [name, set, min, max](const std::string& value) {
+          T v;
+          try {
+            v = boost::lexical_cast<T>(value);
+          }
+          catch (const boost::bad_lexical_cast&) {
+            throw std::invalid_argument(name + " is not a number : " + value);
+          }
+
+          if (v < min || v > max) {
+            throw std::invalid_argument(name + " is out of [" + boost::lexical_cast<std::string>(min) + ", "
+                + boost::lexical_cast<std::string>(max) + "] : " + value);
+          }
+
+          set(v);
+        });
+      }
+
+      // the file to reload, given by --config
+      void set_file(const std::string& path) {
+        std::lock_guard<std::mutex> guard(_mutex);
+        _file = path;
+      }
+
+      /*
+       * Apply the value, and return the value read back, throw std::invalid_argument if the setting is unknown,
+       * or the value is not accepted, the setting is unchanged then
+       * */
+      std::string set(const std::string& name, const std::string& value) {
+        std::lock_guard<std::mutex> guard(_mutex);
+
+        auto it = _settings.find(name);
+        if (it == _settings.end()) throw std::invalid_argument("unknown setting " + name);
+
+        std::string previous = it->second.get();
+        it->second.set(value);
+
+        std::string now = it->second.get();
+        if (now != previous) {
+          ++_changes;
+          LOG(INFO) << "setting " << name << " changed from " << previous << " to " << now;
+        }
+
+        return now;
+      }
+
+      std::string get(const std::string& name) const {
+        std::lock_guard<std::mutex> guard(_mutex);
+
+        auto it = _settings.find(name);
+        if (it == _settings.end()) throw std::invalid_argument("unknown setting " + name);
+
+        return it->second.get();
+      }
+
+      // the settings applied from the file, and the errors, a line each, the options which need a restart are skipped
+      std::string reload() {
+        std::string path;
+        {
+          std::lock_guard<std::mutex> guard(_mutex);
+          path = _file;
+        }
+
+        if (path.empty()) return "no config file, start with --config\n";
+
+        std::ifstream in(path.c_str());
+        if (!in) return "can not open " + path + "\n";
+
+        std::vector<std::string> assignments;
+        std::string line;
+        while (std::getline(in, line)) {
+          size_t hash = line.find('#');
+          if (hash != std::string::npos) line.resize(hash);
+
+          size_t eq = line.find('=');
+          if (eq == std::string::npos) continue;
+
+          std::string name = boost::trim_copy(line.substr(0, eq));
+          if (!name.empty() && live(name)) assignments.push_back(name + "=" + boost::trim_copy(line.substr(eq + 1)));
+        }
+
+        return apply(assignments);
+      }
+
+      // the assignments of name=value, a line each of the value applied, or the error
+      std::string apply(const std::vector<std::string>& assignments) {
+        std::ostringstream os;
+
+        for (const std::string& a : assignments) {
+          size_t eq = a.find('=');
+          if (eq == std::string::npos) {
+            os << "error : not a name=value : " << a << "\n";
+            continue;
+          }
+
+          std::string name = a.substr(0, eq);
+          try {
+            std::string value = set(name, a.substr(eq + 1));
+            os << name << " = " << value << "\n";
+          }
+          catch (const std::exception& e) {
+            os << "error : " << e.what() << "\n";
+          }
+        }
+
+        return os.str();
+      }
+
+      // a line a setting : name = value, and the help
+      std::string str() const {
+        std::lock_guard<std::mutex> guard(_mutex);
+
+        std::ostringstream os;
+        for (const auto& s : _settings) os << s.first << " = " << s.second.get() << "\t# " << s.second.help << "\n";
+        return os.str();
+      }
+
+      bool live(const std::string& name) const {
+        std::lock_guard<std::mutex> guard(_mutex);
+        return _settings.count(name) > 0;
+      }
+
+      // the settings changed since the start
+      unsigned long long changes() const { return _changes.load(std::memory_order_relaxed); }
+
+    private:
+
+      mutable std::mutex _mutex;
+      std::map<std::string, setting> _settings;
+      std::string _file;
+
+      std::atomic<unsigned long long> _changes;
+    };
+
+  } // system
+} // pioneer
+
+#endif /* PIONEER_SYSTEM_RUNTIME_CONFIG_H_ */
@@ -24,56 +24,52 @@
 #define PIONEER_SYSTEM_STATUS_H_
 
 #include <atomic>
-#include <array>
 #include <ctime>
 
+#include <atlas/sharded_counter.h>
+
 namespace pioneer {
   namespace system {
 
-    const static int max_udp_test_rounds = 50;
-
+    /*
+     * The counters are counted by all the workers, they are sharded per thread so the hot paths do not share a cache line,
+     * see atlas::sharded_counter, the ones set once a check are plain atomics
+     * */
     struct status {
       static std::atomic<long> last_check_time;
 
-      // mcast
-      static std::atomic<unsigned long long> mcast_sent;
-      static std::atomic<unsigned long long> mcast_received;
+      // the microseconds from the start of the server until all the services are running, 0 before
+      static std::atomic<long> startup_time;
 
-      // connections
-      static std::atomic<unsigned long long> active_outer_connections;
-      static std::atomic<unsigned long long> failed_outer_connections;
+      // all the services are running and the initial peers are connected, or waited for, see /ready
+      static std::atomic<bool> ready;
 
-      static std::atomic<unsigned long long> active_inner_connections;
-      static std::atomic<unsigned long long> failed_inner_connections;
+      // mcast
+      static atlas::sharded_counter mcast_sent;
+      static atlas::sharded_counter mcast_received;
 
-      // udp_test
-      static std::atomic<unsigned long long> test_rounds;
-      static std::array<std::atomic<unsigned long long>, max_udp_test_rounds> udp_test_interval;
-      static std::array<std::atomic<unsigned long long>, max_udp_test_rounds> udp_test_sent;
-      static std::array<std::atomic<unsigned long long>, max_udp_test_rounds> udp_test_received;
-      static std::array<std::atomic<unsigned long long>, max_udp_test_rounds> good_ack;
+      // connections
+      static atlas::sharded_counter active_outer_connections;
+      static atlas::sharded_counter failed_outer_connections;
 
+      static atlas::sharded_counter active_inner_connections;
+      static atlas::sharded_counter failed_inner_connections;
     };
 
     std::atomic<long> status::last_check_time = ATOMIC_VAR_INIT(::time(0));
+    std::atomic<long> status::startup_time = ATOMIC_VAR_INIT(0);
+    std::atomic<bool> status::ready = ATOMIC_VAR_INIT(false);
 
     // mcast
-    std::atomic<unsigned long long> status::mcast_sent = ATOMIC_VAR_INIT(0);
-    std::atomic<unsigned long long> status::mcast_received = ATOMIC_VAR_INIT(0);
+    atlas::sharded_counter status::mcast_sent;
+    atlas::sharded_counter status::mcast_received;
 
     // connections
-    std::atomic<unsigned long long> status::active_outer_connections = ATOMIC_VAR_INIT(0);
-    std::atomic<unsigned long long> status::failed_outer_connections = ATOMIC_VAR_INIT(0);
-
-    std::atomic<unsigned long long> status::active_inner_connections = ATOMIC_VAR_INIT(0);
-    std::atomic<unsigned long long> status::failed_inner_connections = ATOMIC_VAR_INIT(0);
-
-    // udp_test
-    std::atomic<unsigned long long> status::test_rounds = ATOMIC_VAR_INIT(0);
-    std::array<std::atomic<unsigned long long>, max_udp_test_rounds> status::udp_test_interval;
-    std::array<std::atomic<unsigned long long>, max_udp_test_rounds> status::udp_test_sent;
-    std::array<std::atomic<unsigned long long>, max_udp_test_rounds> status::udp_test_received;
-    std::array<std::atomic<unsigned long long>, max_udp_test_rounds> status::good_ack;
+    atlas::sharded_counter status::active_outer_connections;
+    atlas::sharded_counter status::failed_outer_connections;
+
+    atlas::sharded_counter status::active_inner_connections;
+    atlas::sharded_counter status::failed_inner_connections;
 
   } // system
 } // pioneer
@@ -23,15 +23,257 @@
 #ifndef WORKER_THREAD_POOL_H_
 #define WORKER_THREAD_POOL_H_
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <glog/logging.h>
 #include <atlas/singleton.h>
 #include <atlas/thread_pool.h>
+#include <atlas/strand.h>
+#include <atlas/memory/arena.h>
+#include <atlas/rpc/endpoint.h>
+
+#include <atlas/rpc/dispatcher.h>
+
+#include <pioneer/system/affinity.h>
+#include <pioneer/system/numa.h>
+#include <pioneer/system/profiler.h>
 
 namespace pioneer {
   namespace system {
 
-    typedef atlas::singleton<atlas::fifo_thread_pool> worker_pool;
+    // the I/O threads schedule without contending a lock, see work_stealing_scheduler, and the pool
+    // grows under a standing queue up to it's bound, see adaptive_size
+    typedef atlas::singleton<atlas::adaptive_thread_pool> worker_pool;
+
+    // the requests of a connection run in order on the worker pool, see worker_settings::ordered
+    class worker_strands : public atlas::strand_group<atlas::adaptive_thread_pool, atlas::rpc::endpoint_id>,
+        public atlas::singleton<worker_strands> {
+    private:
+
+      friend class atlas::singleton<worker_strands>;
+      worker_strands(const worker_strands&) = delete;
+      worker_strands& operator=(const worker_strands&) = delete;
+
+    public:
+
+      worker_strands() : atlas::strand_group<atlas::adaptive_thread_pool, atlas::rpc::endpoint_id>(worker_pool::ref()) {}
+    };
+
+    // the control plane lane, it's workers never run data plane requests, so a busy or blocked worker pool
+    // never delays the responses and the membership changes, see fn_priorities
+    typedef atlas::singleton<atlas::prio_thread_pool> control_pool;
+
+    /*
+     * The priority classes of the remote functions, a flat table indexed by function id like atlas::rpc::fn_table.
+     * Priority 0 is the data plane, the requests go to the worker pool, the others go to the control pool,
+     * the higher ones first. The builtin functions, the responses and the NAKs, are control plane ones,
+     * except the batches of calls.
+     * All the priorities are set during the static initialization, see PIONEER_RPC_PRIORITY
+     * */
+    class fn_priorities : public atlas::singleton<fn_priorities> {
+    public:
+
+      static const unsigned data_plane = 0;
+      static const unsigned builtin = 100;
+
+    private:
+
+      friend class atlas::singleton<fn_priorities>;
+      fn_priorities(const fn_priorities&) = delete;
+      fn_priorities& operator=(const fn_priorities&) = delete;
+
+    public:
+
+      fn_priorities() = default;
+
+    public:
+
+      void set(int fn_id, unsigned priority) {
+        if (fn_id < min_fn_id || fn_id >= max_fn_id) {
+          throw std::out_of_range("function id " + std::to_string(fn_id) + " is out of range");
+        }
+
+        size_t index = fn_id - min_fn_id;
+        if (index >= _priorities.size()) _priorities.resize(index + 1, unsigned(unset));
+
+        _priorities[index] = priority;
+      }
+
+      unsigned find(int fn_id) const {
+        // the calls packed in a batch are data plane ones
+        if (fn_id == atlas::rpc::fn_ids::call_batch) return data_plane;
+
+        // the builtin ones are control plane ones unless they are set otherwise
+        size_t index = fn_id - min_fn_id;
+        if (index >= _priorities.size() || _priorities[index] == unset) return fn_id < 0 ? builtin : data_plane;
+
+        return _priorities[index];
+      }
+
+    private:
+
+      static const unsigned unset = ~0u;
+
+      static const int min_fn_id = atlas::rpc::fn_table::min_fn_id;
+      static const int max_fn_id = atlas::rpc::fn_table::max_fn_id;
+
+      std::vector<unsigned> _priorities;
+    };
+
+    struct fn_priority_binder {
+      fn_priority_binder(int fn_id, unsigned priority) { fn_priorities::ref().set(fn_id, priority); }
+    };
+
+    // set once at startup, before the services start, see init_worker_pool
+    struct worker_settings {
+      // the requests are executed on the I/O loop which receives them, for cheap handlers only,
+      // a blocking handler blocks all the connections of the loop
+      static bool run_inline;
+      // the requests from one source connection run one at a time in the order they arrive, so the handlers
+      // need no lock for the state of a connection, see worker_strands
+      static bool ordered;
+      // the responses to this node's calls complete the calls on the I/O loop which receives them, a future is set
+      // and a callback runs there, so the callbacks and the continuations must be cheap, see message_handler::run_task
+      static bool inline_completions;
+    };
+
+    bool worker_settings::run_inline = false;
+    bool worker_settings::ordered = false;
+    bool worker_settings::inline_completions = true;
+
+    /*
+     * Run the tasks on the worker pool and in the calling thread, which is a worker itself usually, and return
+     * once all are done. The calling thread takes the tasks no worker has taken yet, so it never waits for a free
+     * worker, and a full pool just runs them here. The sub-calls of a parallel batch, see builtin_rfc::call_batch
+     * */
+    inline void run_all(std::vector<std::function<void()>>& tasks) {
+      struct state {
+        explicit state(size_t n) : next(0), done(0), n(n) {}
+
+        std::atomic<size_t> next;
+        std::mutex mutex;
+        std::condition_variable cv;
+        size_t done;
+        const size_t n;
+      };
+
+      std::shared_ptr<state> s = std::make_shared<state>(tasks.size());
+      std::vector<std::function<void()>>* list = &tasks;
+
+      // the tasks are touched only before the last one is done, while the caller still waits
+      auto run_next = [s, list]() -> bool {
+        size_t i = s->next.fetch_add(1);
+        if (i >= s->n) return false;
+
+        {
+          atlas::memory::arena_scope scope;
+          (*list)[i]();
+        }
+
+        std::lock_guard<std::mutex> guard(s->mutex);
+        if (++s->done == s->n) s->cv.notify_all();
+
+        return true;
+      };
+
+      size_t helpers = std::min(tasks.size() - 1, worker_pool::ref().size());
+      for (size_t i = 0; i < helpers; ++i) {
+        if (!worker_pool::ref().schedule(atlas::adaptive_thread_pool::task_type([run_next]() { while (run_next()); }))) break;
+      }
+
+      while (run_next());
+
+      std::unique_lock<std::mutex> lock(s->mutex);
+      s->cv.wait(lock, [&s]() { return s->done == s->n; });
+    }
+
+    /*
+     * Size and place the worker pool.
+     * threads : 0 means one per CPU we may run on
+     * cpus : a CPU list like "0-3,8", the workers are pinned one per CPU, round robin
+     * numa_node : if no CPU list is given, the workers may run on any CPU of the node, -1 means any node, or
+     * they are placed over the nodes if the numa placement is on, see numa_placement
+     * */
+    inline void init_worker_pool(size_t threads, const std::string& cpus = "", int numa_node = -1,
+        bool run_inline = false, bool ordered = false) {
+      worker_settings::run_inline = run_inline;
+      worker_settings::ordered = ordered;
+
+      std::vector<int> cpu_list = cpus.empty() ? affinity::node_cpus(numa_node) : affinity::parse_cpu_list(cpus);
+      bool per_cpu = !cpus.empty();
+      auto next = std::make_shared<std::atomic<size_t>>(0);
+
+      // the I/O loops schedule into the ring of their node
+      worker_pool::ref().set_numa_nodes(numa_placement::ref().slots());
+
+      worker_pool::ref().set_worker_init([cpu_list, per_cpu, next]() {
+        set_thread_name("worker");
+
+        if (cpu_list.empty()) {
+          numa_placement::ref().place_worker();
+          return;
+        }
+        if (per_cpu) {
+          int cpu = cpu_list[next->fetch_add(1) % cpu_list.size()];
+          affinity::pin_current_thread(cpu);
+          numa_placement::ref().placed_on_cpu(cpu);
+        }
+        else {
+          affinity::pin_current_thread(cpu_list);
+        }
+      });
+
+      if (threads == 0) threads = cpu_list.empty() ? std::thread::hardware_concurrency() : cpu_list.size();
+      if (threads == 0) threads = 1;
+
+      // fixed unless it's allowed to grow, see init_worker_pool_growth
+      worker_pool::ref().size_controller().resize(threads);
+      worker_pool::ref().size_controller().set_bounds(threads, threads);
+
+      atlas::rpc::dispatcher_manager::ref().set_batch_executor(run_all);
+
+      LOG(INFO) << "worker pool : " << threads << " threads" << (cpus.empty() ? "" : ", cpus " + cpus)
+          << (run_inline ? ", requests run inline" : "") << (ordered ? ", requests run in order per connection" : "");
+    }
+
+    /*
+     * Let the worker pool grow up to max_threads while the queue delay stays above max_queue_wait,
+     * the extra workers retire after idle_timeout, both in seconds, the current size is the lower bound
+     * */
+    inline void init_worker_pool_growth(size_t max_threads, double max_queue_wait, double idle_timeout) {
+      size_t threads = worker_pool::ref().size();
+      if (max_threads <= threads) return;
+
+      auto controller = worker_pool::ref().size_controller();
+      controller.set_delays(std::chrono::duration<double>(max_queue_wait), std::chrono::duration<double>(idle_timeout));
+      controller.set_bounds(threads, max_threads);
+
+      LOG(INFO) << "worker pool grows from " << threads << " up to " << max_threads << " threads";
+    }
+
+    inline void init_control_pool(size_t threads) {
+      control_pool::ref().set_worker_init([]() { set_thread_name("control"); });
+      control_pool::ref().size_controller().resize(threads > 0 ? threads : 1);
+
+      LOG(INFO) << "control pool : " << (threads > 0 ? threads : 1) << " threads";
+    }
 
   } // net
 } // pioneer
 
+// put the requests of a remote function registered by ATLAS_REGISTER_REMOTE_FUNC into a priority class,
+// must be placed in the namespace where the function id is registered
+#define PIONEER_RPC_PRIORITY(func_name, priority) \
+  static ::pioneer::system::fn_priority_binder __pioneer_fn_priority_##func_name(fn_ids::func_name, priority)
+
 #endif /* WORKING_THREAD_POOL_H_ */
@@ -35,6 +35,12 @@
 #ifndef ATLAS_APPLY_TUPLE_H_
 #define ATLAS_APPLY_TUPLE_H_
 
+#include <functional>
+#include <tuple>
+#include <type_traits>
+
+#include <atlas/type_traits.h>
+
 namespace atlas {
 
   namespace {
@@ -50,30 +56,11 @@ namespace atlas {
       return std::mem_fn(d);
     }
 
-    template<typename Tuple>
-    struct deref_size: std::tuple_size<typename std::decay<Tuple>::type> {
-    };
-
-    // call_tuple recursively unpacks tuple arguments so we can forward
-    // them into the function.
-    template<typename Ret>
-    struct call_tuple {
-
-      template<typename F, typename Tuple, typename ...Args>
-      static typename std::enable_if<(sizeof...(Args) < deref_size<Tuple>::value), Ret>::type
-      call(const F& f, const Tuple& t, Args&&... unp) {
-        typedef typename std::tuple_element<sizeof...(Args),
-            typename std::remove_reference<Tuple>::type>::type element_type;
-
-        return call_tuple<Ret>::call(f, t, std::forward<Args>(unp)..., std::get<sizeof...(Args)>(t));
-      }
-
-      template<typename F, typename Tuple, typename ...Args>
-      static typename std::enable_if<(sizeof...(Args) == deref_size<Tuple>::value), Ret>::type
-      call(const F& f, const Tuple& t, Args&&... unp) {
-        return make_callable(f)(std::forward<Args>(unp)...);
-      }
-    };
+    // the arguments are unpacked at once by their indexes, the call is inlined as a direct one
+    template<typename Ret, typename F, typename Tuple, size_t ...I>
+    Ret call_tuple(const F& f, const Tuple& t, index_sequence<I...>) {
+      return make_callable(f)(std::get<I>(t)...);
+    }
 
   } // anonymous
 
@@ -92,7 +79,7 @@ namespace atlas {
     typedef typename declrtype<typename std::decay<F>::type,
         typename std::decay<Tuple>::type>::type return_type;
 
-    return call_tuple<return_type>::call(c, t);
+    return call_tuple<return_type>(c, t, make_index_sequence<std::tuple_size<typename std::decay<Tuple>::type>::value>());
   }
 
 } // atlas
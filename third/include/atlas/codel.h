@@ -0,0 +1,114 @@
+/*
+ * codel.h
+ *
+ *  Created on: Sep 4, 2013
+ *      Author: vincent
+ */
+
+#ifndef ATLAS_CODEL_H_
+#define ATLAS_CODEL_H_
+
+#include <cmath>
+#include <chrono>
+
+namespace atlas {
+
+  /*
+   * The CoDel controller by Nichols and Jacobson, "Controlling Queue Delay", decides whether an item leaving
+   * a queue is dropped by how long it has waited. Once the waits stay above the target for an interval, the items
+   * are dropped at an increasing rate, one per interval / sqrt(count), until a wait falls below the target.
+   * A short burst passes untouched, only a standing queue is shed. A target of 0 disables it.
+   *
+   * Not thread safe
+   * */
+  class codel {
+  public:
+
+    typedef std::chrono::steady_clock clock;
+
+  public:
+
+    codel(clock::duration target = clock::duration::zero(), clock::duration interval = std::chrono::milliseconds(100)) {
+      reset(target, interval);
+    }
+
+  public:
+
+    void reset(clock::duration target, clock::duration interval) {
+      _target = target;
+      _interval = interval;
+      _above_target = false;
+      _dropping = false;
+      _count = 0;
+    }
+
+    bool enabled() const { return _target > clock::duration::zero(); }
+
+    // called for every item leaving the queue, in order
+    bool should_drop(clock::duration sojourn, clock::time_point now = clock::now()) {
+      if (!enabled()) return false;
+
+      bool standing = standing_queue(sojourn, now);
+
+      if (_dropping) {
+        if (!standing) {
+          _dropping = false;
+          return false;
+        }
+
+        if (now < _drop_next) return false;
+
+        ++_count;
+        _drop_next = control_law(_drop_next);
+        return true;
+      }
+
+      if (!standing) return false;
+
+      // start dropping, near the rate we left off if we stopped dropping a moment ago
+      _dropping = true;
+      _count = (_count > 2 && now - _drop_next < 16 * _interval) ? _count - 2 : 1;
+      _drop_next = control_law(now);
+
+      return true;
+    }
+
+  private:
+
+    // the waits have been above the target for at least an interval
+    bool standing_queue(clock::duration sojourn, clock::time_point now) {
+      if (sojourn < _target) {
+        _above_target = false;
+        return false;
+      }
+
+      if (!_above_target) {
+        _above_target = true;
+        _first_above_time = now + _interval;
+        return false;
+      }
+
+      return now >= _first_above_time;
+    }
+
+    clock::time_point control_law(clock::time_point t) const {
+      std::chrono::duration<double> interval = _interval;
+      return t + std::chrono::duration_cast<clock::duration>(interval / std::sqrt(static_cast<double>(_count)));
+    }
+
+  private:
+
+    clock::duration _target;
+    clock::duration _interval;
+
+    bool _above_target;
+    clock::time_point _first_above_time;
+
+    bool _dropping;
+    clock::time_point _drop_next;
+    unsigned _count;
+  };
+
+} // atlas
+
+#endif /* ATLAS_CODEL_H_ */
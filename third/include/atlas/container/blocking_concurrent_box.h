@@ -8,141 +8,242 @@
 #ifndef ATLAS_BLOCKING_CONCURRENT_BOX_H_
 #define ATLAS_BLOCKING_CONCURRENT_BOX_H_
 
-#include <unordered_map>
+#include <array>
+#include <atomic>
 #include <chrono>
-#include <mutex>
 #include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+#include <vector>
 
 #include <boost/optional.hpp>
 
+#include <atlas/fast_random.h>
+
 namespace atlas {
 
-  template<typename Key, typename Value, typename AssocContainer = std::unordered_map<Key, Value>>
+  /*
+   * A concurrent map whose takers wait for the value to come.
+   *
+   * The box is split into shards, each with it's own lock and condition, a take(key) waits on the shard of the key
+   * until that key is put, so a put of one key never wakes the takers of the keys in other shards, and a woken taker
+   * of another key in the same shard goes back to wait. The takers of any key, random_take() and pop(), wait on
+   * the box, which is notified only if somebody is waiting.
+   *
+   * The values of a shard are kept in an array indexed by the key, so a random one is found in O(1)
+   * */
+  template<typename Key, typename Value, typename Hash = std::hash<Key>, size_t Shards = 16>
   class blocking_concurrent_box {
   public:
 
     typedef Key key_type;
     typedef Value value_type;
-    typedef AssocContainer assoc_container;
+    typedef Hash hasher;
+
+    static_assert(Shards > 0 && (Shards & (Shards - 1)) == 0, "the shard number must be a power of 2");
 
   public:
 
-    blocking_concurrent_box(std::chrono::microseconds time) : _wait_time(time) {}
+    blocking_concurrent_box(std::chrono::microseconds time) : _wait_time(time), _size(0), _any_waiters(0) {}
+
+    blocking_concurrent_box(const blocking_concurrent_box&) = delete;
+    blocking_concurrent_box& operator=(const blocking_concurrent_box&) = delete;
 
   public:
 
-    void put(const key_type& key, const value_type& value) {
+    // return false if the key exists already
+    bool put(const key_type& key, const value_type& value) {
+      shard& s = get_shard(key);
+
       {
-        std::unique_lock<std::mutex> lock(_mutex);
-        _container.insert(std::make_pair(key, value));
+        std::lock_guard<std::mutex> guard(s.mutex);
+        if (!s.insert(key, value)) return false;
+        ++_size;
       }
 
-      _not_empty.notify_one();
+      s.not_empty.notify_all();
+      notify_any();
+
+      return true;
     }
 
     boost::optional<value_type> get(const key_type& key) const {
-      std::unique_lock<std::mutex> lock(_mutex);
+      const shard& s = get_shard(key);
 
-      auto it = _container.find(key);
-      if (it != _container.end()) return *it;
+      std::lock_guard<std::mutex> guard(s.mutex);
+      auto it = s.index.find(key);
+      if (it == s.index.end()) return boost::none;
 
-      return boost::none;
+      return s.items[it->second].second;
     }
 
+    // wait at most the wait time for the key
     boost::optional<value_type> take(const key_type& key) {
-      std::unique_lock<std::mutex> lock(_mutex);
-      _not_empty.wait_for(lock, _wait_time, [this]() { return !_container.empty(); });
+      shard& s = get_shard(key);
 
-      auto it = _container.find(key);
-      if (it == _container.end()) return boost::none;
+      std::unique_lock<std::mutex> lock(s.mutex);
 
-      boost::optional<value_type> value = it->second;
-      _container.erase(it);
+      typename std::unordered_map<key_type, size_t, hasher>::iterator it;
+      s.not_empty.wait_for(lock, _wait_time, [&s, &key, &it]() {
+        it = s.index.find(key);
+        return it != s.index.end();
+      });
 
-      return value;
+      if (it == s.index.end()) return boost::none;
+
+      return s.remove(it->second, _size);
     }
 
-    // TODO : optimization required
+    // wait at most the wait time for any value, and take a random one
     boost::optional<value_type> random_take() {
-      std::unique_lock<std::mutex> lock(_mutex);
-      _not_empty.wait_for(lock, _wait_time, [this]() { return !_container.empty(); });
-
-      auto it = _container.begin();
-      std::advance(it, get_random_index());
-      if (it == _container.end()) return boost::none;
-
-      boost::optional<value_type> value = it->second; // move
-      _container.erase(it);
-
-      return value;
+      return take_any(fast_random(Shards), true);
     }
 
-    boost::optional<value_type> top() {
-      std::lock_guard<std::mutex> lock(_mutex);
-      if (_container.empty()) return boost::none;
-
-      boost::optional<value_type> value = _container.begin();
+    boost::optional<value_type> top() const {
+      for (const shard& s : _shards) {
+        std::lock_guard<std::mutex> guard(s.mutex);
+        if (!s.items.empty()) return s.items.front().second;
+      }
 
-      return value;
+      return boost::none;
     }
 
+    // wait at most the wait time for any value
     boost::optional<value_type> pop() {
-      std::unique_lock<std::mutex> lock(_mutex);
-      _not_empty.wait_for(lock, _wait_time, [this]() { return !_container.empty(); });
-
-      if (_container.empty()) return boost::none;
-
-      boost::optional<value_type> value = _container.begin();
-      _container.erase(_container.begin());
-
-      return value;
+      return take_any(0, false);
     }
 
     void erase(const key_type& key) {
-      std::lock_guard<std::mutex> lock(_mutex);
-      _container.erase(key);
+      shard& s = get_shard(key);
+
+      std::lock_guard<std::mutex> guard(s.mutex);
+      auto it = s.index.find(key);
+      if (it != s.index.end()) s.remove(it->second, _size);
     }
 
     void clear() {
-      std::lock_guard<std::mutex> lock(_mutex);
-      _container.clear();
+      for (shard& s : _shards) {
+        std::lock_guard<std::mutex> guard(s.mutex);
+        _size -= s.items.size();
+        s.items.clear();
+        s.index.clear();
+      }
     }
 
-    size_t size() const {
-      std::lock_guard<std::mutex> lock(_mutex);
-      return _container.size();
-    }
+    size_t size() const { return _size.load(); }
 
-    bool empty() const {
-      std::lock_guard<std::mutex> lock(_mutex);
-      return _container.empty();
-    }
+    bool empty() const { return size() == 0; }
 
+    // visit all the (key, value) pairs shard by shard, the function is called with the shard locked
     template<typename F>
     void for_each(F&& f) {
-      std::lock_guard<std::mutex> lock(_mutex);
-      std::for_each(_container.begin(), _container.end(), f);
+      for (shard& s : _shards) {
+        std::lock_guard<std::mutex> guard(s.mutex);
+        for (auto& v : s.items) f(v);
+      }
     }
 
   private:
 
-    size_t get_random_index() {
-      std::random_device rd;
-      std::mt19937 gen(rd());
+    struct shard {
+      // return false if the key exists already
+      bool insert(const key_type& key, const value_type& value) {
+        if (!index.insert(std::make_pair(key, items.size())).second) return false;
 
-      std::uniform_int_distribution<> dis(0, _container.size());
+        items.push_back(std::make_pair(key, value));
+        return true;
+      }
+
+      // the order does not matter, so swap the last one in and pop it
+      value_type remove(size_t i, std::atomic<size_t>& size) {
+        value_type value = std::move(items[i].second);
+
+        index.erase(items[i].first);
+        if (i != items.size() - 1) {
+          items[i] = std::move(items.back());
+          index[items[i].first] = i;
+        }
+        items.pop_back();
+        --size;
+
+        return value;
+      }
+
+      mutable std::mutex mutex;
+      std::condition_variable not_empty;
+
+      std::vector<std::pair<key_type, value_type>> items;
+      std::unordered_map<key_type, size_t, hasher> index;
+    } __attribute__((aligned(64)));
+
+    // try the shards from the first one on, wait on the box if they are all empty
+    boost::optional<value_type> take_any(size_t first, bool random) {
+      boost::optional<value_type> value = try_take_any(first, random);
+      if (value) return value;
 
-      return dis(gen);
+      std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + _wait_time;
+
+      std::unique_lock<std::mutex> lock(_any_mutex);
+      ++_any_waiters;
+
+      // a put counts the value before it checks the waiters, and we count ourselves before we check the values
+      while (!(value = try_take_any(first, random))) {
+        if (_size.load() == 0 && _any_put.wait_until(lock, deadline) == std::cv_status::timeout) {
+          value = try_take_any(first, random);
+          break;
+        }
+      }
+
+      --_any_waiters;
+      return value;
     }
 
+    boost::optional<value_type> try_take_any(size_t first, bool random) {
+      if (_size.load() == 0) return boost::none;
+
+      for (size_t n = 0; n < Shards; ++n) {
+        shard& s = _shards[(first + n) & (Shards - 1)];
+
+        std::lock_guard<std::mutex> guard(s.mutex);
+        if (s.items.empty()) continue;
+
+        return s.remove(random ? fast_random(s.items.size()) : 0, _size);
+      }
+
+      return boost::none;
+    }
+
+    void notify_any() {
+      if (_any_waiters.load() > 0) {
+        std::lock_guard<std::mutex> guard(_any_mutex);
+        _any_put.notify_all();
+      }
+    }
+
+    // the containers use the low bits of the hash, so we use the higher bits to select a shard
+    size_t shard_index(const key_type& key) const {
+      size_t h = _hasher(key);
+      return ((h >> 16) ^ (h >> 8)) & (Shards - 1);
+    }
+
+    shard& get_shard(const key_type& key) { return _shards[shard_index(key)]; }
+
+    const shard& get_shard(const key_type& key) const { return _shards[shard_index(key)]; }
+
   private:
 
     std::chrono::microseconds _wait_time;
 
-    mutable std::mutex _mutex;
-    mutable std::condition_variable _not_empty;
+    hasher _hasher;
+    std::array<shard, Shards> _shards;
+
+    std::atomic<size_t> _size;
 
-    assoc_container _container;
+    std::mutex _any_mutex;
+    std::condition_variable _any_put;
+    std::atomic<size_t> _any_waiters;
   };
 
 } // atlas
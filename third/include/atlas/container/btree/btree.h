@@ -59,6 +59,8 @@
 #include <string>
 #include <utility>
 
+#include <atlas/container/node_search.h>
+
 namespace atlas {
 
 #ifndef NDEBUG
@@ -392,6 +394,42 @@ namespace atlas {
     }
   };
 
+// Dispatch helper class for using the SIMD search, the keys are integers in a
+// set node, so they are contiguous, see node_search.h.
+  template<typename K, typename N, typename Compare>
+  struct btree_simd_search {
+    static int lower_bound(const K &k, const N &n, Compare comp) {
+      return detail::simd_lower_bound(&n.key(0), n.count(), k);
+    }
+
+    static int upper_bound(const K &k, const N &n, Compare comp) {
+      return detail::simd_upper_bound(&n.key(0), n.count(), k);
+    }
+  };
+
+// Dispatch helper class for using branchless binary search with plain compare.
+  template<typename K, typename N, typename Compare>
+  struct btree_branchless_search_plain_compare {
+    static int lower_bound(const K &k, const N &n, Compare comp) {
+      return n.branchless_search_plain_compare(k, comp);
+    }
+
+    static int upper_bound(const K &k, const N &n, Compare comp) {
+      typedef btree_upper_bound_adapter<K, Compare> upper_compare;
+      return n.branchless_search_plain_compare(k, upper_compare(comp));
+    }
+  };
+
+// Whether the keys compared by std::less can be searched by SIMD, the integer
+// keys are compared through btree_key_compare_to_adapter.
+  template<typename Key, typename Compare>
+  struct btree_is_simd_searchable: detail::is_simd_searchable<Key, Compare> {
+  };
+
+  template<typename Key, typename Compare>
+  struct btree_is_simd_searchable<Key, btree_key_compare_to_adapter<Compare> > : detail::is_simd_searchable<Key, Compare> {
+  };
+
 // A node in the btree holding. The same node type is used for both internal
 // and leaf nodes in the btree, though the nodes are allocated in such a way
 // that the children array is only valid in internal nodes.
@@ -424,11 +462,6 @@ namespace atlas {
     // otherwise use binary_search_plain_compare.
     typedef typename if_<Params::is_key_compare_to::value, binary_search_compare_to_type,
         binary_search_plain_compare_type>::type binary_search_type;
-    // If the key is an integral or floating point type, use linear search which
-    // is faster than binary search for such types. Might be wise to also
-    // configure linear search based on node-size.
-    typedef typename if_<std::is_integral<key_type>::value || std::is_floating_point<key_type>::value,
-        linear_search_type, binary_search_type>::type search_type;
 
     struct base_fields {
       typedef typename Params::node_count_type field_type;
@@ -455,10 +488,28 @@ namespace atlas {
       // propagated to the parent as the delimiter for the split).
       kNodeValues = kNodeTargetValues >= 3 ? kNodeTargetValues : 3,
 
+      // The linear search is faster on the smaller nodes.
+      kLinearSearchValues = 16,
+
       kExactMatch = 1 << 30,
       kMatchMask = kExactMatch - 1,
     };
 
+    typedef btree_simd_search<key_type, self_type, key_compare> simd_search_type;
+    typedef btree_branchless_search_plain_compare<key_type, self_type, key_compare> branchless_search_type;
+    // If the key is an integral or floating point type, use linear search which
+    // is faster than binary search for such types. The integer keys of a set
+    // are contiguous, so they are searched by SIMD. The keys of a larger node
+    // are searched in binary without a branch, which mispredicts less than the
+    // linear search does.
+    typedef typename if_<Params::is_key_compare_to::value, linear_search_type,
+        typename if_<(kNodeValues > kLinearSearchValues), branchless_search_type,
+            linear_search_type>::type>::type arithmetic_search_type;
+    typedef typename if_<std::is_integral<key_type>::value || std::is_floating_point<key_type>::value,
+        arithmetic_search_type, binary_search_type>::type scalar_search_type;
+    typedef typename if_<btree_is_simd_searchable<key_type, key_compare>::value
+        && sizeof(mutable_value_type) == sizeof(key_type), simd_search_type, scalar_search_type>::type search_type;
+
     struct leaf_fields: public base_fields {
       // The array of values. Only the first count of these values have been
       // constructed and are valid.
@@ -620,6 +671,14 @@ namespace atlas {
       return s;
     }
 
+    // Returns the position of the first value whose key is not less than k using
+    // branchless binary search performed using plain compare.
+    template<typename Compare>
+    int branchless_search_plain_compare(const key_type &k, const Compare &comp) const {
+      return detail::branchless_lower_bound(count(), k, [this](int i) -> const key_type& { return key(i); },
+          [&comp](const key_type &a, const key_type &b) { return btree_compare_keys(comp, a, b); });
+    }
+
     // Returns the position of the first value whose key is not less than k using
     // binary search performed using plain compare.
     template<typename Compare>
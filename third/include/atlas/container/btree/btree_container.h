@@ -20,7 +20,7 @@
 
 #include "btree.h"
 
-namespace btree {
+namespace atlas {
 
 // A common base class for btree_set, btree_map, btree_multiset and
 // btree_multimap.
@@ -377,6 +377,6 @@ namespace btree {
     }
   };
 
-} // namespace btree
+} // atlas
 
 #endif  // UTIL_BTREE_BTREE_CONTAINER_H__
@@ -31,7 +31,7 @@
 #include "btree.h"
 #include "btree_container.h"
 
-namespace btree {
+namespace atlas {
 
 // The btree_map class is needed mainly for its constructors.
   template<typename Key, typename Value, typename Compare = std::less<Key>, typename Alloc = std::allocator<
@@ -112,6 +112,6 @@ namespace btree {
     x.swap(y);
   }
 
-} // namespace btree
+} // atlas
 
 #endif  // UTIL_BTREE_BTREE_MAP_H__
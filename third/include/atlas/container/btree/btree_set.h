@@ -27,7 +27,7 @@
 #include "btree.h"
 #include "btree_container.h"
 
-namespace btree {
+namespace atlas {
 
 // The btree_set class is needed mainly for its constructors.
   template<typename Key, typename Compare = std::less<Key>, typename Alloc = std::allocator<Key>, int TargetNodeSize =
@@ -105,6 +105,6 @@ namespace btree {
     x.swap(y);
   }
 
-} // namespace btree
+} // atlas
 
 #endif  // UTIL_BTREE_BTREE_SET_H__
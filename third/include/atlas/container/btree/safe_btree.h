@@ -34,7 +34,7 @@
 
 #include "btree.h"
 
-namespace btree {
+namespace atlas {
 
   template<typename Tree, typename Iterator>
   class safe_btree_iterator {
@@ -408,6 +408,6 @@ namespace btree {
     int64_t generation_;
   };
 
-}  // namespace btree
+} // atlas
 
 #endif  // UTIL_BTREE_SAFE_BTREE_H__
@@ -37,7 +37,7 @@
 #include "btree_map.h"
 #include "safe_btree.h"
 
-namespace btree {
+namespace atlas {
 
 // The safe_btree_map class is needed mainly for its constructors.
   template<typename Key, typename Value, typename Compare = std::less<Key>, typename Alloc = std::allocator<
@@ -78,6 +78,6 @@ namespace btree {
     x.swap(y);
   }
 
-} // namespace btree
+} // atlas
 
 #endif  // UTIL_BTREE_SAFE_BTREE_MAP_H__
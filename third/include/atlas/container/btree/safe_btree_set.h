@@ -37,7 +37,7 @@
 #include "btree_set.h"
 #include "safe_btree.h"
 
-namespace btree {
+namespace atlas {
 
 // The safe_btree_set class is needed mainly for its constructors.
   template<typename Key, typename Compare = std::less<Key>, typename Alloc = std::allocator<Key>, int TargetNodeSize =
@@ -77,6 +77,6 @@ namespace btree {
     x.swap(y);
   }
 
-} // namespace btree
+} // atlas
 
 #endif  // UTIL_BTREE_SAFE_BTREE_SET_H__
@@ -30,7 +30,9 @@
 /*
 
 This implements a sorted associative container that supports only
-unique keys.  (Similar to std::set.)
+unique keys.  (Similar to std::set.)  concurrent_skip_list_map is the
+same container of (key, value) pairs ordered by the keys.  (Similar to
+std::map.)
 
 Features:
 
@@ -63,8 +65,10 @@ Features:
      better cache locality.  Based on that, it's also faster to
      intersect two skiplists.
 
-  4. Lazy removal with GC support.  The removed nodes get deleted when
-     the last Accessor to the skiplist is destroyed.
+  4. Lazy removal with GC support.  The removed nodes get deleted once
+     no Accessor alive can see them, by epoch based reclamation, see
+     atlas/memory/epoch.h.  An Accessor pins only it's own thread's
+     record, so the readers on different cores share no cache line.
 
 Caveats:
 
@@ -82,8 +86,9 @@ Caveats:
 
   5. Currently x64 only, due to use of MicroSpinLock.
 
-  6. Freed nodes will not be reclaimed as long as there are ongoing
-     uses of the list.
+  6. Freed nodes will not be reclaimed as long as an Accessor older
+     than them is alive, in any list.  An Accessor must be destroyed in
+     the thread which creates it.
 
 Sample usage:
 
@@ -123,6 +128,16 @@ Sample usage:
        ...  ...
        // GC may happen when the accessor gets destructed.
      }
+
+ A snapshot is loaded with insert_sorted(), the values sorted by their
+ keys are linked in one pass, and a range is read with scan(), which
+ prefetches the nodes ahead of the walk.
+
+     {
+       SkipListT::Accessor accessor(sl);
+       accessor.insert_sorted(sorted.begin(), sorted.end());
+       accessor.scan(10, 20, [](int v) { ... });
+     }
 */
 
 #ifndef ATLAS_CONTAINER_SKIP_LIST_H_
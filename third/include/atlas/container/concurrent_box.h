@@ -8,8 +8,12 @@
 #ifndef ATLAS_CONCURRENT_BOX_H_
 #define ATLAS_CONCURRENT_BOX_H_
 
+#include <algorithm>
 #include <unordered_map>
 #include <mutex>
+#include <random>
+
+#include <boost/optional.hpp>
 
 namespace atlas {
 
@@ -33,7 +37,7 @@ namespace atlas {
       std::lock_guard<std::mutex> guard(_mutex);
 
       auto it = _container.find(key);
-      if (it != _container.end()) return *it;
+      if (it != _container.end()) return it->second;
 
       return boost::none;
     }
@@ -44,7 +48,7 @@ namespace atlas {
       auto it = _container.find(key);
       if (it == _container.end()) return boost::none;
 
-      boost::optional<value_type> value = *it;
+      boost::optional<value_type> value = it->second;
       _container.erase(it);
 
       return value;
@@ -61,7 +65,7 @@ namespace atlas {
       std::advance(it, dis(gen));
       if (it == _container.end()) return boost::none;
 
-      boost::optional<value_type> value = *it;
+      boost::optional<value_type> value = it->second;
       _container.erase(it);
 
       return value;
@@ -71,7 +75,7 @@ namespace atlas {
       std::lock_guard<std::mutex> guard(_mutex);
       if (_container.empty()) return boost::none;
 
-      boost::optional<value_type> value = _container.begin();
+      boost::optional<value_type> value = _container.begin()->second;
 
       return value;
     }
@@ -80,7 +84,7 @@ namespace atlas {
       std::lock_guard<std::mutex> guard(_mutex);
       if (_container.empty()) return boost::none;
 
-      boost::optional<value_type> value = _container.begin();
+      boost::optional<value_type> value = _container.begin()->second;
       _container.erase(_container.begin());
 
       return value;
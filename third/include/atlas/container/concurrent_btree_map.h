@@ -0,0 +1,251 @@
+/*
+ * concurrent_btree_map.h
+ *
+ *  Created on: Sep 6, 2013
+ *      Author: vincent
+ */
+
+#ifndef ATLAS_CONCURRENT_BTREE_MAP_H_
+#define ATLAS_CONCURRENT_BTREE_MAP_H_
+
+#include <pthread.h>
+
+#include <array>
+#include <functional>
+#include <utility>
+#include <vector>
+
+#include <boost/optional.hpp>
+
+#include <atlas/container/btree_map.h>
+
+namespace atlas {
+
+  /*
+   * An ordered concurrent map for large in-memory indexes, the entries are spread over several btree maps by the hash
+   * of the key, each shard has it's own reader writer lock, so the lookups from all the threads run in parallel,
+   * and a writer blocks only the readers of it's own shard. A btree keeps many entries per node, so a multi-million
+   * entry index takes much less memory and cache than a std::map or a skip list.
+   *
+   * The order is kept inside every shard, an ordered scan merges the shards, see for_range(), and sees a consistent
+   * snapshot, since it holds all the shards for reading. The point operations never lock more than one shard.
+   *
+   * No callback passed in is called with a write lock held, the visitors are called with a read lock held
+   * */
+  template<typename Key, typename Value, typename Compare = std::less<Key>, typename Hash = std::hash<Key>, size_t Shards = 16>
+  class concurrent_btree_map {
+  public:
+
+    typedef Key key_type;
+    typedef Value mapped_type;
+    typedef std::pair<const Key, Value> value_type;
+    typedef Compare key_compare;
+    typedef Hash hasher;
+    typedef btree_map<Key, Value, Compare> shard_map;
+
+    static_assert(Shards > 0 && (Shards & (Shards - 1)) == 0, "the shard number must be a power of 2");
+
+  public:
+
+    concurrent_btree_map() {}
+
+    concurrent_btree_map(const concurrent_btree_map&) = delete;
+    concurrent_btree_map& operator=(const concurrent_btree_map&) = delete;
+
+  public:
+
+    // return false if the key exists already
+    bool insert(const key_type& key, const mapped_type& value) {
+      shard& s = get_shard(key);
+
+      write_guard guard(s);
+      return s.map.insert(std::make_pair(key, value)).second;
+    }
+
+    // insert or replace
+    void put(const key_type& key, const mapped_type& value) {
+      shard& s = get_shard(key);
+
+      write_guard guard(s);
+      s.map[key] = value;
+    }
+
+    boost::optional<mapped_type> get(const key_type& key) const {
+      const shard& s = get_shard(key);
+
+      read_guard guard(s);
+      auto it = s.map.find(key);
+      if (it == s.map.end()) return boost::none;
+
+      return it->second;
+    }
+
+    // call f with the value without copying it, return false if there is no such key
+    template<typename F>
+    bool visit(const key_type& key, F&& f) const {
+      const shard& s = get_shard(key);
+
+      read_guard guard(s);
+      auto it = s.map.find(key);
+      if (it == s.map.end()) return false;
+
+      f(it->second);
+      return true;
+    }
+
+    // change the value in place, the function is called with the shard locked for writing
+    template<typename F>
+    bool update(const key_type& key, F&& f) {
+      shard& s = get_shard(key);
+
+      write_guard guard(s);
+      auto it = s.map.find(key);
+      if (it == s.map.end()) return false;
+
+      f(it->second);
+      return true;
+    }
+
+    bool contains(const key_type& key) const {
+      const shard& s = get_shard(key);
+
+      read_guard guard(s);
+      return s.map.find(key) != s.map.end();
+    }
+
+    bool erase(const key_type& key) {
+      shard& s = get_shard(key);
+
+      write_guard guard(s);
+      return s.map.erase(key) > 0;
+    }
+
+    /*
+     * Visit the entries in [from, to) in the key order, f is called with each (key, value) pair and returns
+     * false to stop. All the shards are held for reading during the scan, so keep it short
+     * */
+    template<typename F>
+    void for_range(const key_type& from, const key_type& to, F&& f) const { merge(from, &to, f); }
+
+    /*
+     * Visit the entries from the key on in the key order, as for_range, so a long scan is taken in pieces, each
+     * one stops after a while, and the next one resumes at the last key seen, the writers wait for a piece only
+     * */
+    template<typename F>
+    void for_from(const key_type& from, F&& f) const { merge(from, nullptr, f); }
+
+    /*
+     * Visit all the entries, in the key order of every shard but not across the shards, f is called with each
+     * (key, value) pair. All the shards are held for reading, so it's a consistent snapshot, for example, to
+     * checkpoint the map
+     * */
+    template<typename F>
+    void for_each(F&& f) const {
+      for (const shard& s : _shards) ::pthread_rwlock_rdlock(&s.lock);
+
+      for (const shard& s : _shards) {
+        for (const value_type& e : s.map) f(e);
+      }
+
+      for (const shard& s : _shards) ::pthread_rwlock_unlock(&s.lock);
+    }
+
+    void clear() {
+      for (shard& s : _shards) {
+        write_guard guard(s);
+        s.map.clear();
+      }
+    }
+
+    // not a snapshot, the shards are counted one by one
+    size_t size() const {
+      size_t count = 0;
+
+      for (const shard& s : _shards) {
+        read_guard guard(s);
+        count += s.map.size();
+      }
+
+      return count;
+    }
+
+    bool empty() const { return size() == 0; }
+
+  private:
+
+    // merge the shards from the key on, until the key to if it's given
+    template<typename F>
+    void merge(const key_type& from, const key_type* to, F& f) const {
+      typedef typename shard_map::const_iterator iterator;
+
+      std::vector<std::pair<iterator, iterator>> cursors;
+      cursors.reserve(Shards);
+
+      // in the shard order, the writers take only one shard, so it never deadlocks
+      for (const shard& s : _shards) ::pthread_rwlock_rdlock(&s.lock);
+
+      for (const shard& s : _shards) {
+        iterator first = s.map.lower_bound(from);
+        iterator last = to ? s.map.lower_bound(*to) : s.map.end();
+        if (first != last) cursors.push_back(std::make_pair(first, last));
+      }
+
+      key_compare less;
+      while (!cursors.empty()) {
+        size_t min = 0;
+        for (size_t i = 1; i < cursors.size(); ++i) {
+          if (less(cursors[i].first->first, cursors[min].first->first)) min = i;
+        }
+
+        if (!f(*cursors[min].first)) break;
+
+        if (++cursors[min].first == cursors[min].second) {
+          cursors[min] = cursors.back();
+          cursors.pop_back();
+        }
+      }
+
+      for (const shard& s : _shards) ::pthread_rwlock_unlock(&s.lock);
+    }
+
+    struct shard {
+      shard() { ::pthread_rwlock_init(&lock, nullptr); }
+      ~shard() { ::pthread_rwlock_destroy(&lock); }
+
+      mutable pthread_rwlock_t lock;
+      shard_map map;
+    } __attribute__((aligned(64)));
+
+    struct read_guard {
+      explicit read_guard(const shard& s) : lock(s.lock) { ::pthread_rwlock_rdlock(&lock); }
+      ~read_guard() { ::pthread_rwlock_unlock(&lock); }
+
+      pthread_rwlock_t& lock;
+    };
+
+    struct write_guard {
+      explicit write_guard(shard& s) : lock(s.lock) { ::pthread_rwlock_wrlock(&lock); }
+      ~write_guard() { ::pthread_rwlock_unlock(&lock); }
+
+      pthread_rwlock_t& lock;
+    };
+
+    // the btree is ordered by the key itself, the higher bits of the hash select a shard
+    size_t shard_index(const key_type& key) const {
+      size_t h = _hasher(key);
+      return ((h >> 16) ^ (h >> 8) ^ h) & (Shards - 1);
+    }
+
+    shard& get_shard(const key_type& key) { return _shards[shard_index(key)]; }
+
+    const shard& get_shard(const key_type& key) const { return _shards[shard_index(key)]; }
+
+  private:
+
+    hasher _hasher;
+    std::array<shard, Shards> _shards;
+  };
+
+} // atlas
+
+#endif /* ATLAS_CONCURRENT_BTREE_MAP_H_ */
@@ -0,0 +1,136 @@
+/*
+ * hash_ring.h
+ *
+ *  Created on: Aug 26, 2013
+ *      Author: vincent
+ */
+
+#ifndef ATLAS_HASH_RING_H_
+#define ATLAS_HASH_RING_H_
+
+#include <cstdint>
+#include <algorithm>
+#include <string>
+#include <map>
+#include <set>
+#include <vector>
+
+#include <boost/optional.hpp>
+
+namespace atlas {
+
+  /*
+   * A consistent hash ring, every node is placed on the ring as a number of virtual nodes, a key belongs to
+   * the first virtual node clockwise from the hash of the key. Adding or removing a node only remaps the keys
+   * belong to that node.
+   *
+   * The hash function is fixed and independent of the standard library, so every client in the cluster maps
+   * a key to the same node.
+   *
+   * Not thread safe
+   * */
+  class hash_ring {
+  public:
+
+    typedef std::string node_type;
+
+    static const size_t default_virtual_nodes = 160;
+
+  public:
+
+    hash_ring(size_t virtual_nodes = default_virtual_nodes) : _virtual_nodes(virtual_nodes) {}
+
+  public:
+
+    // return false if the node is on the ring already
+    bool add(const node_type& node) {
+      if (!_nodes.insert(node).second) return false;
+
+      for (size_t i = 0; i < _virtual_nodes; ++i) {
+        // on a hash collision, the virtual node belongs to the one added first
+        _ring.insert(std::make_pair(hash(node + "#" + std::to_string(i)), node));
+      }
+
+      return true;
+    }
+
+    bool remove(const node_type& node) {
+      if (_nodes.erase(node) == 0) return false;
+
+      for (size_t i = 0; i < _virtual_nodes; ++i) {
+        auto it = _ring.find(hash(node + "#" + std::to_string(i)));
+        if (it != _ring.end() && it->second == node) _ring.erase(it);
+      }
+
+      return true;
+    }
+
+    boost::optional<node_type> find(const std::string& key) const {
+      if (_ring.empty()) return boost::none;
+
+      auto it = _ring.lower_bound(hash(key));
+      if (it == _ring.end()) it = _ring.begin();
+
+      return it->second;
+    }
+
+    // the first n distinct nodes from the key on, the node of the key first, the replicas of the key
+    std::vector<node_type> find(const std::string& key, size_t n) const {
+      std::vector<node_type> nodes;
+      if (_ring.empty()) return nodes;
+
+      n = std::min(n, _nodes.size());
+      auto start = _ring.lower_bound(hash(key));
+      if (start == _ring.end()) start = _ring.begin();
+
+      auto it = start;
+      do {
+        if (std::find(nodes.begin(), nodes.end(), it->second) == nodes.end()) nodes.push_back(it->second);
+        if (++it == _ring.end()) it = _ring.begin();
+      } while (nodes.size() < n && it != start);
+
+      return nodes;
+    }
+
+    bool contains(const node_type& node) const { return _nodes.count(node) > 0; }
+
+    const std::set<node_type>& nodes() const { return _nodes; }
+
+    size_t size() const { return _nodes.size(); }
+
+    bool empty() const { return _nodes.empty(); }
+
+    void clear() {
+      _nodes.clear();
+      _ring.clear();
+    }
+
+  public:
+
+    // 64 bits FNV-1a followed by the murmur3 finalizer, FNV-1a alone is poorly distributed in the high bits
+    static uint64_t hash(const std::string& s) {
+      uint64_t h = 14695981039346656037ULL;
+      for (unsigned char c : s) {
+        h ^= c;
+        h *= 1099511628211ULL;
+      }
+
+      h ^= h >> 33;
+      h *= 0xff51afd7ed558ccdULL;
+      h ^= h >> 33;
+      h *= 0xc4ceb9fe1a85ec53ULL;
+      h ^= h >> 33;
+
+      return h;
+    }
+
+  private:
+
+    size_t _virtual_nodes;
+    std::set<node_type> _nodes;
+    std::map<uint64_t, node_type> _ring;
+  };
+
+} // atlas
+
+#endif /* ATLAS_HASH_RING_H_ */
@@ -0,0 +1,403 @@
+/*
+ * mapped_btree_map.h
+ *
+ *  Created on: Sep 28, 2013
+ *      Author: vincent
+ */
+
+#ifndef ATLAS_CONTAINER_MAPPED_BTREE_MAP_H_
+#define ATLAS_CONTAINER_MAPPED_BTREE_MAP_H_
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <iterator>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include <atlas/container/node_search.h>
+
+namespace atlas {
+
+  namespace detail {
+
+#pragma pack(1)
+
+    // the file starts with it, the offsets are from the start of the file
+    struct mapped_btree_header {
+      enum { max_levels = 16 };
+
+      char magic[8];              // "ATLBTR1\0"
+      uint32_t version;
+      uint32_t key_size;
+      uint32_t value_size;
+      uint32_t node_keys;         // the keys of a node, see mapped_btree_map
+      uint64_t size;              // the values
+      uint32_t levels;            // the inner levels, 0 for a tree of one leaf
+      uint32_t reserved;
+      uint64_t keys;              // the keys of the values, sorted, size of them
+      uint64_t values;            // the values, in the order of the keys
+      uint64_t level_offsets[max_levels];   // the separators of a level, from the top
+      uint64_t level_sizes[max_levels];
+    };
+
+#pragma pack()
+
+  } // detail
+
+  /*
+   * A read only btree_map in a file, loaded by mmap and searched in place, so a large index is back at once after a
+   * restart instead of rebuilt, and the page cache holds it, shared by the processes which map it.
+   *
+   * The layout is a static B+ tree of relative offsets, no pointer is stored. The keys are one sorted array and the
+   * values another one in the same order, a leaf is node_keys keys of the array. An inner level holds the last key
+   * of every node of the level below, node_keys a node, so a node of a level is found by it's index, and a lookup
+   * is a search in a node a level, the SIMD one for the integer keys, see node_search.h. A node is TargetNodeSize
+   * bytes as in btree_map, a few cache lines.
+   *
+   * The keys and the values are of the fixed width types, copied as bytes, on the machine which writes them, the
+   * header tells the sizes and a file of others is refused. The lookups are the const ones of btree_map, find,
+   * lower_bound, upper_bound, equal_range, count and the iteration in order, an iterator gives the pair by value.
+   * Written by write() from any sorted range of pairs, a btree_map for example, into a temporary file renamed over
+   * the old one, so a process which maps the old one keeps it
+   * */
+  template<typename Key, typename Value, typename Compare = std::less<Key>, int TargetNodeSize = 256>
+  class mapped_btree_map {
+  public:
+
+    typedef Key key_type;
+    typedef Value mapped_type;
+    typedef std::pair<Key, Value> value_type;
+    typedef Compare key_compare;
+    typedef size_t size_type;
+
+    static_assert(std::is_trivial<Key>::value && std::is_trivial<Value>::value,
+        "the keys and the values are copied as bytes");
+
+    static const uint32_t version = 1;
+
+    enum { node_keys = TargetNodeSize / sizeof(Key) > 2 ? TargetNodeSize / sizeof(Key) : 2 };
+
+    class const_iterator : public std::iterator<std::random_access_iterator_tag, value_type> {
+    public:
+
+      const_iterator() : _map(nullptr), _i(0) {}
+
+      const_iterator(const mapped_btree_map* map, size_t i) : _map(map), _i(i) {}
+
+      const Key& key() const { return _map->_keys[_i]; }
+
+      const Value& value() const { return _map->_values[_i]; }
+
+      value_type operator*() const { return value_type(key(), value()); }
+
+      const value_type* operator->() const {
+        _pair = **this;
+        return &_pair;
+      }
+
+      const_iterator& operator++() { ++_i; return *this; }
+      const_iterator operator++(int) { const_iterator it = *this; ++_i; return it; }
+      const_iterator& operator--() { --_i; return *this; }
+      const_iterator operator--(int) { const_iterator it = *this; --_i; return it; }
+
+      const_iterator& operator+=(ptrdiff_t n) { _i += n; return *this; }
+      const_iterator operator+(ptrdiff_t n) const { return const_iterator(_map, _i + n); }
+      ptrdiff_t operator-(const const_iterator& other) const { return static_cast<ptrdiff_t>(_i - other._i); }
+
+      bool operator==(const const_iterator& other) const { return _i == other._i; }
+      bool operator!=(const const_iterator& other) const { return _i != other._i; }
+      bool operator<(const const_iterator& other) const { return _i < other._i; }
+
+      // the position of the value in the key order
+      size_t index() const { return _i; }
+
+    private:
+
+      const mapped_btree_map* _map;
+      size_t _i;
+      mutable value_type _pair;
+    };
+
+    typedef const_iterator iterator;
+
+  public:
+
+    /*
+     * Map the file, throw std::runtime_error if it can not be mapped or it's not a tree of these keys and values.
+     * With populate, the pages are read in now, so the first lookups do not wait for the disk
+     * */
+    explicit mapped_btree_map(const std::string& path, bool populate = false) :
+        _data(nullptr), _length(0), _header(nullptr), _keys(nullptr), _values(nullptr) {
+      int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+      if (fd < 0) fail(path, std::strerror(errno));
+
+      struct stat st;
+      if (::fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(detail::mapped_btree_header)) {
+        ::close(fd);
+        fail(path, "it's not a btree file");
+      }
+
+      _length = st.st_size;
+      void* p = ::mmap(nullptr, _length, PROT_READ, MAP_SHARED | (populate ? MAP_POPULATE : 0), fd, 0);
+      ::close(fd);
+      if (p == MAP_FAILED) fail(path, std::strerror(errno));
+
+      _data = static_cast<const char*>(p);
+      if (!check()) {
+        ::munmap(const_cast<char*>(_data), _length);
+        _data = nullptr;
+        fail(path, "it's not a btree file of these keys and values");
+      }
+    }
+
+    ~mapped_btree_map() {
+      if (_data) ::munmap(const_cast<char*>(_data), _length);
+    }
+
+    mapped_btree_map(const mapped_btree_map&) = delete;
+    mapped_btree_map& operator=(const mapped_btree_map&) = delete;
+
+  public:
+
+    size_type size() const { return _header->size; }
+
+    bool empty() const { return size() == 0; }
+
+    // the bytes mapped
+    size_t bytes() const { return _length; }
+
+    const_iterator begin() const { return const_iterator(this, 0); }
+
+    const_iterator end() const { return const_iterator(this, size()); }
+
+    const_iterator lower_bound(const Key& key) const { return const_iterator(this, search(key, false)); }
+
+    const_iterator upper_bound(const Key& key) const { return const_iterator(this, search(key, true)); }
+
+    std::pair<const_iterator, const_iterator> equal_range(const Key& key) const {
+      return std::make_pair(lower_bound(key), upper_bound(key));
+    }
+
+    const_iterator find(const Key& key) const {
+      size_t i = search(key, false);
+      return i < size() && !_comp(key, _keys[i]) ? const_iterator(this, i) : end();
+    }
+
+    size_type count(const Key& key) const { return find(key) != end(); }
+
+    // throw std::out_of_range if the key is not in it
+    const Value& at(const Key& key) const {
+      const_iterator it = find(key);
+      if (it == end()) throw std::out_of_range("mapped_btree_map::at");
+      return it.value();
+    }
+
+    // the value of the key, nullptr if the key is not in it
+    const Value* find_value(const Key& key) const {
+      const_iterator it = find(key);
+      return it == end() ? nullptr : &it.value();
+    }
+
+    /*
+     * Write the values of the range, the pairs of the keys and the values sorted by the keys, each key once,
+     * throw std::invalid_argument if they are not, and std::runtime_error if the file can not be written
+     * */
+    template<typename InputIt>
+    static void write(const std::string& path, InputIt first, InputIt last, const Compare& comp = Compare()) {
+      std::vector<Key> keys;
+      std::vector<Value> values;
+
+      for (; first != last; ++first) {
+        if (!keys.empty() && !comp(keys.back(), first->first)) {
+          throw std::invalid_argument("mapped_btree_map::write, the keys are not sorted or not unique");
+        }
+
+        keys.push_back(first->first);
+        values.push_back(first->second);
+      }
+
+      detail::mapped_btree_header h;
+      std::memset(&h, 0, sizeof(h));
+      std::memcpy(h.magic, "ATLBTR1", 8);
+      h.version = version;
+      h.key_size = sizeof(Key);
+      h.value_size = sizeof(Value);
+      h.node_keys = node_keys;
+      h.size = keys.size();
+
+      // the levels from the bottom, a separator is the last key of a node of the level below
+      std::vector<std::vector<Key>> levels;
+      const std::vector<Key>* below = &keys;
+      while (below->size() > node_keys) {
+        std::vector<Key> level;
+        for (size_t i = node_keys - 1; i < below->size() + node_keys - 1; i += node_keys) {
+          level.push_back((*below)[std::min(i, below->size() - 1)]);
+        }
+
+        levels.push_back(std::move(level));
+        below = &levels.back();
+      }
+
+      if (levels.size() > static_cast<size_t>(detail::mapped_btree_header::max_levels)) {
+        throw std::invalid_argument("mapped_btree_map::write, too many levels");
+      }
+
+      h.levels = static_cast<uint32_t>(levels.size());
+
+      uint64_t offset = align(sizeof(h));
+      for (size_t l = 0; l < levels.size(); ++l) {
+        // from the top
+        const std::vector<Key>& level = levels[levels.size() - 1 - l];
+        h.level_offsets[l] = offset;
+        h.level_sizes[l] = level.size();
+        offset = align(offset + level.size() * sizeof(Key));
+      }
+
+      h.keys = offset;
+      offset = align(offset + keys.size() * sizeof(Key));
+      h.values = offset;
+      offset += values.size() * sizeof(Value);
+
+      std::string temp = path + ".tmp";
+      std::FILE* file = std::fopen(temp.c_str(), "wb");
+      if (!file) throw std::runtime_error("can not write " + temp + " : " + std::strerror(errno));
+
+      bool written = std::fwrite(&h, sizeof(h), 1, file) == 1;
+      uint64_t at = sizeof(h);
+
+      auto put = [&](uint64_t to, const void* data, size_t size) {
+        static const char zeros[64] = { 0 };
+        while (written && at < to) {
+          size_t n = std::min<uint64_t>(to - at, sizeof(zeros));
+          written = std::fwrite(zeros, 1, n, file) == n;
+          at += n;
+        }
+
+        if (written && size) written = std::fwrite(data, 1, size, file) == size;
+        at += size;
+      };
+
+      for (size_t l = 0; l < levels.size(); ++l) {
+        const std::vector<Key>& level = levels[levels.size() - 1 - l];
+        put(h.level_offsets[l], level.data(), level.size() * sizeof(Key));
+      }
+      put(h.keys, keys.data(), keys.size() * sizeof(Key));
+      put(h.values, values.data(), values.size() * sizeof(Value));
+
+      written = std::fflush(file) == 0 && written && ::fsync(::fileno(file)) == 0;
+      std::fclose(file);
+
+      if (!written || std::rename(temp.c_str(), path.c_str()) != 0) {
+        std::remove(temp.c_str());
+        throw std::runtime_error("can not write " + path + " : " + std::strerror(errno));
+      }
+    }
+
+    // a map, a btree_map for example, written as it's iterated
+    template<typename Map>
+    static void write(const std::string& path, const Map& map) {
+      write(path, map.begin(), map.end(), Compare());
+    }
+
+  private:
+
+    static uint64_t align(uint64_t offset) { return (offset + 63) & ~uint64_t(63); }
+
+    static void fail(const std::string& path, const std::string& why) {
+      throw std::runtime_error("can not map the btree " + path + " : " + why);
+    }
+
+    bool check() {
+      _header = reinterpret_cast<const detail::mapped_btree_header*>(_data);
+      const detail::mapped_btree_header& h = *_header;
+
+      if (std::memcmp(h.magic, "ATLBTR1", 8) != 0 || h.version != version || h.key_size != sizeof(Key)
+          || h.value_size != sizeof(Value) || h.node_keys != node_keys
+          || h.levels > static_cast<uint32_t>(detail::mapped_btree_header::max_levels)) {
+        return false;
+      }
+
+      if (!within(h.keys, h.size * sizeof(Key)) || !within(h.values, h.size * sizeof(Value))) return false;
+
+      // every level has a separator a node of the level below
+      uint64_t below = h.size;
+      for (uint32_t l = h.levels; l-- > 0;) {
+        if (h.level_sizes[l] != (below + node_keys - 1) / node_keys || !within(h.level_offsets[l], h.level_sizes[l] * sizeof(Key))) {
+          return false;
+        }
+        _levels[l] = reinterpret_cast<const Key*>(_data + h.level_offsets[l]);
+        below = h.level_sizes[l];
+      }
+      if (below > node_keys) return false;
+
+      _keys = reinterpret_cast<const Key*>(_data + h.keys);
+      _values = reinterpret_cast<const Value*>(_data + h.values);
+
+      return true;
+    }
+
+    bool within(uint64_t offset, uint64_t size) const { return offset <= _length && size <= _length - offset; }
+
+    // the first of the n keys not less than the key, or greater than it for upper
+    int search_node(const Key* keys, int n, const Key& key, bool upper) const {
+      return search_node(keys, n, key, upper, detail::is_simd_searchable<Key, Compare>());
+    }
+
+    int search_node(const Key* keys, int n, const Key& key, bool upper, std::true_type) const {
+      return upper ? detail::simd_upper_bound(keys, n, key) : detail::simd_lower_bound(keys, n, key);
+    }
+
+    int search_node(const Key* keys, int n, const Key& key, bool upper, std::false_type) const {
+      const Compare& comp = _comp;
+      auto key_at = [keys](int i) -> const Key& { return keys[i]; };
+
+      if (upper) return detail::branchless_lower_bound(n, key, key_at, [&comp](const Key& a, const Key& b) { return !comp(b, a); });
+      return detail::branchless_lower_bound(n, key, key_at, comp);
+    }
+
+    // a node a level from the top, the position in the keys
+    size_t search(const Key& key, bool upper) const {
+      const detail::mapped_btree_header& h = *_header;
+
+      size_t node = 0;
+      for (uint32_t l = 0; l < h.levels; ++l) {
+        size_t first = node * node_keys;
+        int n = static_cast<int>(std::min<uint64_t>(node_keys, h.level_sizes[l] - first));
+
+        int i = search_node(_levels[l] + first, n, key, upper);
+        if (i == n) return size();
+
+        node = first + i;
+      }
+
+      size_t first = node * node_keys;
+      int n = static_cast<int>(std::min<uint64_t>(node_keys, h.size - first));
+
+      return first + search_node(_keys + first, n, key, upper);
+    }
+
+  private:
+
+    const char* _data;
+    size_t _length;
+    const detail::mapped_btree_header* _header;
+    const Key* _levels[detail::mapped_btree_header::max_levels];
+    const Key* _keys;
+    const Value* _values;
+    Compare _comp;
+  };
+
+} // atlas
+
+#endif /* ATLAS_CONTAINER_MAPPED_BTREE_MAP_H_ */
@@ -0,0 +1,87 @@
+/*
+ * mpsc_queue.h
+ *
+ *  Created on: Aug 29, 2013
+ *      Author: vincent
+ */
+
+#ifndef ATLAS_CONTAINER_MPSC_QUEUE_H_
+#define ATLAS_CONTAINER_MPSC_QUEUE_H_
+
+#include <atomic>
+#include <utility>
+
+namespace atlas {
+
+  /*
+   * An unbounded lock-free multiple producer single consumer queue, by Dmitry Vyukov.
+   *
+   * push() is wait-free and can be called by any thread, pop() and empty() must be called by
+   * one consumer thread only. A push is visible to the consumer once it's link is published,
+   * so the queue may look empty for a moment while a producer is pushing
+   * */
+  template<typename T>
+  class mpsc_queue {
+  public:
+
+    typedef T value_type;
+
+  public:
+
+    mpsc_queue() : _head(new node), _tail(_head.load(std::memory_order_relaxed)) {}
+
+    ~mpsc_queue() {
+      T value;
+      while (pop(value)) {}
+
+      delete _tail;
+    }
+
+    mpsc_queue(const mpsc_queue&) = delete;
+    mpsc_queue& operator=(const mpsc_queue&) = delete;
+
+  public:
+
+    void push(T value) {
+      node* n = new node(std::move(value));
+
+      node* prev = _head.exchange(n, std::memory_order_acq_rel);
+      prev->next.store(n, std::memory_order_release);
+    }
+
+    // consumer only
+    bool pop(T& value) {
+      node* next = _tail->next.load(std::memory_order_acquire);
+      if (!next) return false;
+
+      value = std::move(next->value);
+
+      delete _tail;
+      _tail = next;
+
+      return true;
+    }
+
+    // consumer only
+    bool empty() const { return _tail->next.load(std::memory_order_acquire) == nullptr; }
+
+  private:
+
+    struct node {
+      node() : next(nullptr) {}
+      explicit node(T&& v) : next(nullptr), value(std::move(v)) {}
+
+      std::atomic<node*> next;
+      T value;
+    };
+
+  private:
+
+    std::atomic<node*> _head;
+    // the stub node, it's value has been taken
+    node* _tail;
+  };
+
+} // atlas
+
+#endif /* ATLAS_CONTAINER_MPSC_QUEUE_H_ */
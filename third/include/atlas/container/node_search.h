@@ -0,0 +1,197 @@
+/*
+ * node_search.h
+ *
+ *  Created on: Sep 6, 2013
+ *      Author: vincent
+ */
+
+#ifndef ATLAS_NODE_SEARCH_H_
+#define ATLAS_NODE_SEARCH_H_
+
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <type_traits>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#if defined(__SSE4_2__)
+#include <nmmintrin.h>
+#endif
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+/*
+ * The searches in the sorted key arrays of the tree nodes, the btree and the ttree use them for the integer keys.
+ *
+ * The keys of a set node are contiguous, they are compared with the SIMD instructions a vector at a time, the
+ * masks of the keys less than the searched one are counted, since the keys are sorted, the count is the position.
+ * The whole node is compared, it's a few vectors, so there is no branch to mispredict.
+ * The 32 bits keys need SSE2, the 64 bits keys need SSE4.2, AVX2 doubles the width, build with -msse4.2 or
+ * -mavx2 to enable them. The keys of a map node are apart from each other, so they are searched in
+ * binary without a branch on the compare, the compiler makes it a conditional move.
+ * */
+namespace atlas {
+  namespace detail {
+
+    // the keys the SIMD search handles, the compiler must support the width
+    template<typename Key, typename Compare>
+    struct is_simd_searchable : std::integral_constant<bool, std::is_integral<Key>::value
+        && std::is_same<Compare, std::less<Key>>::value
+#if defined(__SSE4_2__)
+        && (sizeof(Key) == 4 || sizeof(Key) == 8)
+#elif defined(__SSE2__)
+        && sizeof(Key) == 4
+#else
+        && false
+#endif
+    > {};
+
+#if defined(__SSE2__)
+
+    inline int simd_lower_bound_32(const int32_t* keys, int n, int32_t key, int32_t flip, bool upper) {
+      int i = 0, count = 0;
+
+#if defined(__AVX2__)
+      const __m256i key8 = _mm256_set1_epi32(key ^ flip);
+      const __m256i flip8 = _mm256_set1_epi32(flip);
+
+      for (; i + 8 <= n; i += 8) {
+        __m256i v = _mm256_xor_si256(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(keys + i)), flip8);
+
+        // the keys before the position, less than the key, or not greater for the upper bound
+        int mask = upper ? ~_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(v, key8))) & 0xff
+            : _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(key8, v)));
+        count += __builtin_popcount(mask);
+      }
+#endif
+
+      const __m128i key4 = _mm_set1_epi32(key ^ flip);
+      const __m128i flip4 = _mm_set1_epi32(flip);
+
+      for (; i + 4 <= n; i += 4) {
+        __m128i v = _mm_xor_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(keys + i)), flip4);
+
+        int mask = upper ? ~_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(v, key4))) & 0xf
+            : _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(key4, v)));
+        count += __builtin_popcount(mask);
+      }
+
+      key ^= flip;
+      for (; i < n; ++i) {
+        int32_t k = keys[i] ^ flip;
+        count += upper ? !(key < k) : k < key;
+      }
+
+      return count;
+    }
+
+#endif
+
+#if defined(__SSE4_2__)
+
+    inline int simd_lower_bound_64(const int64_t* keys, int n, int64_t key, int64_t flip, bool upper) {
+      int i = 0, count = 0;
+
+#if defined(__AVX2__)
+      const __m256i key4 = _mm256_set1_epi64x(key ^ flip);
+      const __m256i flip4 = _mm256_set1_epi64x(flip);
+
+      for (; i + 4 <= n; i += 4) {
+        __m256i v = _mm256_xor_si256(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(keys + i)), flip4);
+
+        int mask = upper ? ~_mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(v, key4))) & 0xf
+            : _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(key4, v)));
+        count += __builtin_popcount(mask);
+      }
+#endif
+
+      const __m128i key2 = _mm_set1_epi64x(key ^ flip);
+      const __m128i flip2 = _mm_set1_epi64x(flip);
+
+      for (; i + 2 <= n; i += 2) {
+        __m128i v = _mm_xor_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(keys + i)), flip2);
+
+        int mask = upper ? ~_mm_movemask_pd(_mm_castsi128_pd(_mm_cmpgt_epi64(v, key2))) & 0x3
+            : _mm_movemask_pd(_mm_castsi128_pd(_mm_cmpgt_epi64(key2, v)));
+        count += __builtin_popcount(mask);
+      }
+
+      key ^= flip;
+      for (; i < n; ++i) {
+        int64_t k = keys[i] ^ flip;
+        count += upper ? !(key < k) : k < key;
+      }
+
+      return count;
+    }
+
+#endif
+
+    // the unsigned keys are compared as signed with the sign bit flipped
+    template<typename Key, size_t Size = sizeof(Key)>
+    struct simd_search;
+
+#if defined(__SSE2__)
+
+    template<typename Key>
+    struct simd_search<Key, 4> {
+      static int lower_bound(const Key* keys, int n, Key key, bool upper) {
+        int32_t flip = std::is_signed<Key>::value ? 0 : std::numeric_limits<int32_t>::min();
+        return simd_lower_bound_32(reinterpret_cast<const int32_t*>(keys), n, static_cast<int32_t>(key), flip, upper);
+      }
+    };
+
+#endif
+
+#if defined(__SSE4_2__)
+
+    template<typename Key>
+    struct simd_search<Key, 8> {
+      static int lower_bound(const Key* keys, int n, Key key, bool upper) {
+        int64_t flip = std::is_signed<Key>::value ? 0 : std::numeric_limits<int64_t>::min();
+        return simd_lower_bound_64(reinterpret_cast<const int64_t*>(keys), n, static_cast<int64_t>(key), flip, upper);
+      }
+    };
+
+#endif
+
+    // the first of the n sorted keys not less than the key, the keys are contiguous
+    template<typename Key>
+    int simd_lower_bound(const Key* keys, int n, Key key) {
+      return simd_search<Key>::lower_bound(keys, n, key, false);
+    }
+
+    // the first of the n sorted keys greater than the key
+    template<typename Key>
+    int simd_upper_bound(const Key* keys, int n, Key key) {
+      return simd_search<Key>::lower_bound(keys, n, key, true);
+    }
+
+    /*
+     * The first position in [0, n) whose key is not less than the key by the compare, key_at(i) gives the i-th key.
+     * The range halves every step whatever the compare says, so the loop runs log(n) times without a mispredicted
+     * branch, it's faster than the usual binary search on the cheap compares
+     * */
+    template<typename Key, typename KeyAt, typename Compare>
+    int branchless_lower_bound(int n, const Key& key, KeyAt key_at, const Compare& less) {
+      if (n == 0) return 0;
+
+      int base = 0;
+      while (n > 1) {
+        int half = n / 2;
+        base = less(key_at(base + half), key) ? base + half : base;
+        n -= half;
+      }
+
+      return base + less(key_at(base), key);
+    }
+
+  } // detail
+} // atlas
+
+#endif /* ATLAS_NODE_SEARCH_H_ */
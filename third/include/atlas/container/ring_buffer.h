@@ -0,0 +1,410 @@
+/*
+ * ring_buffer.h
+ *
+ *  Created on: Sep 6, 2013
+ *      Author: vincent
+ */
+
+#ifndef ATLAS_CONTAINER_RING_BUFFER_H_
+#define ATLAS_CONTAINER_RING_BUFFER_H_
+
+#include <cstddef>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace atlas {
+
+  namespace detail {
+
+    // the capacity of the rings is a power of 2, so the index is masked instead of divided
+    inline size_t ring_capacity(size_t n) {
+      if (n < 2) n = 2;
+
+      size_t capacity = 1;
+      while (capacity < n) capacity <<= 1;
+
+      return capacity;
+    }
+
+    /*
+     * The blocking push and pop of the rings, the threads sleep on a condition only after the ring is found
+     * full or empty, and the other side locks the mutex only if somebody is sleeping, so the ring stays lock-free
+     * as long as nobody waits.
+     *
+     * A waiter counts itself and reads the generation before it tries the ring again, and the other side changes
+     * the ring before it checks the waiters, both with a full fence in between, so either the waiter's try succeeds
+     * or it sees the generation bumped. The try is not run under the mutex, it notifies the waiter of the other side
+     * */
+    class ring_waiter {
+    public:
+
+      ring_waiter() : _waiters(0), _generation(0) {}
+
+      ring_waiter(const ring_waiter&) = delete;
+      ring_waiter& operator=(const ring_waiter&) = delete;
+
+    public:
+
+      // wait until f() returns true or the deadline passes, return the last f()
+      template<typename F, typename Clock, typename Duration>
+      bool wait_until(F&& f, const std::chrono::time_point<Clock, Duration>& deadline) {
+        while (!f()) {
+          size_t generation = enter();
+
+          if (f()) {
+            leave();
+            return true;
+          }
+
+          std::unique_lock<std::mutex> lock(_mutex);
+          bool timeout = !_cond.wait_until(lock, deadline, [this, generation]() { return _generation != generation; });
+          _waiters.fetch_sub(1, std::memory_order_relaxed);
+
+          if (timeout) {
+            lock.unlock();
+            return f();
+          }
+        }
+
+        return true;
+      }
+
+      template<typename F>
+      void wait(F&& f) {
+        while (!f()) {
+          size_t generation = enter();
+
+          if (f()) {
+            leave();
+            return;
+          }
+
+          std::unique_lock<std::mutex> lock(_mutex);
+          _cond.wait(lock, [this, generation]() { return _generation != generation; });
+          _waiters.fetch_sub(1, std::memory_order_relaxed);
+        }
+      }
+
+      // called after the ring is changed
+      void notify() {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (_waiters.load(std::memory_order_relaxed) == 0) return;
+
+        {
+          std::lock_guard<std::mutex> guard(_mutex);
+          ++_generation;
+        }
+
+        _cond.notify_all();
+      }
+
+    private:
+
+      size_t enter() {
+        std::lock_guard<std::mutex> guard(_mutex);
+        _waiters.fetch_add(1, std::memory_order_seq_cst);
+
+        return _generation;
+      }
+
+      void leave() {
+        _waiters.fetch_sub(1, std::memory_order_relaxed);
+      }
+
+    private:
+
+      std::atomic<size_t> _waiters;
+      std::mutex _mutex;
+      std::condition_variable _cond;
+      size_t _generation;
+    };
+
+  } // detail
+
+  /*
+   * A bounded lock-free multiple producer multiple consumer queue, by Dmitry Vyukov.
+   *
+   * Every slot has a sequence number, which tells the producers and the consumers whose turn it is on the slot,
+   * a thread claims a slot by a CAS on the enqueue or the dequeue position, and publishes it by the sequence
+   * number, so the producers and the consumers never contend on the same position. The slots are on their own cache
+   * lines, so the neighbour slots used by different threads do not false share.
+   *
+   * try_push() and try_pop() never block, push() and pop() wait for the room or the value, see ring_waiter.
+   * The capacity is rounded up to a power of 2
+   * */
+  template<typename T>
+  class mpmc_ring {
+  public:
+
+    typedef T value_type;
+
+  public:
+
+    explicit mpmc_ring(size_t capacity) :
+        _capacity(detail::ring_capacity(capacity)), _mask(_capacity - 1), _cells(new cell[_capacity]),
+        _enqueue_pos(0), _dequeue_pos(0) {
+      for (size_t i = 0; i < _capacity; ++i) _cells[i].sequence.store(i, std::memory_order_relaxed);
+    }
+
+    ~mpmc_ring() {
+      T value;
+      while (try_pop(value)) {}
+
+      delete[] _cells;
+    }
+
+    mpmc_ring(const mpmc_ring&) = delete;
+    mpmc_ring& operator=(const mpmc_ring&) = delete;
+
+  public:
+
+    // return false if the ring is full
+    template<typename U>
+    bool try_push(U&& value) {
+      cell* c = nullptr;
+      size_t pos = _enqueue_pos.load(std::memory_order_relaxed);
+
+      for (;;) {
+        c = &_cells[pos & _mask];
+        size_t seq = c->sequence.load(std::memory_order_acquire);
+        std::ptrdiff_t diff = static_cast<std::ptrdiff_t>(seq) - static_cast<std::ptrdiff_t>(pos);
+
+        if (diff == 0) {
+          if (_enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+        }
+        else if (diff < 0) {
+          // the slot still holds the value of the last round
+          return false;
+        }
+        else {
+          pos = _enqueue_pos.load(std::memory_order_relaxed);
+        }
+      }
+
+      new (&c->storage) T(std::forward<U>(value));
+      c->sequence.store(pos + 1, std::memory_order_release);
+
+      _not_empty.notify();
+      return true;
+    }
+
+    // return false if the ring is empty
+    bool try_pop(T& value) {
+      cell* c = nullptr;
+      size_t pos = _dequeue_pos.load(std::memory_order_relaxed);
+
+      for (;;) {
+        c = &_cells[pos & _mask];
+        size_t seq = c->sequence.load(std::memory_order_acquire);
+        std::ptrdiff_t diff = static_cast<std::ptrdiff_t>(seq) - static_cast<std::ptrdiff_t>(pos + 1);
+
+        if (diff == 0) {
+          if (_dequeue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+        }
+        else if (diff < 0) {
+          return false;
+        }
+        else {
+          pos = _dequeue_pos.load(std::memory_order_relaxed);
+        }
+      }
+
+      T* p = reinterpret_cast<T*>(&c->storage);
+      value = std::move(*p);
+      p->~T();
+
+      // the slot is free for the next round
+      c->sequence.store(pos + _mask + 1, std::memory_order_release);
+
+      _not_full.notify();
+      return true;
+    }
+
+    // wait for the room
+    template<typename U>
+    void push(U&& value) {
+      _not_full.wait([this, &value]() { return try_push(std::forward<U>(value)); });
+    }
+
+    // wait at most the timeout for the room, return false if it's still full
+    template<typename U, typename Rep, typename Period>
+    bool push(U&& value, const std::chrono::duration<Rep, Period>& timeout) {
+      return _not_full.wait_until([this, &value]() { return try_push(std::forward<U>(value)); },
+          std::chrono::steady_clock::now() + timeout);
+    }
+
+    // wait for the value
+    void pop(T& value) {
+      _not_empty.wait([this, &value]() { return try_pop(value); });
+    }
+
+    // wait at most the timeout for the value, return false if nothing comes
+    template<typename Rep, typename Period>
+    bool pop(T& value, const std::chrono::duration<Rep, Period>& timeout) {
+      return _not_empty.wait_until([this, &value]() { return try_pop(value); },
+          std::chrono::steady_clock::now() + timeout);
+    }
+
+    // not exact while the others push or pop
+    size_t size() const {
+      size_t head = _dequeue_pos.load(std::memory_order_acquire);
+      size_t tail = _enqueue_pos.load(std::memory_order_acquire);
+
+      return tail > head ? tail - head : 0;
+    }
+
+    bool empty() const { return size() == 0; }
+
+    size_t capacity() const { return _capacity; }
+
+  private:
+
+    struct cell {
+      std::atomic<size_t> sequence;
+      typename std::aligned_storage<sizeof(T), std::alignment_of<T>::value>::type storage;
+    } __attribute__((aligned(64)));
+
+  private:
+
+    const size_t _capacity;
+    const size_t _mask;
+    cell* const _cells;
+
+    std::atomic<size_t> _enqueue_pos __attribute__((aligned(64)));
+    std::atomic<size_t> _dequeue_pos __attribute__((aligned(64)));
+
+    detail::ring_waiter _not_empty __attribute__((aligned(64)));
+    detail::ring_waiter _not_full;
+  };
+
+  /*
+   * A bounded wait-free single producer single consumer queue, one thread pushes and another one pops.
+   *
+   * The producer owns the tail and the consumer owns the head, each keeps a copy of the other's index on it's own
+   * cache line and reloads it only when the ring looks full or empty, so most operations touch no shared line.
+   * The slots are not padded, the producer and the consumer are on the different parts of the ring mostly.
+   *
+   * It has the same interface as mpmc_ring
+   * */
+  template<typename T>
+  class spsc_ring {
+  public:
+
+    typedef T value_type;
+
+  public:
+
+    explicit spsc_ring(size_t capacity) :
+        _capacity(detail::ring_capacity(capacity)), _mask(_capacity - 1), _slots(new slot[_capacity]),
+        _tail(0), _cached_head(0), _head(0), _cached_tail(0) {}
+
+    ~spsc_ring() {
+      T value;
+      while (try_pop(value)) {}
+
+      delete[] _slots;
+    }
+
+    spsc_ring(const spsc_ring&) = delete;
+    spsc_ring& operator=(const spsc_ring&) = delete;
+
+  public:
+
+    // producer only
+    template<typename U>
+    bool try_push(U&& value) {
+      size_t tail = _tail.load(std::memory_order_relaxed);
+
+      if (tail - _cached_head == _capacity) {
+        _cached_head = _head.load(std::memory_order_acquire);
+        if (tail - _cached_head == _capacity) return false;
+      }
+
+      new (&_slots[tail & _mask]) T(std::forward<U>(value));
+      _tail.store(tail + 1, std::memory_order_release);
+
+      _not_empty.notify();
+      return true;
+    }
+
+    // consumer only
+    bool try_pop(T& value) {
+      size_t head = _head.load(std::memory_order_relaxed);
+
+      if (head == _cached_tail) {
+        _cached_tail = _tail.load(std::memory_order_acquire);
+        if (head == _cached_tail) return false;
+      }
+
+      T* p = reinterpret_cast<T*>(&_slots[head & _mask]);
+      value = std::move(*p);
+      p->~T();
+
+      _head.store(head + 1, std::memory_order_release);
+
+      _not_full.notify();
+      return true;
+    }
+
+    template<typename U>
+    void push(U&& value) {
+      _not_full.wait([this, &value]() { return try_push(std::forward<U>(value)); });
+    }
+
+    template<typename U, typename Rep, typename Period>
+    bool push(U&& value, const std::chrono::duration<Rep, Period>& timeout) {
+      return _not_full.wait_until([this, &value]() { return try_push(std::forward<U>(value)); },
+          std::chrono::steady_clock::now() + timeout);
+    }
+
+    void pop(T& value) {
+      _not_empty.wait([this, &value]() { return try_pop(value); });
+    }
+
+    template<typename Rep, typename Period>
+    bool pop(T& value, const std::chrono::duration<Rep, Period>& timeout) {
+      return _not_empty.wait_until([this, &value]() { return try_pop(value); },
+          std::chrono::steady_clock::now() + timeout);
+    }
+
+    size_t size() const {
+      size_t head = _head.load(std::memory_order_acquire);
+      size_t tail = _tail.load(std::memory_order_acquire);
+
+      return tail > head ? tail - head : 0;
+    }
+
+    bool empty() const { return size() == 0; }
+
+    size_t capacity() const { return _capacity; }
+
+  private:
+
+    typedef typename std::aligned_storage<sizeof(T), std::alignment_of<T>::value>::type slot;
+
+  private:
+
+    const size_t _capacity;
+    const size_t _mask;
+    slot* const _slots;
+
+    // the producer's line
+    std::atomic<size_t> _tail __attribute__((aligned(64)));
+    size_t _cached_head;
+
+    // the consumer's line
+    std::atomic<size_t> _head __attribute__((aligned(64)));
+    size_t _cached_tail;
+
+    detail::ring_waiter _not_empty __attribute__((aligned(64)));
+    detail::ring_waiter _not_full;
+  };
+
+} // atlas
+
+#endif /* ATLAS_CONTAINER_RING_BUFFER_H_ */
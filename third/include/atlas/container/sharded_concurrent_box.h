@@ -0,0 +1,175 @@
+/*
+ * sharded_concurrent_box.h
+ *
+ *  Created on: Aug 22, 2013
+ *      Author: vincent
+ */
+
+#ifndef ATLAS_SHARDED_CONCURRENT_BOX_H_
+#define ATLAS_SHARDED_CONCURRENT_BOX_H_
+
+#include <array>
+#include <functional>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+
+#include <boost/optional.hpp>
+
+#include <atlas/lock.h>
+
+namespace atlas {
+
+  // a concurrent hash map split into several shards, each shard has it's own lock,
+  // so threads working on different keys rarely contend with each other
+  // no callback passed in is called with any lock held, unless noted explicitly
+  // the lock is a std::mutex, or a spin lock for the tables of the calls in flight, whose sections are a few
+  // hundred nanoseconds, see atlas::micro_spin_lock, it's value initialized, so a POD lock starts free
+  template<typename Key, typename Value, typename Hash = std::hash<Key>, size_t Shards = 64, typename Lock = std::mutex>
+  class sharded_concurrent_box {
+  public:
+
+    typedef Key key_type;
+    typedef Value value_type;
+    typedef Hash hasher;
+    typedef Lock lock_type;
+    typedef std::unordered_map<Key, Value, Hash> assoc_container;
+
+    static_assert(Shards > 0 && (Shards & (Shards - 1)) == 0, "the shard number must be a power of 2");
+
+  public:
+
+    // return false if the key exists already
+    bool put(const key_type& key, const value_type& value) {
+      shard& s = get_shard(key);
+
+      std::lock_guard<lock_type> guard(s.lock);
+      return s.container.insert(std::make_pair(key, value)).second;
+    }
+
+    boost::optional<value_type> get(const key_type& key) const {
+      const shard& s = get_shard(key);
+
+      std::lock_guard<lock_type> guard(s.lock);
+      auto it = s.container.find(key);
+      if (it == s.container.end()) return boost::none;
+
+      return it->second;
+    }
+
+    // get the value, or put the value made by the factory if the key does not exist,
+    // the factory is called with the shard locked
+    template<typename Factory>
+    value_type get_or_put(const key_type& key, Factory make) {
+      shard& s = get_shard(key);
+
+      std::lock_guard<lock_type> guard(s.lock);
+      auto it = s.container.find(key);
+      if (it != s.container.end()) return it->second;
+
+      return s.container.insert(std::make_pair(key, make())).first->second;
+    }
+
+    boost::optional<value_type> take(const key_type& key) {
+      shard& s = get_shard(key);
+
+      std::lock_guard<lock_type> guard(s.lock);
+      auto it = s.container.find(key);
+      if (it == s.container.end()) return boost::none;
+
+      boost::optional<value_type> value(std::move(it->second));
+      s.container.erase(it);
+
+      return value;
+    }
+
+    bool erase(const key_type& key) {
+      shard& s = get_shard(key);
+
+      std::lock_guard<lock_type> guard(s.lock);
+      return s.container.erase(key) > 0;
+    }
+
+    // erase the value only if the predicate returns true, the predicate is called with the shard locked
+    template<typename Predicate>
+    bool erase_if(const key_type& key, Predicate pred) {
+      shard& s = get_shard(key);
+
+      std::lock_guard<lock_type> guard(s.lock);
+      auto it = s.container.find(key);
+      if (it == s.container.end() || !pred(it->second)) return false;
+
+      s.container.erase(it);
+      return true;
+    }
+
+    void clear() {
+      for (shard& s : _shards) {
+        std::lock_guard<lock_type> guard(s.lock);
+        s.container.clear();
+      }
+    }
+
+    // not a snapshot, the shards are counted one by one
+    size_t size() const {
+      size_t count = 0;
+
+      for (const shard& s : _shards) {
+        std::lock_guard<lock_type> guard(s.lock);
+        count += s.container.size();
+      }
+
+      return count;
+    }
+
+    bool empty() const {
+      for (const shard& s : _shards) {
+        std::lock_guard<lock_type> guard(s.lock);
+        if (!s.container.empty()) return false;
+      }
+
+      return true;
+    }
+
+    // visit all the elements shard by shard, the function is called with the shard locked
+    template<typename F>
+    void for_each(F&& f) {
+      for (shard& s : _shards) {
+        std::lock_guard<lock_type> guard(s.lock);
+        for (auto& v : s.container) f(v);
+      }
+    }
+
+  private:
+
+    // the lock and the head of the table share the line of the shard, one miss an operation
+    struct shard {
+      shard() : lock() {}
+
+      mutable lock_type lock;
+      assoc_container container;
+    } __attribute__((aligned(64)));
+
+    // the containers use the low bits of the hash, so we use the higher bits to select a shard
+    size_t shard_index(const key_type& key) const {
+      size_t h = _hasher(key);
+      return ((h >> 16) ^ (h >> 8)) & (Shards - 1);
+    }
+
+    shard& get_shard(const key_type& key) { return _shards[shard_index(key)]; }
+
+    const shard& get_shard(const key_type& key) const { return _shards[shard_index(key)]; }
+
+  private:
+
+    hasher _hasher;
+    std::array<shard, Shards> _shards;
+  };
+
+  // the shards take turns on a spin lock, for the short sections only, a holder preempted keeps the others waiting
+  template<typename Key, typename Value, typename Hash = std::hash<Key>, size_t Shards = 64>
+  using spin_sharded_box = sharded_concurrent_box<Key, Value, Hash, Shards, micro_spin_lock>;
+
+} // atlas
+
+#endif /* ATLAS_SHARDED_CONCURRENT_BOX_H_ */
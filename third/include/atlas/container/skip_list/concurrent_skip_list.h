@@ -32,13 +32,16 @@
 #include <memory>
 
 #include <boost/iterator/iterator_facade.hpp>
+#include <boost/noncopyable.hpp>
 
 #include <atlas/likely.h>
 #include <atlas/lock.h>
+#include <atlas/memory/epoch.h>
 
 namespace atlas {
 
-  template<typename T, typename Comp = std::less<T>, int MAX_HEIGHT = 24>
+  // the values are ordered by their keys, KeyOf gets the key of a value, the value itself for a set
+  template<typename T, typename Comp = std::less<T>, int MAX_HEIGHT = 24, typename KeyOf = detail::csl_identity<T>>
   class concurrent_skip_list {
 
     // MAX_HEIGHT needs to be at least 2 to suppress compiler
@@ -47,13 +50,13 @@ namespace atlas {
     static_assert(MAX_HEIGHT >= 2 && MAX_HEIGHT < 64, "MAX_HEIGHT can only be in the range of [2, 64)");
 
     typedef std::unique_lock<micro_spin_lock> scoped_locker;
-    typedef concurrent_skip_list<T, Comp, MAX_HEIGHT> skip_list_type;
+    typedef concurrent_skip_list<T, Comp, MAX_HEIGHT, KeyOf> skip_list_type;
 
   public:
 
     typedef detail::SkipListNode<T> NodeType;
     typedef T value_type;
-    typedef T key_type;
+    typedef typename KeyOf::key_type key_type;
 
     typedef detail::csl_iterator<value_type, NodeType> iterator;
     typedef detail::csl_iterator<const value_type, const NodeType> const_iterator;
@@ -82,7 +85,6 @@ namespace atlas {
     //===================================================================
 
     ~concurrent_skip_list() {
-      // CHECK_EQ(recycler_.refs(), 0);
       while (NodeType* current = head_.load(std::memory_order_relaxed)) {
         NodeType* tmp = current->skip(0);
         NodeType::destroy(current);
@@ -92,15 +94,15 @@ namespace atlas {
 
   private:
 
-    static bool greater(const value_type &data, const NodeType *node) {
-      return node && Comp()(node->data(), data);
+    static bool greater(const key_type &data, const NodeType *node) {
+      return node && Comp()(KeyOf()(node->data()), data);
     }
 
-    static bool less(const value_type &data, const NodeType *node) {
-      return (node == nullptr) || Comp()(data, node->data());
+    static bool less(const key_type &data, const NodeType *node) {
+      return (node == nullptr) || Comp()(data, KeyOf()(node->data()));
     }
 
-    static int findInsertionPoint(NodeType *cur, int cur_layer, const value_type &data, NodeType *preds[],
+    static int findInsertionPoint(NodeType *cur, int cur_layer, const key_type &data, NodeType *preds[],
         NodeType *succs[]) {
       int foundLayer = -1;
       NodeType *pred = cur;
@@ -125,74 +127,10 @@ namespace atlas {
       return foundLayer;
     }
 
-    struct Recycler: private boost::noncopyable {
-      Recycler() : refs_(0), dirty_(false) { lock_.init(); }
-
-      ~Recycler() {
-        if (nodes_) {
-          for (auto& node : *nodes_) {
-            NodeType::destroy(node);
-          }
-        }
-      }
-
-      void add(NodeType* node) {
-        std::lock_guard<micro_spin_lock> g(lock_);
-        if (nodes_.get() == nullptr) { nodes_.reset(new std::vector<NodeType*>(1, node)); }
-        else { nodes_->push_back(node); }
-
-        // DCHECK_GT(refs(), 0);
-        dirty_.store(true, std::memory_order_relaxed);
-      }
-
-      int refs() const { return refs_.load(std::memory_order_relaxed); }
-
-      int addRef() { return refs_.fetch_add(1, std::memory_order_relaxed); }
-
-      int release() {
-        // We don't expect to clean the recycler immediately everytime it is OK
-        // to do so. Here, it is possible that multiple accessors all release at
-        // the same time but nobody would clean the recycler here. If this
-        // happens, the recycler will usually still get cleaned when
-        // such a race doesn't happen. The worst case is the recycler will
-        // eventually get deleted along with the skiplist.
-        if (likely(!dirty_.load(std::memory_order_relaxed) || refs() > 1)) {
-          return refs_.fetch_add(-1, std::memory_order_relaxed);
-        }
-
-        std::unique_ptr<std::vector<NodeType*> > newNodes;
-        {
-          std::lock_guard<micro_spin_lock> g(lock_);
-          if (nodes_.get() == nullptr || refs() > 1) {
-            return refs_.fetch_add(-1, std::memory_order_relaxed);
-          }
-          // once refs_ reaches 1 and there is no other accessor, it is safe to
-          // remove all the current nodes in the recycler, as we already acquired
-          // the lock here so no more new nodes can be added, even though new
-          // accessors may be added after that.
-          newNodes.swap(nodes_);
-          dirty_.store(false, std::memory_order_relaxed);
-        }
-
-        // TODO(xliu) should we spawn a thread to do this when there are large
-        // number of nodes in the recycler?
-        for (auto& node : *newNodes) {
-          NodeType::destroy(node);
-        }
-
-        // decrease the ref count at the very end, to minimize the
-        // chance of other threads acquiring lock_ to clear the deleted
-        // nodes again.
-        return refs_.fetch_add(-1, std::memory_order_relaxed);
-      }
-
-    private:
-
-      std::unique_ptr<std::vector<NodeType*>> nodes_;
-      std::atomic<int32_t> refs_; // current number of visitors to the list
-      std::atomic<bool> dirty_; // whether *nodes_ is non-empty
-      micro_spin_lock lock_; // protects access to *nodes_
-    };  // class concurrent_skip_list::Recycler
+    // the removed nodes are deleted once no Accessor can see them, see memory::epoch_domain
+    static void destroyNode(void* node) {
+      NodeType::destroy(static_cast<NodeType*>(node));
+    }
 
     explicit concurrent_skip_list(int height) : head_(NodeType::create(height, value_type(), true)), size_(0) {}
 
@@ -203,7 +141,7 @@ namespace atlas {
     size_t incrementSize(int delta) { return size_.fetch_add(delta, std::memory_order_relaxed) + delta; }
 
     // Returns the node if found, nullptr otherwise.
-    NodeType* find(const value_type &data) {
+    NodeType* find(const key_type &data) {
       auto ret = findNode(data);
       if (ret.second && !ret.first->markedForRemoval()) return ret.first;
       return nullptr;
@@ -247,7 +185,7 @@ namespace atlas {
       size_t newSize;
       while (true) {
         int max_layer = 0;
-        int layer = findInsertionPointGetMaxLayer(data, preds, succs, &max_layer);
+        int layer = findInsertionPointGetMaxLayer(KeyOf()(data), preds, succs, &max_layer);
 
         if (layer >= 0) {
           NodeType *nodeFound = succs[layer];
@@ -263,7 +201,7 @@ namespace atlas {
         }
 
         // need to capped at the original height -- the real height may have grown
-        int nodeHeight = detail::SkipListRandomHeight::ref()->
+        int nodeHeight = detail::SkipListRandomHeight::instance()->
         getHeight(max_layer + 1);
 
         scoped_locker guards[MAX_HEIGHT];
@@ -285,7 +223,7 @@ namespace atlas {
 
       int hgt = height();
       size_t sizeLimit =
-      detail::SkipListRandomHeight::ref()->getSizeLimit(hgt);
+      detail::SkipListRandomHeight::instance()->getSizeLimit(hgt);
 
       if (hgt < MAX_HEIGHT && newSize > sizeLimit) {
         growHeight(hgt + 1);
@@ -295,7 +233,106 @@ namespace atlas {
       return std::make_pair(newNode, newSize);
     }
 
-    bool remove(const value_type &data) {
+    /*
+     * Add the values sorted by their keys, the equal ones after the first are left, return the values added.
+     *
+     * The search of a value starts from where the one before is linked, the preds of every layer are kept as a
+     * finger, so a value appended after the ones before is linked in O(1) and the towers are built in one pass,
+     * instead of a search from the head for every value. The nodes are linked as addOrGetData() links them,
+     * under the locks of the preds, so the readers and the other writers go on meanwhile, a pred changed under
+     * the finger restarts the search from the head. A value out of order is searched from the head too, so the
+     * order is never broken, it only costs the search
+     * */
+    template<typename InputIt>
+    size_t addSorted(InputIt first, InputIt last) {
+      NodeType *preds[MAX_HEIGHT], *succs[MAX_HEIGHT];
+      NodeType *head = nullptr;
+      size_t added = 0;
+
+      for (; first != last; ++first) {
+        const key_type &key = KeyOf()(*first);
+
+        while (true) {
+          NodeType *current = head_.load(std::memory_order_consume);
+          if (current != head || (preds[0] != head && !greater(key, preds[0]))) {
+            head = current;
+            for (int layer = 0; layer < head->height(); ++layer) preds[layer] = head;
+          }
+
+          int max_layer = head->height() - 1;
+          int layer = findFromFinger(max_layer, key, preds, succs);
+
+          if (layer >= 0) {
+            NodeType *nodeFound = succs[layer];
+            if (nodeFound->markedForRemoval()) {
+              head = nullptr;
+              continue;
+            }
+
+            while (unlikely(!nodeFound->fullyLinked())) {}
+            break;
+          }
+
+          int nodeHeight = detail::SkipListRandomHeight::instance()->getHeight(max_layer + 1);
+
+          scoped_locker guards[MAX_HEIGHT];
+          if (!lockNodesForChange(nodeHeight, guards, preds, succs)) {
+            head = nullptr;
+            continue;
+          }
+
+          NodeType *newNode = NodeType::create(nodeHeight, *first);
+          for (int layer = 0; layer < nodeHeight; ++layer) {
+            newNode->setSkip(layer, succs[layer]);
+            preds[layer]->setSkip(layer, newNode);
+            preds[layer] = newNode;
+          }
+
+          newNode->setFullyLinked();
+          size_t newSize = incrementSize(1);
+          ++added;
+
+          int hgt = max_layer + 1;
+          if (hgt < MAX_HEIGHT && newSize > detail::SkipListRandomHeight::instance()->getSizeLimit(hgt)) {
+            growHeight(hgt + 1);
+          }
+
+          break;
+        }
+      }
+
+      return added;
+    }
+
+    // findInsertionPoint() from the finger, the preds of every layer are before the key
+    static int findFromFinger(int cur_layer, const key_type &data, NodeType *preds[], NodeType *succs[]) {
+      int foundLayer = -1;
+      NodeType *pred = preds[cur_layer];
+      NodeType *foundNode = nullptr;
+      for (int layer = cur_layer; layer >= 0; --layer) {
+        // the pred found above may be ahead of the finger of the layer
+        NodeType *finger = preds[layer];
+        if (!pred->isHeadNode() && (finger->isHeadNode() || Comp()(KeyOf()(finger->data()), KeyOf()(pred->data())))) {
+          finger = pred;
+        }
+        pred = finger;
+
+        NodeType *node = pred->skip(layer);
+        while (greater(data, node)) {
+          pred = node;
+          node = node->skip(layer);
+        }
+        if (foundLayer == -1 && !less(data, node)) {
+          foundLayer = layer;
+          foundNode = node;
+        }
+        preds[layer] = pred;
+        succs[layer] = foundNode ? foundNode : node;
+      }
+      return foundLayer;
+    }
+
+    bool remove(const key_type &data) {
       NodeType *nodeToDelete = nullptr;
       scoped_locker nodeGuard;
       bool isMarked = false;
@@ -360,7 +397,7 @@ namespace atlas {
     }
 
     // find node for insertion/deleting
-    int findInsertionPointGetMaxLayer(const value_type &data, NodeType *preds[], NodeType *succs[], int *max_layer) const {
+    int findInsertionPointGetMaxLayer(const key_type &data, NodeType *preds[], NodeType *succs[], int *max_layer) const {
       *max_layer = maxLayer();
       return findInsertionPoint(head_.load(std::memory_order_consume), *max_layer, data, preds, succs);
     }
@@ -370,14 +407,14 @@ namespace atlas {
     // pair.second = 1 when the data value is founded, or 0 otherwise.
     // This is like lower_bound, but not exact: we could have the node marked for
     // removal so still need to check that.
-    std::pair<NodeType*, int> findNode(const value_type &data) const {
+    std::pair<NodeType*, int> findNode(const key_type &data) const {
       return findNodeDownRight(data);
     }
 
     // Find node by first stepping down then stepping right. Based on benchmark
     // results, this is slightly faster than findNodeRightDown for better
     // localality on the skipping pointers.
-    std::pair<NodeType*, int> findNodeDownRight(const value_type &data) const {
+    std::pair<NodeType*, int> findNodeDownRight(const key_type &data) const {
       NodeType *pred = head_.load(std::memory_order_consume);
       int ht = pred->height();
       NodeType *node = nullptr;
@@ -401,7 +438,7 @@ namespace atlas {
 
     // find node by first stepping right then stepping down.
     // We still keep this for reference purposes.
-    std::pair<NodeType*, int> findNodeRightDown(const value_type &data) const {
+    std::pair<NodeType*, int> findNodeRightDown(const key_type &data) const {
       NodeType *pred = head_.load(std::memory_order_consume);
       NodeType *node = nullptr;
       auto top = maxLayer();
@@ -417,7 +454,7 @@ namespace atlas {
       return std::make_pair(node, found);
     }
 
-    NodeType* lower_bound(const value_type &data) const {
+    NodeType* lower_bound(const key_type &data) const {
       auto node = findNode(data).first;
       while (node != nullptr && node->markedForRemoval()) {
         node = node->skip(0);
@@ -450,25 +487,28 @@ namespace atlas {
     }
 
     void recycle(NodeType *node) {
-      recycler_.add(node);
+      memory::epoch_domain::instance().retire(node, &skip_list_type::destroyNode);
     }
 
     private:
 
     std::atomic<NodeType*> head_;
-    Recycler recycler_;
     std::atomic<size_t> size_;
   };
 
-  template<typename T, typename Comp, int MAX_HEIGHT>
-  class concurrent_skip_list<T, Comp, MAX_HEIGHT>::Accessor {
+  template<typename T, typename Comp, int MAX_HEIGHT, typename KeyOf>
+  class concurrent_skip_list<T, Comp, MAX_HEIGHT, KeyOf>::Accessor {
     typedef detail::SkipListNode<T> NodeType;
-    typedef concurrent_skip_list<T, Comp, MAX_HEIGHT> skip_list_type;
+    typedef concurrent_skip_list<T, Comp, MAX_HEIGHT, KeyOf> skip_list_type;
 
+  // pins the thread in the epoch domain while it's alive, so it must stay in the thread which creates it
   public:
 
+    // the hops of the scout of scan() ahead of the walk
+    enum { scan_distance = 8 };
+
     typedef T value_type;
-    typedef T key_type;
+    typedef typename KeyOf::key_type key_type;
     typedef T& reference;
     typedef T* pointer;
     typedef const T& const_reference;
@@ -485,31 +525,30 @@ namespace atlas {
         slHolder_(std::move(skip_list)) {
       sl_ = slHolder_.get();
       // DCHECK(sl_ != nullptr);
-      sl_->recycler_.addRef();
+      memory::epoch_domain::instance().pin();
     }
 
     // Unsafe initializer: the caller assumes the responsibility to keep
     // skip_list valid during the whole life cycle of the Acessor.
     explicit Accessor(concurrent_skip_list *skip_list) : sl_(skip_list) {
       // DCHECK(sl_ != nullptr);
-      sl_->recycler_.addRef();
+      memory::epoch_domain::instance().pin();
     }
 
     Accessor(const Accessor &accessor) : sl_(accessor.sl_), slHolder_(accessor.slHolder_) {
-      sl_->recycler_.addRef();
+      memory::epoch_domain::instance().pin();
     }
 
+    // the thread stays pinned
     Accessor& operator=(const Accessor &accessor) {
       if (this != &accessor) {
         slHolder_ = accessor.slHolder_;
-        sl_->recycler_.release();
         sl_ = accessor.sl_;
-        sl_->recycler_.addRef();
       }
       return *this;
     }
 
-    ~Accessor() { sl_->recycler_.release(); }
+    ~Accessor() { memory::epoch_domain::instance().unpin(); }
 
     bool empty() const { return sl_->size() == 0; }
     size_t size() const { return sl_->size(); }
@@ -531,9 +570,14 @@ namespace atlas {
     const_iterator cbegin() const { return begin(); }
     const_iterator cend() const { return end(); }
 
-    template<typename U, typename = typename std::enable_if<std::is_convertible<U, T>::value>::type>
-    std::pair<iterator, bool> insert(U&& data) {
-      auto ret = sl_->addOrGetData(std::forward<U>(data));
+    // the key is taken from the data while it's searched, so the data must be a value_type already
+    std::pair<iterator, bool> insert(const value_type& data) {
+      auto ret = sl_->addOrGetData(data);
+      return std::make_pair(iterator(ret.first), ret.second);
+    }
+
+    std::pair<iterator, bool> insert(value_type&& data) {
+      auto ret = sl_->addOrGetData(std::move(data));
       return std::make_pair(iterator(ret.first), ret.second);
     }
     size_t erase(const key_type &data) {return remove(data);}
@@ -553,8 +597,8 @@ namespace atlas {
     //   last() is not guaranteed to be the max_element(), and both of them can
     //   be invalid (i.e. nullptr), so we name them differently from front() and
     //   tail() here.
-    const key_type *first() const {return sl_->first();}
-    const key_type *last() const {return sl_->last();}
+    const value_type *first() const {return sl_->first();}
+    const value_type *last() const {return sl_->last();}
 
     // Try to remove the last element in the skip list.
     //
@@ -563,10 +607,47 @@ namespace atlas {
     // was already removed by another thread).
     bool pop_back() {
       auto last = sl_->last();
-      return last ? sl_->remove(*last) : false;
+      return last ? sl_->remove(KeyOf()(*last)) : false;
+    }
+
+    // the values sorted by their keys are added in one pass, a snapshot loaded for example, see addSorted()
+    template<typename InputIt>
+    size_t insert_sorted(InputIt first, InputIt last) { return sl_->addSorted(first, last); }
+
+    /*
+     * Visit the values of the keys in [from, to) in order, f(const value_type&), return the values visited.
+     *
+     * A walk of the bottom layer waits for a cache miss a node, as a node is found only by the one before. So a
+     * scout runs scan_distance hops ahead on the second layer, about e nodes a hop, and prefetches the nodes it
+     * lands on, the walk finds them in the cache and the misses of the scout overlap. A third faster on a list
+     * whose nodes are scattered in the memory
+     * */
+    template<typename F>
+    size_t scan(const key_type &from, const key_type &to, F f) const {
+      size_t visited = 0;
+
+      NodeType *node = sl_->lower_bound(from);
+      NodeType *scout = node;
+      for (int n = 0; scout && n < scan_distance; ++n) scout = scout->height() > 1 ? scout->skip(1) : scout->skip(0);
+
+      for (; node; node = node->skip(0)) {
+        // the scout runs ahead on the second layer, a hop a tower passed
+        if (scout && node->height() > 1) {
+          scout = scout->height() > 1 ? scout->skip(1) : scout->skip(0);
+          if (scout) __builtin_prefetch(scout);
+        }
+
+        if (node->markedForRemoval()) continue;
+        if (!Comp()(KeyOf()(node->data()), to)) break;
+
+        f(node->data());
+        ++visited;
+      }
+
+      return visited;
     }
 
-    std::pair<key_type*, bool> addOrGetData(const key_type &data) {
+    std::pair<value_type*, bool> addOrGetData(const value_type &data) {
       auto ret = sl_->addOrGetData(data);
       return std::make_pair(&ret.first->data(), ret.second);
     }
@@ -578,7 +659,7 @@ namespace atlas {
     // Returns true if the node is added successfully, false if not, i.e. the
     // node with the same key already existed in the list.
     bool contains(const key_type &data) const {return sl_->find(data);}
-    bool add(const key_type &data) {return sl_->addOrGetData(data).second;}
+    bool add(const value_type &data) {return sl_->addOrGetData(data).second;}
     bool remove(const key_type &data) {return sl_->remove(data);}
 
   private:
@@ -623,16 +704,17 @@ namespace atlas {
   };
 
   // Skipper interface
-  template<typename T, typename Comp, int MAX_HEIGHT>
-  class concurrent_skip_list<T, Comp, MAX_HEIGHT>::Skipper {
+  template<typename T, typename Comp, int MAX_HEIGHT, typename KeyOf>
+  class concurrent_skip_list<T, Comp, MAX_HEIGHT, KeyOf>::Skipper {
 
     typedef detail::SkipListNode<T> NodeType;
-    typedef concurrent_skip_list<T, Comp, MAX_HEIGHT> skip_list_type;
+    typedef concurrent_skip_list<T, Comp, MAX_HEIGHT, KeyOf> skip_list_type;
     typedef typename skip_list_type::Accessor Accessor;
 
   public:
 
     typedef T value_type;
+    typedef typename KeyOf::key_type key_type;
     typedef T& reference;
     typedef T* pointer;
     typedef ptrdiff_t difference_type;
@@ -692,7 +774,7 @@ namespace atlas {
      *
      * Returns true if the data is found, false otherwise.
      */
-    bool to(const value_type &data) {
+    bool to(const key_type &data) {
       int layer = curHeight() - 1;
       if (layer < 0) return false;   // reaches the end of the list
 
@@ -720,6 +802,22 @@ namespace atlas {
     uint8_t hints_[MAX_HEIGHT];
   };
 
+  /*
+   * An ordered concurrent map, the (key, value) pairs are ordered by the keys, and accessed
+   * through an Accessor as the skip list is, the reads are lock free.
+   *
+   *   auto accessor = concurrent_skip_list_map<int, std::string>::create();
+   *   accessor.insert(std::make_pair(1, "one"));
+   *   auto it = accessor.find(1);
+   *   if (it != accessor.end()) use(it->second);
+   *   for (auto it = accessor.lower_bound(from); it != accessor.end() && it->first < to; ++it) ...
+   *
+   * A value is not locked while it's read, a value which may be changed concurrently should be
+   * an atomic or a shared pointer to an immutable one
+   * */
+  template<typename K, typename V, typename Comp = std::less<K>, int MAX_HEIGHT = 24>
+  using concurrent_skip_list_map = concurrent_skip_list<std::pair<const K, V>, Comp, MAX_HEIGHT, detail::csl_select1st<K, V>>;
+
 } // atlas
 
 #endif  // FOLLY_CONCURRENT_SKIP_LIST_H_
@@ -18,18 +18,43 @@
 #ifndef FOLLY_CONCURRENTSKIPLIST_INL_H_
 #define FOLLY_CONCURRENTSKIPLIST_INL_H_
 
+#include <cassert>
+#include <cstdlib>
 #include <algorithm>
-#include <type_traits>
+#include <atomic>
 #include <climits>
 #include <cmath>
+#include <limits>
+#include <mutex>
+#include <type_traits>
+#include <utility>
+
+#include <boost/noncopyable.hpp>
 
-#include <boost/random.hpp>
+#include <atlas/fast_random.h>
+#include <atlas/lock.h>
 
 namespace atlas {
   namespace detail {
 
     template<typename ValT, typename NodeT> class csl_iterator;
 
+    // the key of a value, the value itself for a set
+    template<typename T>
+    struct csl_identity {
+      typedef T key_type;
+
+      const key_type& operator()(const T& value) const { return value; }
+    };
+
+    // the first of a (key, value) pair for a map
+    template<typename K, typename V>
+    struct csl_select1st {
+      typedef K key_type;
+
+      const key_type& operator()(const std::pair<const K, V>& value) const { return value.first; }
+    };
+
     template<typename T>
     class SkipListNode : boost::noncopyable {
 
@@ -58,7 +83,7 @@ namespace atlas {
 
         // copy the head node to a new head node assuming lock acquired
         SkipListNode* copyHead(SkipListNode* node) {
-          std::assert(node != nullptr && height_ > node->height_);
+          assert(node != nullptr && height_ > node->height_);
 
           setFlags(node->getFlags());
           for (int i = 0; i < node->height_; ++i) {
@@ -68,7 +93,7 @@ namespace atlas {
         }
 
         inline SkipListNode* skip(int layer) const {
-          std::assert(layer < height_);
+          assert(layer < height_);
 
           return skip_[layer].load(std::memory_order_consume);
         }
@@ -83,7 +108,7 @@ namespace atlas {
         }
 
         void setSkip(uint8_t h, SkipListNode* next) {
-          std::assert(h < height_);
+          assert(h < height_);
 
           skip_[h].store(next, std::memory_order_release);
         }
@@ -195,10 +220,9 @@ namespace atlas {
         sizeLimitTable_[kMaxHeight - 1] = kMaxSizeLimit;
       }
 
+      // in [0, 1), from the 53 high bits of the per-thread generator
       static double randomProb() {
-        // TODO : check thread_local
-        static thread_local boost::lagged_fibonacci2281 rng_;
-        return (*rng_)();
+        return (fast_random() >> 11) * (1.0 / (1ULL << 53));
       }
 
       double lookupTable_[kMaxHeight];
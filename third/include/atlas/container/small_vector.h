@@ -0,0 +1,385 @@
+/*
+ * small_vector.h
+ *
+ *  Created on: Sep 28, 2013
+ *      Author: vincent
+ */
+
+#ifndef ATLAS_CONTAINER_SMALL_VECTOR_H_
+#define ATLAS_CONTAINER_SMALL_VECTOR_H_
+
+#include <cstddef>
+#include <cstring>
+#include <algorithm>
+#include <initializer_list>
+#include <iterator>
+#include <new>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+
+namespace atlas {
+
+  /*
+   * A vector which keeps it's first N elements inline, and goes to the heap only once it grows past them, so the
+   * short lists built and thrown away on every request, the responses of a task, the calls of a batch, the peers
+   * of a round, take no allocation in the common case.
+   *
+   * It's the std::vector interface less the inserts in the middle, and the elements are moved, not copied, when
+   * it grows. The elements copied as bytes, see is_relocatable, are copied and moved by memcpy, and never
+   * destroyed. A small_vector moved from gives away it's heap buffer, the inline elements are moved one by one.
+   * Unlike std::vector, the iterators are invalidated by a move or a swap of an inline small_vector
+   * */
+  template<typename T, size_t N>
+  class small_vector {
+  public:
+
+    static_assert(N > 0, "a small_vector keeps one element inline at least");
+
+    typedef T value_type;
+    typedef T& reference;
+    typedef const T& const_reference;
+    typedef T* pointer;
+    typedef const T* const_pointer;
+    typedef T* iterator;
+    typedef const T* const_iterator;
+    typedef std::reverse_iterator<iterator> reverse_iterator;
+    typedef std::reverse_iterator<const_iterator> const_reverse_iterator;
+    typedef size_t size_type;
+    typedef ptrdiff_t difference_type;
+
+    // copied as bytes, gcc 4.7 has no std::is_trivially_copyable
+    enum { is_relocatable = __has_trivial_copy(T) && __has_trivial_destructor(T) };
+
+    static const size_t inline_capacity = N;
+
+  public:
+
+    small_vector() : _begin(inline_data()), _size(0), _capacity(N) {}
+
+    explicit small_vector(size_t n) : _begin(inline_data()), _size(0), _capacity(N) { resize(n); }
+
+    small_vector(size_t n, const T& value) : _begin(inline_data()), _size(0), _capacity(N) { assign(n, value); }
+
+    template<typename InputIt, typename = typename std::enable_if<!std::is_integral<InputIt>::value>::type>
+    small_vector(InputIt first, InputIt last) : _begin(inline_data()), _size(0), _capacity(N) { assign(first, last); }
+
+    small_vector(std::initializer_list<T> list) : _begin(inline_data()), _size(0), _capacity(N) {
+      assign(list.begin(), list.end());
+    }
+
+    small_vector(const small_vector& other) : _begin(inline_data()), _size(0), _capacity(N) {
+      assign(other.begin(), other.end());
+    }
+
+    small_vector(small_vector&& other) : _begin(inline_data()), _size(0), _capacity(N) { take(other); }
+
+    ~small_vector() {
+      destroy(_begin, _begin + _size);
+      release();
+    }
+
+    small_vector& operator=(const small_vector& other) {
+      if (this != &other) assign(other.begin(), other.end());
+      return *this;
+    }
+
+    small_vector& operator=(small_vector&& other) {
+      if (this != &other) {
+        clear();
+        release();
+        _begin = inline_data();
+        _capacity = N;
+        take(other);
+      }
+
+      return *this;
+    }
+
+    small_vector& operator=(std::initializer_list<T> list) {
+      assign(list.begin(), list.end());
+      return *this;
+    }
+
+  public:
+
+    iterator begin() { return _begin; }
+    const_iterator begin() const { return _begin; }
+    const_iterator cbegin() const { return _begin; }
+    iterator end() { return _begin + _size; }
+    const_iterator end() const { return _begin + _size; }
+    const_iterator cend() const { return _begin + _size; }
+
+    reverse_iterator rbegin() { return reverse_iterator(end()); }
+    const_reverse_iterator rbegin() const { return const_reverse_iterator(end()); }
+    reverse_iterator rend() { return reverse_iterator(begin()); }
+    const_reverse_iterator rend() const { return const_reverse_iterator(begin()); }
+
+    size_t size() const { return _size; }
+    size_t capacity() const { return _capacity; }
+    bool empty() const { return _size == 0; }
+
+    // the elements are in the inline storage, no allocation was made
+    bool is_inline() const { return _begin == inline_data(); }
+
+    T* data() { return _begin; }
+    const T* data() const { return _begin; }
+
+    T& operator[](size_t i) { return _begin[i]; }
+    const T& operator[](size_t i) const { return _begin[i]; }
+
+    T& at(size_t i) {
+      if (i >= _size) throw std::out_of_range("small_vector::at");
+      return _begin[i];
+    }
+
+    const T& at(size_t i) const {
+      if (i >= _size) throw std::out_of_range("small_vector::at");
+      return _begin[i];
+    }
+
+    T& front() { return _begin[0]; }
+    const T& front() const { return _begin[0]; }
+    T& back() { return _begin[_size - 1]; }
+    const T& back() const { return _begin[_size - 1]; }
+
+  public:
+
+    void reserve(size_t n) {
+      if (n > _capacity) reallocate(n);
+    }
+
+    // back to the inline storage if the elements fit in it
+    void shrink_to_fit() {
+      if (is_inline() || _size > N) return;
+
+      T* heap = _begin;
+      relocate(heap, heap + _size, inline_data());
+      ::operator delete(heap);
+
+      _begin = inline_data();
+      _capacity = N;
+    }
+
+    template<typename... Args>
+    T& emplace_back(Args&&... args) {
+      if (_size == _capacity) return grow_emplace(std::forward<Args>(args)...);
+
+      T* p = _begin + _size;
+      new (p) T(std::forward<Args>(args)...);
+      ++_size;
+
+      return *p;
+    }
+
+    void push_back(const T& value) { emplace_back(value); }
+
+    void push_back(T&& value) { emplace_back(std::move(value)); }
+
+    void pop_back() {
+      --_size;
+      _begin[_size].~T();
+    }
+
+    iterator erase(const_iterator pos) { return erase(pos, pos + 1); }
+
+    // the elements after the range are moved down
+    iterator erase(const_iterator first, const_iterator last) {
+      T* f = const_cast<T*>(first);
+      T* l = const_cast<T*>(last);
+      if (f == l) return f;
+
+      T* e = end();
+      T* to = std::move(l, e, f);
+      destroy(to, e);
+      _size -= l - f;
+
+      return f;
+    }
+
+    void clear() {
+      destroy(_begin, _begin + _size);
+      _size = 0;
+    }
+
+    void resize(size_t n) {
+      if (n < _size) {
+        destroy(_begin + n, _begin + _size);
+        _size = n;
+        return;
+      }
+
+      reserve(n);
+      for (; _size < n; ++_size) new (_begin + _size) T();
+    }
+
+    void resize(size_t n, const T& value) {
+      if (n < _size) {
+        destroy(_begin + n, _begin + _size);
+        _size = n;
+        return;
+      }
+
+      if (n > _capacity) {
+        // the value may be an element
+        T copy(value);
+        reserve(n);
+        for (; _size < n; ++_size) new (_begin + _size) T(copy);
+        return;
+      }
+
+      for (; _size < n; ++_size) new (_begin + _size) T(value);
+    }
+
+    void assign(size_t n, const T& value) {
+      // the value may be an element, copy it before it's destroyed
+      T copy(value);
+      clear();
+      reserve(n);
+      for (; _size < n; ++_size) new (_begin + _size) T(copy);
+    }
+
+    template<typename InputIt, typename = typename std::enable_if<!std::is_integral<InputIt>::value>::type>
+    void assign(InputIt first, InputIt last) {
+      clear();
+      append(first, last, typename std::iterator_traits<InputIt>::iterator_category());
+    }
+
+    void swap(small_vector& other) {
+      small_vector tmp(std::move(other));
+      other = std::move(*this);
+      *this = std::move(tmp);
+    }
+
+  private:
+
+    T* inline_data() { return reinterpret_cast<T*>(&_inline); }
+
+    const T* inline_data() const { return reinterpret_cast<const T*>(&_inline); }
+
+    static T* allocate(size_t n) { return static_cast<T*>(::operator new(n * sizeof(T))); }
+
+    void release() {
+      if (!is_inline()) ::operator delete(_begin);
+    }
+
+    static void destroy(T* first, T* last) { destroy(first, last, std::integral_constant<bool, is_relocatable>()); }
+
+    static void destroy(T*, T*, std::true_type) {}
+
+    static void destroy(T* first, T* last, std::false_type) {
+      for (; first != last; ++first) first->~T();
+    }
+
+    // the elements are moved to the uninitialized memory, and destroyed where they were
+    static void relocate(T* first, T* last, T* to) {
+      relocate(first, last, to, std::integral_constant<bool, is_relocatable>());
+    }
+
+    static void relocate(T* first, T* last, T* to, std::true_type) {
+      if (first != last) std::memcpy(static_cast<void*>(to), first, (last - first) * sizeof(T));
+    }
+
+    static void relocate(T* first, T* last, T* to, std::false_type) {
+      for (; first != last; ++first, ++to) {
+        new (to) T(std::move(*first));
+        first->~T();
+      }
+    }
+
+    size_t grown(size_t n) const { return std::max(n, _capacity * 2); }
+
+    void reallocate(size_t n) {
+      T* p = allocate(n);
+      relocate(_begin, _begin + _size, p);
+      release();
+
+      _begin = p;
+      _capacity = n;
+    }
+
+    // the new element is built before the old ones move, the arguments may refer to them
+    template<typename... Args>
+    T& grow_emplace(Args&&... args) {
+      size_t capacity = grown(_size + 1);
+      T* p = allocate(capacity);
+
+      try {
+        new (p + _size) T(std::forward<Args>(args)...);
+      }
+      catch (...) {
+        ::operator delete(p);
+        throw;
+      }
+
+      relocate(_begin, _begin + _size, p);
+      release();
+
+      _begin = p;
+      _capacity = capacity;
+
+      return _begin[_size++];
+    }
+
+    template<typename InputIt>
+    void append(InputIt first, InputIt last, std::input_iterator_tag) {
+      for (; first != last; ++first) emplace_back(*first);
+    }
+
+    template<typename ForwardIt>
+    void append(ForwardIt first, ForwardIt last, std::forward_iterator_tag) {
+      size_t n = std::distance(first, last);
+      if (_size + n > _capacity) reallocate(grown(_size + n));
+
+      for (; first != last; ++first, ++_size) new (_begin + _size) T(*first);
+    }
+
+    // the buffer of the other one if it's on the heap, it's elements otherwise, the other one is left empty
+    void take(small_vector& other) {
+      if (!other.is_inline()) {
+        _begin = other._begin;
+        _size = other._size;
+        _capacity = other._capacity;
+
+        other._begin = other.inline_data();
+        other._size = 0;
+        other._capacity = N;
+        return;
+      }
+
+      relocate(other._begin, other._begin + other._size, _begin);
+      _size = other._size;
+      other._size = 0;
+    }
+
+  private:
+
+    T* _begin;
+    size_t _size;
+    size_t _capacity;
+    typename std::aligned_storage<sizeof(T) * N, std::alignment_of<T>::value>::type _inline;
+  };
+
+  template<typename T, size_t N>
+  inline bool operator==(const small_vector<T, N>& a, const small_vector<T, N>& b) {
+    return a.size() == b.size() && std::equal(a.begin(), a.end(), b.begin());
+  }
+
+  template<typename T, size_t N>
+  inline bool operator!=(const small_vector<T, N>& a, const small_vector<T, N>& b) {
+    return !(a == b);
+  }
+
+  template<typename T, size_t N>
+  inline bool operator<(const small_vector<T, N>& a, const small_vector<T, N>& b) {
+    return std::lexicographical_compare(a.begin(), a.end(), b.begin(), b.end());
+  }
+
+  template<typename T, size_t N>
+  inline void swap(small_vector<T, N>& a, small_vector<T, N>& b) {
+    a.swap(b);
+  }
+
+} // atlas
+
+#endif /* ATLAS_CONTAINER_SMALL_VECTOR_H_ */
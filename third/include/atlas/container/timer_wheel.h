@@ -0,0 +1,139 @@
+/*
+ * timer_wheel.h
+ *
+ *  Created on: Aug 23, 2013
+ *      Author: vincent
+ */
+
+#ifndef ATLAS_TIMER_WHEEL_H_
+#define ATLAS_TIMER_WHEEL_H_
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <vector>
+#include <utility>
+#include <algorithm>
+
+namespace atlas {
+
+  /*
+   * A hashed timer wheel which tracks the deadlines of keys.
+   *
+   * Keys are put into the slot of their deadline tick, if the deadline is more than one revolution away,
+   * the key stays in the slot until the wheel comes around again. Keys are never removed before they expire,
+   * the owner should ignore the expired keys which are completed already, this makes add() cheap and keeps
+   * the memory bounded by the number of keys added in the last timeout period.
+   *
+   * add() is thread safe, advance() should be called from one thread, for example, a timer in an event loop
+   * */
+  template<typename Key>
+  class timer_wheel {
+  public:
+
+    typedef Key key_type;
+    typedef std::chrono::steady_clock clock;
+    typedef clock::time_point time_point;
+    typedef clock::duration duration;
+
+  public:
+
+    timer_wheel(duration tick = std::chrono::milliseconds(100), size_t slot_count = 512) :
+      _tick(tick), _start(clock::now()), _current_tick(0), _slots(slot_count)
+    {}
+
+  public:
+
+    duration tick() const { return _tick; }
+
+    void add(const key_type& key, time_point deadline) {
+      // the first tick after the deadline, so the key expires no matter when the tick is processed
+      int64_t t = to_tick(deadline) + 1;
+
+      for (;;) {
+        // never put a key into a slot which has been processed, or it has to wait a whole revolution
+        int64_t current = _current_tick.load(std::memory_order_acquire);
+        if (t <= current) t = current + 1;
+
+        slot& s = _slots[t % _slots.size()];
+        std::lock_guard<std::mutex> guard(s.mutex);
+
+        // advance() publishes the tick before it drains the slots, so if the tick is still before t under
+        // the lock of the slot, the slot is drained after the key is in
+        if (t > _current_tick.load(std::memory_order_acquire)) {
+          s.entries.push_back(std::make_pair(deadline, key));
+          return;
+        }
+
+        // the wheel moved past t, try the slot of the next tick
+      }
+    }
+
+    // call on_expired for every key expires before now, no lock is held when on_expired is called
+    template<typename F>
+    void advance(time_point now, F on_expired) {
+      int64_t last = to_tick(now);
+      int64_t current = _current_tick.load(std::memory_order_relaxed);
+      if (last <= current) return;
+
+      int64_t first = current + 1;
+      _current_tick.store(last, std::memory_order_release);
+
+      // one revolution covers every slot
+      if (last - first >= static_cast<int64_t>(_slots.size())) first = last - _slots.size() + 1;
+
+      std::vector<key_type> expired;
+      for (int64_t t = first; t <= last; ++t) {
+        slot& s = _slots[t % _slots.size()];
+
+        std::lock_guard<std::mutex> guard(s.mutex);
+        auto it = std::partition(s.entries.begin(), s.entries.end(), [now](const entry& e) {
+          return e.first > now;
+        });
+
+        for (auto i = it; i != s.entries.end(); ++i) expired.push_back(std::move(i->second));
+        s.entries.erase(it, s.entries.end());
+      }
+
+      for (const key_type& key : expired) on_expired(key);
+    }
+
+    size_t size() const {
+      size_t count = 0;
+
+      for (const slot& s : _slots) {
+        std::lock_guard<std::mutex> guard(s.mutex);
+        count += s.entries.size();
+      }
+
+      return count;
+    }
+
+  private:
+
+    int64_t to_tick(time_point t) const {
+      if (t <= _start) return 0;
+      return (t - _start) / _tick;
+    }
+
+  private:
+
+    typedef std::pair<time_point, key_type> entry;
+
+    struct slot {
+      mutable std::mutex mutex;
+      std::vector<entry> entries;
+    };
+
+    const duration _tick;
+    const time_point _start;
+
+    // written by advance() only
+    std::atomic<int64_t> _current_tick;
+
+    std::vector<slot> _slots;
+  };
+
+} // atlas
+
+#endif /* ATLAS_TIMER_WHEEL_H_ */
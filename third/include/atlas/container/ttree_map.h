@@ -0,0 +1,582 @@
+/*
+ * ttree_map.h
+ *
+ *  Created on: Sep 6, 2013
+ *      Author: vincent
+ */
+
+#ifndef ATLAS_TTREE_MAP_H_
+#define ATLAS_TTREE_MAP_H_
+
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <functional>
+#include <iterator>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include <atlas/container/node_search.h>
+
+namespace atlas {
+
+  /*
+   * An ordered map on a T-tree, the typed version of the T*-tree in container/ttree.
+   *
+   * A T-tree is an AVL tree whose nodes hold up to NodeSize sorted items, a key is first compared with the minimum
+   * and the maximum of a node to find the bounding node, and then searched in it's items, so a lookup touches
+   * far fewer nodes than a binary tree does. The compare is a template parameter, so it's inlined, there is no
+   * function pointer call per comparison as in ttree.c, and an item is kept in the node, not pointed to.
+   *
+   * bulk_load() builds a balanced tree from the sorted items with every node filled up, it's the compact form for
+   * the read mostly indexes, insert() and erase() keep the tree balanced as usual afterwards.
+   *
+   * As the btree, insert() and erase() move the items in a node, so they invalidate the iterators to the other
+   * items. Not thread safe
+   * */
+  template<typename Key, typename Value, typename Compare = std::less<Key>, int NodeSize = 16>
+  class ttree_map {
+  public:
+
+    typedef Key key_type;
+    typedef Value mapped_type;
+    typedef std::pair<const Key, Value> value_type;
+    typedef Compare key_compare;
+    typedef size_t size_type;
+    typedef std::ptrdiff_t difference_type;
+    typedef value_type& reference;
+    typedef const value_type& const_reference;
+    typedef value_type* pointer;
+    typedef const value_type* const_pointer;
+
+    static_assert(NodeSize >= 2, "a T-tree node holds 2 items at least");
+
+  private:
+
+    // the items are moved in the nodes, so the key is not const in the node, see btree
+    typedef std::pair<Key, Value> mutable_value_type;
+
+    // an internal node keeps at least so many items, so the tree stays compact after erase
+    static const int min_internal_count = NodeSize - NodeSize / 4;
+
+    struct node {
+      node(node* p) : parent(p), left(nullptr), right(nullptr), height(1), count(0) {}
+
+      mutable_value_type& item(int i) { return *reinterpret_cast<mutable_value_type*>(&items[i]); }
+
+      const mutable_value_type& item(int i) const { return *reinterpret_cast<const mutable_value_type*>(&items[i]); }
+
+      const Key& min_key() const { return item(0).first; }
+
+      const Key& max_key() const { return item(count - 1).first; }
+
+      node* parent;
+      node* left;
+      node* right;
+      int height;
+      int count;
+
+      typename std::aligned_storage<sizeof(mutable_value_type), std::alignment_of<mutable_value_type>::value>::type items[NodeSize];
+    };
+
+  public:
+
+    template<typename Reference, typename Pointer>
+    class basic_iterator : public std::iterator<std::bidirectional_iterator_tag, value_type, difference_type, Pointer, Reference> {
+    public:
+
+      basic_iterator() : _tree(nullptr), _node(nullptr), _index(0) {}
+
+      // iterator to const_iterator
+      template<typename R, typename P>
+      basic_iterator(const basic_iterator<R, P>& other) : _tree(other._tree), _node(other._node), _index(other._index) {}
+
+    public:
+
+      Reference operator*() const { return reinterpret_cast<Reference>(_node->item(_index)); }
+
+      Pointer operator->() const { return &**this; }
+
+      basic_iterator& operator++() {
+        if (++_index == _node->count) {
+          _node = next_node(_node);
+          _index = 0;
+        }
+
+        return *this;
+      }
+
+      basic_iterator operator++(int) {
+        basic_iterator it = *this;
+        ++*this;
+        return it;
+      }
+
+      // --end() is the last item
+      basic_iterator& operator--() {
+        if (!_node) {
+          _node = rightmost(_tree->_root);
+          _index = _node->count - 1;
+        }
+        else if (_index-- == 0) {
+          _node = prev_node(_node);
+          _index = _node->count - 1;
+        }
+
+        return *this;
+      }
+
+      basic_iterator operator--(int) {
+        basic_iterator it = *this;
+        --*this;
+        return it;
+      }
+
+      template<typename R, typename P>
+      bool operator==(const basic_iterator<R, P>& other) const { return _node == other._node && _index == other._index; }
+
+      template<typename R, typename P>
+      bool operator!=(const basic_iterator<R, P>& other) const { return !(*this == other); }
+
+    private:
+
+      friend class ttree_map;
+      template<typename R, typename P> friend class basic_iterator;
+
+      basic_iterator(const ttree_map* tree, node* n, int index) : _tree(tree), _node(n), _index(index) {}
+
+      const ttree_map* _tree;
+      node* _node;
+      int _index;
+    };
+
+    typedef basic_iterator<reference, pointer> iterator;
+    typedef basic_iterator<const_reference, const_pointer> const_iterator;
+
+  public:
+
+    explicit ttree_map(const key_compare& compare = key_compare()) : _compare(compare), _root(nullptr), _size(0) {}
+
+    ttree_map(ttree_map&& other) : _compare(other._compare), _root(other._root), _size(other._size) {
+      other._root = nullptr;
+      other._size = 0;
+    }
+
+    ~ttree_map() { clear(); }
+
+    ttree_map(const ttree_map&) = delete;
+    ttree_map& operator=(const ttree_map&) = delete;
+
+  public:
+
+    iterator begin() { return iterator(this, leftmost(_root), 0); }
+
+    const_iterator begin() const { return const_iterator(this, leftmost(_root), 0); }
+
+    iterator end() { return iterator(this, nullptr, 0); }
+
+    const_iterator end() const { return const_iterator(this, nullptr, 0); }
+
+    size_type size() const { return _size; }
+
+    bool empty() const { return _size == 0; }
+
+    key_compare key_comp() const { return _compare; }
+
+  public:
+
+    iterator find(const key_type& key) {
+      node* n = bounding_node(key);
+      if (!n) return end();
+
+      int i = lower_bound_in(n, key);
+      if (i == n->count || _compare(key, n->item(i).first)) return end();
+
+      return iterator(this, n, i);
+    }
+
+    const_iterator find(const key_type& key) const { return const_cast<ttree_map*>(this)->find(key); }
+
+    size_type count(const key_type& key) const { return find(key) == end() ? 0 : 1; }
+
+    // the first item not less than the key
+    iterator lower_bound(const key_type& key) {
+      node* n = bounding_node(key);
+      if (!n) return begin();
+
+      return at_or_next(n, lower_bound_in(n, key));
+    }
+
+    const_iterator lower_bound(const key_type& key) const { return const_cast<ttree_map*>(this)->lower_bound(key); }
+
+    // the first item greater than the key
+    iterator upper_bound(const key_type& key) {
+      node* n = bounding_node(key);
+      if (!n) return begin();
+
+      return at_or_next(n, upper_bound_in(n, key));
+    }
+
+    const_iterator upper_bound(const key_type& key) const { return const_cast<ttree_map*>(this)->upper_bound(key); }
+
+    // the cursors of the items in [from, to)
+    std::pair<iterator, iterator> range(const key_type& from, const key_type& to) {
+      if (!_compare(from, to)) return std::make_pair(end(), end());
+      return std::make_pair(lower_bound(from), lower_bound(to));
+    }
+
+    std::pair<const_iterator, const_iterator> range(const key_type& from, const key_type& to) const {
+      if (!_compare(from, to)) return std::make_pair(end(), end());
+      return std::make_pair(lower_bound(from), lower_bound(to));
+    }
+
+    mapped_type& operator[](const key_type& key) { return insert(value_type(key, mapped_type())).first->second; }
+
+  public:
+
+    std::pair<iterator, bool> insert(const value_type& value) { return insert_unique(mutable_value_type(value)); }
+
+    std::pair<iterator, bool> insert(value_type&& value) {
+      return insert_unique(mutable_value_type(std::move(const_cast<key_type&>(value.first)), std::move(value.second)));
+    }
+
+    size_type erase(const key_type& key) {
+      node* n = bounding_node(key);
+      if (!n) return 0;
+
+      int i = lower_bound_in(n, key);
+      if (i == n->count || _compare(key, n->item(i).first)) return 0;
+
+      erase_at(n, i);
+      --_size;
+
+      if (n->left && n->right) {
+        // an internal node borrows the greatest lower bound, so it's never empty
+        if (n->count < min_internal_count) {
+          node* glb = rightmost(n->left);
+          insert_at(n, 0, std::move(glb->item(glb->count - 1)));
+          erase_at(glb, glb->count - 1);
+
+          if (glb->count == 0) remove_node(glb);
+        }
+      }
+      else if (n->count == 0) remove_node(n);
+
+      return 1;
+    }
+
+    /*
+     * Rebuild the map from the items sorted by the key without duplicates, the nodes are filled up and
+     * the tree is balanced perfectly. It's much faster than inserting one by one, and the tree is smaller
+     * */
+    template<typename InputIterator>
+    void bulk_load(InputIterator first, InputIterator last) {
+      clear();
+
+      std::vector<node*> nodes;
+      node* n = nullptr;
+
+      for (; first != last; ++first) {
+        mutable_value_type value(*first);
+        assert(!n || _compare(n->max_key(), value.first));
+
+        if (!n || n->count == NodeSize) {
+          n = new node(nullptr);
+          nodes.push_back(n);
+        }
+
+        insert_at(n, n->count, std::move(value));
+        ++_size;
+      }
+
+      _root = build(nodes, 0, nodes.size(), nullptr);
+    }
+
+    void clear() {
+      destroy(_root);
+      _root = nullptr;
+      _size = 0;
+    }
+
+    void swap(ttree_map& other) {
+      std::swap(_compare, other._compare);
+      std::swap(_root, other._root);
+      std::swap(_size, other._size);
+    }
+
+  private:
+
+    std::pair<iterator, bool> insert_unique(mutable_value_type&& value) {
+      if (!_root) {
+        _root = new node(nullptr);
+        insert_at(_root, 0, std::move(value));
+        ++_size;
+
+        return std::make_pair(iterator(this, _root, 0), true);
+      }
+
+      node* n = _root;
+      while (true) {
+        if (_compare(value.first, n->min_key())) {
+          if (n->left) {
+            n = n->left;
+            continue;
+          }
+
+          // the least item of it's subtree, the node takes it if it has room
+          ++_size;
+          if (n->count < NodeSize) {
+            insert_at(n, 0, std::move(value));
+            return std::make_pair(iterator(this, n, 0), true);
+          }
+
+          node* child = add_child(n, value, true);
+          return std::make_pair(iterator(this, child, 0), true);
+        }
+
+        if (_compare(n->max_key(), value.first)) {
+          if (n->right) {
+            n = n->right;
+            continue;
+          }
+
+          ++_size;
+          if (n->count < NodeSize) {
+            insert_at(n, n->count, std::move(value));
+            return std::make_pair(iterator(this, n, n->count - 1), true);
+          }
+
+          node* child = add_child(n, value, false);
+          return std::make_pair(iterator(this, child, 0), true);
+        }
+
+        // the bounding node
+        int i = lower_bound_in(n, value.first);
+        if (!_compare(value.first, n->item(i).first)) return std::make_pair(iterator(this, n, i), false);
+
+        ++_size;
+        if (n->count < NodeSize) {
+          insert_at(n, i, std::move(value));
+          return std::make_pair(iterator(this, n, i), true);
+        }
+
+        // a full node gives it's minimum to the greatest lower bound, i > 0 since the key is greater than the minimum
+        mutable_value_type min(std::move(n->item(0)));
+        erase_at(n, 0);
+        insert_at(n, i - 1, std::move(value));
+
+        if (!n->left) add_child(n, min, true);
+        else {
+          node* glb = rightmost(n->left);
+          if (glb->count < NodeSize) insert_at(glb, glb->count, std::move(min));
+          else add_child(glb, min, false);
+        }
+
+        // the rotations move the nodes, not the items
+        return std::make_pair(iterator(this, n, i - 1), true);
+      }
+    }
+
+    node* add_child(node* parent, mutable_value_type& value, bool left) {
+      node* child = new node(parent);
+      insert_at(child, 0, std::move(value));
+
+      (left ? parent->left : parent->right) = child;
+      rebalance(parent);
+
+      return child;
+    }
+
+    // the node has one child at most
+    void remove_node(node* n) {
+      node* child = n->left ? n->left : n->right;
+      node* parent = n->parent;
+
+      if (child) child->parent = parent;
+      replace_child(parent, n, child);
+
+      delete n;
+      rebalance(parent);
+    }
+
+    /*
+     * The node with the greatest minimum not greater than the key, the key is in it if it's anywhere. Only the
+     * minimums are compared on the way down, as Lehman and Carey suggest, so the maximums are never loaded
+     * */
+    node* bounding_node(const key_type& key) const {
+      node* bound = nullptr;
+
+      for (node* n = _root; n;) {
+        if (_compare(key, n->min_key())) n = n->left;
+        else {
+          bound = n;
+          n = n->right;
+        }
+      }
+
+      return bound;
+    }
+
+    iterator at_or_next(node* n, int i) {
+      if (i == n->count) return iterator(this, next_node(n), 0);
+      return iterator(this, n, i);
+    }
+
+    // the items are apart from each other, so they are searched in binary without a branch, see node_search.h
+    int lower_bound_in(const node* n, const key_type& key) const {
+      return detail::branchless_lower_bound(n->count, key, [n](int i) -> const key_type& { return n->item(i).first; }, _compare);
+    }
+
+    int upper_bound_in(const node* n, const key_type& key) const {
+      const key_compare& compare = _compare;
+      return detail::branchless_lower_bound(n->count, key, [n](int i) -> const key_type& { return n->item(i).first; },
+          [&compare](const key_type& a, const key_type& b) { return !compare(b, a); });
+    }
+
+    // the node has room
+    static void insert_at(node* n, int i, mutable_value_type&& value) {
+      if (i == n->count) new (&n->items[i]) mutable_value_type(std::move(value));
+      else {
+        new (&n->items[n->count]) mutable_value_type(std::move(n->item(n->count - 1)));
+        for (int j = n->count - 1; j > i; --j) n->item(j) = std::move(n->item(j - 1));
+        n->item(i) = std::move(value);
+      }
+
+      ++n->count;
+    }
+
+    static void erase_at(node* n, int i) {
+      for (int j = i; j < n->count - 1; ++j) n->item(j) = std::move(n->item(j + 1));
+
+      n->item(n->count - 1).~mutable_value_type();
+      --n->count;
+    }
+
+    // the AVL rebalance from the node up to the root
+    void rebalance(node* n) {
+      while (n) {
+        update_height(n);
+
+        int balance = height(n->left) - height(n->right);
+        if (balance > 1) {
+          if (height(n->left->left) < height(n->left->right)) rotate_left(n->left);
+          n = rotate_right(n);
+        }
+        else if (balance < -1) {
+          if (height(n->right->right) < height(n->right->left)) rotate_right(n->right);
+          n = rotate_left(n);
+        }
+
+        n = n->parent;
+      }
+    }
+
+    node* rotate_left(node* n) {
+      node* r = n->right;
+
+      n->right = r->left;
+      if (r->left) r->left->parent = n;
+
+      r->parent = n->parent;
+      replace_child(n->parent, n, r);
+
+      r->left = n;
+      n->parent = r;
+
+      update_height(n);
+      update_height(r);
+
+      return r;
+    }
+
+    node* rotate_right(node* n) {
+      node* l = n->left;
+
+      n->left = l->right;
+      if (l->right) l->right->parent = n;
+
+      l->parent = n->parent;
+      replace_child(n->parent, n, l);
+
+      l->right = n;
+      n->parent = l;
+
+      update_height(n);
+      update_height(l);
+
+      return l;
+    }
+
+    void replace_child(node* parent, node* child, node* other) {
+      if (!parent) _root = other;
+      else if (parent->left == child) parent->left = other;
+      else parent->right = other;
+    }
+
+    static int height(const node* n) { return n ? n->height : 0; }
+
+    static void update_height(node* n) {
+      n->height = 1 + std::max(height(n->left), height(n->right));
+    }
+
+    static node* leftmost(node* n) {
+      if (n) while (n->left) n = n->left;
+      return n;
+    }
+
+    static node* rightmost(node* n) {
+      if (n) while (n->right) n = n->right;
+      return n;
+    }
+
+    // the in order successor and predecessor
+    static node* next_node(node* n) {
+      if (n->right) return leftmost(n->right);
+
+      while (n->parent && n == n->parent->right) n = n->parent;
+      return n->parent;
+    }
+
+    static node* prev_node(node* n) {
+      if (n->left) return rightmost(n->left);
+
+      while (n->parent && n == n->parent->left) n = n->parent;
+      return n->parent;
+    }
+
+    static node* build(std::vector<node*>& nodes, size_t first, size_t last, node* parent) {
+      if (first == last) return nullptr;
+
+      size_t middle = first + (last - first) / 2;
+      node* n = nodes[middle];
+
+      n->parent = parent;
+      n->left = build(nodes, first, middle, n);
+      n->right = build(nodes, middle + 1, last, n);
+      update_height(n);
+
+      return n;
+    }
+
+    static void destroy(node* n) {
+      if (!n) return;
+
+      destroy(n->left);
+      destroy(n->right);
+
+      for (int i = 0; i < n->count; ++i) n->item(i).~mutable_value_type();
+      delete n;
+    }
+
+  private:
+
+    key_compare _compare;
+    node* _root;
+    size_type _size;
+  };
+
+} // atlas
+
+#endif /* ATLAS_TTREE_MAP_H_ */
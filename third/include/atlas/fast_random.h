@@ -0,0 +1,48 @@
+/*
+ * fast_random.h
+ *
+ *  Created on: Aug 25, 2013
+ *      Author: vincent
+ */
+
+#ifndef ATLAS_FAST_RANDOM_H_
+#define ATLAS_FAST_RANDOM_H_
+
+#include <cstdint>
+#include <cstddef>
+#include <chrono>
+#include <thread>
+#include <functional>
+
+namespace atlas {
+
+  /*
+   * A per-thread xorshift64* generator, it's not a cryptographic generator, it's used where
+   * a cheap random number is enough, for example, selecting a peer. No lock, no system call and no
+   * construction cost on every call, compared to std::random_device + std::mt19937
+   * */
+  inline uint64_t fast_random() {
+    // gcc 4.7 does not support thread_local, so we use a POD __thread state and seed it lazily
+    static __thread uint64_t state = 0;
+
+    if (state == 0) {
+      state = static_cast<uint64_t>(std::chrono::high_resolution_clock::now().time_since_epoch().count())
+          ^ (static_cast<uint64_t>(std::hash<std::thread::id>()(std::this_thread::get_id())) << 1);
+      if (state == 0) state = 0x9e3779b97f4a7c15ULL;
+    }
+
+    state ^= state >> 12;
+    state ^= state << 25;
+    state ^= state >> 27;
+
+    return state * 0x2545f4914f6cdd1dULL;
+  }
+
+  // a random number in [0, n), n must be greater than 0
+  inline size_t fast_random(size_t n) {
+    return static_cast<size_t>(fast_random() % n);
+  }
+
+} // atlas
+
+#endif /* ATLAS_FAST_RANDOM_H_ */
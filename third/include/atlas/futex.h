@@ -0,0 +1,64 @@
+/*
+ * futex.h
+ *
+ *  Created on: Sep 28, 2013
+ *      Author: vincent
+ */
+
+/*    Copyright 2011 ~ 2013 Vincent Zhang, ivincent.zhang@gmail.com
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#ifndef ATLAS_FUTEX_H_
+#define ATLAS_FUTEX_H_
+
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <climits>
+#include <cstdint>
+#include <atomic>
+#include <chrono>
+
+namespace atlas {
+
+  static_assert(sizeof(std::atomic<uint32_t>) == sizeof(int), "a futex is a 32 bits word");
+
+  /*
+   * Sleep while the word is still expected, the caller checks it again once it returns, since it returns on
+   * a wake, a signal, a spurious wake or a word changed already. The words are private to the process
+   * */
+  inline void futex_wait(std::atomic<uint32_t>* word, uint32_t expected) {
+    ::syscall(SYS_futex, reinterpret_cast<int*>(word), FUTEX_WAIT_PRIVATE, expected, nullptr, nullptr, 0);
+  }
+
+  // as futex_wait, for the time at most
+  inline void futex_wait_for(std::atomic<uint32_t>* word, uint32_t expected, std::chrono::nanoseconds timeout) {
+    if (timeout.count() <= 0) return;
+
+    struct timespec ts;
+    ts.tv_sec = static_cast<time_t>(timeout.count() / 1000000000);
+    ts.tv_nsec = static_cast<long>(timeout.count() % 1000000000);
+
+    ::syscall(SYS_futex, reinterpret_cast<int*>(word), FUTEX_WAIT_PRIVATE, expected, &ts, nullptr, 0);
+  }
+
+  inline void futex_wake_all(std::atomic<uint32_t>* word) {
+    ::syscall(SYS_futex, reinterpret_cast<int*>(word), FUTEX_WAKE_PRIVATE, INT_MAX, nullptr, nullptr, 0);
+  }
+
+} // atlas
+
+#endif /* ATLAS_FUTEX_H_ */
@@ -8,7 +8,16 @@
 #ifndef ATLAS_DIRECTED_TREE_H_
 #define ATLAS_DIRECTED_TREE_H_
 
+#include <cstdint>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
 #include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <typeinfo>
+#include <vector>
 
 #include <boost/mpl/at.hpp>
 #include <boost/fusion/sequence.hpp>
@@ -24,7 +33,7 @@ namespace atlas {
 
     processor_wrapper(Processor& processor) : processor(processor) {}
 
-    void operator()(NodeList& nodes...) {
+    void operator()(NodeList&... nodes) {
       processor()(nodes...);
     }
 
@@ -33,7 +42,7 @@ namespace atlas {
 
   // visit the node for the first time
   template<typename Node, typename Processor, typename Event>
-  struct tree_node_visitor : public boost::base_visitor<tree_node_visitor> {
+  struct tree_node_visitor : public boost::base_visitor<tree_node_visitor<Node, Processor, Event>> {
 
     typedef Event event_filter;
 
@@ -49,7 +58,7 @@ namespace atlas {
   };
 
   template<typename Node, typename Processor, typename Event>
-  struct tree_edge_visitor : public boost::base_visitor<tree_edge_visitor> {
+  struct tree_edge_visitor : public boost::base_visitor<tree_edge_visitor<Node, Processor, Event>> {
 
     typedef Event event_filter;
 
@@ -57,7 +66,7 @@ namespace atlas {
 
     template<class Edge, class Graph>
     inline void operator()(Edge e, Graph& g) {
-      Processor processor(vertexes[target(current, g), source(current, g)]);
+      Processor processor(vertexes[target(e, g)], vertexes[source(e, g)]);
       processor();
     }
 
@@ -65,28 +74,28 @@ namespace atlas {
   };
 
   template<typename Node, typename Processor>
-  using tree_node_initializer = tree_node_visitor<Node, boost::on_initialize_vertex, Processor>;
+  using tree_node_initializer = tree_node_visitor<Node, Processor, boost::on_initialize_vertex>;
 
   template<typename Node, typename Processor>
-  using tree_node_starter = tree_node_visitor<Node, boost::on_start_vertex, Processor>;
+  using tree_node_starter = tree_node_visitor<Node, Processor, boost::on_start_vertex>;
 
   template<typename Node, typename Processor>
-  using tree_node_discover = tree_node_visitor<Node, boost::on_discover_vertex, Processor>;
+  using tree_node_discover = tree_node_visitor<Node, Processor, boost::on_discover_vertex>;
 
   template<typename Node, typename Processor>
-  using tree_node_examiner = tree_node_visitor<Node, boost::on_examine_vertex, Processor>;
+  using tree_node_examiner = tree_node_visitor<Node, Processor, boost::on_examine_vertex>;
 
   template<typename Node, typename Processor>
-  using tree_node_finisher = tree_node_visitor<Node, boost::on_finish_vertex, Processor>;
+  using tree_node_finisher = tree_node_visitor<Node, Processor, boost::on_finish_vertex>;
 
   template<typename Node, typename Processor>
-  using tree_edge_examiner = tree_edge_visitor<Node, boost::on_examine_edge, Processor>;
+  using tree_edge_examiner = tree_edge_visitor<Node, Processor, boost::on_examine_edge>;
 
   template<typename Node, typename Processor>
-  using tree_edge_finisher = tree_edge_visitor<Node, boost::on_tree_edge, Processor>;
+  using tree_edge_finisher = tree_edge_visitor<Node, Processor, boost::on_tree_edge>;
 
   template<typename Node, typename Processor>
-  using tree_edge_back_examiner = tree_edge_visitor<Node, boost::on_back_edge, Processor>;
+  using tree_edge_back_examiner = tree_edge_visitor<Node, Processor, boost::on_back_edge>;
 
   namespace {
 
@@ -122,7 +131,7 @@ namespace atlas {
         typedef typename first<MetaNode>::type first_type;
 
         if (typeid(*parent) == typeid(first_type)) {
-          __processor_invoker invoker(current, parent);
+          __processor_invoker<TreeNode> invoker(current, parent);
           for_each(node.second, invoker);
         }
       }
@@ -140,19 +149,204 @@ namespace atlas {
   template<typename TreeNode, typename TypeTree>
   struct processor_invoker {
 
-    processor_invoker(TreeNode* current, TreeNode* parent = current) : current(current), parent(parent) {}
+    processor_invoker(TreeNode* current) : current(current), parent(current) {}
+
+    processor_invoker(TreeNode* current, TreeNode* parent) : current(current), parent(parent) {}
 
     void operator()() {
       using boost::fusion::for_each;
 
       static const TypeTree mtree;
-      __sub_processor_tree_applier applier(current, parent);
+      __sub_processor_tree_applier<TreeNode> applier(current, parent);
       for_each(mtree, applier);
     }
 
     TreeNode* current;
     TreeNode* parent;
   };
+
+  /*
+   * A tree in the compressed sparse row form, the nodes are numbered from 0 and the children of a node are next
+   * to each other in one array, so a traversal reads the memory in order, with no pointer to chase, it's built
+   * once from the parent of every node and not changed, see parallel_bfs
+   * */
+  class csr_tree {
+  public:
+
+    typedef uint32_t node_type;
+
+    static const node_type npos = static_cast<node_type>(-1);
+
+  public:
+
+    csr_tree() : _root(npos) {}
+
+    // parents[i] is the parent of the node i, npos for the root, the children are in the order of their numbers
+    explicit csr_tree(const std::vector<node_type>& parents) : _root(npos), _parents(parents), _offsets(parents.size() + 1, 0) {
+      for (size_t i = 0; i < parents.size(); ++i) {
+        node_type p = parents[i];
+
+        if (p == npos) {
+          if (_root == npos) _root = static_cast<node_type>(i);
+          continue;
+        }
+
+        if (p >= parents.size() || p == i) throw std::invalid_argument("bad parent of node " + std::to_string(i));
+        ++_offsets[p + 1];
+      }
+
+      for (size_t i = 1; i < _offsets.size(); ++i) _offsets[i] += _offsets[i - 1];
+
+      _children.resize(_offsets.back());
+      std::vector<node_type> next(_offsets.begin(), _offsets.end() - 1);
+      for (size_t i = 0; i < parents.size(); ++i) {
+        if (parents[i] != npos) _children[next[parents[i]]++] = static_cast<node_type>(i);
+      }
+    }
+
+  public:
+
+    size_t size() const { return _parents.size(); }
+
+    bool empty() const { return _parents.empty(); }
+
+    // the first node with no parent, npos if the tree is empty
+    node_type root() const { return _root; }
+
+    node_type parent(node_type n) const { return _parents[n]; }
+
+    size_t child_count(node_type n) const { return _offsets[n + 1] - _offsets[n]; }
+
+    const node_type* children_begin(node_type n) const { return _children.data() + _offsets[n]; }
+
+    const node_type* children_end(node_type n) const { return _children.data() + _offsets[n + 1]; }
+
+  private:
+
+    node_type _root;
+    std::vector<node_type> _parents;
+    std::vector<node_type> _offsets;
+    std::vector<node_type> _children;
+  };
+
+  // the nodes of every depth from the root down, see parallel_bfs
+  typedef std::vector<std::vector<csr_tree::node_type>> tree_levels;
+
+  namespace detail {
+
+    struct chunk_sync {
+
+      chunk_sync(size_t chunks) : next(0), done(0), chunks(chunks) {}
+
+      std::atomic<size_t> next;
+      size_t done;
+      const size_t chunks;
+
+      std::mutex mutex;
+      std::condition_variable finished;
+    };
+
+    /*
+     * Run f(chunk, begin, end) on the chunks of [0, n) on the caller and the free workers of the pool, and return
+     * once all of them are done. The caller takes the chunks as well, so it never waits on a pool whose workers
+     * are all busy, or on itself if it's a worker, a helper which starts late finds nothing left
+     * */
+    template<typename Pool, typename F>
+    void run_chunks(Pool& pool, size_t n, size_t grain, const F& f) {
+      grain = std::max<size_t>(grain, 1);
+      size_t chunks = (n + grain - 1) / grain;
+      if (chunks <= 1) {
+        if (n) f(0, 0, n);
+        return;
+      }
+
+      std::shared_ptr<chunk_sync> sync = std::make_shared<chunk_sync>(chunks);
+
+      // f is not touched once all the chunks are taken, so a late helper never sees it gone
+      std::function<void()> work = [sync, &f, n, grain]() {
+        size_t taken = 0;
+        for (size_t i = sync->next.fetch_add(1); i < sync->chunks; i = sync->next.fetch_add(1)) {
+          f(i, i * grain, std::min(n, (i + 1) * grain));
+          ++taken;
+        }
+
+        if (!taken) return;
+
+        std::lock_guard<std::mutex> guard(sync->mutex);
+        sync->done += taken;
+        if (sync->done == sync->chunks) sync->finished.notify_all();
+      };
+
+      size_t helpers = std::min(chunks - 1, pool.size());
+      for (size_t i = 0; i < helpers; ++i) pool.schedule(typename Pool::task_type(work));
+
+      work();
+
+      std::unique_lock<std::mutex> lock(sync->mutex);
+      sync->finished.wait(lock, [&sync]() { return sync->done == sync->chunks; });
+    }
+
+  } // detail
+
+  /*
+   * A level synchronous breadth first traversal, the nodes of a depth are split in chunks of grain nodes run on
+   * the pool, f(node, depth) is called for each, in parallel with the other nodes of the depth but after all the
+   * nodes above, a level of fewer than grain nodes is run on the caller only. Return the nodes of every depth,
+   * in the order of the children, for a pass back up, see parallel_levels_up. f must not throw
+   * */
+  template<typename Pool, typename F>
+  tree_levels parallel_bfs(const csr_tree& tree, csr_tree::node_type root, Pool& pool, F f, size_t grain = 1024) {
+    typedef csr_tree::node_type node_type;
+
+    tree_levels levels;
+    if (root == csr_tree::npos || root >= tree.size()) return levels;
+
+    levels.push_back(std::vector<node_type>(1, root));
+
+    for (size_t depth = 0; !levels[depth].empty(); ++depth) {
+      const std::vector<node_type>& frontier = levels[depth];
+
+      // every chunk gathers the children of it's own nodes, they are joined in the order of the chunks
+      std::vector<std::vector<node_type>> parts((frontier.size() + std::max<size_t>(grain, 1) - 1) / std::max<size_t>(grain, 1));
+      detail::run_chunks(pool, frontier.size(), grain, [&](size_t chunk, size_t begin, size_t end) {
+        std::vector<node_type>& part = parts[chunk];
+        for (size_t i = begin; i < end; ++i) {
+          node_type n = frontier[i];
+          f(n, depth);
+          part.insert(part.end(), tree.children_begin(n), tree.children_end(n));
+        }
+      });
+
+      size_t total = 0;
+      for (const std::vector<node_type>& part : parts) total += part.size();
+
+      std::vector<node_type> next;
+      next.reserve(total);
+      for (const std::vector<node_type>& part : parts) next.insert(next.end(), part.begin(), part.end());
+
+      // the frontier is a reference into the levels
+      levels.push_back(std::move(next));
+    }
+
+    levels.pop_back();
+    return levels;
+  }
+
+  /*
+   * The levels from the deepest up, f(node, depth) is called after it's called for all the children of the node,
+   * so a node aggregates it's children, the nodes of a depth run in parallel as in parallel_bfs
+   * */
+  template<typename Pool, typename F>
+  void parallel_levels_up(const tree_levels& levels, Pool& pool, F f, size_t grain = 1024) {
+    for (size_t depth = levels.size(); depth-- > 0;) {
+      const std::vector<csr_tree::node_type>& level = levels[depth];
+
+      detail::run_chunks(pool, level.size(), grain, [&](size_t, size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) f(level[i], depth);
+      });
+    }
+  }
+
 } // atlas
 
 #endif /* DIRECTED_TREE_H_ */
@@ -0,0 +1,274 @@
+/*
+ * crc32c.h
+ *
+ *  Created on: Sep 22, 2013
+ *      Author: vincent
+ */
+
+#ifndef ATLAS_IO_CRC32C_H_
+#define ATLAS_IO_CRC32C_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__x86_64__)
+#include <cpuid.h>
+#endif
+
+#if defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
+
+namespace atlas {
+  namespace io {
+
+    /*
+     * The CRC-32C, the Castagnoli polynomial, as iSCSI and ext4 take it, by the crc32 instruction of SSE4.2, or
+     * the one of ARMv8 if the build targets it, and a table otherwise.
+     *
+     * The instruction takes 8 bytes a cycle but waits 3 cycles for the one before, so the long data is taken in
+     * three streams at once, and the three crcs are joined by shifting the first ones over the bytes after them,
+     * a table lookup, the way of Mark Adler's crc32c.c. It runs at the speed of the memory, tens of GB per second
+     * on the data in the cache.
+     *
+     * extend() goes on from the crc of the data before, so the parts of the data are taken one after another,
+     * and the crc of the whole data is the one of it's last part, start with 0
+     * */
+    class crc32c {
+    public:
+
+      static uint32_t extend(uint32_t crc, const void* data, size_t size) {
+        return implementation()(crc, static_cast<const uint8_t*>(data), size);
+      }
+
+      static uint32_t compute(const void* data, size_t size) { return extend(0, data, size); }
+
+      // false if it's the table
+      static bool hardware() { return implementation() != &extend_table; }
+
+      // the one taken on this CPU, checked once
+      static const char* name() {
+#if defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+        return "armv8";
+#else
+        return hardware() ? "sse4.2" : "table";
+#endif
+      }
+
+      // the table one, on every CPU
+      static uint32_t extend_table(uint32_t crc, const uint8_t* p, size_t size) {
+        const tables& t = tables::ref();
+        uint32_t c = ~crc;
+
+        while (size && (reinterpret_cast<uintptr_t>(p) & 7)) {
+          c = t.bytes[0][(c ^ *p++) & 0xff] ^ (c >> 8);
+          --size;
+        }
+
+        // slicing by 8, little endian
+        while (size >= 8) {
+          uint64_t v;
+          std::memcpy(&v, p, sizeof(v));
+          v ^= c;
+
+          c = t.bytes[7][v & 0xff] ^ t.bytes[6][(v >> 8) & 0xff] ^ t.bytes[5][(v >> 16) & 0xff]
+              ^ t.bytes[4][(v >> 24) & 0xff] ^ t.bytes[3][(v >> 32) & 0xff] ^ t.bytes[2][(v >> 40) & 0xff]
+              ^ t.bytes[1][(v >> 48) & 0xff] ^ t.bytes[0][v >> 56];
+
+          p += 8;
+          size -= 8;
+        }
+
+        while (size--) c = t.bytes[0][(c ^ *p++) & 0xff] ^ (c >> 8);
+
+        return ~c;
+      }
+
+    private:
+
+      typedef uint32_t (*extend_type)(uint32_t, const uint8_t*, size_t);
+
+      static const uint32_t polynomial = 0x82f63b78;    // reflected
+
+      // the streams of the three way loops
+      enum { long_block = 8192, short_block = 256 };
+
+      struct tables {
+        uint32_t bytes[8][256];
+        uint32_t long_zeros[4][256];     // shift a crc over long_block zeros
+        uint32_t short_zeros[4][256];    // shift a crc over short_block zeros
+
+        tables() {
+          for (uint32_t n = 0; n < 256; ++n) {
+            uint32_t c = n;
+            for (int k = 0; k < 8; ++k) c = c & 1 ? (c >> 1) ^ polynomial : c >> 1;
+            bytes[0][n] = c;
+          }
+
+          for (uint32_t n = 0; n < 256; ++n) {
+            uint32_t c = bytes[0][n];
+            for (int k = 1; k < 8; ++k) {
+              c = bytes[0][c & 0xff] ^ (c >> 8);
+              bytes[k][n] = c;
+            }
+          }
+
+          zeros(long_zeros, long_block);
+          zeros(short_zeros, short_block);
+        }
+
+        static const tables& ref() {
+          static const tables t;
+          return t;
+        }
+
+        // the operator of the crc over the zero bytes, a 32x32 matrix over GF(2), see zlib's crc32_combine
+        static uint32_t times(const uint32_t* matrix, uint32_t vector) {
+          uint32_t sum = 0;
+          for (; vector; vector >>= 1, ++matrix) {
+            if (vector & 1) sum ^= *matrix;
+          }
+
+          return sum;
+        }
+
+        static void square(uint32_t* square, const uint32_t* matrix) {
+          for (int n = 0; n < 32; ++n) square[n] = times(matrix, matrix[n]);
+        }
+
+        // size is a power of two
+        static void zeros(uint32_t table[4][256], size_t size) {
+          uint32_t odd[32], even[32];
+
+          // one zero bit
+          odd[0] = polynomial;
+          for (int n = 1; n < 32; ++n) odd[n] = uint32_t(1) << (n - 1);
+
+          square(even, odd);     // two bits
+          square(odd, even);     // four bits
+
+          // a byte, then doubled until it's size bytes
+          uint32_t* op = even;
+          for (;;) {
+            square(even, odd);
+            op = even;
+            size >>= 1;
+            if (!size) break;
+
+            square(odd, even);
+            op = odd;
+            size >>= 1;
+            if (!size) break;
+          }
+
+          for (uint32_t n = 0; n < 256; ++n) {
+            table[0][n] = times(op, n);
+            table[1][n] = times(op, n << 8);
+            table[2][n] = times(op, n << 16);
+            table[3][n] = times(op, n << 24);
+          }
+        }
+      };
+
+      static uint32_t shift(const uint32_t table[4][256], uint32_t c) {
+        return table[0][c & 0xff] ^ table[1][(c >> 8) & 0xff] ^ table[2][(c >> 16) & 0xff] ^ table[3][c >> 24];
+      }
+
+#if defined(__x86_64__)
+      // by the instruction, the build need not target SSE4.2
+      struct instruction {
+        static uint64_t u8(uint64_t c, uint8_t v) {
+          uint32_t r = static_cast<uint32_t>(c);
+          __asm__("crc32b %1, %0" : "+r"(r) : "rm"(v));
+          return r;
+        }
+
+        static uint64_t u64(uint64_t c, uint64_t v) {
+          __asm__("crc32q %1, %0" : "+r"(c) : "rm"(v));
+          return c;
+        }
+
+        static bool supported() {
+          unsigned a = 0, b = 0, c = 0, d = 0;
+          return __get_cpuid(1, &a, &b, &c, &d) && (c & (1u << 20));
+        }
+      };
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+      struct instruction {
+        static uint64_t u8(uint64_t c, uint8_t v) { return __crc32cb(static_cast<uint32_t>(c), v); }
+
+        static uint64_t u64(uint64_t c, uint64_t v) { return __crc32cd(static_cast<uint32_t>(c), v); }
+
+        static bool supported() { return true; }
+      };
+#endif
+
+#if defined(__x86_64__) || (defined(__aarch64__) && defined(__ARM_FEATURE_CRC32))
+      static uint64_t load(const uint8_t* p) {
+        uint64_t v;
+        std::memcpy(&v, p, sizeof(v));
+        return v;
+      }
+
+      // three streams of the block at once, joined by the table of the block
+      static const uint8_t* three_way(uint64_t& c0, const uint8_t* p, size_t block, const uint32_t zeros[4][256]) {
+        uint64_t c1 = 0, c2 = 0;
+        const uint8_t* end = p + block;
+
+        do {
+          c0 = instruction::u64(c0, load(p));
+          c1 = instruction::u64(c1, load(p + block));
+          c2 = instruction::u64(c2, load(p + 2 * block));
+          p += 8;
+        } while (p < end);
+
+        c0 = shift(zeros, static_cast<uint32_t>(c0)) ^ c1;
+        c0 = shift(zeros, static_cast<uint32_t>(c0)) ^ c2;
+
+        return p + 2 * block;
+      }
+
+      static uint32_t extend_instruction(uint32_t crc, const uint8_t* p, size_t size) {
+        const tables& t = tables::ref();
+        uint64_t c = ~crc;
+
+        while (size && (reinterpret_cast<uintptr_t>(p) & 7)) {
+          c = instruction::u8(c, *p++);
+          --size;
+        }
+
+        while (size >= 3 * long_block) {
+          p = three_way(c, p, long_block, t.long_zeros);
+          size -= 3 * long_block;
+        }
+
+        while (size >= 3 * short_block) {
+          p = three_way(c, p, short_block, t.short_zeros);
+          size -= 3 * short_block;
+        }
+
+        while (size >= 8) {
+          c = instruction::u64(c, load(p));
+          p += 8;
+          size -= 8;
+        }
+
+        while (size--) c = instruction::u8(c, *p++);
+
+        return ~static_cast<uint32_t>(c);
+      }
+
+      static extend_type implementation() {
+        static const extend_type impl = instruction::supported() ? &extend_instruction : &extend_table;
+        return impl;
+      }
+#else
+      static extend_type implementation() { return &extend_table; }
+#endif
+    };
+
+  } // io
+} // atlas
+
+#endif /* ATLAS_IO_CRC32C_H_ */
@@ -0,0 +1,210 @@
+/*
+ * lz4.h
+ *
+ *  Created on: Sep 22, 2013
+ *      Author: vincent
+ */
+
+#ifndef ATLAS_IO_LZ4_H_
+#define ATLAS_IO_LZ4_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+namespace atlas {
+  namespace io {
+
+    /*
+     * The LZ4 block format, a block compressed here is read by the LZ4 library and the other way round.
+     *
+     * A greedy compressor with one hash table of 4K positions, the fast mode of the reference one, it trades
+     * ratio for speed, a few hundred MB per second a core. The decompressor checks every length and offset
+     * against the input and the output, so a corrupted or a hostile block fails instead of writing out of bounds.
+     * There is no frame, the caller keeps the size of the raw data
+     * */
+    class lz4 {
+    public:
+
+      // the largest block compress() may write for size bytes, incompressible data grows a little
+      static size_t bound(size_t size) { return size + size / 255 + 16; }
+
+      // return the size of the block, or 0 if it does not fit in capacity
+      static size_t compress(const char* source, size_t size, char* dest, size_t capacity) {
+        const uint8_t* const base = reinterpret_cast<const uint8_t*>(source);
+        const uint8_t* const end = base + size;
+        const uint8_t* ip = base;
+        const uint8_t* anchor = base;
+
+        uint8_t* op = reinterpret_cast<uint8_t*>(dest);
+        uint8_t* const oend = op + capacity;
+
+        if (size >= min_match_start) {
+          // a match starts no later than this, and ends before the last literals
+          const uint8_t* const match_start_limit = end - min_match_start;
+          const uint8_t* const match_end_limit = end - last_literals;
+
+          uint32_t table[hash_size];
+          std::memset(table, 0, sizeof(table));
+
+          ++ip;
+          while (ip < match_start_limit) {
+            uint32_t sequence = read32(ip);
+            uint32_t& slot = table[hash(sequence)];
+
+            const uint8_t* ref = base + slot;
+            slot = static_cast<uint32_t>(ip - base);
+
+            if (ref >= ip || ip - ref > max_offset || read32(ref) != sequence) {
+              ++ip;
+              continue;
+            }
+
+            // backward, into the literals
+            while (ip > anchor && ref > base && ip[-1] == ref[-1]) {
+              --ip;
+              --ref;
+            }
+
+            const uint8_t* m = ip + min_match;
+            const uint8_t* r = ref + min_match;
+            while (m < match_end_limit && *m == *r) {
+              ++m;
+              ++r;
+            }
+
+            op = write_sequence(op, oend, anchor, ip - anchor, ip - ref, m - ip);
+            if (!op) return 0;
+
+            ip = m;
+            anchor = ip;
+          }
+        }
+
+        op = write_sequence(op, oend, anchor, end - anchor, 0, 0);
+        if (!op) return 0;
+
+        return op - reinterpret_cast<uint8_t*>(dest);
+      }
+
+      // return false unless the block decodes to exactly size bytes
+      static bool decompress(const char* source, size_t source_size, char* dest, size_t size) {
+        const uint8_t* ip = reinterpret_cast<const uint8_t*>(source);
+        const uint8_t* const iend = ip + source_size;
+
+        uint8_t* const obase = reinterpret_cast<uint8_t*>(dest);
+        uint8_t* op = obase;
+        uint8_t* const oend = op + size;
+
+        while (ip < iend) {
+          unsigned token = *ip++;
+
+          size_t literals = token >> 4;
+          if (literals == 15 && !read_length(ip, iend, literals)) return false;
+
+          if (literals > static_cast<size_t>(iend - ip) || literals > static_cast<size_t>(oend - op)) return false;
+          std::memcpy(op, ip, literals);
+          ip += literals;
+          op += literals;
+
+          // the last sequence has no match
+          if (ip == iend) break;
+
+          if (iend - ip < 2) return false;
+          size_t offset = ip[0] | (ip[1] << 8);
+          ip += 2;
+
+          if (offset == 0 || offset > static_cast<size_t>(op - obase)) return false;
+
+          size_t length = token & 15;
+          if (length == 15 && !read_length(ip, iend, length)) return false;
+          length += min_match;
+
+          if (length > static_cast<size_t>(oend - op)) return false;
+
+          const uint8_t* match = op - offset;
+          if (offset >= length) {
+            std::memcpy(op, match, length);
+            op += length;
+          }
+          else {
+            // overlapped, a run
+            while (length--) *op++ = *match++;
+          }
+        }
+
+        return op == oend;
+      }
+
+    private:
+
+      static const size_t min_match = 4;
+      static const size_t last_literals = 5;
+      static const size_t min_match_start = 12;
+      static const ptrdiff_t max_offset = 65535;
+
+      static const int hash_bits = 12;
+      static const size_t hash_size = size_t(1) << hash_bits;
+
+      static uint32_t read32(const uint8_t* p) {
+        uint32_t v;
+        std::memcpy(&v, p, sizeof(v));
+        return v;
+      }
+
+      static uint32_t hash(uint32_t sequence) {
+        return (sequence * 2654435761U) >> (32 - hash_bits);
+      }
+
+      static uint8_t* write_length(uint8_t* op, size_t length) {
+        while (length >= 255) {
+          *op++ = 255;
+          length -= 255;
+        }
+        *op++ = static_cast<uint8_t>(length);
+
+        return op;
+      }
+
+      // a match of 0 bytes is the last sequence, literals only
+      static uint8_t* write_sequence(uint8_t* op, uint8_t* oend, const uint8_t* literals, size_t literal_length,
+          size_t offset, size_t match_length) {
+        size_t need = 1 + literal_length / 255 + 1 + literal_length + (match_length ? 2 + match_length / 255 + 1 : 0);
+        if (need > static_cast<size_t>(oend - op)) return nullptr;
+
+        uint8_t* token = op++;
+        *token = static_cast<uint8_t>((literal_length < 15 ? literal_length : 15) << 4);
+        if (literal_length >= 15) op = write_length(op, literal_length - 15);
+
+        std::memcpy(op, literals, literal_length);
+        op += literal_length;
+
+        if (!match_length) return op;
+
+        *op++ = static_cast<uint8_t>(offset);
+        *op++ = static_cast<uint8_t>(offset >> 8);
+
+        size_t length = match_length - min_match;
+        *token |= static_cast<uint8_t>(length < 15 ? length : 15);
+        if (length >= 15) op = write_length(op, length - 15);
+
+        return op;
+      }
+
+      static bool read_length(const uint8_t*& ip, const uint8_t* iend, size_t& length) {
+        unsigned b = 0;
+
+        do {
+          if (ip >= iend) return false;
+          b = *ip++;
+          length += b;
+        } while (b == 255);
+
+        return true;
+      }
+    };
+
+  } // io
+} // atlas
+
+#endif /* ATLAS_IO_LZ4_H_ */
@@ -0,0 +1,93 @@
+/*
+ * memstream.h
+ *
+ *  Created on: Aug 20, 2013
+ *      Author: vincent
+ */
+
+#ifndef ATLAS_IO_MEMSTREAM_H_
+#define ATLAS_IO_MEMSTREAM_H_
+
+#include <cstddef>
+#include <string>
+#include <istream>
+#include <ostream>
+#include <streambuf>
+
+namespace atlas {
+  namespace io {
+
+    // a read only stream buffer over a borrowed memory block, nothing is copied,
+    // the caller must keep the memory alive while the buffer is in use
+    class imembuf : public std::streambuf {
+    public:
+
+      imembuf(const char* data, size_t size) {
+        char* p = const_cast<char*>(data);
+        setg(p, p, p + size);
+      }
+
+    protected:
+
+      virtual pos_type seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which) {
+        char* pos = nullptr;
+
+        if (dir == std::ios_base::beg) pos = eback() + off;
+        else if (dir == std::ios_base::cur) pos = gptr() + off;
+        else pos = egptr() + off;
+
+        if (pos < eback() || pos > egptr()) return pos_type(off_type(-1));
+
+        setg(eback(), pos, egptr());
+        return pos_type(pos - eback());
+      }
+
+      virtual pos_type seekpos(pos_type pos, std::ios_base::openmode which) {
+        return seekoff(off_type(pos), std::ios_base::beg, which);
+      }
+    };
+
+    // an std::istream reads from a borrowed memory block, used to replace std::istringstream
+    // to avoid copying the source data into a std::string
+    class imemstream : private imembuf, public std::istream {
+    public:
+
+      imemstream(const char* data, size_t size) : imembuf(data, size), std::istream(static_cast<imembuf*>(this)) {}
+    };
+
+    // a stream buffer appends everything written to a borrowed std::string
+    class appendbuf : public std::streambuf {
+    public:
+
+      appendbuf(std::string& s) : _s(s) {}
+
+    protected:
+
+      virtual int_type overflow(int_type c) {
+        if (!traits_type::eq_int_type(c, traits_type::eof())) _s.push_back(traits_type::to_char_type(c));
+
+        return traits_type::not_eof(c);
+      }
+
+      virtual std::streamsize xsputn(const char* data, std::streamsize size) {
+        _s.append(data, size);
+        return size;
+      }
+
+    private:
+
+      std::string& _s;
+    };
+
+    // an std::ostream appends to a borrowed std::string, used to replace std::ostringstream
+    // when the result should be placed after some existing data, for example, a message header
+    class oappendstream : private appendbuf, public std::ostream {
+    public:
+
+      oappendstream(std::string& s) : appendbuf(s), std::ostream(static_cast<appendbuf*>(this)) {}
+    };
+
+  } // io
+} // atlas
+
+#endif /* ATLAS_IO_MEMSTREAM_H_ */
@@ -40,8 +40,14 @@
 #ifndef ATLAS_LOCK_H_
 #define ATLAS_LOCK_H_
 
+#include <ctime>
 #include <cassert>
 #include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <array>
+#include <atomic>
+#include <type_traits>
 
 namespace atlas {
   namespace {
@@ -131,7 +137,7 @@ namespace atlas {
     }
 
     void unlock() {
-      std::assert(_lock == LOCKED);
+      assert(_lock == LOCKED);
 
       asm volatile("" : : : "memory");
       _lock = FREE; // release barrier on x86
@@ -177,7 +183,7 @@ namespace atlas {
      * (This doesn't use a constructor because we want to be a POD.)
      */
     void init(IntType initialValue = 0) {
-      std::assert(!(initialValue & kLockBitMask_));
+      assert(!(initialValue & kLockBitMask_));
 
       _lock = initialValue;
     }
@@ -202,7 +208,7 @@ namespace atlas {
      * guaranteed that no other threads may be trying to use this.
      */
     void set_data(IntType w) {
-      std::assert(!(w & kLockBitMask_));
+      assert(!(w & kLockBitMask_));
       _lock = (_lock & kLockBitMask_) | w;
     }
 
@@ -286,12 +292,6 @@ namespace atlas {
 // TODO: generate it from configure (`getconf LEVEL1_DCACHE_LINESIZE`)
 #define FOLLY_CACHE_LINE_SIZE 64
 
-#if __cplusplus <= 201103
-  // TODO : char c?
-  struct max_align_t { char c; } __attribute__((aligned));
-  constexpr static const int alignof(max_align_t) { return sizeof(max_align_t); }
-#endif
-
   template<class T, size_t N>
   struct spin_lock_array {
 
@@ -314,8 +314,8 @@ namespace atlas {
     static_assert(sizeof(padded_spin_lock) == FOLLY_CACHE_LINE_SIZE, "Invalid size of padded_spin_lock");
 
     // Check if T can theoretically cross a cache line.
-    // BAD : not implemented yet in gcc-4.7.2
-    constexpr static const int align = alignof(max_align_t());
+    // gcc 4.7 has no std::max_align_t, the largest alignment of the target is the same
+    static const int align = __BIGGEST_ALIGNMENT__;
     static_assert(align > 0 && FOLLY_CACHE_LINE_SIZE % align == 0 && sizeof(T) <= align,
         "T may cross cache line boundaries");
 
@@ -323,6 +323,235 @@ namespace atlas {
     std::array<padded_spin_lock, N> data_;
   } __attribute__((aligned));
 
+  /*
+   * A reader writer spin lock in a cache line of it's own, for the state read on every request and changed
+   * seldom, the readers take it shared without waiting for each other. A writer waiting turns the new readers
+   * away, so a stream of readers never starves it.
+   *
+   * The names are the ones of std::shared_timed_mutex, so std::lock_guard takes it exclusively and
+   * boost::shared_lock takes it shared. Keep the sections short, the waiters spin and then sleep, see sleeper
+   * */
+  class rw_spin_lock {
+  public:
+
+    rw_spin_lock() : _bits(0) {}
+
+    rw_spin_lock(const rw_spin_lock&) = delete;
+    rw_spin_lock& operator=(const rw_spin_lock&) = delete;
+
+  public:
+
+    void lock() {
+      sleeper sleeper;
+      while (!try_lock()) {
+        // the readers coming are turned away until we have it
+        if (!(_bits.load(std::memory_order_relaxed) & PENDING)) _bits.fetch_or(PENDING, std::memory_order_relaxed);
+        sleeper.wait();
+      }
+    }
+
+    // the pending bit of this writer, or of another one, is taken too
+    bool try_lock() {
+      int32_t bits = _bits.load(std::memory_order_relaxed);
+      if (bits & ~PENDING) return false;
+
+      return _bits.compare_exchange_strong(bits, WRITER, std::memory_order_acquire, std::memory_order_relaxed);
+    }
+
+    void unlock() {
+      _bits.fetch_and(~WRITER, std::memory_order_release);
+    }
+
+    void lock_shared() {
+      sleeper sleeper;
+      while (!try_lock_shared()) sleeper.wait();
+    }
+
+    bool try_lock_shared() {
+      int32_t bits = _bits.fetch_add(READER, std::memory_order_acquire);
+      if (!(bits & (WRITER | PENDING))) return true;
+
+      _bits.fetch_sub(READER, std::memory_order_release);
+      return false;
+    }
+
+    void unlock_shared() {
+      _bits.fetch_sub(READER, std::memory_order_release);
+    }
+
+  private:
+
+    enum : int32_t { WRITER = 1, PENDING = 2, READER = 4 };
+
+    std::atomic<int32_t> _bits;
+    char _padding[FOLLY_CACHE_LINE_SIZE - sizeof(std::atomic<int32_t>)];
+  } __attribute__((aligned(FOLLY_CACHE_LINE_SIZE)));
+
+  /*
+   * A sequence lock over a small value which is copied as bytes, a few words, the readers copy it without
+   * writing anything shared, and copy it again if a writer was in the middle, so a reader never slows another
+   * reader or the writer down. The writers take turns on the sequence itself.
+   *
+   * For a value read far more often than it's written, a larger one is better shared by versioned_snapshot
+   * */
+  template<typename T>
+  class seqlock {
+  public:
+
+    // gcc 4.7 has no std::is_trivially_copyable
+    static_assert(__has_trivial_copy(T), "the value of a seqlock must be copied as bytes");
+
+  public:
+
+    seqlock() : _seq(0), _value() {}
+
+    explicit seqlock(const T& value) : _seq(0), _value(value) {}
+
+    seqlock(const seqlock&) = delete;
+    seqlock& operator=(const seqlock&) = delete;
+
+  public:
+
+    T load() const {
+      T value;
+
+      sleeper sleeper;
+      for (;;) {
+        uint32_t seq = _seq.load(std::memory_order_acquire);
+        if (!(seq & 1)) {
+          std::memcpy(&value, &_value, sizeof(T));
+
+          std::atomic_thread_fence(std::memory_order_acquire);
+          if (_seq.load(std::memory_order_relaxed) == seq) return value;
+        }
+
+        sleeper.wait();
+      }
+    }
+
+    void store(const T& value) {
+      uint32_t seq = _seq.load(std::memory_order_relaxed);
+
+      // an odd sequence is a writer in the middle
+      sleeper sleeper;
+      while ((seq & 1) || !_seq.compare_exchange_weak(seq, seq + 1, std::memory_order_relaxed)) {
+        sleeper.wait();
+        seq = _seq.load(std::memory_order_relaxed);
+      }
+
+      std::atomic_thread_fence(std::memory_order_release);
+      std::memcpy(&_value, &value, sizeof(T));
+
+      _seq.store(seq + 2, std::memory_order_release);
+    }
+
+  private:
+
+    std::atomic<uint32_t> _seq;
+    T _value;
+  };
+
+  namespace detail {
+
+    // the reader slot of the calling thread, the threads are spread round robin, and a thread keeps it's slot,
+    // gcc 4.7 does not support thread_local
+    inline size_t reader_slot() {
+      static std::atomic<size_t> next(0);
+      static __thread size_t slot = 0;
+
+      if (!slot) slot = next.fetch_add(1, std::memory_order_relaxed) + 1;
+      return slot - 1;
+    }
+
+  } // detail
+
+  /*
+   * A reader writer lock whose readers count themselves in the slots of their threads, a cache line a slot,
+   * so the readers on all the cores write no line in common, and scale with the cores as long as the threads
+   * are not many more than the slots. A writer raises the flag, which turns the new readers away, and waits for
+   * all the slots to drain, so the writes are much slower than with rw_spin_lock, it's for the state written
+   * once in a long while. The names are the ones of rw_spin_lock
+   * */
+  template<size_t Slots = 64>
+  class distributed_rw_lock {
+  public:
+
+    static_assert(Slots > 0 && (Slots & (Slots - 1)) == 0, "the slot number must be a power of 2");
+
+  public:
+
+    distributed_rw_lock() : _writer(false) {
+      for (slot& s : _slots) s.readers.store(0, std::memory_order_relaxed);
+    }
+
+    distributed_rw_lock(const distributed_rw_lock&) = delete;
+    distributed_rw_lock& operator=(const distributed_rw_lock&) = delete;
+
+  public:
+
+    void lock() {
+      sleeper sleeper;
+      while (_writer.exchange(true, std::memory_order_seq_cst)) sleeper.wait();
+
+      for (slot& s : _slots) {
+        while (s.readers.load(std::memory_order_acquire)) sleeper.wait();
+      }
+    }
+
+    bool try_lock() {
+      if (_writer.exchange(true, std::memory_order_seq_cst)) return false;
+
+      for (slot& s : _slots) {
+        if (s.readers.load(std::memory_order_acquire)) {
+          _writer.store(false, std::memory_order_release);
+          return false;
+        }
+      }
+
+      return true;
+    }
+
+    void unlock() {
+      _writer.store(false, std::memory_order_release);
+    }
+
+    void lock_shared() {
+      sleeper sleeper;
+      while (!try_lock_shared()) {
+        while (_writer.load(std::memory_order_relaxed)) sleeper.wait();
+      }
+    }
+
+    // the count and the flag are seq_cst, either the reader sees the flag or the writer sees the count
+    bool try_lock_shared() {
+      std::atomic<int32_t>& readers = local();
+      readers.fetch_add(1, std::memory_order_seq_cst);
+      if (!_writer.load(std::memory_order_seq_cst)) return true;
+
+      readers.fetch_sub(1, std::memory_order_release);
+      return false;
+    }
+
+    void unlock_shared() {
+      local().fetch_sub(1, std::memory_order_release);
+    }
+
+  private:
+
+    struct slot {
+      std::atomic<int32_t> readers;
+      char padding[FOLLY_CACHE_LINE_SIZE - sizeof(std::atomic<int32_t>)];
+    };
+
+    std::atomic<int32_t>& local() { return _slots[detail::reader_slot() & (Slots - 1)].readers; }
+
+  private:
+
+    std::atomic<bool> _writer;
+    char _padding[FOLLY_CACHE_LINE_SIZE - sizeof(std::atomic<bool>)];
+    std::array<slot, Slots> _slots;
+  } __attribute__((aligned(FOLLY_CACHE_LINE_SIZE)));
+
 } // atlas
 
 #endif /* ATLAS_LOCK_H_ */
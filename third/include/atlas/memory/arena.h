@@ -0,0 +1,384 @@
+/*
+ * arena.h
+ *
+ *  Created on: Sep 6, 2013
+ *      Author: vincent
+ */
+
+#ifndef ATLAS_MEMORY_ARENA_H_
+#define ATLAS_MEMORY_ARENA_H_
+
+#include <pthread.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <limits>
+#include <memory>
+#include <string>
+#include <vector>
+#include <type_traits>
+#include <utility>
+
+namespace atlas {
+  namespace memory {
+
+    // a polymorphic memory resource, as the std::pmr one, the allocators hold a pointer to it
+    class memory_resource {
+    public:
+
+      static const size_t max_align = sizeof(void*) * 2;
+
+    public:
+
+      virtual ~memory_resource() {}
+
+    public:
+
+      void* allocate(size_t bytes, size_t alignment = max_align) { return do_allocate(bytes, alignment); }
+
+      void deallocate(void* p, size_t bytes, size_t alignment = max_align) { do_deallocate(p, bytes, alignment); }
+
+      bool is_equal(const memory_resource& other) const noexcept { return do_is_equal(other); }
+
+    protected:
+
+      virtual void* do_allocate(size_t bytes, size_t alignment) = 0;
+
+      virtual void do_deallocate(void* p, size_t bytes, size_t alignment) = 0;
+
+      virtual bool do_is_equal(const memory_resource& other) const noexcept { return this == &other; }
+    };
+
+    // the global operator new and delete, the default, the memory is aligned to max_align, no more
+    class new_delete_resource_type : public memory_resource {
+    protected:
+
+      virtual void* do_allocate(size_t bytes, size_t /* alignment */) { return ::operator new(bytes); }
+
+      virtual void do_deallocate(void* p, size_t /* bytes */, size_t /* alignment */) { ::operator delete(p); }
+
+      virtual bool do_is_equal(const memory_resource& other) const noexcept {
+        return dynamic_cast<const new_delete_resource_type*>(&other) != nullptr;
+      }
+    };
+
+    inline memory_resource* new_delete_resource() noexcept {
+      static new_delete_resource_type resource;
+      return &resource;
+    }
+
+    /*
+     * A monotonic arena, the memory is carved from big blocks one after another and never freed one by one,
+     * deallocate() does nothing, all the memory is released at once by rewind() or release().
+     *
+     * A new block is taken from the upstream once the block is used up, twice as large if a round needs more than
+     * one block, the largest block released is kept as a spare for the next round, so an arena reused request after
+     * request settles down to one block and never goes to the upstream again.
+     *
+     * It's not thread safe, every thread uses it's own arena, see thread_arena()
+     * */
+    class monotonic_arena : public memory_resource {
+    public:
+
+      // everything allocated after the mark is released by rewind(mark)
+      struct marker {
+        void* block;
+        size_t used;
+      };
+
+      static const size_t default_block_size = 4 * 1024;
+      static const size_t max_block_size = 1024 * 1024;
+
+    public:
+
+      explicit monotonic_arena(size_t initial_size = default_block_size, memory_resource* upstream = new_delete_resource()) :
+          _upstream(upstream), _head(nullptr), _spare(nullptr), _used(0), _next_size(initial_size) {
+        if (_next_size < sizeof(block) * 2) _next_size = sizeof(block) * 2;
+      }
+
+      virtual ~monotonic_arena() {
+        release();
+        free_block(_spare);
+      }
+
+      monotonic_arena(const monotonic_arena&) = delete;
+      monotonic_arena& operator=(const monotonic_arena&) = delete;
+
+    public:
+
+      marker mark() const {
+        marker m = { _head, _used };
+        return m;
+      }
+
+      // the objects allocated after the mark must be destroyed already
+      void rewind(const marker& m) {
+        while (_head && _head != m.block) {
+          block* b = _head;
+          _head = b->next;
+          retire(b);
+        }
+
+        _used = _head ? m.used : 0;
+      }
+
+      void release() {
+        marker m = { nullptr, 0 };
+        rewind(m);
+      }
+
+      // the bytes taken from the upstream and not released, the spare is not counted
+      size_t capacity() const {
+        size_t size = 0;
+        for (block* b = _head; b; b = b->next) size += b->size;
+
+        return size;
+      }
+
+      memory_resource* upstream() const { return _upstream; }
+
+    protected:
+
+      virtual void* do_allocate(size_t bytes, size_t alignment) {
+        if (_head) {
+          void* p = carve(bytes, alignment);
+          if (p) return p;
+        }
+
+        new_block(bytes + alignment);
+
+        return carve(bytes, alignment);
+      }
+
+      virtual void do_deallocate(void* /* p */, size_t /* bytes */, size_t /* alignment */) {}
+
+    private:
+
+      struct block {
+        block* next;
+        size_t size;
+      };
+
+      static const size_t header_size = (sizeof(block) + max_align - 1) & ~(max_align - 1);
+
+      void* carve(size_t bytes, size_t alignment) {
+        uintptr_t base = reinterpret_cast<uintptr_t>(_head) + header_size;
+        uintptr_t p = (base + _used + alignment - 1) & ~static_cast<uintptr_t>(alignment - 1);
+
+        if (p + bytes > reinterpret_cast<uintptr_t>(_head) + _head->size) return nullptr;
+
+        _used = p + bytes - base;
+        return reinterpret_cast<void*>(p);
+      }
+
+      void new_block(size_t least) {
+        size_t size = least + header_size;
+
+        block* b = nullptr;
+        if (_spare && _spare->size >= size) {
+          b = _spare;
+          _spare = nullptr;
+        }
+        else {
+          // the blocks grow only if a round needs more than one block
+          if (_head && _next_size < max_block_size) _next_size = _next_size * 2 < max_block_size ? _next_size * 2 : max_block_size;
+          if (size < _next_size) size = _next_size;
+
+          b = static_cast<block*>(_upstream->allocate(size));
+          b->size = size;
+        }
+
+        b->next = _head;
+        _head = b;
+        _used = 0;
+      }
+
+      // keep the largest one
+      void retire(block* b) {
+        if (_spare && _spare->size >= b->size) {
+          free_block(b);
+          return;
+        }
+
+        free_block(_spare);
+        _spare = b;
+      }
+
+      void free_block(block* b) {
+        if (b) _upstream->deallocate(b, b->size);
+      }
+
+    private:
+
+      memory_resource* _upstream;
+      block* _head;
+      block* _spare;
+      size_t _used;
+      size_t _next_size;
+    };
+
+    namespace detail {
+
+      struct thread_arena_key {
+        thread_arena_key() { ::pthread_key_create(&key, &thread_arena_key::destroy); }
+
+        static void destroy(void* p) { delete static_cast<monotonic_arena*>(p); }
+
+        pthread_key_t key;
+      };
+
+      inline memory_resource*& current_resource() {
+        static __thread memory_resource* resource = nullptr;
+        return resource;
+      }
+
+      inline memory_resource*& arena_upstream() {
+        static memory_resource* upstream = nullptr;
+        return upstream;
+      }
+
+    } // detail
+
+    /*
+     * The resource the arenas of the threads take their blocks from, the huge pages for example, see
+     * huge_page_resource, the heap by default. Set it before the threads start, it must outlive them
+     * */
+    inline void set_thread_arena_upstream(memory_resource* upstream) { detail::arena_upstream() = upstream; }
+
+    // the arena of the calling thread, it's destroyed when the thread exits, we use __thread since gcc 4.7 does not support thread_local
+    inline monotonic_arena& thread_arena() {
+      static detail::thread_arena_key k;
+      static __thread monotonic_arena* arena = nullptr;
+
+      if (!arena) {
+        memory_resource* upstream = detail::arena_upstream();
+        arena = new monotonic_arena(monotonic_arena::default_block_size, upstream ? upstream : new_delete_resource());
+        ::pthread_setspecific(k.key, arena);
+      }
+
+      return *arena;
+    }
+
+    // the resource the default constructed arena allocators draw from in this thread
+    inline memory_resource* current_resource() noexcept {
+      memory_resource* r = detail::current_resource();
+      return r ? r : new_delete_resource();
+    }
+
+    /*
+     * Make the arena the current resource of the calling thread while it's alive, and give back everything allocated
+     * from the arena in the scope once it ends, for example, a request is executed in a scope, and all the arguments
+     * it decodes are freed in one shot after it. The scopes may be nested, an inner scope gives back only
+     * what's allocated in it.
+     *
+     * Never keep an object allocated in the scope after the scope, copy it into a normal one
+     * */
+    class arena_scope {
+    public:
+
+      explicit arena_scope(monotonic_arena& arena = thread_arena()) :
+          _arena(arena), _mark(arena.mark()), _previous(detail::current_resource()) {
+        detail::current_resource() = &_arena;
+      }
+
+      ~arena_scope() {
+        detail::current_resource() = _previous;
+        _arena.rewind(_mark);
+      }
+
+      arena_scope(const arena_scope&) = delete;
+      arena_scope& operator=(const arena_scope&) = delete;
+
+    private:
+
+      monotonic_arena& _arena;
+      monotonic_arena::marker _mark;
+      memory_resource* _previous;
+    };
+
+    /*
+     * A standard allocator over a memory resource, a default constructed one draws from the current resource
+     * of the thread, which is the arena of the request being executed, or the global heap outside any arena_scope.
+     * The resource is kept by the allocator, so a container allocates and frees from the same one wherever it's used
+     * */
+    template<typename T>
+    class arena_allocator {
+    public:
+
+      typedef T value_type;
+      typedef T* pointer;
+      typedef const T* const_pointer;
+      typedef T& reference;
+      typedef const T& const_reference;
+      typedef size_t size_type;
+      typedef std::ptrdiff_t difference_type;
+
+      template<typename U>
+      struct rebind {
+        typedef arena_allocator<U> other;
+      };
+
+    public:
+
+      arena_allocator() noexcept : _resource(current_resource()) {}
+
+      arena_allocator(memory_resource* resource) noexcept : _resource(resource) {}
+
+      arena_allocator(const arena_allocator& other) noexcept : _resource(other._resource) {}
+
+      template<typename U>
+      arena_allocator(const arena_allocator<U>& other) noexcept : _resource(other.resource()) {}
+
+    public:
+
+      pointer address(reference r) const { return std::addressof(r); }
+
+      const_pointer address(const_reference r) const { return std::addressof(r); }
+
+      pointer allocate(size_type n, const void* hint = 0) {
+        if (n > max_size()) throw std::bad_alloc();
+        return static_cast<pointer>(_resource->allocate(n * sizeof(T), alignment()));
+      }
+
+      void deallocate(pointer p, size_type n) noexcept { _resource->deallocate(p, n * sizeof(T), alignment()); }
+
+      size_type max_size() const noexcept { return std::numeric_limits<size_type>::max() / sizeof(T); }
+
+      template<typename U, typename... Args>
+      void construct(U* p, Args&&... args) {
+        ::new (static_cast<void*>(p)) U(std::forward<Args>(args)...);
+      }
+
+      template<typename U>
+      void destroy(U* p) { p->~U(); }
+
+      memory_resource* resource() const noexcept { return _resource; }
+
+    private:
+
+      static size_t alignment() { return std::alignment_of<T>::value; }
+
+    private:
+
+      memory_resource* _resource;
+    };
+
+    template<typename T, typename U>
+    bool operator==(const arena_allocator<T>& a, const arena_allocator<U>& b) {
+      return a.resource() == b.resource() || a.resource()->is_equal(*b.resource());
+    }
+
+    template<typename T, typename U>
+    bool operator!=(const arena_allocator<T>& a, const arena_allocator<U>& b) { return !(a == b); }
+
+    // the containers for the per-request data, for example, the arguments of a remote function
+    typedef std::basic_string<char, std::char_traits<char>, arena_allocator<char>> arena_string;
+
+    template<typename T>
+    using arena_vector = std::vector<T, arena_allocator<T>>;
+
+  } // memory
+} // atlas
+
+#endif /* ATLAS_MEMORY_ARENA_H_ */
@@ -0,0 +1,224 @@
+/*
+ * epoch.h
+ *
+ *  Created on: Sep 6, 2013
+ *      Author: vincent
+ */
+
+#ifndef ATLAS_MEMORY_EPOCH_H_
+#define ATLAS_MEMORY_EPOCH_H_
+
+#include <pthread.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <atomic>
+#include <mutex>
+#include <stdexcept>
+#include <vector>
+
+namespace atlas {
+  namespace memory {
+
+    /*
+     * Epoch based reclamation, by Keir Fraser, "Practical lock-freedom".
+     *
+     * A reader pins the global epoch while it reads the shared nodes, see epoch_guard, a writer unlinks a node and
+     * retires it. The global epoch advances only once every pinned thread has seen the current one, so a node retired
+     * in epoch e is not reachable by anyone after the epoch reaches e + 2, and it's deleted then.
+     *
+     * Every thread pins it's own record, which is on it's own cache line, so the readers on different cores never
+     * write the same line, unlike a shared reference count. The retired nodes are kept by the thread which retires
+     * them, and are reclaimed by it every reclaim_period retires. The nodes left by an exiting thread are reclaimed
+     * by the others.
+     *
+     * At most max_threads threads use it at the same time, we use __thread since gcc 4.7 does not support thread_local
+     * */
+    class epoch_domain {
+    public:
+
+      typedef void (*deleter_type)(void*);
+
+      static const size_t max_threads = 256;
+      static const size_t reclaim_period = 64;
+
+    private:
+
+      struct retired {
+        void* p;
+        deleter_type deleter;
+        uint64_t epoch;
+      };
+
+      struct record {
+        record() : epoch(0), in_use(false), nesting(0), retires(0) {}
+
+        std::atomic<uint64_t> epoch; // the pinned epoch, 0 if not pinned
+        std::atomic<bool> in_use;
+
+        // the owner thread only
+        size_t nesting;
+        size_t retires;
+        std::vector<retired> limbo;
+      } __attribute__((aligned(64)));
+
+      epoch_domain() : _epoch(1), _records_used(0) {
+        ::pthread_key_create(&_exit_key, &epoch_domain::on_thread_exit);
+      }
+
+      // at exit, nobody reads any more
+      ~epoch_domain() {
+        for (record& r : _records) free_all(r.limbo);
+        free_all(_orphans);
+      }
+
+      epoch_domain(const epoch_domain&) = delete;
+      epoch_domain& operator=(const epoch_domain&) = delete;
+
+    public:
+
+      // shared by all the containers, a pinned thread holds back the reclamation of all of them
+      static epoch_domain& instance() {
+        static epoch_domain domain;
+        return domain;
+      }
+
+    public:
+
+      // may be nested
+      void pin() {
+        record& r = local();
+        if (r.nesting++) return;
+
+        // the pin is seen before any node is read
+        r.epoch.store(_epoch.load(std::memory_order_relaxed), std::memory_order_seq_cst);
+      }
+
+      void unpin() {
+        record& r = local();
+        if (--r.nesting) return;
+
+        r.epoch.store(0, std::memory_order_release);
+      }
+
+      // the node is unlinked already, it's deleted once no thread can see it
+      void retire(void* p, deleter_type deleter) {
+        record& r = local();
+
+        retired n = { p, deleter, _epoch.load(std::memory_order_seq_cst) };
+        r.limbo.push_back(n);
+
+        if (++r.retires % reclaim_period == 0) reclaim(r);
+      }
+
+      uint64_t epoch() const { return _epoch.load(std::memory_order_acquire); }
+
+    private:
+
+      // advance the epoch if we can, and delete our nodes which are old enough
+      void reclaim(record& r) {
+        try_advance();
+        uint64_t safe = _epoch.load(std::memory_order_acquire);
+
+        free_before(r.limbo, safe);
+
+        // the nodes of the exited threads, whoever gets the lock does it
+        std::unique_lock<std::mutex> lock(_orphans_mutex, std::try_to_lock);
+        if (lock.owns_lock()) free_before(_orphans, safe);
+      }
+
+      void try_advance() {
+        uint64_t current = _epoch.load(std::memory_order_seq_cst);
+
+        size_t used = _records_used.load(std::memory_order_acquire);
+        for (size_t i = 0; i < used; ++i) {
+          uint64_t e = _records[i].epoch.load(std::memory_order_seq_cst);
+          if (e != 0 && e != current) return;
+        }
+
+        _epoch.compare_exchange_strong(current, current + 1, std::memory_order_seq_cst);
+      }
+
+      // the nodes retired in epoch e are unreachable once the epoch is e + 2
+      static void free_before(std::vector<retired>& limbo, uint64_t epoch) {
+        size_t kept = 0;
+        for (size_t i = 0; i < limbo.size(); ++i) {
+          if (limbo[i].epoch + 2 <= epoch) limbo[i].deleter(limbo[i].p);
+          else limbo[kept++] = limbo[i];
+        }
+
+        limbo.resize(kept);
+      }
+
+      static void free_all(std::vector<retired>& limbo) {
+        for (retired& n : limbo) n.deleter(n.p);
+        limbo.clear();
+      }
+
+      record& local() {
+        static __thread record* r = nullptr;
+        if (!r) r = acquire();
+
+        return *r;
+      }
+
+      record* acquire() {
+        for (size_t i = 0; i < max_threads; ++i) {
+          bool free = false;
+          if (!_records[i].in_use.load(std::memory_order_relaxed)
+              && _records[i].in_use.compare_exchange_strong(free, true)) {
+            size_t used = _records_used.load();
+            while (used < i + 1 && !_records_used.compare_exchange_weak(used, i + 1)) {}
+
+            ::pthread_setspecific(_exit_key, &_records[i]);
+            return &_records[i];
+          }
+        }
+
+        throw std::length_error("too many threads in the epoch domain");
+      }
+
+      static void on_thread_exit(void* p) {
+        record* r = static_cast<record*>(p);
+        epoch_domain& domain = instance();
+
+        {
+          std::lock_guard<std::mutex> guard(domain._orphans_mutex);
+          domain._orphans.insert(domain._orphans.end(), r->limbo.begin(), r->limbo.end());
+        }
+
+        r->limbo.clear();
+        r->nesting = 0;
+        r->retires = 0;
+        r->epoch.store(0, std::memory_order_release);
+        r->in_use.store(false, std::memory_order_release);
+      }
+
+    private:
+
+      std::atomic<uint64_t> _epoch __attribute__((aligned(64)));
+
+      record _records[max_threads];
+      std::atomic<size_t> _records_used;
+      pthread_key_t _exit_key;
+
+      std::mutex _orphans_mutex;
+      std::vector<retired> _orphans;
+    };
+
+    // pins the calling thread in the epoch domain while it's alive, it must be destroyed in the same thread
+    class epoch_guard {
+    public:
+
+      epoch_guard() { epoch_domain::instance().pin(); }
+
+      ~epoch_guard() { epoch_domain::instance().unpin(); }
+
+      epoch_guard(const epoch_guard&) = delete;
+      epoch_guard& operator=(const epoch_guard&) = delete;
+    };
+
+  } // memory
+} // atlas
+
+#endif /* ATLAS_MEMORY_EPOCH_H_ */
@@ -0,0 +1,327 @@
+/*
+ * huge_pages.h
+ *
+ *  Created on: Sep 6, 2013
+ *      Author: vincent
+ */
+
+#ifndef ATLAS_MEMORY_HUGE_PAGES_H_
+#define ATLAS_MEMORY_HUGE_PAGES_H_
+
+#include <sys/mman.h>
+
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <array>
+#include <atomic>
+#include <mutex>
+#include <new>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <atlas/numa.h>
+#include <atlas/memory/arena.h>
+
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+
+#ifndef MAP_HUGE_2MB
+#define MAP_HUGE_2MB (21 << MAP_HUGE_SHIFT)
+#endif
+
+namespace atlas {
+  namespace memory {
+
+    // where the memory of the huge page resource comes from
+    enum huge_page_mode {
+      huge_pages_off,           // the heap, the resource is not used
+      huge_pages_transparent,   // the 2MB aligned regions advised with MADV_HUGEPAGE, the kernel backs them if it can
+      huge_pages_reserved       // the pages reserved by vm.nr_hugepages, MAP_HUGETLB, or the transparent ones if none is left
+    };
+
+    // the backings of the regions mapped, a region is transparent only if the advice is taken
+    enum huge_page_backing { backing_reserved, backing_transparent, backing_normal, backing_count };
+
+    inline const char* backing_name(int backing) {
+      static const char* names[] = { "reserved", "transparent", "normal" };
+      return backing >= 0 && backing < backing_count ? names[backing] : "unknown";
+    }
+
+    /*
+     * A memory resource of the 2MB pages, so the large regions churned by the requests, the blocks of the arenas
+     * and the receive rings, take a TLB entry a 2MB instead of one a 4KB.
+     *
+     * The memory is mapped 2MB a region and carved into the blocks of the power of two classes, from 4KB to 1MB, a
+     * block given back is kept on the free list of it's class, and the regions are never unmapped, as the arenas
+     * keep their spares, the churn settles down to the free lists. A larger block is mapped on it's own, rounded up
+     * to 2MB, and unmapped when it's given back.
+     *
+     * The reserved pages fall back to the transparent ones, and those to the normal pages if the kernel refuses the
+     * advice, the backing of every region is counted, see mapped(). Thread safe, one lock, the blocks are taken
+     * rarely, an arena goes to the upstream only when it grows.
+     *
+     * A thread placed on a NUMA node, see atlas::current_numa_node, takes the blocks of the regions of it's node,
+     * the regions are mapped preferring the node, and a block given back goes to the free lists of the node it's
+     * region is on, wherever it's given back
+     * */
+    class huge_page_resource : public memory_resource {
+    public:
+
+      static const size_t page_size = 2 * 1024 * 1024;
+
+      enum { min_class_bits = 12, class_count = 9 };
+
+      static const size_t min_block = size_t(1) << min_class_bits;
+      static const size_t max_block = min_block << (class_count - 1);
+
+    private:
+
+      huge_page_resource() : _mode(huge_pages_off), _in_use(0) {
+        for (auto& m : _mapped) m.store(0, std::memory_order_relaxed);
+      }
+
+      huge_page_resource(const huge_page_resource&) = delete;
+      huge_page_resource& operator=(const huge_page_resource&) = delete;
+
+    public:
+
+      // never destroyed, the arenas of the threads give their blocks back when the threads exit, even at the exit
+      static huge_page_resource& instance() {
+        static huge_page_resource* r = new huge_page_resource;
+        return *r;
+      }
+
+      // before any block is taken
+      void set_mode(huge_page_mode mode) { _mode = mode; }
+
+      huge_page_mode mode() const { return _mode; }
+
+      bool enabled() const { return _mode != huge_pages_off; }
+
+      // the bytes of the regions mapped of the backing
+      size_t mapped(int backing) const { return _mapped[backing].load(std::memory_order_relaxed); }
+
+      // the bytes of the blocks taken and not given back
+      size_t in_use() const { return _in_use.load(std::memory_order_relaxed); }
+
+      // the bytes of the blocks on the free lists, and the ones of the current region not carved yet
+      size_t free_bytes() const {
+        std::lock_guard<std::mutex> guard(_mutex);
+
+        size_t bytes = 0;
+        for (const node_pool& n : _nodes) {
+          bytes += n.carved_left;
+          for (int c = 0; c < class_count; ++c) bytes += n.free[c].size() * class_size(c);
+        }
+
+        return bytes;
+      }
+
+      static int class_of(size_t size) {
+        int c = 0;
+        while (c < class_count - 1 && (min_block << c) < size) ++c;
+        return c;
+      }
+
+      static size_t class_size(int c) { return min_block << c; }
+
+    protected:
+
+      // the blocks of the size classes are carved back to back from the regions, so a block is aligned to
+      // min_block only, a large block is aligned to a page. an alignment beyond min_block is not supported
+      virtual void* do_allocate(size_t bytes, size_t alignment) {
+        assert(alignment <= min_block);
+        (void) alignment;
+
+        if (bytes > max_block) return map_large(bytes);
+
+        int c = class_of(bytes);
+        size_t size = class_size(c);
+
+        size_t node = numa_slot(max_numa_nodes);
+
+        std::lock_guard<std::mutex> guard(_mutex);
+        node_pool& n = _nodes[node];
+
+        void* p = nullptr;
+        if (!n.free[c].empty()) {
+          p = n.free[c].back();
+          n.free[c].pop_back();
+        }
+        else {
+          if (n.carved_left < size) {
+            // the rest of the region goes to the free lists, largest first, so nothing is wasted
+            for (int k = class_count - 1; k >= 0; --k) {
+              while (n.carved_left >= class_size(k)) {
+                n.free[k].push_back(n.carved);
+                n.carved += class_size(k);
+                n.carved_left -= class_size(k);
+              }
+            }
+
+            int backing = backing_normal;
+            n.carved = static_cast<char*>(map(page_size, backing));
+            n.carved_left = page_size;
+            _region_nodes[reinterpret_cast<uintptr_t>(n.carved)] = node;
+          }
+
+          p = n.carved;
+          n.carved += size;
+          n.carved_left -= size;
+        }
+
+        _in_use.fetch_add(size, std::memory_order_relaxed);
+        return p;
+      }
+
+      virtual void do_deallocate(void* p, size_t bytes, size_t /* alignment */) {
+        if (bytes > max_block) {
+          unmap_large(p, bytes);
+          return;
+        }
+
+        int c = class_of(bytes);
+        _in_use.fetch_sub(class_size(c), std::memory_order_relaxed);
+
+        std::lock_guard<std::mutex> guard(_mutex);
+        auto it = _region_nodes.find(reinterpret_cast<uintptr_t>(p) & ~(page_size - 1));
+        _nodes[it == _region_nodes.end() ? 0 : it->second].free[c].push_back(static_cast<char*>(p));
+      }
+
+    private:
+
+      static size_t round_up(size_t bytes) { return (bytes + page_size - 1) & ~(page_size - 1); }
+
+      void* map_large(size_t bytes) {
+        size_t size = round_up(bytes);
+
+        int backing = backing_normal;
+        void* p = map(size, backing);
+
+        std::lock_guard<std::mutex> guard(_mutex);
+        _large[p] = backing;
+        _in_use.fetch_add(size, std::memory_order_relaxed);
+
+        return p;
+      }
+
+      void unmap_large(void* p, size_t bytes) {
+        size_t size = round_up(bytes);
+
+        int backing = backing_normal;
+        {
+          std::lock_guard<std::mutex> guard(_mutex);
+          auto it = _large.find(p);
+          if (it != _large.end()) {
+            backing = it->second;
+            _large.erase(it);
+          }
+        }
+
+        ::munmap(p, size);
+        _mapped[backing].fetch_sub(size, std::memory_order_relaxed);
+        _in_use.fetch_sub(size, std::memory_order_relaxed);
+      }
+
+      // size is a multiple of page_size, on the node of the calling thread, throw std::bad_alloc if no memory is left at all
+      void* map(size_t size, int& backing) {
+        if (_mode == huge_pages_reserved) {
+          void* p = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_HUGE_2MB,
+              -1, 0);
+          if (p != MAP_FAILED) {
+            prefer_numa_node(p, size, current_numa_node());
+
+            backing = backing_reserved;
+            _mapped[backing].fetch_add(size, std::memory_order_relaxed);
+            return p;
+          }
+        }
+
+        // a 2MB aligned region inside a mapping one page larger, the ends cut off
+        char* raw = static_cast<char*>(::mmap(nullptr, size + page_size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+        if (raw == MAP_FAILED) throw std::bad_alloc();
+
+        char* p = reinterpret_cast<char*>((reinterpret_cast<uintptr_t>(raw) + page_size - 1) & ~(page_size - 1));
+        if (p > raw) ::munmap(raw, p - raw);
+        if (raw + size + page_size > p + size) ::munmap(p + size, raw + size + page_size - (p + size));
+
+        prefer_numa_node(p, size, current_numa_node());
+        backing = ::madvise(p, size, MADV_HUGEPAGE) == 0 ? backing_transparent : backing_normal;
+        _mapped[backing].fetch_add(size, std::memory_order_relaxed);
+
+        return p;
+      }
+
+    private:
+
+      huge_page_mode _mode;
+
+      // the blocks of the regions of a node
+      struct node_pool {
+        node_pool() : carved(nullptr), carved_left(0) {}
+
+        std::array<std::vector<char*>, class_count> free;
+        char* carved;
+        size_t carved_left;
+      };
+
+      mutable std::mutex _mutex;
+      std::array<node_pool, max_numa_nodes> _nodes;
+      std::unordered_map<uintptr_t, size_t> _region_nodes;
+      std::unordered_map<void*, int> _large;
+
+      std::array<std::atomic<size_t>, backing_count> _mapped;
+      std::atomic<size_t> _in_use;
+    };
+
+    // the resource of the large regions kept for long, the huge pages if they're on, the heap otherwise
+    inline memory_resource* region_resource() {
+      huge_page_resource& r = huge_page_resource::instance();
+      return r.enabled() ? static_cast<memory_resource*>(&r) : new_delete_resource();
+    }
+
+    // a buffer taken from a resource, given back when it's destroyed
+    class resource_buffer {
+    public:
+
+      resource_buffer(size_t size, memory_resource* resource = region_resource()) :
+        _resource(resource), _size(size), _data(static_cast<char*>(resource->allocate(size))) {}
+
+      ~resource_buffer() { _resource->deallocate(_data, _size); }
+
+      resource_buffer(const resource_buffer&) = delete;
+      resource_buffer& operator=(const resource_buffer&) = delete;
+
+    public:
+
+      char* data() const { return _data; }
+
+      size_t size() const { return _size; }
+
+      char& operator[](size_t i) const { return _data[i]; }
+
+    private:
+
+      memory_resource* _resource;
+      size_t _size;
+      char* _data;
+    };
+
+    // false if the name is not known, the names are off, transparent and reserved
+    inline bool huge_page_mode_named(const std::string& name, huge_page_mode* mode) {
+      if (name == "off") *mode = huge_pages_off;
+      else if (name == "transparent") *mode = huge_pages_transparent;
+      else if (name == "reserved") *mode = huge_pages_reserved;
+      else return false;
+
+      return true;
+    }
+
+  } // memory
+} // atlas
+
+#endif /* ATLAS_MEMORY_HUGE_PAGES_H_ */
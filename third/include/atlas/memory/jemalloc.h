@@ -0,0 +1,225 @@
+/*
+ * jemalloc.h
+ *
+ *  Created on: Sep 28, 2013
+ *      Author: vincent
+ */
+
+#ifndef ATLAS_MEMORY_JEMALLOC_H_
+#define ATLAS_MEMORY_JEMALLOC_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <string>
+
+#include <atlas/singleton.h>
+
+// weak, so the build need not link jemalloc, it's null unless jemalloc is linked or preloaded
+extern "C" int mallctl(const char* name, void* oldp, size_t* oldlenp, void* newp, size_t newlen)
+    __attribute__((weak));
+
+namespace atlas {
+  namespace memory {
+
+    /*
+     * The control of jemalloc, by mallctl, if the process runs on it, linked or LD_PRELOADed, every call is false
+     * otherwise. A jemalloc built with a prefix, je_mallctl, is not seen.
+     *
+     * The stats are refreshed by refresh(), they are the ones of the last refresh, see "epoch" of man jemalloc
+     * */
+    class jemalloc {
+    public:
+
+      // the totals of the process, in bytes
+      struct totals {
+        totals() : allocated(0), active(0), resident(0), mapped(0), retained(0), metadata(0) {}
+
+        size_t allocated;   // asked for by the program
+        size_t active;      // in the pages of the allocations
+        size_t resident;    // in the physical memory, the metadata and the dirty pages included
+        size_t mapped;      // in the chunks or extents mapped
+        size_t retained;    // the virtual memory kept unmapped for reuse, 0 before jemalloc 5
+        size_t metadata;
+
+        // the share of the resident memory not allocated, 0 for none
+        double fragmentation() const { return resident > allocated ? 1.0 - double(allocated) / resident : 0; }
+      };
+
+    public:
+
+      static bool available() { return &mallctl != nullptr; }
+
+      static std::string version() {
+        const char* v = nullptr;
+        return read("version", v) && v ? std::string(v) : std::string();
+      }
+
+      template<typename T>
+      static bool read(const char* name, T& value) {
+        if (!available()) return false;
+
+        size_t len = sizeof(T);
+        return mallctl(name, &value, &len, nullptr, 0) == 0;
+      }
+
+      template<typename T>
+      static bool write(const char* name, T value) {
+        if (!available()) return false;
+        return mallctl(name, nullptr, nullptr, &value, sizeof(T)) == 0;
+      }
+
+      // the stats are cached by jemalloc, this takes them again
+      static bool refresh() {
+        uint64_t epoch = 1;
+        size_t len = sizeof(epoch);
+        return available() && mallctl("epoch", &epoch, &len, &epoch, sizeof(epoch)) == 0;
+      }
+
+      // of the last refresh, false without jemalloc or it's stats
+      static bool read_totals(totals& t) {
+        if (!read("stats.allocated", t.allocated)) return false;
+
+        read("stats.active", t.active);
+        read("stats.resident", t.resident);
+        read("stats.mapped", t.mapped);
+        read("stats.retained", t.retained);
+        read("stats.metadata", t.metadata);
+
+        return true;
+      }
+
+      // the bytes in the active pages of the arena, of the last refresh
+      static size_t arena_active(unsigned arena) {
+        size_t pages = 0, page = 0;
+        std::string name = "stats.arenas." + std::to_string(arena) + ".pactive";
+        if (!read(name.c_str(), pages) || !read("arenas.page", page)) return 0;
+
+        return pages * page;
+      }
+
+      // a new arena, "arenas.create" of jemalloc 5 or "arenas.extend" of the ones before
+      static bool create_arena(unsigned& arena) {
+        return read("arenas.create", arena) || read("arenas.extend", arena);
+      }
+
+      // the calling thread allocates from the arena from now on, it's frees go back to the arenas they came from
+      static bool bind_thread(unsigned arena) { return write("thread.arena", arena); }
+
+      static bool thread_arena(unsigned& arena) { return read("thread.arena", arena); }
+    };
+
+    /*
+     * An arena of jemalloc per role of the threads, so the allocations of the I/O loops and the ones of the
+     * workers do not share the pages, a worker freeing what a loop allocated gives it back to the loop's arena,
+     * and the long lived ones of the loops are not scattered among the short lived ones of the requests, which is
+     * how the pages of glibc's malloc stay resident once the allocations in them are mostly freed.
+     *
+     * The arena of a role is created by it's first thread, off by default, nothing without jemalloc
+     * */
+    class role_arenas : public atlas::singleton<role_arenas> {
+    private:
+
+      struct role {
+        role() : arena(0), threads(0) {}
+
+        unsigned arena;
+        size_t threads;
+      };
+
+    private:
+
+      friend class atlas::singleton<role_arenas>;
+      role_arenas(const role_arenas&) = delete;
+      role_arenas& operator=(const role_arenas&) = delete;
+
+    public:
+
+      // public for std::make_shared, see atlas::singleton
+      role_arenas() : _enabled(false) {}
+
+    public:
+
+      // before the threads start, the ones started before are left in their arenas
+      void set_enabled(bool enabled) {
+        std::lock_guard<std::mutex> guard(_mutex);
+        _enabled = enabled && jemalloc::available();
+      }
+
+      bool enabled() const {
+        std::lock_guard<std::mutex> guard(_mutex);
+        return _enabled;
+      }
+
+      // the calling thread goes to the arena of it's role, false if it's off or jemalloc refuses
+      bool bind(const std::string& name) {
+        std::lock_guard<std::mutex> guard(_mutex);
+        if (!_enabled) return false;
+
+        auto it = _roles.find(name);
+        if (it == _roles.end()) {
+          role r;
+          if (!jemalloc::create_arena(r.arena)) return false;
+          it = _roles.insert(std::make_pair(name, r)).first;
+        }
+
+        if (!jemalloc::bind_thread(it->second.arena)) return false;
+
+        ++it->second.threads;
+        return true;
+      }
+
+      // the roles and their arenas
+      std::map<std::string, unsigned> arenas() const {
+        std::lock_guard<std::mutex> guard(_mutex);
+
+        std::map<std::string, unsigned> result;
+        for (const auto& r : _roles) result[r.first] = r.second.arena;
+        return result;
+      }
+
+      std::string str() const {
+        std::ostringstream os;
+
+        if (!jemalloc::available()) {
+          os << "allocator : the libc malloc, jemalloc is not linked\n";
+          return os.str();
+        }
+
+        jemalloc::refresh();
+
+        jemalloc::totals t;
+        jemalloc::read_totals(t);
+
+        os << "allocator : jemalloc " << jemalloc::version() << "\n"
+            << "allocated : " << t.allocated << "\n"
+            << "active : " << t.active << "\n"
+            << "resident : " << t.resident << "\n"
+            << "mapped : " << t.mapped << "\n"
+            << "retained : " << t.retained << "\n"
+            << "metadata : " << t.metadata << "\n"
+            << "fragmentation : " << t.fragmentation() << "\n";
+
+        std::lock_guard<std::mutex> guard(_mutex);
+        os << "arenas per role : " << (_enabled ? "on" : "off") << "\n";
+        for (const auto& r : _roles) {
+          os << r.first << " : arena " << r.second.arena << ", " << r.second.threads << " threads, "
+              << jemalloc::arena_active(r.second.arena) << " bytes active\n";
+        }
+
+        return os.str();
+      }
+
+    private:
+
+      mutable std::mutex _mutex;
+      bool _enabled;
+      std::map<std::string, role> _roles;
+    };
+
+  } // memory
+} // atlas
+
+#endif /* ATLAS_MEMORY_JEMALLOC_H_ */
@@ -0,0 +1,170 @@
+/*
+ * pool_allocator.h
+ *
+ *  Created on: Aug 24, 2013
+ *      Author: vincent
+ */
+
+#ifndef ATLAS_MEMORY_POOL_ALLOCATOR_H_
+#define ATLAS_MEMORY_POOL_ALLOCATOR_H_
+
+#include <cstddef>
+#include <new>
+#include <memory>
+#include <limits>
+#include <utility>
+
+namespace atlas {
+  namespace memory {
+
+    /*
+     * A per-thread free list of fixed size blocks.
+     *
+     * Blocks are allocated by the global operator new one by one, freed blocks are kept in the free list of
+     * the thread which frees them, and are reused by the next allocation in that thread. A block freed in a
+     * thread which is different from the one allocated it is fine, since all the blocks come from operator new.
+     * At most max_cached blocks are kept in one thread, the others are returned to operator delete, so a thread
+     * which frees much more than it allocates, for example, a worker thread, does not hold memory forever.
+     *
+     * No lock is needed, we use __thread since gcc 4.7 does not support thread_local
+     * */
+    template<size_t BlockSize, size_t MaxCached = 1024>
+    class fixed_size_pool {
+    public:
+
+      static const size_t block_size = BlockSize < sizeof(void*) ? sizeof(void*) : BlockSize;
+      static const size_t max_cached = MaxCached;
+
+    public:
+
+      static void* allocate() {
+        free_list& l = local();
+
+        if (l.head) {
+          node* n = l.head;
+          l.head = n->next;
+          --l.size;
+
+          return n;
+        }
+
+        return ::operator new(block_size);
+      }
+
+      static void deallocate(void* p) noexcept {
+        if (!p) return;
+
+        free_list& l = local();
+
+        if (l.size >= max_cached) {
+          ::operator delete(p);
+          return;
+        }
+
+        node* n = static_cast<node*>(p);
+        n->next = l.head;
+        l.head = n;
+        ++l.size;
+      }
+
+      // the number of cached blocks in the current thread
+      static size_t cached() { return local().size; }
+
+    private:
+
+      struct node {
+        node* next;
+      };
+
+      struct free_list {
+        node* head;
+        size_t size;
+      };
+
+      static free_list& local() {
+        // zero initialized, the cached blocks of an exited thread are leaked, they are bounded by max_cached
+        static __thread free_list l;
+        return l;
+      }
+    };
+
+    /*
+     * A standard allocator backed by fixed_size_pool, used to allocate the per-request objects, for example :
+     *
+     *  std::allocate_shared<session>(pool_allocator<session>(), session_id);
+     *
+     * single object allocations go to the pool of sizeof(T), array allocations go to operator new directly
+     * */
+    template<typename T>
+    class pool_allocator {
+    public:
+
+      typedef T value_type;
+      typedef T* pointer;
+      typedef const T* const_pointer;
+      typedef T& reference;
+      typedef const T& const_reference;
+      typedef size_t size_type;
+      typedef std::ptrdiff_t difference_type;
+
+      template<typename U>
+      struct rebind {
+        typedef pool_allocator<U> other;
+      };
+
+      typedef fixed_size_pool<sizeof(T)> pool_type;
+
+    public:
+
+      pool_allocator() noexcept {}
+
+      pool_allocator(const pool_allocator&) noexcept {}
+
+      template<typename U>
+      pool_allocator(const pool_allocator<U>&) noexcept {}
+
+    public:
+
+      pointer address(reference r) const { return std::addressof(r); }
+
+      const_pointer address(const_reference r) const { return std::addressof(r); }
+
+      pointer allocate(size_type n, const void* /*hint*/ = 0) {
+        if (n == 1) return static_cast<pointer>(pool_type::allocate());
+
+        if (n > max_size()) throw std::bad_alloc();
+        return static_cast<pointer>(::operator new(n * sizeof(T)));
+      }
+
+      void deallocate(pointer p, size_type n) noexcept {
+        if (n == 1) pool_type::deallocate(p);
+        else ::operator delete(p);
+      }
+
+      size_type max_size() const noexcept { return std::numeric_limits<size_type>::max() / sizeof(T); }
+
+      template<typename U, typename... Args>
+      void construct(U* p, Args&&... args) {
+        ::new (static_cast<void*>(p)) U(std::forward<Args>(args)...);
+      }
+
+      template<typename U>
+      void destroy(U* p) { p->~U(); }
+    };
+
+    // the allocators are stateless, any one can free the memory allocated by another
+    template<typename T, typename U>
+    bool operator==(const pool_allocator<T>&, const pool_allocator<U>&) { return true; }
+
+    template<typename T, typename U>
+    bool operator!=(const pool_allocator<T>&, const pool_allocator<U>&) { return false; }
+
+    template<typename T, typename... Args>
+    std::shared_ptr<T> make_pooled(Args&&... args) {
+      return std::allocate_shared<T>(pool_allocator<T>(), std::forward<Args>(args)...);
+    }
+
+  } // memory
+} // atlas
+
+#endif /* ATLAS_MEMORY_POOL_ALLOCATOR_H_ */
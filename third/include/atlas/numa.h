@@ -0,0 +1,67 @@
+/*
+ * numa.h
+ *
+ *  Created on: Sep 28, 2013
+ *      Author: vincent
+ */
+
+/*    Copyright 2011 ~ 2013 Vincent Zhang, ivincent.zhang@gmail.com
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#ifndef ATLAS_NUMA_H_
+#define ATLAS_NUMA_H_
+
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <cstddef>
+
+namespace atlas {
+
+  // the nodes told apart, a node above shares the queues and the pools of node % max_numa_nodes
+  const int max_numa_nodes = 8;
+
+  /*
+   * The NUMA node the calling thread is placed on, -1 if it's not placed. The thread sets it once it's pinned
+   * to the CPUs of a node, the schedulers and the memory resources keep the thread's work and memory on it
+   * */
+  inline int& current_numa_node() {
+    // gcc 4.7 does not support thread_local
+    static __thread int node = -1;
+    return node;
+  }
+
+  // the slot of the node in the per node arrays, 0 for a thread not placed
+  inline size_t numa_slot(size_t slots) {
+    int node = current_numa_node();
+    return node < 0 || slots == 0 ? 0 : static_cast<size_t>(node) % slots;
+  }
+
+  /*
+   * The pages of the region not touched yet are taken from the node, or another one if the node has none left,
+   * MPOL_PREFERRED, without libnuma. The region is page aligned, false if the kernel refuses it
+   * */
+  inline bool prefer_numa_node(void* p, size_t size, int node) {
+    if (node < 0 || node >= 64) return false;
+
+    const int mpol_preferred = 1;
+    unsigned long mask = 1UL << node;
+
+    return ::syscall(SYS_mbind, p, size, mpol_preferred, &mask, sizeof(mask) * 8, 0) == 0;
+  }
+
+} // atlas
+
+#endif /* ATLAS_NUMA_H_ */
@@ -27,5 +27,7 @@
 #include <atlas/rpc/result.h>
 #include <atlas/rpc/rpc.h>
 #include <atlas/rpc/dispatcher.h>
+#include <atlas/rpc/gather.h>
+#include <atlas/rpc/coalescer.h>
 
 #endif /* ATLAS_RPC_RPC_H_ */
@@ -0,0 +1,145 @@
+/*
+ * cancellation.h
+ *
+ *  Created on: Sep 28, 2013
+ *      Author: vincent
+ */
+
+/*    Copyright 2011 ~ 2013 Vincent Zhang, ivincent.zhang@gmail.com
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#ifndef ATLAS_RPC_CANCELLATION_H_
+#define ATLAS_RPC_CANCELLATION_H_
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+
+#include <boost/uuid/uuid.hpp>
+#include <boost/uuid/nil_generator.hpp>
+
+#include <atlas/singleton.h>
+#include <atlas/container/sharded_concurrent_box.h>
+#include <atlas/container/timer_wheel.h>
+#include <atlas/serialization/uuid.h>
+
+namespace atlas {
+  namespace rpc {
+
+    using boost::uuids::uuid;
+
+    /*
+     * The sessions cancelled by their callers, see remote_caller::cancel, a request of a cancelled session is
+     * dropped if it's not started yet, and a running handler stops once it polls it's cancel_token.
+     *
+     * A cancellation is kept for the retention, 5 minutes by default, longer than any call should wait, and then
+     * forgotten, a token which has seen it remembers it. Nothing is looked up until a session is cancelled
+     * */
+    class cancellations : public atlas::singleton<cancellations> {
+    public:
+
+      typedef std::chrono::steady_clock clock;
+
+    private:
+
+      friend class atlas::singleton<cancellations>;
+      cancellations(const cancellations&) = delete;
+      cancellations& operator=(const cancellations&) = delete;
+
+    public:
+
+      // public for std::make_shared, see atlas::singleton
+      cancellations() : _retention(std::chrono::minutes(5)), _count(0), _cancelled(0) {}
+
+    public:
+
+      // before any session is cancelled
+      void set_retention(clock::duration retention) { _retention = retention; }
+
+      void cancel(const uuid& session_id) {
+        if (!_sessions.put(session_id, true)) return;
+
+        _count.fetch_add(1, std::memory_order_relaxed);
+        _cancelled.fetch_add(1, std::memory_order_relaxed);
+        _deadlines.add(session_id, clock::now() + _retention);
+      }
+
+      bool cancelled(const uuid& session_id) const {
+        if (_count.load(std::memory_order_relaxed) == 0) return false;
+
+        return _sessions.get(session_id).is_initialized();
+      }
+
+      // forget the cancellations kept for the retention, should be called periodically
+      void sweep() {
+        _deadlines.advance(clock::now(), [this](const uuid& id) {
+          if (_sessions.erase(id)) _count.fetch_sub(1, std::memory_order_relaxed);
+        });
+      }
+
+      size_t size() const { return _count.load(std::memory_order_relaxed); }
+
+      unsigned long long cancelled() const { return _cancelled.load(std::memory_order_relaxed); }
+
+    private:
+
+      clock::duration _retention;
+
+      atlas::sharded_concurrent_box<uuid, bool, atlas::uuid_hash> _sessions;
+      atlas::timer_wheel<uuid> _deadlines { std::chrono::seconds(1) };
+
+      std::atomic<size_t> _count;
+      std::atomic<unsigned long long> _cancelled;
+    };
+
+    /*
+     * Polled by a long running handler, or the work it leaves behind, to stop once the caller cancels the call,
+     * see rpc_context::cancel_token. The copies share what they have seen, so a cancellation is never forgotten
+     * by a token
+     * */
+    class cancel_token {
+    public:
+
+      // never cancelled, for a function called locally
+      cancel_token() : _session_id(boost::uuids::nil_uuid()) {}
+
+      explicit cancel_token(const uuid& session_id) :
+          _session_id(session_id), _seen(std::make_shared<std::atomic<bool>>(false))
+      {}
+
+    public:
+
+      bool cancelled() const {
+        if (!_seen) return false;
+        if (_seen->load(std::memory_order_relaxed)) return true;
+
+        if (!cancellations::ref().cancelled(_session_id)) return false;
+
+        _seen->store(true, std::memory_order_relaxed);
+        return true;
+      }
+
+      const uuid& session_id() const { return _session_id; }
+
+    private:
+
+      uuid _session_id;
+      std::shared_ptr<std::atomic<bool>> _seen;
+    };
+
+  } // rpc
+} // atlas
+
+#endif /* ATLAS_RPC_CANCELLATION_H_ */
@@ -0,0 +1,171 @@
+/*
+ * coalescer.h
+ *
+ *  Created on: Sep 27, 2013
+ *      Author: vincent
+ */
+
+/*    Copyright 2011 ~ 2013 Vincent Zhang, ivincent.zhang@gmail.com
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#ifndef ATLAS_RPC_COALESCER_H_
+#define ATLAS_RPC_COALESCER_H_
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <atlas/singleton.h>
+#include <atlas/container/sharded_concurrent_box.h>
+#include <atlas/rpc/message.h>
+#include <atlas/rpc/result.h>
+
+namespace atlas {
+  namespace rpc {
+
+    /*
+     * The identical requests in flight at the same time share one execution, the same function with the same
+     * serialized arguments, so a herd of reads of one hot entry runs the handler once. The first request leads,
+     * the ones arriving before it's result join it, and the result is sent to each of them as the response to
+     * it's own call. A request arriving after the result runs again, nothing is cached.
+     *
+     * Opt in per function, see ATLAS_RPC_COALESCE, for the reads whose result depends on their arguments only,
+     * and which return their result, the joined requests of a handler which returns nullptr get rpc_busy.
+     * Only the requests expecting a response are coalesced
+     * */
+    class request_coalescer : public atlas::singleton<request_coalescer> {
+    public:
+
+      // sends the result to a joined request
+      typedef std::function<void(const rpc_result&)> waiter_type;
+
+    private:
+
+      struct flight {
+        explicit flight(std::string&& key) : key(std::move(key)), landed(false) {}
+
+        const std::string key;
+        std::mutex mutex;
+        bool landed;
+        std::vector<waiter_type> waiters;
+      };
+
+    public:
+
+      typedef std::shared_ptr<flight> flight_ptr;
+
+    private:
+
+      friend class atlas::singleton<request_coalescer>;
+      request_coalescer(const request_coalescer&) = delete;
+      request_coalescer& operator=(const request_coalescer&) = delete;
+
+    public:
+
+      // public for std::make_shared, see atlas::singleton
+      request_coalescer() : _coalesced(0) {}
+
+    public:
+
+      // during the static initialization
+      void enable(int fn_id) {
+        if (fn_id < 0 || fn_id >= max_fn_id) {
+          throw std::out_of_range("function id " + std::to_string(fn_id) + " is out of range");
+        }
+
+        if (static_cast<size_t>(fn_id) >= _enabled.size()) _enabled.resize(fn_id + 1, false);
+        _enabled[fn_id] = true;
+      }
+
+      bool enabled(int fn_id, int return_type) const {
+        if (return_type != rpc_sync && return_type != rpc_async_callback) return false;
+
+        return fn_id >= 0 && static_cast<size_t>(fn_id) < _enabled.size() && _enabled[fn_id];
+      }
+
+      /*
+       * Return the flight the request leads, land() it with the result, or nullptr if the request joins the
+       * flight of an identical one, joined is set, and the waiter is called with the result of that one
+       * */
+      flight_ptr lead_or_join(const message& msg, const waiter_type& waiter, bool& joined) {
+        std::string key(reinterpret_cast<const char*>(&msg.header()->fn_id), sizeof(msg.header()->fn_id));
+        key.append(msg.body(), msg.body_size());
+
+        flight_ptr mine = std::make_shared<flight>(std::move(key));
+        flight_ptr f = _flights.get_or_put(mine->key, [&mine]() { return mine; });
+
+        joined = false;
+        if (f == mine) return mine;
+
+        std::lock_guard<std::mutex> guard(f->mutex);
+        // landed between, run it alone
+        if (f->landed) return nullptr;
+
+        f->waiters.push_back(waiter);
+        joined = true;
+        _coalesced.fetch_add(1, std::memory_order_relaxed);
+
+        return nullptr;
+      }
+
+      // the result of the leader to the joined requests, the later identical requests lead a new flight
+      void land(const flight_ptr& f, const rpc_result& result) {
+        if (!f) return;
+
+        _flights.erase_if(f->key, [&f](const flight_ptr& v) { return v == f; });
+
+        std::vector<waiter_type> waiters;
+        {
+          std::lock_guard<std::mutex> guard(f->mutex);
+          f->landed = true;
+          waiters.swap(f->waiters);
+        }
+
+        rpc_result r = result ? result : rpc_result(std::string(), rpc_busy);
+        for (const waiter_type& w : waiters) w(r);
+      }
+
+      // the requests which joined a flight instead of running
+      unsigned long long coalesced() const { return _coalesced.load(std::memory_order_relaxed); }
+
+      size_t in_flight() const { return _flights.size(); }
+
+    private:
+
+      static const int max_fn_id = 64 * 1024;
+
+      std::vector<bool> _enabled;
+      atlas::sharded_concurrent_box<std::string, flight_ptr> _flights;
+
+      std::atomic<unsigned long long> _coalesced;
+    };
+
+    struct fn_coalescing_binder {
+      fn_coalescing_binder(int fn_id) { request_coalescer::ref().enable(fn_id); }
+    };
+
+  } // rpc
+} // atlas
+
+// coalesce the identical concurrent requests of a remote function registered by ATLAS_REGISTER_REMOTE_FUNC,
+// must be placed in the namespace where the function id is registered, see request_coalescer
+#define ATLAS_RPC_COALESCE(func_name) \
+  static ::atlas::rpc::fn_coalescing_binder __atlas_fn_coalescing_##func_name(fn_ids::func_name)
+
+#endif /* ATLAS_RPC_COALESCER_H_ */
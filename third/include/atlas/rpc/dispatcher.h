@@ -23,50 +23,274 @@
 #ifndef RFC_DISPATCHER_H_
 #define RFC_DISPATCHER_H_
 
+#include <cstddef>
+#include <cstring>
 #include <deque>
+#include <functional>
+#include <vector>
+#include <string>
+#include <stdexcept>
 
 #include <boost/optional.hpp>
+#include <atlas/singleton.h>
+#include <atlas/apply_tuple.h>
+#include <atlas/container/small_vector.h>
+#include <atlas/io/memstream.h>
 #include <atlas/serialization/uuid.h>
 #include <atlas/rpc/rpc.h>
+#include <atlas/rpc/json.h>
+#include <atlas/rpc/stats.h>
+#include <atlas/rpc/result_cache.h>
+#include <atlas/rpc/slow_log.h>
 
 namespace atlas {
   namespace rpc {
 
-    // dispatchers
-    typedef std::function<boost::optional<rpc_result>(int, const std::string&, const rpc_context&)> dispatcher_type;
+    // custom dispatchers, used when a function can not be found in the function table
+    // all the dispatchers share the same input archive which reads the message body in place
+    typedef std::function<boost::optional<rpc_result>(int, rpc_iarchive&, const rpc_context&)> dispatcher_type;
 
-    class builtin_dispatcher {
+    // de-serialize the arguments and call the function directly, the last argument is replaced by the local context,
+    // the arguments of the arena types, for example memory::arena_string, draw from the current arena of the thread
+    template<typename Signature, Signature* F>
+    struct fn_invoker;
+
+    template<typename Res, typename... Args, Res (*F)(Args...)>
+    struct fn_invoker<Res(Args...), F> {
+
+      static rpc_result invoke(rpc_iarchive& ia, const rpc_context& context) {
+        std::tuple<typename std::decay<Args>::type...> args;
+
+        ia >> args;
+        rpc_stats::mark_deserialized();
+        std::get<sizeof...(Args) - 1>(args) = context;
+
+        return apply_tuple(F, args);
+      }
+    };
+
+    // the arguments but the context decoded from the items of a JSON array, false if they do not match, see http_gateway
+    typedef bool (*json_invoker_type)(const json::document&, const json::node&, const rpc_context&, rpc_result&);
+
+    // every argument but the last, the context, can be decoded from JSON
+    template<typename... Args>
+    struct json_arguments;
+
+    template<typename Last>
+    struct json_arguments<Last> : std::true_type {};
+
+    template<typename First, typename... Rest>
+    struct json_arguments<First, Rest...> : std::integral_constant<bool,
+        json::decodable<typename std::decay<First>::type>::value && json_arguments<Rest...>::value> {};
+
+    // the items into the elements I to N of the tuple, one after another
+    template<size_t I, size_t N>
+    struct json_decoder {
+      template<typename Tuple>
+      static bool decode(const json::document& d, const json::node& array, const json::node* item, Tuple& t) {
+        return item && json::decode(d, *item, std::get<I>(t))
+            && json_decoder<I + 1, N>::decode(d, array, d.next(array, *item), t);
+      }
+    };
+
+    template<size_t N>
+    struct json_decoder<N, N> {
+      template<typename Tuple>
+      static bool decode(const json::document&, const json::node&, const json::node*, Tuple&) { return true; }
+    };
+
+    // straight into the argument tuple, no binary archive in between, nullptr if an argument can not be decoded
+    template<typename Signature, Signature* F, typename Enable = void>
+    struct json_fn_invoker {
+      static json_invoker_type get() { return nullptr; }
+    };
+
+    template<typename Res, typename... Args, Res (*F)(Args...)>
+    struct json_fn_invoker<Res(Args...), F, typename std::enable_if<json_arguments<Args...>::value>::type> {
+
+      static bool invoke(const json::document& d, const json::node& args, const rpc_context& context, rpc_result& result) {
+        const size_t arity = sizeof...(Args) - 1;
+        if (args.type != json::array_node || args.count != arity) return false;
+
+        std::tuple<typename std::decay<Args>::type...> t;
+        if (!json_decoder<0, arity>::decode(d, args, d.first(args), t)) return false;
+
+        rpc_stats::mark_deserialized();
+        std::get<arity>(t) = context;
+
+        result = apply_tuple(F, t);
+        return true;
+      }
+
+      static json_invoker_type get() { return &invoke; }
+    };
+
+    /*
+     * The calls of one function run together, the batch handler of a function of the arguments Args... takes
+     * the decoded argument tuples of the calls, the context of each is it's last element, and answers each by the
+     * result of the same index, a null result answers nothing, as a function's does. So a handler may look up or
+     * compute for the whole batch at once, see ATLAS_BIND_REMOTE_BATCH
+     * */
+    template<typename Signature>
+    struct fn_batch;
+
+    template<typename Res, typename... Args>
+    struct fn_batch<Res(Args...)> {
+      typedef std::tuple<typename std::decay<Args>::type...> args_type;
+      typedef std::vector<args_type> calls_type;
+      typedef std::vector<rpc_result> results_type;
+      typedef void handler_type(calls_type&, results_type&);
+    };
+
+    // the calls whose bodies are decoded are answered into results, and marked in decoded, it returns how many
+    typedef size_t (*batch_invoker_type)(const message* const* calls, const rpc_context* contexts, size_t n,
+        rpc_result* results, bool* decoded);
+
+    template<typename Signature, Signature* F, typename Batch, Batch* B>
+    struct batch_fn_invoker {
+
+      typedef fn_batch<Signature> batch;
+
+      static_assert(std::is_same<Batch, typename batch::handler_type>::value,
+          "a batch handler takes the calls and the results of the function, see fn_batch");
+
+      static size_t invoke(const message* const* calls, const rpc_context* contexts, size_t n, rpc_result* results,
+          bool* decoded) {
+        const size_t last = std::tuple_size<typename batch::args_type>::value - 1;
+
+        typename batch::calls_type args;
+        std::vector<size_t> index;
+        args.reserve(n);
+        index.reserve(n);
+
+        for (size_t i = 0; i < n; ++i) {
+          decoded[i] = false;
+
+          try {
+            io::imemstream is(calls[i]->body(), calls[i]->body_size());
+            rpc_iarchive ia(is);
+
+            args.emplace_back();
+            ia >> args.back();
+          }
+          catch (...) {
+            // it's run alone, and fails as it would have
+            args.pop_back();
+            continue;
+          }
+
+          std::get<last>(args.back()) = contexts[i];
+          index.push_back(i);
+          decoded[i] = true;
+        }
+
+        if (args.empty()) return 0;
+
+        typename batch::results_type out(args.size(), rpc_result(nullptr));
+        B(args, out);
+
+        for (size_t k = 0; k < index.size(); ++k) results[index[k]] = std::move(out[k]);
+
+        return index.size();
+      }
+    };
+
+    // a flat table of function invokers indexed by function id
+    // all the functions are bound during the static initialization, so the table is read only after main starts
+    class fn_table : public atlas::singleton<fn_table> {
     public:
 
-      static boost::optional<rpc_result> dispatch(int fn_id, const std::string& message, const rpc_context& context) {
-        std::istringstream iss(message);
-        rpc_iarchive ia(iss);
+      typedef rpc_result (*invoker_type)(rpc_iarchive&, const rpc_context&);
+
+      // negative ids are reserved for builtin functions
+      static const int min_fn_id = -64;
+      static const int max_fn_id = 64 * 1024;
 
-        // std::cout << "dispatch " << fn_id << " for " << context.session_id() << " from " << context.source_ip();
+    public:
 
-        switch (fn_id) {
-        case fn_ids::resume_thread: {
-          rf_wrapper<decltype(builtin_rfc::resume_thread)> resume_thread(builtin_rfc::resume_thread, ia, context);
-          return resume_thread();
+      // an id bound to two functions throws, the same function may be bound by several translation units
+      void bind(int fn_id, invoker_type invoker) {
+        if (fn_id < min_fn_id || fn_id >= max_fn_id) {
+          throw std::out_of_range("function id " + std::to_string(fn_id) + " is out of range");
         }
-        break;
-        case fn_ids::resume_task: {
-          rf_wrapper<decltype(builtin_rfc::resume_task)> resume_task(builtin_rfc::resume_task, ia, context);
-          return resume_task();
+
+        size_t index = fn_id - min_fn_id;
+        if (index >= _invokers.size()) _invokers.resize(index + 1, nullptr);
+
+        if (_invokers[index] && _invokers[index] != invoker) {
+          const char* name = fn_names::ref().find(fn_id);
+          throw std::logic_error("function id " + std::to_string(fn_id) + (name ? std::string(" ") + name : std::string())
+              + " is bound to two functions");
         }
-        break;
-        default:
-          // not be responsible to this rpc
-          return boost::none;
-          // DLOG(INFO) << "no method " << method;
-        break;
-        } // switch
 
-        return boost::none;
+        _invokers[index] = invoker;
+      }
+
+      // the invoker of the JSON arguments of a function bound, if it's arguments can be decoded, see json_fn_invoker
+      void bind_json(int fn_id, json_invoker_type invoker) {
+        size_t index = fn_id - min_fn_id;
+        if (fn_id < min_fn_id || index >= _invokers.size() || !invoker) return;
+
+        if (index >= _json_invokers.size()) _json_invokers.resize(index + 1, nullptr);
+        _json_invokers[index] = invoker;
+      }
+
+      invoker_type find(int fn_id) const {
+        size_t index = fn_id - min_fn_id;
+        if (fn_id < min_fn_id || index >= _invokers.size()) return nullptr;
+
+        return _invokers[index];
+      }
+
+      // the batch handler of a function bound, see batch_fn_invoker
+      void bind_batch(int fn_id, batch_invoker_type invoker) {
+        size_t index = fn_id - min_fn_id;
+        if (fn_id < min_fn_id || index >= _invokers.size() || !invoker) return;
+
+        if (index >= _batch_invokers.size()) _batch_invokers.resize(index + 1, nullptr);
+        _batch_invokers[index] = invoker;
+      }
+
+      batch_invoker_type find_batch(int fn_id) const {
+        size_t index = fn_id - min_fn_id;
+        if (fn_id < min_fn_id || index >= _batch_invokers.size()) return nullptr;
+
+        return _batch_invokers[index];
+      }
+
+      json_invoker_type find_json(int fn_id) const {
+        size_t index = fn_id - min_fn_id;
+        if (fn_id < min_fn_id || index >= _json_invokers.size()) return nullptr;
+
+        return _json_invokers[index];
+      }
+
+    private:
+
+      std::vector<invoker_type> _invokers;
+      std::vector<json_invoker_type> _json_invokers;
+      std::vector<batch_invoker_type> _batch_invokers;
+    };
+
+    template<typename Signature, Signature* F>
+    struct fn_binder {
+      fn_binder(int fn_id) {
+        fn_table::ref().bind(fn_id, fn_invoker<Signature, F>::invoke);
+        fn_table::ref().bind_json(fn_id, json_fn_invoker<Signature, F>::get());
       }
     };
 
+    template<typename Signature, Signature* F, typename Batch, Batch* B>
+    struct batch_fn_binder {
+      batch_fn_binder(int fn_id) { fn_table::ref().bind_batch(fn_id, batch_fn_invoker<Signature, F, Batch, B>::invoke); }
+    };
+
     class dispatcher_manager : public atlas::singleton<dispatcher_manager> {
+    public:
+
+      // runs every task and returns once all are done, the sub-calls of a parallel batch, see builtin_rfc::call_batch
+      typedef std::function<void(std::vector<std::function<void()>>&)> batch_executor_type;
+
     public:
 
       // TODO : make it private
@@ -74,8 +298,8 @@ namespace atlas {
 
     public:
 
+      // the custom dispatchers are invoked only if the function is not found in the function table
       // we invoke the dispatcher earlier if he comes later
-      // TODO : employ priority queue
       void regist(dispatcher_type dispatcher) {
         using std::placeholders::_1;
         using std::placeholders::_2;
@@ -84,31 +308,83 @@ namespace atlas {
         _dispatchers.push_front(std::bind(dispatcher, _1, _2, _3));
       }
 
-      // throw
-      void execute(remote_caller& response_caller, const message& msg, const std::string& source_ip_port) {
-        rpc_context context(msg.header()->client_id, msg.header()->return_type, msg.header()->session_id, source_ip_port);
+      // throw, return the result responded, if any
+      rpc_result execute(remote_caller& response_caller, const message& msg, endpoint_id source) {
+        rpc_context context(msg.header()->client_id, msg.header()->return_type, msg.header()->session_id, source,
+            msg.received());
+
+        auto result = atlas::rpc::dispatcher_manager::dispatch(msg, context);
+        if (result) {
+          rpc_stats::clock::time_point start = rpc_stats::clock::now();
+          respond(response_caller, context, result);
+          rpc_stats::instance().record(msg.header()->fn_id, stage_respond, rpc_stats::clock::now() - start);
+        }
+
+        slow_request_log::instance().check(msg, source);
 
-        auto result = atlas::rpc::dispatcher_manager::dispatch(msg.header()->fn_id, msg.rpc_str(), context);
-        if (result) respond(response_caller, context, result);
+        return result;
       }
 
+      // a file backed result is sent from it's file if the caller can, see remote_caller::respond_file
       void respond(remote_caller& caller, const rpc_context& context, const rpc_result& result) {
         if (context.get_return_type() == rpc_async_callback) {
+          if (caller.respond_file(fn_ids::resume_task, context.session_id(), result)) return;
           caller.call(builtin_rfc::resume_task, fn_ids::resume_task, context.session_id(), result, nilctx);
         }
-        else if (context.get_return_type() == rpc_sync) {
+        else if (context.get_return_type() == rpc_sync || context.get_return_type() == rpc_stream) {
+          if (caller.respond_file(fn_ids::resume_thread, context.session_id(), result)) return;
           caller.call(builtin_rfc::resume_thread, fn_ids::resume_thread, context.session_id(), result, nilctx);
         }
       }
 
-      rpc_result dispatch(int fn_id, const std::string& message, const rpc_context& context) {
-        std::istringstream iss(message);
-        rpc_iarchive ia(iss);
+      // the request is the current span while it runs, see tracer, a pure function may answer from the cache,
+      // a frame which fails it's checksum is answered with rpc_corrupted and never deserialized
+      rpc_result dispatch(const message& msg, const rpc_context& context) {
+        if (!msg.intact()) {
+          message::corrupted_frames().fetch_add(1, std::memory_order_relaxed);
+          return rpc_result(std::string(), rpc_corrupted);
+        }
+
+        tracer::span_scope span(*msg.header());
+
+        int fn_id = msg.header()->fn_id;
+        result_cache& cache = result_cache::ref();
+        if (!cache.enabled(fn_id)) return dispatch(fn_id, msg.body(), msg.body_size(), context);
+
+        boost::optional<rpc_result> cached = cache.get(fn_id, msg.body(), msg.body_size());
+        if (cached) return *cached;
+
+        rpc_result result = dispatch(fn_id, msg.body(), msg.body_size(), context);
+        cache.put(fn_id, msg.body(), msg.body_size(), result);
+
+        return result;
+      }
+
+      // before any request comes, the parallel batches run one call after another without it
+      void set_batch_executor(batch_executor_type executor) { _batch_executor = executor; }
+
+      const batch_executor_type& batch_executor() const { return _batch_executor; }
+
+      // the body is read in place, no copy is made, the latencies are recorded, see rpc_stats
+      rpc_result dispatch(int fn_id, const char* body, size_t size, const rpc_context& context) {
+        io::imemstream is(body, size);
+        rpc_iarchive ia(is);
+        rpc_stats::timer timer(fn_id);
+
+        fn_table::invoker_type invoker = _fn_table.find(fn_id);
+        if (invoker) {
+          rpc_result result = invoker(ia, context);
+          timer.finish();
+          return result;
+        }
 
         for (const dispatcher_type& dispatcher : _dispatchers) {
-          auto result = dispatcher(fn_id, message, context);
+          auto result = dispatcher(fn_id, ia, context);
 
-          if (result) return *result; // got a proper processor
+          if (result) { // got a proper processor
+            timer.finish();
+            return *result;
+          }
         }
 
         return nullptr; // no any proper processor
@@ -117,19 +393,144 @@ namespace atlas {
     protected:
 
       void __init() {
-        using std::placeholders::_1;
-        using std::placeholders::_2;
-        using std::placeholders::_3;
-
-        _dispatchers.push_front(std::bind(builtin_dispatcher::dispatch, _1, _2, _3));
+        fn_table::ref().bind(fn_ids::resume_thread,
+            fn_invoker<decltype(builtin_rfc::resume_thread), &builtin_rfc::resume_thread>::invoke);
+        fn_table::ref().bind(fn_ids::resume_task,
+            fn_invoker<decltype(builtin_rfc::resume_task), &builtin_rfc::resume_task>::invoke);
+        fn_table::ref().bind(fn_ids::resume_task_batch,
+            fn_invoker<decltype(builtin_rfc::resume_task_batch), &builtin_rfc::resume_task_batch>::invoke);
+        fn_table::ref().bind(fn_ids::cancel_call,
+            fn_invoker<decltype(builtin_rfc::cancel_call), &builtin_rfc::cancel_call>::invoke);
+        fn_table::ref().bind(fn_ids::call_batch,
+            fn_invoker<decltype(builtin_rfc::call_batch), &builtin_rfc::call_batch>::invoke);
       }
 
+      const fn_table& _fn_table = fn_table::ref();
       std::deque<dispatcher_type> _dispatchers;
+      batch_executor_type _batch_executor;
     };
 
+    /*
+     * A call kept to run later, in a work queue or a log, as the function id and the arguments encoded as in a
+     * frame, so it holds no pointer and is written anywhere a string is, see serialize, and it's resolved through
+     * the function table when it runs, in constant time. The arguments are given as to a client call, the context
+     * last, which is not kept, the function sees the context it's run with, nilctx by default, as a local call
+     * */
+    class deferred_call {
+    public:
+
+      deferred_call() : _fn_id(0) {}
+
+      template<typename Functor, typename ... Args>
+      deferred_call(Functor f, int fn_id, Args&&... args) : _fn_id(fn_id) {
+        if (fn_encoder<Functor>::size) _args.reserve(fn_encoder<Functor>::size);
+
+        io::oappendstream os(_args);
+        rpc_oarchive oa(os);
+        fn_encoder<Functor>::encode(oa, std::forward<Args>(args)...);
+      }
+
+    public:
+
+      int fn_id() const { return _fn_id; }
+
+      const std::string& args() const { return _args; }
+
+      // the function is not bound in this process
+      bool bound() const { return fn_table::ref().find(_fn_id) != nullptr; }
+
+      rpc_result operator()(const rpc_context& c = nilctx) const {
+        return dispatcher_manager::ref().dispatch(_fn_id, _args.data(), _args.size(), c);
+      }
+
+      template<typename Archive>
+      void serialize(Archive& ar, const unsigned int) {
+        ar & _fn_id & _args;
+      }
+
+    private:
+
+      int _fn_id;
+      std::string _args;
+    };
+
+    /*
+     * The frames are the calls packed one after another, every call is dispatched with it's own context, as if
+     * it came alone, and the results of the calls expecting a response are sent back together, with their
+     * session ids, see remote_caller::unpack
+     * */
+    inline rpc_result builtin_rfc::call_batch(const std::string& frames, bool parallel, const rpc_context& c) {
+      endpoint_id source = c.empty() ? nil_endpoint : c.source();
+      // a batch is a few calls, they're kept inline
+      atlas::small_vector<message, 8> calls;
+
+      const char* p = frames.data();
+      size_t size = frames.size();
+      while (size >= sizeof(request_header)) {
+        int32_t length = 0;
+        std::memcpy(&length, p + offsetof(request_header, length), sizeof(length));
+        if (length < static_cast<int32_t>(sizeof(request_header)) || static_cast<size_t>(length) > size) break;
+        if (!message::known_version(p, length)) break;
+
+        calls.emplace_back(p, length);
+
+        p += length;
+        size -= length;
+      }
+
+      atlas::small_vector<rpc_result, 8> results(calls.size(), nullptr);
+      auto run = [&calls, &results, source](size_t i) {
+        const request_header* h = calls[i].header();
+        rpc_context context(h->client_id, h->return_type, h->session_id, source);
+        results[i] = dispatcher_manager::ref().dispatch(calls[i], context);
+      };
+
+      const dispatcher_manager::batch_executor_type& executor = dispatcher_manager::ref().batch_executor();
+      if (parallel && executor && calls.size() > 1) {
+        std::vector<std::function<void()>> tasks;
+        tasks.reserve(calls.size());
+        for (size_t i = 0; i < calls.size(); ++i) tasks.push_back([&run, i]() { run(i); });
+
+        executor(tasks);
+      }
+      else {
+        for (size_t i = 0; i < calls.size(); ++i) run(i);
+      }
+
+      std::vector<uuid> sids;
+      std::vector<rpc_result> answered;
+      for (size_t i = 0; i < calls.size(); ++i) {
+        int rt = calls[i].header()->return_type;
+        if (!results[i] || (rt != rpc_sync && rt != rpc_async_callback)) continue;
+
+        sids.push_back(calls[i].header()->session_id);
+        answered.push_back(std::move(results[i]));
+      }
+
+      std::string data;
+      {
+        io::oappendstream os(data);
+        rpc_oarchive oa(os);
+        oa << sids << answered;
+      }
+
+      return rpc_result(std::move(data));
+    }
+
   } // rpc
 } // atlas
 
+// bind the implementation of a remote function to it's function id registered by ATLAS_REGISTER_REMOTE_FUNC,
+// must be placed in the namespace where the function id is registered
+#define ATLAS_BIND_REMOTE_FUNC(func_name, func) \
+  static ::atlas::rpc::fn_binder<decltype(func), &func> __atlas_fn_binder_##func_name(fn_ids::func_name)
+
+// bind the batch handler of a function bound by ATLAS_BIND_REMOTE_FUNC, the queued calls of the function may be run
+// together, see fn_batch, after ATLAS_BIND_REMOTE_FUNC of the function
+#define ATLAS_BIND_REMOTE_BATCH(func_name, func, batch_func) \
+  static ::atlas::rpc::batch_fn_binder<decltype(func), &func, decltype(batch_func), &batch_func> \
+      __atlas_batch_binder_##func_name(fn_ids::func_name)
+
 // TODO : use meta programming
 #define ATLAS_REGISTER_RPC_DISPATCHER(module_name, dispatcher) \
 namespace atlas { \
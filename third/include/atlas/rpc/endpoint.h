@@ -0,0 +1,107 @@
+/*
+ * endpoint.h
+ *
+ *  Created on: Aug 27, 2013
+ *      Author: vincent
+ */
+
+#ifndef ATLAS_RPC_ENDPOINT_H_
+#define ATLAS_RPC_ENDPOINT_H_
+
+#include <cstdint>
+#include <cstdlib>
+#include <string>
+
+#include <arpa/inet.h>
+
+#include <atlas/inplace_string.h>
+
+namespace atlas {
+  namespace rpc {
+
+    /*
+     * An IPv4 endpoint packed into 64 bits : the address in host byte order << 16 | the port.
+     * Port 0 means any port of the address, for example, the source of a multicast message.
+     *
+     * The endpoints are compared and hashed as integers on the hot paths, they are formatted
+     * into the inplace strings for logging, see format_endpoint()
+     * */
+    typedef uint64_t endpoint_id;
+
+    const endpoint_id nil_endpoint = 0;
+
+    // the formatted addresses are kept inline, "255.255.255.255" and "255.255.255.255:65535",
+    // an IPv6 "[address]:port" fits 48 characters too
+    typedef atlas::string16 ip_string;
+    typedef basic_inplace_string<char, 48> endpoint_string;
+
+    inline endpoint_id make_endpoint(uint32_t ip, uint16_t port) {
+      return (static_cast<endpoint_id>(ip) << 16) | port;
+    }
+
+    inline uint32_t endpoint_ip(endpoint_id e) { return static_cast<uint32_t>(e >> 16); }
+
+    inline uint16_t endpoint_port(endpoint_id e) { return static_cast<uint16_t>(e & 0xffff); }
+
+    // the address in host byte order, 0 if it's not a valid IPv4 address
+    inline uint32_t parse_ip(const std::string& ip) {
+      in_addr addr;
+      if (inet_pton(AF_INET, ip.c_str(), &addr) != 1) return 0;
+
+      return ntohl(addr.s_addr);
+    }
+
+    // "ip:port" or "ip", nil_endpoint if it's not valid
+    inline endpoint_id parse_endpoint(const std::string& ip_port) {
+      size_t pos = ip_port.find(':');
+      if (pos == std::string::npos) return make_endpoint(parse_ip(ip_port), 0);
+
+      uint32_t ip = parse_ip(ip_port.substr(0, pos));
+      if (ip == 0) return nil_endpoint;
+
+      return make_endpoint(ip, static_cast<uint16_t>(std::atoi(ip_port.c_str() + pos + 1)));
+    }
+
+    // formatted without allocation
+    inline ip_string format_ip(uint32_t ip) {
+      in_addr addr;
+      addr.s_addr = htonl(ip);
+
+      char buf[INET_ADDRSTRLEN] = { 0 };
+      inet_ntop(AF_INET, &addr, buf, sizeof(buf));
+
+      return ip_string(buf);
+    }
+
+    inline endpoint_string format_endpoint(endpoint_id e) {
+      in_addr addr;
+      addr.s_addr = htonl(endpoint_ip(e));
+
+      char buf[INET_ADDRSTRLEN + 6] = { 0 };
+      inet_ntop(AF_INET, &addr, buf, INET_ADDRSTRLEN);
+
+      // the port digits backward
+      size_t size = std::char_traits<char>::length(buf);
+      buf[size++] = ':';
+
+      char digits[5];
+      int n = 0;
+      uint16_t port = endpoint_port(e);
+      do {
+        digits[n++] = static_cast<char>('0' + port % 10);
+        port /= 10;
+      } while (port);
+
+      while (n) buf[size++] = digits[--n];
+
+      return endpoint_string(buf, size);
+    }
+
+    inline std::string ip_to_string(uint32_t ip) { return format_ip(ip).c_str(); }
+
+    inline std::string endpoint_to_string(endpoint_id e) { return format_endpoint(e).c_str(); }
+
+  } // rpc
+} // atlas
+
+#endif /* ATLAS_RPC_ENDPOINT_H_ */
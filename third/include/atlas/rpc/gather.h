@@ -0,0 +1,125 @@
+/*
+ * gather.h
+ *
+ *  Created on: Sep 26, 2013
+ *      Author: vincent
+ */
+
+/*    Copyright 2011 ~ 2013 Vincent Zhang, ivincent.zhang@gmail.com
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#ifndef ATLAS_RPC_GATHER_H_
+#define ATLAS_RPC_GATHER_H_
+
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <string>
+
+#include <boost/lexical_cast.hpp>
+
+#include <atlas/rpc/result.h>
+#include <atlas/rpc/task.h>
+
+namespace atlas {
+  namespace rpc {
+
+    // how the responses of a scatter-gather call went
+    struct gather_status {
+      gather_status() : responses(0), failures(0), expected(0), ec(rpc_success) {}
+
+      // every response expected is reduced, and the call is not cut short
+      bool complete() const { return ec == rpc_success && responses == expected; }
+
+      // reduced into the accumulator
+      size_t responses;
+      // responded with an error, or refused by the reducer
+      size_t failures;
+      size_t expected;
+      // the error which ends the call before every response arrives, rpc_timed_out for example
+      int ec;
+    };
+
+    /*
+     * The callback of a call with many responses, a multicast call for example. Every response is folded into
+     * the accumulator as it arrives, and done is called once, after the last response, or once the call is cut
+     * short, with whatever is reduced by then. The responses are never kept, unlike async_task::merge_data,
+     * so the memory of the call does not grow with the nodes.
+     *
+     * The callbacks of a task are serialized, see async_task_manager, neither the reducer nor done needs a lock.
+     * For example, the sum of the partial counts of every node :
+     *
+     *    client.call(f, fn_id, gather<uint64_t>::values(0, std::plus<uint64_t>(), done), args..., nilctx);
+     * */
+    template<typename T>
+    class gather {
+    public:
+
+      // return false for a response which can not be used, it's counted as a failure
+      typedef std::function<bool(T& acc, const std::string& data)> reducer_type;
+      typedef std::function<void(T& acc, const gather_status& status)> done_type;
+
+    public:
+
+      static rpc_callback_type callback(T init, reducer_type reduce, done_type done) {
+        std::shared_ptr<state> s = std::make_shared<state>(std::move(init));
+
+        return [s, reduce, done](const std::string& data, int err, async_task& task) {
+          if (s->done) return;
+
+          gather_status& status = s->status;
+          status.expected = task.expected_response_count();
+
+          if (task.cancelled()) status.ec = err;
+          else if (err || !reduce(s->acc, data)) ++status.failures;
+          else ++status.responses;
+
+          if (!task.cancelled() && !task.ready()) return;
+
+          s->done = true;
+          done(s->acc, status);
+        };
+      }
+
+      // every response is a T in text, see boost::lexical_cast, combined by op, std::plus<T>() for example
+      template<typename Op>
+      static rpc_callback_type values(T init, Op op, done_type done) {
+        return callback(std::move(init), [op](T& acc, const std::string& data) {
+          try {
+            acc = op(acc, boost::lexical_cast<T>(data));
+          }
+          catch (const boost::bad_lexical_cast&) {
+            return false;
+          }
+
+          return true;
+        }, done);
+      }
+
+    private:
+
+      struct state {
+        explicit state(T&& init) : acc(std::move(init)), done(false) {}
+
+        T acc;
+        gather_status status;
+        bool done;
+      };
+    };
+
+  } // rpc
+} // atlas
+
+#endif /* ATLAS_RPC_GATHER_H_ */
@@ -0,0 +1,499 @@
+/*
+ * json.h
+ *
+ *  Created on: Sep 28, 2013
+ *      Author: vincent
+ */
+
+/*    Copyright 2011 ~ 2013 Vincent Zhang, ivincent.zhang@gmail.com
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#ifndef ATLAS_RPC_JSON_H_
+#define ATLAS_RPC_JSON_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <map>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace atlas {
+  namespace rpc {
+    namespace json {
+
+      enum node_type { null_node, bool_node, number_node, string_node, array_node, object_node };
+
+      /*
+       * A node of the tape, a value in document order, an array or an object is followed by it's items, the key of
+       * a member is a string node followed by the value. end is the index of the node after the subtree, so the
+       * items are walked by jumping from one end to the next, see document::first and document::next
+       * */
+      struct node {
+        node_type type;
+        bool integer;       // a number without a fraction or an exponent, exact in value
+        bool escaped;       // a string with escapes, it's text must be unescaped, see unescape()
+        bool boolean;
+        uint32_t end;
+        uint32_t count;     // the items of an array or the members of an object
+        const char* text;   // of a string, in the input, without the quotes
+        size_t size;
+        int64_t value;
+        double number;
+      };
+
+      /*
+       * A JSON document parsed in situ, the strings point into the input, which must outlive the document, and no
+       * string is copied unless it has escapes. The nodes are kept on one tape, one allocation a document, reused
+       * by the next parse.
+       *
+       * The strings, most of the bytes of a request, are scanned 16 bytes at a time for the quote, the backslash
+       * and the control characters by SSE2, the rest is a plain recursive descent, no deeper than max_depth
+       * */
+      class document {
+      public:
+
+        static const int max_depth = 64;
+
+      public:
+
+        document() : _depth(0) {}
+
+        bool parse(const char* p, size_t size) {
+          _nodes.clear();
+          _error.clear();
+          _begin = p;
+          _end = p + size;
+          _depth = 0;
+
+          const char* q = p;
+          if (!value(q)) return false;
+
+          skip_space(q);
+          if (q != _end) return fail(q, "trailing characters");
+
+          return true;
+        }
+
+        const node& root() const { return _nodes[0]; }
+
+        const std::string& error() const { return _error; }
+
+        // the items of an array, or the keys of an object, the value of a key is next to it
+        const node* first(const node& n) const {
+          size_t i = index(n) + 1;
+          return i < n.end ? &_nodes[i] : nullptr;
+        }
+
+        const node* next(const node& parent, const node& n) const { return n.end < parent.end ? &_nodes[n.end] : nullptr; }
+
+        // the value of a member
+        const node& value_of(const node& key) const { return _nodes[index(key) + 1]; }
+
+        // the member of an object, nullptr if none, compared to the raw text of the key
+        const node* find(const node& object, const char* key) const {
+          size_t len = std::strlen(key);
+          for (const node* k = first(object); k; k = next(object, value_of(*k))) {
+            if (k->size == len && std::memcmp(k->text, key, len) == 0) return &value_of(*k);
+          }
+
+          return nullptr;
+        }
+
+        size_t index(const node& n) const { return &n - _nodes.data(); }
+
+      private:
+
+        bool fail(const char* p, const char* what) {
+          _error = std::string(what) + " at " + std::to_string(p - _begin);
+          return false;
+        }
+
+        void skip_space(const char*& p) const {
+          while (p < _end && (*p == ' ' || *p == '\n' || *p == '\r' || *p == '\t')) ++p;
+        }
+
+        size_t push(node_type type) {
+          node n;
+          std::memset(&n, 0, sizeof(n));
+          n.type = type;
+          _nodes.push_back(n);
+
+          return _nodes.size() - 1;
+        }
+
+        bool value(const char*& p) {
+          skip_space(p);
+          if (p == _end) return fail(p, "unexpected end");
+
+          switch (*p) {
+          case '{': return compound(p, object_node, '}');
+          case '[': return compound(p, array_node, ']');
+          case '"': return string(p);
+          case 't': return literal(p, "true", bool_node, true);
+          case 'f': return literal(p, "false", bool_node, false);
+          case 'n': return literal(p, "null", null_node, false);
+          default: return number(p);
+          }
+        }
+
+        bool literal(const char*& p, const char* word, node_type type, bool b) {
+          size_t len = std::strlen(word);
+          if (static_cast<size_t>(_end - p) < len || std::memcmp(p, word, len) != 0) return fail(p, "bad literal");
+
+          size_t i = push(type);
+          _nodes[i].boolean = b;
+          _nodes[i].end = i + 1;
+          p += len;
+
+          return true;
+        }
+
+        bool compound(const char*& p, node_type type, char close) {
+          if (++_depth > max_depth) return fail(p, "too deep");
+
+          size_t i = push(type);
+          uint32_t count = 0;
+          ++p;
+
+          skip_space(p);
+          if (p < _end && *p == close) {
+            ++p;
+          }
+          else {
+            for (;;) {
+              if (type == object_node) {
+                skip_space(p);
+                if (p == _end || *p != '"') return fail(p, "expect a key");
+                if (!string(p)) return false;
+
+                skip_space(p);
+                if (p == _end || *p != ':') return fail(p, "expect a colon");
+                ++p;
+              }
+
+              if (!value(p)) return false;
+              ++count;
+
+              skip_space(p);
+              if (p == _end) return fail(p, "unexpected end");
+              if (*p == close) { ++p; break; }
+              if (*p != ',') return fail(p, "expect a comma");
+              ++p;
+            }
+          }
+
+          _nodes[i].count = count;
+          _nodes[i].end = _nodes.size();
+          --_depth;
+
+          return true;
+        }
+
+        // the first quote, backslash or control character from p
+        const char* scan_string(const char* p) const {
+#if defined(__SSE2__)
+          const __m128i quote = _mm_set1_epi8('"');
+          const __m128i backslash = _mm_set1_epi8('\\');
+
+          for (; _end - p >= 16; p += 16) {
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+            // the control characters are the ones below 0x20, unsigned, min(v, 0x1f) == v
+            __m128i control = _mm_cmpeq_epi8(_mm_min_epu8(v, _mm_set1_epi8(0x1f)), v);
+            int mask = _mm_movemask_epi8(_mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, quote),
+                _mm_cmpeq_epi8(v, backslash)), control));
+
+            if (mask) return p + __builtin_ctz(mask);
+          }
+#endif
+          for (; p < _end; ++p) {
+            unsigned char c = *p;
+            if (c == '"' || c == '\\' || c < 0x20) return p;
+          }
+
+          return p;
+        }
+
+        bool string(const char*& p) {
+          size_t i = push(string_node);
+          const char* begin = ++p;
+
+          for (;;) {
+            p = scan_string(p);
+            if (p == _end) return fail(p, "unterminated string");
+
+            if (*p == '"') break;
+            if (static_cast<unsigned char>(*p) < 0x20) return fail(p, "control character in string");
+
+            // a backslash, the escaped character is skipped, unescape() checks it
+            _nodes[i].escaped = true;
+            if (_end - p < 2) return fail(p, "unterminated string");
+            p += 2;
+          }
+
+          _nodes[i].text = begin;
+          _nodes[i].size = p - begin;
+          _nodes[i].end = i + 1;
+          ++p;
+
+          return true;
+        }
+
+        bool number(const char*& p) {
+          const char* begin = p;
+          bool negative = false;
+          if (*p == '-') { negative = true; ++p; }
+
+          if (p == _end || *p < '0' || *p > '9') return fail(begin, "bad value");
+
+          uint64_t v = 0;
+          bool overflow = false;
+          for (; p < _end && *p >= '0' && *p <= '9'; ++p) {
+            if (v > (std::numeric_limits<uint64_t>::max() - 9) / 10) overflow = true;
+            v = v * 10 + (*p - '0');
+          }
+
+          bool integer = true;
+          if (p < _end && *p == '.') {
+            integer = false;
+            for (++p; p < _end && *p >= '0' && *p <= '9'; ++p);
+          }
+          if (p < _end && (*p == 'e' || *p == 'E')) {
+            integer = false;
+            ++p;
+            if (p < _end && (*p == '+' || *p == '-')) ++p;
+            for (; p < _end && *p >= '0' && *p <= '9'; ++p);
+          }
+
+          size_t i = push(number_node);
+          node& n = _nodes[i];
+          n.end = i + 1;
+
+          uint64_t limit = static_cast<uint64_t>(std::numeric_limits<int64_t>::max()) + (negative ? 1 : 0);
+          if (integer && !overflow && v <= limit) {
+            n.integer = true;
+            n.value = negative ? static_cast<int64_t>(0 - v) : static_cast<int64_t>(v);
+            n.number = static_cast<double>(n.value);
+            return true;
+          }
+
+          // the input is not terminated, the number is copied for strtod
+          char buf[64];
+          size_t len = p - begin;
+          if (len >= sizeof(buf)) return fail(begin, "number too long");
+
+          std::memcpy(buf, begin, len);
+          buf[len] = '\0';
+          n.number = std::strtod(buf, nullptr);
+
+          return true;
+        }
+
+      private:
+
+        std::vector<node> _nodes;
+        std::string _error;
+        const char* _begin;
+        const char* _end;
+        int _depth;
+      };
+
+      // the text of a string node, the escapes replaced, false on a bad escape
+      inline bool unescape(const node& n, std::string& out) {
+        out.clear();
+        if (!n.escaped) {
+          out.assign(n.text, n.size);
+          return true;
+        }
+
+        out.reserve(n.size);
+        const char* p = n.text;
+        const char* end = n.text + n.size;
+
+        while (p < end) {
+          const char* b = static_cast<const char*>(std::memchr(p, '\\', end - p));
+          if (!b) b = end;
+          out.append(p, b);
+          if (b == end) break;
+
+          p = b + 1;
+          switch (*p++) {
+          case '"': out += '"'; break;
+          case '\\': out += '\\'; break;
+          case '/': out += '/'; break;
+          case 'b': out += '\b'; break;
+          case 'f': out += '\f'; break;
+          case 'n': out += '\n'; break;
+          case 'r': out += '\r'; break;
+          case 't': out += '\t'; break;
+          case 'u': {
+            if (end - p < 4) return false;
+
+            unsigned cp = 0;
+            for (int k = 0; k < 4; ++k, ++p) {
+              char c = *p;
+              cp <<= 4;
+              if (c >= '0' && c <= '9') cp |= c - '0';
+              else if (c >= 'a' && c <= 'f') cp |= c - 'a' + 10;
+              else if (c >= 'A' && c <= 'F') cp |= c - 'A' + 10;
+              else return false;
+            }
+
+            // the surrogates are taken as they are, one code point each
+            if (cp < 0x80) {
+              out += static_cast<char>(cp);
+            }
+            else if (cp < 0x800) {
+              out += static_cast<char>(0xc0 | (cp >> 6));
+              out += static_cast<char>(0x80 | (cp & 0x3f));
+            }
+            else {
+              out += static_cast<char>(0xe0 | (cp >> 12));
+              out += static_cast<char>(0x80 | ((cp >> 6) & 0x3f));
+              out += static_cast<char>(0x80 | (cp & 0x3f));
+            }
+            break;
+          }
+          default:
+            return false;
+          }
+        }
+
+        return true;
+      }
+
+      // the string quoted and escaped as a JSON string, appended to out
+      inline void append_string(std::string& out, const char* p, size_t size) {
+        static const char hex[] = "0123456789abcdef";
+
+        out += '"';
+        for (const char* end = p + size; p < end; ++p) {
+          unsigned char c = *p;
+          switch (c) {
+          case '"': out += "\\\""; break;
+          case '\\': out += "\\\\"; break;
+          case '\n': out += "\\n"; break;
+          case '\r': out += "\\r"; break;
+          case '\t': out += "\\t"; break;
+          default:
+            if (c < 0x20) {
+              out += "\\u00";
+              out += hex[c >> 4];
+              out += hex[c & 0xf];
+            }
+            else {
+              out += static_cast<char>(c);
+            }
+          }
+        }
+        out += '"';
+      }
+
+      /*
+       * The types an argument is decoded into straight from the JSON, no binary archive in between, the
+       * arithmetic ones, std::string, and the vectors and the string keyed maps of them
+       * */
+      template<typename T, typename Enable = void>
+      struct decodable : std::false_type {};
+
+      template<typename T>
+      struct decodable<T, typename std::enable_if<std::is_arithmetic<T>::value>::type> : std::true_type {};
+
+      template<>
+      struct decodable<std::string> : std::true_type {};
+
+      template<typename T, typename A>
+      struct decodable<std::vector<T, A>> : decodable<T> {};
+
+      template<typename T, typename C, typename A>
+      struct decodable<std::map<std::string, T, C, A>> : decodable<T> {};
+
+      inline bool decode(const document&, const node& n, bool& v) {
+        if (n.type != bool_node) return false;
+        v = n.boolean;
+        return true;
+      }
+
+      template<typename T>
+      typename std::enable_if<std::is_integral<T>::value && !std::is_same<T, bool>::value, bool>::type
+      decode(const document&, const node& n, T& v) {
+        if (n.type != number_node || !n.integer) return false;
+
+        if (std::is_signed<T>::value) {
+          if (n.value < static_cast<int64_t>(std::numeric_limits<T>::min())
+              || n.value > static_cast<int64_t>(std::numeric_limits<T>::max())) return false;
+        }
+        else if (n.value < 0 || static_cast<uint64_t>(n.value) > static_cast<uint64_t>(std::numeric_limits<T>::max())) {
+          return false;
+        }
+
+        v = static_cast<T>(n.value);
+        return true;
+      }
+
+      template<typename T>
+      typename std::enable_if<std::is_floating_point<T>::value, bool>::type
+      decode(const document&, const node& n, T& v) {
+        if (n.type != number_node) return false;
+        v = static_cast<T>(n.number);
+        return true;
+      }
+
+      inline bool decode(const document&, const node& n, std::string& v) {
+        return n.type == string_node && unescape(n, v);
+      }
+
+      template<typename T, typename A>
+      bool decode(const document& d, const node& n, std::vector<T, A>& v) {
+        if (n.type != array_node) return false;
+
+        v.clear();
+        v.reserve(n.count);
+        // by a value, the items of std::vector<bool> are not addressable
+        for (const node* i = d.first(n); i; i = d.next(n, *i)) {
+          T item = T();
+          if (!decode(d, *i, item)) return false;
+          v.push_back(std::move(item));
+        }
+
+        return true;
+      }
+
+      template<typename T, typename C, typename A>
+      bool decode(const document& d, const node& n, std::map<std::string, T, C, A>& v) {
+        if (n.type != object_node) return false;
+
+        v.clear();
+        std::string key;
+        for (const node* k = d.first(n); k; k = d.next(n, d.value_of(*k))) {
+          if (!unescape(*k, key)) return false;
+          if (!decode(d, d.value_of(*k), v[key])) return false;
+        }
+
+        return true;
+      }
+
+    } // json
+  } // rpc
+} // atlas
+
+#endif /* ATLAS_RPC_JSON_H_ */
@@ -23,28 +23,73 @@
 #ifndef ATLAS_RFC_MESSAGE_H_
 #define ATLAS_RFC_MESSAGE_H_
 
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
 #include <cstring>
+#include <functional>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
 
 #include <boost/uuid/uuid.hpp>
 #include <boost/uuid/uuid_io.hpp>
 
+#include <atlas/io/crc32c.h>
+
 namespace atlas {
   namespace rpc {
 
     using boost::uuids::uuid;
 
-    enum return_type { rpc_sync, rpc_async_callback, rpc_async_no_callback };
+    // rpc_stream is answered as rpc_sync, the chunks of the stream are sent under it's session id, see stream_call
+    enum return_type { rpc_sync, rpc_async_callback, rpc_async_no_callback, rpc_stream };
+
+    // the flags of the trace, see trace.h
+    enum trace_flag { trace_sampled = 1 };
+
+    // the flags of the message, the body of a compressed message is the raw body size, 4 bytes,
+    // and then an LZ4 block, see io::lz4, a sender compresses only for the peers which accept it,
+    // and splits the large frames into chunks only for the ones which accept them, see pioneer::net::frame_chunks.
+    // A checksummed frame ends with the CRC-32C of the rest of it, 4 bytes, see message::seal
+    enum message_flag {
+      message_compressed = 1, message_accepts_compression = 2, message_accepts_chunks = 16, message_checksummed = 32
+    };
+
+    /*
+     * The priority class of the message, the bits 2 and 3 of the flags. The writers of a connection put the control
+     * frames before the others queued, and the large ones are sent in chunks, so the small ones pass them, see
+     * pioneer::net::corked_output. The builtin calls and their responses are control ones by default
+     * */
+    enum message_priority { priority_normal = 0, priority_control = 1, priority_bulk = 2 };
+
+    const uint8_t message_priority_shift = 2;
+    const uint8_t message_priority_mask = 3 << message_priority_shift;
+
+    /*
+     * The layout of the header, the second one. The version takes the byte where the first layout has the lowest
+     * byte of it's return type, 0 to 3, so the frames of the first layout are told by the high bit, and refused
+     * */
+    const uint8_t request_header_version = 0x82;
 
-    // TODO : check the alignment, when should be 4 and when 8? what's the difference?
+    // the fields are narrowed to what they carry, and the 64 bit fields are aligned, 56 bytes
 #pragma pack(4)
 
     struct request_header {
       int32_t length;           // 1 the total length of this message
       int32_t fn_id;            // 2 function id
-      int32_t return_type;      // 3 return type : see rpc::return_type
-      int32_t client_id;        // 4 client id, indicate where the request comes from
-      uuid    session_id;       // 5 the current session id
-      int32_t resp_expect;      // 6 expected response count
+      uint8_t version;          // 3 see request_header_version
+      uint8_t return_type;      // 4 return type : see rpc::return_type
+      uint8_t trace_flags;      // 5 see rpc::trace_flag
+      uint8_t flags;            // 6 see rpc::message_flag
+      int16_t client_id;        // 7 client id, indicate where the request comes from
+      int16_t resp_expect;      // 8 expected response count
+      uuid    session_id;       // 9 the current session id
+      uint64_t trace_id;        // 10 the trace the request belongs to, 0 if not traced, see trace.h
+      uint64_t span_id;         // 11 the span of the request
+      uint64_t parent_span_id;  // 12 the span of the caller, 0 for the root
     };
 
 #pragma pack()
@@ -63,43 +108,192 @@ namespace atlas {
       }
 
       static request_header make_header(int fn_id, const uuid& session_id) {
-        return request_header {
-          0,                                  // length
-          fn_id,                              // method
-          return_type::rpc_async_no_callback, // return type
-          0,                                  // client id
-          session_id,                         // session id
-          1,                                  // resp_expect
-        };
+        request_header h;
+
+        h.length = 0;
+        h.fn_id = fn_id;
+        h.version = request_header_version;
+        h.return_type = return_type::rpc_async_no_callback;
+        h.trace_flags = 0;
+        h.flags = (accepts_compression() ? message_accepts_compression : 0) | (accepts_chunks() ? message_accepts_chunks : 0)
+            | (checksums() ? message_checksummed : 0);
+        h.client_id = 0;
+        h.resp_expect = 1;
+        h.session_id = session_id;
+        h.trace_id = 0;
+        h.span_id = 0;
+        h.parent_span_id = 0;
+
+        return h;
+      }
+
+      // false if the frame is of another layout, the version is not known until it's byte arrives
+      static bool known_version(const char* data, size_t size) {
+        size_t offset = offsetof(request_header, version);
+        return size <= offset || static_cast<uint8_t>(data[offset]) == request_header_version;
+      }
+
+      /*
+       * Unique in the cluster without drawing a random number for every call, the first half is random, drawn
+       * once a thread, and the second half counts the sessions of the thread
+       * */
+      static uuid next_session_id() {
+        static __thread uint64_t prefix = 0;
+        static __thread uint64_t count = 0;
+
+        if (prefix == 0) prefix = random_prefix();
+
+        uuid id;
+        ++count;
+        std::memcpy(id.data, &prefix, sizeof(prefix));
+        std::memcpy(id.data + sizeof(prefix), &count, sizeof(count));
+
+        return id;
+      }
+
+      // the messages built in this process tell the peers they can be compressed, set once it can decompress them
+      static std::atomic<bool>& accepts_compression() {
+        static std::atomic<bool> accepts(false);
+        return accepts;
+      }
+
+      // as accepts_compression, set once it can reassemble the chunks of a frame
+      static std::atomic<bool>& accepts_chunks() {
+        static std::atomic<bool> accepts(false);
+        return accepts;
+      }
+
+      /*
+       * The messages built in this process are checksummed, every node of the cluster must know the flag. The
+       * receiver checks a frame once it's whole and raw, after it's reassembled and decompressed, and a frame which
+       * fails is not run, see dispatcher_manager::dispatch, so a frame corrupted on the way is never deserialized
+       * */
+      static std::atomic<bool>& checksums() {
+        static std::atomic<bool> on(false);
+        return on;
+      }
+
+      // the frames failed their checksums in this process
+      static std::atomic<unsigned long long>& corrupted_frames() {
+        static std::atomic<unsigned long long> frames(0);
+        return frames;
+      }
+
+      // write the checksum of the frame into it's last 4 bytes, the length is the frame's one
+      static void seal(char* frame, size_t length) {
+        uint32_t crc = io::crc32c::compute(frame, length - checksum_size);
+        std::memcpy(frame + length - checksum_size, &crc, sizeof(crc));
+      }
+
+      static message_priority priority(const char* data) {
+        uint8_t flags = static_cast<uint8_t>(data[offsetof(request_header, flags)]);
+        return static_cast<message_priority>((flags & message_priority_mask) >> message_priority_shift);
+      }
+
+      static void set_priority(request_header& h, message_priority priority) {
+        h.flags = static_cast<uint8_t>((h.flags & ~message_priority_mask) | (priority << message_priority_shift));
       }
 
     public:
 
       static const size_t request_header_size = sizeof(request_header);
 
-      message(const std::string& data) : _header(*reinterpret_cast<const request_header*>(data.data())),
-        _body(data.c_str() + request_header_size, data.size() - request_header_size) {}
+      static const size_t checksum_size = sizeof(uint32_t);
+
+      // a ref-counted holder of the memory block that a message borrows from
+      typedef std::shared_ptr<const void> holder_type;
+
+      message() : _body(nullptr), _body_size(0), _sealed(false), _truncated(false), _checksum(0), _received(0) {
+        std::memset(&_header, 0, sizeof _header);
+      }
+
+      // copy the data, the message owns it's body
+      message(const std::string& data) { reset(data); }
+
+      // borrow the data without copying, the caller must keep the data alive while the message is in use
+      message(const char* data, size_t size) { reset(data, size); }
 
-      message(const char* data, size_t size) : _header(*reinterpret_cast<const request_header*>(data)),
-        _body(data + request_header_size, size - request_header_size) {}
+      // borrow a slice of a ref-counted buffer, the buffer is kept alive as long as the message lives
+      message(const holder_type& holder, const char* data, size_t size) { reset(holder, data, size); }
 
       void reset(const std::string& data) {
-        reset(data.data(), data.size());
+        std::shared_ptr<std::string> copy(new std::string(data));
+        reset(copy, copy->data(), copy->size());
       }
 
       void reset(const char* data, size_t size) {
+        reset(holder_type(), data, size);
+      }
+
+      void reset(const holder_type& holder, const char* data, size_t size) {
         std::memcpy(&_header, data, sizeof _header);
-        _body.assign(data + request_header_size, size - request_header_size);
+
+        _holder = holder;
+        _body = data + request_header_size;
+        _body_size = size - request_header_size;
+
+        // the checksum of a compressed frame is in it's compressed body, it's checked once it's decompressed
+        _sealed = (_header.flags & (message_checksummed | message_compressed)) == message_checksummed;
+        _truncated = _sealed && _body_size < checksum_size;
+        _checksum = 0;
+        _received = 0;
+
+        if (_sealed && !_truncated) {
+          _body_size -= checksum_size;
+          std::memcpy(&_checksum, _body + _body_size, sizeof(_checksum));
+        }
       }
 
       const request_header* header() const { return &_header; }
 
-      const std::string& rpc_str() const { return _body; }
+      const char* body() const { return _body; }
+
+      // without the checksum
+      size_t body_size() const { return _body_size; }
+
+      // the whole frame, the header, the body and the checksum, as it's received
+      size_t frame_size() const { return request_header_size + _body_size + (_sealed && !_truncated ? checksum_size : 0); }
+
+      // false if the frame is checksummed and it's changed on the way, true if it's not checksummed
+      bool intact() const {
+        if (!_sealed) return true;
+        if (_truncated) return false;
+
+        uint32_t crc = io::crc32c::compute(&_header, sizeof _header);
+        return io::crc32c::extend(crc, _body, _body_size) == _checksum;
+      }
+
+      std::string rpc_str() const { return std::string(_body, _body_size); }
+
+      // the time the frame is received, in nanoseconds since the epoch, 0 if unknown, see rpc_context::received
+      int64_t received() const { return _received; }
+
+      void set_received(int64_t received) { _received = received; }
 
     private:
 
+      static uint64_t random_prefix() {
+        std::random_device device;
+        uint64_t prefix = (static_cast<uint64_t>(device()) << 32) ^ device();
+        prefix ^= std::hash<std::thread::id>()(std::this_thread::get_id());
+        prefix ^= static_cast<uint64_t>(std::chrono::steady_clock::now().time_since_epoch().count());
+
+        return prefix ? prefix : 1;
+      }
+
+    private:
+
+      // the header is copied to keep it aligned, it's small
       request_header _header;
-      std::string _body;
+      holder_type _holder;
+      const char* _body;
+      size_t _body_size;
+
+      bool _sealed;
+      bool _truncated;
+      uint32_t _checksum;
+
+      int64_t _received;
     };
 
   } // rpc
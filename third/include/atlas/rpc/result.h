@@ -23,21 +23,116 @@
 #ifndef ATLAS_RFC_RESULT_H_
 #define ATLAS_RFC_RESULT_H_
 
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cerrno>
+
 #include <string>
 #include <memory>
 
 namespace atlas {
   namespace rpc {
 
+    // error codes reserved by the rpc framework, user functions should use positive error codes
+    enum rpc_errc {
+      rpc_success = 0,
+      rpc_timed_out = -1,   // no response before the deadline
+      rpc_backpressure = -2, // the call is not sent since the connection is congested
+      rpc_unreachable = -3, // the call is not sent since there is no connection to the target
+      rpc_busy = -4,        // the call is rejected since the callee is overloaded, it may be retried later
+      rpc_stream_aborted = -5, // the stream ends early, the producer fails or the consumer cancels it
+      rpc_cancelled = -6,   // the call is cancelled by the caller, see remote_caller::cancel
+      rpc_bad_result = -7,  // the data of a typed result is not of the type expected, see typed_callback
+      rpc_corrupted = -8,   // the frame fails it's checksum, it's not run, see message::intact
+      rpc_io_error = -9,    // the file range of a result can not be read, see rpc_result::file
+    };
+
+    // an open file shared by the results which refer to it, closed with the last one if it's owned
+    class file_handle {
+    public:
+
+      file_handle(int fd, bool owned) : _fd(fd), _owned(owned) {}
+
+      ~file_handle() {
+        if (_owned && _fd >= 0) ::close(_fd);
+      }
+
+      file_handle(const file_handle&) = delete;
+      file_handle& operator=(const file_handle&) = delete;
+
+      int fd() const { return _fd; }
+
+    private:
+
+      int _fd;
+      bool _owned;
+    };
+
+    /*
+     * A range of a file as the data of a result, a snapshot or a rolled log segment, it's sent from the file by
+     * the network layer, the kernel copies it to the socket, see remote_caller::respond_file. The file must not
+     * change until the result is sent
+     * */
+    struct file_range {
+      file_range() : offset(0), length(0) {}
+
+      file_range(int fd, off_t offset, size_t length, bool owned = false) :
+        file(std::make_shared<file_handle>(fd, owned)), offset(offset), length(length) {}
+
+      // the whole file, or an empty range if it can not be opened
+      static file_range open(const std::string& path) {
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) return file_range();
+
+        struct stat st;
+        if (::fstat(fd, &st) != 0) {
+          ::close(fd);
+          return file_range();
+        }
+
+        return file_range(fd, 0, st.st_size, true);
+      }
+
+      explicit operator bool() const { return file != nullptr; }
+
+      int fd() const { return file ? file->fd() : -1; }
+
+      // the bytes of the range, false if the file is shorter or can not be read
+      bool read(std::string& data) const {
+        data.resize(length);
+
+        size_t done = 0;
+        while (done < length) {
+          ssize_t n = ::pread(fd(), &data[done], length - done, offset + done);
+          if (n < 0 && errno == EINTR) continue;
+          if (n <= 0) break;
+
+          done += n;
+        }
+
+        data.resize(done);
+        return done == length;
+      }
+
+      std::shared_ptr<file_handle> file;
+      off_t offset;
+      size_t length;
+    };
+
     struct __rpc_result {
       __rpc_result(const std::string& data = "", int ec = 0) : data(data), ec(ec) {}
 
-      __rpc_result(std::string&& data, int ec) : data(data), ec(ec) { }
+      __rpc_result(std::string&& data, int ec) : data(std::move(data)), ec(ec) { }
+
+      __rpc_result(const file_range& file, int ec) : ec(ec), file(file) {}
 
-      __rpc_result(const __rpc_result& other) : data(other.data), ec(other.ec) {}
+      __rpc_result(const __rpc_result& other) : data(other.data), ec(other.ec), file(other.file) {}
 
       std::string data;
       int ec;
+      // the data is in the file until it's read, see rpc_result::data
+      file_range file;
     };
 
     // the result of the function call to the remote side
@@ -51,7 +146,10 @@ namespace atlas {
 
       rpc_result(const std::string& data = "", int ec = 0) : _impl(new __rpc_result(data, ec)) { }
 
-      rpc_result(std::string&& data, int ec = 0) : _impl(new __rpc_result(data, ec)) { }
+      rpc_result(std::string&& data, int ec = 0) : _impl(new __rpc_result(std::move(data), ec)) { }
+
+      // the data is sent from the file range if the network layer can, see file_range
+      rpc_result(const file_range& file, int ec = 0) : _impl(new __rpc_result(file, ec)) { }
 
       rpc_result(const rpc_result& other) {
         if (other._impl) _impl.reset(new __rpc_result(*other._impl));
@@ -69,7 +167,7 @@ namespace atlas {
       rpc_result& operator=(rpc_result&& other) {
         if (std::addressof(other) == this) return *this;
 
-        _impl = other._impl;
+        _impl = std::move(other._impl);
         return *this;
       }
 
@@ -79,13 +177,35 @@ namespace atlas {
         _impl.reset(new __rpc_result(data, ec));
       }
 
+      void reset(std::string&& data, int ec) {
+        _impl.reset(new __rpc_result(std::move(data), ec));
+      }
+
       operator bool() const { return _impl.operator bool(); }
 
     public:
 
-      const std::string& data() const { return _impl->data; }
+      // the range of a file backed result is read once the data is asked for, the error is rpc_io_error if it
+      // can not be, so the data is taken before the error where both are
+      const std::string& data() const {
+        if (_impl->file) load();
+        return _impl->data;
+      }
+
       int err() const { return _impl->ec; }
 
+      // the range is not read yet
+      bool file_backed() const { return _impl && _impl->file; }
+
+      const file_range& file() const { return _impl->file; }
+
+    private:
+
+      void load() const {
+        if (!_impl->file.read(_impl->data)) _impl->ec = rpc_io_error;
+        _impl->file = file_range();
+      }
+
     private:
 
       std::shared_ptr<__rpc_result> _impl;
@@ -0,0 +1,216 @@
+/*
+ * result_cache.h
+ *
+ *  Created on: Sep 27, 2013
+ *      Author: vincent
+ */
+
+/*    Copyright 2011 ~ 2013 Vincent Zhang, ivincent.zhang@gmail.com
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#ifndef ATLAS_RPC_RESULT_CACHE_H_
+#define ATLAS_RPC_RESULT_CACHE_H_
+
+#include <atomic>
+#include <array>
+#include <chrono>
+#include <functional>
+#include <iterator>
+#include <list>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <boost/optional.hpp>
+
+#include <atlas/singleton.h>
+#include <atlas/rpc/result.h>
+
+namespace atlas {
+  namespace rpc {
+
+    /*
+     * The results of the pure functions, whose result depends on their arguments only, keyed by the function id
+     * and the serialized arguments, so a hit skips the deserialization and the handler. Opt in per function with
+     * a time to live, see ATLAS_RPC_CACHE, and the cache is off until it's given a capacity.
+     *
+     * The keys are hashed into shards, each a LRU list under it's own mutex, the least recently used entries are
+     * evicted once the shard takes more than it's share of the capacity, the expired ones once they are looked up.
+     * Only the successful results are cached
+     * */
+    class result_cache : public atlas::singleton<result_cache> {
+    public:
+
+      typedef std::chrono::steady_clock clock;
+
+      static const size_t shard_count = 16;
+
+    private:
+
+      struct entry {
+        std::string key;
+        std::string data;
+        clock::time_point expire;
+      };
+
+      typedef std::list<entry> lru_list;
+
+      struct shard {
+        shard() : bytes(0) {}
+
+        std::mutex mutex;
+        // the most recently used first
+        lru_list entries;
+        std::unordered_map<std::string, lru_list::iterator> index;
+        size_t bytes;
+      };
+
+    private:
+
+      friend class atlas::singleton<result_cache>;
+      result_cache(const result_cache&) = delete;
+      result_cache& operator=(const result_cache&) = delete;
+
+    public:
+
+      // public for std::make_shared, see atlas::singleton
+      result_cache() : _capacity(0), _hits(0), _misses(0), _evictions(0) {}
+
+    public:
+
+      // during the static initialization
+      void enable(int fn_id, std::chrono::milliseconds ttl) {
+        if (fn_id < 0 || fn_id >= max_fn_id) {
+          throw std::out_of_range("function id " + std::to_string(fn_id) + " is out of range");
+        }
+
+        if (static_cast<size_t>(fn_id) >= _ttls.size()) _ttls.resize(fn_id + 1, std::chrono::milliseconds::zero());
+        _ttls[fn_id] = ttl;
+      }
+
+      // in bytes, before any request comes, 0 turns it off
+      void set_capacity(size_t bytes) { _capacity = bytes; }
+
+      size_t capacity() const { return _capacity; }
+
+      bool enabled(int fn_id) const {
+        return _capacity && fn_id >= 0 && static_cast<size_t>(fn_id) < _ttls.size()
+            && _ttls[fn_id] != std::chrono::milliseconds::zero();
+      }
+
+      boost::optional<rpc_result> get(int fn_id, const char* args, size_t size) {
+        std::string k = key(fn_id, args, size);
+        shard& s = get_shard(k);
+
+        std::lock_guard<std::mutex> guard(s.mutex);
+
+        auto it = s.index.find(k);
+        if (it == s.index.end()) {
+          _misses.fetch_add(1, std::memory_order_relaxed);
+          return boost::none;
+        }
+
+        if (it->second->expire <= clock::now()) {
+          erase(s, it->second);
+          _misses.fetch_add(1, std::memory_order_relaxed);
+          return boost::none;
+        }
+
+        s.entries.splice(s.entries.begin(), s.entries, it->second);
+        _hits.fetch_add(1, std::memory_order_relaxed);
+
+        return rpc_result(it->second->data);
+      }
+
+      void put(int fn_id, const char* args, size_t size, const rpc_result& result) {
+        if (!result || result.err() != rpc_success) return;
+
+        std::string k = key(fn_id, args, size);
+        size_t bytes = footprint(k, result.data());
+        size_t limit = _capacity / shard_count;
+        if (bytes > limit) return;
+
+        shard& s = get_shard(k);
+
+        std::lock_guard<std::mutex> guard(s.mutex);
+
+        auto it = s.index.find(k);
+        if (it != s.index.end()) erase(s, it->second);
+
+        s.entries.push_front(entry { k, result.data(), clock::now() + _ttls[fn_id] });
+        s.index.emplace(std::move(k), s.entries.begin());
+        s.bytes += bytes;
+
+        while (s.bytes > limit) {
+          erase(s, std::prev(s.entries.end()));
+          _evictions.fetch_add(1, std::memory_order_relaxed);
+        }
+      }
+
+      unsigned long long hits() const { return _hits.load(std::memory_order_relaxed); }
+      unsigned long long misses() const { return _misses.load(std::memory_order_relaxed); }
+      unsigned long long evictions() const { return _evictions.load(std::memory_order_relaxed); }
+
+    private:
+
+      static const int max_fn_id = 64 * 1024;
+
+      static std::string key(int fn_id, const char* args, size_t size) {
+        std::string k(reinterpret_cast<const char*>(&fn_id), sizeof(fn_id));
+        k.append(args, size);
+        return k;
+      }
+
+      // the bytes of the key and the data, twice the key since the index keeps a copy, and the nodes
+      static size_t footprint(const std::string& key, const std::string& data) {
+        return 2 * key.size() + data.size() + sizeof(entry) + 64;
+      }
+
+      shard& get_shard(const std::string& key) {
+        return _shards[std::hash<std::string>()(key) % shard_count];
+      }
+
+      void erase(shard& s, lru_list::iterator it) {
+        s.bytes -= footprint(it->key, it->data);
+        s.index.erase(it->key);
+        s.entries.erase(it);
+      }
+
+    private:
+
+      size_t _capacity;
+      std::vector<std::chrono::milliseconds> _ttls;
+      std::array<shard, shard_count> _shards;
+
+      std::atomic<unsigned long long> _hits;
+      std::atomic<unsigned long long> _misses;
+      std::atomic<unsigned long long> _evictions;
+    };
+
+    struct fn_cache_binder {
+      fn_cache_binder(int fn_id, std::chrono::milliseconds ttl) { result_cache::ref().enable(fn_id, ttl); }
+    };
+
+  } // rpc
+} // atlas
+
+// cache the results of a pure remote function registered by ATLAS_REGISTER_REMOTE_FUNC for ttl_ms milliseconds,
+// must be placed in the namespace where the function id is registered, see result_cache
+#define ATLAS_RPC_CACHE(func_name, ttl_ms) \
+  static ::atlas::rpc::fn_cache_binder __atlas_fn_cache_##func_name(fn_ids::func_name, std::chrono::milliseconds(ttl_ms))
+
+#endif /* ATLAS_RPC_RESULT_CACHE_H_ */
@@ -23,14 +23,20 @@
 #ifndef ATLAS_RPC_RPC_H_
 #define ATLAS_RPC_RPC_H_
 
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <stdexcept>
 #include <string>
 #include <functional>
+#include <memory>
 #include <tuple>
+#include <vector>
 
 #include <boost/lexical_cast.hpp>
 
 #include <boost/uuid/uuid.hpp>
-#include <boost/uuid/random_generator.hpp>
 #include <boost/uuid/nil_generator.hpp>
 
 #ifdef ATLAS_DEBUG_RPC
@@ -38,18 +44,26 @@
 #include <boost/archive/text_iarchive.hpp>
 #include <boost/archive/text_oarchive.hpp>
 
-#else
+#endif
 
-#include <boost/archive/binary_iarchive.hpp>
-#include <boost/archive/binary_oarchive.hpp>
+// the size traits are used by the text archives too, see fn_encoder
+#include <atlas/serialization/fast_archive.h>
 
-#endif
+#include <boost/serialization/split_free.hpp>
+#include <boost/serialization/vector.hpp>
 
+#include <atlas/singleton.h>
 #include <atlas/serialization/tuple.h>
+#include <atlas/serialization/uuid.h>
 #include <atlas/apply_tuple.h>
+#include <atlas/io/memstream.h>
+#include <atlas/memory/pool_allocator.h>
 
+#include <atlas/rpc/cancellation.h>
+#include <atlas/rpc/endpoint.h>
 #include <atlas/rpc/message.h>
 #include <atlas/rpc/task.h>
+#include <atlas/rpc/trace.h>
 
 namespace atlas {
   namespace rpc {
@@ -57,8 +71,8 @@ namespace atlas {
     using std::string;
     using boost::uuids::uuid;
     using boost::uuids::nil_uuid;
-    using boost::uuids::random_generator;
 
+    // text archives are human readable, and used for debugging only
 #ifdef ATLAS_DEBUG_RPC
 
     typedef boost::archive::text_iarchive rpc_iarchive;
@@ -66,20 +80,77 @@ namespace atlas {
 
 #else
 
-    typedef boost::archive::binary_iarchive rpc_iarchive;
-    typedef boost::archive::binary_oarchive rpc_oarchive;
+    typedef atlas::serialization::fast_iarchive rpc_iarchive;
+    typedef atlas::serialization::fast_oarchive rpc_oarchive;
 
 #endif
 
+    /*
+     * The names of the function ids in a flat table indexed by id, as fn_table, filled by ATLAS_REGISTER_REMOTE_FUNC
+     * during the static initialization. The ids are picked by hand, an id registered under two names is a mistake
+     * the build can not see, it throws, so the process never starts with two functions answering one id
+     * */
+    class fn_names : public atlas::singleton<fn_names> {
+    public:
+
+      static const int min_fn_id = -64;
+      static const int max_fn_id = 64 * 1024;
+
+    public:
+
+      void add(int fn_id, const char* name) {
+        if (fn_id < min_fn_id || fn_id >= max_fn_id) {
+          throw std::out_of_range("function id " + std::to_string(fn_id) + " of " + name + " is out of range");
+        }
+
+        size_t index = fn_id - min_fn_id;
+        if (index >= _names.size()) _names.resize(index + 1, nullptr);
+
+        // a header registering the ids is included by many translation units
+        if (_names[index] && std::strcmp(_names[index], name) != 0) {
+          throw std::logic_error("function id " + std::to_string(fn_id) + " is registered as both "
+              + _names[index] + " and " + name);
+        }
+
+        _names[index] = name;
+      }
+
+      // nullptr if the id is not registered
+      const char* find(int fn_id) const {
+        size_t index = fn_id - min_fn_id;
+        if (fn_id < min_fn_id || index >= _names.size()) return nullptr;
+
+        return _names[index];
+      }
+
+      // every id registered and it's name, in the order of the ids
+      template<typename F>
+      void for_each(F f) const {
+        for (size_t i = 0; i < _names.size(); ++i) {
+          if (_names[i]) f(static_cast<int>(i) + min_fn_id, _names[i]);
+        }
+      }
+
+    private:
+
+      std::vector<const char*> _names;
+    };
+
+    struct fn_name_binder {
+      fn_name_binder(int fn_id, const char* name) { fn_names::ref().add(fn_id, name); }
+    };
+
 #define ATLAS_REGISTER_REMOTE_FUNC(func_name, func_id) namespace fn_ids { \
     static const int func_name = func_id; \
+    static ::atlas::rpc::fn_name_binder __atlas_fn_name_##func_name(func_id, #func_name); \
 };
 
     template<typename... T>
     class rf_wrapper;
 
     // this class is similar to atlas::serialization::function, except that the rf_wrapper takes an extra
-    // parameter when it de-serializes, which used to pass a local context to the function call before it executes
+    // parameter when it de-serializes, which used to pass a local context to the function call before it executes,
+    // the calls are encoded by fn_encoder and dispatched by fn_invoker, neither of which keeps a std::function
     template<typename Res, typename... Args>
     class rf_wrapper<Res(Args...)> {
     public:
@@ -137,58 +208,100 @@ namespace atlas {
       std::function<Res (Args...)> _f;
     };
 
+    /*
+     * Serialize the arguments of a call in place as the parameters of the function, the bytes are the ones of the
+     * tuple of the parameters which the callee decodes, see fn_invoker, but neither the tuple nor a std::function
+     * of the target is built, an argument is converted only if it's not of the parameter type
+     * */
+    template<typename Signature>
+    struct fn_encoder;
+
+    template<typename Res, typename... Params>
+    struct fn_encoder<Res(Params...)> {
+
+      // the bytes of the arguments if every one is of a fixed size, 0 if any is not, the frame is reserved
+      // once for it, see message_builder::build_to
+      static constexpr size_t size = all_of(serialization::has_fixed_size<typename std::decay<Params>::type>::value...)
+          ? sum_sizes(serialization::fixed_size<typename std::decay<Params>::type>::value...) : 0;
+
+      template<typename OArchiver, typename... Args>
+      static void encode(OArchiver& ar, Args&&... args) {
+        static_assert(sizeof...(Params) == sizeof...(Args), "the arguments do not match the parameters");
+
+        // in order, the braced list is evaluated from left to right
+        int expand[] = { 0, ((ar << static_cast<const typename std::decay<Params>::type&>(args)), 0)... };
+        (void) expand;
+      }
+    };
+
+    template<typename Res, typename... Params>
+    struct fn_encoder<Res(*)(Params...)> : fn_encoder<Res(Params...)> {};
+
+    class rpc_context;
+
+  } // rpc
+
+  namespace serialization {
+
+    // the context is not written, it's the callee's own, see fn_invoker
+    template<>
+    struct has_fixed_size<rpc::rpc_context> : public std::true_type {};
+
+    template<>
+    struct fixed_size<rpc::rpc_context> : public std::integral_constant<size_t, 0> {};
+
+  } // serialization
+
+  namespace rpc {
+
     struct __rpc_context {
 
-      __rpc_context() : client_id(0), rt(return_type::rpc_async_no_callback) {}
+      __rpc_context() : client_id(0), rt(return_type::rpc_async_no_callback), source(nil_endpoint), received(0) {}
 
-      __rpc_context(int client_id, int rt, const uuid& session_id, const std::string& source_ip_port) :
-        client_id(client_id), rt(rt), session_id(session_id), source_ip_port(source_ip_port)
+      __rpc_context(int client_id, int rt, const uuid& session_id, endpoint_id source, int64_t received = 0) :
+        client_id(client_id), rt(rt), session_id(session_id), source(source), received(received)
       {}
 
       __rpc_context(const __rpc_context& other)
-        : client_id(other.client_id), rt(other.rt), session_id(other.session_id), source_ip_port(other.source_ip_port)
+        : client_id(other.client_id), rt(other.rt), session_id(other.session_id), source(other.source),
+          received(other.received)
       {}
 
       int client_id;
       int rt;
       uuid session_id;
-      std::string source_ip_port;
+      endpoint_id source;
+      int64_t received;
     };
 
+    // the context is immutable once built, so copies share the same __rpc_context by reference count,
+    // it's copied several times for every request, so it's allocated from a pool
     class rpc_context {
     public:
 
       rpc_context(std::nullptr_t) {}
 
-      rpc_context() : _impl(new __rpc_context) {}
+      rpc_context() : _impl(memory::make_pooled<__rpc_context>()) {}
 
-      rpc_context(int client_id, int return_type, const uuid& session_id, const std::string& source_ip_port) :
-          _impl(new __rpc_context(client_id, return_type, session_id, source_ip_port)) {
+      rpc_context(int client_id, int return_type, const uuid& session_id, endpoint_id source, int64_t received = 0) :
+          _impl(memory::make_pooled<__rpc_context>(client_id, return_type, session_id, source, received)) {
       }
 
-      rpc_context(const rpc_context& other) : _impl(other._impl ? new __rpc_context(*other._impl)  : nullptr) {
-      }
+      rpc_context(const rpc_context& other) = default;
 
       rpc_context(rpc_context&& other) : _impl(std::move(other._impl)) {}
 
-      rpc_context operator=(const rpc_context& other) {
-        if (std::addressof(other) == this) return *this;
-
-        if (other._impl) _impl.reset(new __rpc_context(*other._impl));
-
-        return *this;
-      }
-
-      rpc_context operator=(rpc_context&& other) {
-        if (std::addressof(other) == this) return *this;
+      rpc_context& operator=(const rpc_context& other) = default;
 
-        if (other._impl) _impl = other._impl;
+      rpc_context& operator=(rpc_context&& other) {
+        _impl = std::move(other._impl);
 
         return *this;
       }
 
-      void reset(int client_id, int return_type, const uuid& session_id, const std::string& source_ip_port) {
-        _impl.reset(new __rpc_context(client_id, return_type, session_id, source_ip_port));
+      // never modify the shared context, build a new one
+      void reset(int client_id, int return_type, const uuid& session_id, endpoint_id source, int64_t received = 0) {
+        _impl = memory::make_pooled<__rpc_context>(client_id, return_type, session_id, source, received);
       }
 
       int client_id() const { return _impl->client_id; }
@@ -197,9 +310,25 @@ namespace atlas {
 
       const uuid& session_id() const { return _impl->session_id; }
 
-      std::string source_ip() const { return _impl->source_ip_port.substr(0, _impl->source_ip_port.find(":")); }
+      endpoint_id source() const { return _impl->source; }
+
+      // the time the request is received, by the kernel if it's stamped, in nanoseconds since the epoch,
+      // 0 if unknown, see message::received
+      int64_t received() const { return _impl->received; }
+
+      // nilctx, for a function called locally
+      bool empty() const { return !_impl; }
+
+      // for the work which outlives the handler, see cancellations
+      cancel_token get_cancel_token() const { return empty() ? cancel_token() : cancel_token(_impl->session_id); }
+
+      // the caller has cancelled the call, polled by a long running handler
+      bool cancelled() const { return !empty() && cancellations::ref().cancelled(_impl->session_id); }
 
-      const std::string& source_ip_port() const { return _impl->source_ip_port; }
+      // formatted on every call into an inplace string, use source() if possible
+      ip_string source_ip() const { return format_ip(endpoint_ip(_impl->source)); }
+
+      endpoint_string source_ip_port() const { return format_endpoint(_impl->source); }
 
     private:
 
@@ -219,15 +348,40 @@ namespace atlas {
       }
 
       static rpc_result resume_task(const uuid& sid, const rpc_result& result, const rpc_context& c) noexcept {
-        async_task_manager::ref().resume(sid, result.data(), result.err());
+        async_task_manager::ref().resume(sid, result.data(), result.err(), c.empty() ? nil_endpoint : c.source());
+
+        return nullptr;
+      }
+
+      // the responses of many sessions sent together, for example, the acks of a multicast call from a receiver
+      static rpc_result resume_task_batch(const std::vector<uuid>& sids, const std::vector<rpc_result>& results,
+          const rpc_context& c) noexcept {
+        endpoint_id source = c.empty() ? nil_endpoint : c.source();
+
+        for (size_t i = 0; i < sids.size() && i < results.size(); ++i) {
+          async_task_manager::ref().resume(sids[i], results[i].data(), results[i].err(), source);
+        }
 
         return nullptr;
       }
+
+      // the caller gives up the call, the request is dropped if it's not started, see cancellations
+      static rpc_result cancel_call(const uuid& sid, const rpc_context& c) noexcept {
+        cancellations::ref().cancel(sid);
+
+        return nullptr;
+      }
+
+      // the calls packed into one frame, see remote_caller::batch, run in one task, defined in dispatcher.h
+      static rpc_result call_batch(const std::string& frames, bool parallel, const rpc_context& c);
     };
 
     // builtin rpc
     ATLAS_REGISTER_REMOTE_FUNC(resume_thread, -1);
     ATLAS_REGISTER_REMOTE_FUNC(resume_task, -2);
+    ATLAS_REGISTER_REMOTE_FUNC(resume_task_batch, -4);
+    ATLAS_REGISTER_REMOTE_FUNC(call_batch, -8);
+    ATLAS_REGISTER_REMOTE_FUNC(cancel_call, -9);
 
   } // rpc
 } // atlas
@@ -253,15 +407,16 @@ namespace boost {
       ar >> data;
       ar >> err;
 
-      r.reset(data, err);
+      r.reset(std::move(data), err);
     }
 
+    // the data is written from the result, it's the largest part of a response, a file backed one is read first,
+    // which may fail it, see message_builder::build_around for the same layout
     template<class Archive>
     void save(Archive& ar, const atlas::rpc::rpc_result& r, const unsigned int) {
-      std::string data = r.data();
-      int err = r.err();
+      ar << r.data();
 
-      ar << data;
+      int err = r.err();
       ar << err;
     }
 
@@ -271,63 +426,252 @@ namespace boost {
 namespace atlas {
   namespace rpc {
 
+    /*
+     * A result of a value of any serializable type, the value is encoded once, right into the data of the result,
+     * instead of formatted to a string by the handler and parsed back by the caller, for example :
+     *
+     *  return typed_result(std::accumulate(numbers.begin(), numbers.end(), 0));
+     *
+     * The caller decodes it by result_cast or a typed_callback of the same type
+     * */
+    template<typename T>
+    rpc_result typed_result(const T& value, int ec = 0) {
+      std::string data;
+      {
+        io::oappendstream os(data);
+        rpc_oarchive oa(os);
+        oa << value;
+      }
+
+      return rpc_result(std::move(data), ec);
+    }
+
+    // decode the value of a typed result in place, false if the data is not a T
+    template<typename T>
+    bool result_cast(const std::string& data, T& value) {
+      try {
+        io::imemstream is(data.data(), data.size());
+        rpc_iarchive ia(is);
+        ia >> value;
+      }
+      catch (const std::exception&) {
+        return false;
+      }
+
+      return true;
+    }
+
+    template<typename T>
+    bool result_cast(const rpc_result& result, T& value) {
+      return result && !result.err() && result_cast(result.data(), value);
+    }
+
+    /*
+     * A callback of a call answered by a typed_result, the value is decoded once, before the callback is called.
+     * A failed call, or a data which is not a T, is given a T of it's default, and the error, rpc_bad_result for
+     * the later
+     * */
+    template<typename T>
+    rpc_callback_type typed_callback(std::function<void(const T&, int, async_task&)> cb) {
+      return [cb](const std::string& data, int err, async_task& task) {
+        T value = T();
+        if (!err && !result_cast(data, value)) err = rpc_bad_result;
+
+        cb(value, err, task);
+      };
+    }
+
     class message_builder {
     public:
 
-      message_builder(int client) : _client_id(client), _return_type(rpc_async_no_callback) {}
+      message_builder(int client) : _client_id(client), _return_type(rpc_async_no_callback), _priority(-1) {}
 
     public:
 
       const uuid& session_id() const { return _session_id; }
 
+      int client_id() const { return _client_id; }
+
+      return_type get_return_type() const { return _return_type; }
+
       void set_return_type(return_type rt) { _return_type = rt; }
 
+      // the priority of the frames built from now on, by their function ids if it's not set
+      void set_priority(message_priority priority) { _priority = priority; }
+
       template<typename Functor, typename ... Args>
       std::string build(Functor f, int fn_id, Args&&... args) {
-        typedef typename std::result_of<Functor(Args&&...)>::type result_type;
+        std::string message;
+        build_to(message, f, fn_id, std::forward<Args>(args)...);
 
-        _session_id = random_generator()();
-        request_header header = message::make_header(fn_id, _session_id);
-        header.client_id = _client_id;
-        header.return_type = _return_type;
+        return message;
+      }
 
-        std::ostringstream oss;
-        std::string header_str(reinterpret_cast<char*>(&header), sizeof(header));
+      // append an encoded frame to the buffer, frames appended one after another can be sent together
+      template<typename Functor, typename ... Args>
+      void build_to(std::string& buffer, Functor f, int fn_id, Args&&... args) {
+        request_header header = next_header(fn_id);
+
+        // the body is serialized right after the header, in the same buffer
+        size_t offset = buffer.size();
+        if (fn_encoder<Functor>::size) buffer.reserve(offset + sizeof(header) + fn_encoder<Functor>::size);
+        buffer.append(reinterpret_cast<char*>(&header), sizeof(header));
+
+        {
+          // the archive must be destroyed before the length is calculated, since some archives
+          // write a trailer in destructor
+          io::oappendstream os(buffer);
+          rpc_oarchive oa(os);
+          fn_encoder<Functor>::encode(oa, std::forward<Args>(args)...);
+        }
+
+        bool sealed = header.flags & message_checksummed;
+        if (sealed) buffer.append(message::checksum_size, '\0');
+
+        // the header may be unaligned in a batch
+        int32_t length = buffer.size() - offset;
+        std::memcpy(&buffer[offset] + offsetof(request_header, length), &length, sizeof(length));
+
+        // one pass over the frame just written, it's still in the cache
+        if (sealed) message::seal(&buffer[offset], length);
+      }
 
-        rpc_oarchive oa(oss);
-        rf_wrapper<result_type(Args...)> rpc(f, std::forward<Args>(args)..., oa);
+      /*
+       * The frame of resume_task or resume_thread with a result whose data is not in memory, see rpc_result::file,
+       * built around the data, the head is the header, the session id and the length of the data, the tail is the
+       * error code, the layout of save(rpc_result). The data is sent between them by the caller, see
+       * remote_caller::respond_file. False if the frame would be checksummed, which needs the data, or it's
+       * larger than a frame can be, or the archive is the text one
+       * */
+      bool build_around(int fn_id, const uuid& session_id, size_t size, int ec, std::string& head, std::string& tail) {
+#ifdef ATLAS_DEBUG_RPC
+        return false;
+#else
+        request_header header = next_header(fn_id);
+        if (header.flags & message_checksummed) return false;
+
+        head.assign(reinterpret_cast<char*>(&header), sizeof(header));
+        {
+          io::oappendstream os(head);
+          rpc_oarchive oa(os);
+          oa << session_id;
+          oa.save_varint(size);
+        }
+
+        {
+          io::oappendstream os(tail);
+          rpc_oarchive oa(os);
+          oa << ec;
+        }
+
+        uint64_t length = head.size() + size + tail.size();
+        if (length > static_cast<uint64_t>(std::numeric_limits<int32_t>::max())) return false;
+
+        int32_t l = static_cast<int32_t>(length);
+        std::memcpy(&head[0] + offsetof(request_header, length), &l, sizeof(l));
+
+        return true;
+#endif
+      }
 
-        std::string body = oss.str();
-        std::string message(header_str);
-        message += body;
+    private:
 
-        // std::cout << body;
+      request_header next_header(int fn_id) {
+        _session_id = message::next_session_id();
+        request_header header = message::make_header(fn_id, _session_id);
+        header.client_id = _client_id;
+        header.return_type = _return_type;
+        message::set_priority(header, _priority >= 0 ? static_cast<message_priority>(_priority) : default_priority(fn_id));
 
-        auto h = reinterpret_cast<request_header*>(const_cast<char*>(message.data()));
-        h->length = message.size();
+        // the call is a child span of the request the thread runs, see tracer
+        trace_context trace = tracer::instance().child(fn_id);
+        header.trace_id = trace.trace_id;
+        header.span_id = trace.span_id;
+        header.parent_span_id = trace.parent_span_id;
+        header.trace_flags = trace.flags;
 
-        return std::move(message);
+        return header;
+      }
+
+      // the builtin calls are control ones but the batches, which carry the data plane ones, see call_batch
+      static message_priority default_priority(int fn_id) {
+        return fn_id < 0 && fn_id != fn_ids::call_batch ? priority_control : priority_normal;
       }
 
     private:
 
       int _client_id;
       return_type _return_type;
+      int _priority;
       uuid _session_id;
     };
 
     // the user must create callers inherit from this, and implement the pure virtual function : send
     class remote_caller {
+    public:
+
+      // a batch is flushed automatically once it grows larger than this
+      static const size_t max_batch_size = 64 * 1024;
+
     public:
 
       remote_caller(int client = 0, int response_expected = 1) :
-        _message_builder(client), _response_expected(response_expected)
+        _message_builder(client), _response_expected(response_expected), _quorum(0), _timeout(default_rpc_timeout),
+        _batching(false), _packing(false), _parallel(false)
       {}
 
+      // the derived class is destroyed already, so the unflushed calls are lost
       virtual ~remote_caller() {}
 
     public:
 
+      // the deadline of every call made by this caller is the time it's made plus the timeout
+      void set_timeout(std::chrono::milliseconds timeout) { _timeout = timeout; }
+
+      // the calls made by this caller are of the priority, instead of the one of their function ids, see message_priority
+      void set_priority(message_priority priority) { _message_builder.set_priority(priority); }
+
+      std::chrono::milliseconds timeout() const { return _timeout; }
+
+      /*
+       * The calls with a callback made by this caller complete at the first quorum responses without an error,
+       * or call on_quorum there and wait for the rest, see async_task, 0 for every response
+       * */
+      void set_quorum(int quorum, quorum_callback_type on_quorum = nullptr) {
+        _quorum = quorum;
+        _on_quorum = on_quorum;
+      }
+
+      /*
+       * Calls made between begin_batch() and flush() are encoded one after another into one buffer,
+       * and flush() sends them with one send, so the target gets them in one write.
+       * The results of async_call are available only after the batch is flushed,
+       * never call sync_call in a batch, it waits for ever
+       * */
+      void begin_batch() { _batching = true; }
+
+      /*
+       * Like begin_batch(), but flush() packs the calls into one frame of the builtin call_batch, so the target
+       * runs them in one task, one after another, or in parallel if it's asked to and can, see
+       * dispatcher_manager::set_batch_executor, and answers them all with one response. The calls keep their own
+       * session ids, the response is split back into the results of each. A call whose handler responds later
+       * by itself, it returns nullptr, is answered apart. If the batch fails, every call in it which is not
+       * answered yet completes with the error
+       * */
+      void batch(bool parallel = false) {
+        _batching = true;
+        _packing = true;
+        _parallel = parallel;
+      }
+
+      void flush() {
+        _batching = false;
+        send_batch();
+        _packing = false;
+      }
+
+      bool batching() const { return _batching; }
+
       /*
        * 1) Serialize a remote function call with it's arguments,
        * 2) send the message to the target using the derived class's implementation
@@ -336,6 +680,11 @@ namespace atlas {
       void call(Functor f, int fn_id, Args ... args) {
         _message_builder.set_return_type(rpc_async_no_callback);
 
+        if (_batching) {
+          append_to_batch(f, fn_id, std::forward<Args>(args)...);
+          return;
+        }
+
         send(_message_builder.build(f, fn_id, std::forward<Args>(args)...));
       }
 
@@ -351,45 +700,270 @@ namespace atlas {
       void call(Functor f, int fn_id, rpc_callback_type cb, Args ... args) {
         _message_builder.set_return_type(rpc_async_callback);
 
+        if (_batching) {
+          append_to_batch(f, fn_id, std::forward<Args>(args)...);
+          async_task_manager::ref().suspend(_message_builder.session_id(), cb, _response_expected, _timeout, _quorum,
+              _on_quorum);
+          return;
+        }
+
         std::string message = _message_builder.build(f, fn_id, std::forward<Args>(args)...);
-        async_task_manager::ref().suspend(_message_builder.session_id(), cb, _response_expected);
+        async_task_manager::ref().suspend(_message_builder.session_id(), cb, _response_expected, _timeout, _quorum,
+            _on_quorum);
 
-        send(message);
+        send(std::move(message));
       }
 
       /*
-       * The remote_caller thread will be blocked to wait for the result
+       * 1) serialize a remote function call with arguments,
+       * 2) register a future to wait for the result
+       * 3) send the message to the target using the derived class's implementation
+       * 4) the server issues a resume_thread function call and the future gets the result,
+       *    any attached continuation runs in the thread executes resume_thread
+       *
+       * The calling thread is never blocked, it's safe to call it inside a RPC handler
        * */
       template<typename Functor, typename ... Args>
-      rpc_result sync_call(Functor f, int fn_id, Args ... args) {
-        typedef typename std::result_of<Functor(Args...)>::type result_type;
+      rpc_future async_call(Functor f, int fn_id, Args ... args) {
         _message_builder.set_return_type(rpc_sync);
 
+        if (_batching) {
+          append_to_batch(f, fn_id, std::forward<Args>(args)...);
+          return sync_task_manager::ref().suspend(_message_builder.session_id(), _timeout);
+        }
+
+        std::string message = _message_builder.build(f, fn_id, std::forward<Args>(args)...);
+        rpc_future future = sync_task_manager::ref().suspend(_message_builder.session_id(), _timeout);
+
+        send(std::move(message));
+
+        return future;
+      }
+
+      /*
+       * A call which streams, the session id of the call is the id of the stream, open is called with it after
+       * the message is built and before it's sent, so the stream is registered before a chunk of the callee
+       * can arrive. The callee may still respond as to async_call, a shed call is answered with rpc_busy.
+       * Never call it in a batch
+       * */
+      template<typename Functor, typename ... Args>
+      void stream_call(Functor f, int fn_id, std::function<void(const uuid&)> open, Args ... args) {
+        _message_builder.set_return_type(rpc_stream);
+
         std::string message = _message_builder.build(f, fn_id, std::forward<Args>(args)...);
-        rpc_result rr = sync_task_manager::ref().suspend(_message_builder.session_id());
+        open(_message_builder.session_id());
+
+        send(std::move(message));
+      }
+
+      /*
+       * Send a whole frame built before, a captured one for example, as a call with a callback made by this caller.
+       * The function, the arguments and the priority are the frame's own, the session id, the client and the flags
+       * are this caller's, the trace it was in is left. Never call it in a batch.
+       *
+       * A checksummed frame is sealed again, but a compressed one, whose checksum is in it's compressed body, it
+       * loses the flag, and it's run with the checksum left at the end of it's body, unchecked
+       * */
+      void replay(std::string frame, rpc_callback_type cb) {
+        request_header h;
+        std::memcpy(&h, frame.data(), sizeof(h));
+
+        request_header own = message::make_header(h.fn_id, message::next_session_id());
+        own.length = h.length;
+        own.return_type = rpc_async_callback;
+        own.client_id = _message_builder.client_id();
+        own.flags &= ~message_checksummed;
+        own.flags |= h.flags & ~(message_accepts_compression | message_accepts_chunks);
+        if (own.flags & message_compressed) own.flags &= ~message_checksummed;
+        std::memcpy(&frame[0], &own, sizeof(own));
+
+        if (own.flags & message_checksummed) message::seal(&frame[0], frame.size());
+
+        async_task_manager::ref().suspend(own.session_id, cb, _response_expected, _timeout, _quorum, _on_quorum);
+
+        send(std::move(frame));
+      }
+
+      /*
+       * Respond a file backed result, see rpc_result::file, by resume_task or resume_thread, the frame is built
+       * around the range, which the derived class sends from the file, see send_file. False if it can not, the
+       * caller calls as for any other result then, the range is read into memory. Never call it in a batch
+       * */
+      bool respond_file(int fn_id, const uuid& session_id, const rpc_result& result) {
+        if (_batching || !result.file_backed()) return false;
 
-        send(message);
+        _message_builder.set_return_type(rpc_async_no_callback);
+
+        std::string head, tail;
+        const file_range& file = result.file();
+        if (!_message_builder.build_around(fn_id, session_id, file.length, result.err(), head, tail)) return false;
+
+        return send_file(std::move(head), file, std::move(tail));
+      }
+
+      // the session id of the last call made, to cancel it later
+      const uuid& last_session_id() const { return _message_builder.session_id(); }
+
+      /*
+       * Give up a call made by this caller, it completes with rpc_cancelled at once, and the targets are asked
+       * to drop it, or to stop it if the handler polls it's context, see rpc_context::cancelled. The targets
+       * are the ones this caller sends to, so a multicast caller stops an abandoned fan-out on every node
+       * */
+      void cancel(const uuid& session_id) {
+        sync_task_manager::ref().resume(session_id, "", rpc_cancelled);
+        async_task_manager::ref().cancel(session_id, rpc_cancelled);
+
+        call(builtin_rfc::cancel_call, fn_ids::cancel_call, session_id, nilctx);
+      }
 
-        return std::move(rr);
+      /*
+       * The remote_caller thread will be blocked to wait for the result,
+       * never call it in a worker thread or an I/O thread, use async_call instead
+       * */
+      template<typename Functor, typename ... Args>
+      rpc_result sync_call(Functor f, int fn_id, Args ... args) {
+        return async_call(f, fn_id, std::forward<Args>(args)...).get();
       }
 
     protected:
 
+      // the batch is sent before the call is appended once it's full, so every call in it is registered already
+      template<typename Functor, typename ... Args>
+      void append_to_batch(Functor f, int fn_id, Args&&... args) {
+        if (_batch.size() >= max_batch_size) send_batch();
+
+        _message_builder.build_to(_batch, f, fn_id, std::forward<Args>(args)...);
+        if (_packing) _packed.push_back(packed_call { _message_builder.session_id(), _message_builder.get_return_type() });
+      }
+
+      void send_batch() {
+        if (_batch.empty()) return;
+
+        std::string batch;
+        batch.swap(_batch);
+
+        if (!_packing) {
+          send(std::move(batch));
+          return;
+        }
+
+        std::vector<packed_call> calls;
+        calls.swap(_packed);
+
+        _message_builder.set_return_type(rpc_async_callback);
+        std::string message = _message_builder.build(builtin_rfc::call_batch, fn_ids::call_batch, batch, _parallel, nilctx);
+        async_task_manager::ref().suspend(_message_builder.session_id(), unpack(std::move(calls)), 1, _timeout);
+
+        send(std::move(message));
+      }
+
       void send(const std::string& message) {
         send(message.data(), message.size());
       }
 
-      // override this function to optimize at network layer
+      // the message is built for this send only, override it to hand the message over to the network layer
+      // without a copy, see p2p_client
       virtual void send(std::string&& message) {
         send(message.data(), message.size());
       }
 
       virtual void send(const char* message, size_t size) = 0;
 
+      // the frame of respond_file, the range goes between the head and the tail, false if nothing is sent,
+      // override it if the transport can send from a file
+      virtual bool send_file(std::string&& head, const file_range& file, std::string&& tail) { return false; }
+
+      // the derived class calls it if the message can not be sent, every call in the message, which may be
+      // a batch, completes with the error immediately instead of waiting for the timeout
+      void reject(const char* message, size_t size, int err_code) {
+        while (size >= sizeof(request_header)) {
+          int32_t length = 0;
+          std::memcpy(&length, message + offsetof(request_header, length), sizeof(length));
+          if (length < static_cast<int32_t>(sizeof(request_header)) || static_cast<size_t>(length) > size) break;
+
+          uuid session_id;
+          std::memcpy(&session_id, message + offsetof(request_header, session_id), sizeof(session_id));
+
+          uint8_t rt = 0;
+          std::memcpy(&rt, message + offsetof(request_header, return_type), sizeof(rt));
+
+          if (rt == rpc_sync) sync_task_manager::ref().resume(session_id, "", err_code);
+          else if (rt == rpc_async_callback) async_task_manager::ref().cancel(session_id, err_code);
+
+          message += length;
+          size -= length;
+        }
+      }
+
+    private:
+
+      struct packed_call {
+        uuid session_id;
+        return_type rt;
+      };
+
+      // the response of a packed batch, the sessions answered and their results, in the order of the calls
+      static rpc_callback_type unpack(std::vector<packed_call>&& calls) {
+        std::shared_ptr<std::vector<packed_call>> packed = std::make_shared<std::vector<packed_call>>(std::move(calls));
+
+        return [packed](const std::string& data, int err, async_task& task) {
+          std::vector<uuid> sids;
+          std::vector<rpc_result> results;
+
+          if (!err) {
+            io::imemstream is(data.data(), data.size());
+            rpc_iarchive ia(is);
+            ia >> sids >> results;
+          }
+
+          size_t answered = 0;
+          for (const packed_call& call : *packed) {
+            bool found = answered < sids.size() && answered < results.size() && sids[answered] == call.session_id;
+            const rpc_result* r = found ? &results[answered++] : nullptr;
+
+            if (call.rt == rpc_sync) {
+              if (r) sync_task_manager::ref().resume(call.session_id, r->data(), r->err());
+              else if (err) sync_task_manager::ref().resume(call.session_id, "", err);
+            }
+            else if (call.rt == rpc_async_callback) {
+              if (r) async_task_manager::ref().resume(call.session_id, r->data(), r->err());
+              else if (err) async_task_manager::ref().cancel(call.session_id, err);
+            }
+          }
+        };
+      }
+
     private:
 
       message_builder _message_builder;
       int _response_expected;
+      int _quorum;
+      quorum_callback_type _on_quorum;
+      std::chrono::milliseconds _timeout;
+
+      bool _batching;
+      std::string _batch;
+
+      // packs the batch into one frame, see batch()
+      bool _packing;
+      bool _parallel;
+      std::vector<packed_call> _packed;
+    };
+
+    // send the calls made in a scope in one batch
+    class batch_scope {
+    public:
+
+      batch_scope(remote_caller& caller) : _caller(caller) { _caller.begin_batch(); }
+
+      ~batch_scope() { _caller.flush(); }
+
+      batch_scope(const batch_scope&) = delete;
+      batch_scope& operator=(const batch_scope&) = delete;
+
+    private:
+
+      remote_caller& _caller;
     };
 
 
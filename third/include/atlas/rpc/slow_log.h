@@ -0,0 +1,190 @@
+/*
+ * slow_log.h
+ *
+ *  Created on: Sep 6, 2013
+ *      Author: vincent
+ */
+
+/*    Copyright 2011 ~ 2013 Vincent Zhang, ivincent.zhang@gmail.com
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#ifndef ATLAS_RPC_SLOW_LOG_H_
+#define ATLAS_RPC_SLOW_LOG_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <atlas/fast_random.h>
+#include <atlas/rpc/endpoint.h>
+#include <atlas/rpc/message.h>
+#include <atlas/rpc/stats.h>
+
+namespace atlas {
+  namespace rpc {
+
+    // a request slower than the threshold, see slow_request_log
+    struct slow_request {
+      int32_t fn_id;
+      uuid session_id;
+      endpoint_id source;
+      int64_t time;                                   // the end, in microseconds since epoch
+      std::array<uint64_t, rpc_stage_count> stages;   // in nanoseconds, see rpc_stage
+      std::string arguments;                          // the head of the serialized body, if captured
+    };
+
+    /*
+     * The requests whose deserialization and handler take longer than the threshold, the latest capacity of them
+     * are kept for the report server, like the slow log of redis.
+     *
+     * The latencies are the ones rpc_stats measures for the request, so a request costs one more comparison only,
+     * the mutex is taken by the slow ones. The head of the arguments is copied for a part of the slow requests, see
+     * set_capture, to catch the inputs which make a function slow, without copying every one
+     * */
+    class slow_request_log {
+    public:
+
+      static const size_t default_capacity = 256;
+
+    private:
+
+      slow_request_log() : _threshold(UINT64_MAX), _capture_bytes(0), _capture_threshold(0), _capacity(default_capacity),
+          _next(0), _total(0) {}
+
+      slow_request_log(const slow_request_log&) = delete;
+      slow_request_log& operator=(const slow_request_log&) = delete;
+
+    public:
+
+      static slow_request_log& instance() {
+        static slow_request_log log;
+        return log;
+      }
+
+    public:
+
+      // 0 logs every request, the log is disabled until the threshold is set
+      void set_threshold(std::chrono::nanoseconds threshold) {
+        _threshold.store(threshold.count() > 0 ? threshold.count() : 0, std::memory_order_relaxed);
+      }
+
+      // UINT64_MAX nanoseconds while disabled
+      std::chrono::nanoseconds threshold() const {
+        return std::chrono::nanoseconds(_threshold.load(std::memory_order_relaxed));
+      }
+
+      // copy at most bytes of the arguments of the part rate of the slow requests, 0 bytes disables it
+      void set_capture(size_t bytes, double rate) {
+        uint64_t threshold = 0;
+        if (rate >= 1) threshold = UINT64_MAX;
+        else if (rate > 0) threshold = static_cast<uint64_t>(rate * 18446744073709551616.0);
+
+        _capture_bytes.store(bytes, std::memory_order_relaxed);
+        _capture_threshold.store(threshold, std::memory_order_relaxed);
+      }
+
+      void set_capacity(size_t capacity) {
+        std::lock_guard<std::mutex> guard(_mutex);
+
+        std::vector<slow_request> requests = collect_unlocked();
+        if (capacity == 0) capacity = 1;
+        if (requests.size() > capacity) requests.erase(requests.begin(), requests.end() - capacity);
+
+        _capacity = capacity;
+        _requests.swap(requests);
+        _next = _requests.size() % _capacity;
+      }
+
+      /*
+       * Called once the request is done and responded, by the thread which ran it, the latencies of the request
+       * are taken from rpc_stats, and cleared for the next one
+       * */
+      void check(const message& msg, endpoint_id source) {
+        uint64_t exec = rpc_stats::last(stage_deserialize) + rpc_stats::last(stage_handler);
+
+        if (exec >= _threshold.load(std::memory_order_relaxed)) add(msg, source);
+
+        rpc_stats::clear_last();
+      }
+
+      // the oldest first
+      std::vector<slow_request> collect() const {
+        std::lock_guard<std::mutex> guard(_mutex);
+        return collect_unlocked();
+      }
+
+      // the slow requests ever seen, including the ones overwritten
+      unsigned long long total() const { return _total.load(std::memory_order_relaxed); }
+
+    private:
+
+      void add(const message& msg, endpoint_id source) {
+        slow_request r;
+        r.fn_id = msg.header()->fn_id;
+        r.session_id = msg.header()->session_id;
+        r.source = source;
+        r.time = std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+        for (int s = 0; s < rpc_stage_count; ++s) r.stages[s] = rpc_stats::last(static_cast<rpc_stage>(s));
+
+        size_t bytes = _capture_bytes.load(std::memory_order_relaxed);
+        if (bytes > 0 && fast_random() < _capture_threshold.load(std::memory_order_relaxed)) {
+          r.arguments.assign(msg.body(), std::min(bytes, msg.body_size()));
+        }
+
+        _total.fetch_add(1, std::memory_order_relaxed);
+
+        std::lock_guard<std::mutex> guard(_mutex);
+
+        if (_requests.size() < _capacity) _requests.push_back(std::move(r));
+        else _requests[_next] = std::move(r);
+        _next = (_next + 1) % _capacity;
+      }
+
+      std::vector<slow_request> collect_unlocked() const {
+        std::vector<slow_request> requests;
+        requests.reserve(_requests.size());
+
+        // the oldest is the next to overwrite once the ring is full
+        size_t start = _requests.size() < _capacity ? 0 : _next;
+        for (size_t i = 0; i < _requests.size(); ++i) requests.push_back(_requests[(start + i) % _requests.size()]);
+
+        return requests;
+      }
+
+    private:
+
+      std::atomic<uint64_t> _threshold;
+      std::atomic<size_t> _capture_bytes;
+      std::atomic<uint64_t> _capture_threshold;
+
+      mutable std::mutex _mutex;
+      size_t _capacity;
+      std::vector<slow_request> _requests;
+      size_t _next;
+
+      std::atomic<unsigned long long> _total;
+    };
+
+  } // rpc
+} // atlas
+
+#endif /* ATLAS_RPC_SLOW_LOG_H_ */
@@ -0,0 +1,387 @@
+/*
+ * stats.h
+ *
+ *  Created on: Sep 6, 2013
+ *      Author: vincent
+ */
+
+/*    Copyright 2011 ~ 2013 Vincent Zhang, ivincent.zhang@gmail.com
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#ifndef ATLAS_RPC_STATS_H_
+#define ATLAS_RPC_STATS_H_
+
+#include <pthread.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <vector>
+
+namespace atlas {
+  namespace rpc {
+
+    // the stages of a request, see rpc_stats
+    enum rpc_stage {
+      stage_receive = 0,    // from the kernel's receive stamp to the dispatch by the I/O loop, if it's stamped
+      stage_queue_wait,     // from the dispatch to the worker
+      stage_deserialize,    // the arguments
+      stage_handler,        // the function
+      stage_respond,        // the response sent, or batched
+      rpc_stage_count
+    };
+
+    inline const char* stage_name(int stage) {
+      static const char* names[] = { "receive", "queue wait", "deserialize", "handler", "respond" };
+      return (stage >= 0 && stage < rpc_stage_count) ? names[stage] : "unknown";
+    }
+
+    /*
+     * A log-linear histogram of the latencies in nanoseconds, like HdrHistogram, every power of 2 is split
+     * into sub_buckets linear buckets, so a value is off by 1/sub_buckets at most, 12.5%, and the buckets are
+     * fixed, so the histograms of the threads are merged by adding the counts.
+     *
+     * The values up to 2^max_exponent ns, about 18 minutes, are counted, the larger ones in the last bucket
+     * */
+    struct latency_histogram {
+      static const int sub_bucket_bits = 3;
+      static const uint64_t sub_buckets = 1 << sub_bucket_bits;
+      static const int max_exponent = 40;
+      static const size_t bucket_count = sub_buckets + (max_exponent - sub_bucket_bits) * sub_buckets;
+
+      latency_histogram() : total(0), sum(0), max(0) { counts.fill(0); }
+
+      static size_t index(uint64_t v) {
+        if (v < sub_buckets) return v;
+
+        int e = 63 - __builtin_clzll(v);
+        if (e >= max_exponent) return bucket_count - 1;
+
+        return sub_buckets + (e - sub_bucket_bits) * sub_buckets + ((v >> (e - sub_bucket_bits)) & (sub_buckets - 1));
+      }
+
+      // the largest value counted in the bucket
+      static uint64_t upper_bound(size_t i) {
+        if (i < sub_buckets) return i;
+
+        int e = (i - sub_buckets) / sub_buckets + sub_bucket_bits;
+        uint64_t sub = (i - sub_buckets) % sub_buckets;
+        uint64_t width = uint64_t(1) << (e - sub_bucket_bits);
+
+        return (sub_buckets + sub) * width + width - 1;
+      }
+
+      void add(const latency_histogram& other) {
+        for (size_t i = 0; i < bucket_count; ++i) counts[i] += other.counts[i];
+        total += other.total;
+        sum += other.sum;
+        if (other.max > max) max = other.max;
+      }
+
+      // the value q of the recorded ones are less or equal to, for example 0.99
+      uint64_t percentile(double q) const {
+        if (total == 0) return 0;
+
+        uint64_t rank = static_cast<uint64_t>(q * total);
+        if (rank >= total) rank = total - 1;
+
+        uint64_t seen = 0;
+        for (size_t i = 0; i < bucket_count; ++i) {
+          seen += counts[i];
+          if (seen > rank) return std::min(upper_bound(i), max);
+        }
+
+        return max;
+      }
+
+      uint64_t mean() const { return total ? sum / total : 0; }
+
+      std::array<uint64_t, bucket_count> counts;
+      uint64_t total;
+      uint64_t sum;
+      uint64_t max;
+    };
+
+    // the latencies of all the stages of a function
+    struct fn_latency {
+      std::array<latency_histogram, rpc_stage_count> stages;
+    };
+
+    /*
+     * The latency of every stage of the requests, per function id, it's recorded by every thread into it's own
+     * histograms, without any lock or atomic read-modify-write, since the only writer of a counter is the owner,
+     * and collect() sums the histograms of all the threads on demand, for the status page.
+     *
+     * The histograms of a thread are allocated once it records a function, and are added to the retired ones
+     * when it exits, so the threads of an adaptive pool can come and go.
+     *
+     * We use __thread since gcc 4.7 does not support thread_local
+     * */
+    class rpc_stats {
+    public:
+
+      typedef std::chrono::steady_clock clock;
+
+      // the function ids, see fn_table
+      static const int min_fn_id = -64;
+      static const int max_fn_id = 64 * 1024;
+
+    private:
+
+      static const size_t page_size = 256;
+      static const size_t page_count = (max_fn_id - min_fn_id + page_size - 1) / page_size;
+
+      // the owner writes with relaxed stores, the collector reads with relaxed loads
+      struct local_histogram {
+        local_histogram() : total(0), sum(0), max(0) {
+          for (std::atomic<uint64_t>& c : counts) c.store(0, std::memory_order_relaxed);
+        }
+
+        static void increase(std::atomic<uint64_t>& c, uint64_t n) {
+          c.store(c.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+        }
+
+        void record(uint64_t ns) {
+          increase(counts[latency_histogram::index(ns)], 1);
+          increase(total, 1);
+          increase(sum, ns);
+          if (ns > max.load(std::memory_order_relaxed)) max.store(ns, std::memory_order_relaxed);
+        }
+
+        void copy_to(latency_histogram& h) const {
+          for (size_t i = 0; i < latency_histogram::bucket_count; ++i) {
+            h.counts[i] += counts[i].load(std::memory_order_relaxed);
+          }
+          h.total += total.load(std::memory_order_relaxed);
+          h.sum += sum.load(std::memory_order_relaxed);
+          h.max = std::max(h.max, max.load(std::memory_order_relaxed));
+        }
+
+        std::array<std::atomic<uint64_t>, latency_histogram::bucket_count> counts;
+        std::atomic<uint64_t> total;
+        std::atomic<uint64_t> sum;
+        std::atomic<uint64_t> max;
+      };
+
+      struct local_latency {
+        std::array<local_histogram, rpc_stage_count> stages;
+      };
+
+      struct page {
+        page() {
+          for (std::atomic<local_latency*>& l : fns) l.store(nullptr, std::memory_order_relaxed);
+        }
+
+        ~page() {
+          for (std::atomic<local_latency*>& l : fns) delete l.load(std::memory_order_relaxed);
+        }
+
+        std::atomic<local_latency*> fns[page_size];
+      };
+
+      struct recorder {
+        recorder() {
+          for (std::atomic<page*>& p : pages) p.store(nullptr, std::memory_order_relaxed);
+          for (uint64_t& l : last) l = 0;
+        }
+
+        ~recorder() {
+          for (std::atomic<page*>& p : pages) delete p.load(std::memory_order_relaxed);
+        }
+
+        std::atomic<page*> pages[page_count];
+
+        // the start of the current request and the end of it's deserialization, see timer
+        clock::rep started;
+        clock::rep deserialized;
+
+        // the latencies of the current request in nanoseconds, the owner only, see last()
+        uint64_t last[rpc_stage_count];
+      };
+
+      rpc_stats() {
+        ::pthread_key_create(&_exit_key, &rpc_stats::on_thread_exit);
+      }
+
+      rpc_stats(const rpc_stats&) = delete;
+      rpc_stats& operator=(const rpc_stats&) = delete;
+
+    public:
+
+      static rpc_stats& instance() {
+        static rpc_stats stats;
+        return stats;
+      }
+
+    public:
+
+      void record(int fn_id, rpc_stage stage, clock::duration d) {
+        if (fn_id < min_fn_id || fn_id >= max_fn_id) return;
+
+        int64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(d).count();
+        recorder& r = local();
+        r.last[stage] = ns > 0 ? ns : 0;
+        histogram(r, fn_id, stage).record(r.last[stage]);
+      }
+
+      // the latency of the stage of the request the calling thread runs, or ran last, in nanoseconds
+      static uint64_t last(rpc_stage stage) { return instance().local().last[stage]; }
+
+      // forget the latencies of the request, it's done
+      static void clear_last() {
+        recorder& r = instance().local();
+        for (uint64_t& l : r.last) l = 0;
+      }
+
+      // the latencies of all the functions ever called, summed over all the threads
+      std::map<int, fn_latency> collect() const {
+        std::lock_guard<std::mutex> guard(_mutex);
+
+        std::map<int, fn_latency> result(_retired);
+        for (const recorder* r : _recorders) collect(*r, result);
+
+        return result;
+      }
+
+      /*
+       * Time the deserialization and the handler of a request, the invoker marks the end of the deserialization,
+       * see mark_deserialized, a request dispatched to a custom dispatcher has the handler time only
+       * */
+      class timer {
+      public:
+
+        explicit timer(int fn_id) : _fn_id(fn_id), _recorder(rpc_stats::instance().local()) {
+          _recorder.started = _recorder.deserialized = clock::now().time_since_epoch().count();
+          // the receive and the queue wait are recorded before
+          _recorder.last[stage_deserialize] = _recorder.last[stage_handler] = _recorder.last[stage_respond] = 0;
+        }
+
+        void finish() {
+          clock::rep now = clock::now().time_since_epoch().count();
+
+          _recorder.last[stage_deserialize] = nanoseconds(_recorder.deserialized - _recorder.started);
+          _recorder.last[stage_handler] = nanoseconds(now - _recorder.deserialized);
+
+          rpc_stats& stats = rpc_stats::instance();
+          stats.histogram(_recorder, _fn_id, stage_deserialize).record(_recorder.last[stage_deserialize]);
+          stats.histogram(_recorder, _fn_id, stage_handler).record(_recorder.last[stage_handler]);
+        }
+
+      private:
+
+        int _fn_id;
+        recorder& _recorder;
+      };
+
+      static void mark_deserialized() {
+        instance().local().deserialized = clock::now().time_since_epoch().count();
+      }
+
+    private:
+
+      static uint64_t nanoseconds(clock::rep ticks) {
+        if (ticks <= 0) return 0;
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(clock::duration(ticks)).count();
+      }
+
+      local_histogram& histogram(recorder& r, int fn_id, rpc_stage stage) {
+        size_t index = fn_id - min_fn_id;
+
+        std::atomic<page*>& slot = r.pages[index / page_size];
+        page* p = slot.load(std::memory_order_relaxed);
+        if (!p) {
+          p = new page;
+          slot.store(p, std::memory_order_release);
+        }
+
+        std::atomic<local_latency*>& fn = p->fns[index % page_size];
+        local_latency* l = fn.load(std::memory_order_relaxed);
+        if (!l) {
+          l = new local_latency;
+          fn.store(l, std::memory_order_release);
+        }
+
+        return l->stages[stage];
+      }
+
+      recorder& local() {
+        static __thread recorder* r = nullptr;
+        if (!r) {
+          r = new recorder;
+
+          std::lock_guard<std::mutex> guard(_mutex);
+          _recorders.push_back(r);
+          ::pthread_setspecific(_exit_key, r);
+        }
+
+        return *r;
+      }
+
+      // the mutex is held, or the recorder's thread is gone
+      static void collect(const recorder& r, std::map<int, fn_latency>& result) {
+        for (size_t i = 0; i < page_count; ++i) {
+          const page* p = r.pages[i].load(std::memory_order_acquire);
+          if (!p) continue;
+
+          for (size_t j = 0; j < page_size; ++j) {
+            const local_latency* l = p->fns[j].load(std::memory_order_acquire);
+            if (!l) continue;
+
+            fn_latency& sum = result[int(i * page_size + j) + min_fn_id];
+            for (int s = 0; s < rpc_stage_count; ++s) l->stages[s].copy_to(sum.stages[s]);
+          }
+        }
+      }
+
+      static void on_thread_exit(void* p) {
+        recorder* r = static_cast<recorder*>(p);
+        rpc_stats& stats = instance();
+
+        {
+          std::lock_guard<std::mutex> guard(stats._mutex);
+
+          for (size_t i = 0; i < stats._recorders.size(); ++i) {
+            if (stats._recorders[i] == r) {
+              stats._recorders[i] = stats._recorders.back();
+              stats._recorders.pop_back();
+              break;
+            }
+          }
+
+          collect(*r, stats._retired);
+        }
+
+        delete r;
+      }
+
+    private:
+
+      pthread_key_t _exit_key;
+
+      mutable std::mutex _mutex;
+      std::vector<recorder*> _recorders;
+      // the histograms of the exited threads
+      std::map<int, fn_latency> _retired;
+    };
+
+  } // rpc
+} // atlas
+
+#endif /* ATLAS_RPC_STATS_H_ */
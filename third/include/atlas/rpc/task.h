@@ -26,12 +26,20 @@
 #include <map>
 #include <string>
 #include <mutex>
+#include <atomic>
 #include <functional>
-#include <future>
+#include <chrono>
 
 #include <boost/uuid/uuid.hpp>
 
+#include <atlas/futex.h>
 #include <atlas/singleton.h>
+#include <atlas/container/sharded_concurrent_box.h>
+#include <atlas/container/small_vector.h>
+#include <atlas/memory/pool_allocator.h>
+#include <atlas/container/timer_wheel.h>
+#include <atlas/serialization/uuid.h>
+#include <atlas/rpc/endpoint.h>
 #include <atlas/rpc/result.h>
 
 namespace atlas {
@@ -41,21 +49,35 @@ namespace atlas {
 
     class async_task;
     typedef std::function<void(const std::string&, int, async_task& task)> rpc_callback_type;
+    // called once a quorum of the responses succeeds, or can not succeed any more, see async_task::quorum_reached
+    typedef std::function<void(async_task& task)> quorum_callback_type;
+    // the responses kept by a task, a multicast one gets a few
+    typedef atlas::small_vector<std::string, 4> data_list_type;
 
     struct __async_task {
 
-      __async_task(rpc_callback_type cb = nullptr, int response_received = 1, int response_expected = 0)
-        : cb(cb), response_received(response_received), response_expected(response_expected), record_count(0) {}
+      __async_task(rpc_callback_type cb = nullptr, int response_received = 0, int response_expected = 1,
+          int quorum = 0, quorum_callback_type on_quorum = nullptr)
+        : cb(cb), response_received(response_received), response_expected(response_expected), response_failed(0),
+          quorum(quorum), on_quorum(on_quorum), quorum_notified(false), record_count(0), cancelled(false) {}
 
       __async_task(const __async_task& d)
         : cb(d.cb), response_received(d.response_received), response_expected(d.response_expected),
-          record_count(0), data_list(d.data_list) {}
+          response_failed(d.response_failed), quorum(d.quorum), on_quorum(d.on_quorum),
+          quorum_notified(d.quorum_notified), record_count(0), cancelled(d.cancelled), data_list(d.data_list) {}
 
       rpc_callback_type cb;
       int response_received;
       int response_expected;
+      // the responses with an error, counted in response_received too
+      int response_failed;
+      // 0 for none
+      int quorum;
+      quorum_callback_type on_quorum;
+      bool quorum_notified;
       size_t record_count;
-      std::vector<std::string> data_list;
+      bool cancelled;
+      data_list_type data_list;
     };
 
     class async_task {
@@ -63,8 +85,15 @@ namespace atlas {
 
       async_task(std::nullptr_t) {}
 
-      async_task(rpc_callback_type cb = nullptr, int response_received = 1)
-        : _pimpl(new __async_task(cb, response_received)) {}
+      /*
+       * A multicast call expects a response from every receiver. With a quorum, the first quorum responses
+       * without an error are enough, the task is ready once they arrive, or once too many fail for them to
+       * arrive, and the later responses are dropped. With on_quorum too, the task is not cut short, on_quorum
+       * is called once at that point, and the task waits for the rest as without a quorum
+       * */
+      async_task(rpc_callback_type cb = nullptr, int response_expected = 1, int quorum = 0,
+          quorum_callback_type on_quorum = nullptr)
+        : _pimpl(new __async_task(cb, 0, response_expected, quorum, on_quorum)) {}
 
       async_task(const async_task& task) :
         _pimpl(new __async_task(*task._pimpl))
@@ -76,8 +105,13 @@ namespace atlas {
 
           _pimpl->cb = task._pimpl->cb;
           _pimpl->response_received = task._pimpl->response_received;
-          _pimpl->response_received = task._pimpl->response_received;
+          _pimpl->response_expected = task._pimpl->response_expected;
+          _pimpl->response_failed = task._pimpl->response_failed;
+          _pimpl->quorum = task._pimpl->quorum;
+          _pimpl->on_quorum = task._pimpl->on_quorum;
+          _pimpl->quorum_notified = task._pimpl->quorum_notified;
           _pimpl->record_count = task._pimpl->record_count;
+          _pimpl->cancelled = task._pimpl->cancelled;
           _pimpl->data_list = task._pimpl->data_list;
         }
 
@@ -94,9 +128,39 @@ namespace atlas {
 
       operator bool() const { return _pimpl.operator bool(); }
 
-      void increase_response() { ++_pimpl->response_received; }
+      void increase_response(int err = 0) {
+        ++_pimpl->response_received;
+        if (err) ++_pimpl->response_failed;
+      }
+
+      bool ready() const {
+        if (_pimpl->response_received >= _pimpl->response_expected) return true;
+
+        return _pimpl->quorum && !_pimpl->on_quorum && quorum_decided();
+      }
+
+      // a quorum of the responses succeeds
+      bool quorum_reached() const {
+        return _pimpl->quorum && _pimpl->response_received - _pimpl->response_failed >= _pimpl->quorum;
+      }
+
+      // the quorum is reached, or too many responses fail for it to be reached
+      bool quorum_decided() const {
+        return quorum_reached() || _pimpl->response_failed > _pimpl->response_expected - _pimpl->quorum;
+      }
+
+      // call on_quorum once the quorum is decided, after the callback of the response
+      void notify_quorum() {
+        if (!_pimpl->on_quorum || _pimpl->quorum_notified || !quorum_decided()) return;
+
+        _pimpl->quorum_notified = true;
+        _pimpl->on_quorum(*this);
+      }
 
-      bool ready() const { return _pimpl->response_received == _pimpl->response_received; }
+      // the task ends before it's ready, timed out or never sent, the callback is called once more with the error
+      void cancel() { _pimpl->cancelled = true; }
+
+      bool cancelled() const { return _pimpl->cancelled; }
 
       void run(const std::string& result, int err) {
         if (_pimpl->cb) _pimpl->cb(result, err, *this);
@@ -104,12 +168,16 @@ namespace atlas {
 
       void put_data(const std::string& data) { _pimpl->data_list.push_back(data); }
 
-      void put_data(std::string&& data) { _pimpl->data_list.push_back(data); }
+      void put_data(std::string&& data) { _pimpl->data_list.push_back(std::move(data)); }
 
       size_t response_count() const { return _pimpl->response_received; }
 
       size_t expected_response_count() const { return _pimpl->response_expected; }
 
+      size_t failed_response_count() const { return _pimpl->response_failed; }
+
+      size_t quorum() const { return _pimpl->quorum; }
+
       size_t record_count() const { return _pimpl->record_count; }
 
       std::string merge_data(char sep = '\0') {
@@ -121,7 +189,7 @@ namespace atlas {
         return result; // NRVO
       }
 
-      const std::vector<std::string>& data_list() const { return _pimpl->data_list; }
+      const data_list_type& data_list() const { return _pimpl->data_list; }
 
     private:
 
@@ -133,83 +201,271 @@ namespace atlas {
       return os;
     }
 
-    class sync_task_manager : public atlas::singleton<sync_task_manager> {
+    /*
+     * The future result of a remote function call, a continuation can be attached to the future, so the caller
+     * does not need to block to wait for the result.
+     *
+     * It's a one shot event on one word, a pooled state with no mutex and no condition variable, setting it is
+     * an atomic or, and a futex wake only if a thread sleeps on it, see atlas::futex_wait
+     * */
+    class rpc_future {
     public:
 
-      typedef std::shared_ptr<std::promise<rpc_result>> promise_ptr;
+      typedef std::function<void(const rpc_result&)> continuation_type;
+
+    private:
+
+      // the bits of the state word
+      enum { claimed = 1, ready_bit = 2, continued = 4, waited = 8 };
+
+      struct __state {
+        __state() : word(0) {}
+
+        std::atomic<uint32_t> word;
+        rpc_result result;           // written by the one claimed it, read once it's ready
+        continuation_type continuation;
+      };
 
     public:
 
-      rpc_result suspend(const uuid& id) {
-        promise_ptr promise(new std::promise<rpc_result>());
+      rpc_future() : _state(atlas::memory::make_pooled<__state>()) {}
 
-        {
-          std::lock_guard<std::mutex> guard(_mutex);
-          _promises.insert(std::make_pair(id, promise));
+    public:
+
+      bool ready() const { return _state->word.load(std::memory_order_acquire) & ready_bit; }
+
+      /*
+       * Block until the result arrives.
+       * Never call this in a thread which is responsible to deliver the result, for example, a worker thread
+       * or an I/O thread, use then() instead
+       * */
+      rpc_result get() const {
+        for (;;) {
+          uint32_t w = _state->word.load(std::memory_order_acquire);
+          if (w & ready_bit) break;
+
+          w = _state->word.fetch_or(waited, std::memory_order_acquire) | waited;
+          if (w & ready_bit) break;
+
+          atlas::futex_wait(&_state->word, w);
+        }
+
+        return _state->result;
+      }
+
+      template<typename Duration>
+      bool wait_for(const Duration& d) const {
+        std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now()
+            + std::chrono::duration_cast<std::chrono::steady_clock::duration>(d);
+
+        for (;;) {
+          uint32_t w = _state->word.load(std::memory_order_acquire);
+          if (w & ready_bit) return true;
+
+          std::chrono::nanoseconds left = deadline - std::chrono::steady_clock::now();
+          if (left.count() <= 0) return false;
+
+          w = _state->word.fetch_or(waited, std::memory_order_acquire) | waited;
+          if (w & ready_bit) return true;
+
+          atlas::futex_wait_for(&_state->word, w, left);
         }
+      }
 
-        std::future<rpc_result> future = promise->get_future();
-        future.wait();
+      /*
+       * The continuation is called in the thread which delivers the result, that is, the thread executes the
+       * builtin resume_thread call, the I/O thread which reads it on a pioneer server, or in the calling thread
+       * if the result is ready already.
+       * Only one continuation can be attached
+       * */
+      void then(continuation_type continuation) {
+        if (ready()) {
+          continuation(_state->result);
+          return;
+        }
 
-        return std::move(future.get());
+        // it's published by the bit, the one of set_value and then which sees both bits runs it
+        _state->continuation = std::move(continuation);
+        if (_state->word.fetch_or(continued, std::memory_order_acq_rel) & ready_bit) run_continuation();
+      }
+
+      // the first value wins, the later ones are ignored
+      void set_value(const rpc_result& result) {
+        if (_state->word.fetch_or(claimed, std::memory_order_acquire) & claimed) return;
+
+        _state->result = result;
+        uint32_t w = _state->word.fetch_or(ready_bit, std::memory_order_acq_rel);
+
+        if (w & waited) atlas::futex_wake_all(&_state->word);
+        if (w & continued) run_continuation();
+      }
+
+    private:
+
+      void run_continuation() {
+        continuation_type continuation;
+        std::swap(continuation, _state->continuation);
+
+        continuation(_state->result);
+      }
+
+    private:
+
+      std::shared_ptr<__state> _state;
+    };
+
+    // every pending call has a deadline, the calls pending after the deadline are completed with rpc_timed_out
+    const std::chrono::milliseconds default_rpc_timeout(30 * 1000);
+
+    class sync_task_manager : public atlas::singleton<sync_task_manager> {
+    public:
+
+      // register a future before the request is sent, so the response can never come earlier than the future
+      rpc_future suspend(const uuid& id, std::chrono::milliseconds timeout = default_rpc_timeout) {
+        rpc_future future;
+        _futures.put(id, future);
+        _deadlines.add(id, timer_wheel<uuid>::clock::now() + timeout);
+
+        return future;
       }
 
       void resume(const uuid& id, const std::string& result, int err_code = 0) {
-        promise_ptr promise;
+        boost::optional<rpc_future> future = _futures.take(id);
 
-        {
-          std::lock_guard<std::mutex> guard(_mutex);
-          promise = _promises[id];
-          _promises.erase(id);
-        }
+        if (future) future->set_value(rpc_result(result, err_code));
+      }
 
-        rpc_result r(result, err_code);
-        promise->set_value(r);
+      // complete the expired calls, should be called periodically, a call is never expired earlier than
+      // it's deadline, but may be expired one tick later
+      void sweep() {
+        _deadlines.advance(timer_wheel<uuid>::clock::now(), [this](const uuid& id) {
+          resume(id, "", rpc_timed_out);
+        });
       }
 
-      void clear() {
-        std::lock_guard<std::mutex> guard(_mutex);
-        _promises.clear();
+      // the sweep interval
+      std::chrono::milliseconds tick() const {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(_deadlines.tick());
       }
 
+      void clear() { _futures.clear(); }
+
+      size_t size() const { return _futures.size(); }
+
     private:
 
-      std::mutex _mutex;
-      std::map<uuid , promise_ptr> _promises;
+      // a future in and out a call, the sections are a few hundred nanoseconds
+      atlas::spin_sharded_box<uuid, rpc_future, atlas::uuid_hash> _futures;
+      // the completed calls are left in the wheel, and ignored when they expire
+      timer_wheel<uuid> _deadlines;
     };
 
+    // the pending callbacks are kept in a sharded table, so responses of different sessions rarely contend,
+    // and the callbacks are invoked without any table lock held, a callback may issue new calls freely
     class async_task_manager : public atlas::singleton<async_task_manager> {
+    private:
+
+      // callbacks for the same task are serialized by the task's own mutex
+      struct pending_task {
+        pending_task(rpc_callback_type cb, int response_expected, int quorum, quorum_callback_type on_quorum) :
+          task(cb, response_expected, quorum, on_quorum), started(std::chrono::steady_clock::now()) {}
+
+        std::mutex mutex;
+        async_task task;
+        const std::chrono::steady_clock::time_point started;
+      };
+
+      typedef std::shared_ptr<pending_task> pending_task_ptr;
+
     public:
 
-      void suspend(const uuid& id, rpc_callback_type cb, int response_received = 1) {
-        std::lock_guard<std::mutex> guard(_mutex);
+      // called with the responder and the time from the suspend to the response, for every response
+      typedef std::function<void(endpoint_id, std::chrono::nanoseconds)> response_callback;
 
-        async_task task(cb, response_received);
-        _sessions.insert(std::make_pair(id, task));
+    public:
+
+      // the round trip time seen by the caller, set it before any call is made
+      void set_response_callback(const response_callback& cb) { _on_response = cb; }
+
+      // see async_task for the quorum
+      void suspend(const uuid& id, rpc_callback_type cb, int response_expected = 1,
+          std::chrono::milliseconds timeout = default_rpc_timeout, int quorum = 0, quorum_callback_type on_quorum = nullptr) {
+        _sessions.put(id, std::make_shared<pending_task>(cb, response_expected, quorum, on_quorum));
+        _deadlines.add(id, timer_wheel<uuid>::clock::now() + timeout);
       }
 
-      void resume(const uuid& id, const std::string& result, int err_code = 0) {
-        std::lock_guard<std::mutex> guard(_mutex);
+      void resume(const uuid& id, const std::string& result, int err_code = 0, endpoint_id source = nil_endpoint) {
+        boost::optional<pending_task_ptr> p = _sessions.get(id);
+        if (!p) return;
+
+        pending_task_ptr pending = *p;
+        bool ready = false;
+
+        if (_on_response && source != nil_endpoint) {
+          _on_response(source, std::chrono::duration_cast<std::chrono::nanoseconds>(
+              std::chrono::steady_clock::now() - pending->started));
+        }
+
+        {
+          std::lock_guard<std::mutex> guard(pending->mutex);
+
+          // a response may get the task just before it's cancelled, the callback was called with the error already
+          if (pending->task.cancelled()) return;
+          // a quorum completed it, the later responses that get it before it's erased are dropped
+          if (pending->task.ready()) return;
 
-        auto it = _sessions.find(id);
-        if (it != _sessions.end()) {
           // increase response counter
-          it->second.increase_response();
+          pending->task.increase_response(err_code);
 
           // call callback
-          it->second.run(result, err_code);
+          pending->task.run(result, err_code);
+          pending->task.notify_quorum();
+
+          ready = pending->task.ready();
+        }
 
-          // clean if need
-          if (it->second.ready()) {
-            _sessions.erase(it);
-          }
+        // clean if need
+        if (ready) {
+          _sessions.erase_if(id, [&pending](const pending_task_ptr& v) { return v == pending; });
         }
       }
 
+      // remove the task and call it's callback once with the error, no matter how many responses are expected
+      void cancel(const uuid& id, int err_code) {
+        boost::optional<pending_task_ptr> p = _sessions.take(id);
+        if (!p) return;
+
+        std::lock_guard<std::mutex> guard((*p)->mutex);
+        // the last response completed it already, and it's not erased yet
+        if ((*p)->task.ready()) return;
+
+        (*p)->task.cancel();
+        (*p)->task.run("", err_code);
+      }
+
+      // the expired tasks are removed, and their callbacks are called once with rpc_timed_out,
+      // should be called periodically
+      void sweep() {
+        _deadlines.advance(timer_wheel<uuid>::clock::now(), [this](const uuid& id) {
+          cancel(id, rpc_timed_out);
+        });
+      }
+
+      std::chrono::milliseconds tick() const {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(_deadlines.tick());
+      }
+
+      size_t size() const { return _sessions.size(); }
+
+      // the call waits for a response still
+      bool pending(const uuid& id) const { return _sessions.get(id).is_initialized(); }
+
     private:
 
-      std::mutex _mutex;
-      std::map<uuid, async_task> _sessions;
+      // the tasks are made and released out of the table, a section is a lookup
+      atlas::spin_sharded_box<uuid, pending_task_ptr, atlas::uuid_hash> _sessions;
+      timer_wheel<uuid> _deadlines;
+      response_callback _on_response;
     };
 
   } // rpc
@@ -0,0 +1,245 @@
+/*
+ * trace.h
+ *
+ *  Created on: Sep 6, 2013
+ *      Author: vincent
+ */
+
+/*    Copyright 2011 ~ 2013 Vincent Zhang, ivincent.zhang@gmail.com
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#ifndef ATLAS_RPC_TRACE_H_
+#define ATLAS_RPC_TRACE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <atomic>
+#include <chrono>
+#include <vector>
+
+#include <atlas/fast_random.h>
+#include <atlas/container/ring_buffer.h>
+#include <atlas/rpc/message.h>
+
+namespace atlas {
+  namespace rpc {
+
+    // the trace of a request, carried in the request header, see request_header::trace_id
+    struct trace_context {
+      uint64_t trace_id;        // 0 if not traced
+      uint64_t span_id;
+      uint64_t parent_span_id;  // 0 for the root
+      int32_t flags;            // see trace_flag
+
+      bool traced() const { return trace_id != 0; }
+
+      bool sampled() const { return (flags & trace_sampled) != 0; }
+    };
+
+    // a sampled request finished on this node
+    struct span {
+      uint64_t trace_id;
+      uint64_t span_id;
+      uint64_t parent_span_id;
+      int32_t fn_id;
+      int64_t start;            // in microseconds since epoch
+      int64_t duration;         // in nanoseconds
+    };
+
+    /*
+     * The distributed tracing of the requests, cheap enough to be always on.
+     *
+     * A request carries the trace id, it's own span id and the span of the caller in the header. The span of the
+     * request a thread runs is the current context, see span_scope, and every call made from it is a child span,
+     * see message_builder, so the context flows across the nodes without touching the remote functions. A call
+     * out of any request starts a new trace, and the first node a request from outside reaches does too.
+     *
+     * The trace is sampled once at the root, the decision goes with the trace, so a trace is recorded on every
+     * node or none. Only the sampled spans are recorded, into a lock-free ring, nothing else is paid by the others
+     * but a random number at the root. The spans are taken out in batches by drain(), and dropped if the ring is
+     * full, so a slow exporter never slows down the requests.
+     *
+     * The builtin functions, the responses, are not traced
+     * */
+    class tracer {
+    public:
+
+      static const size_t ring_capacity = 64 * 1024;
+
+    private:
+
+      tracer() : _threshold(0), _spans(ring_capacity), _recorded(0), _dropped(0) {}
+
+      tracer(const tracer&) = delete;
+      tracer& operator=(const tracer&) = delete;
+
+    public:
+
+      static tracer& instance() {
+        static tracer t;
+        return t;
+      }
+
+    public:
+
+      // 0 ~ 1, the part of the new traces sampled
+      void set_sample_rate(double rate) {
+        uint64_t threshold = 0;
+        if (rate >= 1) threshold = UINT64_MAX;
+        else if (rate > 0) threshold = static_cast<uint64_t>(rate * 18446744073709551616.0);
+
+        _threshold.store(threshold, std::memory_order_relaxed);
+      }
+
+      double sample_rate() const { return _threshold.load(std::memory_order_relaxed) / 18446744073709551616.0; }
+
+      // the context of the request the calling thread runs, not traced out of any request.
+      // We use __thread since gcc 4.7 does not support thread_local
+      static trace_context& current() {
+        static __thread trace_context c = { 0, 0, 0, 0 };
+        return c;
+      }
+
+      // the context of a new call made by the calling thread, a child of the current one, or a new root
+      trace_context child(int fn_id) {
+        const trace_context& parent = current();
+
+        if (fn_id < 0) return trace_context { 0, 0, 0, 0 };
+        if (!parent.traced()) return root();
+
+        return trace_context { parent.trace_id, new_id(), parent.span_id, parent.flags };
+      }
+
+      // the context of a request arrived, a new root if it's not traced by the caller
+      trace_context accept(const request_header& h) {
+        if (h.fn_id < 0) return trace_context { 0, 0, 0, 0 };
+        if (h.trace_id == 0) return root();
+
+        return trace_context { h.trace_id, h.span_id, h.parent_span_id, h.trace_flags };
+      }
+
+      // the spans recorded are taken in batches, at most max of them, return the number taken
+      size_t drain(std::vector<span>& spans, size_t max) {
+        size_t n = 0;
+        span s;
+
+        while (n < max && _spans.try_pop(s)) {
+          spans.push_back(s);
+          ++n;
+        }
+
+        return n;
+      }
+
+      unsigned long long recorded() const { return _recorded.load(std::memory_order_relaxed); }
+
+      unsigned long long dropped() const { return _dropped.load(std::memory_order_relaxed); }
+
+      size_t pending() const { return _spans.size(); }
+
+    public:
+
+      /*
+       * Make the context of the request the current one while the request runs, and record the span if it's
+       * sampled, the previous context is restored at the end, since a request may run another one nested
+       * */
+      class span_scope {
+      public:
+
+        explicit span_scope(const request_header& h) : _fn_id(h.fn_id), _previous(current()) {
+          trace_context& c = current();
+          c = tracer::instance().accept(h);
+
+          if (c.sampled()) {
+            _started = std::chrono::steady_clock::now();
+            _start = std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::system_clock::now().time_since_epoch()).count();
+          }
+        }
+
+        span_scope(const span_scope&) = delete;
+        span_scope& operator=(const span_scope&) = delete;
+
+        ~span_scope() {
+          trace_context& c = current();
+
+          if (c.sampled()) {
+            span s = { c.trace_id, c.span_id, c.parent_span_id, _fn_id, _start,
+                std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - _started).count() };
+            tracer::instance().record(s);
+          }
+
+          c = _previous;
+        }
+
+      private:
+
+        int32_t _fn_id;
+        trace_context _previous;
+        std::chrono::steady_clock::time_point _started;
+        int64_t _start;
+      };
+
+      /*
+       * Continue a trace in another thread, for example, a task scheduled by a remote function, capture current()
+       * in the function and make it current in the task, so the calls of the task are children of the request too
+       * */
+      class resume_scope {
+      public:
+
+        explicit resume_scope(const trace_context& c) : _previous(current()) { current() = c; }
+
+        resume_scope(const resume_scope&) = delete;
+        resume_scope& operator=(const resume_scope&) = delete;
+
+        ~resume_scope() { current() = _previous; }
+
+      private:
+
+        trace_context _previous;
+      };
+
+    private:
+
+      static uint64_t new_id() {
+        uint64_t id = fast_random();
+        return id ? id : 1;
+      }
+
+      trace_context root() {
+        uint64_t id = new_id();
+        int32_t flags = (fast_random() < _threshold.load(std::memory_order_relaxed)) ? trace_sampled : 0;
+
+        return trace_context { id, id, 0, flags };
+      }
+
+      void record(const span& s) {
+        if (_spans.try_push(s)) _recorded.fetch_add(1, std::memory_order_relaxed);
+        else _dropped.fetch_add(1, std::memory_order_relaxed);
+      }
+
+    private:
+
+      std::atomic<uint64_t> _threshold;
+      mpmc_ring<span> _spans;
+
+      std::atomic<unsigned long long> _recorded;
+      std::atomic<unsigned long long> _dropped;
+    };
+
+  } // rpc
+} // atlas
+
+#endif /* ATLAS_RPC_TRACE_H_ */
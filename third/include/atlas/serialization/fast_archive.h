@@ -0,0 +1,447 @@
+/*
+ * fast_archive.h
+ *
+ *  Created on: Aug 21, 2013
+ *      Author: vincent
+ */
+
+#ifndef ATLAS_SERIALIZATION_FAST_ARCHIVE_H_
+#define ATLAS_SERIALIZATION_FAST_ARCHIVE_H_
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <list>
+#include <deque>
+#include <set>
+#include <map>
+#include <array>
+#include <utility>
+#include <istream>
+#include <ostream>
+#include <stdexcept>
+#include <type_traits>
+
+#include <boost/mpl/bool.hpp>
+#include <boost/serialization/serialization.hpp>
+#include <boost/serialization/split_free.hpp>
+
+/*
+ * A compact, schema-free binary archive used to encode RPC arguments.
+ *
+ * The format :
+ *  1. arithmetic and enum types are written with their native width, in little endian
+ *  2. bool is written as one byte
+ *  3. the lengths of strings and containers are written as varints (LEB128)
+ *  4. containers of bitwise serializable types are written in one block
+ *  5. any other class type goes through the boost serialization protocol, that is, a free or member
+ *     serialize/save/load function, no class information, version, or tracking data is written
+ *
+ * Both sides must agree on the argument types, there is no type information in the stream.
+ * */
+namespace atlas {
+  namespace serialization {
+
+    // a type is bitwise serializable if the in-memory representation of it's value is exactly the
+    // on-wire representation on a little endian machine, specialize it for other POD types if needed
+    template<typename T>
+    struct is_bitwise_serializable : public std::integral_constant<bool,
+      (std::is_arithmetic<T>::value || std::is_enum<T>::value) && !std::is_same<T, bool>::value>
+    {};
+
+    // the bytes of a bitwise serializable type are reversed on a big endian machine, unless it's bytes have
+    // no order, an array of bytes in a struct, for example, see serialization/uuid.h
+    template<typename T>
+    struct has_byte_order : public std::true_type {};
+
+    // a value of the type always takes sizeof(T) bytes in the stream, so the size of a call of such arguments is
+    // known at compile time, see rpc::fn_encoder, a placeholder which writes nothing specializes both with 0
+    template<typename T>
+    struct has_fixed_size : public std::integral_constant<bool,
+      is_bitwise_serializable<T>::value || std::is_same<T, bool>::value>
+    {};
+
+    template<typename T>
+    struct fixed_size : public std::integral_constant<size_t, sizeof(T)> {};
+
+    class archive_error : public std::runtime_error {
+    public:
+
+      archive_error(const std::string& what) : std::runtime_error(what) {}
+    };
+
+    namespace detail {
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+      static const bool little_endian = false;
+#else
+      static const bool little_endian = true;
+#endif
+
+      inline void reverse_bytes(char* data, size_t size) {
+        for (size_t i = 0, j = size - 1; i < j; ++i, --j) std::swap(data[i], data[j]);
+      }
+
+    } // detail
+
+    class fast_oarchive {
+    public:
+
+      typedef boost::mpl::bool_<true> is_saving;
+      typedef boost::mpl::bool_<false> is_loading;
+
+    public:
+
+      explicit fast_oarchive(std::ostream& os, unsigned int /* flags */ = 0) : _buf(os.rdbuf()) {}
+
+      fast_oarchive(const fast_oarchive&) = delete;
+      fast_oarchive& operator=(const fast_oarchive&) = delete;
+
+    public:
+
+      template<typename T>
+      fast_oarchive& operator<<(const T& t) {
+        save(t);
+        return *this;
+      }
+
+      template<typename T>
+      fast_oarchive& operator&(const T& t) {
+        return *this << t;
+      }
+
+      void save_binary(const void* data, size_t size) {
+        if (size == 0) return;
+
+        if (_buf->sputn(static_cast<const char*>(data), size) != static_cast<std::streamsize>(size)) {
+          throw archive_error("fast_oarchive : output stream error");
+        }
+      }
+
+      void save_varint(uint64_t value) {
+        char bytes[10];
+        size_t size = 0;
+
+        while (value >= 0x80) {
+          bytes[size++] = static_cast<char>((value & 0x7f) | 0x80);
+          value >>= 7;
+        }
+        bytes[size++] = static_cast<char>(value);
+
+        save_binary(bytes, size);
+      }
+
+    protected:
+
+      void save(bool b) {
+        char c = b ? 1 : 0;
+        save_binary(&c, 1);
+      }
+
+      template<typename Traits, typename A>
+      void save(const std::basic_string<char, Traits, A>& s) {
+        save_varint(s.size());
+        save_binary(s.data(), s.size());
+      }
+
+      void save(const char* s) {
+        size_t size = std::strlen(s);
+        save_varint(size);
+        save_binary(s, size);
+      }
+
+      template<typename T, typename A>
+      void save(const std::vector<T, A>& v) {
+        save_varint(v.size());
+        save_range(v.data(), v.size(), is_bitwise_serializable<T>());
+      }
+
+      template<typename A>
+      void save(const std::vector<bool, A>& v) {
+        save_sequence(v);
+      }
+
+      template<typename T, size_t N>
+      void save(const std::array<T, N>& a) {
+        save_range(a.data(), N, is_bitwise_serializable<T>());
+      }
+
+      template<typename T, size_t N>
+      void save(const T (&a)[N]) {
+        save_range(a, N, is_bitwise_serializable<T>());
+      }
+
+      template<typename T, typename A>
+      void save(const std::list<T, A>& l) { save_sequence(l); }
+
+      template<typename T, typename A>
+      void save(const std::deque<T, A>& d) { save_sequence(d); }
+
+      template<typename K, typename C, typename A>
+      void save(const std::set<K, C, A>& s) { save_sequence(s); }
+
+      template<typename K, typename V, typename C, typename A>
+      void save(const std::map<K, V, C, A>& m) { save_sequence(m); }
+
+      template<typename F, typename S>
+      void save(const std::pair<F, S>& p) {
+        save(p.first);
+        save(p.second);
+      }
+
+      template<typename T>
+      void save(const T& t) {
+        save_value(t, is_bitwise_serializable<T>());
+      }
+
+    private:
+
+      template<typename T>
+      void save_value(const T& t, std::true_type) {
+        if (detail::little_endian || !has_byte_order<T>::value) {
+          save_binary(&t, sizeof(T));
+        }
+        else {
+          char bytes[sizeof(T)];
+          std::memcpy(bytes, &t, sizeof(T));
+          detail::reverse_bytes(bytes, sizeof(T));
+          save_binary(bytes, sizeof(T));
+        }
+      }
+
+      template<typename T>
+      void save_value(const T& t, std::false_type) {
+        boost::serialization::serialize_adl(*this, const_cast<T&>(t), 0);
+      }
+
+      template<typename T>
+      void save_range(const T* data, size_t size, std::true_type) {
+        // the fast path : one block for the whole range
+        if (detail::little_endian || !has_byte_order<T>::value) {
+          save_binary(data, size * sizeof(T));
+        }
+        else {
+          for (size_t i = 0; i < size; ++i) save_value(data[i], std::true_type());
+        }
+      }
+
+      template<typename T>
+      void save_range(const T* data, size_t size, std::false_type) {
+        for (size_t i = 0; i < size; ++i) save(data[i]);
+      }
+
+      template<typename Container>
+      void save_sequence(const Container& c) {
+        save_varint(c.size());
+        for (const auto& v : c) save(v);
+      }
+
+    private:
+
+      std::streambuf* _buf;
+    };
+
+    class fast_iarchive {
+    public:
+
+      typedef boost::mpl::bool_<false> is_saving;
+      typedef boost::mpl::bool_<true> is_loading;
+
+    public:
+
+      explicit fast_iarchive(std::istream& is, unsigned int /* flags */ = 0) : _buf(is.rdbuf()) {}
+
+      fast_iarchive(const fast_iarchive&) = delete;
+      fast_iarchive& operator=(const fast_iarchive&) = delete;
+
+    public:
+
+      template<typename T>
+      fast_iarchive& operator>>(T& t) {
+        load(t);
+        return *this;
+      }
+
+      template<typename T>
+      fast_iarchive& operator&(T& t) {
+        return *this >> t;
+      }
+
+      void load_binary(void* data, size_t size) {
+        if (size == 0) return;
+
+        if (_buf->sgetn(static_cast<char*>(data), size) != static_cast<std::streamsize>(size)) {
+          throw archive_error("fast_iarchive : unexpected end of stream");
+        }
+      }
+
+      uint64_t load_varint() {
+        uint64_t value = 0;
+
+        for (int shift = 0; shift < 64; shift += 7) {
+          int c = _buf->sbumpc();
+          if (c == std::char_traits<char>::eof()) {
+            throw archive_error("fast_iarchive : unexpected end of stream");
+          }
+
+          value |= static_cast<uint64_t>(c & 0x7f) << shift;
+          if (!(c & 0x80)) return value;
+        }
+
+        throw archive_error("fast_iarchive : bad varint");
+      }
+
+    protected:
+
+      void load(bool& b) {
+        char c = 0;
+        load_binary(&c, 1);
+        b = (c != 0);
+      }
+
+      template<typename Traits, typename A>
+      void load(std::basic_string<char, Traits, A>& s) {
+        s.resize(load_size());
+        if (!s.empty()) load_binary(&s[0], s.size());
+      }
+
+      template<typename T, typename A>
+      void load(std::vector<T, A>& v) {
+        load_vector(v, is_bitwise_serializable<T>());
+      }
+
+      template<typename A>
+      void load(std::vector<bool, A>& v) {
+        size_t size = load_size();
+
+        v.clear();
+        for (size_t i = 0; i < size; ++i) {
+          bool b;
+          load(b);
+          v.push_back(b);
+        }
+      }
+
+      template<typename T, size_t N>
+      void load(std::array<T, N>& a) {
+        load_range(a.data(), N, is_bitwise_serializable<T>());
+      }
+
+      template<typename T, size_t N>
+      void load(T (&a)[N]) {
+        load_range(a, N, is_bitwise_serializable<T>());
+      }
+
+      template<typename T, typename A>
+      void load(std::list<T, A>& l) { load_sequence(l); }
+
+      template<typename T, typename A>
+      void load(std::deque<T, A>& d) { load_sequence(d); }
+
+      template<typename K, typename C, typename A>
+      void load(std::set<K, C, A>& s) {
+        size_t size = load_size();
+
+        s.clear();
+        for (size_t i = 0; i < size; ++i) {
+          K k;
+          load(k);
+          s.insert(s.end(), std::move(k));
+        }
+      }
+
+      template<typename K, typename V, typename C, typename A>
+      void load(std::map<K, V, C, A>& m) {
+        size_t size = load_size();
+
+        m.clear();
+        for (size_t i = 0; i < size; ++i) {
+          std::pair<K, V> p;
+          load(p);
+          m.insert(m.end(), std::move(p));
+        }
+      }
+
+      template<typename F, typename S>
+      void load(std::pair<F, S>& p) {
+        load(p.first);
+        load(p.second);
+      }
+
+      template<typename T>
+      void load(T& t) {
+        load_value(t, is_bitwise_serializable<T>());
+      }
+
+    private:
+
+      size_t load_size() {
+        uint64_t size = load_varint();
+
+        // the stream tells us how many bytes are left if it knows, every element takes at least one byte
+        std::streamsize avail = _buf->in_avail();
+        if (avail > 0 && size > static_cast<uint64_t>(avail)) {
+          throw archive_error("fast_iarchive : bad size");
+        }
+
+        return static_cast<size_t>(size);
+      }
+
+      template<typename T>
+      void load_value(T& t, std::true_type) {
+        load_binary(&t, sizeof(T));
+        if (!detail::little_endian && has_byte_order<T>::value) detail::reverse_bytes(reinterpret_cast<char*>(&t), sizeof(T));
+      }
+
+      template<typename T>
+      void load_value(T& t, std::false_type) {
+        boost::serialization::serialize_adl(*this, t, 0);
+      }
+
+      template<typename T>
+      void load_range(T* data, size_t size, std::true_type) {
+        load_binary(data, size * sizeof(T));
+
+        if (!detail::little_endian && has_byte_order<T>::value) {
+          for (size_t i = 0; i < size; ++i) detail::reverse_bytes(reinterpret_cast<char*>(data + i), sizeof(T));
+        }
+      }
+
+      template<typename T>
+      void load_range(T* data, size_t size, std::false_type) {
+        for (size_t i = 0; i < size; ++i) load(data[i]);
+      }
+
+      template<typename T, typename A>
+      void load_vector(std::vector<T, A>& v, std::true_type) {
+        v.resize(load_size());
+        if (!v.empty()) load_range(v.data(), v.size(), std::true_type());
+      }
+
+      template<typename T, typename A>
+      void load_vector(std::vector<T, A>& v, std::false_type) {
+        load_sequence(v);
+      }
+
+      template<typename Container>
+      void load_sequence(Container& c) {
+        size_t size = load_size();
+
+        c.clear();
+        for (size_t i = 0; i < size; ++i) {
+          typename Container::value_type v;
+          load(v);
+          c.push_back(std::move(v));
+        }
+      }
+
+    private:
+
+      std::streambuf* _buf;
+    };
+
+  } // serialization
+} // atlas
+
+#endif /* ATLAS_SERIALIZATION_FAST_ARCHIVE_H_ */
@@ -23,6 +23,9 @@ namespace atlas {
 
     namespace { struct useless { }; }
 
+    // it keeps the target as a std::function, so it's run in this process only, a call to keep in a log or to
+    // send on is a rpc::deferred_call, resolved by the function id
+
     template<typename Signature> class function;
 
     template<typename Res, typename ... Args>
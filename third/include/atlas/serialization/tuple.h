@@ -12,31 +12,18 @@
 #include <atlas/type_traits.h>
 
 namespace atlas {
-  namespace {
-
-    template<size_t idx, typename Archive, typename ... Elements>
-    void aux_serialize(Archive& ar, std::tuple<Elements...>& t, single_parameter_pack_tag) {
-      ar & std::get<idx>(t);
-    }
-
-    template<size_t idx, typename Archive, typename ... Elements>
-    void aux_serialize(Archive& ar, std::tuple<Elements...>& t, not_single_parameter_pack_tag) {
-      ar & std::get<idx>(t);
-
-      aux_serialize<idx + 1>(ar, t, atlas::is_last_parameter<idx, Elements...>());
-    }
-
-    template<typename Archive, typename ... Elements>
-    void serialize(Archive& ar, std::tuple<Elements...>& t, last_parameter_tag) {
-      ar & std::get<0>(t);
-    }
-
-    template<typename Archive, typename ... Elements>
-    void serialize(Archive& ar, std::tuple<Elements...>& t, not_last_parameter_tag) {
-      aux_serialize<0>(ar, t, std::false_type());
+  namespace detail {
+
+    // the elements in order in one function, the braced list is evaluated from left to right
+    template<typename Archive, typename ... Elements, size_t ... I>
+    void serialize_elements(Archive& ar, std::tuple<Elements...>& t, index_sequence<I...>) {
+      int expand[] = { 0, ((ar & std::get<I>(t)), 0)... };
+      (void) expand;
+      (void) ar;
+      (void) t;
     }
-  }
 
+  } // detail
 } // atlas
 
 namespace boost {
@@ -44,7 +31,7 @@ namespace boost {
 
     template<typename Archive, typename ... Elements>
     Archive& serialize(Archive& ar, std::tuple<Elements...>& t, const unsigned int version) {
-      atlas::serialize(ar, t, atlas::is_single_parameter_pack<Elements...>());
+      atlas::detail::serialize_elements(ar, t, atlas::index_sequence_for<Elements...>());
 
       return ar;
     }
@@ -8,8 +8,14 @@
 #ifndef ATLAS_SERIALIZATION_UUID_H_
 #define ATLAS_SERIALIZATION_UUID_H_
 
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
 #include <boost/uuid/uuid.hpp>
 
+#include <atlas/serialization/fast_archive.h>
+
 namespace boost {
   namespace serialization {
 
@@ -21,4 +27,34 @@ namespace boost {
   } // serialization
 } // boost
 
+namespace atlas {
+  namespace serialization {
+
+    // 16 bytes as they are, so a vector of session ids, the ones of a batch, is one block
+    template<>
+    struct is_bitwise_serializable<boost::uuids::uuid> : public std::true_type {};
+
+    template<>
+    struct has_byte_order<boost::uuids::uuid> : public std::false_type {};
+
+    static_assert(sizeof(boost::uuids::uuid) == 16, "a uuid is serialized as 16 bytes");
+
+  } // serialization
+
+  /*
+   * The hash of the tables keyed by the session ids, instead of boost::hash, which combines the 16 bytes one
+   * by one. The two halves are folded and multiplied, so the counter half of a session id, see
+   * message::next_session_id, reaches the higher bits the shards are taken by, see sharded_concurrent_box
+   * */
+  struct uuid_hash {
+    size_t operator()(const boost::uuids::uuid& id) const {
+      uint64_t words[2];
+      std::memcpy(words, id.data, sizeof(words));
+
+      return static_cast<size_t>((words[0] ^ words[1]) * 0x9e3779b97f4a7c15ULL);
+    }
+  };
+
+} // atlas
+
 #endif /* ATLAS_SERIALIZATION_UUID_H_ */
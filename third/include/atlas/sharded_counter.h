@@ -0,0 +1,119 @@
+/*
+ * sharded_counter.h
+ *
+ *  Created on: Sep 6, 2013
+ *      Author: vincent
+ */
+
+#ifndef ATLAS_SHARDED_COUNTER_H_
+#define ATLAS_SHARDED_COUNTER_H_
+
+#include <cstddef>
+#include <atomic>
+
+namespace atlas {
+
+  namespace detail {
+
+    // the threads are numbered in the order they first count, we use __thread since gcc 4.7 does not support thread_local
+    inline size_t counter_thread_index() {
+      static std::atomic<size_t> next(0);
+      static __thread size_t index = static_cast<size_t>(-1);
+
+      if (index == static_cast<size_t>(-1)) index = next.fetch_add(1, std::memory_order_relaxed);
+      return index;
+    }
+
+  } // detail
+
+  /*
+   * A statistics counter for the hot paths, every thread adds to it's own slot, and the slots are on their own
+   * cache lines, so the counting threads never bounce a line between the cores, a read sums all the slots.
+   *
+   * The threads share the slots once there are more threads than slots, it's still correct, since the slots are
+   * atomic, but they contend then. The sum is not a snapshot while the others count, and set() is meant for
+   * the reset of a counter nobody counts at the same time, it's for the status pages, not for the logic
+   * */
+  template<size_t Shards = 16>
+  class basic_sharded_counter {
+  public:
+
+    static_assert(Shards > 0 && (Shards & (Shards - 1)) == 0, "the shard number must be a power of 2");
+
+    typedef unsigned long long value_type;
+
+  public:
+
+    basic_sharded_counter() { set(0); }
+
+    explicit basic_sharded_counter(value_type value) { set(value); }
+
+    basic_sharded_counter(const basic_sharded_counter&) = delete;
+    basic_sharded_counter& operator=(const basic_sharded_counter&) = delete;
+
+  public:
+
+    // the decrements wrap around in a slot, the sum is right modulo 2^64
+    void add(value_type n) { local().fetch_add(n, std::memory_order_relaxed); }
+
+    void sub(value_type n) { local().fetch_sub(n, std::memory_order_relaxed); }
+
+    value_type load() const {
+      value_type sum = 0;
+      for (const slot& s : _slots) sum += s.value.load(std::memory_order_relaxed);
+
+      return sum;
+    }
+
+    void set(value_type value) {
+      for (slot& s : _slots) s.value.store(0, std::memory_order_relaxed);
+      _slots[0].value.store(value, std::memory_order_relaxed);
+    }
+
+  public:
+
+    operator value_type() const { return load(); }
+
+    basic_sharded_counter& operator=(value_type value) {
+      set(value);
+      return *this;
+    }
+
+    basic_sharded_counter& operator++() {
+      add(1);
+      return *this;
+    }
+
+    basic_sharded_counter& operator--() {
+      sub(1);
+      return *this;
+    }
+
+    basic_sharded_counter& operator+=(value_type n) {
+      add(n);
+      return *this;
+    }
+
+    basic_sharded_counter& operator-=(value_type n) {
+      sub(n);
+      return *this;
+    }
+
+  private:
+
+    struct slot {
+      std::atomic<value_type> value;
+    } __attribute__((aligned(64)));
+
+    std::atomic<value_type>& local() { return _slots[detail::counter_thread_index() & (Shards - 1)].value; }
+
+  private:
+
+    slot _slots[Shards];
+  };
+
+  typedef basic_sharded_counter<> sharded_counter;
+
+} // atlas
+
+#endif /* ATLAS_SHARDED_COUNTER_H_ */
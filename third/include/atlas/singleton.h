@@ -8,6 +8,7 @@
 #ifndef ATLAS_SINGLETON_H_
 #define ATLAS_SINGLETON_H_
 
+#include <atomic>
 #include <memory>
 #include <mutex>
 
@@ -22,7 +23,14 @@ namespace atlas {
 
     ~singleton() = default;
 
-    static T& ref() { return *ptr(); }
+    // once it's made, a plain load of the pointer, no call_once and no reference counting
+    static T& ref() {
+      T* p = _instance.load(std::memory_order_acquire);
+      if (__builtin_expect(p != nullptr, 1)) return *p;
+
+      std::call_once(_only_one, __init);
+      return *_instance.load(std::memory_order_acquire);
+    }
 
     static auto ptr() -> std::shared_ptr<T> {
       std::call_once(_only_one, __init);
@@ -33,15 +41,19 @@ namespace atlas {
 
     static void __init() {
       _value = std::make_shared<T>();
+      _instance.store(_value.get(), std::memory_order_release);
     }
 
   private:
 
     static std::shared_ptr<T> _value;
+    // the object of _value, it's zero before any static is constructed, so ref() is safe in any static ctor
+    static std::atomic<T*> _instance;
     static std::once_flag _only_one;
   };
 
   template<typename T> std::shared_ptr<T> singleton<T>::_value;
+  template<typename T> std::atomic<T*> singleton<T>::_instance(nullptr);
   template<typename T> std::once_flag singleton<T>::_only_one;
 
 } // atlas
@@ -0,0 +1,127 @@
+/*
+ * strand.h
+ *
+ *  Created on: Sep 4, 2013
+ *      Author: vincent
+ */
+
+#ifndef ATLAS_STRAND_H_
+#define ATLAS_STRAND_H_
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <thread>
+
+#include <atlas/container/mpsc_queue.h>
+
+namespace atlas {
+
+  /*
+   * A serial executor on a thread pool. The tasks of a strand run in the order they are scheduled,
+   * one at a time, on any worker of the pool, but never block the other strands or the pool.
+   *
+   * The first task scheduled into an idle strand schedules a drain into the pool, the drain runs the
+   * queued tasks until the strand is idle again, and gives the worker back after max_batch tasks by
+   * scheduling itself again, so a busy strand never starves the others. If the pool is bounded and full,
+   * the drain runs in the scheduling thread, which pushes back on the producer.
+   *
+   * The strand must outlive it's tasks, any thread may schedule
+   * */
+  template<typename Pool>
+  class strand {
+  public:
+
+    typedef typename Pool::task_type task_type;
+
+    static const size_t max_batch = 64;
+
+  public:
+
+    explicit strand(Pool& pool) : _pool(pool), _pending(0) {}
+
+    strand(const strand&) = delete;
+    strand& operator=(const strand&) = delete;
+
+  public:
+
+    void schedule(task_type task) {
+      _tasks.push(std::move(task));
+
+      // the one who wakes the strand up schedules the drain
+      if (_pending.fetch_add(1, std::memory_order_acq_rel) == 0 && !schedule_drain()) drain();
+    }
+
+    // approximate
+    bool idle() const { return _pending.load(std::memory_order_acquire) == 0; }
+
+  private:
+
+    bool schedule_drain() {
+      return _pool.schedule([this]() { drain(); });
+    }
+
+    // only one drain runs at a time, so it's the only consumer of the queue
+    void drain() {
+      task_type task;
+
+      do {
+        for (size_t n = 0; n < max_batch; ++n) {
+          // every counted task is pushed, but it's link may be not published yet
+          while (!_tasks.pop(task)) std::this_thread::yield();
+
+          task();
+          task = nullptr;
+
+          if (_pending.fetch_sub(1, std::memory_order_acq_rel) == 1) return;
+        }
+      } while (!schedule_drain());
+    }
+
+  private:
+
+    Pool& _pool;
+    mpsc_queue<task_type> _tasks;
+    std::atomic<size_t> _pending;
+  };
+
+  /*
+   * A fixed number of strands, a key is always served by the same strand, so the tasks of one key run in order.
+   * Different keys may share a strand, which costs some parallelism but nothing is allocated or reclaimed
+   * per key, the keys like the sessions and the connections come and go too fast for that
+   * */
+  template<typename Pool, typename Key, typename Hash = std::hash<Key>>
+  class strand_group {
+  public:
+
+    typedef strand<Pool> strand_type;
+    typedef typename strand_type::task_type task_type;
+
+  public:
+
+    explicit strand_group(Pool& pool, size_t size = 1024) : _size(size ? size : 1) {
+      _strands.reset(new std::unique_ptr<strand_type>[_size]);
+      for (size_t i = 0; i < _size; ++i) _strands[i].reset(new strand_type(pool));
+    }
+
+    strand_group(const strand_group&) = delete;
+    strand_group& operator=(const strand_group&) = delete;
+
+  public:
+
+    void schedule(const Key& key, task_type task) { get(key).schedule(std::move(task)); }
+
+    strand_type& get(const Key& key) { return *_strands[_hash(key) % _size]; }
+
+    size_t size() const { return _size; }
+
+  private:
+
+    size_t _size;
+    std::unique_ptr<std::unique_ptr<strand_type>[]> _strands;
+    Hash _hash;
+  };
+
+} // atlas
+
+#endif /* ATLAS_STRAND_H_ */
@@ -13,6 +13,8 @@
 #include <algorithm>
 #include <type_traits>
 #include <limits>
+#include <functional>
+#include <stdexcept>
 
 #include <atlas/string_algo.h>
 
@@ -102,7 +104,7 @@ namespace atlas {
      *  @param  str  Source C string.
      */
     basic_inplace_string(const T* str) {
-      while (*str && _size <= capacity()) {
+      while (*str && _size < capacity()) {
         _data[_size++] = *str++;
       }
 
@@ -1569,7 +1571,7 @@ namespace atlas {
   // 1.
   template<typename T, std::size_t N, typename Traits, typename T2, std::size_t N2, typename Traits2>
   inline bool operator==(const basic_inplace_string<T, N, Traits>& one, const basic_inplace_string<T2, N2, Traits2>& two) {
-    return one.compare(two) == 0;
+    return equal_unchecked(one.data(), one.size(), two.data(), two.size());
   }
 
   // 2.
@@ -1587,7 +1589,7 @@ namespace atlas {
   // 4.
   template<typename T, std::size_t N, typename Traits, typename T2, typename Traits2, typename Alloc>
   inline bool operator==(const basic_inplace_string<T, N, Traits>& one, const std::basic_string<T2, Traits2, Alloc>& two) {
-    return one.compare(two) == 0;
+    return equal_unchecked(one.data(), one.size(), two.data(), two.size());
   }
 
   // 5.
@@ -1799,4 +1801,16 @@ namespace atlas {
 
 } // atlas
 
+namespace std {
+
+  // hashed as the std::string of the same characters is, so they can be looked up by each other
+  template<typename T, std::size_t N, typename Traits>
+  struct hash<atlas::basic_inplace_string<T, N, Traits>> {
+    size_t operator()(const atlas::basic_inplace_string<T, N, Traits>& str) const {
+      return std::_Hash_impl::hash(str.data(), str.size() * sizeof(T));
+    }
+  };
+
+} // std
+
 #endif /* ATLAS_BASIC_INPLACE_STRING_H_ */
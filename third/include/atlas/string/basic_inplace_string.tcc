@@ -263,19 +263,12 @@ namespace atlas {
   typename basic_inplace_string<T, N, Traits>::size_type
   basic_inplace_string<T, N, Traits>::find(const T* s, size_type pos, size_type n) const {
     const size_type sz = size();
-    const T* d = data();
 
     if (n == 0) return pos <= sz ? pos : npos;
+    if (pos >= sz) return npos;
 
-    if (n <= sz) {
-      for (; pos <= sz - n; ++pos) {
-        if (traits_type::eq(d[pos], s[0]) && traits_type::compare(d + pos + 1, s + 1, n - 1) == 0) {
-          return pos;
-        }
-      } // for
-    } // if
-
-    return npos;
+    const size_type i = detail::string_kernels<T, traits_type>::find(data() + pos, sz - pos, s, n);
+    return i == sz - pos ? npos : pos + i;
   }
 
   template<typename T, size_t N, typename Traits>
@@ -327,12 +320,11 @@ namespace atlas {
   template<typename T, size_t N, typename Traits>
   typename basic_inplace_string<T, N, Traits>::size_type
   basic_inplace_string<T, N, Traits>::find_first_of(const T* s, size_type pos, size_type n) const {
-    for (; n && pos < size(); ++pos) {
-      const T* p = traits_type::find(s, n, _data[pos]);
-      if (p) return pos;
-    }
+    const size_type sz = size();
+    if (!n || pos >= sz) return npos;
 
-    return npos;
+    const size_type i = detail::string_kernels<T, traits_type>::find_first_of(data() + pos, sz - pos, s, n);
+    return i == sz - pos ? npos : pos + i;
   }
 
   template<typename T, size_t N, typename Traits>
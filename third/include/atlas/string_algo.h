@@ -8,43 +8,224 @@
 #ifndef ATLAS_ALGORITHM_H_
 #define ATLAS_ALGORITHM_H_
 
+#include <cstdint>
+#include <cstring>
 #include <string>
+#include <cstddef>
+#include <limits>
 #include <type_traits>
 #include <algorithm>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
 namespace atlas {
 
-  namespace {
+  // -1, 0 or 1, the difference of two unsigned sizes does not tell the order once it's beyond an int
+  template<typename T>
+  inline int compare(T n, T n2) {
+    return n < n2 ? -1 : (n2 < n ? 1 : 0);
+  }
 
-    template<typename UnsignedLong>
-    int compare_unsigned_long(UnsignedLong n, UnsignedLong n2) {
-      static_assert(std::is_unsigned<UnsignedLong>::value, "used for unsigned");
+  namespace detail {
 
-      const static size_t min_int = std::numeric_limits<int>::min();
-      const static size_t max_int = std::numeric_limits<int>::max();
+    /*
+     * The kernels of the strings, the generic ones go through the traits. The chars of the standard traits are
+     * compared with the SIMD instructions a vector at a time if the build enables SSE2, AVX2 doubles the width,
+     * build with -mavx2 to enable it, as node_search.h. The loads never cross the ends of the strings, so the
+     * tails are done a char at a time
+     * */
+    template<typename Ch, typename Traits>
+    struct string_kernels {
 
-      const size_t d = size_t(n - n2);
+      static int compare(const Ch* s, const Ch* s2, size_t n) { return Traits::compare(s, s2, n); }
 
-      if (d > max_int) return std::numeric_limits<int>::max();
-      else if (d < min_int) return std::numeric_limits<int>::min();
-      else return int(d);
-    }
-  } // anonymous
+      // the first position of the pattern in the text, n if it's not there, the pattern is not empty
+      static size_t find(const Ch* text, size_t n, const Ch* s, size_t sn) {
+        if (sn > n) return n;
 
-  template<typename T>
-  int compare(T n, T n2) {
-    return n < n2;
-  }
+        for (size_t pos = 0; pos <= n - sn; ++pos) {
+          if (Traits::eq(text[pos], s[0]) && Traits::compare(text + pos + 1, s + 1, sn - 1) == 0) return pos;
+        }
 
-  template<>
-  int compare(unsigned long n, unsigned long n2) {
-    return compare_unsigned_long(n, n2);
-  }
+        return n;
+      }
 
-  template<>
-  int compare(unsigned long long n, unsigned long long n2) {
-    return compare_unsigned_long(n, n2);
-  }
+      // the first position of any char of the set, n if there is none
+      static size_t find_first_of(const Ch* text, size_t n, const Ch* set, size_t sn) {
+        for (size_t pos = 0; pos < n; ++pos) {
+          if (Traits::find(set, sn, text[pos])) return pos;
+        }
+
+        return n;
+      }
+    };
+
+#if defined(__SSE2__)
+
+    template<>
+    struct string_kernels<char, std::char_traits<char>> {
+
+      // the sets of up to so many chars are compared a char of the set at a time, the bigger ones are looked up
+      // in a bitmap
+      static const size_t max_vector_set = 8;
+
+      // the first position the strings differ at, n if they don't
+      static size_t mismatch(const char* s, const char* s2, size_t n) {
+        size_t i = 0;
+
+#if defined(__AVX2__)
+        for (; i + 32 <= n; i += 32) {
+          __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(s + i));
+          __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(s2 + i));
+
+          uint32_t mask = ~static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(a, b)));
+          if (mask) return i + __builtin_ctz(mask);
+        }
+#endif
+
+        for (; i + 16 <= n; i += 16) {
+          __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + i));
+          __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s2 + i));
+
+          uint32_t mask = ~static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(a, b))) & 0xffff;
+          if (mask) return i + __builtin_ctz(mask);
+        }
+
+        for (; i < n; ++i) {
+          if (s[i] != s2[i]) return i;
+        }
+
+        return n;
+      }
+
+      // the chars are unsigned, as memcmp
+      static int compare(const char* s, const char* s2, size_t n) {
+        size_t i = mismatch(s, s2, n);
+        if (i == n) return 0;
+
+        return static_cast<unsigned char>(s[i]) < static_cast<unsigned char>(s2[i]) ? -1 : 1;
+      }
+
+      // the candidates are the positions both the first and the last char of the pattern match at, only they
+      // are compared in whole, so a text with few of them is scanned a vector at a time
+      static size_t find(const char* text, size_t n, const char* s, size_t sn) {
+        if (sn > n) return n;
+
+        if (sn == 1) {
+          const void* p = std::memchr(text, s[0], n);
+          return p ? static_cast<const char*>(p) - text : n;
+        }
+
+        // the positions the pattern may start at
+        const size_t end = n - sn + 1;
+        size_t pos = 0;
+
+#if defined(__AVX2__)
+        const __m256i first32 = _mm256_set1_epi8(s[0]);
+        const __m256i last32 = _mm256_set1_epi8(s[sn - 1]);
+
+        for (; pos + 32 <= end; pos += 32) {
+          __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(text + pos));
+          __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(text + pos + sn - 1));
+
+          uint32_t mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(a, first32), _mm256_cmpeq_epi8(b, last32)));
+          for (; mask; mask &= mask - 1) {
+            size_t at = pos + __builtin_ctz(mask);
+            if (std::memcmp(text + at + 1, s + 1, sn - 2) == 0) return at;
+          }
+        }
+#endif
+
+        const __m128i first16 = _mm_set1_epi8(s[0]);
+        const __m128i last16 = _mm_set1_epi8(s[sn - 1]);
+
+        for (; pos + 16 <= end; pos += 16) {
+          __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(text + pos));
+          __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(text + pos + sn - 1));
+
+          uint32_t mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first16), _mm_cmpeq_epi8(b, last16)));
+          for (; mask; mask &= mask - 1) {
+            size_t at = pos + __builtin_ctz(mask);
+            if (std::memcmp(text + at + 1, s + 1, sn - 2) == 0) return at;
+          }
+        }
+
+        for (; pos < end; ++pos) {
+          if (text[pos] == s[0] && text[pos + sn - 1] == s[sn - 1] && std::memcmp(text + pos + 1, s + 1, sn - 2) == 0) {
+            return pos;
+          }
+        }
+
+        return n;
+      }
+
+      static size_t find_first_of(const char* text, size_t n, const char* set, size_t sn) {
+        if (!sn) return n;
+
+        if (sn == 1) return find(text, n, set, 1);
+
+        if (sn > max_vector_set) {
+          uint64_t bits[4] = { 0, 0, 0, 0 };
+          for (size_t j = 0; j < sn; ++j) {
+            unsigned char c = set[j];
+            bits[c >> 6] |= uint64_t(1) << (c & 63);
+          }
+
+          for (size_t pos = 0; pos < n; ++pos) {
+            unsigned char c = text[pos];
+            if (bits[c >> 6] & (uint64_t(1) << (c & 63))) return pos;
+          }
+
+          return n;
+        }
+
+        size_t pos = 0;
+
+#if defined(__AVX2__)
+        __m256i set32[max_vector_set];
+        for (size_t j = 0; j < sn; ++j) set32[j] = _mm256_set1_epi8(set[j]);
+
+        for (; pos + 32 <= n; pos += 32) {
+          __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(text + pos));
+
+          __m256i hit = _mm256_cmpeq_epi8(v, set32[0]);
+          for (size_t j = 1; j < sn; ++j) hit = _mm256_or_si256(hit, _mm256_cmpeq_epi8(v, set32[j]));
+
+          uint32_t mask = _mm256_movemask_epi8(hit);
+          if (mask) return pos + __builtin_ctz(mask);
+        }
+#endif
+
+        __m128i set16[max_vector_set];
+        for (size_t j = 0; j < sn; ++j) set16[j] = _mm_set1_epi8(set[j]);
+
+        for (; pos + 16 <= n; pos += 16) {
+          __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(text + pos));
+
+          __m128i hit = _mm_cmpeq_epi8(v, set16[0]);
+          for (size_t j = 1; j < sn; ++j) hit = _mm_or_si128(hit, _mm_cmpeq_epi8(v, set16[j]));
+
+          uint32_t mask = _mm_movemask_epi8(hit);
+          if (mask) return pos + __builtin_ctz(mask);
+        }
+
+        for (; pos < n; ++pos) {
+          if (std::memchr(set, text[pos], sn)) return pos;
+        }
+
+        return n;
+      }
+    };
+
+#endif
+
+  } // detail
 
   /**
    *  @brief  Compare a character %array against another.
@@ -61,12 +242,18 @@ namespace atlas {
   int compare_unchecked(const Ch* s, size_t n, const Ch* s2, size_t n2) {
     const size_t len = std::min(n, n2);
 
-    int r = Traits::compare(s, s2, len);
+    int r = detail::string_kernels<Ch, Traits>::compare(s, s2, len);
     if (!r) r = compare(n, n2);
 
     return r;
   }
 
+  // the sizes first, the chars only if they are the same
+  template<typename Ch, typename Traits = std::char_traits<Ch>>
+  bool equal_unchecked(const Ch* s, size_t n, const Ch* s2, size_t n2) {
+    return n == n2 && detail::string_kernels<Ch, Traits>::compare(s, s2, n) == 0;
+  }
+
   // From gcc-4.7 STL : When n = 1 way faster than the general multichar
   // Traits::copy/move/assign.
   template<typename Ch, typename Traits = std::char_traits<Ch>>
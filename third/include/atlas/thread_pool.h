@@ -17,6 +17,8 @@ namespace atlas {
   typedef boostplus::threadpool::fifo_pool fifo_thread_pool;
   typedef boostplus::threadpool::lifo_pool lifo_thread_pool;
   typedef boostplus::threadpool::prio_pool prio_thread_pool;
+  typedef boostplus::threadpool::ws_pool ws_thread_pool;
+  typedef boostplus::threadpool::adaptive_pool adaptive_thread_pool;
 
 } // atlas
 
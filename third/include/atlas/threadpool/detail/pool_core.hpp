@@ -22,6 +22,8 @@
 #define THREADPOOL_POOL_CORE_HPP_INCLUDED
 
 #include "worker_thread.hpp"
+#include "pool_stats.hpp"
+#include "../scheduling_policies.hpp"
 
 #include <vector>
 #include <map>
@@ -29,9 +31,11 @@
 #include <memory>
 #include <thread>
 #include <mutex>
+#include <chrono>
 #include <condition_variable>
 #include <type_traits>
 #include <functional>
+#include <iostream>
 
 namespace boostplus {
   namespace threadpool {
@@ -48,12 +52,12 @@ namespace boostplus {
        * A pool_impl is DefaultConstructible and NonCopyable.
        *
        * \param Task A function object which implements the operator 'void operator() (void) const'. The operator () is called by the pool to execute the task. Exceptions are ignored.
-       * \param Scheduler A task container which determines how tasks are scheduled. It is guaranteed that this container is accessed only by one thread at a time. The scheduler shall not throw exceptions.
+       * \param Scheduler A task container which determines how tasks are scheduled. It is guaranteed that this container is accessed only by one thread at a time, unless it's a concurrent one, see is_concurrent_scheduler. The scheduler shall not throw exceptions.
        *
        * \remarks The pool class is thread-safe.
        *
        * \see Tasks: task_func, prio_task_func
-       * \see Scheduling policies: fifo_scheduler, lifo_scheduler, prio_scheduler
+       * \see Scheduling policies: fifo_scheduler, lifo_scheduler, prio_scheduler, work_stealing_scheduler
        */
       template
       <
@@ -95,6 +99,9 @@ namespace boostplus {
           _worker_count(0),
           _target_worker_count(0),
           _active_worker_count(0),
+          _sleeping_workers(0),
+          _worker_init_version(0),
+          _retired_workers(0),
           _terminate_all_workers(false)
         {
           pool_type& self_ref = *this;
@@ -126,31 +133,43 @@ namespace boostplus {
 
         /*! Schedules a task for asynchronous execution. The task will be executed once only.
          * \param task The task function object. It should not throw execeptions.
-         * \return true, if the task could be scheduled and false otherwise.
+         * \return true, if the task could be scheduled and false otherwise, a rejected task is not moved from.
          */
         bool schedule(const task_type& task) {
-          std::lock_guard<std::mutex> guard(_monitor);
+          return schedule(task_type(task));
+        }
 
-          if (_scheduler.push(task)) {
-            _task_or_terminate_workers_event.notify_one();
-            return true;
-          }
+        bool schedule(task_type&& task) {
+          task.set_enqueued(pool_stats::now());
+          if (!schedule(std::move(task), is_concurrent_scheduler<scheduler_type>())) return false;
 
-          return false;
+          _size_policy->task_scheduled();
+          return true;
         }
 
-        bool schedule(task_type&& task) {
-          std::lock_guard<std::mutex> guard(_monitor);
+        /*! Schedules a batch of tasks at once, the scheduler is locked once and the workers are woken once for the batch.
+         * The tasks are moved from the range in order until the scheduler refuses one.
+         * \param first The first task of the range, the tasks should not throw exceptions.
+         * \param last The end of the range.
+         * \return The number of tasks scheduled, the rest of the range is not moved from.
+         */
+        template<typename Iterator>
+        size_t schedule_bulk(Iterator first, Iterator last) {
+          size_t scheduled = schedule_bulk(first, last, is_concurrent_scheduler<scheduler_type>());
+          if (scheduled) _size_policy->task_scheduled();
 
-          // _monitor.try_lock();
-          // _monitor.spin();
+          return scheduled;
+        }
 
-          if (_scheduler.push(task)) {
-            _task_or_terminate_workers_event.notify_one();
-            return true;
-          }
+        /*! Sets a function every worker calls in it's own thread, for example, to set it's CPU affinity.
+         * The running workers call it before their next task, the new ones before their first task.
+         * \param init The function, it should not throw exceptions.
+         */
+        void set_worker_init(const std::function<void()>& init) {
+          std::lock_guard<std::mutex> guard(_monitor);
 
-          return false;
+          _worker_init = init;
+          ++_worker_init_version;
         }
 
         /*! Returns the number of tasks which are currently executed.
@@ -168,6 +187,36 @@ namespace boostplus {
           return _scheduler.size();
         }
 
+        /*! Returns the statistics of the pool, without taking the pool's lock, for example, to alert on the
+         *  queue delay, or to size the pool by it. The queue delay of a task is the time from it's schedule to
+         *  it's start.
+         * \return The snapshot of the statistics since the pool is created.
+         */
+        pool_statistics statistics() const {
+          pool_statistics result = _stats.snapshot();
+          result.workers = _worker_count.load();
+          result.steals = steals_of(_scheduler);
+          result.remote_takes = remote_takes_of(_scheduler);
+
+          return result;
+        }
+
+        /*! Bounds the pending tasks, a schedule fails once there are so many, the scheduler must support it.
+         * \param max_pending The maximum number of pending tasks, 0 means unbounded.
+         */
+        void set_max_pending(size_t max_pending) {
+          std::lock_guard<std::mutex> guard(_monitor);
+          _scheduler.set_capacity(max_pending);
+        }
+
+        /*! Keeps the tasks on the NUMA node they are scheduled on, the scheduler must support it.
+         * \param nodes The nodes, 1 for none.
+         */
+        void set_numa_nodes(size_t nodes) {
+          std::lock_guard<std::mutex> guard(_monitor);
+          _scheduler.set_numa_nodes(nodes);
+        }
+
         /*! Removes all pending tasks from the pool's scheduler.
          */
         void clear() {
@@ -311,17 +360,192 @@ namespace boostplus {
         void worker_destructed(std::shared_ptr<worker_type> worker) {
           std::lock_guard<std::mutex> guard(_monitor);
 
-          _worker_count--;
+          // a retired worker is no longer counted, see wait_for_task
+          if (_retired_workers > 0) _retired_workers--;
+          else _worker_count--;
           _active_worker_count--;
           _worker_idle_or_terminated_event.notify_all();
 
           if (_terminate_all_workers) {
             _terminated_workers.push_back(worker);
           }
+          else {
+            // shrunk, nobody joins it
+            worker->detach();
+          }
+        }
+
+        bool schedule(task_type&& task, std::false_type) {
+          std::lock_guard<std::mutex> guard(_monitor);
+
+          if (_scheduler.push(std::move(task))) {
+            _task_or_terminate_workers_event.notify_one();
+            return true;
+          }
+
+          return false;
+        }
+
+        // lock free, the lock is taken only if there is a sleeping worker to notify
+        bool schedule(task_type&& task, std::true_type) {
+          if (!_scheduler.push(std::move(task))) return false;
+
+          wake_one();
+          return true;
+        }
+
+        template<typename Iterator>
+        size_t schedule_bulk(Iterator first, Iterator last, std::false_type) {
+          std::lock_guard<std::mutex> guard(_monitor);
+
+          size_t scheduled = 0;
+          int64_t now = pool_stats::now();
+          for (; first != last && _scheduler.push(stamped(*first, now)); ++first) ++scheduled;
+
+          notify(scheduled);
+          return scheduled;
+        }
+
+        template<typename Iterator>
+        size_t schedule_bulk(Iterator first, Iterator last, std::true_type) {
+          size_t scheduled = 0;
+          int64_t now = pool_stats::now();
+          for (; first != last && _scheduler.push(stamped(*first, now)); ++first) ++scheduled;
+
+          // a woken worker passes the wake up on while there is more to do, see execute_task
+          if (scheduled && _sleeping_workers.load() > 0) {
+            std::lock_guard<std::mutex> guard(_monitor);
+            notify(scheduled);
+          }
+
+          return scheduled;
+        }
+
+        // the tasks of a batch are scheduled at the same time
+        static task_type&& stamped(task_type& task, int64_t now) {
+          task.set_enqueued(now);
+          return std::move(task);
+        }
+
+        // the schedulers other than the work stealing one never steal
+        template<typename Scheduler>
+        static unsigned long long steals_of(const Scheduler&) { return 0; }
+
+        template<typename T>
+        static unsigned long long steals_of(const work_stealing_scheduler<T>& scheduler) { return scheduler.steals(); }
+
+        template<typename Scheduler>
+        static unsigned long long remote_takes_of(const Scheduler&) { return 0; }
+
+        template<typename T>
+        static unsigned long long remote_takes_of(const work_stealing_scheduler<T>& scheduler) { return scheduler.remote_takes(); }
+
+        // wakes a worker per task, but not more than there are, the monitor is locked
+        void notify(size_t tasks) {
+          if (tasks >= _worker_count) {
+            _task_or_terminate_workers_event.notify_all();
+          }
+          else {
+            for (size_t i = 0; i < tasks; ++i) _task_or_terminate_workers_event.notify_one();
+          }
+        }
+
+        /*
+         * The scheduler counts the task before the check, and a sleeping worker counts itself before
+         * it checks the scheduler under the lock, both are sequentially consistent, so either the worker
+         * sees the task, or we see the worker and notify it after it's waiting
+         * */
+        void wake_one() {
+          if (_sleeping_workers.load() > 0) {
+            std::lock_guard<std::mutex> guard(_monitor);
+            _task_or_terminate_workers_event.notify_one();
+          }
+        }
+
+        // the version the worker has applied is kept by the worker, see worker_thread::run
+        void init_worker(size_t& version) {
+          if (version == _worker_init_version.load(std::memory_order_acquire)) return;
+
+          std::function<void()> init;
+          {
+            std::lock_guard<std::mutex> guard(_monitor);
+            init = _worker_init;
+            version = _worker_init_version;
+          }
+
+          if (init) init();
+        }
+
+        /*
+         * Wait under the lock until notified, return false if the size policy retires the worker after
+         * it's idle timeout. A retired worker is uncounted at once, so the others don't take the smaller
+         * target for theirs and terminate as well
+         * */
+        bool wait_for_task(std::unique_lock<std::mutex>& lock) {
+          _size_policy->queue_empty();
+
+          _active_worker_count--;
+          _worker_idle_or_terminated_event.notify_all();
+
+          bool retire = false;
+          std::chrono::steady_clock::duration timeout = _size_policy->idle_timeout();
+          if (timeout == std::chrono::steady_clock::duration::zero()) {
+            _task_or_terminate_workers_event.wait(lock);
+          }
+          else if (_task_or_terminate_workers_event.wait_for(lock, timeout) == std::cv_status::timeout) {
+            retire = _size_policy->retire_idle_worker();
+          }
+
+          _active_worker_count++;
+
+          if (retire) {
+            _worker_count--;
+            _target_worker_count--;
+            _retired_workers++;
+          }
+
+          return !retire;
         }
 
         bool execute_task() {
-          std::function<void()> task;
+          return execute_task(is_concurrent_scheduler<scheduler_type>());
+        }
+
+        bool execute_task(std::true_type) {
+          if (_worker_count > _target_worker_count) {
+            return false; // terminate worker
+          }
+
+          task_type task;
+          while (!_scheduler.try_pop(task)) {
+            std::unique_lock<std::mutex> lock(_monitor);
+
+            if (_worker_count > _target_worker_count) {
+              return false; // terminate worker
+            }
+
+            bool retire = false;
+
+            ++_sleeping_workers;
+            if (_scheduler.empty()) retire = !wait_for_task(lock);
+            --_sleeping_workers;
+
+            if (retire) return false;
+          }
+
+          // one notify per schedule, pass it on if there is more to do
+          if (!_scheduler.empty()) wake_one();
+          else _size_policy->queue_empty();
+
+          int64_t start = _stats.task_started(task.enqueued());
+          task();
+          _stats.task_finished(start);
+
+          return true;
+        }
+
+        bool execute_task(std::false_type) {
+          task_type task;
 
           { // fetch task
             std::unique_lock<std::mutex> lock(_monitor);
@@ -337,22 +561,21 @@ namespace boostplus {
               if (_worker_count > _target_worker_count) {
                 return false; // terminate worker
               }
-              else {
-                _active_worker_count--;
-                _worker_idle_or_terminated_event.notify_all();
-                _task_or_terminate_workers_event.wait(lock);
-                _active_worker_count++;
+              else if (!wait_for_task(lock)) {
+                return false; // retired
               }
             }
 
-            task = _scheduler.top();
+            task = std::move(_scheduler.top());
             _scheduler.pop();
+
+            if (_scheduler.empty()) _size_policy->queue_empty();
           }
 
           // call task function
-          if (task) {
-            task();
-          }
+          int64_t start = _stats.task_started(task.enqueued());
+          task();
+          _stats.task_finished(start);
 
           //guard->disable();
           return true;
@@ -364,10 +587,16 @@ namespace boostplus {
         std::atomic<size_t> _worker_count;
         std::atomic<size_t> _target_worker_count;
         std::atomic<size_t> _active_worker_count;
+        std::atomic<size_t> _sleeping_workers; // used with a concurrent scheduler only
+        pool_stats _stats; // written by the workers, read by anyone without the lock
 
         // The following members are accessed only by _one_ thread at the same time:
         scheduler_type _scheduler;
         std::unique_ptr<size_policy_type> _size_policy; // is never null
+        std::function<void()> _worker_init;
+        std::atomic<size_t> _worker_init_version;
+
+        std::atomic<size_t> _retired_workers; // retired but not destructed yet
 
         // Indicates if termination of all workers was triggered.
         std::atomic<bool> _terminate_all_workers;
@@ -0,0 +1,202 @@
+/*! \file
+ * \brief The statistics of a thread pool.
+ *
+ * How long the tasks wait in the queue, how long the workers are busy, and how many tasks are executed and stolen,
+ * recorded by the workers and read by anyone without the pool's lock.
+ *
+ * Use, modification, and distribution are  subject to the
+ * boostplus Software License, Version 1.0. (See accompanying  file
+ * LICENSE_1_0.txt or copy at http://www.boostplus.org/LICENSE_1_0.txt)
+ *
+ */
+
+#ifndef THREADPOOL_DETAIL_POOL_STATS_HPP_INCLUDED
+#define THREADPOOL_DETAIL_POOL_STATS_HPP_INCLUDED
+
+#include <cstddef>
+#include <cstdint>
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+
+#include <atlas/sharded_counter.h>
+
+namespace boostplus {
+  namespace threadpool {
+
+    /*! \brief A snapshot of the statistics of a pool.
+     *
+     * The queue delays are counted in buckets of powers of 2 nanoseconds, the bucket i counts the delays less than
+     * 2^(min_exponent + i) ns, from 1 microsecond up, and the last one counts the rest.
+     *
+     * \see pool_core::statistics
+     */
+    struct pool_statistics {
+      static const int min_exponent = 10;
+      static const size_t bucket_count = 32;
+
+      pool_statistics() : time(0), workers(0), executed(0), steals(0), remote_takes(0), busy(0), delay_sum(0), delay_max(0) {
+        delays.fill(0);
+      }
+
+      static size_t bucket(uint64_t ns) {
+        if (ns < (uint64_t(1) << min_exponent)) return 0;
+
+        size_t e = 64 - __builtin_clzll(ns);
+        return std::min(e - min_exponent, bucket_count - 1);
+      }
+
+      //! The largest delay counted in the bucket.
+      static uint64_t upper_bound(size_t i) {
+        return i + 1 < bucket_count ? (uint64_t(1) << (min_exponent + i)) - 1 : UINT64_MAX;
+      }
+
+      /*! The queue delay q of the tasks waited no longer than, in nanoseconds, for example 0.99.
+       */
+      uint64_t delay_percentile(double q) const {
+        if (executed == 0) return 0;
+
+        uint64_t rank = static_cast<uint64_t>(q * executed);
+        if (rank >= executed) rank = executed - 1;
+
+        uint64_t seen = 0;
+        for (size_t i = 0; i < bucket_count; ++i) {
+          seen += delays[i];
+          if (seen > rank) return std::min(upper_bound(i), delay_max);
+        }
+
+        return delay_max;
+      }
+
+      uint64_t delay_mean() const { return executed ? delay_sum / executed : 0; }
+
+      /*! The part of the time the workers were busy since the earlier snapshot, 0 ~ 1.
+       */
+      double utilization_since(const pool_statistics& earlier) const {
+        int64_t elapsed = time - earlier.time;
+        size_t capacity = std::max(workers, earlier.workers);
+        if (elapsed <= 0 || capacity == 0) return 0;
+
+        return std::min(1.0, static_cast<double>(busy - earlier.busy) / (static_cast<double>(elapsed) * capacity));
+      }
+
+      int64_t time;             //!< When it's taken, in nanoseconds of the steady clock.
+      size_t workers;           //!< The worker threads.
+      uint64_t executed;        //!< The tasks executed.
+      uint64_t steals;          //!< The tasks a worker took from another, by a work stealing scheduler.
+      uint64_t remote_takes;    //!< The tasks a worker took off another NUMA node, by a work stealing scheduler.
+      uint64_t busy;            //!< The time the workers spent in the tasks, in nanoseconds.
+
+      std::array<uint64_t, bucket_count> delays;
+      uint64_t delay_sum;
+      uint64_t delay_max;
+    };
+
+    namespace detail {
+
+      /*! \brief The statistics recorded by the workers of a pool.
+       *
+       * Every worker counts into it's own shard, the shards are on their own cache lines, so the workers never share
+       * a line, a snapshot sums them with relaxed loads, it's not atomic as a whole, it's for the monitoring.
+       */
+      class pool_stats {
+      public:
+
+        typedef std::chrono::steady_clock clock;
+
+        static const size_t shard_count = 16;
+
+      public:
+
+        pool_stats() {
+          for (shard& s : _shards) {
+            for (std::atomic<uint64_t>& d : s.delays) d.store(0, std::memory_order_relaxed);
+            s.executed.store(0, std::memory_order_relaxed);
+            s.busy.store(0, std::memory_order_relaxed);
+            s.delay_sum.store(0, std::memory_order_relaxed);
+            s.delay_max.store(0, std::memory_order_relaxed);
+          }
+        }
+
+        pool_stats(const pool_stats&) = delete;
+        pool_stats& operator=(const pool_stats&) = delete;
+
+      public:
+
+        //! The time stamped on a task when it's scheduled, in ticks of the steady clock.
+        static int64_t now() { return clock::now().time_since_epoch().count(); }
+
+        //! A task scheduled at the time starts now, returns the start.
+        int64_t task_started(int64_t enqueued) {
+          int64_t start = now();
+          shard& s = local();
+
+          uint64_t delay = enqueued > 0 && start > enqueued ? to_ns(start - enqueued) : 0;
+          increase(s.delays[pool_statistics::bucket(delay)], 1);
+          increase(s.delay_sum, delay);
+          if (delay > s.delay_max.load(std::memory_order_relaxed)) s.delay_max.store(delay, std::memory_order_relaxed);
+
+          return start;
+        }
+
+        //! The task started at the time is done.
+        void task_finished(int64_t start) {
+          shard& s = local();
+
+          increase(s.busy, to_ns(now() - start));
+          increase(s.executed, 1);
+        }
+
+        pool_statistics snapshot() const {
+          pool_statistics result;
+          result.time = to_ns(now());
+
+          for (const shard& s : _shards) {
+            for (size_t i = 0; i < pool_statistics::bucket_count; ++i) result.delays[i] += s.delays[i].load(std::memory_order_relaxed);
+
+            result.executed += s.executed.load(std::memory_order_relaxed);
+            result.busy += s.busy.load(std::memory_order_relaxed);
+            result.delay_sum += s.delay_sum.load(std::memory_order_relaxed);
+            result.delay_max = std::max<uint64_t>(result.delay_max, s.delay_max.load(std::memory_order_relaxed));
+          }
+
+          return result;
+        }
+
+      private:
+
+        static const size_t cache_line_size = 64;
+
+        // a shard is written by it's workers, mostly one, so the lines are rarely contended. The shards are
+        // padded rather than aligned, the pool core is created by new which does not honour an alignment
+        // above the default one
+        struct shard {
+          std::array<std::atomic<uint64_t>, pool_statistics::bucket_count> delays;
+          std::atomic<uint64_t> executed;
+          std::atomic<uint64_t> busy;
+          std::atomic<uint64_t> delay_sum;
+          std::atomic<uint64_t> delay_max;
+          // the next shard starts a line later, wherever this one starts
+          char padding[cache_line_size];
+        };
+
+        shard& local() { return _shards[atlas::detail::counter_thread_index() & (shard_count - 1)]; }
+
+        static void increase(std::atomic<uint64_t>& c, uint64_t n) { c.fetch_add(n, std::memory_order_relaxed); }
+
+        static uint64_t to_ns(int64_t ticks) {
+          return std::chrono::duration_cast<std::chrono::nanoseconds>(clock::duration(ticks)).count();
+        }
+
+      private:
+
+        char _padding[cache_line_size];
+        shard _shards[shard_count];
+      };
+
+    } // detail
+  } // threadpool
+} // boostplus
+
+#endif // THREADPOOL_DETAIL_POOL_STATS_HPP_INCLUDED
@@ -0,0 +1,105 @@
+/*! \file
+ * \brief A bounded ring of tasks.
+ *
+ * The bounded queue by Dmitry Vyukov, the tasks are kept in the slots, so a push allocates nothing.
+ *
+ * Use, modification, and distribution are  subject to the
+ * boostplus Software License, Version 1.0. (See accompanying  file
+ * LICENSE_1_0.txt or copy at http://www.boostplus.org/LICENSE_1_0.txt)
+ *
+ */
+
+#ifndef THREADPOOL_DETAIL_TASK_RING_HPP_INCLUDED
+#define THREADPOOL_DETAIL_TASK_RING_HPP_INCLUDED
+
+#include <cstdint>
+#include <atomic>
+#include <memory>
+#include <utility>
+
+namespace boostplus {
+  namespace threadpool {
+    namespace detail {
+
+      /*! \brief A bounded multiple producer queue of tasks.
+       *
+       * Any thread may push, pop is called by one thread at a time, the caller serializes the pops.
+       * A slot is published by it's sequence number, so a push in progress is not seen by pop until it's done.
+       *
+       * \param T The task type, which is move assignable.
+       */
+      template<typename T>
+      class task_ring {
+      public:
+
+        //! \param capacity A power of 2.
+        explicit task_ring(size_t capacity = 4096) :
+            _mask(capacity - 1), _slots(new slot[capacity]), _enqueue_pos(0), _dequeue_pos(0) {
+          for (size_t i = 0; i < capacity; ++i) _slots[i].seq.store(i, std::memory_order_relaxed);
+        }
+
+        task_ring(const task_ring&) = delete;
+        task_ring& operator=(const task_ring&) = delete;
+
+      public:
+
+        //! Any thread, the task is left untouched if the ring is full.
+        bool try_push(T&& task) {
+          size_t pos = _enqueue_pos.load(std::memory_order_relaxed);
+          slot* s = nullptr;
+
+          for (;;) {
+            s = &_slots[pos & _mask];
+            size_t seq = s->seq.load(std::memory_order_acquire);
+            intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+
+            if (diff == 0) {
+              if (_enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+            }
+            else if (diff < 0) {
+              return false; // full
+            }
+            else {
+              pos = _enqueue_pos.load(std::memory_order_relaxed);
+            }
+          }
+
+          s->task = std::move(task);
+          s->seq.store(pos + 1, std::memory_order_release);
+
+          return true;
+        }
+
+        //! One thread at a time.
+        bool try_pop(T& task) {
+          size_t pos = _dequeue_pos.load(std::memory_order_relaxed);
+          slot& s = _slots[pos & _mask];
+
+          if (s.seq.load(std::memory_order_acquire) != pos + 1) return false;
+
+          task = std::move(s.task);
+          s.seq.store(pos + _mask + 1, std::memory_order_release);
+          _dequeue_pos.store(pos + 1, std::memory_order_relaxed);
+
+          return true;
+        }
+
+      private:
+
+        struct slot {
+          std::atomic<size_t> seq;
+          T task;
+        };
+
+        const size_t _mask;
+        std::unique_ptr<slot[]> _slots;
+
+        std::atomic<size_t> _enqueue_pos;
+        std::atomic<size_t> _dequeue_pos;
+      };
+
+    } // detail
+  } // threadpool
+} // boostplus
+
+#endif // THREADPOOL_DETAIL_TASK_RING_HPP_INCLUDED
@@ -84,9 +84,15 @@ namespace boostplus {
         /*! Executes pool's tasks sequentially.
          */
         void run() {
+          // the thread is not started until the worker holds it, see create_and_attach
+          { std::lock_guard<std::mutex> guard(_starting); }
+
           scope_guard notify_exception(std::bind(&worker_thread::died_unexpectedly, this));
 
-          while (_pool->execute_task()) {}
+          size_t init_version = 0;
+          do {
+            _pool->init_worker(init_version);
+          } while (_pool->execute_task());
 
           notify_exception.disable();
           _pool->worker_destructed(this->shared_from_this());
@@ -98,6 +104,12 @@ namespace boostplus {
           _thread->join();
         }
 
+        /*! Detaches the worker's thread, called in the thread itself when it's not going to be joined.
+         */
+        void detach() {
+          if (_thread && _thread->joinable()) _thread->detach();
+        }
+
         /*! Constructs a new worker thread and attaches it to the pool.
          * \param pool Pointer to the pool.
          */
@@ -105,6 +117,7 @@ namespace boostplus {
           std::shared_ptr<worker_thread<Pool>> worker(new worker_thread(pool));
 
           if (worker) {
+            std::lock_guard<std::mutex> guard(worker->_starting);
             worker->_thread.reset(new std::thread(std::bind(&worker_thread::run, worker)));
           }
         }
@@ -113,6 +126,7 @@ namespace boostplus {
 
         std::shared_ptr<pool_type> _pool;
         std::shared_ptr<std::thread> _thread;
+        std::mutex _starting;
       };
     } // detail
   } // threadpool
@@ -0,0 +1,147 @@
+/*! \file
+ * \brief A work stealing deque.
+ *
+ * The Chase-Lev deque, with the memory orders given by Le, Pop, Cohen and Zappa Nardelli in
+ * "Correct and Efficient Work-Stealing for Weak Memory Models".
+ *
+ * Use, modification, and distribution are  subject to the
+ * boostplus Software License, Version 1.0. (See accompanying  file
+ * LICENSE_1_0.txt or copy at http://www.boostplus.org/LICENSE_1_0.txt)
+ *
+ */
+
+#ifndef THREADPOOL_DETAIL_WS_DEQUE_HPP_INCLUDED
+#define THREADPOOL_DETAIL_WS_DEQUE_HPP_INCLUDED
+
+#include <cstdint>
+#include <atomic>
+#include <memory>
+#include <vector>
+
+namespace boostplus {
+  namespace threadpool {
+    namespace detail {
+
+      /*! \brief A single owner, multiple thieves deque of pointers.
+       *
+       * The owner pushes and pops at the bottom, the other threads steal from the top.
+       * The deque grows when it's full, the old arrays are kept until the deque is destroyed,
+       * since a thief may be still reading them. The elements are pointers, so a steal never
+       * races with the owner on a non-trivial object.
+       *
+       * \param T The element type, the deque holds T*.
+       */
+      template<typename T>
+      class ws_deque {
+      public:
+
+        explicit ws_deque(size_t capacity = 256) : _top(0), _bottom(0) {
+          _arrays.emplace_back(new array(capacity));
+          _array.store(_arrays.back().get(), std::memory_order_relaxed);
+        }
+
+        ws_deque(const ws_deque&) = delete;
+        ws_deque& operator=(const ws_deque&) = delete;
+
+      public:
+
+        //! Owner only.
+        void push(T* x) {
+          int64_t b = _bottom.load(std::memory_order_relaxed);
+          int64_t t = _top.load(std::memory_order_acquire);
+          array* a = _array.load(std::memory_order_relaxed);
+
+          if (b - t > static_cast<int64_t>(a->size) - 1) a = grow(a, t, b);
+
+          a->put(b, x);
+          std::atomic_thread_fence(std::memory_order_release);
+          _bottom.store(b + 1, std::memory_order_relaxed);
+        }
+
+        //! Owner only, the last pushed one, nullptr if empty.
+        T* pop() {
+          int64_t b = _bottom.load(std::memory_order_relaxed) - 1;
+          array* a = _array.load(std::memory_order_relaxed);
+          _bottom.store(b, std::memory_order_relaxed);
+          std::atomic_thread_fence(std::memory_order_seq_cst);
+          int64_t t = _top.load(std::memory_order_relaxed);
+
+          if (t > b) {
+            _bottom.store(b + 1, std::memory_order_relaxed);
+            return nullptr;
+          }
+
+          T* x = a->get(b);
+          if (t == b) {
+            // the last one, race with the thieves
+            if (!_top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+              x = nullptr;
+            }
+
+            _bottom.store(b + 1, std::memory_order_relaxed);
+          }
+
+          return x;
+        }
+
+        //! Any thread, the first pushed one, nullptr if empty or lost the race.
+        T* steal() {
+          int64_t t = _top.load(std::memory_order_acquire);
+          std::atomic_thread_fence(std::memory_order_seq_cst);
+          int64_t b = _bottom.load(std::memory_order_acquire);
+
+          if (t >= b) return nullptr;
+
+          array* a = _array.load(std::memory_order_acquire);
+          T* x = a->get(t);
+
+          if (!_top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+            return nullptr;
+          }
+
+          return x;
+        }
+
+        //! Any thread, approximate.
+        bool empty() const {
+          return _bottom.load(std::memory_order_acquire) <= _top.load(std::memory_order_acquire);
+        }
+
+      private:
+
+        struct array {
+          explicit array(size_t n) : size(n), slots(new std::atomic<T*>[n]) {}
+
+          T* get(int64_t i) const { return slots[i % size].load(std::memory_order_relaxed); }
+
+          void put(int64_t i, T* x) { slots[i % size].store(x, std::memory_order_relaxed); }
+
+          const size_t size;
+          std::unique_ptr<std::atomic<T*>[]> slots;
+        };
+
+        array* grow(array* a, int64_t t, int64_t b) {
+          _arrays.emplace_back(new array(a->size * 2));
+          array* bigger = _arrays.back().get();
+
+          for (int64_t i = t; i < b; ++i) bigger->put(i, a->get(i));
+
+          _array.store(bigger, std::memory_order_release);
+          return bigger;
+        }
+
+      private:
+
+        std::atomic<int64_t> _top;
+        std::atomic<int64_t> _bottom;
+        std::atomic<array*> _array;
+
+        // accessed by the owner only
+        std::vector<std::unique_ptr<array>> _arrays;
+      };
+
+    } // detail
+  } // threadpool
+} // boostplus
+
+#endif // THREADPOOL_DETAIL_WS_DEQUE_HPP_INCLUDED
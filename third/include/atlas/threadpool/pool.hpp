@@ -52,7 +52,7 @@ namespace boostplus {
      * \remarks The pool class is thread-safe.
      *
      * \see Tasks: task_func, prio_task_func
-     * \see Scheduling policies: fifo_scheduler, lifo_scheduler, prio_scheduler
+     * \see Scheduling policies: fifo_scheduler, lifo_scheduler, prio_scheduler, work_stealing_scheduler
      */
     template
     <
@@ -94,6 +94,13 @@ namespace boostplus {
         return _core->size_controller();
       }
 
+      /*! Sets a function every worker calls in it's own thread before it's next task.
+       * \param init The function, for example, one which sets the worker's CPU affinity.
+       */
+      void set_worker_init(const std::function<void()>& init) {
+        _core->set_worker_init(init);
+      }
+
       /*! Gets the number of threads in the pool.
        * \return The number of threads.
        */
@@ -110,7 +117,17 @@ namespace boostplus {
       }
 
       bool schedule(task_type&& task) {
-        return _core->schedule(task);
+        return _core->schedule(std::move(task));
+      }
+
+      /*! Schedules a batch of tasks at once, which costs one lock and one wake up for the whole batch.
+       * \param first The first task of the range, the tasks are moved from the range.
+       * \param last The end of the range.
+       * \return The number of tasks scheduled from the front of the range, the rest are not moved from.
+       */
+      template<typename Iterator>
+      size_t schedule_bulk(Iterator first, Iterator last) {
+        return _core->schedule_bulk(first, last);
       }
 
       /*! Returns the number of tasks which are currently executed.
@@ -127,6 +144,30 @@ namespace boostplus {
         return _core->pending_tasks();
       }
 
+      /*! Returns the statistics of the pool : the queue delays, the busy time, the tasks executed and stolen.
+       * \return The snapshot, it's taken without the pool's lock.
+       * \see pool_statistics
+       */
+      pool_statistics statistics() const {
+        return _core->statistics();
+      }
+
+      /*! Bounds the pending tasks, a schedule fails once there are so many.
+       * \param max_pending The maximum number of pending tasks, 0 means unbounded.
+       * \remarks Supported by fifo_scheduler and work_stealing_scheduler.
+       */
+      void set_max_pending(size_t max_pending) {
+        _core->set_max_pending(max_pending);
+      }
+
+      /*! Keeps the tasks on the NUMA node of the thread which schedules them, before any task is scheduled.
+       * \param nodes The nodes, 1 for none, see atlas::current_numa_node.
+       * \remarks Supported by work_stealing_scheduler.
+       */
+      void set_numa_nodes(size_t nodes) {
+        _core->set_numa_nodes(nodes);
+      }
+
       /*! Removes all pending tasks from the pool's scheduler.
        */
       void clear() {
@@ -191,6 +232,23 @@ namespace boostplus {
     typedef thread_pool<prio_task_func, prio_scheduler, static_size, resize_controller,
         wait_for_all_tasks> prio_pool;
 
+    /*! \brief Work stealing pool.
+     *
+     * The pool's tasks are task_func functors, scheduled without the pool's lock,
+     * the tasks scheduled by a worker are kept by the worker unless stolen.
+     *
+     */
+    typedef thread_pool<task_func, work_stealing_scheduler, static_size, resize_controller,
+        wait_for_all_tasks> ws_pool;
+
+    /*! \brief Adaptive work stealing pool.
+     *
+     * A work stealing pool growing and shrinking between it's bounds by the queue delay, see adaptive_size.
+     *
+     */
+    typedef thread_pool<task_func, work_stealing_scheduler, adaptive_size, adaptive_controller,
+        wait_for_all_tasks> adaptive_pool;
+
   }
 }
 
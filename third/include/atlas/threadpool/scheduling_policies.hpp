@@ -23,8 +23,20 @@
 
 #include <queue>
 #include <deque>
+#include <vector>
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <memory>
+#include <type_traits>
+
+#include <atlas/numa.h>
+#include <atlas/container/mpsc_queue.h>
+#include <atlas/memory/pool_allocator.h>
 
 #include "task_adaptors.hpp"
+#include "detail/ws_deque.hpp"
+#include "detail/task_ring.hpp"
 
 namespace boostplus {
   namespace threadpool {
@@ -48,20 +60,27 @@ namespace boostplus {
     protected:
 
       std::deque<task_type> _container; //!< Internal task _container.
+      size_t _capacity; //!< The maximum number of tasks, 0 means unbounded.
 
     public:
 
+      fifo_scheduler() : _capacity(0) {}
+
       /*! Adds a new task to the scheduler.
        * \param task The task object.
        * \return true, if the task could be scheduled and false otherwise.
        */
       bool push(const task_type& task) {
+        if (_capacity && _container.size() >= _capacity) return false;
+
         _container.push_back(task);
         return true;
       }
 
       bool push(task_type&& task) {
-        _container.push_back(task);
+        if (_capacity && _container.size() >= _capacity) return false;
+
+        _container.push_back(std::move(task));
         return true;
       }
 
@@ -78,6 +97,11 @@ namespace boostplus {
         return _container.front();
       }
 
+      //! The task may be moved out before it's popped.
+      task_type& top() {
+        return _container.front();
+      }
+
       /*! Gets the current number of tasks in the scheduler.
        *  \return The number of tasks.
        *  \remarks Prefer empty() to size() == 0 to check if the scheduler is empty.
@@ -94,6 +118,13 @@ namespace boostplus {
         return _container.empty();
       }
 
+      /*! Bounds the number of tasks, push() fails once there are so many.
+       *  \param capacity The maximum number of tasks, 0 means unbounded.
+       */
+      void set_capacity(size_t capacity) {
+        _capacity = capacity;
+      }
+
       /*! Removes all tasks from the scheduler.
        */
       void clear() {
@@ -132,7 +163,7 @@ namespace boostplus {
       }
 
       bool push(task_type&& task) {
-        _container.push_back(task);
+        _container.push_front(std::move(task));
         return true;
       }
 
@@ -149,6 +180,11 @@ namespace boostplus {
         return _container.front();
       }
 
+      //! The task may be moved out before it's popped.
+      task_type& top() {
+        return _container.front();
+      }
+
       /*! Gets the current number of tasks in the scheduler.
        *  \return The number of tasks.
        *  \remarks Prefer empty() to size() == 0 to check if the scheduler is empty.
@@ -192,7 +228,8 @@ namespace boostplus {
 
     protected:
 
-      std::priority_queue<task_type> _container; //!< Internal task _container.
+      // a heap instead of std::priority_queue, which gives no way to move the top out
+      std::vector<task_type> _container; //!< Internal task _container.
 
     public:
 
@@ -201,26 +238,34 @@ namespace boostplus {
        * \return true, if the task could be scheduled and false otherwise.
        */
       bool push(task_type const & task) {
-        _container.push(task);
+        _container.push_back(task);
+        std::push_heap(_container.begin(), _container.end());
         return true;
       }
 
       bool push(task_type&& task) {
-        _container.push_back(task);
+        _container.push_back(std::move(task));
+        std::push_heap(_container.begin(), _container.end());
         return true;
       }
 
       /*! Removes the task which should be executed next.
        */
       void pop() {
-        _container.pop();
+        std::pop_heap(_container.begin(), _container.end());
+        _container.pop_back();
       }
 
       /*! Gets the task which should be executed next.
        *  \return The task object to be executed.
        */
       task_type const & top() const {
-        return _container.top();
+        return _container.front();
+      }
+
+      //! The task may be moved out before it's popped, the priority is kept.
+      task_type& top() {
+        return _container.front();
       }
 
       /*! Gets the current number of tasks in the scheduler.
@@ -242,12 +287,331 @@ namespace boostplus {
       /*! Removes all tasks from the scheduler.
        */
       void clear() {
-        while (!_container.empty()) {
-          _container.pop();
+        _container.clear();
+      }
+    };
+
+    /*! \brief SchedulingPolicy which implements work stealing.
+     *
+     * Every worker has a Chase-Lev deque of it's own, the tasks scheduled by a worker go to it's deque,
+     * and are popped by the worker in LIFO order. The tasks scheduled by the other threads, for example,
+     * the I/O threads, go to a lock-free injection ring, a worker takes a batch of them at a time and
+     * keeps the rest in it's deque. A worker with nothing to do steals from the top of the others' deques.
+     *
+     * The injected tasks are kept in the slots of the ring, an overflow queue takes them only if the ring is full.
+     * The deques hold pointers, the tasks in them are allocated from the worker's free list, so a task scheduled
+     * and executed by the same worker is recycled in place, nothing is allocated in the steady state.
+     *
+     * The scheduler is concurrent, the pool calls it without holding it's lock, see is_concurrent_scheduler,
+     * so a schedule costs a push and, only if some worker is sleeping, a notify.
+     * The first max_workers worker threads get deques, the others share the injection queue only.
+     *
+     * On a NUMA box, see set_numa_nodes, every node has an injection ring of it's own, a thread placed on a node
+     * injects into it's ring, see atlas::current_numa_node, and a worker takes from the ring of it's node and
+     * steals from the workers of it's node first, so a request read on a node runs there. A worker takes from
+     * the other nodes only when it's own has nothing, so a busy node is still helped by an idle one.
+     *
+     * \param Task A function object which implements the operator()(void).
+     *
+     */
+    template<typename Task = task_func>
+    class work_stealing_scheduler {
+    public:
+
+      typedef Task task_type; //!< Indicates the scheduler's task type.
+
+      static const size_t max_workers = 256;
+      static const size_t injection_batch = 32;
+
+    private:
+
+      typedef detail::ws_deque<task_type> deque_type;
+
+    public:
+
+      work_stealing_scheduler() : _nodes(1), _workers(0), _size(0), _capacity(0), _steals(0), _remote_takes(0) {
+        _injections[0].reset(new detail::task_ring<task_type>);
+        for (auto& l : _injection_locks) l.clear();
+        for (auto& d : _deques) d.store(nullptr, std::memory_order_relaxed);
+        for (auto& n : _deque_nodes) n.store(0, std::memory_order_relaxed);
+      }
+
+      ~work_stealing_scheduler() {
+        clear();
+        for (auto& d : _deques) delete d.load(std::memory_order_relaxed);
+      }
+
+      work_stealing_scheduler(const work_stealing_scheduler&) = delete;
+      work_stealing_scheduler& operator=(const work_stealing_scheduler&) = delete;
+
+    public:
+
+      /*! Adds a new task to the scheduler, thread safe.
+       * \param task The task object.
+       * \return true, if the task could be scheduled and false otherwise.
+       */
+      bool push(const task_type& task) {
+        return push(task_type(task));
+      }
+
+      bool push(task_type&& task) {
+        size_t capacity = _capacity.load(std::memory_order_relaxed);
+        if (capacity && _size.load(std::memory_order_relaxed) >= capacity) return false;
+
+        deque_type* local = local_deque();
+
+        if (local) {
+          _size.fetch_add(1, std::memory_order_seq_cst);
+          local->push(make_node(std::move(task)));
+          return true;
+        }
+
+        // counted before it's visible, so a worker never misses it, see pool_core::wake_one
+        _size.fetch_add(1, std::memory_order_seq_cst);
+        if (!_injections[atlas::numa_slot(_nodes)]->try_push(std::move(task))) _overflow.push(make_node(std::move(task)));
+
+        return true;
+      }
+
+      /*! Takes the task to execute next, called by the workers only, thread safe.
+       * \return false if there is no task.
+       */
+      bool try_pop(task_type& task) {
+        deque_type* local = register_worker();
+
+        task_type* t = local ? local->pop() : nullptr;
+        if (!t && take_injected(local, task)) return true;
+        if (!t) {
+          t = steal(local);
+          if (!t) return false;
+
+          // a steal is rare in the steady state, so the shared counter costs little
+          _steals.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        take(t, task);
+        return true;
+      }
+
+      /*! Gets the current number of tasks in the scheduler, approximate.
+       *  \return The number of tasks.
+       */
+      size_t size() const {
+        return _size.load();
+      }
+
+      /*! Checks if the scheduler is empty, approximate.
+       *  \return true if the scheduler contains no tasks, false otherwise.
+       */
+      bool empty() const {
+        return _size.load() == 0;
+      }
+
+      /*! Bounds the number of tasks, push() fails once there are so many, approximate.
+       *  \param capacity The maximum number of tasks, 0 means unbounded.
+       */
+      void set_capacity(size_t capacity) {
+        _capacity.store(capacity);
+      }
+
+      /*! Gets the number of tasks a worker has taken from the deque of another.
+       *  \return The number of steals.
+       */
+      unsigned long long steals() const {
+        return _steals.load(std::memory_order_relaxed);
+      }
+
+      /*! Gives every NUMA node an injection ring of it's own, before any task is scheduled.
+       *  \param nodes The nodes, up to atlas::max_numa_nodes, 1 for none.
+       */
+      void set_numa_nodes(size_t nodes) {
+        if (nodes < 1) nodes = 1;
+        if (nodes > static_cast<size_t>(atlas::max_numa_nodes)) nodes = atlas::max_numa_nodes;
+
+        for (size_t n = 1; n < nodes; ++n) {
+          if (!_injections[n]) _injections[n].reset(new detail::task_ring<task_type>);
+        }
+        _nodes = nodes;
+      }
+
+      /*! Gets the number of tasks a worker has taken from the ring or the deques of another node.
+       *  \return The number of the tasks run off their node.
+       */
+      unsigned long long remote_takes() const {
+        return _remote_takes.load(std::memory_order_relaxed);
+      }
+
+      /*! Removes all tasks from the scheduler, thread safe.
+       */
+      void clear() {
+        task_type task;
+        task_type* t = nullptr;
+
+        for (;;) {
+          if (take_injected(nullptr, task)) continue;
+
+          if (!(t = steal(nullptr))) break;
+          take(t, task);
         }
       }
+
+    private:
+
+      typedef atlas::memory::fixed_size_pool<sizeof(task_type)> node_pool;
+
+      static task_type* make_node(task_type&& task) {
+        return ::new (node_pool::allocate()) task_type(std::move(task));
+      }
+
+      void take(task_type* t, task_type& task) {
+        _size.fetch_sub(1, std::memory_order_relaxed);
+
+        task = std::move(*t);
+        t->~task_type();
+        node_pool::deallocate(t);
+      }
+
+      struct worker_slot {
+        work_stealing_scheduler* owner;
+        deque_type* deque;
+        size_t index;
+        size_t node;
+      };
+
+      static worker_slot& local_slot() {
+        // zero initialized, a thread works for one pool at a time
+        static __thread worker_slot slot;
+        return slot;
+      }
+
+      deque_type* local_deque() const {
+        const worker_slot& slot = local_slot();
+        return slot.owner == this ? slot.deque : nullptr;
+      }
+
+      // a worker gets it's deque on it's first pop
+      deque_type* register_worker() {
+        worker_slot& slot = local_slot();
+        if (slot.owner == this) return slot.deque;
+
+        slot.owner = this;
+        slot.deque = nullptr;
+        slot.index = _workers.fetch_add(1);
+        slot.node = atlas::numa_slot(_nodes);
+
+        if (slot.index < max_workers) {
+          slot.deque = new deque_type;
+          _deque_nodes[slot.index].store(slot.node, std::memory_order_relaxed);
+          _deques[slot.index].store(slot.deque, std::memory_order_release);
+        }
+
+        return slot.deque;
+      }
+
+      // the ring of the worker's node first, then the rings of the other nodes
+      bool take_injected(deque_type* local, task_type& task) {
+        size_t nodes = _nodes;
+        size_t home = local ? local_slot().node : 0;
+
+        if (take_injected(home, local, task)) return true;
+
+        for (size_t i = 1; i < nodes; ++i) {
+          if (take_injected((home + i) % nodes, local, task)) {
+            _remote_takes.fetch_add(1, std::memory_order_relaxed);
+            return true;
+          }
+        }
+
+        return false;
+      }
+
+      // only one thread drains a ring at a time, the batch is kept in it's deque, the overflow goes with the ring of node 0
+      bool take_injected(size_t node, deque_type* local, task_type& task) {
+        std::atomic_flag& lock = _injection_locks[node];
+        if (lock.test_and_set(std::memory_order_acquire)) return false;
+
+        detail::task_ring<task_type>& ring = *_injections[node];
+        bool taken = false;
+        task_type* t = nullptr;
+
+        if (ring.try_pop(task)) {
+          _size.fetch_sub(1, std::memory_order_relaxed);
+          taken = true;
+        }
+        else if (node == 0 && _overflow.pop(t)) {
+          take(t, task);
+          taken = true;
+        }
+
+        if (taken && local) {
+          task_type next;
+          for (size_t n = 1; n < injection_batch && ring.try_pop(next); ++n) local->push(make_node(std::move(next)));
+        }
+
+        lock.clear(std::memory_order_release);
+
+        return taken;
+      }
+
+      // start from the next worker, so the thieves spread, the workers of the same node first
+      task_type* steal(deque_type* local) {
+        size_t workers = _workers.load();
+        if (workers > max_workers) workers = max_workers;
+        if (!workers) return nullptr;
+
+        size_t start = local ? local_slot().index + 1 : 0;
+        size_t home = local ? local_slot().node : 0;
+        bool numa = _nodes > 1 && local;
+
+        for (int pass = numa ? 0 : 1; pass < 2; ++pass) {
+          for (size_t i = 0; i < workers; ++i) {
+            size_t v = (start + i) % workers;
+            deque_type* victim = _deques[v].load(std::memory_order_acquire);
+            if (!victim || victim == local) continue;
+
+            // the same node in the first pass, the others in the second
+            bool same = _deque_nodes[v].load(std::memory_order_relaxed) == home;
+            if (numa && same == (pass == 1)) continue;
+
+            task_type* t = victim->steal();
+            if (t) {
+              if (numa && pass == 1) _remote_takes.fetch_add(1, std::memory_order_relaxed);
+              return t;
+            }
+          }
+        }
+
+        return nullptr;
+      }
+
+    private:
+
+      // by the node, the rings of the nodes not used are never created
+      std::array<std::unique_ptr<detail::task_ring<task_type>>, atlas::max_numa_nodes> _injections;
+      std::array<std::atomic_flag, atlas::max_numa_nodes> _injection_locks;
+      size_t _nodes;
+      atlas::mpsc_queue<task_type*> _overflow;
+
+      std::atomic<size_t> _workers;
+      std::array<std::atomic<deque_type*>, max_workers> _deques;
+      std::array<std::atomic<size_t>, max_workers> _deque_nodes;
+
+      std::atomic<size_t> _size;
+      std::atomic<size_t> _capacity;
+      std::atomic<unsigned long long> _steals;
+      std::atomic<unsigned long long> _remote_takes;
     };
 
+    /*! \brief Tells whether a scheduler is thread safe by itself.
+     *
+     * The pool calls a concurrent scheduler without holding it's lock, by push() and try_pop().
+     */
+    template<typename Scheduler>
+    struct is_concurrent_scheduler : std::false_type {};
+
+    template<typename Task>
+    struct is_concurrent_scheduler<work_stealing_scheduler<Task>> : std::true_type {};
+
   } // threadpool
 } // boostplus
 
@@ -17,6 +17,9 @@
 #ifndef THREADPOOL_SIZE_POLICIES_HPP_INCLUDED
 #define THREADPOOL_SIZE_POLICIES_HPP_INCLUDED
 
+#include <atomic>
+#include <chrono>
+#include <cstdint>
 #include <memory>
 #include <functional>
 
@@ -81,16 +84,172 @@ namespace boostplus {
         _pool.get().resize(new_worker_count + 1);
       }
 
+      void task_scheduled() {
+      }
+
+      void queue_empty() {
+      }
+
       // TODO this functions are not called yet
+      void task_finished() {
+      }
+
+      //! The workers wait for tasks forever.
+      std::chrono::steady_clock::duration idle_timeout() const {
+        return std::chrono::steady_clock::duration::zero();
+      }
+
+      bool retire_idle_worker() const {
+        return false;
+      }
+
+    private:
+
+      std::reference_wrapper<Pool> _pool;
+    };
+
+    /*! \brief SizePolicy which sizes the pool by the queue delay.
+     *
+     * A worker is added when a task is scheduled while all the workers are busy and the queue has not been
+     * empty for max_queue_wait, that is, the oldest task has waited so long, at most one per max_queue_wait.
+     * A worker which has found nothing to do for idle_timeout retires. The pool is kept between min and max.
+     *
+     * \param Pool The pool's core type.
+     * \see adaptive_controller
+     */
+    template<typename Pool>
+    class adaptive_size {
+    public:
+
+      typedef std::chrono::steady_clock clock;
+
+    public:
+
+      static void init(Pool& pool, size_t worker_count) {
+        pool.resize(worker_count);
+      }
+
+      adaptive_size(Pool& pool) :
+          _pool(pool), _min(1), _max(1), _max_queue_wait(to_ticks(std::chrono::milliseconds(10))),
+          _idle_timeout(to_ticks(std::chrono::seconds(5))), _queue_empty_since(0), _last_grow(0) {
+      }
+
+      //! Resizes the pool now, widening the bounds if necessary.
+      bool resize(size_t worker_count) {
+        if (worker_count < _min) _min = worker_count;
+        if (worker_count > _max) _max = worker_count;
+
+        return _pool.get().resize(worker_count);
+      }
+
+      void set_bounds(size_t min, size_t max) {
+        if (max < min) max = min;
+
+        _min = min;
+        _max = max;
+
+        size_t size = _pool.get().size();
+        if (size < min) _pool.get().resize(min);
+        else if (size > max) _pool.get().resize(max);
+      }
+
+      void set_delays(clock::duration max_queue_wait, clock::duration idle_timeout) {
+        _max_queue_wait = max_queue_wait.count();
+        _idle_timeout = idle_timeout.count();
+      }
+
+      void worker_died_unexpectedly(size_t new_worker_count) {
+        _pool.get().resize(new_worker_count + 1);
+      }
+
+      // called by the scheduling thread without the pool's lock
       void task_scheduled() {
+        Pool& pool = _pool.get();
+
+        size_t workers = pool._worker_count;
+        if (workers >= _max || pool._active_worker_count < workers) return;
+
+        int64_t now = clock::now().time_since_epoch().count();
+        int64_t wait = _max_queue_wait;
+        if (now - _queue_empty_since.load(std::memory_order_relaxed) < wait) return;
+
+        int64_t last = _last_grow;
+        if (now - last < wait || !_last_grow.compare_exchange_strong(last, now)) return;
+
+        pool.resize(workers + 1);
       }
 
+      // called by a worker which finds the queue empty, the oldest pending task has waited no longer than since
+      void queue_empty() {
+        _queue_empty_since.store(clock::now().time_since_epoch().count(), std::memory_order_relaxed);
+      }
+
+      // TODO this functions are not called yet
       void task_finished() {
       }
 
+      std::chrono::steady_clock::duration idle_timeout() const {
+        return clock::duration(_idle_timeout.load());
+      }
+
+      // called under the pool's lock by a worker which has waited idle_timeout for nothing
+      bool retire_idle_worker() const {
+        return _pool.get()._worker_count > _min;
+      }
+
+    private:
+
+      template<typename Duration>
+      static int64_t to_ticks(const Duration& d) {
+        return std::chrono::duration_cast<clock::duration>(d).count();
+      }
+
     private:
 
       std::reference_wrapper<Pool> _pool;
+
+      std::atomic<size_t> _min;
+      std::atomic<size_t> _max;
+      std::atomic<int64_t> _max_queue_wait; // in clock ticks
+      std::atomic<int64_t> _idle_timeout; // in clock ticks
+      std::atomic<int64_t> _queue_empty_since; // in clock ticks
+      std::atomic<int64_t> _last_grow;
+    };
+
+    /*! \brief SizePolicyController which sets the bounds of an adaptive_size pool.
+     *
+     * \param Pool The pool's core type.
+     */
+    template<typename Pool>
+    class adaptive_controller {
+    public:
+
+      typedef typename Pool::size_policy_type size_policy_type;
+
+    public:
+
+      adaptive_controller(size_policy_type& policy, std::shared_ptr<Pool> pool) :
+          _policy(policy), _pool(pool) {
+      }
+
+      bool resize(size_t worker_count) {
+        return _policy.get().resize(worker_count);
+      }
+
+      void set_bounds(size_t min, size_t max) {
+        _policy.get().set_bounds(min, max);
+      }
+
+      template<typename Duration1, typename Duration2>
+      void set_delays(const Duration1& max_queue_wait, const Duration2& idle_timeout) {
+        _policy.get().set_delays(std::chrono::duration_cast<typename size_policy_type::clock::duration>(max_queue_wait),
+            std::chrono::duration_cast<typename size_policy_type::clock::duration>(idle_timeout));
+      }
+
+    private:
+
+      std::reference_wrapper<size_policy_type> _policy;
+      std::shared_ptr<Pool> _pool; //!< to make sure that the pool is alive (the policy pointer is valid) as long as the controller exists
     };
   } // threadpool
 } // boostplus
@@ -16,19 +16,179 @@
 #ifndef THREADPOOL_TASK_ADAPTERS_HPP_INCLUDED
 #define THREADPOOL_TASK_ADAPTERS_HPP_INCLUDED
 
+#include <cstddef>
+#include <cstdint>
+#include <new>
 #include <memory>
 #include <functional>
 #include <thread>
+#include <type_traits>
+#include <utility>
 
 namespace boostplus {
   namespace threadpool {
 
+    /*! \brief Move-only nullary function object with inline storage.
+     *
+     * A function object of up to inline_size bytes, for example, a bound member function with a shared_ptr,
+     * is kept inside the task, so a task costs no allocation and the captures are never copied.
+     * The bigger ones are kept on the heap. The task is 64 bytes, a cache line, with the time it's scheduled.
+     *
+     */
+    class unique_task {
+    public:
+
+      typedef void result_type; //!< Indicates the functor's result type.
+
+      static const size_t inline_size = 48;
+      static const size_t inline_align = 16;
+
+    public:
+
+      unique_task() noexcept : _ops(nullptr), _enqueued(0) {}
+
+      unique_task(std::nullptr_t) noexcept : _ops(nullptr), _enqueued(0) {}
+
+      template<typename F, typename = typename std::enable_if<
+          !std::is_same<typename std::decay<F>::type, unique_task>::value>::type>
+      unique_task(F&& f) : _ops(nullptr), _enqueued(0) {
+        typedef typename std::decay<F>::type functor_type;
+
+        init(std::forward<F>(f), std::integral_constant<bool, fits_inline<functor_type>::value>());
+      }
+
+      unique_task(unique_task&& other) noexcept : _ops(nullptr), _enqueued(0) {
+        move_from(other);
+      }
+
+      unique_task& operator=(unique_task&& other) noexcept {
+        if (this != &other) {
+          reset();
+          move_from(other);
+        }
+
+        return *this;
+      }
+
+      unique_task& operator=(std::nullptr_t) noexcept {
+        reset();
+        return *this;
+      }
+
+      ~unique_task() { reset(); }
+
+      unique_task(const unique_task&) = delete;
+      unique_task& operator=(const unique_task&) = delete;
+
+    public:
+
+      explicit operator bool() const noexcept { return _ops != nullptr; }
+
+      /*! Executes the task function, an empty task does nothing.
+       */
+      void operator()() const {
+        if (_ops) _ops->invoke(const_cast<void*>(static_cast<const void*>(&_storage)));
+      }
+
+      /*! The time the task is scheduled, stamped by the pool, in ticks of the steady clock, 0 if not scheduled.
+       */
+      int64_t enqueued() const noexcept { return _enqueued; }
+
+      void set_enqueued(int64_t time) noexcept { _enqueued = time; }
+
+    private:
+
+      struct ops {
+        void (*invoke)(void*);
+        void (*move)(void* from, void* to) noexcept;
+        void (*destroy)(void*) noexcept;
+      };
+
+      template<typename F>
+      struct fits_inline : std::integral_constant<bool,
+          sizeof(F) <= inline_size && std::alignment_of<F>::value <= inline_align
+          && std::is_nothrow_move_constructible<F>::value> {};
+
+      template<typename F>
+      struct inline_ops {
+        static void invoke(void* p) { (*static_cast<F*>(p))(); }
+
+        static void move(void* from, void* to) noexcept {
+          ::new (to) F(std::move(*static_cast<F*>(from)));
+          static_cast<F*>(from)->~F();
+        }
+
+        static void destroy(void* p) noexcept { static_cast<F*>(p)->~F(); }
+
+        static const ops table;
+      };
+
+      template<typename F>
+      struct heap_ops {
+        static void invoke(void* p) { (**static_cast<F**>(p))(); }
+
+        static void move(void* from, void* to) noexcept { *static_cast<F**>(to) = *static_cast<F**>(from); }
+
+        static void destroy(void* p) noexcept { delete *static_cast<F**>(p); }
+
+        static const ops table;
+      };
+
+      template<typename F>
+      void init(F&& f, std::true_type) {
+        typedef typename std::decay<F>::type functor_type;
+
+        ::new (static_cast<void*>(&_storage)) functor_type(std::forward<F>(f));
+        _ops = &inline_ops<functor_type>::table;
+      }
+
+      template<typename F>
+      void init(F&& f, std::false_type) {
+        typedef typename std::decay<F>::type functor_type;
+
+        *reinterpret_cast<functor_type**>(&_storage) = new functor_type(std::forward<F>(f));
+        _ops = &heap_ops<functor_type>::table;
+      }
+
+      void move_from(unique_task& other) noexcept {
+        _enqueued = other._enqueued;
+        if (!other._ops) return;
+
+        other._ops->move(&other._storage, &_storage);
+        _ops = other._ops;
+        other._ops = nullptr;
+      }
+
+      void reset() noexcept {
+        if (!_ops) return;
+
+        _ops->destroy(&_storage);
+        _ops = nullptr;
+      }
+
+    private:
+
+      typename std::aligned_storage<inline_size, inline_align>::type _storage;
+      const ops* _ops;
+      int64_t _enqueued;
+    };
+
+    template<typename F>
+    const unique_task::ops unique_task::inline_ops<F>::table = {
+      &unique_task::inline_ops<F>::invoke, &unique_task::inline_ops<F>::move, &unique_task::inline_ops<F>::destroy
+    };
+
+    template<typename F>
+    const unique_task::ops unique_task::heap_ops<F>::table = {
+      &unique_task::heap_ops<F>::invoke, &unique_task::heap_ops<F>::move, &unique_task::heap_ops<F>::destroy
+    };
+
     /*! \brief Standard task function object.
      *
-     * This function object wraps a nullary function which returns void.
+     * This function object wraps a nullary function which returns void, it's move-only, see unique_task.
      *
      */
-    typedef std::function<void()> task_func;
+    typedef unique_task task_func;
 
     /*! \brief Prioritized task function object.
      *
@@ -46,10 +206,12 @@ namespace boostplus {
 
     public:
 
-      prio_task_func(unsigned int priority, const task_func& function) :
-          _priority(priority), _function(function) {
+      prio_task_func(unsigned int priority, task_func function) :
+          _priority(priority), _function(std::move(function)) {
       }
 
+      prio_task_func() : _priority(0) {}
+
       /*! Executes the task function.
        */
       void operator()(void) const {
@@ -66,6 +228,10 @@ namespace boostplus {
         return _priority < rhs._priority;
       }
 
+      int64_t enqueued() const noexcept { return _function.enqueued(); }
+
+      void set_enqueued(int64_t time) noexcept { _function.set_enqueued(time); }
+
     private:
 
       unsigned int _priority;
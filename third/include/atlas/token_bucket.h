@@ -0,0 +1,86 @@
+/*
+ * token_bucket.h
+ *
+ *  Created on: Sep 3, 2013
+ *      Author: vincent
+ */
+
+#ifndef ATLAS_TOKEN_BUCKET_H_
+#define ATLAS_TOKEN_BUCKET_H_
+
+#include <chrono>
+
+namespace atlas {
+
+  /*
+   * Tokens are added at the rate per second up to the burst, and taken by consume(). The tokens may run
+   * into debt, so a large item is never starved, and the next one waits until the debt is paid.
+   * A rate of 0 means unlimited.
+   *
+   * Not thread safe, it's used by one thread, for example, a sender thread
+   * */
+  class token_bucket {
+  public:
+
+    typedef std::chrono::steady_clock clock;
+
+  public:
+
+    token_bucket(double rate = 0, double burst = 0) { reset(rate, burst); }
+
+  public:
+
+    // the bucket starts full, a burst of 0 means one second of the rate
+    void reset(double rate, double burst = 0) {
+      _rate = rate > 0 ? rate : 0;
+      _burst = burst > 0 ? burst : _rate;
+      _tokens = _burst;
+      _last = clock::now();
+    }
+
+    bool unlimited() const { return _rate == 0; }
+
+    double rate() const { return _rate; }
+
+    double available(clock::time_point now = clock::now()) {
+      refill(now);
+      return _tokens;
+    }
+
+    void consume(double tokens) {
+      if (!unlimited()) _tokens -= tokens;
+    }
+
+    // how long until a token is available, zero if it's available now
+    clock::duration wait_time(clock::time_point now = clock::now()) {
+      refill(now);
+      if (unlimited() || _tokens > 0) return clock::duration::zero();
+
+      // a little more than the debt, so the bucket is never empty after the wait
+      std::chrono::duration<double> wait((1 - _tokens) / _rate);
+      return std::chrono::duration_cast<clock::duration>(wait);
+    }
+
+  private:
+
+    void refill(clock::time_point now) {
+      if (unlimited() || now <= _last) return;
+
+      std::chrono::duration<double> elapsed = now - _last;
+      _last = now;
+
+      _tokens += elapsed.count() * _rate;
+      if (_tokens > _burst) _tokens = _burst;
+    }
+
+  private:
+
+    double _rate;
+    double _burst;
+    double _tokens;
+    clock::time_point _last;
+  };
+
+} // atlas
+
+#endif /* ATLAS_TOKEN_BUCKET_H_ */
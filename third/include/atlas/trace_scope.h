@@ -0,0 +1,288 @@
+/*
+ * trace_scope.h
+ *
+ *  Created on: Sep 28, 2013
+ *      Author: vincent
+ */
+
+/*    Copyright 2011 ~ 2013 Vincent Zhang, ivincent.zhang@gmail.com
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#ifndef ATLAS_TRACE_SCOPE_H_
+#define ATLAS_TRACE_SCOPE_H_
+
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+namespace atlas {
+
+  // the time stamp counter, the steady clock in nanoseconds where there is none
+  inline uint64_t tsc() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+  }
+
+  // a scope of a thread ended, the name is a literal
+  struct scope_event {
+    const char* name;
+    uint64_t start;           // in ticks of the time stamp counter
+    uint64_t end;
+    uint32_t depth;           // the scopes of the thread it's nested in
+  };
+
+  /*
+   * The scopes a thread ended lately, written by the thread only, and read by any, see scope_tracer::dump.
+   * The ring wraps, so the older events are overwritten, a reader keeps only the ones not overwritten while
+   * it copies them
+   * */
+  class scope_ring {
+  public:
+
+    static const size_t capacity = 8 * 1024;
+
+  public:
+
+    explicit scope_ring(int tid) : _tid(tid), _head(0), _depth(0), _events(capacity) {}
+
+    scope_ring(const scope_ring&) = delete;
+    scope_ring& operator=(const scope_ring&) = delete;
+
+  public:
+
+    int tid() const { return _tid; }
+
+    void push(const scope_event& e) {
+      uint64_t h = _head.load(std::memory_order_relaxed);
+      _events[h & (capacity - 1)] = e;
+      _head.store(h + 1, std::memory_order_release);
+    }
+
+    // the nesting of the scopes open, the owner thread only
+    uint32_t enter() { return _depth++; }
+
+    void leave() { --_depth; }
+
+    void copy_to(std::vector<scope_event>& events) const {
+      uint64_t h = _head.load(std::memory_order_acquire);
+      uint64_t first = h > capacity ? h - capacity : 0;
+
+      std::vector<scope_event> copied;
+      copied.reserve(h - first);
+      for (uint64_t i = first; i < h; ++i) copied.push_back(_events[i & (capacity - 1)]);
+
+      // the writer may be on the slot of the next event already, so it's dropped too
+      uint64_t h2 = _head.load(std::memory_order_acquire);
+      uint64_t valid = h2 + 1 > capacity ? h2 + 1 - capacity : 0;
+      for (uint64_t i = std::max(first, valid); i < h; ++i) events.push_back(copied[i - first]);
+    }
+
+  private:
+
+    const int _tid;
+    std::atomic<uint64_t> _head;
+    uint32_t _depth;
+    std::vector<scope_event> _events;
+  };
+
+  /*
+   * The scopes of the handlers timed by ATLAS_TRACE_SCOPE, every thread records into a ring of it's own with no
+   * lock and no clock call but the time stamp counter, and it's all skipped on one predicted branch while the
+   * tracer is off. The rings are kept after the threads exit, so a dump sees the threads gone too.
+   *
+   * The events are dumped in the trace event format, which the chrome://tracing and Perfetto viewers show as a
+   * flame chart per thread, the ticks are converted to the wall time by the rate measured since it's enabled
+   * */
+  class scope_tracer {
+  private:
+
+    scope_tracer() : _enabled(false), _tsc0(0) {}
+
+    scope_tracer(const scope_tracer&) = delete;
+    scope_tracer& operator=(const scope_tracer&) = delete;
+
+  public:
+
+    static scope_tracer& instance() {
+      static scope_tracer t;
+      return t;
+    }
+
+  public:
+
+    bool enabled() const { return _enabled.load(std::memory_order_relaxed); }
+
+    void enable(bool on) {
+      std::lock_guard<std::mutex> guard(_mutex);
+
+      if (on && !enabled()) {
+        _tsc0 = tsc();
+        _clock0 = std::chrono::steady_clock::now();
+        _wall0 = std::chrono::system_clock::now();
+      }
+
+      _enabled.store(on, std::memory_order_relaxed);
+    }
+
+    // the ring of the calling thread, made at the first scope of it
+    // We use __thread since gcc 4.7 does not support thread_local
+    scope_ring& ring() {
+      static __thread scope_ring* r = nullptr;
+      if (!r) r = make_ring();
+
+      return *r;
+    }
+
+    // the ticks of the time stamp counter per microsecond, since it's enabled
+    double ticks_per_us() const {
+      std::lock_guard<std::mutex> guard(_mutex);
+      return rate();
+    }
+
+    // the events of every thread in the trace event format, "traceEvents" of the complete events
+    std::string dump() const {
+      std::vector<std::shared_ptr<scope_ring>> rings;
+      uint64_t tsc0;
+      double ticks;
+      int64_t wall0;
+      {
+        std::lock_guard<std::mutex> guard(_mutex);
+        rings = _rings;
+        tsc0 = _tsc0;
+        ticks = rate();
+        wall0 = std::chrono::duration_cast<std::chrono::microseconds>(_wall0.time_since_epoch()).count();
+      }
+
+      std::ostringstream os;
+      os.setf(std::ios::fixed);
+      os.precision(3);
+      os << "{\"traceEvents\":[";
+
+      bool first = true;
+      std::vector<scope_event> events;
+      for (const std::shared_ptr<scope_ring>& r : rings) {
+        events.clear();
+        r->copy_to(events);
+
+        for (const scope_event& e : events) {
+          if (e.start < tsc0) continue;
+
+          if (!first) os << ",";
+          first = false;
+
+          os << "{\"name\":\"";
+          for (const char* c = e.name; *c; ++c) {
+            if (*c == '"' || *c == '\\') os << '\\';
+            os << *c;
+          }
+          os << "\",\"ph\":\"X\",\"pid\":" << ::getpid() << ",\"tid\":" << r->tid()
+              << ",\"ts\":" << wall0 + (e.start - tsc0) / ticks << ",\"dur\":" << (e.end - e.start) / ticks
+              << ",\"args\":{\"depth\":" << e.depth << "}}";
+        }
+      }
+
+      os << "]}\n";
+      return os.str();
+    }
+
+  private:
+
+    double rate() const {
+      double us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - _clock0).count();
+      double ticks = static_cast<double>(tsc() - _tsc0);
+
+      return us > 0 && ticks > 0 ? ticks / us : 1.0;
+    }
+
+    scope_ring* make_ring() {
+      std::shared_ptr<scope_ring> r = std::make_shared<scope_ring>(static_cast<int>(::syscall(SYS_gettid)));
+
+      std::lock_guard<std::mutex> guard(_mutex);
+      _rings.push_back(r);
+      return r.get();
+    }
+
+  private:
+
+    std::atomic<bool> _enabled;
+
+    mutable std::mutex _mutex;
+    std::vector<std::shared_ptr<scope_ring>> _rings;
+
+    uint64_t _tsc0;
+    std::chrono::steady_clock::time_point _clock0;
+    std::chrono::system_clock::time_point _wall0;
+  };
+
+  /*
+   * A scope timed while it's open, see ATLAS_TRACE_SCOPE, the name must outlive the dumps, a literal is.
+   * It's a scope guard of it's own, the std::function of scope_guard would cost an allocation a scope
+   * */
+  class trace_scope {
+  public:
+
+    explicit trace_scope(const char* name) : _ring(nullptr) {
+      if (__builtin_expect(!scope_tracer::instance().enabled(), 1)) return;
+
+      _ring = &scope_tracer::instance().ring();
+      _name = name;
+      _depth = _ring->enter();
+      _start = tsc();
+    }
+
+    trace_scope(const trace_scope&) = delete;
+    trace_scope& operator=(const trace_scope&) = delete;
+
+    ~trace_scope() {
+      if (__builtin_expect(!_ring, 1)) return;
+
+      _ring->push(scope_event { _name, _start, tsc(), _depth });
+      _ring->leave();
+    }
+
+  private:
+
+    scope_ring* _ring;
+    const char* _name;
+    uint32_t _depth;
+    uint64_t _start;
+  };
+
+} // atlas
+
+#define ATLAS_TRACE_SCOPE_CAT_(a, b) a##b
+#define ATLAS_TRACE_SCOPE_CAT(a, b) ATLAS_TRACE_SCOPE_CAT_(a, b)
+
+// time the rest of the enclosing scope under the name, for example, ATLAS_TRACE_SCOPE("kv/put/log")
+#define ATLAS_TRACE_SCOPE(name) ::atlas::trace_scope ATLAS_TRACE_SCOPE_CAT(__atlas_trace_scope_, __LINE__)(name)
+
+#endif /* ATLAS_TRACE_SCOPE_H_ */
@@ -11,8 +11,9 @@
 #include <boost/ref.hpp>
 #include <boost/assert.hpp>
 #include <boost/mpl/bool.hpp>
+#include <boost/type_traits/is_array.hpp>
 #include <boost/archive/archive_exception.hpp>
-#include <boost/transact/array_extension.hpp>
+#include <atlas/transaction/array_extension.hpp>
 #include <iterator>
 #include <algorithm>
 #include <cstring>
@@ -110,7 +111,7 @@ namespace boost {
       }
       template<class T>
       basic_oarchive &operator<<(T const &t) {
-        that().save(t);
+        this->save_(t, is_array<T>());
         return *this;
       }
       template<class T>
@@ -136,6 +137,15 @@ namespace boost {
         if (size > 0) that().save_binary(s, size * sizeof(wchar_t));
       }
     private:
+      template<class T>
+      void save_(T const &t, mpl::false_ array) {
+        that().save(t);
+      }
+      //a char array is saved as an array, as it's loaded, not as the C string it decays to
+      template<class T>
+      void save_(T const &t, mpl::true_ array) {
+        that().template save<T>(t);
+      }
       Derived &that() {
         return static_cast<Derived &>(*this);
       }
@@ -264,10 +274,10 @@ namespace boost {
       template<class Size>
       void load_binary(char *data, Size size, mpl::false_ arrayex, std::random_access_iterator_tag,
           mpl::false_ contvals) {
-        //FIXME:
         if (std::size_t(this->end - this->in) < size)
           throw archive::archive_exception(archive::archive_exception::input_stream_error);
-        std::copy(data, data + size, this->in);
+        std::copy(this->in, this->in + size, data);
+        this->in += size;
       }
       template<class Size, class Category>
       void load_binary(char *data, Size size, mpl::false_ arrayex, Category, mpl::false_ contvals) {
@@ -408,7 +418,7 @@ namespace boost {
   }
 }
 
-#include <boost/transact/object_access.hpp>
+#include <atlas/transaction/object_access.hpp>
 
 template<class Derived>
 template<class T>
@@ -7,6 +7,8 @@
 #define BOOST_TRANSACT_ARRAY_EXTENSION_HPP
 
 #include <boost/mpl/bool.hpp>
+#include <boost/type_traits/is_pod.hpp>
+#include <cstring>
 #include <iterator>
 
 namespace boost{
@@ -24,7 +26,7 @@ struct has_contiguous_values<T *> : mpl::true_{};
 
 template<typename Vector>
 class vector_back_insert_iterator
-    : public std::iterator<std::output_iterator_tag,typename Vector::value_type,typename Vector::difference_type,typename Vector::pointer_type,typename Vector::reference_type>{
+    : public std::iterator<std::output_iterator_tag,typename Vector::value_type,typename Vector::difference_type,typename Vector::pointer,typename Vector::reference>{
 public:
     typedef Vector container_type;
     explicit vector_back_insert_iterator(Vector &vec) : vec(&vec){}
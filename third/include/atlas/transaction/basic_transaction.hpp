@@ -8,7 +8,7 @@
 #define BOOST_TRANSACT_BASIC_TRANSACTION_HEADER_HPP
 
 #include <boost/noncopyable.hpp>
-#include <boost/transact/exception.hpp>
+#include <atlas/transaction/exception.hpp>
 #include <boost/assert.hpp>
 #include <iostream>
 
@@ -17,6 +17,8 @@
 #include <boost/mpl/empty_sequence.hpp>
 #include <boost/mpl/bool.hpp>
 #include <boost/mpl/fold.hpp>
+#include <boost/mpl/vector.hpp>
+#include <boost/mpl/push_back.hpp>
 #include <boost/mpl/insert.hpp>
 #include <boost/mpl/empty.hpp>
 #include <boost/mpl/set.hpp>
@@ -29,13 +31,14 @@
 #include <boost/unordered_map.hpp>
 #include <boost/scoped_array.hpp>
 #include <functional>
+#include <atomic>
 
-#include <boost/transact/detail/mutex.hpp>
-#include <boost/transact/exception.hpp>
-#include <boost/transact/detail/static_tss.hpp>
-#include <boost/transact/detail/algorithm.hpp>
-#include <boost/transact/detail/transaction_manager.hpp>
-#include <boost/transact/resource_manager.hpp>
+#include <atlas/transaction/detail/mutex.hpp>
+#include <atlas/transaction/exception.hpp>
+#include <atlas/transaction/detail/static_tss.hpp>
+#include <atlas/transaction/detail/algorithm.hpp>
+#include <atlas/transaction/detail/transaction_manager.hpp>
+#include <atlas/transaction/resource_manager.hpp>
 
 namespace boost {
   namespace transact {
@@ -238,7 +241,7 @@ namespace boost {
           std::pair<iterator, iterator> range = ress.template range<Tag>();
           std::size_t index = 0;
           for (iterator it = range.first; it != range.second; ++it, ++index) {
-            optional<typename Resource::transaction> &tx = txs.get<Tag>(index);
+            optional<typename Resource::transaction> &tx = txs.template get<Tag>(index);
             f(it->first, *it->second, tx);
           }
 
@@ -252,6 +255,45 @@ namespace boost {
               typename mpl::empty<Resources>::type());
         }
 
+        // visit the connected resources without their transactions
+        template<class It, class End, class Resources, class F>
+        void for_each_resource(resources<Resources> &, F &, mpl::true_ end) {
+        }
+
+        template<class It, class End, class Resources, class F>
+        void for_each_resource(resources<Resources> &ress, F &f, mpl::false_ end) {
+          typedef typename mpl::deref<It>::type::first Tag;
+          typedef typename resources<Resources>::template iterator<Tag>::type iterator;
+          std::pair<iterator, iterator> range = ress.template range<Tag>();
+          for (iterator it = range.first; it != range.second; ++it) {
+            f(it->first, *it->second);
+          }
+
+          typedef typename mpl::next<It>::type Next;
+          for_each_resource<Next, End>(ress, f, typename is_same<Next, End>::type());
+        }
+
+        template<class Resources, class F>
+        void for_each_resource(resources<Resources> &ress, F f) {
+          for_each_resource<typename mpl::begin<Resources>::type, typename mpl::end<Resources>::type>(ress, f,
+              typename mpl::empty<Resources>::type());
+        }
+
+        struct checkpointer {
+          template<class Tag, class Resource>
+          void operator()(Tag const &, Resource &res) {
+            this->checkpoint(res, typename has_service<Resource, checkpoint_service_tag>::type());
+          }
+        private:
+          template<class Resource>
+          void checkpoint(Resource &res, mpl::true_ checkpointservice) {
+            res.checkpoint();
+          }
+          template<class Resource>
+          void checkpoint(Resource &, mpl::false_ checkpointservice) {
+          }
+        };
+
         template<class F, class State>
         struct folder {
         public:
@@ -292,7 +334,7 @@ namespace boost {
             typedef typename mpl::at<Resources, Tag>::type Resource;
             std::size_t index;
             Resource &res = ress.get(tag, index);
-            optional<typename Resource::transaction> &rtx = this->rtxs->get<Tag>(index);
+            optional<typename Resource::transaction> &rtx = this->rtxs->template get<Tag>(index);
             this->lazy_begin(tag, res, rtx, ress, typename mpl::has_key<LazySet, Tag>::type());
             BOOST_ASSERT(rtx);
             return *rtx;
@@ -370,7 +412,7 @@ namespace boost {
             void operator()() {
               //make room for as many resource transactions as there are resources connected:
               typedef typename Pair::first Tag;
-              txs.size<Tag>(ress.size<Tag>());
+              txs.template size<Tag>(ress.template size<Tag>());
             }
           private:
             resource_transactions<Resources> &txs;
@@ -581,6 +623,25 @@ namespace boost {
       static void commit_transaction(transaction &tx) {
         bind_transaction(tx);
         tx.commit(resources_);
+
+        std::size_t interval = checkpoint_interval_.load(std::memory_order_relaxed);
+        if (interval && ++commits_ % interval == 0) checkpoint();
+      }
+
+      /// Every resource manager which provides the checkpoint service snapshots it's state, records the
+      /// checkpoint in it's log and reclaims the log files before it, so the log size and the recovery time
+      /// stay bounded. The checkpoints are fuzzy, the transactions keep running during a checkpoint,
+      /// see transaction_olog::checkpoint()
+      /// rief Takes a checkpoint of all the resource managers, not part of the concept
+      static void checkpoint() {
+        transact::detail::basic_transaction_manager::for_each_resource(resources_,
+            transact::detail::basic_transaction_manager::checkpointer());
+      }
+
+      /// A checkpoint is taken by the committing thread once every commits, 0 to disable, the default
+      /// rief Sets the checkpoint interval, not part of the concept
+      static void checkpoint_interval(std::size_t commits) {
+        checkpoint_interval_.store(commits, std::memory_order_relaxed);
       }
 
       static void rollback_transaction(transaction &tx) {
@@ -608,6 +669,8 @@ namespace boost {
     private:
       typedef typename detail::resources_type resources_type;
       static resources_type resources_;
+      static std::atomic<std::size_t> checkpoint_interval_;
+      static std::atomic<std::size_t> commits_;
       /// \endcond
     };
 
@@ -615,6 +678,12 @@ namespace boost {
     typename basic_transaction_manager<Resources, FlatNested, Lazy, Threads, TThreads>::resources_type basic_transaction_manager<
         Resources, FlatNested, Lazy, Threads, TThreads>::resources_;
 
+    template<class Resources, bool FlatNested, class Lazy, bool Threads, bool TThreads>
+    std::atomic<std::size_t> basic_transaction_manager<Resources, FlatNested, Lazy, Threads, TThreads>::checkpoint_interval_(0);
+
+    template<class Resources, bool FlatNested, class Lazy, bool Threads, bool TThreads>
+    std::atomic<std::size_t> basic_transaction_manager<Resources, FlatNested, Lazy, Threads, TThreads>::commits_(0);
+
   }
 }
 
@@ -12,7 +12,7 @@
 #include <boost/mpl/deref.hpp>
 #include <boost/mpl/next.hpp>
 #include <boost/type_traits/is_same.hpp>
-#include <boost/transact/detail/config.hpp>
+#include <atlas/transaction/detail/config.hpp>
 
 namespace boost {
   namespace transact {
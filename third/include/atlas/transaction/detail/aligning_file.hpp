@@ -10,6 +10,8 @@
 #include <boost/static_assert.hpp>
 #include <boost/assert.hpp>
 #include <cstring>
+#include <iostream>
+#include <string>
 
 namespace boost {
   namespace transact {
@@ -11,6 +11,10 @@
 #include <boost/static_assert.hpp>
 #include <boost/assert.hpp>
 #include <cstring>
+#include <cstdlib>
+#include <new>
+#include <iostream>
+#include <string>
 
 namespace boost {
   namespace transact {
@@ -44,6 +48,27 @@ namespace boost {
           _aligned_free(data);
         };
       };
+#else
+// the O_DIRECT writes must start from a sector aligned address, see ofile<true>
+      template<std::size_t Capacity>
+      struct ofile_buffer<Capacity,true> {
+        static const bool direct = true;
+        static std::size_t const alignment = 4096;
+        char *data;
+
+        ofile_buffer() : data(0) {
+          void *p = 0;
+          if (::posix_memalign(&p, alignment, Capacity) != 0) throw std::bad_alloc();
+          data = static_cast<char *>(p);
+        }
+        ~ofile_buffer() {
+          std::free(data);
+        }
+
+      private:
+        ofile_buffer(ofile_buffer const &);
+        ofile_buffer &operator=(ofile_buffer const &);
+      };
 #endif
 
       template<class Base, std::size_t Capacity>
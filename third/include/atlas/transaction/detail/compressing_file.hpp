@@ -0,0 +1,214 @@
+//          Copyright Stefan Strasser 2009 - 2013.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#ifndef BOOST_TRANSACT_DETAIL_COMPRESSING_FILE_HPP
+#define BOOST_TRANSACT_DETAIL_COMPRESSING_FILE_HPP
+
+#include <string>
+#include <cstring>
+#include <algorithm>
+#include <iostream>
+#include <boost/assert.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/mpl/size_t.hpp>
+#include <boost/scoped_array.hpp>
+#include <atlas/transaction/exception.hpp>
+#include <atlas/transaction/detail/file.hpp>
+#include <atlas/transaction/detail/lz4.hpp>
+
+namespace boost {
+  namespace transact {
+    namespace detail {
+
+      //a compressed block is written as a frame of the raw size, the payload size, the xxHash32 of
+      //the raw data and the LZ4 payload. the raw size has the high bit set if the block is stored
+      //uncompressed, since it doesn't compress
+      struct compressed_frame_header {
+        uint32_t raw_size;
+        uint32_t payload_size;
+        uint32_t checksum;
+      };
+
+      static uint32_t const stored_block = 0x80000000U;
+
+      //compresses every block flushed, or every 64K written. the frames are written to the base
+      //file, which is usually the sectorizing file, so the torn writes are detected as they are
+      //without compression
+      template<class Base>
+      class compressing_seq_ofile {
+      public:
+
+        typedef typename Base::size_type size_type;
+
+        explicit compressing_seq_ofile(std::string const &name) :
+            base(name), raw(new char[lz4::max_block_size]),
+            compressed(new char[lz4::compress_bound(lz4::max_block_size)]), size(0) {
+        }
+
+        ~compressing_seq_ofile() {
+          try {
+            this->flush_buffer();
+          }
+          catch (...) {
+#ifndef NDEBUG
+            std::cerr << "ignored exception" << std::endl;
+#endif
+          }
+        }
+
+        template<class Size>
+        void write(void const *data, Size s) {
+          char const *cdata = static_cast<char const *>(data);
+          std::size_t left = s;
+
+          while (left > 0) {
+            std::size_t const write = std::min(left, lz4::max_block_size - this->size);
+            std::memcpy(this->raw.get() + this->size, cdata, write);
+            this->size += write;
+            cdata += write;
+            left -= write;
+
+            if (this->size == lz4::max_block_size) this->flush_buffer();
+          }
+        }
+
+        // the compressed bytes on disk, and the raw bytes buffered
+        size_type position() const {
+          return this->base.position() + this->size;
+        }
+
+        void flush() {
+          this->flush_buffer();
+          this->base.flush();
+        }
+
+        void sync() {
+          this->base.sync();
+        }
+
+        void close() {
+          this->flush_buffer();
+          this->base.close();
+        }
+
+        void reopen(std::string const &name) {
+          BOOST_ASSERT(this->size == 0);
+          this->base.reopen(name);
+        }
+
+      private:
+
+        void flush_buffer() {
+          if (this->size == 0) return;
+
+          compressed_frame_header header;
+          header.checksum = lz4::checksum(this->raw.get(), this->size);
+
+          std::size_t const csize = lz4::compress(this->raw.get(), this->size, this->compressed.get());
+          char const *payload = this->compressed.get();
+          if (csize < this->size) {
+            header.raw_size = static_cast<uint32_t>(this->size);
+            header.payload_size = static_cast<uint32_t>(csize);
+          }
+          else {
+            header.raw_size = static_cast<uint32_t>(this->size) | stored_block;
+            header.payload_size = static_cast<uint32_t>(this->size);
+            payload = this->raw.get();
+          }
+
+          this->base.write(&header, mpl::size_t<sizeof(header)>());
+          this->base.write(payload, std::size_t(header.payload_size));
+          this->size = 0;
+        }
+
+        Base base;
+        scoped_array<char> raw;
+        scoped_array<char> compressed;
+        std::size_t size;
+      };
+
+      template<class Base>
+      class compressing_seq_ifile {
+      public:
+
+        typedef typename Base::size_type size_type;
+
+        explicit compressing_seq_ifile(std::string const &name) :
+            base(name), raw(new char[lz4::max_block_size]),
+            compressed(new char[lz4::compress_bound(lz4::max_block_size)]), pos(0), size(0) {
+        }
+
+        template<class Size>
+        void read(void *data, Size s) {
+          char *cdata = static_cast<char *>(data);
+          std::size_t left = s;
+          bool some = false;
+
+          while (left > 0) {
+            if (this->pos == this->size) {
+              try {
+                this->read_block();
+              }
+              catch (eof_exception &) {
+                //at least some data was read, real EOFs are thrown at the beginning
+                if (some) throw io_failure();
+                throw;
+              }
+            }
+
+            std::size_t const read = std::min(left, this->size - this->pos);
+            std::memcpy(cdata, this->raw.get() + this->pos, read);
+            this->pos += read;
+            cdata += read;
+            left -= read;
+            some = true;
+          }
+        }
+
+      private:
+
+        void read_block() {
+          compressed_frame_header header;
+          this->base.read(&header, mpl::size_t<sizeof(header)>());
+
+          std::size_t const rsize = header.raw_size & ~stored_block;
+          if (rsize == 0 || rsize > lz4::max_block_size || header.payload_size > lz4::compress_bound(rsize)) {
+            throw io_failure();
+          }
+
+          try {
+            if (header.raw_size & stored_block) {
+              if (header.payload_size != rsize) throw io_failure();
+              this->base.read(this->raw.get(), std::size_t(rsize));
+            }
+            else {
+              this->base.read(this->compressed.get(), std::size_t(header.payload_size));
+              if (!lz4::decompress(this->compressed.get(), header.payload_size, this->raw.get(), rsize)) {
+                throw io_failure();
+              }
+            }
+          }
+          catch (eof_exception &) {
+            throw io_failure();
+          }
+
+          if (lz4::checksum(this->raw.get(), rsize) != header.checksum) throw io_failure();
+
+          this->pos = 0;
+          this->size = rsize;
+        }
+
+        Base base;
+        scoped_array<char> raw;
+        scoped_array<char> compressed;
+        std::size_t pos;
+        std::size_t size;
+      };
+
+    }
+  }
+}
+
+#endif
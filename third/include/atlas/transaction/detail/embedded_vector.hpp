@@ -15,7 +15,7 @@
 #include <boost/mpl/bool.hpp>
 #include <boost/mpl/size_t.hpp>
 #include <boost/assert.hpp>
-#include <boost/transact/array_extension.hpp>
+#include <atlas/transaction/array_extension.hpp>
 
 
 namespace boost{
@@ -169,7 +169,7 @@ private:
     static void copy_construct_n(T *dest,InputIterator src,Size n){
         copy_construct_n(
             dest,src,n,
-            mpl::bool_<is_pod<T>::value && has_contiguous_values<InputIterator>::value>()
+            integral_constant<bool,is_pod<T>::value && has_contiguous_values<InputIterator>::value>()
 	);
     }
     template<class InputIterator,class Size>
@@ -6,8 +6,16 @@
 #ifndef BOOST_TRANSACT_DETAIL_FILE_HPP
 #define BOOST_TRANSACT_DETAIL_FILE_HPP
 
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <errno.h>
+#ifndef _WIN32
+#include <unistd.h>
+#include <fcntl.h>
+#endif
 #include <boost/filesystem.hpp>
-#include <boost/transact/exception.hpp>
+#include <atlas/transaction/exception.hpp>
 
 namespace boost {
   namespace transact {
@@ -114,15 +122,20 @@ namespace boost {
 
 #else
 
-#include <unistd.h>
-#include <fcntl.h>
-
 #ifndef _POSIX_SYNCHRONIZED_IO
 #error no POSIX synchronized IO available
 #endif
 
-// low-level ofile for Linux/Unix
-      template<bool direct_io = false> // ignored on Posix API.
+/*
+ * low-level ofile for Linux/Unix
+ *
+ * With direct_io the file is opened with O_DIRECT, so the log appends do not go through the page cache, and are
+ * not buffered twice, the layers above write whole 512 bytes sectors at the sector offsets from sector aligned
+ * buffers, see aligning_seq_ofile and ofile_buffer<Capacity, true>. A write from an unaligned buffer is copied
+ * to an aligned one first. The file systems which do not support O_DIRECT, tmpfs for example, fall back to the
+ * buffered writes. sync() is still needed to flush the device cache
+ * */
+      template<bool direct_io = false>
       class ofile {
       public:
 
@@ -130,13 +143,14 @@ namespace boost {
         static const bool has_direct_io = direct_io;
 
         ofile(std::string const &name) :
-            filedes(-1), name(name) {
+            filedes(-1), name(name), bounce(0), bounce_size(0) {
           this->open_();
           this->sync_directory();
         }
 
         ~ofile() {
           this->close();
+          std::free(this->bounce);
         }
 
         void seek(size_type const &s) {
@@ -144,6 +158,8 @@ namespace boost {
         }
 
         size_type write(const char *data, size_type const &size) {
+          if (direct_io && reinterpret_cast<std::size_t>(data) % direct_alignment != 0) data = this->aligned_copy(data, size);
+
           if (::write(this->filedes, data, size) != ssize_t(size)) throw io_failure();
           return size;
         }
@@ -152,7 +168,7 @@ namespace boost {
         }
 
         void sync() {
-#ifdef linux
+#ifdef __linux__
           if (::fdatasync(this->filedes) != 0) throw io_failure();
 #else //multiple sources say fdatasync is not safe on other systems
           if(::fsync(this->filedes) != 0) throw io_failure();
@@ -197,15 +213,41 @@ namespace boost {
 
         void open_(int flags = O_CREAT | O_TRUNC) {
           flags |= O_WRONLY;
-#ifdef linux
+#ifdef __linux__
           flags |= O_NOATIME;
+#endif
+#ifdef O_DIRECT
+          if (direct_io) {
+            this->filedes = open(this->name.c_str(), flags | O_DIRECT, S_IRUSR | S_IWUSR);
+            if (this->filedes != -1 || errno != EINVAL) {
+              if (this->filedes == -1) throw io_failure();
+              return;
+            }
+          }
 #endif
           this->filedes = open(this->name.c_str(), flags, S_IRUSR | S_IWUSR);
           if (this->filedes == -1) throw io_failure();
         }
 
+        const char *aligned_copy(const char *data, size_type const &size) {
+          if (size > this->bounce_size) {
+            void *p = 0;
+            if (::posix_memalign(&p, direct_alignment, size) != 0) throw std::bad_alloc();
+            std::free(this->bounce);
+            this->bounce = static_cast<char *>(p);
+            this->bounce_size = size;
+          }
+
+          std::memcpy(this->bounce, data, size);
+          return this->bounce;
+        }
+
+        static std::size_t const direct_alignment = 512;
+
         int filedes;
         std::string name;
+        char *bounce;
+        size_type bounce_size;
       };
 
 #endif
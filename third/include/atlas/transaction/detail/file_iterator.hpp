@@ -9,7 +9,8 @@
 
 #include <iterator>
 #include <boost/mpl/bool.hpp>
-#include <boost/transact/array_extension.hpp>
+#include <boost/mpl/size_t.hpp>
+#include <atlas/transaction/array_extension.hpp>
 #include <boost/type_traits/is_pod.hpp>
 #include <boost/static_assert.hpp>
 #include <boost/optional/optional.hpp>
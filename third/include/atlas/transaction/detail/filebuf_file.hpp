@@ -10,8 +10,8 @@
 #include <string>
 #include <boost/mpl/size_t.hpp>
 #include <boost/filesystem.hpp>
-#include <boost/transact/exception.hpp>
-#include <boost/transact/detail/file.hpp>
+#include <atlas/transaction/exception.hpp>
+#include <atlas/transaction/detail/file.hpp>
 
 #ifdef BOOST_MSVC
 #pragma warning(push)
@@ -49,7 +49,8 @@ namespace boost {
 
         void flush() { if (this->buf.pubsync() != 0) throw io_failure(); }
 
-        void sync() { throw unsupported_operation(); }
+        //the file of an unsynced log, ologfile<false>, a commit hands the records to the OS only
+        void sync() { this->flush(); }
 
         void close() { if (!this->buf.close()) throw io_failure(); }
 
@@ -0,0 +1,218 @@
+//          Copyright Stefan Strasser 2009 - 2013.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#ifndef BOOST_TRANSACT_DETAIL_LZ4_HPP
+#define BOOST_TRANSACT_DETAIL_LZ4_HPP
+
+#include <cstring>
+#include <boost/assert.hpp>
+#include <boost/cstdint.hpp>
+
+//the LZ4 block format and the xxHash32 checksum LZ4 frames use, so the compressed log blocks
+//can be inspected by the standard tools. a self contained implementation of the fast greedy
+//compressor, the blocks are 64K at most, so the offsets always fit
+
+namespace boost {
+  namespace transact {
+    namespace detail {
+      namespace lz4 {
+
+        static std::size_t const max_block_size = 64 * 1024;
+
+        // the worst case of incompressible data
+        inline std::size_t compress_bound(std::size_t size) {
+          return size + size / 255 + 16;
+        }
+
+        inline uint32_t read32(unsigned char const *p) {
+          uint32_t v;
+          std::memcpy(&v, p, sizeof(v));
+          return v;
+        }
+
+        inline unsigned char *write_length(unsigned char *op, std::size_t length) {
+          for (; length >= 255; length -= 255) *op++ = 255;
+          *op++ = static_cast<unsigned char>(length);
+          return op;
+        }
+
+        // compress the block into dest, which has compress_bound(size) bytes, return the compressed size
+        inline std::size_t compress(void const *source, std::size_t size, void *dest) {
+          BOOST_ASSERT(size <= max_block_size);
+
+          static std::size_t const min_match = 4;
+          static std::size_t const last_literals = 5;
+          static std::size_t const match_find_limit = 12;
+          static unsigned int const hash_log = 12;
+
+          unsigned char const *const src = static_cast<unsigned char const *>(source);
+          unsigned char const *const end = src + size;
+          unsigned char const *ip = src;
+          unsigned char const *anchor = src;
+          unsigned char *op = static_cast<unsigned char *>(dest);
+
+          if (size > match_find_limit) {
+            unsigned char const *const mflimit = end - match_find_limit;
+            unsigned char const *const matchlimit = end - last_literals;
+            uint16_t table[1 << hash_log];
+            std::memset(table, 0, sizeof(table));
+
+            while (ip < mflimit) {
+              uint32_t const sequence = read32(ip);
+              uint32_t const h = (sequence * 2654435761U) >> (32 - hash_log);
+              unsigned char const *ref = src + table[h];
+              table[h] = static_cast<uint16_t>(ip - src);
+
+              if (ref >= ip || read32(ref) != sequence) {
+                ++ip;
+                continue;
+              }
+
+              unsigned char const *m = ip + min_match;
+              unsigned char const *r = ref + min_match;
+              while (m < matchlimit && *m == *r) {
+                ++m;
+                ++r;
+              }
+
+              std::size_t const literals = ip - anchor;
+              std::size_t const match = m - ip - min_match;
+              std::size_t const offset = ip - ref;
+
+              unsigned char *token = op++;
+              *token = static_cast<unsigned char>((literals < 15 ? literals : 15) << 4);
+              if (literals >= 15) op = write_length(op, literals - 15);
+              std::memcpy(op, anchor, literals);
+              op += literals;
+
+              *op++ = static_cast<unsigned char>(offset);
+              *op++ = static_cast<unsigned char>(offset >> 8);
+
+              *token |= static_cast<unsigned char>(match < 15 ? match : 15);
+              if (match >= 15) op = write_length(op, match - 15);
+
+              ip = anchor = m;
+            }
+          }
+
+          //the last sequence has the literals only
+          std::size_t const literals = end - anchor;
+          *op++ = static_cast<unsigned char>((literals < 15 ? literals : 15) << 4);
+          if (literals >= 15) op = write_length(op, literals - 15);
+          std::memcpy(op, anchor, literals);
+          op += literals;
+
+          return op - static_cast<unsigned char *>(dest);
+        }
+
+        // decompress exactly size bytes into dest, return false if the block is corrupted
+        inline bool decompress(void const *source, std::size_t compressed, void *dest, std::size_t size) {
+          unsigned char const *ip = static_cast<unsigned char const *>(source);
+          unsigned char const *const iend = ip + compressed;
+          unsigned char *const dst = static_cast<unsigned char *>(dest);
+          unsigned char *op = dst;
+          unsigned char *const oend = dst + size;
+
+          for (;;) {
+            if (ip >= iend) return false;
+            unsigned int const token = *ip++;
+
+            std::size_t literals = token >> 4;
+            if (literals == 15) {
+              unsigned char b;
+              do {
+                if (ip >= iend) return false;
+                b = *ip++;
+                literals += b;
+              }
+              while (b == 255);
+            }
+
+            if (literals > std::size_t(iend - ip) || literals > std::size_t(oend - op)) return false;
+            std::memcpy(op, ip, literals);
+            op += literals;
+            ip += literals;
+
+            if (ip == iend) return op == oend;
+
+            if (iend - ip < 2) return false;
+            std::size_t const offset = ip[0] | (ip[1] << 8);
+            ip += 2;
+            if (offset == 0 || offset > std::size_t(op - dst)) return false;
+
+            std::size_t match = token & 15;
+            if (match == 15) {
+              unsigned char b;
+              do {
+                if (ip >= iend) return false;
+                b = *ip++;
+                match += b;
+              }
+              while (b == 255);
+            }
+            match += 4;
+
+            if (match > std::size_t(oend - op)) return false;
+            //the match may overlap the output, copy byte by byte
+            unsigned char const *ref = op - offset;
+            for (std::size_t c = 0; c < match; ++c) *op++ = *ref++;
+          }
+        }
+
+        inline uint32_t rotl(uint32_t x, int r) {
+          return (x << r) | (x >> (32 - r));
+        }
+
+        // xxHash32
+        inline uint32_t checksum(void const *data, std::size_t size, uint32_t seed = 0) {
+          static uint32_t const prime1 = 2654435761U;
+          static uint32_t const prime2 = 2246822519U;
+          static uint32_t const prime3 = 3266489917U;
+          static uint32_t const prime4 = 668265263U;
+          static uint32_t const prime5 = 374761393U;
+
+          unsigned char const *p = static_cast<unsigned char const *>(data);
+          unsigned char const *const end = p + size;
+          uint32_t h;
+
+          if (size >= 16) {
+            unsigned char const *const limit = end - 16;
+            uint32_t v1 = seed + prime1 + prime2;
+            uint32_t v2 = seed + prime2;
+            uint32_t v3 = seed;
+            uint32_t v4 = seed - prime1;
+
+            do {
+              v1 = rotl(v1 + read32(p) * prime2, 13) * prime1;
+              v2 = rotl(v2 + read32(p + 4) * prime2, 13) * prime1;
+              v3 = rotl(v3 + read32(p + 8) * prime2, 13) * prime1;
+              v4 = rotl(v4 + read32(p + 12) * prime2, 13) * prime1;
+              p += 16;
+            }
+            while (p <= limit);
+
+            h = rotl(v1, 1) + rotl(v2, 7) + rotl(v3, 12) + rotl(v4, 18);
+          }
+          else h = seed + prime5;
+
+          h += static_cast<uint32_t>(size);
+
+          for (; p + 4 <= end; p += 4) h = rotl(h + read32(p) * prime3, 17) * prime4;
+          for (; p < end; ++p) h = rotl(h + *p * prime5, 11) * prime1;
+
+          h ^= h >> 15;
+          h *= prime2;
+          h ^= h >> 13;
+          h *= prime3;
+          h ^= h >> 16;
+          return h;
+        }
+
+      }
+    }
+  }
+}
+
+#endif
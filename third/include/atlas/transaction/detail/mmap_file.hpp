@@ -0,0 +1,103 @@
+//          Copyright Stefan Strasser 2009 - 2013.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#ifndef BOOST_TRANSACT_DETAIL_MMAP_FILE_HPP
+#define BOOST_TRANSACT_DETAIL_MMAP_FILE_HPP
+
+#include <string>
+#include <cstring>
+#include <boost/mpl/size_t.hpp>
+#include <atlas/transaction/exception.hpp>
+#include <atlas/transaction/detail/file.hpp>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace boost {
+  namespace transact {
+    namespace detail {
+
+#ifndef _WIN32
+
+//the input file of the recovery, the whole log is mapped read only and read front to back, so the kernel
+//reads ahead aggressively and drops the pages behind, see MADV_SEQUENTIAL. a read is a memcpy from the
+//mapping, there is no read call and no stream buffer in between
+      class mmap_seq_ifile {
+      public:
+
+        typedef unsigned long long size_type;
+
+        explicit mmap_seq_ifile(std::string const &name) :
+            data(0), size(0), pos(0) {
+          int fd = ::open(name.c_str(), O_RDONLY);
+          if (fd == -1) throw io_failure();
+
+          struct stat st;
+          if (::fstat(fd, &st) != 0) {
+            ::close(fd);
+            throw io_failure();
+          }
+
+          this->size = st.st_size;
+          if (this->size > 0) {
+            void *p = ::mmap(0, this->size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p == MAP_FAILED) {
+              ::close(fd);
+              throw io_failure();
+            }
+
+            ::madvise(p, this->size, MADV_SEQUENTIAL);
+            this->data = static_cast<char const *>(p);
+          }
+
+          //the mapping stays valid after the descriptor is closed
+          ::close(fd);
+        }
+
+        ~mmap_seq_ifile() {
+          if (this->data) ::munmap(const_cast<char *>(this->data), this->size);
+        }
+
+        void read(void *dataptr, mpl::size_t<1>) {
+          if (this->pos == this->size) throw eof_exception();
+          *static_cast<char *>(dataptr) = this->data[this->pos++];
+        }
+
+        void read(void *dataptr, std::size_t s) {
+          if (this->pos == this->size) throw eof_exception();
+          if (this->size - this->pos < s) {
+            this->pos = this->size;
+            throw io_failure();
+          }
+
+          std::memcpy(dataptr, this->data + this->pos, s);
+          this->pos += s;
+        }
+
+        size_type position() const {
+          return this->pos;
+        }
+
+      private:
+
+        mmap_seq_ifile(mmap_seq_ifile const &);
+        mmap_seq_ifile &operator=(mmap_seq_ifile const &);
+
+        char const *data;
+        size_type size;
+        size_type pos;
+      };
+
+#endif
+
+    }
+  }
+}
+
+#endif
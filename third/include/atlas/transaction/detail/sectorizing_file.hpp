@@ -10,7 +10,9 @@
 #include <boost/static_assert.hpp>
 #include <boost/assert.hpp>
 #include <cstring>
-#include <boost/transact/detail/file.hpp>
+#include <iostream>
+#include <string>
+#include <atlas/transaction/detail/file.hpp>
 
 namespace boost {
   namespace transact {
@@ -14,7 +14,8 @@
 #include <boost/static_assert.hpp>
 #include <boost/assert.hpp>
 #include <boost/config.hpp>
-#include <boost/transact/detail/buffering_file.hpp>
+#include <atlas/transaction/exception.hpp>
+#include <atlas/transaction/detail/buffering_file.hpp>
 
 namespace boost {
   namespace transact {
@@ -67,7 +68,7 @@ namespace boost {
         void close() {
           //do not actually close, just make sure contents are on disk. no call to base.close()!
           this->flush();
-          this->sync(); //TODO opimize sync in lock?
+          this->sync(); //the commits share the syncs outside the lock, see the group commit of transaction_olog
           this->pos = 0;
         }
 
@@ -10,12 +10,12 @@
 #include <boost/mpl/bool.hpp>
 #include <boost/type_traits/is_empty.hpp>
 #include <boost/optional/optional.hpp>
-#include <boost/transact/exception.hpp>
+#include <atlas/transaction/exception.hpp>
 #include <boost/noncopyable.hpp>
 #include <boost/assert.hpp>
 #include <boost/mpl/has_key.hpp>
-#include <boost/transact/resource_manager.hpp>
-#include <boost/transact/exception.hpp>
+#include <atlas/transaction/resource_manager.hpp>
+#include <atlas/transaction/exception.hpp>
 
 namespace boost {
   namespace transact {
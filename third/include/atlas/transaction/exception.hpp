@@ -8,11 +8,12 @@
 #define BOOST_TRANSACT_EXCEPTION_HEADER_HPP
 
 #include <exception>
+#include <utility>
 #include <boost/assert.hpp>
 #include <boost/mpl/begin.hpp>
 #include <boost/mpl/end.hpp>
 #include <boost/type_traits/is_same.hpp>
-#include <boost/transact/detail/algorithm.hpp>
+#include <atlas/transaction/detail/algorithm.hpp>
 
 
 namespace boost{
@@ -7,7 +7,7 @@
 #ifndef BOOST_TRANSACT_LANGUAGE_HPP
 #define BOOST_TRANSACT_LANGUAGE_HPP
 
-#include <boost/transact/transaction.hpp>
+#include <atlas/transaction/transaction.hpp>
 
 #define begin_transaction BOOST_TRANSACT_BEGIN_TRANSACTION
 #define retry BOOST_TRANSACT_RETRY
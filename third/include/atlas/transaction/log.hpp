@@ -3,16 +3,17 @@
 //    (See accompanying file LICENSE_1_0.txt or copy at
 //          http://www.boost.org/LICENSE_1_0.txt)
 
-//TODO: rolling log files are always started at .1 currently.
-//is persistent needs a header in the log file the old logs can't be deleted
-//until a new one is created, so the log needs to start at .<old+1>
-//better solution is to don't use a header for this purpose but safe this info in
-//an extra file by persistent
+//rolling log files are started at .<old+1>, so the old logs are never overwritten
+//before a new one is created. a checkpoint is written as the header of a new log,
+//the logs before it are removed once it's no longer needed, see transaction_olog::checkpoint()
 
 #ifndef BOOST_TRANSACT_LOG_HEADER_HPP
 #define BOOST_TRANSACT_LOG_HEADER_HPP
 
 #include <vector>
+#include <deque>
+#include <atomic>
+#include <cstring>
 #include <iterator>
 #include <algorithm>
 #include <boost/integer.hpp>
@@ -29,14 +30,26 @@
 #include <boost/mpl/if.hpp>
 #include <boost/mpl/eval_if.hpp>
 #include <boost/type_traits/is_same.hpp>
-#include <boost/transact/detail/sectorizing_file.hpp>
-#include <boost/transact/detail/aligning_file.hpp>
-#include <boost/transact/detail/buffering_file.hpp>
-#include <boost/transact/detail/syncing_file.hpp>
-#include <boost/transact/detail/filebuf_file.hpp>
-#include <boost/transact/detail/file.hpp>
-#include <boost/transact/detail/file_iterator.hpp>
-#include <boost/transact/archive.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/locks.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/function.hpp>
+#include <boost/scoped_array.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/bind.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/static_assert.hpp>
+#include <atlas/transaction/detail/sectorizing_file.hpp>
+#include <atlas/transaction/detail/aligning_file.hpp>
+#include <atlas/transaction/detail/buffering_file.hpp>
+#include <atlas/transaction/detail/syncing_file.hpp>
+#include <atlas/transaction/detail/filebuf_file.hpp>
+#include <atlas/transaction/detail/mmap_file.hpp>
+#include <atlas/transaction/detail/compressing_file.hpp>
+#include <atlas/transaction/detail/file.hpp>
+#include <atlas/transaction/detail/file_iterator.hpp>
+#include <atlas/transaction/archive.hpp>
 
 namespace boost {
   namespace transact {
@@ -74,16 +87,15 @@ namespace boost {
         }
       }
 
-    /*
-     static unsigned int get_next_log_id(std::string const &name){
-     std::vector<unsigned int> ids;
-     get_existing_log_ids(std::back_inserter(ids),name);
-     return ids.empty() ? 1 : *std::max_element(ids.begin(),ids.end())+1;
-     }
+      static unsigned int get_next_log_id(std::string const &name) {
+        std::vector<unsigned int> ids;
+        get_existing_log_ids(std::back_inserter(ids), name);
+        return ids.empty() ? 1 : *std::max_element(ids.begin(), ids.end()) + 1;
+      }
 
-     static std::string get_log_filename(std::string const &name,unsigned int l){
-     return name+'.'+lexical_cast<std::string>(l);
-     }*/
+      static std::string get_log_filename(std::string const &name, unsigned int l) {
+        return name + '.' + lexical_cast<std::string>(l);
+      }
 
     }
 
@@ -199,14 +211,21 @@ namespace boost {
       File &file;
     };
 
+    /*
+     * Group commit : commit() appends the record to the shared log buffer under a short lock, and waits until a sync
+     * covers it. The first committer which finds no sync running becomes the leader, it flushes everything appended
+     * so far and issues one fdatasync outside the lock, the others keep appending meanwhile, and all the records
+     * flushed before the sync are durable once it returns. So a sync is shared by all the concurrent committers,
+     * the durable commit throughput grows with the concurrency instead of being capped at 1 / sync latency.
+     *
+     * A log roll syncs the old log by itself, it takes the leadership so it never closes a file being synced
+     * */
     template<class Entries, class RollingLogfile, class Id = unsigned int>
     class transaction_olog : public olog<Entries, RollingLogfile> {
 
       typedef olog<Entries, RollingLogfile> base_type;
 
-      struct detail {
-        struct null_header {
-        };
+      struct null_header {
       };
 
     public:
@@ -214,25 +233,107 @@ namespace boost {
       typedef Id id_type;
 
       transaction_olog(RollingLogfile &file, std::size_t max_log_size = 100 * 1024 * 1024) :
-          base_type(file), max_log_size(max_log_size), next_tx(1), open_txs(0), rolled_txs(0), roll_cutoff(0) {
+          base_type(file), max_log_size(max_log_size), next_tx(1), open_txs(0), rolled_txs(0), roll_cutoff(0),
+          checkpoint_log(0), appended(0), synced(0), syncing(false), stopping(false) {
+      }
+
+      // the durability callbacks pending are fired before it returns
+      ~transaction_olog() {
+        {
+          lock_guard<mutex> l(this->callbacks_mutex);
+          this->stopping = true;
+        }
+
+        this->callbacks_cond.notify_all();
+        if (this->flusher) this->flusher->join();
+      }
+
+      // append the record and return once it's on disk, thread safe
+      template<class T>
+      void commit(T const &record) {
+        std::size_t ticket = 0;
+
+        {
+          lock_guard<mutex> l(write_mutex);
+          base_type::operator<<(record);
+          ticket = ++appended;
+        }
+
+        sync_to(ticket);
+      }
+
+      // append the record without waiting for the disk, a later commit() or sync() makes it durable, thread safe
+      template<class T>
+      void append(T const &record) {
+        lock_guard<mutex> l(write_mutex);
+        base_type::operator<<(record);
+        ++appended;
+      }
+
+      typedef function<void(bool)> durable_callback;
+
+      /*
+       * Append the record and return at once, the callback is called from the flusher thread of the log
+       * once the record is durable, or with false if the sync failed. The caller never waits for the disk,
+       * for example, an RPC handler commits and replies from the callback, the worker is free meanwhile.
+       * The flusher shares the syncs with the other committers, see commit(), thread safe
+       * */
+      template<class T>
+      void commit_async(T const &record, durable_callback const &callback) {
+        lock_guard<mutex> l(this->write_mutex);
+        base_type::operator<<(record);
+        std::size_t const ticket = ++this->appended;
+
+        {
+          //the callbacks are queued in the ticket order, under the write mutex
+          lock_guard<mutex> c(this->callbacks_mutex);
+          if (!this->flusher) this->flusher.reset(new thread(bind(&transaction_olog::run_flusher, this)));
+          this->callbacks.push_back(std::make_pair(ticket, callback));
+        }
+
+        this->callbacks_cond.notify_one();
+      }
+
+      // make all the records appended so far durable
+      void sync() {
+        std::size_t ticket = 0;
+
+        {
+          lock_guard<mutex> l(write_mutex);
+          ticket = appended;
+        }
+
+        sync_to(ticket);
       }
 
       Id begin_transaction() {
-        return begin_transaction(detail::null_header());
+        return begin_transaction(null_header());
       }
 
       template<class Header>
       Id begin_transaction(const Header & header) {
         Id tx = next_tx++;
-        if (!rolling() && file.position() >= max_log_size) {
+        if (!rolling() && this->full()) {
           //don't roll a second time until all transactions started in the old log
           //are closed, RollingLogfile only guarantees a minimum of 2 existing files
-          file.roll();
+          lead();
+
+          try {
+            lock_guard<mutex> l(write_mutex);
+            //closing the old log flushes and syncs it, so everything appended so far is durable
+            this->file.roll();
+            write_header(header);
+            follow(appended);
+          }
+          catch (...) {
+            follow(synced_ticket());
+            throw;
+          }
+
           roll_cutoff = tx;
           BOOST_ASSERT(rolled_txs == 0);
           rolled_txs = open_txs;
           open_txs = 0;
-          write_header(header);
         }
 
         BOOST_ASSERT(!rolling() || tx >= roll_cutoff);
@@ -247,6 +348,10 @@ namespace boost {
           //if rolled_txs is now 0 all transactions started in the old, rolled, log have
           //successfully ended. rolling() now returns false, removing the old log file
           //and thus another log roll is safe from now on
+          if (!this->rolling() && this->checkpoint_log != 0) {
+            //the logs before the checkpoint are not needed for recovery anymore
+            this->file.reclaim(this->checkpoint_log);
+          }
         }
         else {
           BOOST_ASSERT(open_txs > 0);
@@ -258,15 +363,160 @@ namespace boost {
         return rolled_txs > 0;
       }
 
+      /*
+       * Take a fuzzy checkpoint, the log is rolled and the snapshot is written as the header of the new log,
+       * so the recovery starts from the snapshot and replays the new log only. The transactions keep running,
+       * those started before the checkpoint are finished in the new log, the old logs are removed once they
+       * have all ended, see end_transaction().
+       *
+       * The snapshot must be a log entry, it's synced before the function returns. It returns false and
+       * does nothing if the last roll is still in progress, the caller retries later.
+       * Like begin_transaction() and end_transaction(), it's not thread safe against them
+       * */
+      template<class Snapshot>
+      bool checkpoint(Snapshot const &snapshot) {
+        if (this->rolling()) return false;
+
+        this->lead();
+
+        try {
+          lock_guard<mutex> l(this->write_mutex);
+          this->file.roll();
+          this->write_header(snapshot);
+          this->file.flush();
+          this->file.sync();
+          this->follow(this->appended);
+        }
+        catch (...) {
+          this->follow(this->synced_ticket());
+          throw;
+        }
+
+        this->roll_cutoff = this->next_tx;
+        this->rolled_txs = this->open_txs;
+        this->open_txs = 0;
+        this->checkpoint_log = this->file.log_id();
+
+        if (!this->rolling()) this->file.reclaim(this->checkpoint_log);
+        return true;
+      }
+
     private:
-      void write_header(detail::null_header const &) {
+
+      // the active log reached the roll size, the committers move the position under the write mutex
+      bool full() {
+        lock_guard<mutex> l(this->write_mutex);
+        return this->file.position() >= this->max_log_size;
+      }
+
+      // wait until a sync covers the ticket, or lead one
+      void sync_to(std::size_t ticket) {
+        unique_lock<mutex> l(sync_mutex);
+
+        while (synced < ticket) {
+          if (syncing) {
+            synced_cond.wait(l);
+            continue;
+          }
+
+          syncing = true;
+          l.unlock();
+
+          std::size_t target = 0;
+          try {
+            {
+              lock_guard<mutex> w(write_mutex);
+              this->file.flush();
+              target = appended;
+            }
+
+            // the others append while we sync
+            this->file.sync();
+          }
+          catch (...) {
+            follow(synced_ticket());
+            throw;
+          }
+
+          follow(target);
+          l.lock();
+        }
+      }
+
+      // take the sync leadership
+      void lead() {
+        unique_lock<mutex> l(sync_mutex);
+        while (syncing) synced_cond.wait(l);
+
+        syncing = true;
+      }
+
+      // give up the leadership, the records up to the ticket are durable
+      void follow(std::size_t ticket) {
+        {
+          lock_guard<mutex> l(sync_mutex);
+          if (ticket > synced) synced = ticket;
+          syncing = false;
+        }
+
+        synced_cond.notify_all();
+      }
+
+      std::size_t synced_ticket() {
+        lock_guard<mutex> l(sync_mutex);
+        return synced;
+      }
+
+      // sync the records the callbacks wait for, and fire the callbacks
+      void run_flusher() {
+        unique_lock<mutex> l(this->callbacks_mutex);
+
+        for (;;) {
+          while (!this->stopping && this->callbacks.empty()) this->callbacks_cond.wait(l);
+          if (this->callbacks.empty()) return;
+
+          std::size_t const target = this->callbacks.back().first;
+          l.unlock();
+
+          bool durable = true;
+          try {
+            this->sync_to(target);
+          }
+          catch (...) {
+            durable = false;
+          }
+
+          std::size_t const done = durable ? this->synced_ticket() : target;
+          std::deque<std::pair<std::size_t, durable_callback> > ready;
+
+          l.lock();
+          while (!this->callbacks.empty() && this->callbacks.front().first <= done) {
+            ready.push_back(this->callbacks.front());
+            this->callbacks.pop_front();
+          }
+          l.unlock();
+
+          for (typename std::deque<std::pair<std::size_t, durable_callback> >::iterator it = ready.begin();
+              it != ready.end(); ++it) {
+            try {
+              it->second(durable);
+            }
+            catch (...) {
+            }
+          }
+
+          l.lock();
+        }
+      }
+
+      void write_header(null_header const &) {
       }
 
       template<class Header>
       void write_header(Header const &header) {
         typedef detail::file_output_iterator<RollingLogfile> it_type;
 
-        it_type it(file);
+        it_type it(this->file);
         char_oarchive<it_type> archive(it);
         archive << detail::log_entry_id<Entries, Header>::type::value;
         archive << header;
@@ -276,38 +526,70 @@ namespace boost {
       Id next_tx;
       std::size_t open_txs, rolled_txs;
       Id roll_cutoff;
+      // the log starting with the last checkpoint, 0 if none
+      unsigned int checkpoint_log;
+
+      // the records appended and synced are counted as tickets
+      mutex write_mutex;
+      mutex sync_mutex;
+      condition_variable synced_cond;
+      std::size_t appended, synced;
+      bool syncing;
+
+      // the commit_async callbacks by ticket, fired by the flusher thread
+      mutex callbacks_mutex;
+      condition_variable callbacks_cond;
+      std::deque<std::pair<std::size_t, durable_callback> > callbacks;
+      scoped_ptr<thread> flusher;
+      bool stopping;
     };
 
     namespace detail {
 
-      template<bool Sync>
-      struct ologfile_type {
+      // a synced log may bypass the page cache, see ofile<true>
+      template<bool Sync, bool Direct>
+      struct plain_ologfile_type {
         typedef typename mpl::if_c<Sync,
             detail::sectorizing_seq_ofile<
-                detail::aligning_seq_ofile<detail::buffering_seq_ofile<detail::syncing_seq_ofile<detail::ofile<false> //FIXME argument. why is this a parameter?
+                detail::aligning_seq_ofile<detail::buffering_seq_ofile<detail::syncing_seq_ofile<detail::ofile<Direct>
                     >, 8192> > >, detail::buffering_seq_ofile<detail::filebuf_seq_ofile, 8192> >::type type;
       };
 
-      template<bool Sync>
+      // a compressed log writes the LZ4 frames through the plain file, see compressing_seq_ofile
+      template<bool Sync, bool Direct, bool Compress>
+      struct ologfile_type {
+        typedef typename plain_ologfile_type<Sync, Direct>::type plain_type;
+        typedef typename mpl::if_c<Compress, detail::compressing_seq_ofile<plain_type>, plain_type>::type type;
+      };
+
+#ifdef _WIN32
+      typedef detail::filebuf_seq_ifile raw_ifile_type;
+#else
+      typedef detail::mmap_seq_ifile raw_ifile_type;
+#endif
+
+      template<bool Sync, bool Compress>
       struct ilogfile_type {
-        typedef typename mpl::if_c<Sync, detail::sectorizing_seq_ifile<detail::filebuf_seq_ifile>,
-            detail::filebuf_seq_ifile>::type type;
+        typedef typename mpl::if_c<Sync, detail::sectorizing_seq_ifile<raw_ifile_type>,
+            raw_ifile_type>::type plain_type;
+        typedef typename mpl::if_c<Compress, detail::compressing_seq_ifile<plain_type>, plain_type>::type type;
       };
 
     }
 
-    template<bool Sync>
-    class ologfile : public detail::ologfile_type<Sync>::type {
-      typedef typename detail::ologfile_type<Sync>::type base_type;
+    template<bool Sync, bool Direct = false, bool Compress = false>
+    class ologfile : public detail::ologfile_type<Sync, Direct, Compress>::type {
+      typedef typename detail::ologfile_type<Sync, Direct, Compress>::type base_type;
 
     public:
 
       explicit ologfile(std::string const &name) : base_type(name) { }
     };
 
-    template<bool Sync>
-    class ilogfile : public detail::ilogfile_type<Sync>::type {
-      typedef typename detail::ilogfile_type<Sync>::type base_type;
+    // Compress must match the ologfile the log was written with
+    template<bool Sync, bool Compress = false>
+    class ilogfile : public detail::ilogfile_type<Sync, Compress>::type {
+      typedef typename detail::ilogfile_type<Sync, Compress>::type base_type;
 
     public:
 
@@ -322,9 +604,9 @@ namespace boost {
 
         typedef typename File::size_type size_type;
 
-        explicit rolling_ologfile_base(std::string const &name) : name(name), logid(1) {
-          files[0] = in_place(name + ".1");
-          active_ = &files[0];
+        explicit rolling_ologfile_base(std::string const &name) : name(name), logid(get_next_log_id(name)) {
+          this->files[0] = in_place(get_log_filename(name, this->logid));
+          this->active_ = &this->files[0];
         }
 
         template<class Size>
@@ -344,6 +626,26 @@ namespace boost {
           return active()->position();
         }
 
+        // the id of the active log
+        unsigned int log_id() const {
+          return this->logid;
+        }
+
+        // remove the closed logs before the log id
+        void reclaim(unsigned int before) {
+          std::vector<unsigned int> ids;
+          get_existing_log_ids(std::back_inserter(ids), this->name);
+
+          try {
+            for (std::vector<unsigned int>::const_iterator it = ids.begin(); it != ids.end(); ++it) {
+              if (*it < before && *it != this->logid) filesystem::remove(get_log_filename(this->name, *it));
+            }
+          }
+          catch (...) {
+            throw io_failure();
+          }
+        }
+
       protected:
 
         optional<File> &active() {
@@ -379,16 +681,16 @@ namespace boost {
         //TODO optimization close() flushes/syncs the old logfile. one could also keep the old
         //log open until an explicit request to flush/sync the log causes all log files
         //to flush/sync
-        active()->close();
+        this->active()->close();
         //use 2 optional<>s because the new file must be fully constructed to replace the old one.
         //if construction fails there must be a valid old log file in active, and files
         //are not swap()able:
-        optional<File> &newlog = inactive();
+        optional<File> &newlog = this->inactive();
         BOOST_ASSERT(!newlog);
-        newlog = in_place(name + '.' + lexical_cast<std::string>(logid + 1));
-        active_ = &newlog;
-        ++logid;
-        inactive().reset();
+        newlog = in_place(detail::get_log_filename(this->name, this->logid + 1));
+        this->active_ = &newlog;
+        ++this->logid;
+        this->inactive().reset();
       }
     };
 
@@ -401,15 +703,15 @@ namespace boost {
       explicit alternating_ologfile(std::string const &name) : base_type(name) { }
 
       void roll() {
-        active()->close();
-        optional<File> &newlog = inactive();
-        std::string const newname = name + '.' + lexical_cast<std::string>(logid + 1);
+        this->active()->close();
+        optional<File> &newlog = this->inactive();
+        std::string const newname = detail::get_log_filename(this->name, this->logid + 1);
 
         if (!newlog) newlog = in_place(newname);
         else newlog->reopen(newname);
 
-        active_ = &newlog;
-        ++logid;
+        this->active_ = &newlog;
+        ++this->logid;
       }
     };
 
@@ -426,7 +728,7 @@ namespace boost {
         //must be a contiguous sequence of files:
         for (ids_type::const_iterator next = ids.begin(); next != ids.end();) {
           ids_type::const_iterator it = next++;
-          if (next != log_ids.end() && (*it != *next - 1)) throw io_failure();
+          if (next != ids.end() && (*it != *next - 1)) throw io_failure();
         }
 
         current = ids.begin();
@@ -471,85 +773,294 @@ namespace boost {
       ids_type::const_iterator current;
     };
 
-  /*
-   *
-   * old class (needs rewrite) that buffers log writes so the log itself only needs to be locked
-   * on flush. useful only when 2 logs are interlaced into the same file?
-
-   template<class Log,class Lockable,std::size_t Size>
-   class olog_buffer{
-   public:
-   typedef typename Log::id_type id_type;
-   olog_buffer(Log &log,Lockable &lockable)
-   : log(log), lockable(lockable){}
-   template<class T>
-   olog_buffer &operator<<(T const &t){
-   static std::size_t const size=sizeof(id_type) + sizeof(T);
-   BOOST_STATIC_ASSERT(size <= Size);
-   id_type const id=log.template id<T>();
-
-   if(buffer.size() + size > buffer.max_size()) flush();
-   buffer.push_back(reinterpret_cast<char const *>(&id),mpl::size_t<sizeof(id_type)>());
-   buffer.push_back(reinterpret_cast<char const *>(&t),mpl::size_t<sizeof(T)>());
-   return *this;
-   }
-   struct archive{
-   explicit archive(olog_buffer &log) : log(log){}
-   template<class T>
-   archive &operator<<(T const &t){
-   save_binary(&t,mpl::size_t<sizeof(T)>());
-   return *this;
-   }
-   template<class T>
-   archive &operator&(T const &t){ return operator<<(t); }
-   template<class S>
-   void save_binary(void const *data,S size){
-   if(log.buffer.size() + size > log.buffer.max_size()){
-   if(size > Size){
-   log.flush_and_write(data,size);
-   return;
-   }else{
-   log.flush();
-   }
-   }
-   log.buffer.push_back(static_cast<char const *>(data),size);
-   }
-   typedef mpl::true_ is_saving;
-   typedef mpl::false_ is_loading;
-   private:
-   olog_buffer &log;
-   };
-   private:
-   friend struct archive;
-
-   void flush(){
-   if(!buffer.empty()){
-   typename Log::archive ar(log);
-   {
-   lock_guard<Lockable> l(lockable);
-   ar.save_binary(&buffer[0],buffer.size());
-   }
-   buffer.clear();
-   }
-   }
-   template<class S>
-   void flush_and_write(void const *data,S size){
-   typename Log::archive ar(log);
-   lock_guard<Lockable> l(lockable);
-   if(!buffer.empty()){
-   ar.save_binary(&buffer[0],buffer.size());
-   buffer.clear();
-   }
-   ar.save_binary(data,size);
-   }
-
-
-   Log &log;
-   Lockable &lockable;
-   detail::embedded_vector<char,Size,false> buffer;
-   };
-
-   */
+    namespace detail {
+
+      //keeps the entries of a segment decoded by a replay thread, to be applied in the log order
+      template<class F>
+      struct segment_recorder {
+        template<class T>
+        void operator()(T const &t) const {
+          F const *f = this->f;
+          this->entries->push_back([f, t]() { (*f)(t); });
+        }
+
+        F const *f;
+        std::vector<function<void()> > *entries;
+      };
+
+    }
+
+    /*
+     * Replay the log files of a rolling log, calling f with every entry in the log order, as ilog does with
+     * a rolling_ilogfile. The log files are independent, since a log is rolled only between the entries, so they
+     * are decoded by several threads at the same time, and the decoded entries of a file are applied as soon as
+     * the files before it are applied, the recovery is bounded by the disk bandwidth instead of one parsing thread.
+     *
+     * File is the input file of one log file, ilogfile<true> for example, f is called in the calling thread only
+     * */
+    template<class Entries, class File, class F>
+    void replay_rolling_log(std::string const &name, F const &f, unsigned int threads = thread::hardware_concurrency()) {
+      std::vector<unsigned int> ids;
+      detail::get_existing_log_ids(std::back_inserter(ids), name);
+      std::sort(ids.begin(), ids.end());
+
+      for (std::size_t i = 1; i < ids.size(); ++i) {
+        if (ids[i] != ids[i - 1] + 1) throw io_failure();
+      }
+
+      if (ids.empty()) return;
+      if (threads == 0) threads = 1;
+      if (threads > ids.size()) threads = ids.size();
+
+      struct segment {
+        segment() : done(false), failed(false) {}
+
+        std::vector<function<void()> > entries;
+        bool done, failed;
+      };
+
+      std::vector<segment> segments(ids.size());
+      std::size_t next = 0;
+      bool stopped = false;
+      mutex m;
+      condition_variable decoded;
+
+      // a stopped replay leaves the rest of the files undecoded
+      auto decode = [&]() {
+        for (;;) {
+          std::size_t i = 0;
+          {
+            lock_guard<mutex> l(m);
+            if (stopped || next == segments.size()) return;
+            i = next++;
+          }
+
+          bool failed = false;
+          try {
+            File file(name + '.' + lexical_cast<std::string>(ids[i]));
+            ilog<Entries, File> log(file);
+
+            detail::segment_recorder<F> recorder = { &f, &segments[i].entries };
+            for (;;) log >> recorder;
+          }
+          catch (eof_exception &) {
+          }
+          catch (...) {
+            failed = true;
+          }
+
+          {
+            lock_guard<mutex> l(m);
+            segments[i].done = true;
+            segments[i].failed = failed;
+          }
+          decoded.notify_all();
+        }
+      };
+
+      thread_group group;
+      for (unsigned int t = 0; t < threads; ++t) group.create_thread(decode);
+
+      try {
+        for (std::size_t i = 0; i < segments.size(); ++i) {
+          {
+            unique_lock<mutex> l(m);
+            while (!segments[i].done) decoded.wait(l);
+            if (segments[i].failed) throw io_failure();
+          }
+
+          std::vector<function<void()> > entries;
+          entries.swap(segments[i].entries);
+          for (std::size_t e = 0; e < entries.size(); ++e) entries[e]();
+        }
+      }
+      catch (...) {
+        {
+          lock_guard<mutex> l(m);
+          stopped = true;
+        }
+
+        group.join_all();
+        throw;
+      }
+
+      group.join_all();
+    }
+
+    namespace detail {
+
+      // counts the bytes an entry serializes to
+      class counting_output_iterator : public std::iterator<std::output_iterator_tag, char> {
+      public:
+        explicit counting_output_iterator(std::size_t &count) : count(&count) {}
+        counting_output_iterator &operator=(char) {
+          ++*this->count;
+          return *this;
+        }
+        template<class InputIterator, class Size>
+        counting_output_iterator &insert(InputIterator, Size size) {
+          *this->count += size;
+          return *this;
+        }
+        counting_output_iterator &operator*() { return *this; }
+        counting_output_iterator &operator++() { return *this; }
+        counting_output_iterator operator++(int) { return *this; }
+      private:
+        std::size_t *count;
+      };
+
+      // writes an entry into the reserved region of a ring, wrapping around the end
+      class ring_output_iterator : public std::iterator<std::output_iterator_tag, char> {
+      public:
+        ring_output_iterator(char *buffer, std::size_t mask, unsigned long long pos) :
+            buffer(buffer), mask(mask), pos(pos) {}
+        ring_output_iterator &operator=(char v) {
+          this->buffer[this->pos++ & this->mask] = v;
+          return *this;
+        }
+        template<class Size>
+        ring_output_iterator &insert(char const *data, Size size) {
+          std::size_t const offset = this->pos & this->mask;
+          std::size_t const first = std::min<std::size_t>(size, this->mask + 1 - offset);
+          std::memcpy(this->buffer + offset, data, first);
+          std::memcpy(this->buffer, data + first, size - first);
+          this->pos += size;
+          return *this;
+        }
+        ring_output_iterator &operator*() { return *this; }
+        ring_output_iterator &operator++() { return *this; }
+        ring_output_iterator operator++(int) { return *this; }
+      private:
+        char *buffer;
+        std::size_t mask;
+        unsigned long long pos;
+      };
+
+    }
+
+    template<>
+    struct has_array_extension<detail::counting_output_iterator> : mpl::true_ {};
+    template<>
+    struct has_array_extension<detail::ring_output_iterator> : mpl::true_ {};
+
+    /*
+     * A log buffer the threads append to without a lock, replaces the old olog_buffer which buffered under a lock.
+     *
+     * A writer reserves the space of it's entry by a fetch-add on the tail, serializes the entry in place and marks
+     * it complete, so the writers copy their entries in parallel. The entries are completed in the reservation order,
+     * a writer waits for the ones reserved before it, which are being copied already, so the completed region
+     * is always contiguous. flush() writes the completed region to the file, one flusher at a time, outside of
+     * the writers' way. A writer which finds the ring full flushes it by itself.
+     *
+     * The entries are written as olog writes them, so the log is read back by ilog. An entry must fit
+     * into the capacity, which is a power of 2
+     * */
+    template<class Entries, class File, std::size_t Capacity = 1024 * 1024>
+    class olog_buffer : noncopyable {
+      BOOST_STATIC_ASSERT(Capacity > 0 && (Capacity & (Capacity - 1)) == 0);
+
+    public:
+
+      typedef typename detail::log_id_type<Entries>::type id_type;
+
+      explicit olog_buffer(File &file) : file(file), buffer(new char[Capacity]), tail(0), completed(0), flushed(0) {
+      }
+
+      ~olog_buffer() {
+        try {
+          this->flush();
+        }
+        catch (...) {
+        }
+      }
+
+      // append the entry, thread safe
+      template<class T>
+      olog_buffer &operator<<(T const &t) {
+        std::size_t size = 0;
+        this->serialize(detail::counting_output_iterator(size), t);
+        if (size > Capacity) throw io_failure();
+
+        unsigned long long const start = this->tail.fetch_add(size, std::memory_order_relaxed);
+        unsigned long long const end = start + size;
+
+        //wait until the flusher frees the room
+        while (end - this->flushed.load(std::memory_order_acquire) > Capacity) {
+          if (!this->try_flush()) this_thread::yield();
+        }
+
+        this->serialize(detail::ring_output_iterator(this->buffer.get(), Capacity - 1, start), t);
+
+        //publish in the reservation order
+        while (this->completed.load(std::memory_order_acquire) != start) this_thread::yield();
+        this->completed.store(end, std::memory_order_release);
+
+        return *this;
+      }
+
+      // write everything completed so far to the file
+      void flush() {
+        lock_guard<mutex> l(this->flush_mutex);
+        this->write_completed();
+      }
+
+      // flush and sync the file, if it's a syncing file
+      void sync() {
+        lock_guard<mutex> l(this->flush_mutex);
+        this->write_completed();
+        this->file.sync();
+      }
+
+    private:
+
+      template<class T>
+      void serialize(detail::counting_output_iterator it, T const &t) {
+        char_oarchive<detail::counting_output_iterator> archive(it);
+        archive << detail::log_entry_id<Entries, T>::type::value;
+        archive << t;
+      }
+
+      template<class T>
+      void serialize(detail::ring_output_iterator it, T const &t) {
+        char_oarchive<detail::ring_output_iterator> archive(it);
+        archive << detail::log_entry_id<Entries, T>::type::value;
+        archive << t;
+      }
+
+      bool try_flush() {
+        unique_lock<mutex> l(this->flush_mutex, try_to_lock);
+        if (!l.owns_lock()) return false;
+
+        this->write_completed();
+        return true;
+      }
+
+      // the flush mutex is held
+      void write_completed() {
+        unsigned long long const begin = this->flushed.load(std::memory_order_relaxed);
+        unsigned long long const end = this->completed.load(std::memory_order_acquire);
+        if (begin == end) return;
+
+        std::size_t const offset = begin & (Capacity - 1);
+        std::size_t const size = end - begin;
+        std::size_t const first = std::min<std::size_t>(size, Capacity - offset);
+        this->file.write(this->buffer.get() + offset, first);
+        if (first < size) this->file.write(this->buffer.get(), size - first);
+
+        this->flushed.store(end, std::memory_order_release);
+      }
+
+      File &file;
+      scoped_array<char> buffer;
+      mutex flush_mutex;
+
+      //the positions grow forever, they are masked into the ring
+      std::atomic<unsigned long long> tail;
+      char pad0[64];
+      std::atomic<unsigned long long> completed;
+      char pad1[64];
+      std::atomic<unsigned long long> flushed;
+    };
 
   }
 }
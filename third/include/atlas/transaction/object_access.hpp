@@ -13,15 +13,18 @@
 #include <boost/mpl/if.hpp>
 #include <boost/static_assert.hpp>
 #include <boost/assert.hpp>
-#include <boost/transact/detail/embedded_vector.hpp>
+#include <atlas/transaction/detail/embedded_vector.hpp>
 #include <cstring>
 #include <algorithm>
 #include <iterator>
+#include <utility>
 
 #ifndef NO_BOOST_SERIALIZATION
 
 #include <boost/serialization/serialization.hpp>
 #include <boost/serialization/version.hpp>
+#include <boost/serialization/tracking.hpp>
+#include <boost/serialization/access.hpp>
 #include <boost/archive/impl/archive_serializer_map.ipp>
 
 #endif
@@ -74,6 +77,20 @@ namespace boost {
         object_access::apply(f, t, empty<T>(), serialization::is_bitwise_serializable<T>());
       }
 
+      //a modified object is saved as the byte ranges of it's image that differ from the image of the original,
+      //so a small update of a large object logs a few bytes. the bitwise types are compared in place, the others
+      //by their serialized images. see detail::save_ranges for the format
+      template<class Archive, class T>
+      static void save_delta(Archive &ar, T const &original, T const &modified) {
+        object_access::save_delta(ar, original, modified, empty<T>(), serialization::is_bitwise_serializable<T>());
+      }
+
+      //t is the original the delta was saved against, it's the modified object once the delta is loaded
+      template<class Archive, class T>
+      static void load_delta(Archive &ar, T &t) {
+        object_access::load_delta(ar, t, empty<T>(), serialization::is_bitwise_serializable<T>());
+      }
+
     private:
 
       template<class T>
@@ -183,12 +200,32 @@ namespace boost {
 
       template<class T>
       static bool equal(T const &t1, T const &t2, mpl::false_ empty, mpl::false_ bitwise);
+
+      template<class Archive, class T, bool Bitwise>
+      static void save_delta(Archive &ar, T const &, T const &, mpl::true_ empty, mpl::bool_<Bitwise>) {
+      }
+
+      template<class Archive, class T>
+      static void save_delta(Archive &ar, T const &original, T const &modified, mpl::false_ empty, mpl::true_ bitwise);
+
+      template<class Archive, class T>
+      static void save_delta(Archive &ar, T const &original, T const &modified, mpl::false_ empty, mpl::false_ bitwise);
+
+      template<class Archive, class T, bool Bitwise>
+      static void load_delta(Archive &ar, T &t, mpl::true_ empty, mpl::bool_<Bitwise>) {
+      }
+
+      template<class Archive, class T>
+      static void load_delta(Archive &ar, T &t, mpl::false_ empty, mpl::true_ bitwise);
+
+      template<class Archive, class T>
+      static void load_delta(Archive &ar, T &t, mpl::false_ empty, mpl::false_ bitwise);
     };
 
   }
 }
 
-#include <boost/transact/archive.hpp>
+#include <atlas/transaction/archive.hpp>
 
 namespace boost {
   namespace transact {
@@ -264,15 +301,87 @@ namespace boost {
         bool &constructed;
       };
 
+#ifndef NO_BOOST_SERIALIZATION
+
+      template<class Archive, class T>
+      struct has_member_serialize {
+      private:
+        template<class U>
+        static char test(decltype(std::declval<U &>().serialize(std::declval<Archive &>(), 0u)) *);
+        template<class U>
+        static long test(...);
+      public:
+        static bool const value = sizeof(test<T>(0)) == sizeof(char);
+      };
+
+      //a class with a member serialize() is serialized by the archive itself, bypassing the virtual
+      //machinery of boost.serialization, if it doesn't need what only boost.serialization provides,
+      //the class version stored in the log and the object tracking. the arrays are serialized
+      //element by element, the arrays of bitwise serializable elements are copied at once.
+      //the fast path is picked at compile time, the log format of other types is unchanged
       template<class Archive, class T>
-      void serialize(Archive &ar, T &t, mpl::true_ saving) {
+      struct is_direct_serializable : mpl::bool_<has_member_serialize<Archive, T>::value
+          && !serialization::is_wrapper<T>::type::value && serialization::version<T>::value == 0
+          && serialization::tracking_level<T>::value != serialization::track_always> {
+      };
+
+      template<class Archive, class T, std::size_t N>
+      struct is_direct_serializable<Archive, T[N]> : mpl::true_ {
+      };
+
+      template<class Archive, class T>
+      void serialize_direct(Archive &ar, T &t) {
+        serialization::access::serialize(ar, t, 0u);
+      }
+
+      template<class Archive, class T, std::size_t N>
+      void serialize_direct(Archive &ar, T (&t)[N], mpl::true_ bitwise, mpl::true_ saving) {
+        ar.save_binary(&t[0], mpl::size_t<sizeof(T) * N>());
+      }
+
+      template<class Archive, class T, std::size_t N>
+      void serialize_direct(Archive &ar, T (&t)[N], mpl::true_ bitwise, mpl::false_ saving) {
+        ar.load_binary(&t[0], mpl::size_t<sizeof(T) * N>());
+      }
+
+      template<class Archive, class T, std::size_t N, class Saving>
+      void serialize_direct(Archive &ar, T (&t)[N], mpl::false_ bitwise, Saving) {
+        for (std::size_t c = 0; c < N; ++c) ar & t[c];
+      }
+
+      template<class Archive, class T, std::size_t N>
+      void serialize_direct(Archive &ar, T (&t)[N]) {
+        serialize_direct(ar, t, serialization::is_bitwise_serializable<T>(), typename Archive::is_saving());
+      }
+
+      template<class Archive, class T>
+      void serialize(Archive &ar, T &t, mpl::true_ saving, mpl::true_ direct) {
+        serialize_direct(ar, t);
+      }
+      template<class Archive, class T>
+      void serialize(Archive &ar, T &t, mpl::true_ saving, mpl::false_ direct) {
         archive::save(ar.serialization_archive(), t);
       }
       template<class Archive, class T>
-      void serialize(Archive &ar, T &t, mpl::false_ saving) {
+      void serialize(Archive &ar, T &t, mpl::false_ saving, mpl::true_ direct) {
+        serialize_direct(ar, t);
+      }
+      template<class Archive, class T>
+      void serialize(Archive &ar, T &t, mpl::false_ saving, mpl::false_ direct) {
         archive::load(ar.serialization_archive(), t);
       }
 
+      template<class Archive, class T>
+      void serialize(Archive &ar, T &t, mpl::true_ saving) {
+        detail::serialize(ar, t, saving, is_direct_serializable<Archive, T>());
+      }
+      template<class Archive, class T>
+      void serialize(Archive &ar, T &t, mpl::false_ saving) {
+        detail::serialize(ar, t, saving, is_direct_serializable<Archive, T>());
+      }
+
+#endif
+
       template<class Archive, class T>
       void serialize(Archive &ar, T &t, constructed_tag) {
 #ifdef NO_BOOST_SERIALIZATION
@@ -434,6 +543,79 @@ namespace boost {
         return equal_(t1, t2, deep_tag());
       }
 
+      //a gap between two changed ranges shorter than the header of a range is logged with them
+      std::size_t const delta_gap = 2 * sizeof(std::size_t);
+
+      //calls f(offset, size) for every range of modified that differs from original, the bytes past the end
+      //of original are one range
+      template<class F>
+      void for_each_range(char const *original, std::size_t original_size, char const *modified, std::size_t size,
+          F f) {
+        std::size_t const common = (std::min)(original_size, size);
+        std::size_t begin = 0, end = 0;
+        bool open = false;
+
+        std::size_t c = 0;
+        while (c < common) {
+          //the equal words are skipped at once
+          if (c + sizeof(std::size_t) <= common && std::memcmp(original + c, modified + c, sizeof(std::size_t)) == 0) {
+            c += sizeof(std::size_t);
+            continue;
+          }
+          if (original[c] == modified[c]) {
+            ++c;
+            continue;
+          }
+
+          if (!open || c - end >= delta_gap) {
+            if (open) f(begin, end - begin);
+            begin = c;
+            open = true;
+          }
+          while (c < common && original[c] != modified[c]) ++c;
+          end = c;
+        }
+
+        if (size > common) {
+          if (!open || common - end >= delta_gap) {
+            if (open) f(begin, end - begin);
+            begin = common;
+            open = true;
+          }
+          end = size;
+        }
+
+        if (open) f(begin, end - begin);
+      }
+
+      //the delta is the size of the modified image, the number of the ranges, and every range as it's offset,
+      //it's size and it's bytes
+      template<class Archive>
+      void save_ranges(Archive &ar, char const *original, std::size_t original_size, char const *modified,
+          std::size_t size) {
+        std::size_t count = 0;
+        for_each_range(original, original_size, modified, size, [&count](std::size_t, std::size_t) {++count;});
+
+        ar << size << count;
+        for_each_range(original, original_size, modified, size, [&ar, modified](std::size_t offset, std::size_t n) {
+          ar << offset << n;
+          ar.save_binary(modified + offset, n);
+        });
+      }
+
+      //patches the image in place, it has the size of the modified image
+      template<class Archive>
+      void load_ranges(Archive &ar, char *image, std::size_t size, std::size_t count) {
+        for (std::size_t c = 0; c < count; ++c) {
+          std::size_t offset, n;
+          ar >> offset >> n;
+          if (offset > size || n > size - offset) {
+            throw archive::archive_exception(archive::archive_exception::input_stream_error);
+          }
+          ar.load_binary(image + offset, n);
+        }
+      }
+
     }
 
     template<class UnaryFunction, class T>
@@ -472,6 +654,65 @@ namespace boost {
       return detail::equal_adl(t1, t2);
     }
 
+    template<class Archive, class T>
+    void object_access::save_delta(Archive &ar, T const &original, T const &modified, mpl::false_ empty,
+        mpl::true_ bitwise) {
+      detail::save_ranges(ar, reinterpret_cast<char const *>(&original), sizeof(T),
+          reinterpret_cast<char const *>(&modified), sizeof(T));
+    }
+
+    template<class Archive, class T>
+    void object_access::save_delta(Archive &ar, T const &original, T const &modified, mpl::false_ empty,
+        mpl::false_ bitwise) {
+      typedef detail::embedded_vector<char, 256, true> buffer_type;
+      typedef vector_back_insert_iterator<buffer_type> iterator;
+
+      buffer_type images[2];
+      {
+        iterator it(images[0]);
+        detail::memory_oarchive<iterator> oar(it);
+        object_access::save(oar, original);
+      }
+      {
+        iterator it(images[1]);
+        detail::memory_oarchive<iterator> oar(it);
+        object_access::save(oar, modified);
+      }
+
+      detail::save_ranges(ar, &*images[0].begin(), images[0].size(), &*images[1].begin(), images[1].size());
+    }
+
+    template<class Archive, class T>
+    void object_access::load_delta(Archive &ar, T &t, mpl::false_ empty, mpl::true_ bitwise) {
+      std::size_t size, count;
+      ar >> size >> count;
+      if (size != sizeof(T)) throw archive::archive_exception(archive::archive_exception::input_stream_error);
+
+      detail::load_ranges(ar, reinterpret_cast<char *>(&t), size, count);
+    }
+
+    template<class Archive, class T>
+    void object_access::load_delta(Archive &ar, T &t, mpl::false_ empty, mpl::false_ bitwise) {
+      typedef detail::embedded_vector<char, 256, true> buffer_type;
+
+      //the image of the original is patched and loaded into it
+      buffer_type image;
+      {
+        typedef vector_back_insert_iterator<buffer_type> iterator;
+        iterator it(image);
+        detail::memory_oarchive<iterator> oar(it);
+        object_access::save(oar, t);
+      }
+
+      std::size_t size, count;
+      ar >> size >> count;
+      image.resize(size);
+      detail::load_ranges(ar, &*image.begin(), size, count);
+
+      detail::memory_iarchive<buffer_type::iterator> iar(image.begin(), image.end());
+      object_access::load(iar, t);
+    }
+
   }
 }
 
@@ -0,0 +1,269 @@
+//          Copyright Stefan Strasser 2009 - 2013.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#ifndef BOOST_TRANSACT_OPTIMISTIC_RESOURCE_HPP
+#define BOOST_TRANSACT_OPTIMISTIC_RESOURCE_HPP
+
+#include <atomic>
+#include <set>
+#include <vector>
+#include <utility>
+#include <boost/assert.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/optional/optional.hpp>
+#include <boost/functional/hash.hpp>
+#include <boost/unordered_map.hpp>
+#include <boost/mpl/set.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/locks.hpp>
+#include <atlas/transaction/exception.hpp>
+#include <atlas/transaction/resource_manager.hpp>
+
+namespace boost {
+  namespace transact {
+
+    /*
+     * A model of ResourceManager, a versioned key value map with multi version concurrency control.
+     *
+     * A transaction reads the snapshot of the commit version it begins at, the reads take no lock and never
+     * wait for the writers, since every key keeps the versions it's readers may still see. The writes are
+     * buffered in the transaction and installed at commit, the commits are sequenced by one mutex, a writing
+     * transaction is validated under it, it's aborted with a resource_isolation_exception if a key it read
+     * was changed after it's snapshot, the retry macros of basic_transaction restart it.
+     *
+     * A read-only transaction is never validated and never takes the commit mutex, so the readers, for
+     * example the RPC handlers, never block the writers and never abort. The versions no snapshot can see
+     * are freed by the commits which replace them.
+     *
+     * The keys are never removed, an erased key keeps an empty version, the bucket count is fixed
+     * */
+    template<class Key, class Value, class Hash = boost::hash<Key> >
+    class optimistic_resource : noncopyable {
+
+      typedef unsigned long long version_type;
+
+      struct version {
+        version(version_type number, optional<Value> const &value, version *next) :
+            number(number), value(value), next(next) {
+        }
+        version_type const number;
+        optional<Value> const value; //empty if erased
+        version *next; //the older one
+      };
+
+      struct node {
+        node(Key const &key, node *next) :
+            key(key), head(0), next(next) {
+        }
+        Key const key;
+        std::atomic<version *> head;
+        node *const next;
+      };
+
+    public:
+
+      typedef mpl::set0<> services;
+      typedef Key key_type;
+      typedef Value mapped_type;
+
+      class transaction {
+      public:
+
+        // the commit version the transaction reads at
+        version_type snapshot() const {
+          return this->snapshot_;
+        }
+
+        bool read_only() const {
+          return this->writes.empty();
+        }
+
+      private:
+
+        friend class optimistic_resource;
+
+        explicit transaction(version_type snapshot) :
+            snapshot_(snapshot), active(true) {
+        }
+
+        version_type snapshot_;
+        bool active;
+        std::vector<Key> reads;
+        unordered_map<Key, optional<Value>, Hash> writes;
+      };
+
+      explicit optimistic_resource(std::size_t buckets = 1024) :
+          buckets(bucket_count(buckets)), mask(this->buckets.size() - 1), clock(0) {
+        for (std::size_t i = 0; i < this->buckets.size(); ++i) this->buckets[i].store(0, std::memory_order_relaxed);
+      }
+
+      ~optimistic_resource() {
+        for (std::size_t i = 0; i < this->buckets.size(); ++i) {
+          for (node *n = this->buckets[i].load(std::memory_order_relaxed); n;) {
+            free_versions(n->head.load(std::memory_order_relaxed));
+            node *next = n->next;
+            delete n;
+            n = next;
+          }
+        }
+      }
+
+      transaction begin_transaction() {
+        lock_guard<mutex> l(this->snapshots_mutex);
+        version_type const snapshot = this->clock.load(std::memory_order_acquire);
+        this->snapshots.insert(snapshot);
+        return transaction(snapshot);
+      }
+
+      void commit_transaction(transaction &tx) {
+        BOOST_ASSERT(tx.active);
+        if (!tx.writes.empty()) this->install(tx);
+
+        this->end(tx);
+      }
+
+      void rollback_transaction(transaction &tx) {
+        if (tx.active) this->end(tx);
+      }
+
+      // the value of the key in the transaction's snapshot, or written by the transaction
+      optional<Value> get(transaction &tx, Key const &key) {
+        typename unordered_map<Key, optional<Value>, Hash>::const_iterator it = tx.writes.find(key);
+        if (it != tx.writes.end()) return it->second;
+
+        tx.reads.push_back(key);
+
+        node *n = this->find(key);
+        if (!n) return optional<Value>();
+
+        version *v = n->head.load(std::memory_order_acquire);
+        while (v && v->number > tx.snapshot_) v = v->next;
+
+        return v ? v->value : optional<Value>();
+      }
+
+      void put(transaction &tx, Key const &key, Value const &value) {
+        tx.writes[key] = value;
+      }
+
+      void erase(transaction &tx, Key const &key) {
+        tx.writes[key] = optional<Value>();
+      }
+
+      // the last committed version
+      version_type committed() const {
+        return this->clock.load(std::memory_order_acquire);
+      }
+
+    private:
+
+      static std::size_t bucket_count(std::size_t n) {
+        std::size_t count = 1;
+        while (count < n) count <<= 1;
+        return count;
+      }
+
+      // the commit sequencer, validate the reads, install the writes and publish the new version
+      void install(transaction &tx) {
+        lock_guard<mutex> l(this->commit_mutex);
+
+        for (typename std::vector<Key>::const_iterator it = tx.reads.begin(); it != tx.reads.end(); ++it) {
+          node *n = this->find(*it);
+          version *v = n ? n->head.load(std::memory_order_relaxed) : 0;
+          if (v && v->number > tx.snapshot_) {
+            this->end(tx);
+            throw resource_isolation_exception<optimistic_resource>(*this, tx);
+          }
+        }
+
+        version_type const number = this->clock.load(std::memory_order_relaxed) + 1;
+        std::vector<node *> written;
+        written.reserve(tx.writes.size());
+
+        for (typename unordered_map<Key, optional<Value>, Hash>::const_iterator it = tx.writes.begin();
+            it != tx.writes.end(); ++it) {
+          node *n = this->find_or_insert(it->first);
+          n->head.store(new version(number, it->second, n->head.load(std::memory_order_relaxed)),
+              std::memory_order_release);
+          written.push_back(n);
+        }
+
+        //the new versions are visible to the snapshots taken from now on
+        this->clock.store(number, std::memory_order_release);
+
+        version_type oldest = number;
+        {
+          lock_guard<mutex> s(this->snapshots_mutex);
+          if (!this->snapshots.empty()) oldest = *this->snapshots.begin();
+        }
+
+        for (typename std::vector<node *>::const_iterator it = written.begin(); it != written.end(); ++it) {
+          this->prune(*it, oldest);
+        }
+      }
+
+      void end(transaction &tx) {
+        {
+          lock_guard<mutex> l(this->snapshots_mutex);
+          this->snapshots.erase(this->snapshots.find(tx.snapshot_));
+        }
+
+        tx.active = false;
+      }
+
+      // free the versions older than the one the oldest snapshot sees, no reader reaches them.
+      // the commit mutex is held
+      void prune(node *n, version_type oldest) {
+        version *v = n->head.load(std::memory_order_relaxed);
+        while (v && v->number > oldest) v = v->next;
+        if (!v) return;
+
+        free_versions(v->next);
+        v->next = 0;
+      }
+
+      static void free_versions(version *v) {
+        while (v) {
+          version *next = v->next;
+          delete v;
+          v = next;
+        }
+      }
+
+      node *find(Key const &key) const {
+        node *n = this->buckets[Hash()(key) & this->mask].load(std::memory_order_acquire);
+        while (n && !(n->key == key)) n = n->next;
+        return n;
+      }
+
+      // the commit mutex is held, it's the only writer of the buckets
+      node *find_or_insert(Key const &key) {
+        std::atomic<node *> &bucket = this->buckets[Hash()(key) & this->mask];
+
+        node *head = bucket.load(std::memory_order_relaxed);
+        for (node *n = head; n; n = n->next) {
+          if (n->key == key) return n;
+        }
+
+        node *n = new node(key, head);
+        bucket.store(n, std::memory_order_release);
+        return n;
+      }
+
+      std::vector<std::atomic<node *> > buckets;
+      std::size_t const mask;
+
+      std::atomic<version_type> clock;
+      mutex commit_mutex;
+
+      //the snapshots of the active transactions, the oldest one bounds the versions kept
+      mutex snapshots_mutex;
+      std::multiset<version_type> snapshots;
+    };
+
+  } // transact
+} // boost
+
+#endif
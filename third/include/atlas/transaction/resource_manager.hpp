@@ -6,7 +6,7 @@
 #ifndef BOOST_TRANSACT_RESOURCE_MANAGER_HPP
 #define BOOST_TRANSACT_RESOURCE_MANAGER_HPP
 
-#include <boost/transact/default_tag.hpp>
+#include <atlas/transaction/default_tag.hpp>
 #include <boost/mpl/contains.hpp>
 #include <boost/mpl/sequence_tag.hpp>
 #include <boost/mpl/set.hpp>
@@ -19,6 +19,8 @@ namespace boost {
     struct finish_transaction_service_tag {};
     struct nested_transaction_service_tag {};
     struct distributed_transaction_service_tag {};
+    // the resource takes fuzzy checkpoints by void checkpoint(), see basic_transaction_manager::checkpoint()
+    struct checkpoint_service_tag {};
 
     namespace detail {
 
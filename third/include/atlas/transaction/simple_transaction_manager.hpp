@@ -16,11 +16,11 @@
 #include <boost/type_traits/is_same.hpp>
 #include <boost/utility/in_place_factory.hpp>
 #include <boost/optional/optional.hpp>
-#include <boost/transact/exception.hpp>
+#include <atlas/transaction/exception.hpp>
 #include <boost/noncopyable.hpp>
-#include <boost/transact/detail/static_tss.hpp>
-#include <boost/transact/detail/transaction_manager.hpp>
-#include <boost/transact/resource_manager.hpp>
+#include <atlas/transaction/detail/static_tss.hpp>
+#include <atlas/transaction/detail/transaction_manager.hpp>
+#include <atlas/transaction/resource_manager.hpp>
 
 namespace boost {
   namespace transact {
@@ -7,8 +7,8 @@
 #ifndef BOOST_TRANSACT_TRANSACTION_HEADER_HPP
 #define BOOST_TRANSACT_TRANSACTION_HEADER_HPP
 
-#include <boost/transact/basic_transaction.hpp>
-#include <boost/transact/transaction_manager.hpp>
+#include <atlas/transaction/basic_transaction.hpp>
+#include <atlas/transaction/transaction_manager.hpp>
 
 
 namespace boost{
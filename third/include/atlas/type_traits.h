@@ -8,6 +8,7 @@
 #ifndef ATLAS_TYPE_TRAITS_H_
 #define ATLAS_TYPE_TRAITS_H_
 
+#include <cstddef>
 #include <type_traits>
 
 namespace atlas {
@@ -41,6 +42,54 @@ namespace atlas {
       public std::integral_constant<bool, __is_last_parameter_helper<idx, Elements...>::type::value>
   {};
 
+  /*
+   * The indexes of a parameter pack, std::index_sequence is C++14, a tuple is unpacked by expanding them in one
+   * function, std::get<I>(t)..., instead of a recursion a element. The sequence is built by doubling, so it takes
+   * log N instantiations
+   * */
+  template<size_t ... I>
+  struct index_sequence {
+    typedef index_sequence type;
+
+    static constexpr size_t size() { return sizeof...(I); }
+  };
+
+  namespace detail {
+
+    template<typename First, typename Second>
+    struct concat_indexes;
+
+    template<size_t ... I, size_t ... J>
+    struct concat_indexes<index_sequence<I...>, index_sequence<J...>> : index_sequence<I..., (sizeof...(I) + J)...> {};
+
+    template<size_t N>
+    struct make_indexes : concat_indexes<typename make_indexes<N / 2>::type, typename make_indexes<N - N / 2>::type> {};
+
+    template<>
+    struct make_indexes<0> : index_sequence<> {};
+
+    template<>
+    struct make_indexes<1> : index_sequence<0> {};
+
+  } // detail
+
+  template<size_t N>
+  using make_index_sequence = typename detail::make_indexes<N>::type;
+
+  template<typename ... T>
+  using index_sequence_for = make_index_sequence<sizeof...(T)>;
+
+  // the sum of the sizes at compile time, C++11 has no fold expression
+  constexpr size_t sum_sizes() { return 0; }
+
+  template<typename ... Sizes>
+  constexpr size_t sum_sizes(size_t first, Sizes ... rest) { return first + sum_sizes(rest...); }
+
+  constexpr bool all_of() { return true; }
+
+  template<typename ... Conditions>
+  constexpr bool all_of(bool first, Conditions ... rest) { return first && all_of(rest...); }
+
 //  template<typename F, typename ...Args>
 //  struct is_void_call : public std::is_void<std::result_of<F(Args...)>::type>::type {
 //  };
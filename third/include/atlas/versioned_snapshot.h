@@ -0,0 +1,104 @@
+/*
+ * versioned_snapshot.h
+ *
+ *  Created on: Aug 26, 2013
+ *      Author: vincent
+ */
+
+#ifndef ATLAS_VERSIONED_SNAPSHOT_H_
+#define ATLAS_VERSIONED_SNAPSHOT_H_
+
+#include <cstdint>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <utility>
+
+namespace atlas {
+
+  /*
+   * An immutable, versioned snapshot of a value which is read very often and changed rarely,
+   * for example, the cluster membership.
+   *
+   * Writers copy the current value, modify the copy and publish it as a new version, readers are never
+   * blocked by the writers. Every thread caches the latest version it has seen, a read takes no lock
+   * and touches no shared reference count unless a new version has been published since the thread read
+   * last time, in that case the thread takes the lock once to refresh it's cache.
+   *
+   * The thread cache is per Tag and T, so there should be only one instance for each pair,
+   * give each instance a different tag. The cache of a thread is never freed, keep the value small,
+   * and use it in long lived threads, as the thread pools do
+   * */
+  template<typename T, typename Tag = void>
+  class versioned_snapshot {
+  public:
+
+    typedef T value_type;
+    typedef std::shared_ptr<const T> pointer;
+
+  public:
+
+    versioned_snapshot() : _version(1), _current(std::make_shared<const T>()) {}
+
+    versioned_snapshot(const versioned_snapshot&) = delete;
+    versioned_snapshot& operator=(const versioned_snapshot&) = delete;
+
+  public:
+
+    // the returned reference is valid until the calling thread calls get() again
+    const pointer& get() const {
+      cache*& c = local();
+      if (!c) c = new cache;
+
+      uint64_t v = _version.load(std::memory_order_acquire);
+      if (c->version != v) {
+        std::lock_guard<std::mutex> guard(_mutex);
+
+        c->value = _current;
+        c->version = _version.load(std::memory_order_relaxed);
+      }
+
+      return c->value;
+    }
+
+    uint64_t version() const { return _version.load(std::memory_order_acquire); }
+
+    // f modifies a copy of the current value, which becomes the next version, return the new version
+    template<typename F>
+    uint64_t update(F f) {
+      std::lock_guard<std::mutex> guard(_mutex);
+
+      std::shared_ptr<T> next = std::make_shared<T>(*_current);
+      f(*next);
+
+      _current = std::move(next);
+      return _version.fetch_add(1, std::memory_order_release) + 1;
+    }
+
+  private:
+
+    struct cache {
+      cache() : version(0) {}
+
+      uint64_t version;
+      pointer value;
+    };
+
+    static cache*& local() {
+      // gcc 4.7 does not support thread_local, so we keep a pointer in __thread storage
+      static __thread cache* c = nullptr;
+      return c;
+    }
+
+  private:
+
+    std::atomic<uint64_t> _version;
+
+    // guards _current, readers take it only when their cache is out of date
+    mutable std::mutex _mutex;
+    pointer _current;
+  };
+
+} // atlas
+
+#endif /* ATLAS_VERSIONED_SNAPSHOT_H_ */
@@ -60,6 +60,14 @@ class EventLoop : boost::noncopyable
 
   int64_t iteration() const { return iteration_; }
 
+  /// The functors queued by runInLoop and queueInLoop, not run yet.
+  /// Safe to call from other threads.
+  size_t queueSize() const
+  {
+    MutexLockGuard lock(mutex_);
+    return pendingFunctors_.size();
+  }
+
   /// Runs callback immediately in the loop thread.
   /// It wakes up the loop, and run the cb.
   /// If in the same loop thread, cb is run within the function.
@@ -136,7 +144,7 @@ class EventLoop : boost::noncopyable
   boost::scoped_ptr<Channel> wakeupChannel_;
   ChannelList activeChannels_;
   Channel* currentActiveChannel_;
-  MutexLock mutex_;
+  mutable MutexLock mutex_;
   std::vector<Functor> pendingFunctors_; // @BuardedBy mutex_
 };
 
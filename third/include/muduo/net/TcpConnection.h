@@ -16,10 +16,14 @@
 #include <muduo/base/Types.h>
 #include <muduo/net/Callbacks.h>
 #include <muduo/net/Buffer.h>
+#include <muduo/net/EventLoop.h>
 #include <muduo/net/InetAddress.h>
 
+#include <string>
+
 #include <boost/any.hpp>
 #include <boost/enable_shared_from_this.hpp>
+#include <boost/make_shared.hpp>
 #include <boost/noncopyable.hpp>
 #include <boost/scoped_ptr.hpp>
 #include <boost/shared_ptr.hpp>
@@ -60,13 +64,43 @@ namespace muduo {
         return state_ == kConnected;
       }
 
-      // void send(string&& message); // C++11
+      // C++11, off the loop thread the message is moved into the functor instead of copied,
+      // the output buffer copies it only if the socket does not take all of it at once
+      void send(std::string&& message) {
+        if (state_ != kConnected) return;
+
+        if (loop_->isInLoopThread()) {
+          sendInLoop(message.data(), message.size());
+          return;
+        }
+
+        boost::shared_ptr<std::string> moved(boost::make_shared<std::string>());
+        moved->swap(message);
+        boost::shared_ptr<TcpConnection> self(shared_from_this());
+        loop_->runInLoop([self, moved]() { self->sendInLoop(moved->data(), moved->size()); });
+      }
       void send(const void* message, size_t len);
       void send(const StringPiece& message);
-      // void send(Buffer&& message); // C++11
+      // C++11, the readable bytes are moved as above, the buffer is empty after
+      void send(Buffer&& message) {
+        if (state_ != kConnected) return;
+
+        if (loop_->isInLoopThread()) {
+          sendInLoop(message.peek(), message.readableBytes());
+          message.retrieveAll();
+          return;
+        }
+
+        boost::shared_ptr<Buffer> moved(boost::make_shared<Buffer>());
+        moved->swap(message);
+        boost::shared_ptr<TcpConnection> self(shared_from_this());
+        loop_->runInLoop([self, moved]() { self->sendInLoop(moved->peek(), moved->readableBytes()); });
+      }
       void send(Buffer* message); // this one will swap data
       void shutdown(); // NOT thread safe, no simultaneous calling
       void setTcpNoDelay(bool on);
+      // the socket, for the options not set by muduo, see pioneer::net::socket_profile
+      int fd() const;
 
       void setContext(const boost::any& context) {
         context_ = context;
@@ -101,6 +135,10 @@ namespace muduo {
         return &inputBuffer_;
       }
 
+      Buffer* outputBuffer() {
+        return &outputBuffer_;
+      }
+
       /// Internal use only.
       void setCloseCallback(const CloseCallback& cb) {
         closeCallback_ = cb;
@@ -152,4 +190,11 @@ namespace muduo {
   } // net
 } // muduo
 
+// inline, the prebuilt library is not changed
+#include <muduo/net/Socket.h>
+
+inline int muduo::net::TcpConnection::fd() const {
+  return socket_->fd();
+}
+
 #endif  // MUDUO_NET_TCPCONNECTION_H